@@ -39,9 +39,9 @@ local modules = {
 
 	-- libraries:
 	--   CuikC frontend
-	cuik   = { srcs={"libCuik/lib/libcuik.c", "libCuik/lib/toolchains/msvc.c", "libCuik/lib/toolchains/gnu.c", "libCuik/lib/toolchains/darwin.c"}, flags="-I libCuik/include", deps={"common"} },
+	cuik   = { srcs={"libCuik/lib/libcuik.c", "libCuik/lib/toolchains/msvc.c", "libCuik/lib/toolchains/gnu.c", "libCuik/lib/toolchains/darwin.c", "libCuik/lib/toolchains/wasm.c"}, flags="-I libCuik/include", deps={"common"} },
 	--   TildeBackend
-	tb     = { srcs={"tb/src/libtb.c", "tb/src/x64/x64.c"}, flags="-I tb/include -DCUIK_USE_TB", deps={"common"} },
+	tb     = { srcs={"tb/src/libtb.c", "tb/src/x64/x64.c", "tb/src/aarch64/aarch64.c", "tb/src/wasm/wasm.c"}, flags="-I tb/include -DCUIK_USE_TB", deps={"common"} },
 
 	-- executables:
 	--   Cuik command line
@@ -205,8 +205,11 @@ function command(out, input, cmd, extra_input)
 	ninja:write("  cmd = "..cmd:gsub("$in", input):gsub("$out", out).."\n")
 end
 
-function filename(file)
-	return file:match("^.+/(.+)%..+")
+-- objects are named after the whole path so that sources with the same
+-- name in different directories (toolchains/wasm.c, tb/src/wasm/wasm.c)
+-- don't end up as the same output
+function objname(file)
+	return (file:gsub("%.[^./\\]*$", ""):gsub("[/\\]", "_"))
 end
 
 ninja:write("cflags = "..cflags.."\n")
@@ -260,9 +263,9 @@ src[#src + 1] = "bin/objs/freestanding.c"
 -- normal C files
 local objs = {}
 for i, f in ipairs(src) do
-	local out = "bin/objs/"..filename(f)..".o"
+	local out = "bin/objs/"..objname(f)..".o"
 	ninja:write("build "..out..": cc "..f)
-	if out == "bin/objs/libcuik.o" then
+	if f == "libCuik/lib/libcuik.c" then
 		ninja:write(" | libCuik/lib/preproc/keywords.h libCuik/lib/preproc/dfa.h\n")
 	else
 		ninja:write("\n")
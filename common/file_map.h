@@ -43,6 +43,79 @@ static FileMap open_file_map(const char* filepath) {
     };
 }
 
+// makes (or truncates) the file to be exactly size bytes and maps it writable,
+// the contents start zeroed.
+static FileMap create_file_map(const char* filepath, size_t size) {
+    HANDLE file = CreateFileA(filepath, GENERIC_READ | GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+    if (file == INVALID_HANDLE_VALUE) {
+        return (FileMap){ INVALID_HANDLE_VALUE };
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, (DWORD) ((uint64_t) size >> 32), (DWORD) size, 0);
+    if (!mapping) {
+        fprintf(stderr, "Could not map file! %s", filepath);
+        CloseHandle(file);
+        return (FileMap){ INVALID_HANDLE_VALUE };
+    }
+
+    void* memory = MapViewOfFileEx(mapping, FILE_MAP_WRITE, 0, 0, size, 0);
+    if (!memory) {
+        fprintf(stderr, "Could not view mapped file! %s", filepath);
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return (FileMap){ INVALID_HANDLE_VALUE };
+    }
+
+    return (FileMap){
+        .file = file,
+        .mapping = mapping,
+        .size = size,
+        .data = memory
+    };
+}
+
+// maps an existing file writable, the size and contents stay as they are.
+static FileMap open_file_map_rw(const char* filepath) {
+    HANDLE file = CreateFileA(filepath, GENERIC_READ | GENERIC_WRITE, 0, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (file == INVALID_HANDLE_VALUE) {
+        return (FileMap){ INVALID_HANDLE_VALUE };
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+        CloseHandle(file);
+        return (FileMap){ INVALID_HANDLE_VALUE };
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, 0, 0, 0);
+    if (!mapping) {
+        CloseHandle(file);
+        return (FileMap){ INVALID_HANDLE_VALUE };
+    }
+
+    void* memory = MapViewOfFileEx(mapping, FILE_MAP_WRITE, 0, 0, 0, 0);
+    if (!memory) {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return (FileMap){ INVALID_HANDLE_VALUE };
+    }
+
+    return (FileMap){
+        .file = file,
+        .mapping = mapping,
+        .size = size.QuadPart,
+        .data = memory
+    };
+}
+
+// asks the OS to start reading the pages in, doesn't wait for them.
+static void prefetch_file_map(FileMap* file_map) {
+    #if _WIN32_WINNT >= 0x0602
+    WIN32_MEMORY_RANGE_ENTRY range = { file_map->data, file_map->size };
+    PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+    #endif
+}
+
 static void close_file_map(FileMap* file_map) {
     UnmapViewOfFile(file_map->data);
     CloseHandle(file_map->mapping);
@@ -76,6 +149,55 @@ static FileMap open_file_map(const char* filepath) {
     return (FileMap){ fd, file_stats.st_size, buffer };
 }
 
+// makes (or truncates) the file to be exactly size bytes and maps it writable,
+// the contents start zeroed.
+static FileMap create_file_map(const char* filepath, size_t size) {
+    int fd = open(filepath, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        return (FileMap){ 0 };
+    }
+
+    if (ftruncate(fd, size) != 0) {
+        close(fd);
+        return (FileMap){ 0 };
+    }
+
+    void* buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (buffer == MAP_FAILED) {
+        close(fd);
+        return (FileMap){ 0 };
+    }
+
+    return (FileMap){ fd, size, buffer };
+}
+
+// maps an existing file writable, the size and contents stay as they are.
+static FileMap open_file_map_rw(const char* filepath) {
+    int fd = open(filepath, O_RDWR);
+    if (fd < 0) {
+        return (FileMap){ 0 };
+    }
+
+    struct stat file_stats;
+    if (fstat(fd, &file_stats) == -1 || file_stats.st_size == 0) {
+        close(fd);
+        return (FileMap){ 0 };
+    }
+
+    void* buffer = mmap(NULL, file_stats.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (buffer == MAP_FAILED) {
+        close(fd);
+        return (FileMap){ 0 };
+    }
+
+    return (FileMap){ fd, file_stats.st_size, buffer };
+}
+
+// asks the OS to start reading the pages in, doesn't wait for them.
+static void prefetch_file_map(FileMap* file_map) {
+    madvise(file_map->data, file_map->size, MADV_WILLNEED);
+}
+
 static void close_file_map(FileMap* file_map) {
     munmap(file_map->data, file_map->size);
     close(file_map->fd);
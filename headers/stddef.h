@@ -10,12 +10,19 @@
 #endif
 
 // 7.19 Common definitions <stddef.h>
+#ifdef _CUIK_TARGET_32BIT_
+typedef int                ptrdiff_t;
+typedef unsigned int       size_t;
+typedef int                intptr_t;
+typedef unsigned int       uintptr_t;
+#else
 typedef long long          ptrdiff_t;
 typedef unsigned long long size_t;
-typedef long double        max_align_t;
-
 typedef long long          intptr_t;
 typedef unsigned long long uintptr_t;
+#endif
+
+typedef long double        max_align_t;
 
 #ifdef _WIN32
 typedef unsigned short wchar_t;
@@ -704,10 +704,10 @@ struct Subexpr {
 //   using a postfix notation. Instead of using pointers to refer to inputs
 //   it's implicit to this position in the expression stream.
 //
-//     1 x y * +                     +
-//                                  / \
-//                    versus       1   *
-//                                    / \
+//                                   +
+//     1 x y * +      versus        / \   <- a tree with pointers
+//                                 1   *
+//                                    / \  to each input
 //                                   x   y
 //
 // # CAST TYPE
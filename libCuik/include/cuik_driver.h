@@ -33,6 +33,13 @@ struct Cuik_DriverArgs {
     const char* output_name;
     const char* entrypoint;
 
+    // profile guided optimization (NULL if unused)
+    const char* profile_generate;
+    const char* profile_use;
+
+    // CPU feature level (e.g. "native" or "x86-64-v3"), NULL is the baseline arch
+    const char* march;
+
     void* diag_userdata;
     Cuik_DiagCallback diag_callback;
 
@@ -60,6 +67,10 @@ struct Cuik_DriverArgs {
     bool preprocess      : 1;
     bool think           : 1;
     bool based           : 1;
+    bool icf             : 1;
+    bool print_gc        : 1;
+    bool incremental     : 1;
+    bool lto             : 1;
     bool preserve_ast    : 1;
 };
 
@@ -104,6 +115,7 @@ CUIK_API void cuik_apply_tb_toolchain_libs(TB_Linker* l);
 CUIK_API Cuik_Toolchain cuik_toolchain_msvc(void);
 CUIK_API Cuik_Toolchain cuik_toolchain_darwin(void);
 CUIK_API Cuik_Toolchain cuik_toolchain_gnu(void);
+CUIK_API Cuik_Toolchain cuik_toolchain_wasm(void);
 
 CUIK_API Cuik_Toolchain cuik_toolchain_host(void);
 CUIK_API void cuik_toolchain_free(Cuik_Toolchain* toolchain);
@@ -113,11 +125,16 @@ CUIK_API void cuik_toolchain_free(Cuik_Toolchain* toolchain);
 ////////////////////////////////////////////
 // This is a wrapper over the system linker, eventually TB will be capable of
 // this job but until then...
+typedef struct Cuik_LibraryIndex Cuik_LibraryIndex;
+
 struct Cuik_Linker {
     Cuik_Toolchain toolchain;
 
     DynArray(char*) inputs;
     DynArray(char*) libpaths;
+
+    // NULL until cuiklink_index_libraries
+    Cuik_LibraryIndex* index;
 };
 
 // True if success
@@ -134,6 +151,11 @@ CUIK_API void cuiklink_add_libpathf(Cuik_Linker* l, const char* fmt, ...);
 // This can be a static library or object file
 CUIK_API void cuiklink_add_input_file(Cuik_Linker* l, const char* filepath);
 
+// Lists every libpath directory once, after this cuiklink_find_library is a
+// hash lookup for plain file names. Don't add libpaths past this point, the
+// index is read-only afterwards so searches can happen from any thread.
+CUIK_API void cuiklink_index_libraries(Cuik_Linker* l);
+
 CUIK_API bool cuiklink_find_library(Cuik_Linker* l, char output[FILENAME_MAX], const char* filepath);
 
 // return true if it succeeds
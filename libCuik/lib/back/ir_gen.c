@@ -9,6 +9,7 @@ static thread_local Cuik_Type* function_type;
 static thread_local const char* function_name;
 
 static thread_local TB_PassingRule func_return_rule;
+static thread_local TB_DebugType* func_return_dbg;
 
 static _Thread_local TB_Node* current_scope;
 
@@ -272,6 +273,27 @@ static TB_Node* cast_reg(TB_Function* func, TB_Node* reg, const Cuik_Type* src,
     return reg;
 }
 
+// strict aliasing: objects are only accessed through their own type (sign
+// doesn't matter) or a character type, TB assumes different non-zero alias
+// classes never overlap.
+static int alias_class(Cuik_Type* t) {
+    switch (t->kind) {
+        case KIND_SHORT:
+        case KIND_INT:
+        case KIND_ENUM:
+        case KIND_LONG:
+        case KIND_LLONG:
+        return t->size;
+
+        case KIND_FLOAT:  return 16;
+        case KIND_DOUBLE: return 17;
+        case KIND_PTR:    return 18;
+
+        // chars, bools and aggregates may touch anything
+        default: return 0;
+    }
+}
+
 static TB_Node* cvt2rval(TranslationUnit* tu, TB_Function* func, IRVal* v) {
     Cuik_Type* dst = cuik_canonical_type(v->cast_type);
     Cuik_Type* src = cuik_canonical_type(v->type);
@@ -311,6 +333,7 @@ static TB_Node* cvt2rval(TranslationUnit* tu, TB_Function* func, IRVal* v) {
             } else {
                 TB_DataType dt = ctype_to_tbtype(src);
                 reg = tb_inst_load(func, dt, v->reg, src->align, is_volatile);
+                tb_inst_set_alias_class(func, reg, alias_class(src));
             }
             break;
         }
@@ -357,7 +380,55 @@ TB_Node* cvt2lval(TranslationUnit* tu, TB_Function* func, IRVal* v) {
     }
 }
 
-static int pass_parameter(TranslationUnit* tu, TB_Function* func, TB_PassingRule rule, IRVal arg, bool is_vararg, TB_Node** out_param) {
+static int piece_size(TB_DataType dt) {
+    return dt.type == TB_FLOAT ? (dt.data == TB_FLT_64 ? 8 : 4) : (dt.data + 7) / 8;
+}
+
+// aggregates in registers get split into the pieces the ABI asks for (register
+// pairs, HFAs...), the pieces can cover more bytes than the type does (a 12 byte
+// struct is two 8 byte registers) so we don't wanna read past the end of it.
+static int load_pieces(TB_Function* func, TB_Node* addr, Cuik_Type* type, int piece_count, const TB_DataType* pieces, TB_Node** out) {
+    int total = 0;
+    for (int i = 0; i < piece_count; i++) total += piece_size(pieces[i]);
+
+    if (total > type->size) {
+        TB_Node* temp = tb_inst_local(func, total, type->align);
+        tb_inst_memcpy(func, temp, addr, tb_inst_uint(func, TB_TYPE_I64, type->size), type->align);
+        addr = temp;
+    }
+
+    int offset = 0;
+    for (int i = 0; i < piece_count; i++) {
+        int size = piece_size(pieces[i]);
+        TB_Node* ptr = offset ? tb_inst_member_access(func, addr, offset) : addr;
+
+        out[i] = tb_inst_load(func, pieces[i], ptr, size < type->align ? size : type->align, false);
+        offset += size;
+    }
+
+    return piece_count;
+}
+
+// the inverse, glue the pieces back into a lil temporary
+static TB_Node* store_pieces(TB_Function* func, Cuik_Type* type, int piece_count, TB_Node** values) {
+    int total = 0;
+    for (int i = 0; i < piece_count; i++) total += piece_size(values[i]->dt);
+
+    TB_Node* addr = tb_inst_local(func, total > type->size ? total : type->size, type->align);
+
+    int offset = 0;
+    for (int i = 0; i < piece_count; i++) {
+        int size = piece_size(values[i]->dt);
+        TB_Node* ptr = offset ? tb_inst_member_access(func, addr, offset) : addr;
+
+        tb_inst_store(func, values[i]->dt, ptr, values[i], size < type->align ? size : type->align, false);
+        offset += size;
+    }
+
+    return addr;
+}
+
+static int pass_parameter(TranslationUnit* tu, TB_Function* func, TB_DebugType* dbg, TB_PassingRule rule, IRVal arg, bool is_vararg, TB_Node** out_param) {
     Cuik_Type* arg_type = cuik_canonical_type(arg.type);
     bool is_volatile = CUIK_QUAL_TYPE_HAS(arg.type, CUIK_QUAL_VOLATILE);
 
@@ -408,9 +479,9 @@ static int pass_parameter(TranslationUnit* tu, TB_Function* func, TB_PassingRule
             if (arg_type->kind == KIND_STRUCT || arg_type->kind == KIND_UNION) {
                 TB_Node* addr = cvt2lval(tu, func, &arg);
 
-                TB_DataType dt = TB_TYPE_INTN(arg_type->size*8);
-                out_param[0] = tb_inst_load(func, dt, addr, arg_type->align, false);
-                return 1;
+                TB_DataType pieces[4];
+                int piece_count = tb_get_passing_pieces(tu->ir_mod, dbg, pieces);
+                return load_pieces(func, addr, arg_type, piece_count, pieces, out_param);
             } else {
                 TB_Node* n = cvt2rval(tu, func, &arg);
                 TB_DataType dt = n->dt;
@@ -886,11 +957,15 @@ static IRVal irgen_subexpr(TranslationUnit* tu, TB_Function* func, Cuik_Expr* _,
                 return_rule = tb_get_passing_rule_from_dbg(tu->ir_mod, ret_dbg, true);
             }
 
-            size_t real_arg_count = call_prototype->param_count + (arg_count - varargs_cutoff);
+            // varargs can still get split into pieces so we only know the upper bound
+            size_t max_arg_count = call_prototype->param_count + 4*(arg_count - varargs_cutoff);
             size_t ir_arg_count = 0;
-            TB_Node** ir_args = tls_push(real_arg_count * sizeof(TB_Node*));
+            TB_Node** ir_args = tls_push(max_arg_count * sizeof(TB_Node*));
+
+            TB_Node* return_buffer = NULL;
             if (return_rule == TB_PASSING_INDIRECT) {
-                ir_args[ir_arg_count++] = tb_inst_local(func, return_type->size, return_type->align);
+                return_buffer = tb_inst_local(func, return_type->size, return_type->align);
+                ir_args[ir_arg_count++] = return_buffer;
             }
 
             size_t dbg_param_count = tb_debug_func_param_count(dbg);
@@ -904,38 +979,36 @@ static IRVal irgen_subexpr(TranslationUnit* tu, TB_Function* func, Cuik_Expr* _,
                 }
 
                 TB_PassingRule rule = tb_get_passing_rule_from_dbg(tu->ir_mod, t, false);
-                ir_arg_count += pass_parameter(tu, func, rule, args[i + 1], i >= varargs_cutoff, &ir_args[ir_arg_count]);
+                ir_arg_count += pass_parameter(tu, func, t, rule, args[i + 1], i >= varargs_cutoff, &ir_args[ir_arg_count]);
             }
-            assert(ir_arg_count == real_arg_count);
+            assert(ir_arg_count <= max_arg_count);
+            assert(varargs_cutoff < arg_count || ir_arg_count == call_prototype->param_count);
 
-            TB_MultiOutput out = tb_inst_call(func, call_prototype, target_node, real_arg_count, ir_args);
+            TB_MultiOutput out = tb_inst_call(func, call_prototype, target_node, ir_arg_count, ir_args);
             tls_restore(ir_args);
 
-            if (out.count == 0) {
+            if (return_rule == TB_PASSING_INDIRECT) {
+                // the callee might hand the pointer back but on some ABIs (AAPCS64) it
+                // doesn't have to, we own the buffer anyways.
                 return (IRVal){
-                    .value_type = RVALUE,
-                    .reg = NULL,
+                    .value_type = LVALUE,
+                    .reg = return_buffer,
                 };
-            } else if (return_rule == TB_PASSING_INDIRECT) {
+            } else if (out.count == 0) {
                 return (IRVal){
-                    .value_type = LVALUE,
-                    .reg = out.single,
+                    .value_type = RVALUE,
+                    .reg = NULL,
                 };
-            } else if (out.count > 1) {
-                assert(0 && "TODO: multiple return ABI stuff");
             } else {
                 TB_Node* ret = out.single;
 
                 if (return_type->kind == KIND_STRUCT || return_type->kind == KIND_UNION) {
-                    // spawn a lil temporary
-                    TB_Node* addr = tb_inst_local(func, return_type->size, return_type->align);
-                    tb_inst_store(func, ret->dt, addr, ret, return_type->align, false);
-
                     return (IRVal){
                         .value_type = LVALUE,
-                        .reg = addr,
+                        .reg = store_pieces(func, return_type, out.count, TB_MULTI_OUTPUT(out)),
                     };
                 } else {
+                    assert(out.count == 1);
                     return (IRVal){
                         .value_type = RVALUE,
                         .reg = ret,
@@ -1404,7 +1477,8 @@ static IRVal irgen_subexpr(TranslationUnit* tu, TB_Function* func, Cuik_Expr* _,
                     }
 
                     assert(lhs.value_type == LVALUE);
-                    tb_inst_store(func, dt, lhs.reg, data, type->align, is_volatile);
+                    TB_Node* st = tb_inst_store(func, dt, lhs.reg, data, type->align, is_volatile);
+                    tb_inst_set_alias_class(func, st, alias_class(type));
                 } else {
                     TB_Node* r = cvt2rval(tu, func, &rhs);
                     TB_ArithmeticBehavior ab = type->is_unsigned ? 0 : TB_ARITHMATIC_NSW;
@@ -1447,7 +1521,10 @@ static IRVal irgen_subexpr(TranslationUnit* tu, TB_Function* func, Cuik_Expr* _,
                         assert(lhs.value_type == LVALUE);
                     }
 
-                    tb_inst_store(func, dt, lhs.reg, data, type->align, is_volatile);
+                    TB_Node* st = tb_inst_store(func, dt, lhs.reg, data, type->align, is_volatile);
+                    if (lhs.value_type == LVALUE) {
+                        tb_inst_set_alias_class(func, st, alias_class(type));
+                    }
 
                     if (e->op == EXPR_ASSIGN) {
                         assert(data);
@@ -1717,10 +1794,13 @@ static void irgen_stmt(TranslationUnit* tu, TB_Function* func, Stmt* restrict s)
                     if (type->kind == KIND_ARRAY) {
                         r = v.reg;
                     } else if (type->kind == KIND_STRUCT || type->kind == KIND_UNION) {
-                        assert(type->size <= 8);
-                        TB_DataType dt = { { TB_INT, type->size * 8 } };
+                        TB_DataType pieces[4];
+                        TB_Node* values[4];
 
-                        r = tb_inst_load(func, dt, v.reg, type->align, false);
+                        int piece_count = tb_get_passing_pieces(tu->ir_mod, func_return_dbg, pieces);
+                        load_pieces(func, v.reg, type, piece_count, pieces, values);
+                        tb_inst_ret(func, piece_count, values);
+                        break;
                     }
                 }
 
@@ -1977,12 +2057,26 @@ TB_Symbol* cuikcg_top_level(TranslationUnit* restrict tu, TB_Module* m, TB_Arena
         parameter_map = tb_function_set_prototype_from_dbg(func, section, dbg_type, arena, &param_count);
 
         if (cuik_canonical_type(type->func.return_type)->kind != KIND_VOID) {
-            TB_DebugType* dbg_ret = tb_debug_func_returns(dbg_type)[0];
-            func_return_rule = tb_get_passing_rule_from_dbg(tu->ir_mod, dbg_ret, true);
+            func_return_dbg = tb_debug_func_returns(dbg_type)[0];
+            func_return_rule = tb_get_passing_rule_from_dbg(tu->ir_mod, func_return_dbg, true);
         } else {
+            func_return_dbg = NULL;
             func_return_rule = TB_PASSING_DIRECT;
         }
 
+        // restrict pointers don't alias with anything else, aggregates might've
+        // been split across a few TB params so we need to count those.
+        int param_base = func_return_rule == TB_PASSING_INDIRECT ? 1 : 0;
+        for (size_t i = 0; i < type->func.param_count; i++) {
+            Cuik_QualType param_type = type->func.param_list[i].type;
+            if (CUIK_QUAL_TYPE_HAS(param_type, CUIK_QUAL_RESTRICT) && cuik_canonical_type(param_type)->kind == KIND_PTR) {
+                tb_function_set_noalias(func, param_base);
+            }
+
+            TB_DataType pieces[4];
+            param_base += tb_get_passing_pieces(m, tb_debug_field_type(dbg_params[i]), pieces);
+        }
+
         // mark where the return site is
         if (tu->has_tb_debug_info) {
             SourceLoc loc = s->decl.initial_as_stmt->loc.end;
@@ -1993,6 +2087,18 @@ TB_Symbol* cuikcg_top_level(TranslationUnit* restrict tu, TB_Module* m, TB_Arena
             }
         }
 
+        // instrumented builds dump their counters on exit
+        TB_Function* prof_dumper = tb_module_get_profile_dumper(m);
+        if (prof_dumper != NULL && strcmp(s->decl.name, "main") == 0) {
+            TB_PrototypeParam param = { TB_TYPE_PTR };
+            TB_PrototypeParam ret = { TB_TYPE_I32 };
+            TB_FunctionPrototype* proto = tb_prototype_create(m, TB_CDECL, 1, &param, 1, &ret, false);
+
+            TB_Node* target = tb_inst_get_symbol_address(func, get_external(tu->parent, "atexit"));
+            TB_Node* dumper = tb_inst_get_symbol_address(func, (TB_Symbol*) prof_dumper);
+            tb_inst_call(func, proto, target, 1, &dumper);
+        }
+
         // compile body
         {
             function_type = type;
@@ -4,9 +4,26 @@
 #ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#else
+#include <dirent.h>
 #endif
 
+struct Cuik_LibraryIndex {
+    // file name -> full path, the first libpath to have a name wins
+    NL_Strmap(char*) files;
+};
+
 void cuiklink_deinit(Cuik_Linker* l) {
+    if (l->index != NULL) {
+        nl_map_for_str(i, l->index->files) {
+            cuik_free((void*) l->index->files[i].k.data);
+            cuik_free(l->index->files[i].v);
+        }
+        nl_map_free(l->index->files);
+        cuik_free(l->index);
+        l->index = NULL;
+    }
+
     dyn_array_destroy(l->inputs);
     dyn_array_destroy(l->libpaths);
 }
@@ -41,7 +58,99 @@ void cuiklink_add_input_file(Cuik_Linker* l, const char* filepath) {
     dyn_array_put(l->inputs, cuik_strdup(filepath));
 }
 
+static void index_library_file(Cuik_LibraryIndex* index, const char* dir, const char* name) {
+    char* key = cuik_strdup(name);
+    #ifdef _WIN32
+    // windows paths are case insensitive
+    for (char* s = key; *s; s++) {
+        if (*s >= 'A' && *s <= 'Z') *s += 'a' - 'A';
+    }
+    #endif
+
+    if (nl_map_get_cstr(index->files, key) >= 0) {
+        cuik_free(key);
+        return;
+    }
+
+    char* path = cuik_malloc(FILENAME_MAX);
+    snprintf(path, FILENAME_MAX, "%s%s%s", dir, dir[0] && dir[strlen(dir) - 1] != '/' ? "/" : "", name);
+    nl_map_put_cstr(index->files, key, path);
+}
+
+void cuiklink_index_libraries(Cuik_Linker* l) {
+    if (l->index != NULL) {
+        return;
+    }
+
+    Cuik_LibraryIndex* index = cuik_calloc(1, sizeof(Cuik_LibraryIndex));
+    dyn_array_for(i, l->libpaths) {
+        const char* lp = l->libpaths[i];
+
+        #ifdef _WIN32
+        char pattern[FILENAME_MAX];
+        snprintf(pattern, FILENAME_MAX, "%s%s*", lp, lp[0] && lp[strlen(lp) - 1] != '/' ? "/" : "");
+
+        WIN32_FIND_DATAA find_data;
+        HANDLE find_handle = FindFirstFileA(pattern, &find_data);
+        if (find_handle == INVALID_HANDLE_VALUE) {
+            continue;
+        }
+
+        do {
+            if ((find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0) {
+                index_library_file(index, lp, find_data.cFileName);
+            }
+        } while (FindNextFileA(find_handle, &find_data));
+        FindClose(find_handle);
+        #else
+        DIR* dir = opendir(lp);
+        if (dir == NULL) {
+            continue;
+        }
+
+        struct dirent* e;
+        while ((e = readdir(dir)) != NULL) {
+            if (e->d_type != DT_DIR) {
+                index_library_file(index, lp, e->d_name);
+            }
+        }
+        closedir(dir);
+        #endif
+    }
+
+    l->index = index;
+}
+
 bool cuiklink_find_library(Cuik_Linker* l, char output[FILENAME_MAX], const char* filepath) {
+    // paths with a directory in them (inputs from the command line are made
+    // absolute) are used as is, bare names only ever come from the libpaths
+    // so a file with the same name in the CWD can't shadow them.
+    bool has_dir = strchr(filepath, '/') != NULL || strchr(filepath, '\\') != NULL;
+    if (has_dir) {
+        FILE* f = fopen(filepath, "rb");
+        if (f) {
+            fclose(f);
+            snprintf(output, FILENAME_MAX, "%s", filepath);
+            return true;
+        }
+    } else if (l->index != NULL) {
+        char key[FILENAME_MAX];
+        snprintf(key, FILENAME_MAX, "%s", filepath);
+        #ifdef _WIN32
+        for (char* s = key; *s; s++) {
+            if (*s >= 'A' && *s <= 'Z') *s += 'a' - 'A';
+        }
+        #endif
+
+        ptrdiff_t search = nl_map_get_cstr(l->index->files, key);
+        if (search < 0) {
+            return false;
+        }
+
+        snprintf(output, FILENAME_MAX, "%s", l->index->files[search].v);
+        return true;
+    }
+
     dyn_array_for(i, l->libpaths) {
         const char* lp = l->libpaths[i];
         snprintf(output, FILENAME_MAX, "%s%s%s", lp, lp[strlen(lp) - 1] != '/' ? "/" : "", filepath);
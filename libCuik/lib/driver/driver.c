@@ -21,6 +21,12 @@ typedef struct {
     mtx_t* mutex;
 } BuildStepInfo;
 
+// a located & mapped input for the linker, see ld_preload
+typedef struct {
+    char* path; // NULL if it couldn't be found
+    FileMap map;
+} LinkerInputFile;
+
 struct Cuik_BuildStep {
     enum {
         BUILD_STEP_NONE,
@@ -62,6 +68,12 @@ struct Cuik_BuildStep {
         struct {
             Cuik_DriverArgs* args;
             CompilationUnit* cu;
+
+            // filled in by ld_preload, one input file per libs.inputs
+            bool preloading;
+            Futex preload;
+            Cuik_Linker libs;
+            LinkerInputFile* inputs;
         } ld;
 
         struct {
@@ -129,6 +141,44 @@ static Cuik_Linker gimme_linker(Cuik_DriverArgs* restrict args) {
     return l;
 }
 
+#ifdef CUIK_USE_TB
+// true if ld_invoke is gonna hand the inputs to TB's linker
+static bool ld_uses_tb_linker(Cuik_DriverArgs* args) {
+    Cuik_System sys = cuik_get_target_system(args->target);
+    return cuik_driver_does_codegen(args) && args->based && args->flavor != TB_FLAVOR_OBJECT &&
+        (sys == CUIK_SYSTEM_WINDOWS || sys == CUIK_SYSTEM_LINUX);
+}
+
+// locates and maps every linker input, this is submitted before the compile
+// starts so the archives are already paged in by the time ld_invoke wants them.
+static void ld_preload(Cuik_BuildStep** arg) {
+    Cuik_BuildStep* s = *arg;
+
+    CUIK_TIMED_BLOCK("ld_preload") {
+        s->ld.libs = gimme_linker(s->ld.args);
+        cuiklink_index_libraries(&s->ld.libs);
+
+        s->ld.inputs = cuik_calloc(dyn_array_length(s->ld.libs.inputs), sizeof(LinkerInputFile));
+
+        char path[FILENAME_MAX];
+        dyn_array_for(i, s->ld.libs.inputs) {
+            if (!cuiklink_find_library(&s->ld.libs, path, s->ld.libs.inputs[i])) {
+                continue;
+            }
+
+            LinkerInputFile* in = &s->ld.inputs[i];
+            in->path = cuik_strdup(path);
+            in->map  = open_file_map(path);
+            if (in->map.data != NULL) {
+                prefetch_file_map(&in->map);
+            }
+        }
+    }
+
+    futex_dec(&s->ld.preload);
+}
+#endif
+
 static void sys_invoke(BuildStepInfo* info) {
     Cuik_BuildStep* s = info->step;
 
@@ -145,8 +195,14 @@ static void sys_invoke(BuildStepInfo* info) {
 #ifdef CUIK_USE_TB
 static void irgen(Cuik_IThreadpool* restrict thread_pool, Cuik_DriverArgs* restrict args, CompilationUnit* restrict cu, TB_Module* mod);
 
-static void apply_func(TB_Function* f, void* arg) {
-    Cuik_DriverArgs* args = arg;
+// with LTO the functions aren't touched until the link step, that's when
+// we've got every TU in the module and the whole program passes can run.
+// instrumented builds don't bother, the counters are per compiled CFG.
+static bool lto_defers_codegen(const Cuik_DriverArgs* args) {
+    return args->lto && args->profile_generate == NULL && cuik_driver_does_codegen(args);
+}
+
+static void compile_func(TB_Function* f, Cuik_DriverArgs* args) {
     bool print_asm = args->assembly;
 
     CUIK_TIMED_BLOCK("passes") {
@@ -172,6 +228,14 @@ static void apply_func(TB_Function* f, void* arg) {
         tb_pass_exit(p);
     }
 }
+
+static void apply_func(TB_Function* f, void* arg) {
+    // the profile dumper has no body until every counter exists, ld_invoke
+    // compiles it at the very end.
+    if (f != tb_module_get_profile_dumper(((TB_Symbol*) f)->module)) {
+        compile_func(f, arg);
+    }
+}
 #endif
 
 static void cc_invoke(BuildStepInfo* restrict info) {
@@ -275,7 +339,7 @@ static void cc_invoke(BuildStepInfo* restrict info) {
             cuikpp_free(cpp);
         }
 
-        if (args->opt_level > 0 || args->assembly || args->emit_ir || args->emit_dot) {
+        if (!lto_defers_codegen(args) && (args->opt_level > 0 || args->assembly || args->emit_ir || args->emit_dot)) {
             // do parallel function passes
             cuiksched_per_function(s->tp, args->threads, mod, args, apply_func);
         }
@@ -327,9 +391,44 @@ static void ld_invoke(BuildStepInfo* info) {
     TB_DebugFormat debug_fmt = (args->debug_info ? TB_DEBUGFMT_CODEVIEW : TB_DEBUGFMT_NONE);
     Cuik_System sys = cuik_get_target_system(args->target);
 
+    // nothing's been compiled yet, the whole program passes get first dibs
+    if (lto_defers_codegen(args)) {
+        CUIK_TIMED_BLOCK("IPO") {
+            tb_module_ipo(mod);
+        }
+
+        cuiksched_per_function(s->tp, args->threads, mod, args, apply_func);
+    }
+
+    // the profile dumper needs to see every counter so it's compiled last
+    if (args->profile_generate) {
+        TB_Function* dumper = tb_module_finish_instrumentation(mod, args->profile_generate);
+        if (dumper != NULL) {
+            compile_func(dumper, args);
+        }
+    }
+
+    // the export can use the same workers as the backend did (Cuik_IThreadpool
+    // and TB_ThreadPool line up)
+    tb_module_set_thread_pool(mod, (TB_ThreadPool*) s->tp);
+
+    if (args->verbose) {
+        size_t peep_hits, peep_bytes;
+        tb_module_get_peephole_stats(mod, &peep_hits, &peep_bytes);
+
+        mtx_lock(info->mutex);
+        printf("  peepholes: %zu rewrites, %zu bytes saved\n", peep_hits, peep_bytes);
+        if (lto_defers_codegen(args)) {
+            size_t inlined, killed, constants;
+            tb_module_get_ipo_stats(mod, &inlined, &killed, &constants);
+            printf("  lto: %zu calls inlined, %zu dead symbols, %zu read-only globals\n", inlined, killed, constants);
+        }
+        mtx_unlock(info->mutex);
+    }
+
     Cuik_Path output_path;
     if (args->output_name == NULL) {
-        cuik_path_set(&output_path, sys == TB_SYSTEM_WINDOWS ? "a.exe" : "a.out");
+        cuik_path_set(&output_path, sys == TB_SYSTEM_WINDOWS ? "a.exe" : sys == CUIK_SYSTEM_WEB ? "a.wasm" : "a.out");
     } else if (!has_file_ext(args->output_name) && cuik_get_target_system(args->target) == CUIK_SYSTEM_WINDOWS) {
         cuik_path_append2(&output_path, strlen(args->output_name), args->output_name, 4, ".exe");
     } else {
@@ -367,7 +466,18 @@ static void ld_invoke(BuildStepInfo* info) {
     ////////////////////////////////
     // generate object file
     ////////////////////////////////
-    if (args->based && args->flavor != TB_FLAVOR_OBJECT) {
+    if (sys == CUIK_SYSTEM_WEB) {
+        // there's no wasm linker, TB's wasm output is already a complete
+        // module so it just goes straight into the output file.
+        TB_ExportBuffer buffer = tb_module_object_export(mod, debug_fmt);
+        tb_module_destroy(mod);
+
+        if (!tb_export_buffer_to_file(buffer, output_path.data)) {
+            step_error(s);
+            goto done;
+        }
+        tb_export_buffer_free(buffer);
+    } else if (args->based && args->flavor != TB_FLAVOR_OBJECT) {
         TB_ExecutableType exe;
         switch (sys) {
             case CUIK_SYSTEM_WINDOWS: exe = TB_EXECUTABLE_PE;  break;
@@ -379,27 +489,43 @@ static void ld_invoke(BuildStepInfo* info) {
         }
 
         TB_Linker* l = tb_linker_create(exe, args->target->arch);
+        tb_linker_set_thread_pool(l, (TB_ThreadPool*) s->tp);
+        tb_linker_set_icf(l, args->icf);
+        tb_linker_set_print_gc_sections(l, args->print_gc);
+        tb_linker_set_incremental(l, args->incremental);
+
+        // the libraries were usually located and mapped while we were compiling
+        if (s->ld.preloading) {
+            futex_wait_eq(&s->ld.preload, 0);
+        } else {
+            s->ld.preloading = true;
+            s->ld.preload = 1;
+            ld_preload(&s);
+        }
 
-        // locate libraries and feed them into TB... in theory this process
-        // can be somewhat multithreaded so we might wanna consider that.
+        // feed the inputs into TB, the object files get parsed on the thread
+        // pool while we keep going.
         int errors = 0;
-        Cuik_Linker tmp_linker = gimme_linker(args);
-        char path[FILENAME_MAX];
-        dyn_array_for(i, tmp_linker.inputs) {
-            CUIK_TIMED_BLOCK(tmp_linker.inputs[i]) {
-                if (!cuiklink_find_library(&tmp_linker, path, tmp_linker.inputs[i])) {
-                    fprintf(stderr, "could not find library: %s\n", tmp_linker.inputs[i]);
+        Cuik_Linker* tmp_linker = &s->ld.libs;
+        dyn_array_for(i, tmp_linker->inputs) {
+            CUIK_TIMED_BLOCK(tmp_linker->inputs[i]) {
+                const char* path = s->ld.inputs[i].path;
+                if (path == NULL) {
+                    fprintf(stderr, "could not find library: %s\n", tmp_linker->inputs[i]);
                     step_error(s);
                     errors++;
                     goto skip;
                 }
 
-                FileMap fm = open_file_map(path);
-                tb_linker_append_library(
-                    l,
-                    (TB_Slice){ strlen(path), (const uint8_t*) cuik_strdup(path) },
-                    (TB_Slice){ fm.size, fm.data }
-                );
+                FileMap fm = s->ld.inputs[i].map;
+                TB_Slice name = { strlen(path), (const uint8_t*) cuik_strdup(path) };
+
+                // object files are always linked in, archives only as needed
+                if (str_ends_with(path, ".o") || str_ends_with(path, ".obj")) {
+                    tb_linker_append_object(l, name, (TB_Slice){ fm.size, fm.data });
+                } else {
+                    tb_linker_append_library(l, name, (TB_Slice){ fm.size, fm.data });
+                }
             }
 
             skip:;
@@ -407,8 +533,8 @@ static void ld_invoke(BuildStepInfo* info) {
 
         if (errors) {
             fprintf(stderr, "library search paths:\n");
-            dyn_array_for(i, tmp_linker.libpaths) {
-                fprintf(stderr, "  %s\n", tmp_linker.libpaths[i]);
+            dyn_array_for(i, tmp_linker->libpaths) {
+                fprintf(stderr, "  %s\n", tmp_linker->libpaths[i]);
             }
             goto error;
         }
@@ -432,12 +558,38 @@ static void ld_invoke(BuildStepInfo* info) {
             }
         }
 
-        TB_ExportBuffer buffer = tb_linker_export(l);
-        if (!tb_export_buffer_to_file(buffer, output_path.data)) {
+        if (!tb_linker_export_to_file(l, output_path.data)) {
             goto error;
         }
 
-        tb_export_buffer_free(buffer);
+        if (args->verbose && args->icf) {
+            size_t icf_folded, icf_bytes;
+            tb_linker_get_icf_stats(l, &icf_folded, &icf_bytes);
+
+            mtx_lock(info->mutex);
+            printf("  icf: %zu pieces folded, %zu bytes saved\n", icf_folded, icf_bytes);
+            mtx_unlock(info->mutex);
+        }
+
+        if (args->verbose && args->incremental) {
+            size_t patched, total;
+            bool in_place = tb_linker_get_incremental_stats(l, &patched, &total);
+
+            mtx_lock(info->mutex);
+            if (in_place) {
+                printf("  incremental: patched %zu of %zu pieces\n", patched, total);
+            } else {
+                printf("  incremental: full link\n");
+            }
+            mtx_unlock(info->mutex);
+        }
+
+        #ifndef _WIN32
+        chmod(output_path.data, 0755);
+        #endif
+
+        tb_module_destroy(mod);
+        goto done;
 
         error:
         step_error(s);
@@ -508,10 +660,31 @@ Cuik_BuildStep* cuik_driver_ld(Cuik_DriverArgs* args, int dep_count, Cuik_BuildS
     s->ld.args = args;
 
     #ifdef CUIK_USE_TB
+    // JIT'd code only ever runs here so it might as well use everything
+    const char* march = args->march ? args->march : (args->run ? "native" : NULL);
+
     TB_FeatureSet features = { 0 };
+    if (march && !tb_get_named_features(args->target->arch, march, &features)) {
+        fprintf(stderr, "warning: unknown -march: %s (supported: native, x86-64, x86-64-v2, x86-64-v3, x86-64-v4)\n", march);
+    }
+
     s->ld.cu->ir_mod = tb_module_create(
         args->target->arch, (TB_System) cuik_get_target_system(args->target), &features, args->run
     );
+
+    // -O2 is willing to spend more compile time on regalloc & scheduling
+    if (args->opt_level >= 2) {
+        tb_module_set_regalloc(s->ld.cu->ir_mod, TB_REGALLOC_GREEDY);
+        tb_module_set_scheduler(s->ld.cu->ir_mod, TB_SCHEDULER_LIST);
+    }
+
+    if (args->profile_generate) {
+        tb_module_enable_instrumentation(s->ld.cu->ir_mod);
+    } else if (args->profile_use) {
+        if (!tb_module_load_profile(s->ld.cu->ir_mod, args->profile_use)) {
+            fprintf(stderr, "warning: could not load profile: %s\n", args->profile_use);
+        }
+    }
     #endif
 
     for (size_t i = 0; i < dep_count; i++) {
@@ -535,6 +708,15 @@ static void step_submit(Cuik_BuildStep* s, Cuik_IThreadpool* tp, mtx_t* mutex, b
     s->visited = true;
     s->tp = tp;
 
+    #ifdef CUIK_USE_TB
+    // start finding & mapping the libraries while the compile is still going
+    if (s->tag == BUILD_STEP_LD && tp != NULL && ld_uses_tb_linker(s->ld.args)) {
+        s->ld.preloading = true;
+        s->ld.preload = 1;
+        CUIK_CALL(tp, submit, (Cuik_TaskFn) ld_preload, sizeof(s), &s);
+    }
+    #endif
+
     // submit dependencies
     size_t dep_count = s->dep_count;
     if (dep_count > 0) {
@@ -582,6 +764,16 @@ void cuik_step_free(Cuik_BuildStep* s) {
 
     if (s->tag == BUILD_STEP_SYS) {
         cuik_free(s->sys.data);
+    } else if (s->tag == BUILD_STEP_LD && s->ld.preloading) {
+        // the preload might still be running if the compile failed
+        futex_wait_eq(&s->ld.preload, 0);
+
+        // the mappings stay around, TB's linker doesn't copy the inputs
+        dyn_array_for(i, s->ld.libs.inputs) {
+            cuik_free(s->ld.inputs[i].path);
+        }
+        cuik_free(s->ld.inputs);
+        cuiklink_deinit(&s->ld.libs);
     }
 
     cuik_free(s);
@@ -759,7 +951,7 @@ static void irgen_job(void* arg) {
 
     // unoptimized builds can just compile functions without
     // the rest of the functions being ready.
-    bool do_compiles_immediately = task.args->opt_level == 0 && !task.args->emit_ir && !task.args->assembly;
+    bool do_compiles_immediately = task.args->opt_level == 0 && !task.args->emit_ir && !task.args->assembly && !lto_defers_codegen(task.args);
     TB_Arena* allocator = get_ir_arena();
 
     for (size_t i = 0; i < task.count; i++) {
@@ -38,6 +38,8 @@ static TargetOption target_options[] = {
     { "x64_windows_msvc",         cuik_target_x64,       CUIK_SYSTEM_WINDOWS,     CUIK_ENV_MSVC, cuik_toolchain_msvc   },
     { "x64_macos_gnu",            cuik_target_x64,       CUIK_SYSTEM_MACOS,       CUIK_ENV_GNU,  cuik_toolchain_darwin },
     { "x64_linux_gnu",            cuik_target_x64,       CUIK_SYSTEM_LINUX,       CUIK_ENV_GNU,  cuik_toolchain_gnu    },
+    { "aarch64_linux_gnu",        cuik_target_aarch64,   CUIK_SYSTEM_LINUX,       CUIK_ENV_GNU,  cuik_toolchain_gnu    },
+    { "wasm32",                   cuik_target_wasm,      CUIK_SYSTEM_WEB,         CUIK_ENV_GNU,  cuik_toolchain_wasm   },
 };
 enum { TARGET_OPTION_COUNT = sizeof(target_options) / sizeof(target_options[0]) };
 
@@ -74,8 +76,11 @@ static void print_help(void) {
 
 static size_t find_arg_desc(const char* arg) {
     for (size_t i = 1; i < ARG_DESC_COUNT; i++) {
+        // only flags with a value get to glue it on (-lfoo, -O1), the rest must
+        // match exactly or -ltomcrypt ends up as -lto
         const char* n = arg_descs[i].alias;
-        if (n && strncmp(arg, n, strlen(n)) == 0) {
+        size_t len = n ? strlen(n) : 0;
+        if (n && strncmp(arg, n, len) == 0 && (arg_descs[i].has_arg || arg[len] == 0)) {
             return i;
         }
     }
@@ -132,7 +137,10 @@ CUIK_API void cuik_parse_args(Cuik_Arguments* restrict args, int argc, const cha
         size_t alias_len = strlen(arg_descs[type].alias);
         const ArgDesc* desc = &arg_descs[type];
         if (desc->has_arg) {
-            if (first[alias_len + 1] != 0) {
+            if (first[alias_len + 1] == '=') {
+                // -march=native
+                insert_arg(args, type)->value = first + alias_len + 2;
+            } else if (first[alias_len + 1] != 0) {
                 insert_arg(args, type)->value = first + alias_len + 1;
             } else if (i + 1 >= argc) {
                 fprintf(stderr, "\x1b[31merror\x1b[0m: expected argument after %s\n", first);
@@ -268,6 +276,18 @@ CUIK_API bool cuik_args_to_driver(Cuik_DriverArgs* comp_args, Cuik_Arguments* re
         comp_args->entrypoint = entry->value;
     }
 
+    if (args->_[ARG_PGOGEN]) {
+        comp_args->profile_generate = args->_[ARG_PGOGEN]->value;
+    }
+
+    if (args->_[ARG_PGOUSE]) {
+        comp_args->profile_use = args->_[ARG_PGOUSE]->value;
+    }
+
+    if (args->_[ARG_MARCH]) {
+        comp_args->march = args->_[ARG_MARCH]->value;
+    }
+
     Cuik_Arg* threads = args->_[ARG_THREADS];
     if (threads) {
         if (threads->value != arg_is_set) {
@@ -313,8 +333,12 @@ CUIK_API bool cuik_args_to_driver(Cuik_DriverArgs* comp_args, Cuik_Arguments* re
     TOGGLE(ARG_EMITIR, emit_ir);
     TOGGLE(ARG_EMITDOT, emit_dot);
     TOGGLE(ARG_NOLIBC, nocrt);
+    TOGGLE(ARG_ICF, icf);
+    TOGGLE(ARG_PRINTGC, print_gc);
+    TOGGLE(ARG_INCREMENTAL, incremental);
+    TOGGLE(ARG_LTO, lto);
 
-    if (comp_args->verbose) {
+    if (comp_args->verbose && comp_args->toolchain.print_verbose) {
         comp_args->toolchain.print_verbose(comp_args->toolchain.ctx, comp_args);
     }
 
@@ -13,6 +13,7 @@ X(AST,         "ast",      false, "print AST into stdout")
 X(SYNTAX,      "xe",       false, "type check only")
 // optimizer
 X(OPTLVL,      "O",        true,  "no optimizations")
+X(LTO,         "lto",      false, "hold onto the IR until link time so every TU can be inlined & cleaned up together")
 // backend
 X(EMITIR,      "emit-ir",  false, "print IR into stdout")
 X(EMITDOT,     "emit-dot", false, "print graphviz into stdout")
@@ -20,6 +21,9 @@ X(OUTPUT,      "o",        true,  "set the output filepath")
 X(OBJECT,      "c",        false, "output object file")
 X(ASSEMBLY,    "S",        false, "output assembly to stdout")
 X(DEBUG,       "g",        false, "compile with debug information")
+X(PGOGEN,      "pgo-gen",  true,  "instrument the program, the profile is written to the given path on exit")
+X(PGOUSE,      "pgo-use",  true,  "optimize using a profile from an instrumented build")
+X(MARCH,       "march",    true,  "pick the CPU features to target (native, x86-64, x86-64-v2, x86-64-v3, x86-64-v4)")
 // linker
 X(NOLIBC,      "nostdlib", false, "don't include and link against the default CRT")
 X(LIB,         "l",        true,  "add library name to the linking")
@@ -27,6 +31,9 @@ X(LIBDIR,      "L",        true,  "add library directory to search paths")
 X(BASED,       "based",    false, "use the TB linker (EXPERIMENTAL)")
 X(SUBSYSTEM,   "subsystem",true,  "set windows subsystem (windows only... of course)")
 X(ENTRY,       "e",        true,  "set entrypoint")
+X(ICF,         "icf",      false, "fold identical functions when linking, unless their address is stored in data (TB linker only)")
+X(PRINTGC,     "print-gc-sections", false, "list which sections the linker removed or kept and why (TB linker only)")
+X(INCREMENTAL, "incremental", false, "keep the link layout around so relinking only patches what changed (TB linker, ELF only)")
 // misc
 X(TARGET,      "target",   true,  "change the target system and arch")
 X(THREADS,     "j",        true,  "enabled multithreaded compilation")
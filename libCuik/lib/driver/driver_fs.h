@@ -3,6 +3,7 @@
 #include <windows.h>
 #else
 #include <glob.h>
+#include <sys/stat.h>
 #endif
 
 static bool str_ends_with(const char* cstr, const char* postfix) {
@@ -40,7 +41,8 @@ static void filtered_append(Cuik_DriverArgs* args, const char* path, bool recurs
                 fprintf(stderr, "Invalid filepath! %s\n", tmp);
             }
 
-            if (cuik_path_has_ext(new_path, "a") || cuik_path_has_ext(new_path, "lib")) {
+            if (cuik_path_has_ext(new_path, "a") || cuik_path_has_ext(new_path, "lib") ||
+                cuik_path_has_ext(new_path, "o") || cuik_path_has_ext(new_path, "obj")) {
                 dyn_array_put(args->libraries, new_path);
             } else {
                 dyn_array_put(args->sources, new_path);
@@ -87,7 +89,8 @@ static void append_input_path(Cuik_DriverArgs* args, const char* path) {
     } else {
         Cuik_Path* newstr = cuik_malloc(sizeof(Cuik_Path));
         if (cuikfs_canonicalize(newstr, path, args->toolchain.case_insensitive)) {
-            if (cuik_path_has_ext(newstr, "a") || cuik_path_has_ext(newstr, "lib")) {
+            if (cuik_path_has_ext(newstr, "a") || cuik_path_has_ext(newstr, "lib") ||
+                cuik_path_has_ext(newstr, "o") || cuik_path_has_ext(newstr, "obj")) {
                 dyn_array_put(args->libraries, newstr);
             } else {
                 dyn_array_put(args->sources, newstr);
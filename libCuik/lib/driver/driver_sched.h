@@ -12,8 +12,7 @@ static void per_func_task(void* arg) {
     PerFunction task = *((PerFunction*) arg);
     task.func(task.f, task.arg);
 
-    atomic_fetch_sub(task.remaining, 1);
-    futex_signal(task.remaining);
+    futex_dec(task.remaining);
 }
 
 static size_t good_batch_size(size_t n, size_t jobs) {
@@ -34,19 +33,20 @@ static size_t good_batch_size(size_t n, size_t jobs) {
 void cuiksched_per_function(Cuik_IThreadpool* restrict thread_pool, int num_threads, TB_Module* mod, void* arg, CuikSched_PerFunction func) {
     TB_SymbolIter it = tb_symbol_iter(mod);
     if (thread_pool != NULL) {
-        Futex remaining = 0;
-        size_t count = 0;
-
+        // count goes up before each submit so it can't hit zero until
+        // every function is queued & done.
+        Futex remaining = 1;
         PerFunction task = { .remaining = &remaining, .arg = arg, .func = func };
 
         TB_Symbol* sym;
         while (sym = tb_symbol_iter_next(&it), sym) if (sym->tag == TB_SYMBOL_FUNCTION) {
             task.f = (TB_Function*) sym;
+            atomic_fetch_add(&remaining, 1);
             CUIK_CALL(thread_pool, submit, per_func_task, sizeof(task), &task);
-            count++;
         }
 
-        futex_wait_eq(&remaining, count);
+        futex_dec(&remaining);
+        futex_wait_eq(&remaining, 0);
     } else {
         TB_Symbol* sym;
         while (sym = tb_symbol_iter_next(&it), sym) if (sym->tag == TB_SYMBOL_FUNCTION) {
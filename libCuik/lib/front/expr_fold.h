@@ -83,6 +83,9 @@ static ptrdiff_t const_eval_subexpr(Cuik_Parser* restrict parser, Subexpr* exprs
                     diag_err(&parser->tokens, s->loc, "Cannot evaluate address as constant");
                     return CONST_ERROR;
                 }
+            } else if (base->op == EXPR_SYMBOL) {
+                // &sym
+                *res = (Cuik_ConstVal){ CUIK_CONST_ADDR, .s = { base - exprs, 0 } };
             }
 
             ptrdiff_t offset = 0;
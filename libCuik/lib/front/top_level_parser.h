@@ -421,7 +421,7 @@ Cuik_ParseResult cuikparse_run(Cuik_Version version, TokenStream* restrict s, Cu
     assert(s != NULL);
 
     tls_init();
-    assert(target->pointer_byte_size == 8 && "other sized pointers aren't really supported yet");
+    assert((target->pointer_byte_size == 4 || target->pointer_byte_size == 8) && "other sized pointers aren't really supported yet");
 
     int r;
     Cuik_Parser parser = { 0 };
@@ -42,6 +42,8 @@
 // Targets
 #include "targets/target_generic.c"
 #include "targets/x64_desc.c"
+#include "targets/aarch64_desc.c"
+#include "targets/wasm_desc.c"
 
 // Compilation units
 #include "compilation_unit.c"
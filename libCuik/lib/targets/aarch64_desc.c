@@ -0,0 +1,79 @@
+#include "targets.h"
+#include "../front/sema.h"
+
+static void aarch64_set_defines(const Cuik_Target* target, Cuik_CPP* cpp) {
+    target_generic_set_defines(cpp, target->system, true, true);
+
+    cuikpp_define_cstr(cpp, "__aarch64__", "1");
+    cuikpp_define_cstr(cpp, "__ARM_64BIT_STATE", "1");
+    cuikpp_define_cstr(cpp, "__ARM_ARCH", "8");
+    cuikpp_define_cstr(cpp, "__ARM_ARCH_ISA_A64", "1");
+
+    if (target->system == CUIK_SYSTEM_WINDOWS) {
+        cuikpp_define_cstr(cpp, "_M_ARM64", "1");
+    }
+}
+
+#ifdef CUIK_USE_TB
+static TB_Node* aarch64_compile_builtin(TranslationUnit* tu, TB_Function* func, const char* name, int arg_count, IRVal* args) {
+    BuiltinResult r = target_generic_compile_builtin(tu, func, name, arg_count, args);
+    if (!r.failure) {
+        return r.r;
+    }
+
+    // aarch64 specific builtins
+    if (strcmp(name, "__rdtsc") == 0) {
+        // there's no TSC but the virtual counter is close enough
+        return tb_inst_cycle_counter(func);
+    } else {
+        assert(0 && "unimplemented builtin!");
+        return 0;
+    }
+}
+#endif /* CUIK_USE_TB */
+
+Cuik_Target* cuik_target_aarch64(Cuik_System system, Cuik_Environment env) {
+    BuiltinTable builtins;
+    nl_map_create(builtins, 128);
+
+    target_generic_fill_builtin_table(&builtins);
+
+    #define X(name, format) nl_map_put_cstr(builtins, #name, format);
+    X("__rdtsc",       " L");
+    #undef X
+
+    Cuik_Target* t = cuik_malloc(sizeof(Cuik_Target));
+    *t = (Cuik_Target){
+        .env = env,
+        .system = system,
+
+        .int_bits = { 8, 16, 32, 64, 64 },
+        .pointer_byte_size = 8,
+
+        #ifdef CUIK_USE_TB
+        .arch = TB_ARCH_AARCH64,
+        #endif
+
+        .builtin_func_map = builtins,
+        .set_defines = aarch64_set_defines,
+        #ifdef CUIK_USE_TB
+        .compile_builtin = aarch64_compile_builtin,
+        #endif /* CUIK_USE_TB */
+    };
+
+    // LLP64 on windows just like x64
+    if (env == CUIK_ENV_MSVC) {
+        t->int_bits[CUIK_BUILTIN_LONG] = 32;
+    }
+
+    cuik_target_build(t);
+
+    // bake out size_t and ptrdiff_t after long long is ready
+    t->size_type = t->unsigned_ints[CUIK_BUILTIN_LLONG];
+    t->size_type.also_known_as = "size_t";
+
+    t->ptrdiff_type = t->signed_ints[CUIK_BUILTIN_LLONG];
+    t->ptrdiff_type.also_known_as = "ptrdiff_t";
+
+    return t;
+}
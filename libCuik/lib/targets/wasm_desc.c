@@ -0,0 +1,59 @@
+#include "targets.h"
+#include "../front/sema.h"
+
+static void wasm_set_defines(const Cuik_Target* target, Cuik_CPP* cpp) {
+    target_generic_set_defines(cpp, target->system, false, true);
+
+    cuikpp_define_cstr(cpp, "__wasm__", "1");
+    cuikpp_define_cstr(cpp, "__wasm32__", "1");
+}
+
+#ifdef CUIK_USE_TB
+static TB_Node* wasm_compile_builtin(TranslationUnit* tu, TB_Function* func, const char* name, int arg_count, IRVal* args) {
+    BuiltinResult r = target_generic_compile_builtin(tu, func, name, arg_count, args);
+    if (!r.failure) {
+        return r.r;
+    }
+
+    // there's no wasm specific builtins yet
+    assert(0 && "unimplemented builtin!");
+    return 0;
+}
+#endif /* CUIK_USE_TB */
+
+Cuik_Target* cuik_target_wasm(Cuik_System system, Cuik_Environment env) {
+    BuiltinTable builtins;
+    nl_map_create(builtins, 128);
+
+    target_generic_fill_builtin_table(&builtins);
+
+    Cuik_Target* t = cuik_malloc(sizeof(Cuik_Target));
+    *t = (Cuik_Target){
+        .env = env,
+        .system = system,
+
+        // ILP32, long stays 32bit like every other wasm32 toolchain
+        .int_bits = { 8, 16, 32, 32, 64 },
+        .pointer_byte_size = 4,
+
+        #ifdef CUIK_USE_TB
+        .arch = TB_ARCH_WASM32,
+        #endif
+
+        .builtin_func_map = builtins,
+        .set_defines = wasm_set_defines,
+        #ifdef CUIK_USE_TB
+        .compile_builtin = wasm_compile_builtin,
+        #endif /* CUIK_USE_TB */
+    };
+    cuik_target_build(t);
+
+    // pointers are 32bit so size_t and ptrdiff_t are just int
+    t->size_type = t->unsigned_ints[CUIK_BUILTIN_INT];
+    t->size_type.also_known_as = "size_t";
+
+    t->ptrdiff_type = t->signed_ints[CUIK_BUILTIN_INT];
+    t->ptrdiff_type.also_known_as = "ptrdiff_t";
+
+    return t;
+}
@@ -0,0 +1,27 @@
+#include <cuik.h>
+#include <common.h>
+
+// there's no wasm linker yet, TB writes out the final module directly so
+// this toolchain only needs to exist for the target table.
+static void add_libraries(void* ctx, bool nocrt, Cuik_Linker* l) {
+}
+
+static void set_preprocessor(void* ctx, bool nocrt, Cuik_CPP* cpp) {
+}
+
+static bool invoke_link(void* ctx, const Cuik_DriverArgs* args, Cuik_Linker* linker, const char* output, const char* filename) {
+    return false;
+}
+
+static void* init(void) {
+    return NULL;
+}
+
+Cuik_Toolchain cuik_toolchain_wasm(void) {
+    return (Cuik_Toolchain){
+        .init = init,
+        .set_preprocessor = set_preprocessor,
+        .add_libraries = add_libraries,
+        .invoke_link = invoke_link
+    };
+}
@@ -3,6 +3,7 @@ static DynArray(const char*) libpaths = NULL;
 static const char* output_name = "a.exe";
 static DynArray(const char*) input_files = NULL;
 static int errors = 0;
+static bool icf = false;
 
 static void add_linker_input(TB_Linker* l, const char* path) {
     size_t path_len = strlen(path);
@@ -68,6 +69,8 @@ int run_link(int argc, const char** argv) {
 
             if (strncmp(arg, "libpath:", 8) == 0) {
                 dyn_array_put(libpaths, arg + 8);
+            } else if (strcmp(arg, "opt:icf") == 0 || strcmp(arg, "OPT:ICF") == 0) {
+                icf = true;
             } else {
                 fprintf(stderr, "\x1b[31merror\x1b[0m: unresolved option: -%s\n", arg);
             }
@@ -77,6 +80,7 @@ int run_link(int argc, const char** argv) {
     }
 
     TB_Linker* l = tb_linker_create(TB_EXECUTABLE_PE, TB_ARCH_X86_64);
+    tb_linker_set_icf(l, icf);
 
     dyn_array_for(i, input_files) {
         add_linker_input(l, input_files[i]);
@@ -102,12 +106,10 @@ int run_link(int argc, const char** argv) {
         return EXIT_FAILURE;
     }
 
-    TB_ExportBuffer buffer = tb_linker_export(l);
-    if (!tb_export_buffer_to_file(buffer, output_name)) {
+    if (!tb_linker_export_to_file(l, output_name)) {
         return EXIT_FAILURE;
     }
 
-    tb_export_buffer_free(buffer);
     tb_linker_destroy(l);
     return EXIT_SUCCESS;
 }
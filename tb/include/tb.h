@@ -65,7 +65,7 @@ typedef enum TB_Arch {
     TB_ARCH_UNKNOWN,
 
     TB_ARCH_X86_64,
-    TB_ARCH_AARCH64, // unsupported but planned
+    TB_ARCH_AARCH64,
     TB_ARCH_WASM32,
 } TB_Arch;
 
@@ -93,6 +93,12 @@ typedef enum TB_ABI {
 
     // Used on Mac, BSD and Linux platforms
     TB_ABI_SYSTEMV,
+
+    // Used on 64bit ARM platforms (other than Apple's which tweak it a bit)
+    TB_ABI_AAPCS64,
+
+    // WebAssembly's C ABI (what clang does), scalars are direct everything else is by reference
+    TB_ABI_WASM32,
 } TB_ABI;
 
 typedef enum TB_OutputFlavor {
@@ -555,6 +561,7 @@ typedef struct { // TB_MULPAIR
 
 typedef struct {
     TB_CharUnits align;
+    int alias_class;
 } TB_NodeMemAccess;
 
 typedef struct {
@@ -719,6 +726,15 @@ TB_API TB_Module* tb_module_create(TB_Arch arch, TB_System sys, const TB_Feature
 // Creates a module but defaults on the architecture and system based on the host machine
 TB_API TB_Module* tb_module_create_for_host(const TB_FeatureSet* features, bool is_jit);
 
+// Fills in the features supported by the machine we're running on (CPUID on x86),
+// it's all zeroes if we don't know how to detect them.
+TB_API void tb_get_host_features(TB_FeatureSet* out);
+
+// Named feature levels, for x86 these are "x86-64", "x86-64-v2", "x86-64-v3",
+// "x86-64-v4" and "native" (whatever the host supports). Returns false if the
+// name isn't known for that arch.
+TB_API bool tb_get_named_features(TB_Arch arch, const char* name, TB_FeatureSet* out);
+
 // Frees all resources for the TB_Module and it's functions, globals and
 // compiled code.
 TB_API void tb_module_destroy(TB_Module* m);
@@ -728,6 +744,47 @@ TB_API void tb_module_destroy(TB_Module* m);
 // dont and the tls_index is used, it'll crash
 TB_API void tb_module_set_tls_index(TB_Module* m, ptrdiff_t len, const char* name);
 
+typedef enum TB_RegAlloc {
+    // fast and the default, it's what you want for debug builds
+    TB_REGALLOC_LINEAR_SCAN,
+    // slower but spills less, it allocates the most expensive values first and
+    // will evict cheaper ones out of their registers.
+    TB_REGALLOC_GREEDY,
+} TB_RegAlloc;
+
+// Picks which register allocator codegen will use for this module
+TB_API void tb_module_set_regalloc(TB_Module* m, TB_RegAlloc ra);
+
+typedef enum TB_Scheduler {
+    // dependency order only, it's the default
+    TB_SCHEDULER_TOPO,
+    // reorders each block using the target's latencies so loads and divides
+    // get other work between them and their users, costs a bit of compile time.
+    TB_SCHEDULER_LIST,
+} TB_Scheduler;
+
+// Picks how codegen orders instructions within a block
+TB_API void tb_module_set_scheduler(TB_Module* m, TB_Scheduler sched);
+
+// how many instructions the machine peepholes removed or rewrote and how many
+// bytes of code that saved, across every function compiled in the module so far.
+TB_API void tb_module_get_peephole_stats(TB_Module* m, size_t* out_hits, size_t* out_bytes);
+
+// TB doesn't own any threads, if you hand it a pool the object export will
+// split layout, code copying & relocations across it. the layout matches
+// Cuik_IThreadpool so cuik can pass its pool straight through.
+typedef void (*TB_TaskFn)(void*);
+typedef struct TB_ThreadPool {
+    // runs fn(arg) on some thread, arg_size from TB is always less than 56 bytes
+    void (*submit)(void* user_data, TB_TaskFn fn, size_t arg_size, void* arg);
+
+    // tries to work one job before returning (can also not work at all)
+    void (*work_one_job)(void* user_data);
+} TB_ThreadPool;
+
+// NULL means single-threaded (the default)
+TB_API void tb_module_set_thread_pool(TB_Module* m, TB_ThreadPool* tp);
+
 TB_API TB_ModuleSectionHandle tb_module_create_section(TB_Module* m, ptrdiff_t len, const char* name, TB_ModuleSectionFlags flags, TB_ComdatType comdat);
 
 typedef struct {
@@ -739,6 +796,31 @@ typedef struct {
 TB_SymbolIter tb_symbol_iter(TB_Module* mod);
 TB_Symbol* tb_symbol_iter_next(TB_SymbolIter* iter);
 
+////////////////////////////////
+// Profile guided optimization
+////////////////////////////////
+// instrumented modules will count how many times each basic block is entered
+// during codegen (function entries, branch successors and merges), the counters
+// live in a ".tbprof" section.
+TB_API void tb_module_enable_instrumentation(TB_Module* m);
+
+// the dumper is a `void()` function which appends the counters to a file, you
+// can reference it as soon as instrumentation is enabled (atexit it in main) but
+// it's only filled in by tb_module_finish_instrumentation which has to happen after
+// all other functions were compiled, the dumper itself still needs to be compiled.
+//
+// returns NULL if the module isn't instrumented.
+TB_API TB_Function* tb_module_get_profile_dumper(TB_Module* m);
+TB_API TB_Function* tb_module_finish_instrumentation(TB_Module* m, const char* path);
+
+// feedback mode: loads the counters from previous instrumented runs (they're
+// summed), it'll drive block layout and spill weights during tb_pass_codegen.
+TB_API bool tb_module_load_profile(TB_Module* m, const char* path);
+
+// returns NULL if there's no profile for the function, otherwise it's the basic
+// block counts in CFG walk order ([0] is the entry count so it's how many calls).
+TB_API const uint64_t* tb_function_get_profile(TB_Function* f, size_t* out_count);
+
 ////////////////////////////////
 // Compiled code introspection
 ////////////////////////////////
@@ -832,6 +914,9 @@ TB_API TB_ExecutableType tb_system_executable_format(TB_System s);
 
 TB_API TB_Linker* tb_linker_create(TB_ExecutableType type, TB_Arch arch);
 TB_API TB_ExportBuffer tb_linker_export(TB_Linker* l);
+// same as tb_linker_export but the image is laid out first and then written
+// directly into a mapping of the output file, no in-memory copy.
+TB_API bool tb_linker_export_to_file(TB_Linker* l, const char* path);
 TB_API void tb_linker_destroy(TB_Linker* l);
 
 TB_API bool tb_linker_get_msg(TB_Linker* l, TB_LinkerMsg* msg);
@@ -841,6 +926,34 @@ TB_API void tb_linker_set_subsystem(TB_Linker* l, TB_WindowsSubsystem subsystem)
 
 TB_API void tb_linker_set_entrypoint(TB_Linker* l, const char* name);
 
+// with a pool, object files (and the archive members they pull in) are parsed
+// on it and the relocations get applied in parallel. the contents passed to
+// the append functions have to stay alive until the export is done anyways.
+// NULL means single-threaded (the default)
+TB_API void tb_linker_set_thread_pool(TB_Linker* l, TB_ThreadPool* tp);
+
+// identical code folding: code pieces from object files which are byte-for-byte
+// the same (and relocate to the same places) get merged into one copy. this
+// means distinct functions can end up with the same address. off by default.
+TB_API void tb_linker_set_icf(TB_Linker* l, bool enabled);
+
+// how many pieces ICF folded away and how many bytes of code that saved.
+TB_API void tb_linker_get_icf_stats(TB_Linker* l, size_t* out_folded, size_t* out_bytes);
+
+// after the section GC, print every input section to stderr with whether it
+// was removed or kept (and what referenced it).
+TB_API void tb_linker_set_print_gc_sections(TB_Linker* l, bool enabled);
+
+// incremental linking: tb_linker_export_to_file leaves the layout next to the output
+// (<output>.tbilk) with some room after every piece. the next export reuses it when
+// everything still fits and only rewrites the pieces (and relocations) which changed
+// in the existing file, otherwise it's a full link. ELF only for now, off by default.
+TB_API void tb_linker_set_incremental(TB_Linker* l, bool enabled);
+
+// whether the last export patched the old output in place and how many of the
+// pieces it rewrote (out of the total).
+TB_API bool tb_linker_get_incremental_stats(TB_Linker* l, size_t* out_patched, size_t* out_total);
+
 // Links compiled module into output
 TB_API void tb_linker_append_module(TB_Linker* l, TB_Module* m);
 
@@ -884,6 +997,10 @@ struct TB_FunctionPrototype {
     uint16_t return_count, param_count;
     bool has_varargs;
 
+    // the first param is the buffer an aggregate return is written to, AAPCS64
+    // passes that one in X8 instead of the first argument register.
+    bool has_indirect_return;
+
     // params are directly followed by returns
     TB_PrototypeParam params[];
 };
@@ -917,6 +1034,12 @@ typedef enum {
 
 TB_API TB_PassingRule tb_get_passing_rule_from_dbg(TB_Module* mod, TB_DebugType* param_type, bool is_return);
 
+// DIRECT values can take more than one register (AAPCS64 passes small structs
+// in a register pair and HFAs as one float register per member), this fills in
+// the type of each piece and returns how many there are. the pieces sit back
+// to back in the value's memory, INDIRECT values are a single pointer.
+TB_API int tb_get_passing_pieces(TB_Module* mod, TB_DebugType* type, TB_DataType pieces[4]);
+
 ////////////////////////////////
 // Globals
 ////////////////////////////////
@@ -1034,6 +1157,10 @@ TB_API TB_Node* tb_inst_poison(TB_Function* f);
 
 TB_API TB_Node* tb_inst_param(TB_Function* f, int param_id);
 
+// marks a pointer parameter as not being reachable from any other pointer (C's
+// restrict), only the first 64 params can be marked.
+TB_API void tb_function_set_noalias(TB_Function* f, int param_id);
+
 TB_API TB_Node* tb_inst_fpxt(TB_Function* f, TB_Node* src, TB_DataType dt);
 TB_API TB_Node* tb_inst_sxt(TB_Function* f, TB_Node* src, TB_DataType dt);
 TB_API TB_Node* tb_inst_zxt(TB_Function* f, TB_Node* src, TB_DataType dt);
@@ -1047,7 +1174,12 @@ TB_API TB_Node* tb_inst_bitcast(TB_Function* f, TB_Node* src, TB_DataType dt);
 TB_API TB_Node* tb_inst_local(TB_Function* f, TB_CharUnits size, TB_CharUnits align);
 
 TB_API TB_Node* tb_inst_load(TB_Function* f, TB_DataType dt, TB_Node* addr, TB_CharUnits align, bool is_volatile);
-TB_API void tb_inst_store(TB_Function* f, TB_DataType dt, TB_Node* addr, TB_Node* val, TB_CharUnits align, bool is_volatile);
+TB_API TB_Node* tb_inst_store(TB_Function* f, TB_DataType dt, TB_Node* addr, TB_Node* val, TB_CharUnits align, bool is_volatile);
+
+// loads and stores with different non-zero alias classes are assumed to never
+// touch the same memory (C's strict aliasing), 0 is the default and may alias
+// anything. it's ignored on anything that isn't a LOAD or STORE.
+TB_API void tb_inst_set_alias_class(TB_Function* f, TB_Node* mem_op, int alias_class);
 
 TB_API void tb_inst_safepoint_poll(TB_Function* f, TB_Node* addr, int input_count, TB_Node** inputs);
 
@@ -1165,6 +1297,10 @@ TB_API TB_Node* tb_inst_x86_rsqrt(TB_Function* f, TB_Node* a);
 // Control flow
 TB_API TB_Node* tb_inst_syscall(TB_Function* f, TB_DataType dt, TB_Node* syscall_num, size_t param_count, TB_Node** params);
 TB_API TB_MultiOutput tb_inst_call(TB_Function* f, TB_FunctionPrototype* proto, TB_Node* target, size_t param_count, TB_Node** params);
+
+// guaranteed tail call, this terminates the current block and the callee returns
+// straight to our caller. the arguments must fit into registers since we don't
+// have a stack argument area to reuse (it'll panic during codegen otherwise).
 TB_API void tb_inst_tailcall(TB_Function* f, TB_FunctionPrototype* proto, TB_Node* target, size_t param_count, TB_Node** params);
 
 // Managed
@@ -1228,9 +1364,26 @@ TB_API bool tb_pass_print(TB_Passes* opt);
 //   print-dot: prints IR as DOT
 TB_API void tb_pass_print_dot(TB_Passes* opt, TB_PrintCallback callback, void* user_data);
 
+//   alias: asks whether two memory operations (LOAD, STORE, MEMSET, MEMCPY)
+//     might touch the same bytes, this is what the memory peepholes use.
+typedef enum {
+    TB_NO_ALIAS,
+    TB_MAY_ALIAS,
+    TB_MUST_ALIAS,
+} TB_AliasResult;
+
+TB_API TB_AliasResult tb_pass_alias(TB_Passes* opt, TB_Node* a, TB_Node* b);
+
 // codegen
 TB_API TB_FunctionOutput* tb_pass_codegen(TB_Passes* opt, bool emit_asm);
 
+// whole program passes: inlines small functions across the call graph, kills
+// the symbols nothing can reach anymore and marks private globals which are
+// never written so loads from them fold. it needs to see every function body
+// before any of them get compiled and it's not thread-safe.
+TB_API void tb_module_ipo(TB_Module* m);
+TB_API void tb_module_get_ipo_stats(TB_Module* m, size_t* out_inlined, size_t* out_killed, size_t* out_constants);
+
 TB_API void tb_pass_kill_node(TB_Passes* opt, TB_Node* n);
 TB_API void tb_pass_mark(TB_Passes* opt, TB_Node* n);
 TB_API void tb_pass_mark_users(TB_Passes* opt, TB_Node* n);
@@ -0,0 +1,88 @@
+#ifndef TB_AARCH64_H
+#define TB_AARCH64_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// register 31 means either the zero register or the stack pointer depending
+// on the instruction, the decoder tells them apart for you.
+enum {
+    TB_A64_ZR = 31,
+    TB_A64_SP = 32,
+};
+
+typedef enum {
+    TB_A64_OPERAND_NONE,
+
+    // reg is the register number, size is 4 or 8 (W/X, S/D)
+    TB_A64_OPERAND_GPR,
+    TB_A64_OPERAND_FPR,
+
+    // #imm
+    TB_A64_OPERAND_IMM,
+
+    // [reg, #imm] or [reg, index, lsl #shift]
+    TB_A64_OPERAND_MEM,
+
+    // pc relative, imm is the byte offset from the instruction (adrp uses
+    // the page offset from the instruction's page)
+    TB_A64_OPERAND_LABEL,
+    TB_A64_OPERAND_PAGE,
+
+    // condition code, reg is the 4bit encoding
+    TB_A64_OPERAND_COND,
+
+    // modifies the register before it (lsl/lsr/asr/ror #imm), reg is the kind
+    TB_A64_OPERAND_SHIFT,
+
+    // system register for mrs/msr, imm is the op0:op1:CRn:CRm:op2 encoding
+    TB_A64_OPERAND_SYSREG,
+} TB_A64_OperandType;
+
+typedef enum {
+    TB_A64_MEM_OFFSET,
+    TB_A64_MEM_PRE,  // [reg, #imm]!
+    TB_A64_MEM_POST, // [reg], #imm
+} TB_A64_MemMode;
+
+// how an immediate gets printed, same choices llvm-objdump makes
+typedef enum {
+    TB_A64_IMM_DEC,
+    TB_A64_IMM_HEX, // bitmasks and brk codes
+    TB_A64_IMM_FP,  // fcmp against #0.0
+} TB_A64_ImmFormat;
+
+typedef struct {
+    uint8_t type;
+    uint8_t reg;
+    uint8_t size;
+
+    // memory operand
+    int8_t index; // -1 if there's none
+    uint8_t shift, mode;
+
+    // immediate (TB_A64_ImmFormat)
+    uint8_t fmt;
+
+    int64_t imm;
+} TB_A64_Operand;
+
+typedef struct {
+    const char* mnemonic;
+
+    // writes the flags (adds, subs, ands...)
+    bool sets_flags;
+
+    uint8_t operand_count;
+    TB_A64_Operand operands[4];
+} TB_A64_Inst;
+
+// false if we don't know the encoding
+bool tb_a64_disasm(TB_A64_Inst* restrict inst, uint32_t word);
+const char* tb_a64_reg_name(int reg, int size, bool is_fpr);
+
+// prints one operand into buf, returns the length written
+int tb_a64_print_operand(char* buf, size_t size, const TB_A64_Operand* op);
+
+#endif /* TB_AARCH64_H */
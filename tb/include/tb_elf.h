@@ -38,7 +38,23 @@
 #define TB_SHT_SYMTAB   2 /* symbol table section */
 #define TB_SHT_STRTAB   3 /* string table section */
 #define TB_SHT_RELA     4 /* relocation section with addends */
+#define TB_SHT_NOTE     7 /* note section */
 #define TB_SHT_NOBITS   8 /* no space section */
+#define TB_SHT_REL      9 /* relocation section - no addends */
+#define TB_SHT_INIT_ARRAY    14 /* Initialization function pointers. */
+#define TB_SHT_FINI_ARRAY    15 /* Termination function pointers. */
+#define TB_SHT_PREINIT_ARRAY 16 /* Pre-initialization function ptrs. */
+#define TB_SHT_GROUP         17 /* Section group. */
+#define TB_SHT_SYMTAB_SHNDX  18 /* Section indexes (see SHN_XINDEX). */
+
+/* Special section indexes. */
+#define TB_SHN_UNDEF  0      /* Undefined, missing, irrelevant. */
+#define TB_SHN_ABS    0xfff1 /* Absolute values. */
+#define TB_SHN_COMMON 0xfff2 /* Common data. */
+#define TB_SHN_XINDEX 0xffff /* Escape -- index stored elsewhere. */
+
+/* Flags for section groups. */
+#define TB_GRP_COMDAT 0x1    /* COMDAT semantics. */
 
 /* Flags for sh_flags. */
 #define TB_SHF_WRITE            0x1        /* Section contains writable data. */
@@ -70,6 +86,7 @@
 #define TB_PT_SHLIB     5	/* Reserved (not used). */
 #define TB_PT_PHDR      6	/* Location of program header itself. */
 #define TB_PT_TLS       7	/* Thread local storage segment */
+#define TB_PT_GNU_STACK 0x6474e551 /* Stack flags */
 
 /* Values for relocation */
 typedef enum {
@@ -79,6 +96,27 @@ typedef enum {
     TB_ELF_X86_64_GOT32    = 3,
     TB_ELF_X86_64_PLT32    = 4,
     TB_ELF_X86_64_GOTPCREL = 9,
+    TB_ELF_X86_64_32       = 10,
+    TB_ELF_X86_64_32S      = 11,
+    TB_ELF_X86_64_16       = 12,
+    TB_ELF_X86_64_PC16     = 13,
+    TB_ELF_X86_64_8        = 14,
+    TB_ELF_X86_64_PC8      = 15,
+    TB_ELF_X86_64_GOTTPOFF = 22,
+    TB_ELF_X86_64_TPOFF32  = 23,
+    TB_ELF_X86_64_PC64     = 24,
+    TB_ELF_X86_64_GOTOFF64 = 25,
+    TB_ELF_X86_64_GOTPC32  = 26,
+    TB_ELF_X86_64_SIZE32   = 32,
+    TB_ELF_X86_64_SIZE64   = 33,
+    TB_ELF_X86_64_GOTPCRELX     = 41,
+    TB_ELF_X86_64_REX_GOTPCRELX = 42,
+
+    TB_ELF_AARCH64_ABS64            = 257,
+    TB_ELF_AARCH64_ADR_PREL_PG_HI21 = 275,
+    TB_ELF_AARCH64_ADD_ABS_LO12_NC  = 277,
+    TB_ELF_AARCH64_JUMP26           = 282,
+    TB_ELF_AARCH64_CALL26           = 283,
 } TB_ELF_RelocType;
 
 // ST_TYPE
@@ -86,6 +124,10 @@ typedef enum {
 #define TB_ELF64_STT_OBJECT  1
 #define TB_ELF64_STT_FUNC    2
 #define TB_ELF64_STT_SECTION 3
+#define TB_ELF64_STT_FILE    4
+#define TB_ELF64_STT_COMMON  5
+#define TB_ELF64_STT_TLS     6
+#define TB_ELF64_STT_GNU_IFUNC 10
 
 // ST_INFO
 #define TB_ELF64_STB_LOCAL  0
@@ -118,8 +118,13 @@ typedef struct {
     size_t member_count;
     uint32_t* members;
 
+    // symbol_count NUL terminated names, tb_archive_symbol_member(i) is the (1-based) member
+    // which defines the i'th one. COFF stores those as u16s while GNU archives get converted
+    // into u32s (wide_symbols) since they can have more than 65535 members.
     size_t symbol_count;
-    uint16_t* symbols;
+    void* symbols;
+    bool wide_symbols;
+    TB_Slice symbol_names;
 
     TB_Slice strtbl;
 } TB_ArchiveFileParser;
@@ -128,5 +133,9 @@ typedef struct {
 bool tb_archive_parse(TB_Slice file, TB_ArchiveFileParser* restrict out_parser);
 // After that we can enumerate any symbol entries to resolve imports
 size_t tb_archive_parse_entries(TB_ArchiveFileParser* restrict parser, size_t i, size_t count, TB_ArchiveEntry* out_entry);
+// member index (1-based, 0 is none) of the i'th symbol in the archive's symbol table
+uint32_t tb_archive_symbol_member(TB_ArchiveFileParser* restrict parser, size_t i);
+// frees whatever tb_archive_parse allocated, the entries are still fine since they point into the file
+void tb_archive_free(TB_ArchiveFileParser* restrict parser);
 
 #endif // TB_OBJECT_H
@@ -1,218 +1,2520 @@
-#if 0
-// NOTE(NeGate): THIS IS VERY INCOMPLETE
-#include "../tb_internal.h"
-#include "../codegen/emitter.h"
+#include "aarch64.h"
+#include "aarch64_emitter.h"
+
+#include "aarch64_disasm.c"
+
+enum {
+    CG_REGISTER_CLASSES = 2,
+    CG_REGISTER_COUNT = 32,
+};
+
+enum {
+    REG_CLASS_GPR,
+    REG_CLASS_FPR,
+
+    FIRST_GPR = 0,
+    FIRST_FPR = 32,
+
+    // ADRP operands still have an input, it doesn't mean anything
+    GLOBAL_BASE = SP,
+    // edge moves can borrow this one (xchg'ing it out and back) when nothing's free
+    BORROW_GPR = X0,
+};
+
+typedef A64_DataType CG_DataType;
+
+// never handed out by the allocator, X16 & X17 are our scratch registers (the
+// linker's veneers might clobber them anyways), X18 is the platform register.
+static const uint64_t reserved_regs[CG_REGISTER_CLASSES] = {
+    (1u << X16) | (1u << X17) | (1u << X18) | (1u << FP) | (1u << LR) | (1u << 31), 0
+};
+
+static const struct ParamDescriptor {
+    int gpr_count;
+    int fpr_count;
+    uint32_t caller_saved_gprs; // bitfield
+    uint32_t caller_saved_fprs; // bitfield
+
+    GPR gprs[8];
+} param_descs[] = {
+    // AAPCS64
+    { 8, 8, AAPCS64_CALLER_SAVED_GPRS, AAPCS64_CALLER_SAVED_FPRS, { X0, X1, X2, X3, X4, X5, X6, X7 } },
+    // linux syscall (the number goes into X8)
+    { 6, 0, SYSCALL_CALLER_SAVED_GPRS, 0,                         { X0, X1, X2, X3, X4, X5 } },
+};
+
+#include "../codegen/generic_cg.h"
+
+static size_t emit_prologue(Ctx* restrict ctx, bool has_frame);
+static void emit_epilogue(Ctx* restrict ctx, TB_Node* stop, bool has_frame);
+static void emit_frame_teardown(Ctx* restrict ctx, bool has_frame);
+
+// initialize register allocator state
+static void init_regalloc(Ctx* restrict ctx) {
+    // Generate intervals for physical registers
+    FOREACH_N(i, 0, CG_REGISTER_CLASSES*CG_REGISTER_COUNT) {
+        DynArray(LiveRange) ranges = dyn_array_create(LiveRange, 8);
+        dyn_array_put(ranges, (LiveRange){ INT_MAX, INT_MAX });
+
+        bool is_gpr = i < CG_REGISTER_COUNT;
+        int reg = i % CG_REGISTER_COUNT;
+
+        dyn_array_put(ctx->intervals, (LiveInterval){
+                .reg_class = is_gpr ? REG_CLASS_GPR : REG_CLASS_FPR,
+                .dt = is_gpr ? A64_TYPE_I64 : A64_TYPE_F64,
+                .reg = reg, .assigned = reg, .hint = -1, .split_kid = -1,
+                .ranges = ranges
+            });
+    }
+}
+
+static void mark_callee_saved_constraints(Ctx* restrict ctx, uint64_t callee_saved[CG_REGISTER_CLASSES]) {
+    const struct ParamDescriptor* restrict desc = &param_descs[0];
+
+    // X19 - X28, the frame record (FP & LR) is handled by the prologue
+    callee_saved[0] = ~desc->caller_saved_gprs & ~reserved_regs[0] & 0xFFFFFFFF;
+
+    // V8 - V15 (only the bottom 64bits but that's all we use)
+    callee_saved[1] = ~desc->caller_saved_fprs & 0xFFFFFFFF;
+}
+
+static A64_DataType legalize(TB_DataType dt) {
+    if (dt.type == TB_FLOAT) {
+        return dt.data == TB_FLT_64 ? A64_TYPE_F64 : A64_TYPE_F32;
+    } else if (dt.type == TB_PTR) {
+        return A64_TYPE_I64;
+    }
+
+    assert(dt.type == TB_INT);
+    if (dt.data <= 8) return A64_TYPE_I8;
+    else if (dt.data <= 16) return A64_TYPE_I16;
+    else if (dt.data <= 32) return A64_TYPE_I32;
+    else if (dt.data <= 64) return A64_TYPE_I64;
+
+    assert(0 && "TODO: large int support");
+    return A64_TYPE_NONE;
+}
+
+static int classify_reg_class(TB_DataType dt) {
+    return dt.type == TB_FLOAT ? REG_CLASS_FPR : REG_CLASS_GPR;
+}
+
+static bool wont_spill_around(int t) {
+    return t == INST_LABEL || t == CMP || t == TST || t == FCMP || t == B || (t >= B_EQ && t <= B_NV);
+}
+
+static bool is_terminator(int t) {
+    return t == INST_TERMINATOR || t == TRAP || t == DEBUGBREAK;
+}
+
+static const char* reg_name(int rg, int num) {
+    return tb_a64_reg_name(num, 8, rg == REG_CLASS_FPR);
+}
+
+// everything but plain moves works on registers, the loads and stores
+// are explicit.
+static bool dst_needs_reg(Inst* inst) {
+    return inst->type != MOV && inst->type != FP_MOV;
+}
+
+// log2 of the access size
+static int dt_size_log2(A64_DataType dt) {
+    switch (dt) {
+        case A64_TYPE_I8:  return 0;
+        case A64_TYPE_I16: return 1;
+        case A64_TYPE_I32: return 2;
+        case A64_TYPE_F32: return 2;
+        default:           return 3;
+    }
+}
+
+// anything below 32bits is computed with the W form of the op
+static TB_DataType widen_narrow(TB_DataType dt) {
+    if (dt.type == TB_INT && dt.data < 32) {
+        dt.data = 32;
+    }
+    return dt;
+}
+
+// the constant in n, sign extended from the type unless it's an unsigned op
+// on a narrow type (those are zero extended to match the register).
+static bool try_for_const(TB_Node* n, bool is_signed, int64_t* out_x) {
+    if (n->type != TB_INTEGER_CONST) {
+        return false;
+    }
+
+    uint64_t x = TB_NODE_GET_EXTRA_T(n, TB_NodeInt)->value;
+    int bits = n->dt.type == TB_PTR ? 64 : n->dt.data;
+    if (bits > 0 && bits < 64) {
+        uint64_t sign = 1ull << (bits - 1);
+        x &= (sign << 1) - 1;
+        if (is_signed || bits >= 32) {
+            x = (x ^ sign) - sign;
+        }
+    }
+
+    *out_x = x;
+    return true;
+}
+
+static int get_stack_slot(Ctx* restrict ctx, TB_Node* n) {
+    ptrdiff_t search = nl_map_get(ctx->stack_slots, n);
+    if (search >= 0) {
+        return ctx->stack_slots[search].v;
+    } else {
+        TB_NodeLocal* local = TB_NODE_GET_EXTRA(n);
+
+        int pos = STACK_ALLOC(local->size, local->align);
+        nl_map_put(ctx->stack_slots, n, pos);
+
+        add_debug_local(ctx, n, pos);
+        return pos;
+    }
+}
+
+static Inst* inst_jmp(TB_Node* target) {
+    assert(target->type > 0);
+    Inst* i = alloc_inst(B, TB_TYPE_VOID, 0, 0, 0);
+    i->flags = INST_NODE;
+    i->n = target;
+    return i;
+}
+
+static Inst* inst_bcond(TB_Node* target, Cond cc) {
+    Inst* i = alloc_inst(B_EQ + cc, TB_TYPE_VOID, 0, 0, 0);
+    i->flags = INST_NODE;
+    i->n = target;
+    return i;
+}
+
+// add qword [sym + disp], 1
+static Inst* inst_counter(TB_Symbol* sym, int32_t disp) {
+    Inst* i = alloc_inst(COUNTER, TB_TYPE_I64, 0, 1, 0);
+    i->flags = INST_GLOBAL;
+    i->mem_slot = 0;
+    i->operands[0] = FIRST_GPR + GLOBAL_BASE;
+    i->s = sym;
+    i->disp = disp;
+    return i;
+}
+
+// op dst, src, #bitmask
+static Inst* inst_op_rr_abs(int type, TB_DataType dt, RegIndex dst, RegIndex src, uint64_t x) {
+    Inst* i = inst_op_rr(type, dt, dst, src);
+    i->flags = INST_ABS;
+    i->abs = x;
+    return i;
+}
+
+// narrow values have garbage in the bits above their type, this cleans them
+// up for the ops which read the whole register.
+static int isel_extend(Ctx* restrict ctx, TB_Node* n, bool is_signed) {
+    int src = input_reg(ctx, n);
+    if (n->dt.type != TB_INT || n->dt.data >= 32) {
+        return src;
+    }
+
+    int dst = DEF(NULL, TB_TYPE_I32);
+    Inst* inst = inst_op_rr(is_signed ? SEXT : ZEXT, TB_TYPE_I32, dst, src);
+    inst->imm = n->dt.data;
+    SUBMIT(inst);
+    return dst;
+}
+
+// cmp src, #x which might not fit into the imm12
+static void isel_cmp_imm(Ctx* restrict ctx, TB_DataType dt, int src, int64_t x) {
+    if (x > -4096 && x < 4096) {
+        SUBMIT(inst_op_ri(CMP, dt, src, x));
+    } else {
+        int tmp = DEF(NULL, dt);
+        SUBMIT(inst_op_abs(MOVI, dt, tmp, x));
+        SUBMIT(inst_op_rr_no_dst(CMP, dt, src, tmp));
+    }
+}
+
+// generates an LEA for computing the address of n, if store_op is set
+// it's a store of src into that address instead.
+static Inst* isel_addr(Ctx* restrict ctx, TB_Node* n, int dst, int store_op, int src) {
+    int64_t offset = 0;
+    if (n->type == TB_SYMBOL) {
+        TB_Symbol* sym = TB_NODE_GET_EXTRA_T(n, TB_NodeSymbol)->sym;
+        assert(sym->tag != 0);
+
+        Inst* i;
+        if (store_op < 0) {
+            i = alloc_inst(LEA, TB_TYPE_PTR, 1, 1, 0);
+            i->mem_slot = 1;
+            i->operands[0] = dst;
+            i->operands[1] = FIRST_GPR + GLOBAL_BASE;
+        } else {
+            i = alloc_inst(store_op, TB_TYPE_PTR, 0, 2, 0);
+            i->mem_slot = 0;
+            i->operands[0] = FIRST_GPR + GLOBAL_BASE;
+            i->operands[1] = src;
+        }
+        i->flags = INST_GLOBAL;
+        i->s = sym;
+        return i;
+    } else if (n->type == TB_VA_START) {
+        // we'd need to spill the parameter registers into a save area first
+        tb_todo();
+    } else if (n->type == TB_MEMBER_ACCESS) {
+        offset = TB_NODE_GET_EXTRA_T(n, TB_NodeMember)->offset;
+
+        use(ctx, n);
+        n = n->inputs[1];
+    }
+
+    Scale scale = SCALE_X1;
+    int index = -1;
+
+    if (n->type == TB_ARRAY_ACCESS) {
+        TB_Node* base = n->inputs[1];
+        int64_t stride = TB_NODE_GET_EXTRA_T(n, TB_NodeArray)->stride;
+
+        use(ctx, n);
+        n = n->inputs[2];
+
+        int64_t x;
+        if (n->type == TB_SHL && try_for_const(n->inputs[2], false, &x) && x >= 0 && x < 64) {
+            use(ctx, n);
+            use(ctx, n->inputs[2]);
+
+            n = n->inputs[1];
+            stride *= (1ull << x);
+        }
+
+        index = input_reg(ctx, n);
+
+        // compute index
+        if (stride == 1) {
+            // no scaling required
+        } else if (tb_is_power_of_two(stride)) {
+            // the register offset form only takes the access size as the shift
+            // but anything else is a single add with a shifted register.
+            scale = tb_ffs64(stride) - 1;
+        } else {
+            int tmp = DEF(NULL, TB_TYPE_I64);
+            int k = DEF(NULL, TB_TYPE_I64);
+            SUBMIT(inst_op_abs(MOVI, TB_TYPE_I64, k, stride));
+            SUBMIT(inst_op_rrr(MUL, TB_TYPE_I64, tmp, index, k));
+            index = tmp;
+        }
+
+        n = base;
+    }
+
+    int base;
+    if (n->type == TB_LOCAL) {
+        use(ctx, n);
+        offset += get_stack_slot(ctx, n);
+        base = FIRST_GPR + FP;
+    } else {
+        base = input_reg(ctx, n);
+    }
+
+    assert(offset == (int32_t) offset);
+    if (store_op < 0) {
+        return inst_op_rm(LEA, n->dt, dst, base, index, scale, offset);
+    } else {
+        return inst_op_mr(store_op, n->dt, base, index, scale, offset, src);
+    }
+}
+
+static Inst* isel_addr2(Ctx* restrict ctx, TB_Node* n, int dst, int store_op, int src) {
+    // compute base
+    if (n->type == TB_ARRAY_ACCESS && (ctx->values[n->gvn].uses >  2 || ctx->values[n->gvn].vreg >= 0)) {
+        int base = input_reg(ctx, n);
+        if (store_op < 0) {
+            return inst_op_rm(LEA, TB_TYPE_PTR, dst, base, -1, SCALE_X1, 0);
+        } else {
+            return inst_op_mr(store_op, TB_TYPE_PTR, base, -1, SCALE_X1, 0, src);
+        }
+    } else {
+        return isel_addr(ctx, n, dst, store_op, src);
+    }
+}
+
+// exclusives and acquire loads only take a bare register for the address
+static int isel_addr_reg(Ctx* restrict ctx, TB_Node* n) {
+    if (n->type == TB_LOCAL || n->type == TB_SYMBOL || n->type == TB_MEMBER_ACCESS || n->type == TB_ARRAY_ACCESS) {
+        int dst = DEF(NULL, TB_TYPE_PTR);
+        SUBMIT(isel_addr2(ctx, n, dst, -1, -1));
+        return dst;
+    }
+
+    return input_reg(ctx, n);
+}
+
+static Cond isel_cmp(Ctx* restrict ctx, TB_Node* n) {
+    bool invert = false;
+    if (n->type == TB_CMP_EQ && n->dt.type == TB_INT && n->dt.data == 1 && n->inputs[2]->type == TB_INTEGER_CONST) {
+        TB_NodeInt* b = TB_NODE_GET_EXTRA_T(n->inputs[2], TB_NodeInt);
+        if (b->value == 0) {
+            invert = true;
+            n = n->inputs[1];
+        }
+    }
+
+    if (n->type >= TB_CMP_EQ && n->type <= TB_CMP_FLE) {
+        TB_DataType cmp_dt = TB_NODE_GET_EXTRA_T(n, TB_NodeCompare)->cmp_dt;
+
+        Cond cc = -1;
+        use(ctx, n);
+
+        if (TB_IS_FLOAT_TYPE(cmp_dt)) {
+            int lhs = input_reg(ctx, n->inputs[1]);
+            int rhs = input_reg(ctx, n->inputs[2]);
+            SUBMIT(inst_op_rr_no_dst(FCMP, cmp_dt, lhs, rhs));
+
+            // unordered sets C & V so MI and LS are false for NaNs
+            switch (n->type) {
+                case TB_CMP_EQ:  cc = EQ; break;
+                case TB_CMP_NE:  cc = NE; break;
+                case TB_CMP_FLT: cc = MI; break;
+                case TB_CMP_FLE: cc = LS; break;
+                default: tb_unreachable();
+            }
+        } else {
+            bool is_signed = n->type == TB_CMP_SLT || n->type == TB_CMP_SLE;
+            TB_DataType dt = widen_narrow(cmp_dt);
+
+            int64_t x;
+            int lhs = isel_extend(ctx, n->inputs[1], is_signed);
+            if (try_for_const(n->inputs[2], is_signed, &x)) {
+                use(ctx, n->inputs[2]);
+                isel_cmp_imm(ctx, dt, lhs, x);
+            } else {
+                int rhs = isel_extend(ctx, n->inputs[2], is_signed);
+                SUBMIT(inst_op_rr_no_dst(CMP, dt, lhs, rhs));
+            }
+
+            switch (n->type) {
+                case TB_CMP_EQ:  cc = EQ; break;
+                case TB_CMP_NE:  cc = NE; break;
+                case TB_CMP_SLT: cc = LT; break;
+                case TB_CMP_SLE: cc = LE; break;
+                case TB_CMP_ULT: cc = LO; break;
+                case TB_CMP_ULE: cc = LS; break;
+                default: tb_unreachable();
+            }
+        }
+
+        return cc ^ invert;
+    } else {
+        int src = input_reg(ctx, n);
+
+        TB_DataType dt = n->dt;
+        if (TB_IS_FLOAT_TYPE(dt)) {
+            // fcmp src, #0.0
+            Inst* inst = alloc_inst(FCMP, dt, 0, 1, 0);
+            inst->flags = INST_IMM;
+            inst->operands[0] = src;
+            SUBMIT(inst);
+        } else if (dt.type == TB_INT && dt.data < 32) {
+            // only the bits in the type count
+            Inst* inst = alloc_inst(TST, TB_TYPE_I32, 0, 1, 0);
+            inst->flags = INST_ABS;
+            inst->operands[0] = src;
+            inst->abs = (1ull << dt.data) - 1;
+            SUBMIT(inst);
+        } else {
+            SUBMIT(inst_op_ri(CMP, dt, src, 0));
+        }
+        return NE ^ invert;
+    }
+}
+
+// the proj1 in TB_NodeAtomic isn't kept up to date by the optimizer so we
+// go looking for the data projection ourselves.
+static TB_Node* find_data_proj(TB_Node* n) {
+    for (User* u = n->users; u; u = u->next) {
+        if (u->n->type == TB_PROJ && TB_NODE_GET_EXTRA_T(u->n, TB_NodeProj)->index == 1) {
+            return u->n;
+        }
+    }
+
+    return NULL;
+}
+
+static bool should_rematerialize(TB_Node* n) {
+    if ((n->type == TB_INT2FLOAT || n->type == TB_INT2PTR) && n->inputs[1]->type == TB_INTEGER_CONST) {
+        return true;
+    }
+
+    return (n->type == TB_PROJ && n->inputs[0]->type == TB_START) ||
+        n->type == TB_FLOAT32_CONST || n->type == TB_FLOAT64_CONST ||
+        n->type == TB_INTEGER_CONST || n->type == TB_MEMBER_ACCESS ||
+        n->type == TB_LOCAL || n->type == TB_SYMBOL;
+}
+
+////////////////////////////////
+// Scheduling model
+////////////////////////////////
+// latencies are rough numbers for a Cortex-A72 class core, the big cores
+// are all in the same ballpark for the stuff we care about.
+typedef enum {
+    SCHED_NONE, SCHED_ALU, SCHED_IMUL, SCHED_DIV, SCHED_LOAD, SCHED_STORE,
+    SCHED_FADD, SCHED_FMUL, SCHED_FDIV, SCHED_CVT, SCHED_CALL,
+    SCHED_CLASS_COUNT
+} SchedClass;
+
+static const SchedCost a64_sched_costs[SCHED_CLASS_COUNT] = {
+    [SCHED_NONE]  = { 0,  1 }, [SCHED_ALU]   = { 1,  1 },
+    [SCHED_IMUL]  = { 4,  1 }, [SCHED_DIV]   = { 20, 12 },
+    [SCHED_LOAD]  = { 4,  1 }, [SCHED_STORE] = { 1,  1 },
+    [SCHED_FADD]  = { 4,  1 }, [SCHED_FMUL]  = { 4,  1 },
+    [SCHED_FDIV]  = { 12, 7 }, [SCHED_CVT]   = { 5,  1 },
+    [SCHED_CALL]  = { 1,  1 },
+};
+
+static SchedClass node_sched_class(TB_Node* n) {
+    if (should_rematerialize(n)) {
+        return SCHED_NONE;
+    }
+
+    switch (n->type) {
+        case TB_START: case TB_REGION: case TB_PHI: case TB_PROJ:
+        case TB_MERGEMEM: case TB_BITCAST:
+        return SCHED_NONE;
+
+        case TB_LOAD: case TB_READ: case TB_ATOMIC_LOAD:
+        return SCHED_LOAD;
+
+        case TB_STORE: case TB_WRITE:
+        return SCHED_STORE;
+
+        case TB_MUL: case TB_MULPAIR:
+        return SCHED_IMUL;
+
+        case TB_UDIV: case TB_SDIV: case TB_UMOD: case TB_SMOD:
+        return SCHED_DIV;
+
+        case TB_FADD: case TB_FSUB: case TB_FMAX: case TB_FMIN:
+        return SCHED_FADD;
+
+        case TB_FMUL:
+        return SCHED_FMUL;
+
+        case TB_FDIV:
+        return SCHED_FDIV;
+
+        case TB_INT2FLOAT: case TB_UINT2FLOAT: case TB_FLOAT2INT:
+        case TB_FLOAT2UINT: case TB_FLOAT_EXT:
+        return SCHED_CVT;
+
+        case TB_CALL: case TB_SYSCALL:
+        return SCHED_CALL;
+
+        default:
+        return SCHED_ALU;
+    }
+}
+
+static SchedCost node_sched_cost(void* user, TB_Node* n) {
+    return a64_sched_costs[node_sched_class(n)];
+}
+
+static SchedModel sched_model(Ctx* restrict ctx) {
+    // 26 allocatable GPRs minus a few for isel's temporaries
+    return (SchedModel){ ctx, node_sched_cost, 20 };
+}
+
+// where the index'th argument goes, the GPRs and FPRs are handed out
+// separately and everything past them takes 8 byte stack slots in order.
+// the aggregate return buffer (if any) is always in X8. returns -1 (and
+// the slot) if it's on the stack.
+static int param_location(const struct ParamDescriptor* restrict desc, TB_Node** args, bool indirect_ret, size_t index, int* out_slot) {
+    int gprs = 0, fprs = 0, slot = 0;
+    FOREACH_N(i, 0, index + 1) {
+        bool is_float = TB_IS_FLOAT_TYPE(args[i]->dt);
+
+        int reg = -1;
+        if (i == 0 && indirect_ret) {
+            reg = FIRST_GPR + X8;
+        } else if (is_float && fprs < desc->fpr_count) {
+            reg = FIRST_FPR + fprs++;
+        } else if (!is_float && gprs < desc->gpr_count) {
+            reg = FIRST_GPR + desc->gprs[gprs++];
+        }
+
+        if (i == index) {
+            *out_slot = reg < 0 ? slot : -1;
+            return reg;
+        }
+
+        if (reg < 0) slot++;
+    }
+
+    tb_unreachable();
+    return -1;
+}
+
+// popcnt with the usual SWAR trick, NEON has cnt but it's a round trip
+// through the vector registers which isn't any better for a single value:
+//   x = x - ((x >> 1) & 0x55..)
+//   x = (x & 0x33..) + ((x >> 2) & 0x33..)
+//   x = (x + (x >> 4)) & 0x0F..
+//   x = (x * 0x01..) >> (bits - 8)
+static void isel_popcnt(Ctx* restrict ctx, TB_DataType dt, int dst, int src) {
+    int t0 = DEF(NULL, dt), t1 = DEF(NULL, dt), x = DEF(NULL, dt);
+    SUBMIT(inst_op_rri(LSR, dt, t0, src, 1));
+    SUBMIT(inst_op_rr_abs(AND, dt, t1, t0, 0x5555555555555555ull));
+    SUBMIT(inst_op_rrr(SUB, dt, x, src, t1));
+
+    int t2 = DEF(NULL, dt), t3 = DEF(NULL, dt), t4 = DEF(NULL, dt), y = DEF(NULL, dt);
+    SUBMIT(inst_op_rri(LSR, dt, t2, x, 2));
+    SUBMIT(inst_op_rr_abs(AND, dt, t3, t2, 0x3333333333333333ull));
+    SUBMIT(inst_op_rr_abs(AND, dt, t4, x, 0x3333333333333333ull));
+    SUBMIT(inst_op_rrr(ADD, dt, y, t4, t3));
+
+    int t5 = DEF(NULL, dt), t6 = DEF(NULL, dt), z = DEF(NULL, dt);
+    SUBMIT(inst_op_rri(LSR, dt, t5, y, 4));
+    SUBMIT(inst_op_rrr(ADD, dt, t6, y, t5));
+    SUBMIT(inst_op_rr_abs(AND, dt, z, t6, 0x0F0F0F0F0F0F0F0Full));
+
+    int k = DEF(NULL, dt), w = DEF(NULL, dt);
+    SUBMIT(inst_op_abs(MOVI, dt, k, 0x0101010101010101ull));
+    SUBMIT(inst_op_rrr(MUL, dt, w, z, k));
+    SUBMIT(inst_op_rri(LSR, dt, dst, w, dt.data - 8));
+}
+
+static void isel(Ctx* restrict ctx, TB_Node* n, const int dst) {
+    TB_NodeTypeEnum type = n->type;
+    switch (type) {
+        case TB_PHI: break;
+        case TB_REGION: break;
+
+        case TB_POISON: {
+            Inst* inst = alloc_inst(INST_INLINE, TB_TYPE_VOID, 1, 0, 0);
+            inst->operands[0] = dst;
+            append_inst(ctx, inst);
+            break;
+        }
+
+        case TB_START: {
+            const TB_FunctionPrototype* restrict proto = ctx->f->prototype;
+            const struct ParamDescriptor* restrict desc = &param_descs[0];
+
+            // va_start needs the parameter registers spilled next to the stack
+            // parameters, we don't do that yet.
+            if (proto->has_varargs) {
+                tb_todo();
+            }
+
+            Inst* prev = ctx->head;
+
+            int out_count = 0;
+            RegIndex outs[16];
+
+            // handle known parameters
+            int used_gpr = 0, used_fpr = 0;
+            TB_Node** params = ctx->f->params;
+            FOREACH_N(i, 0, ctx->f->param_count) {
+                TB_Node* proj = params[3 + i];
+                bool is_float = proj->dt.type == TB_FLOAT;
+
+                int reg = -1;
+                if (i == 0 && proto->has_indirect_return) {
+                    reg = FIRST_GPR + X8;
+                } else if (is_float && used_fpr < desc->fpr_count) {
+                    reg = FIRST_FPR + used_fpr++;
+                } else if (!is_float && used_gpr < desc->gpr_count) {
+                    reg = FIRST_GPR + desc->gprs[used_gpr++];
+                }
+
+                // stack parameters are loaded by their PROJ
+                if (reg >= 0) {
+                    ValueDesc* v = lookup_val(ctx, proj);
+                    if (v != NULL) {
+                        assert(v->vreg < 0 && "shouldn't have been initialized yet?");
+                        v->vreg = DEF(proj, proj->dt);
+
+                        hint_reg(ctx, v->vreg, reg);
+                        SUBMIT(inst_move(proj->dt, v->vreg, reg));
+
+                        outs[out_count++] = reg;
+                    }
+                }
+            }
+
+            // insert INST_ENTRY (this is where parameter register come from)
+            Inst* entry_inst = alloc_inst(INST_ENTRY, TB_TYPE_I64, out_count, 0, 0);
+            memcpy(entry_inst->operands, outs, out_count * sizeof(RegIndex));
+
+            entry_inst->next = prev->next;
+            if (prev->next == NULL) {
+                ctx->head = entry_inst;
+            }
+            prev->next = entry_inst;
+            break;
+        }
+
+        case TB_INTEGER_CONST: {
+            uint64_t x = TB_NODE_GET_EXTRA_T(n, TB_NodeInt)->value;
+
+            // the optimizer might hand us float typed integers, those are
+            // just the raw bits.
+            if (n->dt.type == TB_FLOAT) {
+                if (x == 0) {
+                    SUBMIT(inst_op_zero(n->dt, dst));
+                } else {
+                    TB_DataType int_dt = n->dt.data == TB_FLT_64 ? TB_TYPE_I64 : TB_TYPE_I32;
+                    int tmp = DEF(NULL, int_dt);
+                    SUBMIT(inst_op_abs(MOVI, int_dt, tmp, x));
+                    SUBMIT(inst_op_rr(FMOV_I2F, n->dt, dst, tmp));
+                }
+                break;
+            }
+
+            // mask off bits
+            uint64_t bits_in_type = n->dt.type == TB_PTR ? 64 : n->dt.data;
+            if (bits_in_type < 64) {
+                x &= (1ull << bits_in_type) - 1;
+            }
+
+            SUBMIT(inst_op_abs(MOVI, n->dt, dst, x));
+            break;
+        }
+
+        case TB_SELECT: {
+            assert(n->dt.type != TB_FLOAT);
+            int lhs = input_reg(ctx, n->inputs[2]);
+            int rhs = input_reg(ctx, n->inputs[3]);
+
+            Cond cc = isel_cmp(ctx, n->inputs[1]);
+            SUBMIT(inst_op_rrr(CSEL_EQ + cc, n->dt, dst, lhs, rhs));
+            break;
+        }
+
+        case TB_AND:
+        case TB_OR:
+        case TB_XOR:
+        case TB_ADD:
+        case TB_SUB: {
+            const static InstType ops[] = { AND, ORR, EOR, ADD, SUB };
+            InstType op = ops[type - TB_AND];
+
+            TB_DataType dt = widen_narrow(n->dt);
+            int lhs = input_reg(ctx, n->inputs[1]);
+
+            int64_t x;
+            uint32_t bitmask;
+            bool is_64bit = legalize(dt) == A64_TYPE_I64;
+            if (try_for_const(n->inputs[2], true, &x) && type >= TB_ADD && x > -4096 && x < 4096) {
+                use(ctx, n->inputs[2]);
+                SUBMIT(inst_op_rri(op, dt, dst, lhs, x));
+            } else if (try_for_const(n->inputs[2], true, &x) && type < TB_ADD && encode_bitmask(x, is_64bit, &bitmask)) {
+                use(ctx, n->inputs[2]);
+                SUBMIT(inst_op_rr_abs(op, dt, dst, lhs, x));
+            } else if (try_for_const(n->inputs[2], false, &x) && type < TB_ADD && encode_bitmask(x, is_64bit, &bitmask)) {
+                // the zero extended form might be the one which fits
+                use(ctx, n->inputs[2]);
+                SUBMIT(inst_op_rr_abs(op, dt, dst, lhs, x));
+            } else {
+                int rhs = input_reg(ctx, n->inputs[2]);
+                SUBMIT(inst_op_rrr(op, dt, dst, lhs, rhs));
+            }
+            break;
+        }
+
+        case TB_MUL: {
+            // garbage in the top bits doesn't matter as long as we don't read them
+            TB_DataType dt = widen_narrow(n->dt);
+            assert(dt.type == TB_INT || dt.type == TB_PTR);
+
+            int lhs = input_reg(ctx, n->inputs[1]);
+            int rhs = input_reg(ctx, n->inputs[2]);
+            SUBMIT(inst_op_rrr(MUL, dt, dst, lhs, rhs));
+            break;
+        }
+        case TB_MULPAIR: {
+            // returns into both lo and hi
+            TB_NodeArithPair* p = TB_NODE_GET_EXTRA(n);
+            TB_DataType dt = p->lo->dt;
+            assert(dt.type == TB_INT);
+
+            if (dt.data == 64) {
+                int lhs = input_reg(ctx, n->inputs[1]);
+                int rhs = input_reg(ctx, n->inputs[2]);
+
+                int lo = has_users(ctx, p->lo) ? input_reg(ctx, p->lo) : DEF(NULL, dt);
+                int hi = has_users(ctx, p->hi) ? input_reg(ctx, p->hi) : DEF(NULL, dt);
+                SUBMIT(inst_op_rrr(MUL, dt, lo, lhs, rhs));
+                SUBMIT(inst_op_rrr(UMULH, dt, hi, lhs, rhs));
+            } else if (dt.data <= 32) {
+                // the whole product fits into a 64bit multiply
+                int lhs = input_reg(ctx, n->inputs[1]);
+                int rhs = input_reg(ctx, n->inputs[2]);
+
+                int a = DEF(NULL, TB_TYPE_I64), b = DEF(NULL, TB_TYPE_I64), prod = DEF(NULL, TB_TYPE_I64);
+                Inst* inst = inst_op_rr(ZEXT, TB_TYPE_I64, a, lhs);
+                inst->imm = dt.data;
+                SUBMIT(inst);
+                inst = inst_op_rr(ZEXT, TB_TYPE_I64, b, rhs);
+                inst->imm = dt.data;
+                SUBMIT(inst);
+                SUBMIT(inst_op_rrr(MUL, TB_TYPE_I64, prod, a, b));
+
+                int lo = has_users(ctx, p->lo) ? input_reg(ctx, p->lo) : DEF(NULL, dt);
+                int hi = has_users(ctx, p->hi) ? input_reg(ctx, p->hi) : DEF(NULL, dt);
+                SUBMIT(inst_move(dt, lo, prod));
+                SUBMIT(inst_op_rri(LSR, TB_TYPE_I64, hi, prod, dt.data));
+            } else {
+                tb_todo();
+            }
+            break;
+        }
+
+        // bit magic
+        case TB_BSWAP: {
+            TB_DataType dt = n->dt;
+            int src = input_reg(ctx, n->inputs[1]);
+            if (dt.type == TB_INT && dt.data <= 8) {
+                SUBMIT(inst_move(dt, dst, src));
+            } else {
+                SUBMIT(inst_op_rr(REV, dt, dst, src));
+            }
+            break;
+        }
+        case TB_CTZ:
+        case TB_CLZ:
+        case TB_POPCNT: {
+            // the result is always an i32 but the op is as wide as the source
+            TB_DataType src_dt = n->inputs[1]->dt;
+            TB_DataType dt = widen_narrow(src_dt);
+            int bits = src_dt.data;
+
+            // clz and popcnt need the bits above the type zero'd, ctz
+            // doesn't care (beyond the zero case)
+            int src = type == TB_CTZ ? input_reg(ctx, n->inputs[1]) : isel_extend(ctx, n->inputs[1], false);
+
+            if (type == TB_POPCNT) {
+                isel_popcnt(ctx, dt, dst, src);
+            } else if (type == TB_CTZ) {
+                int tmp = DEF(NULL, dt);
+                SUBMIT(inst_op_rr(RBIT, dt, tmp, src));
+                SUBMIT(inst_op_rr(CLZ, dt, dst, tmp));
+            } else if (bits < 32) {
+                int tmp = DEF(NULL, dt);
+                SUBMIT(inst_op_rr(CLZ, dt, tmp, src));
+                SUBMIT(inst_op_rri(SUB, dt, dst, tmp, 32 - bits));
+            } else {
+                SUBMIT(inst_op_rr(CLZ, dt, dst, src));
+            }
+            break;
+        }
+
+        // bit shifts
+        case TB_SHL:
+        case TB_SHR:
+        case TB_SAR:
+        case TB_ROL:
+        case TB_ROR: {
+            const static InstType ops[] = { LSL, LSR, ASR, ROR, ROR };
+            InstType op = ops[type - TB_SHL];
+
+            TB_DataType dt = widen_narrow(n->dt);
+            if (n->dt.type == TB_INT && n->dt.data < 32 && type >= TB_ROL) {
+                tb_todo(); // narrow rotates need to be pieced together
+            }
+
+            // right shifts pull in the bits above the type
+            int lhs = type == TB_SHR || type == TB_SAR ? isel_extend(ctx, n->inputs[1], type == TB_SAR) : input_reg(ctx, n->inputs[1]);
+            int width = legalize(dt) == A64_TYPE_I64 ? 64 : 32;
+
+            int64_t x;
+            if (try_for_const(n->inputs[2], false, &x)) {
+                use(ctx, n->inputs[2]);
+
+                int amt = x & (width - 1);
+                if (type == TB_ROL) {
+                    amt = (width - amt) & (width - 1);
+                }
+
+                SUBMIT(inst_op_rri(op, dt, dst, lhs, amt));
+                break;
+            }
+
+            // the variable shifts only look at the bottom bits of the amount
+            int rhs = input_reg(ctx, n->inputs[2]);
+            if (type == TB_ROL) {
+                int tmp = DEF(NULL, dt);
+                SUBMIT(inst_op_rr(NEG, dt, tmp, rhs));
+                rhs = tmp;
+            }
+
+            SUBMIT(inst_op_rrr(op, dt, dst, lhs, rhs));
+            break;
+        }
+
+        case TB_UDIV:
+        case TB_SDIV:
+        case TB_UMOD:
+        case TB_SMOD: {
+            bool is_signed = (type == TB_SDIV || type == TB_SMOD);
+            bool is_div    = (type == TB_UDIV || type == TB_SDIV);
+
+            // division is scaled up to 32bit
+            TB_DataType dt = widen_narrow(n->dt);
+            assert(dt.type == TB_INT);
+
+            int lhs = isel_extend(ctx, n->inputs[1], is_signed);
+            int rhs = isel_extend(ctx, n->inputs[2], is_signed);
+
+            if (is_div) {
+                SUBMIT(inst_op_rrr(is_signed ? SDIV : UDIV, dt, dst, lhs, rhs));
+            } else {
+                // a - (a / b)*b
+                int q = DEF(NULL, dt);
+                SUBMIT(inst_op_rrr(is_signed ? SDIV : UDIV, dt, q, lhs, rhs));
+
+                Inst* inst = alloc_inst(MSUB, dt, 1, 3, 0);
+                inst->operands[0] = dst;
+                inst->operands[1] = q;
+                inst->operands[2] = rhs;
+                inst->operands[3] = lhs;
+                SUBMIT(inst);
+            }
+            break;
+        }
+
+        // there's an fmov for some immediates but it's a tiny set, going
+        // through a GPR is always 2 or 3 instructions and doesn't touch memory.
+        case TB_FLOAT32_CONST: {
+            assert(n->dt.type == TB_FLOAT);
+            uint32_t imm = (Cvt_F32U32) { .f = TB_NODE_GET_EXTRA_T(n, TB_NodeFloat32)->value }.i;
+
+            if (imm == 0) {
+                SUBMIT(inst_op_zero(n->dt, dst));
+            } else {
+                int tmp = DEF(NULL, TB_TYPE_I32);
+                SUBMIT(inst_op_abs(MOVI, TB_TYPE_I32, tmp, imm));
+                SUBMIT(inst_op_rr(FMOV_I2F, n->dt, dst, tmp));
+            }
+            break;
+        }
+        case TB_FLOAT64_CONST: {
+            assert(n->dt.type == TB_FLOAT);
+            uint64_t imm = (Cvt_F64U64){ .f = TB_NODE_GET_EXTRA_T(n, TB_NodeFloat64)->value }.i;
+
+            if (imm == 0) {
+                SUBMIT(inst_op_zero(n->dt, dst));
+            } else {
+                int tmp = DEF(NULL, TB_TYPE_I64);
+                SUBMIT(inst_op_abs(MOVI, TB_TYPE_I64, tmp, imm));
+                SUBMIT(inst_op_rr(FMOV_I2F, n->dt, dst, tmp));
+            }
+            break;
+        }
+        case TB_FLOAT_EXT: {
+            int src = input_reg(ctx, n->inputs[1]);
+            SUBMIT(inst_op_rr(FCVT, n->inputs[1]->dt, dst, src));
+            break;
+        }
+        case TB_NEG:
+        case TB_NOT: {
+            int src = input_reg(ctx, n->inputs[1]);
+            if (n->dt.type != TB_FLOAT) {
+                SUBMIT(inst_op_rr(type == TB_NOT ? MVN : NEG, n->dt, dst, src));
+            } else if (type == TB_NEG) {
+                SUBMIT(inst_op_rr(FNEG, n->dt, dst, src));
+            } else {
+                tb_todo();
+            }
+            break;
+        }
+        case TB_FADD:
+        case TB_FSUB:
+        case TB_FMUL:
+        case TB_FDIV:
+        case TB_FMAX:
+        case TB_FMIN: {
+            const static InstType ops[] = { FADD, FSUB, FMUL, FDIV, FMAX, FMIN };
+
+            int lhs = input_reg(ctx, n->inputs[1]);
+            int rhs = input_reg(ctx, n->inputs[2]);
+            SUBMIT(inst_op_rrr(ops[type - TB_FADD], n->dt, dst, lhs, rhs));
+            break;
+        }
+        case TB_UINT2FLOAT:
+        case TB_INT2FLOAT: {
+            TB_DataType src_dt = n->inputs[1]->dt;
+            assert(src_dt.type == TB_INT);
+
+            int src = isel_extend(ctx, n->inputs[1], type == TB_INT2FLOAT);
+            Inst* inst = inst_op_rr(type == TB_INT2FLOAT ? SCVTF : UCVTF, n->dt, dst, src);
+            inst->scale = src_dt.data > 32;
+            SUBMIT(inst);
+            break;
+        }
+
+        case TB_FLOAT2INT:
+        case TB_FLOAT2UINT: {
+            TB_DataType src_dt = n->inputs[1]->dt;
+            assert(src_dt.type == TB_FLOAT);
+
+            int src = input_reg(ctx, n->inputs[1]);
+            Inst* inst = inst_op_rr(type == TB_FLOAT2INT ? FCVTZS : FCVTZU, n->dt, dst, src);
+            inst->scale = src_dt.data == TB_FLT_64;
+            SUBMIT(inst);
+            break;
+        }
+
+        // pointer arithmatic
+        case TB_LOCAL:
+        case TB_VA_START:
+        case TB_MEMBER_ACCESS:
+        case TB_ARRAY_ACCESS: {
+            SUBMIT(isel_addr(ctx, n, dst, -1, -1));
+            break;
+        }
+
+        // bitcasting
+        case TB_BITCAST: {
+            TB_DataType src_dt = n->inputs[1]->dt;
+            int src = input_reg(ctx, n->inputs[1]);
+
+            if (src_dt.type == TB_FLOAT && n->dt.type != TB_FLOAT) {
+                SUBMIT(inst_op_rr(FMOV_F2I, n->dt, dst, src));
+            } else if (src_dt.type != TB_FLOAT && n->dt.type == TB_FLOAT) {
+                SUBMIT(inst_op_rr(FMOV_I2F, n->dt, dst, src));
+            } else {
+                SUBMIT(inst_move(n->dt, dst, src));
+            }
+            break;
+        }
+
+        // downcasting
+        case TB_PTR2INT:
+        case TB_TRUNCATE: {
+            int src = input_reg(ctx, n->inputs[1]);
+
+            if (n->dt.type == TB_FLOAT) {
+                SUBMIT(inst_op_rr(FCVT, n->inputs[1]->dt, dst, src));
+            } else {
+                SUBMIT(inst_move(n->dt, dst, src));
+            }
+            break;
+        }
+
+        // upcasting
+        case TB_INT2PTR:
+        case TB_SIGN_EXT:
+        case TB_ZERO_EXT: {
+            TB_Node* src = n->inputs[1];
+            bool sign_ext = (type == TB_SIGN_EXT);
+            int bits_in_type = src->dt.type == TB_PTR ? 64 : src->dt.data;
+
+            int64_t x;
+            if (try_for_const(src, sign_ext, &x)) {
+                use(ctx, src);
+
+                // try_for_const doesn't zero extend the >=32bit types
+                uint64_t y = x;
+                if (!sign_ext && bits_in_type < 64) {
+                    y &= ~UINT64_C(0) >> (64 - bits_in_type);
+                }
+
+                int dst_bits = n->dt.type == TB_PTR ? 64 : n->dt.data;
+                if (dst_bits < 64) {
+                    y &= (1ull << dst_bits) - 1;
+                }
+
+                SUBMIT(inst_op_abs(MOVI, n->dt, dst, y));
+            } else {
+                int val = input_reg(ctx, src);
+                if (src->dt.type != TB_INT || bits_in_type >= 64) {
+                    SUBMIT(inst_move(n->dt, dst, val));
+                } else {
+                    Inst* inst = inst_op_rr(sign_ext ? SEXT : ZEXT, n->dt, dst, val);
+                    inst->imm = bits_in_type;
+                    SUBMIT(inst);
+                }
+            }
+            break;
+        }
+
+        case TB_TAILCALL:
+        case TB_SYSCALL:
+        case TB_CALL: {
+            const struct ParamDescriptor* restrict desc = &param_descs[type == TB_SYSCALL ? 1 : 0];
+            const TB_FunctionPrototype* restrict proto = TB_NODE_GET_EXTRA_T(n, TB_NodeCall)->proto;
+
+            // tail calls have the RPC before the target
+            size_t first_arg = type == TB_TAILCALL ? 4 : 3;
+            bool is_tail = type == TB_TAILCALL;
+
+            // returns come back in X0, X1 and V0-V3 in order, more than one
+            // is a struct in a register pair or an HFA. the callee returns
+            // straight to our caller on tail calls.
+            int ret_count = 0;
+            TB_Node* ret_nodes[4];
+            int ret_vals[4], ret_regs[4];
+            if (!is_tail) {
+                TB_Node** projs = TB_NODE_GET_EXTRA_T(n, TB_NodeCall)->projs;
+                size_t proj_count = proto != NULL && proto->return_count > 1 ? proto->return_count : 1;
+                assert(proj_count <= 4);
+
+                int gprs_ret = 0, fprs_ret = 0;
+                FOREACH_N(i, 0, proj_count) {
+                    TB_Node* proj = projs[2 + i];
+                    if (proj == NULL) continue;
+
+                    int reg = TB_IS_FLOAT_TYPE(proj->dt) ? FIRST_FPR + V0 + fprs_ret++ : FIRST_GPR + X0 + gprs_ret++;
+                    if (has_users(ctx, proj)) {
+                        ret_nodes[ret_count] = proj;
+                        ret_vals[ret_count] = input_reg(ctx, proj);
+                        ret_regs[ret_count] = reg;
+                        ret_count += 1;
+                    }
+                }
+            }
+
+            TB_DataType ret_dt = ret_count ? ret_nodes[0]->dt : TB_TYPE_VOID;
+
+            uint32_t caller_saved_gprs = desc->caller_saved_gprs;
+            uint32_t caller_saved_fprs = desc->caller_saved_fprs;
+
+            // parameter passing is separate from eval from regalloc reasons
+            size_t in_count = 0;
+            RegIndex ins[64];
+            RegIndex param_srcs[64];
+            TB_DataType param_dts[64];
+
+            int fprs_used = 0, gprs_used = 0, stack_slots = 0;
+            FOREACH_N(i, first_arg, n->input_count) {
+                TB_Node* param = n->inputs[i];
+                bool use_fpr = TB_IS_FLOAT_TYPE(param->dt);
+
+                int phys_reg = -1;
+                if (i == first_arg && proto != NULL && proto->has_indirect_return) {
+                    // aggregate return buffer
+                    phys_reg = X8;
+                } else if (use_fpr && fprs_used < desc->fpr_count) {
+                    phys_reg = fprs_used++;
+                } else if (!use_fpr && gprs_used < desc->gpr_count) {
+                    phys_reg = desc->gprs[gprs_used++];
+                }
+
+                // first few parameters are passed as inputs to the CALL instruction.
+                // the rest are written into the stack in order.
+                RegIndex src = input_reg(ctx, param);
+                if (phys_reg < 0) {
+                    if (is_tail) {
+                        tb_panic("tail call needs stack arguments, those aren't supported yet\n");
+                    }
+
+                    SUBMIT(inst_op_mr(STR, param->dt, FIRST_GPR + SP, -1, SCALE_X1, stack_slots * 8, src));
+                    stack_slots += 1;
+                } else {
+                    int dst = (use_fpr ? FIRST_FPR : FIRST_GPR) + phys_reg;
+                    hint_reg(ctx, src, dst);
+
+                    param_srcs[in_count] = src;
+                    param_dts[in_count] = param->dt;
+                    ins[in_count] = dst;
+                    in_count += 1;
+
+                    if (use_fpr) {
+                        caller_saved_fprs &= ~(1u << phys_reg);
+                    } else {
+                        caller_saved_gprs &= ~(1u << phys_reg);
+                    }
+                }
+            }
+
+            // outgoing stack arguments live at the bottom of our frame
+            if (ctx->caller_usage < stack_slots) {
+                ctx->caller_usage = stack_slots;
+            }
+
+            // perform last minute copies (this avoids keeping parameter registers alive for too long)
+            FOREACH_N(i, 0, in_count) {
+                SUBMIT(inst_move(param_dts[i], ins[i], param_srcs[i]));
+            }
+
+            // compute the target (unless it's a symbol) before the
+            // registers all need to be forcibly shuffled
+            TB_Node* target = n->inputs[first_arg - 1];
+            bool static_call = n->type != TB_SYSCALL && target->type == TB_SYMBOL;
+
+            int target_val = FIRST_GPR + GLOBAL_BASE; // placeholder really
+            if (!static_call) {
+                target_val = input_reg(ctx, target);
+
+                // callee saved registers are reloaded right before the jump so
+                // the target can't stay in one of those, X9 isn't a param.
+                if (is_tail) {
+                    hint_reg(ctx, target_val, FIRST_GPR + X9);
+                    SUBMIT(inst_move(TB_TYPE_PTR, FIRST_GPR + X9, target_val));
+                    target_val = FIRST_GPR + X9;
+                }
+            }
+
+            if (type == TB_SYSCALL) {
+                ins[in_count++] = FIRST_GPR + X8;
+                hint_reg(ctx, target_val, X8);
+                SUBMIT(inst_move(target->dt, X8, target_val));
+            }
+
+            FOREACH_N(i, 0, ret_count) {
+                if (ret_regs[i] >= FIRST_FPR) {
+                    caller_saved_fprs &= ~(1u << (ret_regs[i] - FIRST_FPR));
+                } else {
+                    caller_saved_gprs &= ~(1u << (ret_regs[i] - FIRST_GPR));
+                }
+            }
+
+            size_t clobber_count = tb_popcount(caller_saved_gprs) + tb_popcount(caller_saved_fprs);
+
+            Inst* call_inst;
+            if (is_tail) {
+                // we never come back so there's nothing to clobber or return
+                call_inst = alloc_inst(static_call ? B : BR, TB_TYPE_VOID, 0, 1 + in_count, 0);
+                call_inst->flags |= INST_TAIL;
+            } else {
+                call_inst = alloc_inst(n->type == TB_CALL ? CALL : SYSCALL, ret_dt, ret_count ? ret_count : 1, 1 + in_count, clobber_count);
+
+                // mark clobber list
+                {
+                    RegIndex* clobbers = &call_inst->operands[call_inst->out_count + call_inst->in_count];
+                    FOREACH_N(i, 0, 32) if (caller_saved_gprs & (1u << i)) {
+                        *clobbers++ = FIRST_GPR + i;
+                    }
+
+                    FOREACH_N(i, 0, 32) if (caller_saved_fprs & (1u << i)) {
+                        *clobbers++ = FIRST_FPR + i;
+                    }
+                }
+
+                // return values (X0 when there's none)
+                call_inst->operands[0] = FIRST_GPR + X0;
+                FOREACH_N(i, 0, ret_count) {
+                    call_inst->operands[i] = ret_regs[i];
+                }
+            }
+
+            // write inputs
+            RegIndex* dst_ins = &call_inst->operands[call_inst->out_count];
+            if (static_call) {
+                call_inst->flags |= INST_GLOBAL;
+                call_inst->mem_slot = call_inst->out_count;
+                call_inst->s = TB_NODE_GET_EXTRA_T(target, TB_NodeSymbol)->sym;
+            }
+
+            *dst_ins++ = target_val;
+            memcpy(dst_ins, ins, in_count * sizeof(RegIndex));
+
+            SUBMIT(call_inst);
+
+            // copy out returns
+            FOREACH_N(i, 0, ret_count) {
+                hint_reg(ctx, ret_vals[i], ret_regs[i]);
+                SUBMIT(inst_move(ret_nodes[i]->dt, ret_vals[i], ret_regs[i]));
+            }
+            break;
+        }
+
+        case TB_CMP_EQ:
+        case TB_CMP_NE:
+        case TB_CMP_SLT:
+        case TB_CMP_SLE:
+        case TB_CMP_ULT:
+        case TB_CMP_ULE:
+        case TB_CMP_FLT:
+        case TB_CMP_FLE: {
+            Cond cc = isel_cmp(ctx, n);
+            SUBMIT(inst_op_r(CSET_EQ + cc, TB_TYPE_I8, dst));
+            break;
+        }
+
+        case TB_BRANCH: {
+            TB_NodeBranch* br = TB_NODE_GET_EXTRA(n);
+
+            // the arena on the function should also be available at this time, we're
+            // in the TB_Passes
+            TB_Arena* arena = ctx->f->arena;
+            TB_ArenaSavepoint sp = tb_arena_save(arena);
+            TB_Node** restrict succ = tb_arena_alloc(arena, br->succ_count * sizeof(TB_Node**));
+
+            // fill successors
+            for (User* u = n->users; u; u = u->next) {
+                if (u->n->type == TB_PROJ) {
+                    int index = TB_NODE_GET_EXTRA_T(u->n, TB_NodeProj)->index;
+                    succ[index] = cfg_get_fallthru(u->n);
+                }
+            }
+
+            SUBMIT(alloc_inst(INST_TERMINATOR, TB_TYPE_VOID, 0, 0, 0));
+            if (br->succ_count == 1) {
+                if (ctx->fallthrough != succ[0]) {
+                    SUBMIT(inst_jmp(succ[0]));
+                }
+            } else if (br->succ_count == 2 && br->keys[0] == 0) {
+                // if-like branch
+                Cond cc = isel_cmp(ctx, n->inputs[1]);
+
+                // if flipping avoids a jmp, do that
+                TB_Node *f = succ[0], *t = succ[1];
+                if (ctx->fallthrough == f) {
+                    SUBMIT(inst_bcond(t, cc ^ 1));
+                } else {
+                    SUBMIT(inst_bcond(f, cc));
+
+                    if (ctx->fallthrough != t) {
+                        SUBMIT(inst_jmp(t));
+                    }
+                }
+            } else {
+                // no jump tables yet, it's an if-else chain
+                TB_DataType key_dt = n->inputs[1]->dt;
+                TB_DataType dt = widen_narrow(key_dt);
+                int bits = key_dt.type == TB_PTR ? 64 : key_dt.data;
+
+                int key = isel_extend(ctx, n->inputs[1], false);
+                FOREACH_N(i, 1, br->succ_count) {
+                    uint64_t curr_key = br->keys[i-1];
+                    if (bits < 32) {
+                        curr_key &= (1ull << bits) - 1;
+                    } else if (bits == 32) {
+                        curr_key = (int32_t) curr_key;
+                    }
+
+                    isel_cmp_imm(ctx, dt, key, curr_key);
+                    SUBMIT(inst_bcond(succ[i], EQ));
+                }
+                SUBMIT(inst_jmp(succ[0]));
+            }
+            tb_arena_restore(arena, sp);
+            break;
+        }
+
+        case TB_DEBUGBREAK: {
+            SUBMIT(alloc_inst(DEBUGBREAK, TB_TYPE_VOID, 0, 0, 0));
+            break;
+        }
+
+        case TB_UNREACHABLE:
+        case TB_TRAP: {
+            SUBMIT(alloc_inst(TRAP, TB_TYPE_VOID, 0, 0, 0));
+            break;
+        }
+
+        case TB_SYMBOL: {
+            TB_NodeSymbol* s = TB_NODE_GET_EXTRA(n);
+            SUBMIT(inst_op_global(LEA, n->dt, dst, s->sym));
+            break;
+        }
+        case TB_LOAD: {
+            Inst* ld_inst = isel_addr2(ctx, n->inputs[2], dst, -1, -1);
+            ld_inst->type = LDR;
+            ld_inst->dt = legalize(n->dt);
+            SUBMIT(ld_inst);
+            break;
+        }
+        case TB_ATOMIC_LOAD: {
+            TB_Node* proj = find_data_proj(n);
+            if (proj == NULL) {
+                // nobody reads it, the load still happens for the ordering
+                proj = TB_NODE_GET_EXTRA_T(n, TB_NodeAtomic)->proj1;
+            }
+
+            TB_DataType dt = proj->dt;
+            if (dt.type == TB_FLOAT) {
+                tb_todo();
+            }
+
+            int addr = isel_addr_reg(ctx, n->inputs[2]);
+            int val = has_users(ctx, proj) ? input_reg(ctx, proj) : DEF(NULL, dt);
+            SUBMIT(inst_op_rr(LDAR, dt, val, addr));
+            break;
+        }
+        case TB_SAFEPOINT_POLL: {
+            TB_Node* addr = n->inputs[2];
+
+            // force uses of the inputs
+            FOREACH_N(i, 3, n->input_count) {
+                input_reg(ctx, n->inputs[i]);
+            }
+
+            // ldr wtmp, [poll_site]
+            int tmp = DEF(n, TB_TYPE_I32);
+            Inst* ld_inst = isel_addr2(ctx, addr, tmp, -1, -1);
+            ld_inst->type = LDR;
+            ld_inst->dt = A64_TYPE_I32;
+            SUBMIT(ld_inst);
+            break;
+        }
+
+        case TB_STORE: {
+            if (dst >= 0) {
+                use(ctx, n->inputs[2]);
+                use(ctx, n->inputs[3]);
+                break;
+            }
+
+            TB_Node* addr = n->inputs[2];
+            TB_Node* src = n->inputs[3];
+
+            // storing zero can just use the zero register
+            int src_reg;
+            if (src->type == TB_INTEGER_CONST && TB_NODE_GET_EXTRA_T(src, TB_NodeInt)->value == 0) {
+                use(ctx, src);
+                src_reg = FIRST_GPR + ZR;
+            } else {
+                src_reg = input_reg(ctx, src);
+            }
+
+            Inst* st_inst = isel_addr2(ctx, addr, dst, STR, src_reg);
+            st_inst->dt = legalize(src->dt);
+            assert(st_inst->flags & (INST_MEM | INST_GLOBAL));
+            SUBMIT(st_inst);
+            break;
+        }
+        case TB_MEMSET: {
+            // the pointer and count are consumed by the loop so it gets copies
+            int d = DEF(NULL, TB_TYPE_PTR);
+            int c = DEF(NULL, TB_TYPE_I64);
+            SUBMIT(inst_move(TB_TYPE_PTR, d, input_reg(ctx, n->inputs[2])));
+            int v = input_reg(ctx, n->inputs[3]);
+            SUBMIT(inst_move(TB_TYPE_I64, c, input_reg(ctx, n->inputs[4])));
+
+            Inst* i = alloc_inst(MEMSET, TB_TYPE_VOID, 2, 3, 0);
+            i->operands[0] = d;
+            i->operands[1] = c;
+            i->operands[2] = d;
+            i->operands[3] = v;
+            i->operands[4] = c;
+            SUBMIT(i);
+            break;
+        }
+        case TB_MEMCPY: {
+            int d = DEF(NULL, TB_TYPE_PTR);
+            int s = DEF(NULL, TB_TYPE_PTR);
+            int c = DEF(NULL, TB_TYPE_I64);
+            SUBMIT(inst_move(TB_TYPE_PTR, d, input_reg(ctx, n->inputs[2])));
+            SUBMIT(inst_move(TB_TYPE_PTR, s, input_reg(ctx, n->inputs[3])));
+            SUBMIT(inst_move(TB_TYPE_I64, c, input_reg(ctx, n->inputs[4])));
+
+            Inst* i = alloc_inst(MEMCPY, TB_TYPE_VOID, 3, 3, 0);
+            i->operands[0] = d;
+            i->operands[1] = s;
+            i->operands[2] = c;
+            i->operands[3] = d;
+            i->operands[4] = s;
+            i->operands[5] = c;
+            SUBMIT(i);
+            break;
+        }
+
+        case TB_END: {
+            // same registers as the call side, X0 & X1 then V0-V3 in order
+            assert(n->input_count <= 3 + 4 && "too many returns");
+
+            int gprs_ret = 0, fprs_ret = 0;
+            FOREACH_N(i, 3, n->input_count) {
+                int src = input_reg(ctx, n->inputs[i]);
+
+                // copy to return register
+                TB_DataType dt = n->inputs[i]->dt;
+                int ret_reg = dt.type == TB_FLOAT ? FIRST_FPR + V0 + fprs_ret++ : FIRST_GPR + X0 + gprs_ret++;
+                hint_reg(ctx, src, ret_reg);
+                SUBMIT(inst_move(dt, ret_reg, src));
+            }
+
+            // we don't really need a fence if we're about to exit but we do
+            // need to mark that it's the epilogue to tell regalloc where callee
+            // regs need to get restored.
+            append_inst(ctx, alloc_inst(INST_EPILOGUE, TB_TYPE_VOID, 0, 0, 0));
+            break;
+        }
+
+        case TB_MACHINE_OP: {
+            TB_NodeMachineOp* mach = TB_NODE_GET_EXTRA(n);
+            size_t total = mach->outs + mach->ins + mach->tmps;
+
+            if (total == 0) tb_todo();
 
-typedef struct Ctx Ctx;
+            Inst* inst = alloc_inst(INST_INLINE, TB_TYPE_VOID, mach->outs, mach->ins, mach->tmps);
+            memcpy(inst->operands, mach->regs, total * sizeof(TB_PhysicalReg));
+            append_inst(ctx, inst);
+            break;
+        }
 
-enum {
-    AARCH64_REG_CLASS_GPR
-};
+        // atomic RMW, these are all exclusive load/store loops
+        case TB_ATOMIC_XCHG:
+        case TB_ATOMIC_ADD:
+        case TB_ATOMIC_SUB:
+        case TB_ATOMIC_AND:
+        case TB_ATOMIC_XOR:
+        case TB_ATOMIC_OR: {
+            TB_Node* proj = find_data_proj(n);
+            TB_DataType dt = n->inputs[3]->dt;
+            if (dt.type == TB_FLOAT) {
+                tb_todo();
+            }
 
-// Xn refers to the 64bit variants of the registers,
-// usually the 32bit aliases are Wn (we don't have enums
-// for them because it's not that important, they're equal)
-typedef enum {
-    X0,  X1,   X2,  X3,  X4,  X5,  X6,  X7,
-    X8,  X9,  X10, X11, X12, X13, X14, X15,
-    X16, X17, X18, X19, X20, X21, X22, X23,
-    X24, X25, X26, X27, X28, X29, X30,
+            int old = proj && has_users(ctx, proj) ? input_reg(ctx, proj) : DEF(NULL, dt);
+
+            int addr = isel_addr_reg(ctx, n->inputs[2]);
+            int src = input_reg(ctx, n->inputs[3]);
+
+            // the loop reads the address and source again after loading the old
+            // value so they can't share a register with it, listing them as temps
+            // keeps them alive past the start of the output.
+            Inst* inst = alloc_inst(RMW_XCHG + (type - TB_ATOMIC_XCHG), dt, 1, 2, 2);
+            inst->operands[0] = old;
+            inst->operands[1] = addr;
+            inst->operands[2] = src;
+            inst->operands[3] = addr;
+            inst->operands[4] = src;
+            SUBMIT(inst);
+            break;
+        }
 
-    // It's context specific because ARM lmao
-    ZR = 0x1F, SP = 0x1F,
+        case TB_CYCLE_COUNTER: {
+            // mrs dst, cntvct_el0
+            SUBMIT(inst_op_r(MRS, TB_TYPE_I64, dst));
+            break;
+        }
+
+        case TB_PROJ: {
+            if (n->inputs[0]->type == TB_START) {
+                int index = TB_NODE_GET_EXTRA_T(n, TB_NodeProj)->index - 3;
+
+                // past the parameter registers, it's all stack (above the frame record)
+                int slot;
+                if (index >= 0 && param_location(&param_descs[0], &ctx->f->params[3], ctx->f->prototype->has_indirect_return, index, &slot) < 0) {
+                    SUBMIT(inst_op_rm(LDR, n->dt, dst, FIRST_GPR + FP, -1, SCALE_X1, 16 + slot*8));
+                }
+            }
+            break;
+        }
 
-    // not a real gpr
-    GPR_NONE = -1,
-} GPR;
+        default: tb_todo();
+    }
+}
 
-// refers to the data processing immediate operand.
-// Aarch64 has a bunch of weird immediate fields so
-// we might wanna rename this later.
+////////////////////////////////
+// Emitting
+////////////////////////////////
 typedef struct {
-    uint16_t imm;
-    uint8_t shift;
-} Immediate;
-
-typedef enum ValType {
-    VAL_NONE,
-    VAL_FLAGS,
-    VAL_GPR,
-    VAL_FPR,
-    VAL_IMM,
-    VAL_MEM,
-    VAL_GLOBAL,
-} ValType;
+    int base, index;
+    int scale;
+    int32_t disp;
+    TB_Symbol* sym;
+} MemOp;
 
 typedef struct {
-    int8_t type;
+    uint32_t pos;
+    TB_Node* target;
+} BranchFixup;
+
+static int op_reg(Ctx* restrict ctx, Inst* inst, int i) {
+    LiveInterval* interval = &ctx->intervals[inst->operands[i]];
+    tb_assert(interval->spill <= 0, "only moves can work with spilled values (v%d)", inst->operands[i]);
+    return interval->assigned;
+}
 
-    // if VAL_MEM then this is the base
-    int8_t reg;
+static bool op_is_fpr(Ctx* restrict ctx, Inst* inst, int i) {
+    return ctx->intervals[inst->operands[i]].reg_class == REG_CLASS_FPR;
+}
 
-    uint8_t base;
+static int resolve_interval(Ctx* restrict ctx, Inst* inst, int i, Val* val) {
+    LiveInterval* interval = &ctx->intervals[inst->operands[i]];
+    if (interval->spill > 0) {
+        *val = val_stack(-interval->spill);
+    } else if (interval->reg_class == REG_CLASS_FPR) {
+        *val = val_fpr(interval->assigned);
+    } else {
+        *val = val_gpr(interval->assigned);
+    }
 
-    union {
+    return 1;
+}
 
-        int reg;
-        GPR gpr;
-        uint8_t fpr;
-        struct {
-            bool is_rvalue;
-            int32_t disp;
-        } mem;
+// memory operands are [base, index?] in the operands (or just the symbol)
+static int resolve_mem(Ctx* restrict ctx, Inst* inst, int i, MemOp* out) {
+    *out = (MemOp){ .base = -1, .index = -1, .scale = inst->scale, .disp = inst->disp };
+    if (inst->flags & INST_GLOBAL) {
+        out->sym = inst->s;
+        return 1;
+    }
 
-        int32_t disp;
-        uint64_t num;
-    };
-} Val;
+    out->base = op_reg(ctx, inst, i);
+    if (inst->flags & INST_INDEXED) {
+        out->index = op_reg(ctx, inst, i + 1);
+        return 2;
+    }
 
-#include "../x64/generic_cg.h"
-#include "aarch64_emitter.h"
+    return 1;
+}
 
-static int classify_reg_class(TB_DataType dt) {
+static const char* symbol_name(TB_Symbol* sym, char* buf, size_t size) {
+    if (*sym->name == 0) {
+        snprintf(buf, size, "sym%p", sym);
+        return buf;
+    }
 
+    return sym->name;
 }
 
-static int isel(Ctx* restrict ctx, Sequence* restrict seq, TB_Node* n) {
-    /*TB_Node* restrict n = &f->nodes[r];
-    TB_NodeTypeEnum type = n->type;
+static const char* label_name(Ctx* restrict ctx, TB_Node* bb, char* buf, size_t size) {
+    snprintf(buf, size, ".bb%d", nl_map_get_checked(ctx->cfg.node_to_block, bb).id);
+    return buf;
+}
 
-    switch (type) {
-        case TB_INTEGER_CONST: {
-            assert(n->integer.num_words == 1);
-            GAD_VAL dst = GAD_FN(regalloc)(ctx, f, r, AARCH64_REG_CLASS_GPR);
+// dst = src + x, split across the shifted and unshifted imm12 when needed.
+// register 31 is SP here.
+static void emit_add_imm(TB_CGEmitter* restrict e, bool sf, int dst, int src, int64_t x) {
+    bool sub = x < 0;
+    uint64_t abs = sub ? -x : x;
+    if (abs >= (1u << 24)) {
+        tb_todo();
+    }
 
-            uint64_t x = n->integer.single_word;
-            emit_movz(&ctx->emit, dst.reg, x & 0xFFFF, 0, true);
+    if (abs >> 12) {
+        emit_addsub_imm(e, sub, false, sf, dst, src, abs >> 12, true);
+        src = dst;
+    }
 
-            uint8_t shift = 16;
-            x >>= 16;
+    if ((abs & 0xFFF) || src != dst) {
+        emit_addsub_imm(e, sub, false, sf, dst, src, abs & 0xFFF, false);
+    }
+}
 
-            while (x & 0xFFFF) {
-                emit_movk(&ctx->emit, dst.reg, x & 0xFFFF, shift, true);
-                x >>= 16, shift += 16;
-            }
-            return dst;
-        }
+// adrp dst, sym
+// add  dst, dst, :lo12:sym
+static void emit_symbol_addr(Ctx* restrict ctx, int dst, TB_Symbol* sym) {
+    TB_CGEmitter* e = &ctx->emit;
+
+    char buf[32];
+    const char* name = symbol_name(sym, buf, sizeof(buf));
+
+    tb_emit_symbol_patch(e->output, sym, GET_CODE_POS(e));
+    emit_adrp(e, dst, name);
+    tb_emit_symbol_patch(e->output, sym, GET_CODE_POS(e));
+    emit_word(e, 0x91000000 | ((dst & 31) << 5u) | (dst & 31), name);
+}
 
-        case TB_ADD: {
-            GAD_VAL a = ctx->values[n->i_arith.a];
-            GAD_VAL b = ctx->values[n->i_arith.b];
-            GAD_VAL dst = GAD_FN(regalloc)(ctx, f, r, AARCH64_REG_CLASS_GPR);
+static bool fits_scaled(int32_t disp, int size) {
+    return disp >= 0 && (disp & ((1 << size) - 1)) == 0 && (disp >> size) < 4096;
+}
+
+// picks whichever addressing mode fits, X17 is the scratch for the
+// ones which don't.
+static void emit_memory(Ctx* restrict ctx, int size, bool fp, bool load, int rt, MemOp m) {
+    TB_CGEmitter* e = &ctx->emit;
+    if (m.sym) {
+        emit_symbol_addr(ctx, X17, m.sym);
+        m.base = X17;
+    }
 
-            bool is_64bit = n->dt.type == TB_PTR || (n->dt.type == TB_INT && n->dt.data == 64);
-            emit_dp_r(&ctx->emit, ADD, dst.reg, a.reg, b.reg, 0, 0, is_64bit);
-            return dst;
+    if (m.index >= 0) {
+        if (m.disp == 0 && (m.scale == 0 || m.scale == size)) {
+            emit_ldst_reg(e, size, fp, load, rt, m.base, m.index, m.scale != 0);
+            return;
         }
 
-        default:
-        tb_todo();
-        return (GAD_VAL){ 0 };
-    }*/
+        // add x17, base, index, lsl #scale
+        emit_addsub_reg(e, false, false, true, X17, m.base, m.index, 0, m.scale);
+        m.base = X17;
+    }
+
+    if (fits_scaled(m.disp, size)) {
+        emit_ldst_scaled(e, size, fp, load, rt, m.base, m.disp >> size);
+    } else if (m.disp >= -256 && m.disp < 256) {
+        emit_ldst_unscaled(e, size, fp, load, rt, m.base, m.disp, 0);
+    } else {
+        emit_add_imm(e, true, X17, m.base, m.disp);
+        emit_ldst_scaled(e, size, fp, load, rt, X17, 0);
+    }
 }
 
-static void emit_sequence(Ctx* restrict ctx, Sequence* restrict seq, TB_Node* n) {
-    assert(seq->inst_count == 0 && "TODO");
+// whole register moves between registers and spill slots, the slots are
+// always at least 8 bytes so we don't care about the type's size.
+static void emit_move(Ctx* restrict ctx, A64_DataType dt, Val* dst, Val* src) {
+    TB_CGEmitter* e = &ctx->emit;
+    if (is_value_match(dst, src)) {
+        return;
+    }
+
+    if (dst->type == VAL_MEM && src->type == VAL_MEM) {
+        MemOp a = { .base = src->reg, .index = -1, .disp = src->imm };
+        MemOp b = { .base = dst->reg, .index = -1, .disp = dst->imm };
+        emit_memory(ctx, 3, false, true,  X16, a);
+        emit_memory(ctx, 3, false, false, X16, b);
+    } else if (dst->type == VAL_MEM) {
+        MemOp m = { .base = dst->reg, .index = -1, .disp = dst->imm };
+        emit_memory(ctx, 3, src->type == VAL_FPR, false, src->reg, m);
+    } else if (src->type == VAL_MEM) {
+        MemOp m = { .base = src->reg, .index = -1, .disp = src->imm };
+        emit_memory(ctx, 3, dst->type == VAL_FPR, true, dst->reg, m);
+    } else if (dst->type == VAL_FPR) {
+        assert(src->type == VAL_FPR);
+        emit_fp1(e, 0, dt != A64_TYPE_F32, dst->reg, src->reg);
+    } else {
+        assert(src->type == VAL_GPR);
+        emit_mov(e, dt == A64_TYPE_I64, dst->reg, src->reg);
+    }
 }
 
-static void patch_local_labels(Ctx* restrict ctx) {
+static int32_t branch_rel(Ctx* restrict ctx, TB_Node* target, DynArray(BranchFixup)* fixups) {
+    uint32_t pos = GET_CODE_POS(&ctx->emit);
+    uint32_t label = nl_map_get_checked(ctx->emit.labels, target);
+
+    // backwards branches know where they're going already
+    if (label & 0x80000000) {
+        return ((int32_t) (label & 0x7FFFFFFF) - (int32_t) pos) / 4;
+    }
 
+    dyn_array_put(*fixups, (BranchFixup){ pos, target });
+    return 0;
 }
 
-static void resolve_stack_usage(Ctx* restrict ctx, size_t caller_usage) {
-    tb_todo();
+////////////////////////////////
+// Machine peepholes
+////////////////////////////////
+// runs over the final instruction list (after regalloc, before encoding) so
+// the rules get to see the real locations. Each rule is handed an instruction
+// (and the one before it in the list so it can unlink it), it returns how many
+// bytes it saved or -1 if it didn't apply.
+typedef int (*PeepRule)(Ctx* restrict ctx, Inst* prev, Inst* inst);
+
+// these don't emit anything
+static bool peep_is_marker(Inst* inst) {
+    return inst->type == INST_LINE || inst->type == INST_TERMINATOR;
 }
 
-static void copy_value(Ctx* restrict ctx, Sequence* seq, TB_Node* phi, int dst, TB_Node* src, TB_DataType dt) {
-    tb_todo();
+static Inst* peep_next(Inst* inst, Inst** out_prev) {
+    Inst* prev = inst;
+    inst = inst->next;
+    while (inst != NULL && peep_is_marker(inst)) {
+        prev = inst, inst = inst->next;
+    }
+
+    if (out_prev) *out_prev = prev;
+    return inst;
 }
 
-static size_t aarch64_emit_call_patches(TB_Module* restrict m) {
+// mov a, a
+static int peep_self_move(Ctx* restrict ctx, Inst* prev, Inst* inst) {
+    if ((inst->type != MOV && inst->type != FP_MOV) || (inst->flags & ~INST_SPILL) || inst->out_count != 1 || inst->in_count != 1) {
+        return -1;
+    }
+
+    Val dst, src;
+    resolve_interval(ctx, inst, 0, &dst);
+    resolve_interval(ctx, inst, 1, &src);
+    if (!is_value_match(&dst, &src)) {
+        return -1;
+    }
+
+    // the encoder already skips these, nothing saved but it keeps the
+    // rest of the rules from having to look past them
+    prev->next = inst->next;
     return 0;
 }
 
-static void aarch64_return(Ctx* restrict ctx, TB_Function* f, TB_Node* restrict n) {
-    GAD_VAL* src = &ctx->values[n->ret.value];
+// b .next
+// .next:
+static int peep_jmp_next(Ctx* restrict ctx, Inst* prev, Inst* inst) {
+    if (inst->type != B || inst->flags != INST_NODE) {
+        return -1;
+    }
 
-    if (src->type != VAL_GPR || src->gpr != X0) {
-        emit_mov(&ctx->emit, X0, src->gpr, true);
+    Inst* next = peep_next(inst, NULL);
+    if (next == NULL || next->type != INST_LABEL || next->n != inst->n) {
+        return -1;
     }
-}
 
-static void aarch64_goto(Ctx* restrict ctx, TB_Label label) {
-    // jmp(&ctx->emit, label);
-    tb_todo();
+    prev->next = inst->next;
+    return 4;
 }
 
-static void aarch64_ret_jmp(Ctx* restrict ctx) {
-    ctx->emit.ret_patches[ctx->emit.ret_patch_count++] = GET_CODE_POS(&ctx->emit);
-    EMIT4(&ctx->emit, (0b101 << 25));
+// b.cc .a        b.!cc .b
+// b    .b   =>
+// .a:            .a:
+static int peep_bcond_over_jmp(Ctx* restrict ctx, Inst* prev, Inst* inst) {
+    if (inst->type < B_EQ || inst->type > B_LE || inst->flags != INST_NODE) {
+        return -1;
+    }
+
+    Inst* jmp_prev;
+    Inst* jmp = peep_next(inst, &jmp_prev);
+    if (jmp == NULL || jmp->type != B || jmp->flags != INST_NODE) {
+        return -1;
+    }
+
+    Inst* next = peep_next(jmp, NULL);
+    if (next == NULL || next->type != INST_LABEL || next->n != inst->n) {
+        return -1;
+    }
+
+    inst->type = B_EQ + ((inst->type - B_EQ) ^ 1);
+    inst->n = jmp->n;
+    jmp_prev->next = jmp->next;
+    return 4;
 }
 
-static size_t aarch64_emit_prologue(uint8_t* out, uint64_t saved, uint64_t stack_usage) {
-    return 0;
+static const struct {
+    const char* name;
+    PeepRule func;
+} peep_rules[] = {
+    { "self move",     peep_self_move      },
+    { "jmp next",      peep_jmp_next       },
+    { "bcond over jmp", peep_bcond_over_jmp },
+};
+
+static bool peep_is_branch(Inst* inst) {
+    return (inst->type == B || (inst->type >= B_EQ && inst->type <= B_NV)) && inst->flags == INST_NODE;
 }
 
-static size_t aarch64_emit_epilogue(uint8_t* out, uint64_t saved, uint64_t stack_usage) {
-    // RET
-    memcpy(out, &(uint32_t){ 0xD65F03C0 }, 4);
-    return 4;
+// branches into a block which is nothing but `b .b` can go straight to .b, these
+// are mostly the landing pads from splitting critical edges. once nothing branches
+// to a pad it's only reachable by falling into it:
+//
+// b.cc .a           b.!cc .b
+// .pad:         =>  .a:
+// b    .b
+// .a:
+static int peep_thread_jumps(Ctx* restrict ctx, size_t* hits) {
+    NL_Map(TB_Node*, TB_Node*) forward = NULL;
+    for (Inst* inst = ctx->first; inst; inst = inst->next) {
+        Inst* jmp = inst->type == INST_LABEL ? peep_next(inst, NULL) : NULL;
+        if (jmp != NULL && jmp->type == B && jmp->flags == INST_NODE && jmp->n != inst->n) {
+            nl_map_put(forward, inst->n, jmp->n);
+        }
+    }
+
+    if (forward == NULL) {
+        return 0;
+    }
+
+    // pads can chain, a few hops is plenty (and infinite loops can make cycles)
+    NL_Map(TB_Node*, int) refs = NULL;
+    for (Inst* inst = ctx->first; inst; inst = inst->next) {
+        if (peep_is_branch(inst)) {
+            ptrdiff_t i;
+            for (int hops = 0; hops < 4 && (i = nl_map_get(forward, inst->n)) >= 0; hops++) {
+                inst->n = forward[i].v;
+            }
+        }
+
+        if (inst->type != INST_LABEL && (inst->flags & INST_NODE)) {
+            nl_map_put(refs, inst->n, 0);
+        }
+    }
+
+    int saved = 0;
+    Inst* prev = ctx->first;
+    Inst* last = ctx->first; // last instruction which isn't a marker
+    for (Inst* inst = prev->next; inst; inst = prev->next) {
+        if (inst->type == INST_LABEL && nl_map_get(forward, inst->n) >= 0 && nl_map_get(refs, inst->n) < 0) {
+            Inst* jmp = peep_next(inst, NULL);
+            Inst* next = peep_next(jmp, NULL);
+
+            bool dead = last->type == B;
+            if (!dead && last->type >= B_EQ && last->type <= B_LE && last->flags == INST_NODE && next != NULL && next->type == INST_LABEL && next->n == last->n) {
+                last->type = B_EQ + ((last->type - B_EQ) ^ 1);
+                last->n = jmp->n;
+                dead = true;
+            }
+
+            if (dead) {
+                // it's never placed so it can't keep a label either
+                nl_map_remove(ctx->emit.labels, inst->n);
+
+                *hits += 1, saved += 4;
+                prev->next = jmp->next;
+                continue;
+            }
+        }
+
+        if (!peep_is_marker(inst)) {
+            last = inst;
+        }
+        prev = inst;
+    }
+
+    nl_map_free(forward);
+    nl_map_free(refs);
+    return saved;
 }
 
-static void aarch64_initial_reg_alloc(Ctx* restrict ctx) {
-    ctx->callee_saved[0] = 0;
+static void machine_peephole(Ctx* restrict ctx) {
+    size_t hits = 0, bytes = 0;
+    bytes += peep_thread_jumps(ctx, &hits);
 
-    // SP/ZR is the only reserved register
-    ctx->free_regs[0] = set_create(32);
-    set_put(&ctx->free_regs[0], SP);
-    ctx->active[0] = 0, ctx->active_count += 1;
+    Inst* prev = ctx->first;
+    Inst* inst = prev->next;
+    while (inst != NULL) {
+        bool progress = false;
+        FOREACH_N(i, 0, COUNTOF(peep_rules)) {
+            int saved = peep_rules[i].func(ctx, prev, inst);
+            if (saved >= 0) {
+                TB_OPTDEBUG(CODEGEN)(printf("  PEEP %s: saved %d bytes\n", peep_rules[i].name, saved));
+
+                hits += 1, bytes += saved;
+                progress = true;
+                break;
+            }
+        }
+
+        // the rule might've removed the instruction so we start over from the last
+        // one we know is still there.
+        if (progress) {
+            inst = prev->next;
+        } else {
+            prev = inst, inst = inst->next;
+        }
+    }
+
+    if (hits > 0) {
+        TB_Module* m = ctx->module;
+        atomic_fetch_add(&m->peephole_hits, hits);
+        atomic_fetch_add(&m->peephole_bytes, bytes);
+    }
 }
 
-static int get_data_type_size(const TB_DataType dt) {
-    assert(dt.width <= 2 && "Vector width too big!");
+// leaf functions which don't touch the stack can skip the frame record
+static bool needs_frame(Ctx* restrict ctx) {
+    if (ctx->stack_usage > 0) {
+        return true;
+    }
 
-    switch (dt.type) {
-        case TB_INT: {
-            // round up bits to a byte
-            bool is_big_int = dt.data > 64;
-            int bits = is_big_int ? ((dt.data + 7) / 8) : tb_next_pow2(dt.data);
+    for (Inst* inst = ctx->first; inst; inst = inst->next) {
+        if (inst->type == CALL) {
+            return true;
+        }
 
-            return ((bits+7) / 8) << dt.width;
+        FOREACH_N(i, 0, inst->out_count + inst->in_count + inst->tmp_count) {
+            if (inst->operands[i] == FIRST_GPR + FP) {
+                return true;
+            }
         }
-        case TB_FLOAT: {
-            int s = 0;
-            if (dt.data == TB_FLT_32) s = 4;
-            else if (dt.data == TB_FLT_64) s = 8;
-            else tb_unreachable();
+    }
+
+    return false;
+}
+
+static void emit_code(Ctx* restrict ctx, TB_FunctionOutput* restrict func_out, int end) {
+    TB_CGEmitter* e = &ctx->emit;
+
+    // resolve stack usage, the outgoing arguments are at the bottom and the
+    // frame record sits above everything.
+    ctx->stack_usage = align_up(ctx->stack_usage + ctx->caller_usage*8, 16);
+    bool has_frame = needs_frame(ctx);
+
+    // emit prologue
+    func_out->prologue_length = emit_prologue(ctx, has_frame);
+
+    DynArray(BranchFixup) fixups = dyn_array_create(BranchFixup, 64);
+    Inst* prev_line = NULL;
+    for (Inst* restrict inst = ctx->first; inst; inst = inst->next) {
+        int in_base = inst->out_count;
+        bool sf = inst->dt == A64_TYPE_I64;
+        bool is_double = inst->dt == A64_TYPE_F64;
+        char buf[64];
+
+        // the generic INST_* markers live outside of InstType
+        switch ((int) inst->type) {
+            case INST_ENTRY:
+            case INST_TERMINATOR:
+            case INST_EPILOGUE:
+            // just markers
+            break;
+
+            case INST_LABEL: {
+                TB_Node* bb = inst->n;
+                uint32_t pos = GET_CODE_POS(e);
+                nl_map_get_checked(e->labels, bb) = 0x80000000 | pos;
+
+                int id = nl_map_get_checked(ctx->cfg.node_to_block, bb).id;
+                if (id > 0) {
+                    EMITA(e, ".bb%d:\n", id);
+                }
+                break;
+            }
+
+            case INST_LINE: {
+                TB_Attrib* loc = inst->a;
+                uint32_t pos = GET_CODE_POS(e);
+
+                if (prev_line == NULL || !is_same_location(prev_line->a, loc)) {
+                    EMITA(e, "  \x1b[33m# loc %s %"PRIu64"\x1b[0m\n", loc->loc.file->path, loc->loc.line);
+
+                    TB_Location l = {
+                        .file = loc->loc.file,
+                        .line = loc->loc.line,
+                        .column = loc->loc.column,
+                        .pos = pos
+                    };
+                    dyn_array_put(ctx->locations, l);
+                    prev_line = inst;
+                }
+                break;
+            }
+
+            case INST_INLINE: {
+                if (inst->n) {
+                    TB_NodeMachineOp* mach = TB_NODE_GET_EXTRA(inst->n);
+
+                    EMITA(e, "  INLINE MACHINE CODE:");
+                    FOREACH_N(i, 0, mach->length) {
+                        EMITA(e, " %#02x", mach->data[i]);
+                    }
+                    EMITA(e, "\n");
+                }
+                break;
+            }
+
+            case INST_ZERO: {
+                int d = op_reg(ctx, inst, 0);
+                if (op_is_fpr(ctx, inst, 0)) {
+                    // fmov d, xzr
+                    emit_fp_int(e, 0x07, is_double, is_double, d, ZR);
+                } else {
+                    emit_movw(e, 2, false, d, 0, 0);
+                }
+                break;
+            }
+
+            case MOV:
+            case FP_MOV: {
+                Val dst, src;
+                resolve_interval(ctx, inst, 0, &dst);
+                resolve_interval(ctx, inst, 1, &src);
+                emit_move(ctx, inst->dt, &dst, &src);
+                break;
+            }
+
+            case XCHG: {
+                Val a, b;
+                resolve_interval(ctx, inst, 0, &a);
+                resolve_interval(ctx, inst, 1, &b);
+                assert(b.type == VAL_GPR);
+
+                Val tmp = val_gpr(X16);
+                if (a.type == VAL_MEM) {
+                    // ldr x16, [a]; str b, [a]; mov b, x16
+                    emit_move(ctx, A64_TYPE_I64, &tmp, &a);
+                    emit_move(ctx, A64_TYPE_I64, &a, &b);
+                    emit_move(ctx, A64_TYPE_I64, &b, &tmp);
+                } else {
+                    emit_move(ctx, A64_TYPE_I64, &tmp, &a);
+                    emit_move(ctx, A64_TYPE_I64, &a, &b);
+                    emit_move(ctx, A64_TYPE_I64, &b, &tmp);
+                }
+                break;
+            }
+
+            case MOVI: {
+                emit_movi(e, sf, op_reg(ctx, inst, 0), inst->abs);
+                break;
+            }
+
+            case LEA: {
+                int d = op_reg(ctx, inst, 0);
+                MemOp m;
+                resolve_mem(ctx, inst, 1, &m);
+
+                if (m.sym) {
+                    emit_symbol_addr(ctx, d, m.sym);
+                    emit_add_imm(e, true, d, d, m.disp);
+                } else if (m.index >= 0) {
+                    emit_addsub_reg(e, false, false, true, d, m.base, m.index, 0, m.scale);
+                    emit_add_imm(e, true, d, d, m.disp);
+                } else {
+                    emit_add_imm(e, true, d, m.base, m.disp);
+                }
+                break;
+            }
+
+            case LDR: {
+                MemOp m;
+                resolve_mem(ctx, inst, 1, &m);
+                emit_memory(ctx, dt_size_log2(inst->dt), op_is_fpr(ctx, inst, 0), true, op_reg(ctx, inst, 0), m);
+                break;
+            }
+
+            case STR: {
+                MemOp m;
+                int i = resolve_mem(ctx, inst, 0, &m);
+                emit_memory(ctx, dt_size_log2(inst->dt), op_is_fpr(ctx, inst, i), false, op_reg(ctx, inst, i), m);
+                break;
+            }
+
+            case LDAR: {
+                emit_ldar(e, dt_size_log2(inst->dt), op_reg(ctx, inst, 0), op_reg(ctx, inst, 1));
+                break;
+            }
+
+            case ADD:
+            case SUB: {
+                int d = op_reg(ctx, inst, 0), a = op_reg(ctx, inst, 1);
+                bool sub = inst->type == SUB;
+                if (inst->flags & INST_IMM) {
+                    int32_t x = sub ? -inst->imm : inst->imm;
+                    emit_addsub_imm(e, x < 0, false, sf, d, a, x < 0 ? -x : x, false);
+                } else {
+                    emit_addsub_reg(e, sub, false, sf, d, a, op_reg(ctx, inst, 2), 0, 0);
+                }
+                break;
+            }
+
+            case AND:
+            case ORR:
+            case EOR: {
+                int d = op_reg(ctx, inst, 0), a = op_reg(ctx, inst, 1);
+                if (inst->flags & INST_ABS) {
+                    uint32_t bitmask;
+                    bool ok = encode_bitmask(inst->abs, sf, &bitmask);
+                    tb_assert(ok, "isel should've checked the bitmask (%#"PRIx64")", inst->abs);
+                    emit_logical_imm(e, inst->type - AND, sf, d, a, bitmask);
+                } else {
+                    emit_logical_reg(e, inst->type - AND, false, sf, d, a, op_reg(ctx, inst, 2), 0, 0);
+                }
+                break;
+            }
+
+            case CMP: {
+                int a = op_reg(ctx, inst, 0);
+                if (inst->flags & INST_IMM) {
+                    // cmn for the negative ones
+                    int32_t x = inst->imm;
+                    emit_addsub_imm(e, x >= 0, true, sf, ZR, a, x < 0 ? -x : x, false);
+                } else {
+                    emit_addsub_reg(e, true, true, sf, ZR, a, op_reg(ctx, inst, 1), 0, 0);
+                }
+                break;
+            }
+
+            case TST: {
+                int a = op_reg(ctx, inst, 0);
+                if (inst->flags & INST_ABS) {
+                    uint32_t bitmask;
+                    bool ok = encode_bitmask(inst->abs, sf, &bitmask);
+                    tb_assert(ok, "isel should've checked the bitmask (%#"PRIx64")", inst->abs);
+                    emit_logical_imm(e, 3, sf, ZR, a, bitmask);
+                } else {
+                    emit_logical_reg(e, 3, false, sf, ZR, a, op_reg(ctx, inst, 1), 0, 0);
+                }
+                break;
+            }
+
+            case MUL: {
+                emit_madd(e, false, sf, op_reg(ctx, inst, 0), op_reg(ctx, inst, 1), op_reg(ctx, inst, 2), ZR);
+                break;
+            }
+
+            case MSUB: {
+                emit_madd(e, true, sf, op_reg(ctx, inst, 0), op_reg(ctx, inst, 1), op_reg(ctx, inst, 2), op_reg(ctx, inst, 3));
+                break;
+            }
+
+            case UMULH:
+            case SMULH: {
+                emit_mulh(e, inst->type == SMULH, op_reg(ctx, inst, 0), op_reg(ctx, inst, 1), op_reg(ctx, inst, 2));
+                break;
+            }
+
+            case UDIV:
+            case SDIV: {
+                emit_dp2(e, inst->type == SDIV ? 3 : 2, sf, op_reg(ctx, inst, 0), op_reg(ctx, inst, 1), op_reg(ctx, inst, 2));
+                break;
+            }
+
+            case LSL:
+            case LSR:
+            case ASR:
+            case ROR: {
+                int d = op_reg(ctx, inst, 0), a = op_reg(ctx, inst, 1);
+                if (inst->flags & INST_IMM) {
+                    int width = sf ? 64 : 32, k = inst->imm;
+                    switch (inst->type) {
+                        case LSL: emit_bitfield(e, 2, sf, d, a, (width - k) % width, width - 1 - k); break;
+                        case LSR: emit_bitfield(e, 2, sf, d, a, k, width - 1); break;
+                        case ASR: emit_bitfield(e, 0, sf, d, a, k, width - 1); break;
+                        case ROR: emit_extr(e, sf, d, a, a, k); break;
+                        default: tb_unreachable();
+                    }
+                } else {
+                    emit_dp2(e, 8 + (inst->type - LSL), sf, d, a, op_reg(ctx, inst, 2));
+                }
+                break;
+            }
+
+            case NEG: {
+                emit_addsub_reg(e, true, false, sf, op_reg(ctx, inst, 0), ZR, op_reg(ctx, inst, 1), 0, 0);
+                break;
+            }
+
+            case MVN: {
+                emit_logical_reg(e, 1, true, sf, op_reg(ctx, inst, 0), ZR, op_reg(ctx, inst, 1), 0, 0);
+                break;
+            }
+
+            case CLZ:
+            case RBIT: {
+                emit_dp1(e, inst->type == CLZ ? 4 : 0, sf, op_reg(ctx, inst, 0), op_reg(ctx, inst, 1));
+                break;
+            }
+
+            case REV: {
+                int op = inst->dt == A64_TYPE_I16 ? 1 : (sf ? 3 : 2);
+                emit_dp1(e, op, sf, op_reg(ctx, inst, 0), op_reg(ctx, inst, 1));
+                break;
+            }
+
+            case SEXT:
+            case ZEXT: {
+                int d = op_reg(ctx, inst, 0), a = op_reg(ctx, inst, 1);
+                if (inst->type == ZEXT && inst->imm == 32) {
+                    // writing the W register clears the top half
+                    emit_mov(e, false, d, a);
+                } else {
+                    emit_bitfield(e, inst->type == SEXT ? 0 : 2, sf, d, a, 0, inst->imm - 1);
+                }
+                break;
+            }
+
+            case MRS: {
+                emit_mrs_cntvct(e, op_reg(ctx, inst, 0));
+                break;
+            }
+
+            case FADD:
+            case FSUB:
+            case FMUL:
+            case FDIV:
+            case FMAX:
+            case FMIN: {
+                const static int ops[] = { 2, 3, 0, 1, 4, 5 };
+                emit_fp2(e, ops[inst->type - FADD], is_double, op_reg(ctx, inst, 0), op_reg(ctx, inst, 1), op_reg(ctx, inst, 2));
+                break;
+            }
+
+            case FNEG: {
+                emit_fp1(e, 2, is_double, op_reg(ctx, inst, 0), op_reg(ctx, inst, 1));
+                break;
+            }
+
+            case FCVT: {
+                // the type is the source's
+                emit_fp1(e, is_double ? 4 : 5, is_double, op_reg(ctx, inst, 0), op_reg(ctx, inst, 1));
+                break;
+            }
+
+            case FCMP: {
+                if (inst->flags & INST_IMM) {
+                    emit_fcmp(e, is_double, op_reg(ctx, inst, 0), 0, true);
+                } else {
+                    emit_fcmp(e, is_double, op_reg(ctx, inst, 0), op_reg(ctx, inst, 1), false);
+                }
+                break;
+            }
+
+            case SCVTF:
+            case UCVTF: {
+                emit_fp_int(e, inst->type == SCVTF ? 0x02 : 0x03, inst->scale, is_double, op_reg(ctx, inst, 0), op_reg(ctx, inst, 1));
+                break;
+            }
+
+            case FCVTZS:
+            case FCVTZU: {
+                emit_fp_int(e, inst->type == FCVTZS ? 0x18 : 0x19, sf, inst->scale, op_reg(ctx, inst, 0), op_reg(ctx, inst, 1));
+                break;
+            }
+
+            case FMOV_F2I: {
+                emit_fp_int(e, 0x06, sf, sf, op_reg(ctx, inst, 0), op_reg(ctx, inst, 1));
+                break;
+            }
+
+            case FMOV_I2F: {
+                emit_fp_int(e, 0x07, is_double, is_double, op_reg(ctx, inst, 0), op_reg(ctx, inst, 1));
+                break;
+            }
+
+            case B: {
+                if (inst->flags & INST_NODE) {
+                    int32_t rel = branch_rel(ctx, inst->n, &fixups);
+                    emit_b(e, false, rel, label_name(ctx, inst->n, buf, sizeof(buf)));
+                } else {
+                    assert((inst->flags & (INST_TAIL | INST_GLOBAL)) == (INST_TAIL | INST_GLOBAL));
+                    emit_frame_teardown(ctx, has_frame);
+
+                    tb_emit_symbol_patch(e->output, inst->s, GET_CODE_POS(e));
+                    emit_b(e, false, 0, symbol_name(inst->s, buf, sizeof(buf)));
+                }
+                break;
+            }
 
-            return s << dt.width;
+            case BR: {
+                int target = op_reg(ctx, inst, in_base);
+                if (inst->flags & INST_TAIL) {
+                    emit_frame_teardown(ctx, has_frame);
+                }
+                emit_br(e, false, target);
+                break;
+            }
+
+            case CALL: {
+                if (inst->flags & INST_GLOBAL) {
+                    tb_emit_symbol_patch(e->output, inst->s, GET_CODE_POS(e));
+                    emit_b(e, true, 0, symbol_name(inst->s, buf, sizeof(buf)));
+                } else {
+                    emit_br(e, true, op_reg(ctx, inst, in_base));
+                }
+                break;
+            }
+
+            case SYSCALL: {
+                emit_svc(e, 0);
+                break;
+            }
+
+            case TRAP: {
+                emit_brk(e, 1);
+                break;
+            }
+
+            case DEBUGBREAK: {
+                emit_brk(e, 0xF000);
+                break;
+            }
+
+            case COUNTER: {
+                // adrp x17, sym
+                // add  x17, x17, :lo12:sym
+                // ldr  x16, [x17, #disp]
+                // add  x16, x16, #1
+                // str  x16, [x17, #disp]
+                //
+                // not atomic (an exclusive loop needs a third scratch register) so
+                // threads hitting the same block can drop counts, they're approximate.
+                MemOp m = { .base = X17, .index = -1, .disp = inst->disp };
+                emit_symbol_addr(ctx, X17, inst->s);
+                if (!fits_scaled(m.disp, 3)) {
+                    emit_add_imm(e, true, X17, X17, m.disp);
+                    m.disp = 0;
+                }
+
+                emit_memory(ctx, 3, false, true, X16, m);
+                emit_addsub_imm(e, false, false, true, X16, X16, 1, false);
+                emit_memory(ctx, 3, false, false, X16, m);
+                break;
+            }
+
+            case RMW_XCHG:
+            case RMW_ADD:
+            case RMW_SUB:
+            case RMW_AND:
+            case RMW_XOR:
+            case RMW_OR: {
+                int size = dt_size_log2(inst->dt);
+                int old = op_reg(ctx, inst, 0), addr = op_reg(ctx, inst, 1), src = op_reg(ctx, inst, 2);
+
+                // 1: ldaxr old, [addr]
+                //    op    x16, old, src
+                //    stlxr w17, x16, [addr]
+                //    cbnz  w17, 1b
+                emit_ldaxr(e, size, old, addr);
+                if (inst->type == RMW_XCHG) {
+                    emit_stlxr(e, size, X17, src, addr);
+                    emit_cbz(e, true, false, X17, -2, NULL);
+                } else {
+                    switch (inst->type) {
+                        case RMW_ADD: emit_addsub_reg(e, false, false, sf, X16, old, src, 0, 0); break;
+                        case RMW_SUB: emit_addsub_reg(e, true, false, sf, X16, old, src, 0, 0); break;
+                        case RMW_AND: emit_logical_reg(e, 0, false, sf, X16, old, src, 0, 0); break;
+                        case RMW_XOR: emit_logical_reg(e, 2, false, sf, X16, old, src, 0, 0); break;
+                        case RMW_OR:  emit_logical_reg(e, 1, false, sf, X16, old, src, 0, 0); break;
+                        default: tb_unreachable();
+                    }
+                    emit_stlxr(e, size, X17, X16, addr);
+                    emit_cbz(e, true, false, X17, -3, NULL);
+                }
+                break;
+            }
+
+            case MEMCPY: {
+                int d = op_reg(ctx, inst, 0), s = op_reg(ctx, inst, 1), c = op_reg(ctx, inst, 2);
+
+                //    cbz  c, 2f
+                // 1: ldrb w16, [s], #1
+                //    strb w16, [d], #1
+                //    subs c, c, #1
+                //    b.ne 1b
+                // 2:
+                emit_cbz(e, false, true, c, 5, NULL);
+                emit_ldst_unscaled(e, 0, false, true, X16, s, 1, 1);
+                emit_ldst_unscaled(e, 0, false, false, X16, d, 1, 1);
+                emit_addsub_imm(e, true, true, true, c, c, 1, false);
+                emit_bcond(e, NE, -3, NULL);
+                break;
+            }
+
+            case MEMSET: {
+                int d = op_reg(ctx, inst, 0), c = op_reg(ctx, inst, 1), v = op_reg(ctx, inst, 3);
+
+                //    cbz  c, 2f
+                // 1: strb v, [d], #1
+                //    subs c, c, #1
+                //    b.ne 1b
+                // 2:
+                emit_cbz(e, false, true, c, 4, NULL);
+                emit_ldst_unscaled(e, 0, false, false, v, d, 1, 1);
+                emit_addsub_imm(e, true, true, true, c, c, 1, false);
+                emit_bcond(e, NE, -2, NULL);
+                break;
+            }
+
+            default: {
+                if (inst->type >= B_EQ && inst->type <= B_NV) {
+                    assert(inst->flags & INST_NODE);
+                    int32_t rel = branch_rel(ctx, inst->n, &fixups);
+                    emit_bcond(e, inst->type - B_EQ, rel, label_name(ctx, inst->n, buf, sizeof(buf)));
+                } else if (inst->type >= CSET_EQ && inst->type <= CSET_NV) {
+                    // csinc d, zr, zr, !cc
+                    emit_csel(e, true, false, op_reg(ctx, inst, 0), ZR, ZR, (inst->type - CSET_EQ) ^ 1);
+                } else if (inst->type >= CSEL_EQ && inst->type <= CSEL_NV) {
+                    emit_csel(e, false, sf, op_reg(ctx, inst, 0), op_reg(ctx, inst, 1), op_reg(ctx, inst, 2), inst->type - CSEL_EQ);
+                } else {
+                    tb_todo();
+                }
+                break;
+            }
         }
-        case TB_PTR: {
-            return 8;
+    }
+
+    if (end >= 0) {
+        emit_epilogue(ctx, ctx->f->stop_node, has_frame);
+    }
+
+    // now that every label is placed we can fill in the forward branches
+    dyn_array_for(i, fixups) {
+        BranchFixup* f = &fixups[i];
+        uint32_t label = nl_map_get_checked(e->labels, f->target);
+        tb_assert(label & 0x80000000, "branch to a label which was never placed");
+
+        int32_t rel = ((int32_t) (label & 0x7FFFFFFF) - (int32_t) f->pos) / 4;
+
+        uint32_t w;
+        memcpy(&w, &e->data[f->pos], 4);
+        if ((w & 0x7C000000) == 0x14000000) {
+            w |= rel & 0x3FFFFFF;
+        } else {
+            tb_assert(rel >= -(1 << 18) && rel < (1 << 18), "conditional branch is out of range (%d)", rel);
+            w |= (rel & 0x7FFFF) << 5u;
         }
-        default: {
-            tb_unreachable();
-            return 0;
+        PATCH4(e, f->pos, w);
+    }
+    dyn_array_destroy(fixups);
+
+    // pad to 16bytes with nops
+    while (ctx->emit.count & 15) {
+        EMIT4(e, 0xD503201F);
+    }
+}
+
+static size_t emit_prologue(Ctx* restrict ctx, bool has_frame) {
+    if (!has_frame) {
+        return 0;
+    }
+
+    TB_CGEmitter* e = &ctx->emit;
+
+    // stp x29, x30, [sp, #-16]!
+    emit_push_frame_record(e);
+    // mov x29, sp
+    emit_addsub_imm(e, false, false, true, FP, SP, 0, false);
+    // sub sp, sp, stack_usage
+    if (ctx->stack_usage > 0) {
+        emit_add_imm(e, true, SP, SP, -(int64_t) ctx->stack_usage);
+    }
+
+    return e->count;
+}
+
+// shared between the epilogue and tail calls
+static void emit_frame_teardown(Ctx* restrict ctx, bool has_frame) {
+    if (!has_frame) {
+        return;
+    }
+
+    TB_CGEmitter* e = &ctx->emit;
+
+    // mov sp, x29
+    if (ctx->stack_usage > 0) {
+        emit_addsub_imm(e, false, false, true, SP, FP, 0, false);
+    }
+
+    // ldp x29, x30, [sp], #16
+    emit_pop_frame_record(e);
+}
+
+static void emit_epilogue(Ctx* restrict ctx, TB_Node* stop, bool has_frame) {
+    TB_CGEmitter* e = &ctx->emit;
+
+    if (!has_frame) {
+        emit_ret(e);
+        return;
+    }
+
+    emit_frame_teardown(ctx, has_frame);
+
+    // ret
+    TB_Node* rpc = stop->inputs[2];
+    if (rpc->type == TB_PROJ && rpc->inputs[0]->type == TB_START && TB_NODE_GET_EXTRA_T(rpc, TB_NodeProj)->index == 2) {
+        emit_ret(e);
+    }
+}
+
+static size_t emit_call_patches(TB_Module* restrict m, TB_FunctionOutput* out_f) {
+    size_t r = 0;
+    uint32_t src_section = out_f->section;
+
+    for (TB_SymbolPatch* patch = out_f->last_patch; patch; patch = patch->prev) {
+        if (patch->target->tag == TB_SYMBOL_FUNCTION) {
+            uint32_t dst_section = ((TB_Function*) patch->target)->output->section;
+
+            // you can't do relocations across sections
+            if (src_section == dst_section) {
+                assert(patch->pos < out_f->code_size);
+
+                // only b/bl can be resolved here, adrp/add pairs still need
+                // the relocation since we don't know the final page.
+                uint32_t w;
+                memcpy(&w, &out_f->code[patch->pos], sizeof(uint32_t));
+                if ((w & 0x7C000000) != 0x14000000) {
+                    continue;
+                }
+
+                // relative to the start of the branch, in words
+                size_t actual_pos = out_f->code_pos + patch->pos;
+                int32_t rel = (int32_t) (((TB_Function*) patch->target)->output->code_pos - actual_pos) / 4;
+
+                w = (w & 0xFC000000) | (rel & 0x3FFFFFF);
+                memcpy(&out_f->code[patch->pos], &w, sizeof(uint32_t));
+
+                r += 1;
+                patch->internal = true;
+            }
         }
     }
+
+    return out_f->patch_count - r;
 }
 
-#if _MSC_VER
-_Pragma("warning (push)") _Pragma("warning (disable: 4028)")
-#endif
 ICodeGen tb__aarch64_codegen = {
     .minimum_addressable_size = 8,
     .pointer_size = 64,
 
-    .get_data_type_size  = aarch64_get_data_type_size,
-    .emit_call_patches   = aarch64_emit_call_patches,
-    .emit_prologue       = aarch64_emit_prologue,
-    .emit_epilogue       = aarch64_emit_epilogue,
-
-    .fast_path    = aarch64_compile_function,
-    //.complex_path = x64_complex_compile_function
+    .emit_win64eh_unwind_info = NULL,
+    .emit_call_patches  = emit_call_patches,
+    .get_data_type_size = get_data_type_size,
+    .compile_function   = compile_function,
 };
-#if _MSC_VER
-_Pragma("warning (pop)")
-#endif
-#endif
\ No newline at end of file
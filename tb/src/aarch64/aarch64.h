@@ -0,0 +1,115 @@
+#pragma once
+#include "../codegen/emitter.h"
+#include "../tb_internal.h"
+#include <tb_aarch64.h>
+
+static_assert(sizeof(float) == sizeof(uint32_t), "Float needs to be a 32-bit float!");
+static_assert(sizeof(double) == sizeof(uint64_t), "Double needs to be a 64-bit float!");
+
+typedef union {
+    float f;
+    uint32_t i;
+} Cvt_F32U32;
+
+typedef union {
+    double f;
+    uint64_t i;
+} Cvt_F64U64;
+
+// the 4bit condition codes, flipping the bottom bit inverts them
+// (except for AL and NV but we don't branch on those)
+typedef enum {
+    EQ, NE, HS, LO, MI, PL, VS, VC,
+    HI, LS, GE, LT, GT, LE, AL, NV
+} Cond;
+
+// Xn refers to the 64bit variants of the registers,
+// usually the 32bit aliases are Wn (we don't have enums
+// for them because it's not that important, they're equal)
+typedef enum {
+    X0,  X1,   X2,  X3,  X4,  X5,  X6,  X7,
+    X8,  X9,  X10, X11, X12, X13, X14, X15,
+    X16, X17, X18, X19, X20, X21, X22, X23,
+    X24, X25, X26, X27, X28, X29, X30,
+
+    // It's context specific because ARM lmao
+    ZR = 0x1F, SP = 0x1F,
+
+    // frame pointer & link register
+    FP = X29, LR = X30,
+
+    // not a real gpr
+    GPR_NONE = -1,
+} GPR;
+
+typedef enum {
+    V0, V1, V2, V3, V4, V5, V6, V7,
+    V8, V9, V10, V11, V12, V13, V14, V15,
+    V16, V17, V18, V19, V20, V21, V22, V23,
+    V24, V25, V26, V27, V28, V29, V30, V31,
+} FPR;
+
+// what the instructions operate on, anything below 32bits still uses the
+// W form of the instruction so the bits above the type aren't defined.
+typedef enum {
+    A64_TYPE_NONE,
+    A64_TYPE_I8, A64_TYPE_I16, A64_TYPE_I32, A64_TYPE_I64,
+    A64_TYPE_F32, A64_TYPE_F64,
+} A64_DataType;
+
+typedef enum {
+    VAL_NONE, VAL_GPR, VAL_FPR, VAL_MEM
+} ValType;
+
+typedef enum {
+    SCALE_X1, SCALE_X2, SCALE_X4, SCALE_X8
+} Scale;
+
+// resolved operand, memory is always [base + disp] by this point
+typedef struct Val {
+    int8_t type;
+    int8_t reg;
+    int32_t imm;
+} Val;
+
+typedef enum InstType {
+    #define X(a, ...) a,
+    #include "aarch64_insts.inc"
+} InstType;
+
+typedef struct InstDesc {
+    const char* mnemonic;
+} InstDesc;
+
+static const InstDesc inst_table[] = {
+    #define X(a, b) [a] = { .mnemonic = b },
+    #include "aarch64_insts.inc"
+};
+
+// AAPCS64, x16-x18 are technically caller saved too but we never
+// allocate them.
+#define AAPCS64_CALLER_SAVED_GPRS 0x0000FFFFu
+#define AAPCS64_CALLER_SAVED_FPRS 0xFFFF00FFu
+
+// the syscall only writes back to X0
+#define SYSCALL_CALLER_SAVED_GPRS (1u << X0)
+
+inline static Val val_gpr(GPR g) {
+    return (Val) { .type = VAL_GPR, .reg = g };
+}
+
+inline static Val val_fpr(FPR f) {
+    return (Val) { .type = VAL_FPR, .reg = f };
+}
+
+inline static Val val_stack(int s) {
+    return (Val) { .type = VAL_MEM, .reg = FP, .imm = s };
+}
+
+inline static bool is_value_match(const Val* a, const Val* b) {
+    if (a->type != b->type) return false;
+    return a->reg == b->reg && (a->type != VAL_MEM || a->imm == b->imm);
+}
+
+// shorthand macros
+#define STACK_ALLOC(size, align) (ctx->stack_usage = align_up(ctx->stack_usage + (size), align), - ctx->stack_usage)
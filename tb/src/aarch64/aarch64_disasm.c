@@ -0,0 +1,802 @@
+#include <tb_aarch64.h>
+#include <common.h>
+
+#define BITS(w, lo, n) (((w) >> (lo)) & ((1u << (n)) - 1))
+#define PUSH(op) (inst->operands[inst->operand_count++] = (op))
+
+enum {
+    SHIFT_LSL, SHIFT_LSR, SHIFT_ASR, SHIFT_ROR,
+    // extended register operands
+    EXT_UXTB, EXT_UXTH, EXT_UXTW, EXT_UXTX,
+    EXT_SXTB, EXT_SXTH, EXT_SXTW, EXT_SXTX,
+};
+
+static const char* a64_cond_names[16] = {
+    "eq", "ne", "hs", "lo", "mi", "pl", "vs", "vc",
+    "hi", "ls", "ge", "lt", "gt", "le", "al", "nv",
+};
+
+static const char* a64_shift_names[] = {
+    "lsl", "lsr", "asr", "ror",
+    "uxtb", "uxth", "uxtw", "uxtx",
+    "sxtb", "sxth", "sxtw", "sxtx",
+};
+
+static int64_t a64_sext(uint64_t x, int bits) {
+    uint64_t m = 1ull << (bits - 1);
+    x &= (m << 1) - 1;
+    return (int64_t) ((x ^ m) - m);
+}
+
+static TB_A64_Operand a64_gpr(int reg, bool sf, bool is_sp) {
+    if (reg == 31 && is_sp) reg = TB_A64_SP;
+    return (TB_A64_Operand){ TB_A64_OPERAND_GPR, .reg = reg, .size = sf ? 8 : 4, .index = -1 };
+}
+
+static TB_A64_Operand a64_fpr(int reg, int size) {
+    return (TB_A64_Operand){ TB_A64_OPERAND_FPR, .reg = reg, .size = size, .index = -1 };
+}
+
+static TB_A64_Operand a64_imm(int64_t imm) {
+    return (TB_A64_Operand){ TB_A64_OPERAND_IMM, .index = -1, .imm = imm };
+}
+
+static TB_A64_Operand a64_imm_fmt(int64_t imm, TB_A64_ImmFormat fmt) {
+    return (TB_A64_Operand){ TB_A64_OPERAND_IMM, .index = -1, .fmt = fmt, .imm = imm };
+}
+
+static TB_A64_Operand a64_shift(int kind, int amount) {
+    return (TB_A64_Operand){ TB_A64_OPERAND_SHIFT, .reg = kind, .index = -1, .imm = amount };
+}
+
+static TB_A64_Operand a64_cond(int cc) {
+    return (TB_A64_Operand){ TB_A64_OPERAND_COND, .reg = cc, .index = -1 };
+}
+
+static TB_A64_Operand a64_mem(int base, int64_t disp, TB_A64_MemMode mode) {
+    return (TB_A64_Operand){ TB_A64_OPERAND_MEM, .reg = base == 31 ? TB_A64_SP : base, .size = 8, .index = -1, .mode = mode, .imm = disp };
+}
+
+// DecodeBitMasks from the ARM manual, this is how logical immediates get packed
+static bool a64_decode_bitmask(int n, int imms, int immr, bool sf, uint64_t* out) {
+    int x = (n << 6) | (~imms & 0x3F);
+    if (x == 0) return false;
+
+    int len = 31 - __builtin_clz(x);
+    if (len < 1 || (!sf && n)) return false;
+
+    int size = 1 << len, levels = size - 1;
+    int s = imms & levels, r = immr & levels;
+    if (s == levels) return false;
+
+    uint64_t mask = size == 64 ? ~0ull : (1ull << size) - 1;
+    uint64_t elem = (1ull << (s + 1)) - 1;
+    if (r != 0) {
+        elem = ((elem >> r) | (elem << (size - r))) & mask;
+    }
+
+    for (int i = size; i < 64; i *= 2) {
+        elem |= elem << i;
+    }
+
+    *out = sf ? elem : elem & 0xFFFFFFFF;
+    return true;
+}
+
+static bool a64_dp_imm(TB_A64_Inst* restrict inst, uint32_t w) {
+    bool sf = w >> 31;
+    int rd = BITS(w, 0, 5), rn = BITS(w, 5, 5);
+
+    if ((w & 0x1F000000) == 0x10000000) {
+        // ADR/ADRP
+        int64_t imm = a64_sext((BITS(w, 5, 19) << 2) | BITS(w, 29, 2), 21);
+        bool page = w >> 31;
+
+        inst->mnemonic = page ? "adrp" : "adr";
+        PUSH(a64_gpr(rd, true, false));
+        PUSH(((TB_A64_Operand){ page ? TB_A64_OPERAND_PAGE : TB_A64_OPERAND_LABEL, .index = -1, .imm = page ? imm << 12 : imm }));
+        return true;
+    } else if ((w & 0x1F800000) == 0x11000000) {
+        // ADD/SUB (immediate)
+        bool op = BITS(w, 30, 1), s = BITS(w, 29, 1), sh = BITS(w, 22, 1);
+        int imm = BITS(w, 10, 12);
+
+        static const char* names[4] = { "add", "adds", "sub", "subs" };
+        inst->mnemonic = names[op*2 + s];
+        inst->sets_flags = s;
+
+        if (s && rd == 31) {
+            inst->mnemonic = op ? "cmp" : "cmn";
+        } else if (!op && !s && imm == 0 && !sh && (rd == 31 || rn == 31)) {
+            inst->mnemonic = "mov";
+            PUSH(a64_gpr(rd, sf, true));
+            PUSH(a64_gpr(rn, sf, true));
+            return true;
+        } else {
+            PUSH(a64_gpr(rd, sf, !s));
+        }
+
+        PUSH(a64_gpr(rn, sf, true));
+        PUSH(a64_imm(imm));
+        if (sh) PUSH(a64_shift(SHIFT_LSL, 12));
+        return true;
+    } else if ((w & 0x1F800000) == 0x12000000) {
+        // logical (immediate)
+        int opc = BITS(w, 29, 2);
+        uint64_t imm;
+        if (!a64_decode_bitmask(BITS(w, 22, 1), BITS(w, 10, 6), BITS(w, 16, 6), sf, &imm)) {
+            return false;
+        }
+
+        static const char* names[4] = { "and", "orr", "eor", "ands" };
+        inst->mnemonic = names[opc];
+        inst->sets_flags = opc == 3;
+
+        if (opc == 3 && rd == 31) {
+            inst->mnemonic = "tst";
+        } else if (opc == 1 && rn == 31) {
+            inst->mnemonic = "mov";
+            PUSH(a64_gpr(rd, sf, true));
+            PUSH(a64_imm(sf ? (int64_t) imm : (int32_t) imm));
+            return true;
+        } else {
+            PUSH(a64_gpr(rd, sf, opc != 3));
+        }
+
+        PUSH(a64_gpr(rn, sf, false));
+        PUSH(a64_imm_fmt(imm, TB_A64_IMM_HEX));
+        return true;
+    } else if ((w & 0x1F800000) == 0x12800000) {
+        // move wide
+        static const char* names[4] = { "movn", NULL, "movz", "movk" };
+        int opc = BITS(w, 29, 2), hw = BITS(w, 21, 2), imm = BITS(w, 5, 16);
+        if (names[opc] == NULL || (!sf && hw >= 2)) return false;
+
+        // movz/movn are mov unless some other encoding would be picked for the
+        // same value (a zero chunk that isn't the bottom, all ones in 32bit movn)
+        if (opc != 3 && !(imm == 0 && hw != 0) && !(opc == 0 && !sf && imm == 0xFFFF)) {
+            uint64_t x = (uint64_t) imm << (hw * 16);
+            if (opc == 0) x = ~x;
+
+            inst->mnemonic = "mov";
+            PUSH(a64_gpr(rd, sf, false));
+            PUSH(a64_imm(sf ? (int64_t) x : (int32_t) x));
+            return true;
+        }
+
+        inst->mnemonic = names[opc];
+        PUSH(a64_gpr(rd, sf, false));
+        PUSH(a64_imm(imm));
+        if (hw) PUSH(a64_shift(SHIFT_LSL, hw * 16));
+        return true;
+    } else if ((w & 0x1F800000) == 0x13000000) {
+        // bitfield
+        int opc = BITS(w, 29, 2), immr = BITS(w, 16, 6), imms = BITS(w, 10, 6);
+        int bits = sf ? 64 : 32;
+        if (opc == 3 || BITS(w, 22, 1) != sf) return false;
+
+        PUSH(a64_gpr(rd, sf, false));
+        if (opc == 0) {
+            // SBFM
+            if (imms == bits - 1) {
+                inst->mnemonic = "asr";
+                PUSH(a64_gpr(rn, sf, false));
+                PUSH(a64_imm(immr));
+            } else if (immr == 0 && (imms == 7 || imms == 15 || imms == 31)) {
+                inst->mnemonic = imms == 7 ? "sxtb" : imms == 15 ? "sxth" : "sxtw";
+                PUSH(a64_gpr(rn, false, false));
+            } else if (imms >= immr) {
+                inst->mnemonic = "sbfx";
+                PUSH(a64_gpr(rn, sf, false));
+                PUSH(a64_imm(immr));
+                PUSH(a64_imm(imms - immr + 1));
+            } else {
+                inst->mnemonic = "sbfiz";
+                PUSH(a64_gpr(rn, sf, false));
+                PUSH(a64_imm(bits - immr));
+                PUSH(a64_imm(imms + 1));
+            }
+        } else if (opc == 2) {
+            // UBFM
+            if (imms == bits - 1) {
+                inst->mnemonic = "lsr";
+                PUSH(a64_gpr(rn, sf, false));
+                PUSH(a64_imm(immr));
+            } else if (imms + 1 == immr) {
+                inst->mnemonic = "lsl";
+                PUSH(a64_gpr(rn, sf, false));
+                PUSH(a64_imm(bits - 1 - imms));
+            } else if (!sf && immr == 0 && (imms == 7 || imms == 15)) {
+                inst->mnemonic = imms == 7 ? "uxtb" : "uxth";
+                PUSH(a64_gpr(rn, false, false));
+            } else if (imms >= immr) {
+                inst->mnemonic = "ubfx";
+                PUSH(a64_gpr(rn, sf, false));
+                PUSH(a64_imm(immr));
+                PUSH(a64_imm(imms - immr + 1));
+            } else {
+                inst->mnemonic = "ubfiz";
+                PUSH(a64_gpr(rn, sf, false));
+                PUSH(a64_imm(bits - immr));
+                PUSH(a64_imm(imms + 1));
+            }
+        } else {
+            inst->mnemonic = "bfm";
+            PUSH(a64_gpr(rn, sf, false));
+            PUSH(a64_imm(immr));
+            PUSH(a64_imm(imms));
+        }
+        return true;
+    } else if ((w & 0x1FA00000) == 0x13800000) {
+        // EXTR, ror is the alias for when both sources match
+        int rm = BITS(w, 16, 5), imms = BITS(w, 10, 6);
+        PUSH(a64_gpr(rd, sf, false));
+        PUSH(a64_gpr(rn, sf, false));
+        if (rn == rm) {
+            inst->mnemonic = "ror";
+        } else {
+            inst->mnemonic = "extr";
+            PUSH(a64_gpr(rm, sf, false));
+        }
+        PUSH(a64_imm(imms));
+        return true;
+    }
+
+    return false;
+}
+
+static bool a64_branch(TB_A64_Inst* restrict inst, uint32_t w) {
+    if ((w & 0x7C000000) == 0x14000000) {
+        inst->mnemonic = w >> 31 ? "bl" : "b";
+        PUSH(((TB_A64_Operand){ TB_A64_OPERAND_LABEL, .index = -1, .imm = a64_sext(BITS(w, 0, 26), 26) * 4 }));
+        return true;
+    } else if ((w & 0xFF000010) == 0x54000000) {
+        static char names[16][8];
+        int cc = BITS(w, 0, 4);
+        if (names[cc][0] == 0) {
+            snprintf(names[cc], 8, "b.%s", a64_cond_names[cc]);
+        }
+
+        inst->mnemonic = names[cc];
+        PUSH(((TB_A64_Operand){ TB_A64_OPERAND_LABEL, .index = -1, .imm = a64_sext(BITS(w, 5, 19), 19) * 4 }));
+        return true;
+    } else if ((w & 0x7E000000) == 0x34000000) {
+        inst->mnemonic = BITS(w, 24, 1) ? "cbnz" : "cbz";
+        PUSH(a64_gpr(BITS(w, 0, 5), w >> 31, false));
+        PUSH(((TB_A64_Operand){ TB_A64_OPERAND_LABEL, .index = -1, .imm = a64_sext(BITS(w, 5, 19), 19) * 4 }));
+        return true;
+    } else if ((w & 0xFE1FFC1F) == 0xD61F0000) {
+        static const char* names[] = { "br", "blr", "ret" };
+        int opc = BITS(w, 21, 4), rn = BITS(w, 5, 5);
+        if (opc > 2) return false;
+
+        inst->mnemonic = names[opc];
+        if (opc != 2 || rn != 30) {
+            PUSH(a64_gpr(rn, true, false));
+        }
+        return true;
+    } else if ((w & 0xFF000000) == 0xD4000000) {
+        int opc = BITS(w, 21, 3), ll = BITS(w, 0, 2);
+        if (opc == 0 && ll == 1) inst->mnemonic = "svc";
+        else if (opc == 1 && ll == 0) inst->mnemonic = "brk";
+        else return false;
+
+        PUSH(a64_imm_fmt(BITS(w, 5, 16), opc == 1 ? TB_A64_IMM_HEX : TB_A64_IMM_DEC));
+        return true;
+    } else if (w == 0xD503201F) {
+        inst->mnemonic = "nop";
+        return true;
+    } else if ((w & 0xFFF00000) == 0xD5300000) {
+        inst->mnemonic = "mrs";
+        PUSH(a64_gpr(BITS(w, 0, 5), true, false));
+        PUSH(((TB_A64_Operand){ TB_A64_OPERAND_SYSREG, .index = -1, .imm = BITS(w, 5, 15) | (1u << 15) }));
+        return true;
+    }
+
+    return false;
+}
+
+static bool a64_load_store(TB_A64_Inst* restrict inst, uint32_t w) {
+    int size = BITS(w, 30, 2), rt = BITS(w, 0, 5), rn = BITS(w, 5, 5);
+    bool v = BITS(w, 26, 1);
+
+    if ((w & 0x3F000000) == 0x08000000) {
+        // exclusives & acquire/release
+        int o2 = BITS(w, 23, 1), l = BITS(w, 22, 1), o1 = BITS(w, 21, 1), o0 = BITS(w, 15, 1);
+        if (o1 || !o0) return false;
+
+        static const char* names[2][2][4] = {
+            { { "stlxrb", "stlxrh", "stlxr", "stlxr" }, { "ldaxrb", "ldaxrh", "ldaxr", "ldaxr" } },
+            { { "stlrb",  "stlrh",  "stlr",  "stlr"  }, { "ldarb",  "ldarh",  "ldar",  "ldar"  } },
+        };
+        inst->mnemonic = names[o2][l][size];
+        if (!o2 && !l) {
+            PUSH(a64_gpr(BITS(w, 16, 5), false, false));
+        }
+        PUSH(a64_gpr(rt, size == 3, false));
+        PUSH(a64_mem(rn, 0, TB_A64_MEM_OFFSET));
+        return true;
+    } else if ((w & 0x3A000000) == 0x28000000) {
+        // load/store pair
+        int opc = size, mode = BITS(w, 23, 2), l = BITS(w, 22, 1);
+        if (mode == 0 || opc == 3 || (!v && opc == 1)) return false;
+
+        int scale = v ? 2 + opc : 2 + (opc >> 1);
+        inst->mnemonic = l ? "ldp" : "stp";
+
+        TB_A64_MemMode modes[4] = { 0, TB_A64_MEM_POST, TB_A64_MEM_OFFSET, TB_A64_MEM_PRE };
+        int64_t disp = a64_sext(BITS(w, 15, 7), 7) << scale;
+        if (v) {
+            PUSH(a64_fpr(rt, 1 << scale));
+            PUSH(a64_fpr(BITS(w, 10, 5), 1 << scale));
+        } else {
+            PUSH(a64_gpr(rt, scale == 3, false));
+            PUSH(a64_gpr(BITS(w, 10, 5), scale == 3, false));
+        }
+        PUSH(a64_mem(rn, disp, modes[mode]));
+        return true;
+    } else if ((w & 0x3B000000) == 0x38000000 || (w & 0x3B000000) == 0x39000000) {
+        int opc = BITS(w, 22, 2);
+        bool unsigned_imm = BITS(w, 24, 1);
+
+        int scale = size;
+        bool is_load = opc & 1, reg_64 = size == 3;
+        if (v) {
+            // the 128bit form is encoded through the opc
+            if (opc >= 2) {
+                if (size != 0) return false;
+                scale = 4;
+            }
+            is_load = opc & 1;
+        } else if (opc >= 2) {
+            // sign extending loads (ldrsw only has the 64bit form)
+            if (size == 3 || (size == 2 && opc == 3)) return false;
+            is_load = true;
+            reg_64 = opc == 2;
+        }
+
+        TB_A64_Operand mem;
+        bool unscaled = false;
+        if (unsigned_imm) {
+            mem = a64_mem(rn, BITS(w, 10, 12) << scale, TB_A64_MEM_OFFSET);
+        } else if (BITS(w, 21, 1) == 0) {
+            int kind = BITS(w, 10, 2);
+            if (kind == 2) return false;
+
+            TB_A64_MemMode modes[4] = { TB_A64_MEM_OFFSET, TB_A64_MEM_POST, 0, TB_A64_MEM_PRE };
+            mem = a64_mem(rn, a64_sext(BITS(w, 12, 9), 9), modes[kind]);
+            unscaled = kind == 0;
+        } else if (BITS(w, 10, 2) == 2) {
+            // register offset, we only decode the LSL form
+            if (BITS(w, 13, 3) != 3) return false;
+
+            mem = a64_mem(rn, 0, TB_A64_MEM_OFFSET);
+            mem.index = BITS(w, 16, 5);
+            mem.shift = BITS(w, 12, 1) ? scale : 0;
+        } else {
+            return false;
+        }
+
+        static const char* gpr_names[2][2][4] = {
+            {
+                { "strb",   "strh",   "str",    "str"  },
+                { "ldrb",   "ldrh",   "ldr",    "ldr"  },
+            },
+            {
+                { "sturb",  "sturh",  "stur",   "stur" },
+                { "ldurb",  "ldurh",  "ldur",   "ldur" },
+            },
+        };
+
+        static const char* sext_names[2][3] = {
+            { "ldrsb",  "ldrsh",  "ldrsw"  },
+            { "ldursb", "ldursh", "ldursw" },
+        };
+
+        if (v) {
+            inst->mnemonic = gpr_names[unscaled][is_load][2];
+            PUSH(a64_fpr(rt, 1 << scale));
+        } else if (opc >= 2) {
+            inst->mnemonic = sext_names[unscaled][size];
+            PUSH(a64_gpr(rt, reg_64, false));
+        } else {
+            inst->mnemonic = gpr_names[unscaled][is_load][size];
+            PUSH(a64_gpr(rt, reg_64, false));
+        }
+        PUSH(mem);
+        return true;
+    }
+
+    return false;
+}
+
+static bool a64_dp_reg(TB_A64_Inst* restrict inst, uint32_t w) {
+    bool sf = w >> 31;
+    int rd = BITS(w, 0, 5), rn = BITS(w, 5, 5), rm = BITS(w, 16, 5);
+
+    if ((w & 0x1F000000) == 0x0A000000) {
+        // logical (shifted register)
+        static const char* names[8] = { "and", "bic", "orr", "orn", "eor", "eon", "ands", "bics" };
+        int opc = BITS(w, 29, 2), n = BITS(w, 21, 1), shift = BITS(w, 22, 2), amt = BITS(w, 10, 6);
+
+        inst->mnemonic = names[opc*2 + n];
+        inst->sets_flags = opc == 3;
+        if (opc == 1 && rn == 31 && shift == 0 && amt == 0) {
+            inst->mnemonic = n ? "mvn" : "mov";
+            PUSH(a64_gpr(rd, sf, false));
+            PUSH(a64_gpr(rm, sf, false));
+            return true;
+        } else if (opc == 1 && n && rn == 31) {
+            inst->mnemonic = "mvn";
+        } else if (opc == 3 && !n && rd == 31) {
+            inst->mnemonic = "tst";
+            PUSH(a64_gpr(rn, sf, false));
+        } else {
+            PUSH(a64_gpr(rd, sf, false));
+            PUSH(a64_gpr(rn, sf, false));
+        }
+
+        if (inst->mnemonic[0] == 'm') {
+            PUSH(a64_gpr(rd, sf, false));
+        }
+        PUSH(a64_gpr(rm, sf, false));
+        if (amt) PUSH(a64_shift(shift, amt));
+        return true;
+    } else if ((w & 0x1F200000) == 0x0B000000) {
+        // add/sub (shifted register)
+        static const char* names[4] = { "add", "adds", "sub", "subs" };
+        int op = BITS(w, 30, 1), s = BITS(w, 29, 1), shift = BITS(w, 22, 2), amt = BITS(w, 10, 6);
+        if (shift == 3) return false;
+
+        inst->mnemonic = names[op*2 + s];
+        inst->sets_flags = s;
+        if (s && rd == 31) {
+            inst->mnemonic = op ? "cmp" : "cmn";
+            PUSH(a64_gpr(rn, sf, false));
+        } else if (op && rn == 31) {
+            inst->mnemonic = s ? "negs" : "neg";
+            PUSH(a64_gpr(rd, sf, false));
+        } else {
+            PUSH(a64_gpr(rd, sf, false));
+            PUSH(a64_gpr(rn, sf, false));
+        }
+
+        PUSH(a64_gpr(rm, sf, false));
+        if (amt) PUSH(a64_shift(shift, amt));
+        return true;
+    } else if ((w & 0x1F200000) == 0x0B200000) {
+        // add/sub (extended register)
+        static const char* names[4] = { "add", "adds", "sub", "subs" };
+        int op = BITS(w, 30, 1), s = BITS(w, 29, 1), option = BITS(w, 13, 3), amt = BITS(w, 10, 3);
+        if (BITS(w, 22, 2) != 0 || amt > 4) return false;
+
+        inst->mnemonic = names[op*2 + s];
+        inst->sets_flags = s;
+        if (s && rd == 31) {
+            inst->mnemonic = op ? "cmp" : "cmn";
+        } else {
+            PUSH(a64_gpr(rd, sf, !s));
+        }
+
+        PUSH(a64_gpr(rn, sf, true));
+        PUSH(a64_gpr(rm, sf && (option & 3) == 3, false));
+
+        // LSL is preferred when the stack pointer is involved
+        bool uses_sp = (rd == 31 && !s) || rn == 31;
+        if (uses_sp && option == (sf ? 3 : 2)) {
+            if (amt) PUSH(a64_shift(SHIFT_LSL, amt));
+        } else {
+            PUSH(a64_shift(EXT_UXTB + option, amt));
+        }
+        return true;
+    } else if ((w & 0x5FE00000) == 0x1AC00000) {
+        // data processing (2 source)
+        const char* name = NULL;
+        switch (BITS(w, 10, 6)) {
+            case 0x02: name = "udiv"; break;
+            case 0x03: name = "sdiv"; break;
+            case 0x08: name = "lsl";  break;
+            case 0x09: name = "lsr";  break;
+            case 0x0A: name = "asr";  break;
+            case 0x0B: name = "ror";  break;
+            default: return false;
+        }
+
+        inst->mnemonic = name;
+        PUSH(a64_gpr(rd, sf, false));
+        PUSH(a64_gpr(rn, sf, false));
+        PUSH(a64_gpr(rm, sf, false));
+        return true;
+    } else if ((w & 0x5FFF0000) == 0x5AC00000) {
+        // data processing (1 source)
+        const char* name = NULL;
+        switch (BITS(w, 10, 6)) {
+            case 0x00: name = "rbit"; break;
+            case 0x01: name = "rev16"; break;
+            case 0x02: name = sf ? "rev32" : "rev"; break;
+            case 0x03: if (!sf) return false; name = "rev"; break;
+            case 0x04: name = "clz"; break;
+            case 0x05: name = "cls"; break;
+            default: return false;
+        }
+
+        inst->mnemonic = name;
+        PUSH(a64_gpr(rd, sf, false));
+        PUSH(a64_gpr(rn, sf, false));
+        return true;
+    } else if ((w & 0x1F000000) == 0x1B000000) {
+        // data processing (3 source)
+        int op31 = BITS(w, 21, 3), o0 = BITS(w, 15, 1), ra = BITS(w, 10, 5);
+        if (BITS(w, 29, 2) != 0) return false;
+
+        if (op31 == 0) {
+            PUSH(a64_gpr(rd, sf, false));
+            PUSH(a64_gpr(rn, sf, false));
+            PUSH(a64_gpr(rm, sf, false));
+            if (ra == 31) {
+                inst->mnemonic = o0 ? "mneg" : "mul";
+            } else {
+                inst->mnemonic = o0 ? "msub" : "madd";
+                PUSH(a64_gpr(ra, sf, false));
+            }
+            return true;
+        } else if ((op31 == 2 || op31 == 6) && !o0 && sf) {
+            inst->mnemonic = op31 == 2 ? "smulh" : "umulh";
+            PUSH(a64_gpr(rd, true, false));
+            PUSH(a64_gpr(rn, true, false));
+            PUSH(a64_gpr(rm, true, false));
+            return true;
+        }
+        return false;
+    } else if ((w & 0x1FE00000) == 0x1A800000) {
+        // conditional select
+        static const char* names[4] = { "csel", "csinc", "csinv", "csneg" };
+        int op = BITS(w, 30, 1), op2 = BITS(w, 10, 2), cc = BITS(w, 12, 4);
+        if (op2 > 1 || BITS(w, 29, 1)) return false;
+
+        PUSH(a64_gpr(rd, sf, false));
+        if (op2 == 1 && rn == 31 && rm == 31 && (cc >> 1) != 7) {
+            inst->mnemonic = op ? "csetm" : "cset";
+            PUSH(a64_cond(cc ^ 1));
+            return true;
+        }
+
+        inst->mnemonic = names[op*2 + op2];
+        PUSH(a64_gpr(rn, sf, false));
+        PUSH(a64_gpr(rm, sf, false));
+        PUSH(a64_cond(cc));
+        return true;
+    }
+
+    return false;
+}
+
+static bool a64_fp(TB_A64_Inst* restrict inst, uint32_t w) {
+    int ftype = BITS(w, 22, 2);
+    int rd = BITS(w, 0, 5), rn = BITS(w, 5, 5), rm = BITS(w, 16, 5);
+    int size = ftype == 0 ? 4 : ftype == 1 ? 8 : 0;
+
+    if ((w & 0x7F20FC00) == 0x1E200000) {
+        // conversions between floats and ints
+        bool sf = w >> 31;
+        int rmode = BITS(w, 19, 2), opcode = BITS(w, 16, 3);
+        if (size == 0) return false;
+
+        int kind = (rmode << 3) | opcode;
+        switch (kind) {
+            case 0x02: case 0x03:
+            inst->mnemonic = opcode == 2 ? "scvtf" : "ucvtf";
+            PUSH(a64_fpr(rd, size));
+            PUSH(a64_gpr(rn, sf, false));
+            return true;
+
+            case 0x18: case 0x19:
+            inst->mnemonic = opcode == 0 ? "fcvtzs" : "fcvtzu";
+            PUSH(a64_gpr(rd, sf, false));
+            PUSH(a64_fpr(rn, size));
+            return true;
+
+            case 0x06: case 0x07:
+            // fmov between register files, the sizes have to match
+            if (sf != (size == 8)) return false;
+            inst->mnemonic = "fmov";
+            if (opcode == 6) {
+                PUSH(a64_gpr(rd, sf, false));
+                PUSH(a64_fpr(rn, size));
+            } else {
+                PUSH(a64_fpr(rd, size));
+                PUSH(a64_gpr(rn, sf, false));
+            }
+            return true;
+
+            default: return false;
+        }
+    }
+
+    if ((w >> 24) != 0x1E || BITS(w, 21, 1) == 0 || size == 0) {
+        return false;
+    }
+
+    if ((w & 0xFF207C00) == 0x1E204000) {
+        // 1 source
+        int opcode = BITS(w, 15, 6);
+        switch (opcode) {
+            case 0x00: inst->mnemonic = "fmov";  break;
+            case 0x01: inst->mnemonic = "fabs";  break;
+            case 0x02: inst->mnemonic = "fneg";  break;
+            case 0x03: inst->mnemonic = "fsqrt"; break;
+            case 0x04: case 0x05: {
+                inst->mnemonic = "fcvt";
+                PUSH(a64_fpr(rd, opcode == 4 ? 4 : 8));
+                PUSH(a64_fpr(rn, size));
+                return true;
+            }
+            default: return false;
+        }
+
+        PUSH(a64_fpr(rd, size));
+        PUSH(a64_fpr(rn, size));
+        return true;
+    } else if ((w & 0xFF203C00) == 0x1E202000) {
+        // compare
+        int opcode2 = BITS(w, 0, 5);
+        if (opcode2 & 7) return false;
+
+        inst->mnemonic = opcode2 & 0x10 ? "fcmpe" : "fcmp";
+        inst->sets_flags = true;
+        PUSH(a64_fpr(rn, size));
+        if (opcode2 & 8) {
+            // compare against zero
+            PUSH(a64_imm_fmt(0, TB_A64_IMM_FP));
+        } else {
+            PUSH(a64_fpr(rm, size));
+        }
+        return true;
+    } else if ((w & 0xFF200C00) == 0x1E200800) {
+        // 2 source
+        static const char* names[9] = { "fmul", "fdiv", "fadd", "fsub", "fmax", "fmin", "fmaxnm", "fminnm", "fnmul" };
+        int opcode = BITS(w, 12, 4);
+        if (opcode > 8) return false;
+
+        inst->mnemonic = names[opcode];
+        PUSH(a64_fpr(rd, size));
+        PUSH(a64_fpr(rn, size));
+        PUSH(a64_fpr(rm, size));
+        return true;
+    } else if ((w & 0xFF200C00) == 0x1E200C00) {
+        inst->mnemonic = "fcsel";
+        PUSH(a64_fpr(rd, size));
+        PUSH(a64_fpr(rn, size));
+        PUSH(a64_fpr(rm, size));
+        PUSH(a64_cond(BITS(w, 12, 4)));
+        return true;
+    }
+
+    return false;
+}
+
+bool tb_a64_disasm(TB_A64_Inst* restrict inst, uint32_t word) {
+    *inst = (TB_A64_Inst){ 0 };
+
+    // the top level split is on bits 28:25
+    int op0 = BITS(word, 25, 4);
+    if ((op0 & 0b1110) == 0b1000) {
+        return a64_dp_imm(inst, word);
+    } else if ((op0 & 0b1110) == 0b1010) {
+        return a64_branch(inst, word);
+    } else if ((op0 & 0b0101) == 0b0100) {
+        return a64_load_store(inst, word);
+    } else if ((op0 & 0b0111) == 0b0101) {
+        return a64_dp_reg(inst, word);
+    } else if ((op0 & 0b0111) == 0b0111) {
+        return a64_fp(inst, word);
+    } else if (word >> 16 == 0) {
+        inst->mnemonic = "udf";
+        PUSH(a64_imm(word));
+        return true;
+    }
+
+    return false;
+}
+
+const char* tb_a64_reg_name(int reg, int size, bool is_fpr) {
+    static const char* gprs[2][33] = {
+        {
+            "w0",  "w1",  "w2",  "w3",  "w4",  "w5",  "w6",  "w7",
+            "w8",  "w9",  "w10", "w11", "w12", "w13", "w14", "w15",
+            "w16", "w17", "w18", "w19", "w20", "w21", "w22", "w23",
+            "w24", "w25", "w26", "w27", "w28", "w29", "w30", "wzr", "wsp",
+        },
+        {
+            "x0",  "x1",  "x2",  "x3",  "x4",  "x5",  "x6",  "x7",
+            "x8",  "x9",  "x10", "x11", "x12", "x13", "x14", "x15",
+            "x16", "x17", "x18", "x19", "x20", "x21", "x22", "x23",
+            "x24", "x25", "x26", "x27", "x28", "x29", "x30", "xzr", "sp",
+        },
+    };
+
+    #define FPRS(p) {                                           \
+        p"0",  p"1",  p"2",  p"3",  p"4",  p"5",  p"6",  p"7",  \
+        p"8",  p"9",  p"10", p"11", p"12", p"13", p"14", p"15", \
+        p"16", p"17", p"18", p"19", p"20", p"21", p"22", p"23", \
+        p"24", p"25", p"26", p"27", p"28", p"29", p"30", p"31", \
+    }
+    static const char* fprs[5][32] = { FPRS("b"), FPRS("h"), FPRS("s"), FPRS("d"), FPRS("q") };
+    #undef FPRS
+
+    // byte size -> 1 + row in fprs
+    static const uint8_t fpr_row[17] = { [1] = 1, [2] = 2, [4] = 3, [8] = 4, [16] = 5 };
+
+    if (is_fpr) {
+        if (size < 0 || size > 16 || fpr_row[size] == 0 || reg < 0 || reg >= 32) return "???";
+        return fprs[fpr_row[size] - 1][reg];
+    }
+
+    return reg <= TB_A64_SP ? gprs[size == 8][reg] : "???";
+}
+
+int tb_a64_print_operand(char* buf, size_t size, const TB_A64_Operand* op) {
+    switch (op->type) {
+        case TB_A64_OPERAND_GPR:
+        return snprintf(buf, size, "%s", tb_a64_reg_name(op->reg, op->size, false));
+
+        case TB_A64_OPERAND_FPR:
+        return snprintf(buf, size, "%s", tb_a64_reg_name(op->reg, op->size, true));
+
+        case TB_A64_OPERAND_IMM:
+        if (op->fmt == TB_A64_IMM_HEX) {
+            return snprintf(buf, size, "#0x%"PRIx64, (uint64_t) op->imm);
+        } else if (op->fmt == TB_A64_IMM_FP) {
+            return snprintf(buf, size, "#%.1f", (double) op->imm);
+        }
+        return snprintf(buf, size, "#%"PRId64, op->imm);
+
+        case TB_A64_OPERAND_LABEL:
+        case TB_A64_OPERAND_PAGE:
+        return snprintf(buf, size, "%s%"PRId64, op->imm >= 0 ? "." "+" : ".", op->imm);
+
+        case TB_A64_OPERAND_COND:
+        return snprintf(buf, size, "%s", a64_cond_names[op->reg & 15]);
+
+        case TB_A64_OPERAND_SHIFT:
+        if (op->imm == 0 && op->reg >= EXT_UXTB) {
+            return snprintf(buf, size, "%s", a64_shift_names[op->reg]);
+        }
+        return snprintf(buf, size, "%s #%"PRId64, a64_shift_names[op->reg], op->imm);
+
+        case TB_A64_OPERAND_SYSREG:
+        if (op->imm == 0xDF02) {
+            return snprintf(buf, size, "CNTVCT_EL0");
+        }
+        return snprintf(buf, size, "S%d_%d_C%d_C%d_%d", (int) (op->imm >> 14) & 3, (int) (op->imm >> 11) & 7,
+            (int) (op->imm >> 7) & 15, (int) (op->imm >> 3) & 15, (int) op->imm & 7);
+
+        case TB_A64_OPERAND_MEM: {
+            const char* base = tb_a64_reg_name(op->reg, 8, false);
+            if (op->index >= 0) {
+                const char* index = tb_a64_reg_name(op->index, 8, false);
+                if (op->shift) {
+                    return snprintf(buf, size, "[%s, %s, lsl #%d]", base, index, op->shift);
+                }
+                return snprintf(buf, size, "[%s, %s]", base, index);
+            }
+
+            switch (op->mode) {
+                case TB_A64_MEM_PRE:  return snprintf(buf, size, "[%s, #%"PRId64"]!", base, op->imm);
+                case TB_A64_MEM_POST: return snprintf(buf, size, "[%s], #%"PRId64, base, op->imm);
+                default: break;
+            }
+
+            if (op->imm == 0) {
+                return snprintf(buf, size, "[%s]", base);
+            }
+            return snprintf(buf, size, "[%s, #%"PRId64"]", base, op->imm);
+        }
+
+        default:
+        return snprintf(buf, size, "???");
+    }
+}
+
+#undef BITS
+#undef PUSH
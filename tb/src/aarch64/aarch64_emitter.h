@@ -1,114 +1,489 @@
-
-typedef enum {
-    AND,
-    ADD,
-    ADDS,
-    SUB,
-    SUBS,
-} DPOpcode;
-
-enum {
-    SHIFT_LSL,
-    SHIFT_LSR,
-    SHIFT_ASR,
-    SHIFT_RESERVED,
-};
-
-typedef struct {
-    uint16_t r, i;
-} DPInst;
-
-static const DPInst inst_table[] = {
-    [AND]  = { .r = 0b00001010, .i = 0b00010010 },
-    [ADD]  = { .r = 0b00001011, .i = 0b00010001 },
-    [ADDS] = { .r = 0b00101011, .i = 0b00110001 },
-    [SUB]  = { .r = 0b01010001, .i = 0b01010001 },
-    [SUBS] = { .r = 0b01101011, .i = 0b01110001 },
-};
-
-// data processing instruction
-//   OP dst, src, imm
+// every instruction is a single 32bit word, the encoders here don't know
+// anything about the IR, they just pack fields.
 //
 // 0000 0000 0000 0000 0000 0000 0000 0000
-// AOOO OOOO SSII IIII IIII IINN NNND DDDD
+// F... .... .... .... .... ..NN NNND DDDD
 //
-// A - set when we're doing the 64bit variant of the instruction
-// O - is the opcode
-// S - shift
-// I - immediate
-// N - source
+// F - sf, set when we're doing the 64bit variant of the instruction
+// N - first source
 // D - destination
-static void emit_dp_imm(TB_CGEmitter* restrict e, DPOpcode op, GPR dst, GPR src, uint16_t imm, uint8_t shift, bool _64bit) {
-    uint32_t inst = _64bit ? (1u << 31u) : 0;
+//
+// register 31 is either the zero register or SP depending on the
+// instruction, it's on the caller to know which one they're getting.
+
+// the listing isn't built from what we meant to emit, we decode each word
+// back so whatever is printed is what the CPU sees. target names the label
+// or symbol for the pc-relative (and :lo12:) operands.
+static void emit_word(TB_CGEmitter* restrict e, uint32_t w, const char* target) {
+    EMIT4(e, w);
+
+    if (e->emit_asm) {
+        TB_A64_Inst inst;
+        bool ok = tb_a64_disasm(&inst, w);
+        tb_assert(ok, "aarch64: we emitted an instruction we can't decode (%#08x)", w);
 
-    inst |= ((inst_table[op].i & 0xFF) << 24u);
+        char buf[64];
+        EMITA(e, "  %s", inst.mnemonic);
+        FOREACH_N(i, 0, inst.operand_count) {
+            TB_A64_Operand* op = &inst.operands[i];
+            const char* sep = i == 0 ? " " : ", ";
 
-    if (op == ADD || op == SUB) {
-        if (shift == 12) inst |= (shift << 22u);
-        else if (shift == 0) {}
-        else {
-            tb_panic("emit_dp_imm: shift amount cannot be %d (only 0 or 12)", shift);
+            if (target != NULL && (op->type == TB_A64_OPERAND_LABEL || op->type == TB_A64_OPERAND_PAGE)) {
+                EMITA(e, "%s%s", sep, target);
+            } else if (target != NULL && op->type == TB_A64_OPERAND_IMM && i + 1 == inst.operand_count) {
+                EMITA(e, "%s:lo12:%s", sep, target);
+            } else {
+                tb_a64_print_operand(buf, sizeof(buf), op);
+                EMITA(e, "%s%s", sep, buf);
+            }
         }
+        EMITA(e, "\n");
     }
+}
+
+////////////////////////////////
+// Data processing (immediate)
+////////////////////////////////
+// add/sub immediate
+//   OP dst, src, #imm{, lsl #12}
+//
+// FOSx xxxx xLII IIII IIII IINN NNND DDDD
+//
+// O - set for sub
+// S - set the flags (adds/subs)
+// L - shift the immediate up by 12
+// I - immediate
+//
+// with S clear register 31 is SP on both sides, otherwise Rd=31 is the zero
+// register (that's how cmp/cmn work).
+static void emit_addsub_imm(TB_CGEmitter* restrict e, bool sub, bool set_flags, bool sf, int dst, int src, uint32_t imm, bool lsl12) {
+    assert(imm < 4096);
+    uint32_t w = 0x11000000 | ((uint32_t) sf << 31u) | (sub << 30u) | (set_flags << 29u);
+    w |= (lsl12 << 22u) | (imm << 10u) | ((src & 31) << 5u) | (dst & 31);
+    emit_word(e, w, NULL);
+}
+
+// logical immediate
+//   OP dst, src, #bitmask
+//
+// FOOx xxxx xNRR RRRR SSSS SSNN NNND DDDD
+//
+// O - 0 and, 1 orr, 2 eor, 3 ands
+// N:R:S - the packed bitmask (see encode_bitmask)
+static void emit_logical_imm(TB_CGEmitter* restrict e, int op, bool sf, int dst, int src, uint32_t bitmask) {
+    uint32_t w = 0x12000000 | ((uint32_t) sf << 31u) | (op << 29u);
+    w |= (bitmask << 10u) | ((src & 31) << 5u) | (dst & 31);
+    emit_word(e, w, NULL);
+}
+
+// move wide
+//   OP dst, #imm{, lsl #hw*16}
+//
+// FOOx xxxx xHHI IIII IIII IIII IIID DDDD
+//
+// O - 0 movn, 2 movz, 3 movk
+// H - which halfword
+static void emit_movw(TB_CGEmitter* restrict e, int op, bool sf, int dst, uint16_t imm, int hw) {
+    uint32_t w = 0x12800000 | ((uint32_t) sf << 31u) | (op << 29u);
+    w |= (hw << 21u) | ((uint32_t) imm << 5u) | (dst & 31);
+    emit_word(e, w, NULL);
+}
+
+// bitfield move, this is behind all the immediate shifts and extensions
+//   OP dst, src, #immr, #imms
+//
+// FOOx xxxx xNRR RRRR SSSS SSNN NNND DDDD
+//
+// O - 0 sbfm, 2 ubfm
+// N - has to match F
+static void emit_bitfield(TB_CGEmitter* restrict e, int op, bool sf, int dst, int src, int immr, int imms) {
+    uint32_t w = 0x13000000 | ((uint32_t) sf << 31u) | (op << 29u) | (sf << 22u);
+    w |= (immr << 16u) | (imms << 10u) | ((src & 31) << 5u) | (dst & 31);
+    emit_word(e, w, NULL);
+}
+
+// extract, ror #imm is extr with both sources being the same
+//   extr dst, a, b, #lsb
+//
+// Fxxx xxxx xNxM MMMM LLLL LLNN NNND DDDD
+static void emit_extr(TB_CGEmitter* restrict e, bool sf, int dst, int a, int b, int lsb) {
+    uint32_t w = 0x13800000 | ((uint32_t) sf << 31u) | (sf << 22u);
+    w |= ((b & 31) << 16u) | (lsb << 10u) | ((a & 31) << 5u) | (dst & 31);
+    emit_word(e, w, NULL);
+}
+
+// adrp dst, sym
+//
+// 1LLx xxxx HHHH HHHH HHHH HHHH HHHD DDDD
+//
+// the page offset is left as zero, the object file relocates it
+static void emit_adrp(TB_CGEmitter* restrict e, int dst, const char* target) {
+    emit_word(e, 0x90000000 | (dst & 31), target);
+}
+
+////////////////////////////////
+// Data processing (register)
+////////////////////////////////
+// add/sub shifted register
+//   OP dst, a, b{, shift #amount}
+//
+// FOSx xxxx TT0M MMMM AAAA AANN NNND DDDD
+//
+// T - shift kind (lsl, lsr, asr)
+// A - shift amount
+//
+// register 31 is always the zero register here
+static void emit_addsub_reg(TB_CGEmitter* restrict e, bool sub, bool set_flags, bool sf, int dst, int a, int b, int shift, int amount) {
+    uint32_t w = 0x0B000000 | ((uint32_t) sf << 31u) | (sub << 30u) | (set_flags << 29u);
+    w |= (shift << 22u) | ((b & 31) << 16u) | (amount << 10u) | ((a & 31) << 5u) | (dst & 31);
+    emit_word(e, w, NULL);
+}
 
-    inst |= (imm & 0xFFF) << 10u;
-    inst |= (src & 0b11111) << 5u;
-    inst |= (dst & 0b11111) << 0u;
-    EMIT4(e, inst);
+// logical shifted register
+//   OP dst, a, b{, shift #amount}
+//
+// FOOx xxxx TTIM MMMM AAAA AANN NNND DDDD
+//
+// O - 0 and, 1 orr, 2 eor, 3 ands
+// I - invert b (bic, orn, eon, bics), mvn is orn with a=zr
+static void emit_logical_reg(TB_CGEmitter* restrict e, int op, bool invert, bool sf, int dst, int a, int b, int shift, int amount) {
+    uint32_t w = 0x0A000000 | ((uint32_t) sf << 31u) | (op << 29u) | (invert << 21u);
+    w |= (shift << 22u) | ((b & 31) << 16u) | (amount << 10u) | ((a & 31) << 5u) | (dst & 31);
+    emit_word(e, w, NULL);
 }
 
-// data processing instruction
+// mov dst, src (orr dst, zr, src)
+static void emit_mov(TB_CGEmitter* restrict e, bool sf, int dst, int src) {
+    emit_logical_reg(e, 1, false, sf, dst, ZR, src, 0, 0);
+}
+
+// data processing with 2 sources
 //   OP dst, a, b
 //
-// 0000 0000 0000 0000 0000 0000 0000 0000
-// AOOO OOOO SS_M MMMM IIII IINN NNND DDDD
-// x101 1110 xx1m mmmm x000 01nn nnnd dddd  -  add Sd Sn Sm
-static void emit_dp_r(TB_CGEmitter* restrict e, DPOpcode op, GPR dst, GPR a, GPR b, uint16_t imm, uint8_t shift, bool _64bit) {
-    uint32_t inst = _64bit ? (1u << 31u) : 0;
-
-    inst |= ((inst_table[op].r & 0x7F) << 24u);
-
-    if (op == ADD || op == SUB) {
-        if (shift == 12) inst |= (shift << 22u);
-        else if (shift == 0) {}
-        else {
-            tb_panic("emit_dp_r: shift amount cannot be %d (only 0 or 12)", shift);
-        }
-    }
+// Fxxx xxxx xxxM MMMM OOOO OONN NNND DDDD
+//
+// O - 2 udiv, 3 sdiv, 8 lslv, 9 lsrv, 10 asrv, 11 rorv
+static void emit_dp2(TB_CGEmitter* restrict e, int op, bool sf, int dst, int a, int b) {
+    uint32_t w = 0x1AC00000 | ((uint32_t) sf << 31u);
+    w |= ((b & 31) << 16u) | (op << 10u) | ((a & 31) << 5u) | (dst & 31);
+    emit_word(e, w, NULL);
+}
+
+// data processing with 1 source
+//   OP dst, src
+//
+// Fxxx xxxx xxxx xxxx OOOO OONN NNND DDDD
+//
+// O - 0 rbit, 1 rev16, 2 rev (32bit) / rev32, 3 rev (64bit), 4 clz
+static void emit_dp1(TB_CGEmitter* restrict e, int op, bool sf, int dst, int src) {
+    uint32_t w = 0x5AC00000 | ((uint32_t) sf << 31u);
+    w |= (op << 10u) | ((src & 31) << 5u) | (dst & 31);
+    emit_word(e, w, NULL);
+}
+
+// data processing with 3 sources
+//   madd dst, a, b, c (dst = c + a*b)
+//   msub dst, a, b, c (dst = c - a*b)
+//
+// Fxxx xxxx xxxM MMMM OCCC CCNN NNND DDDD
+//
+// O - set for msub, mul is madd with c=zr
+static void emit_madd(TB_CGEmitter* restrict e, bool sub, bool sf, int dst, int a, int b, int c) {
+    uint32_t w = 0x1B000000 | ((uint32_t) sf << 31u) | (sub << 15u);
+    w |= ((b & 31) << 16u) | ((c & 31) << 10u) | ((a & 31) << 5u) | (dst & 31);
+    emit_word(e, w, NULL);
+}
+
+// high half of the 128bit product, 64bit only
+//   umulh/smulh dst, a, b
+static void emit_mulh(TB_CGEmitter* restrict e, bool is_signed, int dst, int a, int b) {
+    uint32_t w = is_signed ? 0x9B400000 : 0x9BC00000;
+    w |= ((b & 31) << 16u) | (31u << 10u) | ((a & 31) << 5u) | (dst & 31);
+    emit_word(e, w, NULL);
+}
+
+// conditional select
+//   csel/csinc dst, a, b, cc
+//
+// Fxxx xxxx xxxM MMMM CCCC xINN NNND DDDD
+//
+// I - set for csinc, cset is csinc dst, zr, zr with the inverted condition
+static void emit_csel(TB_CGEmitter* restrict e, bool inc, bool sf, int dst, int a, int b, Cond cc) {
+    uint32_t w = 0x1A800000 | ((uint32_t) sf << 31u) | (inc << 10u);
+    w |= ((b & 31) << 16u) | (cc << 12u) | ((a & 31) << 5u) | (dst & 31);
+    emit_word(e, w, NULL);
+}
+
+////////////////////////////////
+// Branches & system
+////////////////////////////////
+// b/bl rel
+//
+// Lxxx xxII IIII IIII IIII IIII IIII IIII
+//
+// L - set for bl
+// I - word offset
+static void emit_b(TB_CGEmitter* restrict e, bool link, int32_t rel, const char* target) {
+    uint32_t w = (link ? 0x94000000 : 0x14000000) | (rel & 0x3FFFFFF);
+    emit_word(e, w, target);
+}
+
+// b.cond rel
+//
+// xxxx xxxx IIII IIII IIII IIII IIIx CCCC
+static void emit_bcond(TB_CGEmitter* restrict e, Cond cc, int32_t rel, const char* target) {
+    uint32_t w = 0x54000000 | ((rel & 0x7FFFF) << 5u) | cc;
+    emit_word(e, w, target);
+}
+
+// cbz/cbnz src, rel
+//
+// Fxxx xxxO IIII IIII IIII IIII IIIN NNNN
+//
+// O - set for cbnz
+static void emit_cbz(TB_CGEmitter* restrict e, bool nz, bool sf, int src, int32_t rel, const char* target) {
+    uint32_t w = 0x34000000 | ((uint32_t) sf << 31u) | (nz << 24u) | ((rel & 0x7FFFF) << 5u) | (src & 31);
+    emit_word(e, w, target);
+}
+
+// br/blr src
+static void emit_br(TB_CGEmitter* restrict e, bool link, int src) {
+    emit_word(e, (link ? 0xD63F0000 : 0xD61F0000) | ((src & 31) << 5u), NULL);
+}
+
+static void emit_ret(TB_CGEmitter* restrict e) {
+    emit_word(e, 0xD65F03C0, NULL);
+}
+
+static void emit_svc(TB_CGEmitter* restrict e, uint16_t imm) {
+    emit_word(e, 0xD4000001 | ((uint32_t) imm << 5u), NULL);
+}
+
+static void emit_brk(TB_CGEmitter* restrict e, uint16_t imm) {
+    emit_word(e, 0xD4200000 | ((uint32_t) imm << 5u), NULL);
+}
+
+// mrs dst, cntvct_el0
+static void emit_mrs_cntvct(TB_CGEmitter* restrict e, int dst) {
+    emit_word(e, 0xD53BE040 | (dst & 31), NULL);
+}
+
+////////////////////////////////
+// Loads & stores
+////////////////////////////////
+// all the single register loads and stores share the top bits
+//
+// SSxx VxxL ...
+//
+// S - log2 of the access size (for FP 2 is S and 3 is D)
+// V - FP/SIMD register
+// L - load
+static uint32_t ldst_kind(int size, bool fp, bool load) {
+    return ((uint32_t) size << 30u) | (fp << 26u) | (load << 22u);
+}
+
+// unscaled and indexed forms
+//   ldur/stur rt, [rn, #imm]
+//   ldr/str   rt, [rn], #imm
+//   ldr/str   rt, [rn, #imm]!
+//
+// SSxx VxxL xxxI IIII IIII MMNN NNNT TTTT
+//
+// M - 0 unscaled offset, 1 post-index, 3 pre-index
+static void emit_ldst_unscaled(TB_CGEmitter* restrict e, int size, bool fp, bool load, int rt, int rn, int32_t imm, int mode) {
+    assert(imm >= -256 && imm < 256);
+    uint32_t w = 0x38000000 | ldst_kind(size, fp, load) | ((imm & 0x1FF) << 12u) | (mode << 10u);
+    w |= ((rn & 31) << 5u) | (rt & 31);
+    emit_word(e, w, NULL);
+}
+
+// unsigned offset (scaled by the access size)
+//   ldr/str rt, [rn, #imm]
+//
+// SSxx VxxL IIII IIII IIII NNNN NNNT TTTT
+static void emit_ldst_scaled(TB_CGEmitter* restrict e, int size, bool fp, bool load, int rt, int rn, uint32_t imm) {
+    assert(imm < 4096);
+    uint32_t w = 0x39000000 | ldst_kind(size, fp, load) | (imm << 10u);
+    w |= ((rn & 31) << 5u) | (rt & 31);
+    emit_word(e, w, NULL);
+}
+
+// register offset
+//   ldr/str rt, [rn, rm{, lsl #size}]
+//
+// SSxx VxxL xx1M MMMM 011S 10NN NNNT TTTT
+static void emit_ldst_reg(TB_CGEmitter* restrict e, int size, bool fp, bool load, int rt, int rn, int rm, bool scaled) {
+    uint32_t w = 0x38206800 | ldst_kind(size, fp, load) | ((rm & 31) << 16u) | (scaled << 12u);
+    w |= ((rn & 31) << 5u) | (rt & 31);
+    emit_word(e, w, NULL);
+}
+
+// frame records are the only pairs we do
+//   stp x29, x30, [sp, #-16]!
+//   ldp x29, x30, [sp], #16
+static void emit_push_frame_record(TB_CGEmitter* restrict e) {
+    emit_word(e, 0xA9800000 | ((-2 & 0x7F) << 15u) | (LR << 10u) | (SP << 5u) | FP, NULL);
+}
+
+static void emit_pop_frame_record(TB_CGEmitter* restrict e) {
+    emit_word(e, 0xA8C00000 | (2 << 15u) | (LR << 10u) | (SP << 5u) | FP, NULL);
+}
+
+// acquire/release exclusives, no offsets on these
+//   ldaxr rt, [rn]
+//   stlxr ws, rt, [rn]
+//   ldar  rt, [rn]
+static void emit_ldaxr(TB_CGEmitter* restrict e, int size, int rt, int rn) {
+    emit_word(e, ((uint32_t) size << 30u) | 0x085FFC00 | ((rn & 31) << 5u) | (rt & 31), NULL);
+}
+
+static void emit_stlxr(TB_CGEmitter* restrict e, int size, int rs, int rt, int rn) {
+    emit_word(e, ((uint32_t) size << 30u) | 0x0800FC00 | ((rs & 31) << 16u) | ((rn & 31) << 5u) | (rt & 31), NULL);
+}
 
-    inst |= (b & 0b11111) << 16u;
-    inst |= (imm & 0xFFF) << 10u;
-    inst |= (a & 0b11111) << 5u;
-    inst |= (dst & 0b11111) << 0u;
-    EMIT4(e, inst);
+static void emit_ldar(TB_CGEmitter* restrict e, int size, int rt, int rn) {
+    emit_word(e, ((uint32_t) size << 30u) | 0x08DFFC00 | ((rn & 31) << 5u) | (rt & 31), NULL);
 }
 
-static void emit_mov(TB_CGEmitter* restrict e, uint8_t dst, uint8_t src, bool _64bit) {
-    uint32_t inst = (_64bit ? (1 << 31u) : 0);
+////////////////////////////////
+// Floating point
+////////////////////////////////
+// FP data processing with 2 sources
+//   OP dst, a, b
+//
+// xxxx xxxx xTxM MMMM OOOO xxNN NNND DDDD
+//
+// T - 0 single, 1 double
+// O - 0 fmul, 1 fdiv, 2 fadd, 3 fsub, 4 fmax, 5 fmin
+static void emit_fp2(TB_CGEmitter* restrict e, int op, bool is_double, int dst, int a, int b) {
+    uint32_t w = 0x1E200800 | (is_double << 22u) | (op << 12u);
+    w |= ((b & 31) << 16u) | ((a & 31) << 5u) | (dst & 31);
+    emit_word(e, w, NULL);
+}
 
-    inst |= (0b00101010 << 24u);
-    inst |= (src & 0b11111) << 16u;
-    inst |= (0b11111) << 5u;
-    inst |= (dst & 0b11111) << 0u;
-    EMIT4(e, inst);
+// FP data processing with 1 source
+//   OP dst, src
+//
+// xxxx xxxx xTxx xxxO OOOO OxNN NNND DDDD
+//
+// O - 0 fmov, 2 fneg, 5 fcvt to double, 4 fcvt to single
+static void emit_fp1(TB_CGEmitter* restrict e, int op, bool is_double, int dst, int src) {
+    uint32_t w = 0x1E204000 | (is_double << 22u) | (op << 15u);
+    w |= ((src & 31) << 5u) | (dst & 31);
+    emit_word(e, w, NULL);
+}
+
+// fcmp a, b (or #0.0 if zero is set)
+static void emit_fcmp(TB_CGEmitter* restrict e, bool is_double, int a, int b, bool zero) {
+    uint32_t w = 0x1E202000 | (is_double << 22u) | (zero << 3u);
+    w |= ((zero ? 0 : b & 31) << 16u) | ((a & 31) << 5u);
+    emit_word(e, w, NULL);
 }
 
-static void emit_movz(TB_CGEmitter* restrict e, uint8_t dst, uint16_t imm, uint8_t shift, bool _64bit) {
-    uint32_t inst = (_64bit ? (1 << 31u) : 0);
+// conversions between integer and FP registers
+//   OP dst, src
+//
+// Fxxx xxxx xTxR ROOO xxxx xxNN NNND DDDD
+//
+// F - the integer side is 64bit
+// R:O - 0x02 scvtf, 0x03 ucvtf, 0x18 fcvtzs, 0x19 fcvtzu, 0x06 fmov to gpr, 0x07 fmov to fpr
+static void emit_fp_int(TB_CGEmitter* restrict e, int op, bool sf, bool is_double, int dst, int src) {
+    uint32_t w = 0x1E200000 | ((uint32_t) sf << 31u) | (is_double << 22u) | (op << 16u);
+    w |= ((src & 31) << 5u) | (dst & 31);
+    emit_word(e, w, NULL);
+}
+
+////////////////////////////////
+// Immediates
+////////////////////////////////
+// logical immediates are a rotated run of ones repeated across the register in
+// 2, 4, 8, 16, 32 or 64bit elements, returns false if x isn't one of those. The
+// result is N:immr:imms packed the same way the instructions want it.
+static bool encode_bitmask(uint64_t x, bool sf, uint32_t* out) {
+    if (!sf) {
+        x = (x & 0xFFFFFFFF) | (x << 32);
+    }
+
+    if (x == 0 || x == ~UINT64_C(0)) {
+        return false;
+    }
+
+    // find the smallest element which repeats
+    int size = 64;
+    while (size > 2) {
+        int half = size / 2;
+        uint64_t mask = (UINT64_C(1) << half) - 1;
+        if ((x & mask) != ((x >> half) & mask)) {
+            break;
+        }
+        size = half;
+    }
+
+    uint64_t mask = size == 64 ? ~UINT64_C(0) : (UINT64_C(1) << size) - 1;
+    uint64_t elem = x & mask;
+    int ones = tb_popcount64(elem);
+
+    // it's encodable if the element is a rotated run of ones
+    uint64_t run = (UINT64_C(1) << ones) - 1;
+    FOREACH_N(r, 0, size) {
+        uint64_t rot = r == 0 ? run : ((run << r) | (run >> (size - r))) & mask;
+        if (rot == elem) {
+            uint32_t immr = (size - r) % size;
+            uint32_t imms = (~(2*size - 1) & 0x3F) | (ones - 1);
+            *out = ((size == 64) << 12u) | (immr << 6u) | imms;
+            return true;
+        }
+    }
 
-    inst |= (0b010100101 << 23u);
-    inst |= shift << 21u;
-    inst |= imm << 5u;
-    inst |= (dst & 0b11111) << 0u;
-    EMIT4(e, inst);
+    return false;
 }
 
-static void emit_movk(TB_CGEmitter* restrict e, uint8_t dst, uint16_t imm, uint8_t shift, bool _64bit) {
-    uint32_t inst = (_64bit ? (1 << 31u) : 0);
+// any constant into a register, we pick the shortest of:
+//   orr dst, zr, #bitmask
+//   movz + movk...
+//   movn + movk...
+static void emit_movi(TB_CGEmitter* restrict e, bool sf, int dst, uint64_t x) {
+    if (!sf) {
+        x &= 0xFFFFFFFF;
+    }
+
+    uint32_t bitmask;
+    int chunks = sf ? 4 : 2;
+    int zeros = 0, ones = 0;
+    FOREACH_N(i, 0, chunks) {
+        uint16_t h = x >> (i*16);
+        zeros += (h == 0);
+        ones += (h == 0xFFFF);
+    }
 
-    inst |= (0b011100101 << 23u);
-    inst |= shift << 21u;
-    inst |= imm << 5u;
-    inst |= (dst & 0b11111) << 0u;
-    EMIT4(e, inst);
+    // movz/movn can do a chunk on their own, only bother with the bitmask
+    // if it saves instructions.
+    if (chunks - TB_MAX(zeros, ones) > 1 && encode_bitmask(x, sf, &bitmask)) {
+        emit_logical_imm(e, 1, sf, dst, ZR, bitmask);
+        return;
+    }
+
+    // with movn we're filling the untouched chunks with ones
+    bool inverted = ones > zeros;
+    uint16_t fill = inverted ? 0xFFFF : 0;
+
+    bool first = true;
+    FOREACH_N(i, 0, chunks) {
+        uint16_t h = x >> (i*16);
+        if (h == fill) {
+            continue;
+        }
+
+        if (first) {
+            emit_movw(e, inverted ? 0 : 2, sf, dst, inverted ? ~h : h, i);
+            first = false;
+        } else {
+            emit_movw(e, 3, sf, dst, h, i);
+        }
+    }
+
+    // all the chunks were the fill
+    if (first) {
+        emit_movw(e, inverted ? 0 : 2, sf, dst, 0, 0);
+    }
 }
@@ -30,9 +30,9 @@ static int debug_type_size(TB_ABI abi, TB_DebugType* t) {
         case TB_DEBUG_TYPE_UINT: return (t->int_bits + 7) / 8;
         case TB_DEBUG_TYPE_INT:  return (t->int_bits + 7) / 8;
 
-        case TB_DEBUG_TYPE_FUNCTION: return 8;
-        case TB_DEBUG_TYPE_ARRAY:    return 8;
-        case TB_DEBUG_TYPE_POINTER:  return 8;
+        case TB_DEBUG_TYPE_FUNCTION: return abi == TB_ABI_WASM32 ? 4 : 8;
+        case TB_DEBUG_TYPE_ARRAY:    return abi == TB_ABI_WASM32 ? 4 : 8;
+        case TB_DEBUG_TYPE_POINTER:  return abi == TB_ABI_WASM32 ? 4 : 8;
 
         case TB_DEBUG_TYPE_FLOAT: {
             switch (t->float_fmt) {
@@ -62,6 +62,54 @@ static int debug_type_align(TB_ABI abi, TB_DebugType* t) {
     return debug_type_size(abi, t);
 }
 
+// AAPCS64 homogeneous floating-point aggregate: every leaf member is the same
+// float type, there's 1 to 4 of them and no padding. returns the member count
+// (0 if it's not one) and the leaf's format in fmt.
+static int hfa_members(TB_DebugType* t, int* fmt) {
+    while (t->tag == TB_DEBUG_TYPE_ALIAS) {
+        t = t->alias.type;
+    }
+
+    switch (t->tag) {
+        case TB_DEBUG_TYPE_FLOAT: {
+            if (*fmt >= 0 && *fmt != t->float_fmt) return 0;
+
+            *fmt = t->float_fmt;
+            return 1;
+        }
+
+        case TB_DEBUG_TYPE_ARRAY: {
+            if (t->array.count == 0 || t->array.count > 4) return 0;
+
+            int n = hfa_members(t->array.base, fmt);
+            return n * t->array.count <= 4 ? n * t->array.count : 0;
+        }
+
+        case TB_DEBUG_TYPE_STRUCT:
+        case TB_DEBUG_TYPE_UNION: {
+            // unions are as big as their biggest member
+            int total = 0;
+            FOREACH_N(i, 0, t->record.count) {
+                int n = hfa_members(t->record.members[i]->field.type, fmt);
+                if (n == 0) return 0;
+
+                if (t->tag == TB_DEBUG_TYPE_UNION) {
+                    if (total < n) total = n;
+                } else {
+                    total += n;
+                }
+            }
+
+            if (total == 0 || total > 4) return 0;
+
+            int leaf_size = *fmt == TB_FLT_32 ? 4 : 8;
+            return total * leaf_size == t->record.size ? total : 0;
+        }
+
+        default: return 0;
+    }
+}
+
 static RegClass classify_reg(TB_ABI abi, TB_DebugType* t) {
     switch (abi) {
         // [https://learn.microsoft.com/en-us/cpp/build/x64-calling-convention]
@@ -77,6 +125,35 @@ static RegClass classify_reg(TB_ABI abi, TB_DebugType* t) {
             return RG_MEMORY;
         }
 
+        // [https://github.com/ARM-software/abi-aa/blob/main/aapcs64/aapcs64.rst]
+        // composites up to 16 bytes go in one or two GPRs and HFAs take a float
+        // register per member (see classify_pieces), anything else bigger than
+        // 16 bytes is passed by reference.
+        case TB_ABI_AAPCS64: {
+            if (t->tag == TB_DEBUG_TYPE_STRUCT || t->tag == TB_DEBUG_TYPE_UNION) {
+                int fmt = -1;
+                if (hfa_members(t, &fmt) > 0) {
+                    return RG_SSE;
+                }
+
+                return t->record.size > 16 ? RG_MEMORY : RG_INTEGER;
+            }
+
+            return t->tag == TB_DEBUG_TYPE_FLOAT ? RG_SSE : RG_INTEGER;
+        }
+
+        // [https://github.com/WebAssembly/tool-conventions/blob/main/BasicCABI.md]
+        // scalars are direct, aggregates go by reference (we don't unwrap the
+        // single scalar ones like clang does).
+        case TB_ABI_WASM32: {
+            int s = debug_type_size(abi, t);
+            if (t->tag != TB_DEBUG_TYPE_STRUCT && t->tag != TB_DEBUG_TYPE_UNION && (s == 1 || s == 2 || s == 4 || s == 8)) {
+                return t->tag == TB_DEBUG_TYPE_FLOAT ? RG_SSE : RG_INTEGER;
+            }
+
+            return RG_MEMORY;
+        }
+
         default: tb_todo();
     }
 }
@@ -124,6 +201,49 @@ TB_PassingRule tb_get_passing_rule_from_dbg(TB_Module* mod, TB_DebugType* param_
     return classify_reg(mod->target_abi, param_type) == RG_MEMORY ? TB_PASSING_INDIRECT : TB_PASSING_DIRECT;
 }
 
+// the TB params (or returns) a value gets lowered into, only AAPCS64 splits
+// values up, everyone else gets one per value.
+static int classify_pieces(TB_ABI abi, TB_DebugType* t, TB_DataType pieces[4]) {
+    while (t->tag == TB_DEBUG_TYPE_ALIAS) {
+        t = t->alias.type;
+    }
+
+    RegClass rg = classify_reg(abi, t);
+    if (abi != TB_ABI_AAPCS64 || rg == RG_MEMORY || (t->tag != TB_DEBUG_TYPE_STRUCT && t->tag != TB_DEBUG_TYPE_UNION)) {
+        pieces[0] = reg_class_to_tb(abi, rg, t);
+        return 1;
+    }
+
+    // HFA, one float register per member
+    int fmt = -1;
+    int n = hfa_members(t, &fmt);
+    if (n > 0) {
+        FOREACH_N(i, 0, n) {
+            pieces[i] = (TB_DataType){ { TB_FLOAT, fmt } };
+        }
+        return n;
+    }
+
+    // up to 16 bytes in GPRs, the tail is rounded up to a power of two so
+    // a 12 byte struct is an i64 + i32.
+    int size = t->record.size;
+    n = 0;
+    for (int offset = 0; offset < size; offset += 8) {
+        int left = size - offset;
+        int bytes = left >= 8 ? 8 : left > 4 ? 8 : left > 2 ? 4 : left;
+        pieces[n++] = TB_TYPE_INTN(bytes * 8);
+    }
+    return n;
+}
+
+int tb_get_passing_pieces(TB_Module* mod, TB_DebugType* type, TB_DataType pieces[4]) {
+    return classify_pieces(mod->target_abi, type, pieces);
+}
+
+static int data_type_size(TB_DataType dt) {
+    return dt.type == TB_FLOAT ? (dt.data == TB_FLT_64 ? 8 : 4) : dt.type == TB_PTR ? 8 : (dt.data + 7) / 8;
+}
+
 TB_Node** tb_function_set_prototype_from_dbg(TB_Function* f, TB_ModuleSectionHandle section, TB_DebugType* dbg, TB_Arena* arena, size_t* out_param_count) {
     tb_assert(dbg->tag == TB_DEBUG_TYPE_FUNCTION, "type has to be a function");
     tb_assert(dbg->func.return_count <= 1, "C can't do multiple returns and thus we can't lower it into C from here, try tb_function_set_prototype and do it manually");
@@ -142,7 +262,8 @@ TB_Node** tb_function_set_prototype_from_dbg(TB_Function* f, TB_ModuleSectionHan
     if (dbg->func.param_count > 0) {
         params = tb_arena_alloc(f->arena, sizeof(TB_Node*) * param_count);
 
-        bool has_aggregate_return = dbg->func.return_count > 0 && classify_reg(abi, dbg->func.returns[0]) == RG_MEMORY;
+        // split values take a few params in a row
+        size_t j = p->has_indirect_return;
         FOREACH_N(i, 0, param_count) {
             TB_DebugType* type = param_list[i]->field.type;
             const char* name = param_list[i]->field.name;
@@ -150,15 +271,27 @@ TB_Node** tb_function_set_prototype_from_dbg(TB_Function* f, TB_ModuleSectionHan
             int size = debug_type_size(abi, type);
             int align = debug_type_align(abi, type);
 
-            // place values into memory
-            TB_Node* v = tb_inst_param(f, i + has_aggregate_return);
-
             RegClass rg = classify_reg(abi, type);
             if (rg == RG_MEMORY) {
-                params[i] = v;
+                params[i] = tb_inst_param(f, j++);
             } else {
-                TB_Node* slot = tb_inst_local(f, size, align);
-                tb_inst_store(f, p->params[i + has_aggregate_return].dt, slot, v, align, false);
+                TB_DataType pieces[4];
+                int piece_count = classify_pieces(abi, type, pieces);
+
+                // the slot covers the whole of the last piece, a 12 byte struct
+                // in a register pair gets stored as 16 bytes.
+                int offset = 0, total = 0;
+                FOREACH_N(k, 0, piece_count) total += data_type_size(pieces[k]);
+
+                TB_Node* slot = tb_inst_local(f, size > total ? size : total, align);
+                FOREACH_N(k, 0, piece_count) {
+                    TB_Node* v = tb_inst_param(f, j++);
+                    TB_Node* addr = offset ? tb_inst_member_access(f, slot, offset) : slot;
+
+                    int piece_size = data_type_size(pieces[k]);
+                    tb_inst_store(f, pieces[k], addr, v, piece_size < align ? piece_size : align, false);
+                    offset += piece_size;
+                }
                 params[i] = slot;
             }
 
@@ -180,13 +313,11 @@ TB_API TB_FunctionPrototype* tb_prototype_from_dbg(TB_Module* m, TB_DebugType* d
     // TODO(NeGate): it's uninitialized by default but we don't communicate
     // this to the IR yet.
     RegClass return_rg = RG_NONE;
-    TB_PrototypeParam ret = { TB_TYPE_VOID };
+    TB_DataType ret_pieces[4];
+    size_t return_count = 0;
     if (dbg->func.return_count == 1) {
         return_rg = classify_reg(abi, dbg->func.returns[0]);
-
-        ret.debug_type = dbg->func.returns[0];
-        ret.dt = reg_class_to_tb(abi, return_rg, dbg->func.returns[0]);
-        ret.name = "$ret";
+        return_count = classify_pieces(abi, dbg->func.returns[0], ret_pieces);
     }
 
     bool has_aggregate_return = return_rg == RG_MEMORY;
@@ -195,42 +326,78 @@ TB_API TB_FunctionPrototype* tb_prototype_from_dbg(TB_Module* m, TB_DebugType* d
     // * in win64 this is easy, parameters don't split.
     // * in sysv this is a nightmare, structs are usually
     // the culprit because they can be split up.
-    size_t param_count = dbg->func.param_count;
+    // * in aapcs64 composites split into up to 4 registers, they're never
+    // partially on the stack.
+    size_t param_count = 0;
     TB_DebugType** param_list = dbg->func.params;
     if (abi == TB_ABI_SYSTEMV) {
         tb_todo();
     }
 
+    int gprs = 0, fprs = 0;
+    FOREACH_N(i, 0, dbg->func.param_count) {
+        TB_DataType pieces[4];
+        int n = classify_pieces(abi, param_list[i]->field.type, pieces);
+        param_count += n;
+
+        // a composite that doesn't fit in the registers left goes on the stack
+        // in one piece and stops any later args from using those registers, we
+        // place the pieces independently so those need to be rejected here.
+        if (abi == TB_ABI_AAPCS64) {
+            if (pieces[0].type == TB_FLOAT) {
+                if (n > 1 && fprs < 8 && fprs + n > 8) {
+                    tb_panic("%s: AAPCS64 HFA would be split between the float registers and the stack, that's not supported\n", param_list[i]->field.name);
+                }
+                fprs += n;
+            } else {
+                int align = debug_type_align(abi, param_list[i]->field.type);
+                if (n > 1 && gprs < 8 && (gprs + n > 8 || (align == 16 && (gprs & 1)))) {
+                    tb_panic("%s: AAPCS64 composite would be split between X7 and the stack (or needs an even register pair), that's not supported\n", param_list[i]->field.name);
+                }
+                gprs += n;
+            }
+        }
+    }
+
     // build up prototype param types
-    size_t return_count = dbg->func.return_count;
     size_t size = sizeof(TB_FunctionPrototype) + ((param_count + has_aggregate_return + return_count) * sizeof(TB_PrototypeParam));
     TB_FunctionPrototype* p = tb_arena_alloc(get_permanent_arena(m), size);
     p->call_conv = dbg->func.cc;
     p->has_varargs = dbg->func.has_varargs;
+    p->has_indirect_return = has_aggregate_return;
     p->return_count = return_count;
     p->param_count = has_aggregate_return + param_count;
 
-    if (dbg->func.param_count > 0) {
-        FOREACH_N(i, 0, dbg->func.param_count) {
-            TB_DebugType* type = param_list[i]->field.type;
-            RegClass rg = classify_reg(abi, type);
+    size_t j = has_aggregate_return;
+    FOREACH_N(i, 0, dbg->func.param_count) {
+        TB_DebugType* type = param_list[i]->field.type;
 
-            TB_PrototypeParam param = {
+        TB_DataType pieces[4];
+        int n = classify_pieces(abi, type, pieces);
+        FOREACH_N(k, 0, n) {
+            p->params[j++] = (TB_PrototypeParam){
                 .name = param_list[i]->field.name,
-                .debug_type = type,
-                .dt = reg_class_to_tb(abi, rg, type),
+                .debug_type = n > 1 ? NULL : type,
+                .dt = pieces[k],
             };
-
-            p->params[has_aggregate_return + i] = param;
         }
     }
 
-    if (p->return_count == 1) {
-        if (has_aggregate_return) {
-            p->params[0] = ret;
-        }
+    if (return_count > 0) {
+        TB_DebugType* ret_type = dbg->func.returns[0];
+        FOREACH_N(k, 0, return_count) {
+            TB_PrototypeParam ret = {
+                .name = "$ret",
+                .debug_type = return_count > 1 ? NULL : ret_type,
+                .dt = ret_pieces[k],
+            };
+
+            if (has_aggregate_return) {
+                p->params[0] = ret;
+            }
 
-        p->params[p->param_count] = ret;
+            p->params[p->param_count + k] = ret;
+        }
     }
 
     return p;
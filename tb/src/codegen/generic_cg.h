@@ -76,6 +76,7 @@ typedef struct {
     TB_Module* module;
     TB_Function* f;
     TB_ABI target_abi;
+    TB_FeatureSet features;
 
     int caller_usage;
     TB_Node* fallthrough;
@@ -109,6 +110,15 @@ typedef struct {
     DynArray(TB_StackSlot) debug_stack_slots;
 
     uint64_t regs_to_save;
+
+    // times right before each tail call's jump, these act like extra
+    // epilogues as far as callee saved registers are concerned.
+    DynArray(int) tail_exits;
+
+    // Profile guided
+    TB_Global* prof_counters; // non-NULL if we're instrumenting
+    int32_t prof_base;
+    const uint64_t* bb_freq;  // non-NULL if we've got feedback, indexed like the CFG blocks
 } Ctx;
 
 static bool fits_into_int8(uint64_t x) {
@@ -123,13 +133,18 @@ static bool fits_into_int32(uint64_t x) {
 
 static void init_regalloc(Ctx* restrict ctx);
 
-static TB_X86_DataType legalize(TB_DataType dt);
+static CG_DataType legalize(TB_DataType dt);
+static const char* reg_name(int rg, int num);
 static bool is_terminator(int type);
 static bool wont_spill_around(int type);
 static int classify_reg_class(TB_DataType dt);
 static void isel(Ctx* restrict ctx, TB_Node* n, int dst);
 static bool should_rematerialize(TB_Node* n);
+static bool dst_needs_reg(Inst* inst);
+static SchedModel sched_model(Ctx* restrict ctx);
+static Inst* inst_counter(TB_Symbol* sym, int32_t disp);
 
+static void machine_peephole(Ctx* restrict ctx);
 static void emit_code(Ctx* restrict ctx, TB_FunctionOutput* restrict func_out, int end);
 static void mark_callee_saved_constraints(Ctx* restrict ctx, uint64_t callee_saved[CG_REGISTER_CLASSES]);
 
@@ -156,10 +171,6 @@ static void add_debug_local(Ctx* restrict ctx, TB_Node* n, int pos) {
     }
 }
 
-static const char* reg_name(int rg, int num) {
-    return (rg == REG_CLASS_XMM ? XMM_NAMES : GPR_NAMES)[num];
-}
-
 ////////////////////////////////
 // Instructions
 ////////////////////////////////
@@ -179,6 +190,10 @@ typedef enum {
     // memory op
     INST_INDEXED = 1024,
     INST_SPILL   = 2048,
+
+    // jump which leaves the function (tail call), the
+    // frame is torn down right before it.
+    INST_TAIL    = 4096,
 } InstFlags;
 
 struct Inst {
@@ -188,7 +203,7 @@ struct Inst {
     InstType type;
     InstFlags flags;
 
-    TB_X86_DataType dt;
+    CG_DataType dt;
     int time, mem_slot;
 
     union {
@@ -249,7 +264,7 @@ static Inst* inst_move(TB_DataType dt, RegIndex dst, RegIndex src) {
     int machine_dt = legalize(dt);
 
     Inst* i = tb_arena_alloc(tmp_arena, sizeof(Inst) + (2 * sizeof(RegIndex)));
-    *i = (Inst){ .type = machine_dt >= TB_X86_TYPE_SSE_SS ? FP_MOV : MOV, .dt = machine_dt, .out_count = 1, 1 };
+    *i = (Inst){ .type = classify_reg_class(dt) != REG_CLASS_GPR ? FP_MOV : MOV, .dt = machine_dt, .out_count = 1, 1 };
     i->operands[0] = dst;
     i->operands[1] = src;
     return i;
@@ -260,7 +275,7 @@ static Inst* inst_op_global(int type, TB_DataType dt, RegIndex dst, TB_Symbol* s
     i->flags = INST_GLOBAL;
     i->mem_slot = 1;
     i->operands[0] = dst;
-    i->operands[1] = RSP;
+    i->operands[1] = FIRST_GPR + GLOBAL_BASE;
     i->s = s;
     return i;
 }
@@ -425,6 +440,18 @@ static void hint_reg(Ctx* restrict ctx, int i, int j) {
 ////////////////////////////////
 // Data flow analysis
 ////////////////////////////////
+// branch projections which only lead into a region aren't blocks of their own,
+// we skip past them to find the real predecessor.
+static void push_pred_bb(Ctx* restrict ctx, MachineBBs seq_bb, TB_Node* n) {
+    n = get_block_begin(n);
+    while (nl_map_get(seq_bb, n) < 0) {
+        if (n->inputs[0]->type == TB_START) return;
+        n = get_block_begin(n->inputs[0]);
+    }
+
+    dyn_array_put(ctx->worklist.items, n);
+}
+
 static int liveness(Ctx* restrict ctx, TB_Function* f) {
     size_t interval_count = dyn_array_length(ctx->intervals);
     TB_Arena* arena = tmp_arena;
@@ -482,6 +509,10 @@ static int liveness(Ctx* restrict ctx, TB_Function* f) {
                     epilogue = timeline;
                 }
 
+                if (inst->flags & INST_TAIL) {
+                    dyn_array_put(ctx->tail_exits, timeline - 1);
+                }
+
                 Set* restrict gen = &mbb->gen;
                 Set* restrict kill = &mbb->kill;
 
@@ -543,7 +574,6 @@ static int liveness(Ctx* restrict ctx, TB_Function* f) {
         // live_in = (live_out - live_kill) U live_gen
         bool changes = false;
         FOREACH_N(i, 0, (interval_count + 63) / 64) {
-            bool changes = false;
             uint64_t new_in = (live_out->data[i] & ~kill->data[i]) | gen->data[i];
 
             changes |= (live_in->data[i] != new_in);
@@ -552,8 +582,12 @@ static int liveness(Ctx* restrict ctx, TB_Function* f) {
 
         // if we have changes, mark the predeccesors
         if (changes) {
-            FOREACH_N(i, 0, bb->input_count) {
-                dyn_array_put(ctx->worklist.items, get_block_begin(bb->inputs[i]));
+            if (bb->type == TB_REGION) {
+                FOREACH_N(i, 0, bb->input_count) {
+                    push_pred_bb(ctx, seq_bb, bb->inputs[i]);
+                }
+            } else if (bb->inputs[0]->type != TB_START) {
+                push_pred_bb(ctx, seq_bb, bb->inputs[0]);
             }
         }
     }
@@ -647,6 +681,45 @@ static void isel_set_location(Ctx* restrict ctx, TB_Node* n) {
     }
 }
 
+// all the PHI moves on an edge happen at once, one PHI might read another one which
+// we've already written (swapping loop variables) so we emit the ones nobody else reads
+// first and break whatever cycles are left with a temporary.
+static void phi_parallel_copy(Ctx* restrict ctx, size_t count, PhiVal* phis) {
+    while (count > 0) {
+        size_t i = 0;
+        for (; i < count; i++) {
+            bool blocked = false;
+            FOREACH_N(j, 0, count) if (j != i && phis[j].src == phis[i].dst) {
+                blocked = true;
+                break;
+            }
+
+            if (!blocked) break;
+        }
+
+        if (i < count) {
+            PhiVal* v = &phis[i];
+            if (v->dst != v->src) {
+                hint_reg(ctx, v->dst, v->src);
+                SUBMIT(inst_move(v->phi->dt, v->dst, v->src));
+            }
+
+            SWAP(PhiVal, phis[i], phis[count - 1]);
+            count -= 1;
+            continue;
+        }
+
+        // cycle, save the old value and point the readers at it
+        int dst = phis[0].dst;
+        int tmp = DEF(NULL, phis[0].phi->dt);
+        SUBMIT(inst_move(phis[0].phi->dt, tmp, dst));
+
+        FOREACH_N(j, 0, count) if (phis[j].src == dst) {
+            phis[j].src = tmp;
+        }
+    }
+}
+
 static void isel_region(Ctx* restrict ctx, TB_Node* bb_start, TB_Node* end, size_t rpo_index) {
     assert(dyn_array_length(ctx->worklist.items) == ctx->cfg.block_count);
     TB_Scheduled scheduled = ctx->p->scheduled;
@@ -657,6 +730,14 @@ static void isel_region(Ctx* restrict ctx, TB_Node* bb_start, TB_Node* end, size
     CUIK_TIMED_BLOCK("phase 1") {
         sched_walk(ctx->p, &ctx->worklist, &phi_vals, bb, end, true);
 
+        // at higher opt levels we reorder the walk to hide latencies
+        if (ctx->module->scheduler == TB_SCHEDULER_LIST) {
+            SchedModel model = sched_model(ctx);
+            CUIK_TIMED_BLOCK("list sched") {
+                sched_list(ctx->p, &ctx->worklist, ctx->cfg.block_count, end, &model);
+            }
+        }
+
         // schedule params
         if (rpo_index == 0) {
             for (User* use = ctx->f->start_node->users; use; use = use->next) {
@@ -685,36 +766,16 @@ static void isel_region(Ctx* restrict ctx, TB_Node* bb_start, TB_Node* end, size
         }
     }
 
-    // phase 3: within the BB, the phi nodes should view itself as the previous value
-    // not the new one we're producing.
+    // phase 3: figure out where the successor's PHIs live. the PHIs of this BB can be
+    // read straight out of their registers, the writeback is a parallel copy at the very
+    // end so nothing in here sees the new values.
     size_t our_phis = dyn_array_length(phi_vals);
     CUIK_TIMED_BLOCK("phase 3") {
         FOREACH_N(i, 0, our_phis) {
             PhiVal* v = &phi_vals[i];
-
-            // mark the proper output, especially before we make the BB-local ones
             v->dst = input_reg(ctx, v->phi);
         }
 
-        if (bb_start->type == TB_REGION) {
-            for (User* use = find_users(ctx->p, bb_start); use; use = use->next) {
-                if (use->n->type == TB_PHI && use->n->dt.type != TB_MEMORY) {
-                    ValueDesc* val = &ctx->values[use->n->gvn];
-
-                    // copy PHI into temporary
-                    PhiVal p = { .phi = use->n, .dst = input_reg(ctx, use->n) };
-                    dyn_array_put(phi_vals, p);
-
-                    TB_DataType dt = p.phi->dt;
-                    int tmp = DEF(NULL, dt);
-                    SUBMIT(inst_move(dt, tmp, p.dst));
-
-                    // assign temporary as the PHI until the end of the BB
-                    val->vreg = tmp;
-                }
-            }
-        }
-
         if (rpo_index == 0) {
             isel(ctx, ctx->f->start_node, -1);
         }
@@ -839,18 +900,13 @@ static void isel_region(Ctx* restrict ctx, TB_Node* bb_start, TB_Node* end, size
             }
         }
 
-        // restore the PHI value to normal
-        FOREACH_N(i, our_phis, dyn_array_length(phi_vals)) {
-            PhiVal* v = &phi_vals[i];
-            lookup_val(ctx, v->phi)->vreg = v->dst;
-        }
-
         dyn_array_clear(phi_vals);
         ctx->phi_vals = phi_vals;
         ctx->head = last ? last : head;
 
         if (end->type != TB_END    && end->type != TB_TRAP &&
-            end->type != TB_BRANCH && end->type != TB_UNREACHABLE) {
+            end->type != TB_BRANCH && end->type != TB_UNREACHABLE &&
+            end->type != TB_TAILCALL) {
             TB_OPTDEBUG(CODEGEN)(
                 printf("  TERMINATOR %u: ", end->gvn),
                 print_node_sexpr(end, 0),
@@ -860,15 +916,12 @@ static void isel_region(Ctx* restrict ctx, TB_Node* bb_start, TB_Node* end, size
             // writeback PHIs
             FOREACH_N(i, 0, our_phis) {
                 PhiVal* v = &phi_vals[i];
-                TB_DataType dt = v->phi->dt;
-
-                int src = input_reg(ctx, v->n);
-
-                hint_reg(ctx, v->dst, src);
-                SUBMIT(inst_move(dt, v->dst, src));
+                v->src = input_reg(ctx, v->n);
             }
+            phi_parallel_copy(ctx, our_phis, phi_vals);
 
-            // implicit goto
+            // implicit goto, the regalloc puts the edge moves before the terminator
+            SUBMIT(alloc_inst(INST_TERMINATOR, TB_TYPE_VOID, 0, 0, 0));
             TB_Node* succ = cfg_next_control(end);
             if (ctx->fallthrough != succ) {
                 SUBMIT(inst_jmp(succ));
@@ -879,6 +932,173 @@ static void isel_region(Ctx* restrict ctx, TB_Node* bb_start, TB_Node* end, size
     dyn_array_set_length(ctx->worklist.items, ctx->cfg.block_count);
 }
 
+////////////////////////////////
+// Block placement
+////////////////////////////////
+// blocks are laid out as chains where each one falls into its likeliest successor
+// (hottest according to the profile, otherwise the first one in CFG walk order) and
+// cold blocks are sunk to the end of the function. the END block has to go last
+// since that's where the epilogue is emitted.
+//
+// cold blocks either end in TB_TRAP/TB_UNREACHABLE, only lead to other cold blocks or
+// never ran during profiling.
+static int bb_id(Ctx* restrict ctx, TB_Node* n) {
+    return nl_map_get_checked(ctx->cfg.node_to_block, n).id;
+}
+
+// isel expects a block's dominator to have been selected before it
+static bool can_place_bb(Ctx* restrict ctx, bool* placed, int bb) {
+    TB_Node* dom = nl_map_get_checked(ctx->cfg.node_to_block, ctx->worklist.items[bb]).dom;
+    return !placed[bb] && (bb == 0 || dom == NULL || placed[bb_id(ctx, dom)]);
+}
+
+static int likely_succ(Ctx* restrict ctx, const uint64_t* freq, bool* cold, bool* placed, int bb, int stop_bb) {
+    TB_Node* end = nl_map_get_checked(ctx->cfg.node_to_block, ctx->worklist.items[bb]).end;
+
+    int best = -1;
+    for (User* u = end->users; u; u = u->next) {
+        if (!cfg_is_control(u->n)) continue;
+
+        int succ = bb_id(ctx, cfg_get_fallthru(u->n));
+        if (succ == stop_bb || cold[succ] || !can_place_bb(ctx, placed, succ)) continue;
+
+        if (best < 0 ||
+            (freq ? freq[succ] > freq[best] || (freq[succ] == freq[best] && succ < best) : succ < best)) {
+            best = succ;
+        }
+    }
+
+    return best;
+}
+
+// returns true if the entry block is cold
+static bool place_blocks(Ctx* restrict ctx, int stop_bb) {
+    size_t count = ctx->cfg.block_count;
+    TB_Node** bbs = ctx->worklist.items;
+
+    // a function which never ran tells us nothing about its branches
+    const uint64_t* freq = ctx->bb_freq;
+    if (freq != NULL && freq[0] == 0) {
+        freq = NULL;
+    }
+
+    bool* cold = tb_arena_alloc(tmp_arena, count * sizeof(bool));
+    bool* placed = tb_arena_alloc(tmp_arena, count * sizeof(bool));
+    FOREACH_N(i, 0, count) {
+        TB_Node* end = nl_map_get_checked(ctx->cfg.node_to_block, bbs[i]).end;
+
+        placed[i] = false;
+        cold[i] = freq ? freq[i] == 0 : (end->type == TB_TRAP || end->type == TB_UNREACHABLE);
+    }
+
+    // anything which only leads to cold blocks is cold too
+    if (freq == NULL) {
+        bool changed = true;
+        while (changed) {
+            changed = false;
+
+            FOREACH_REVERSE_N(i, 0, count) if (!cold[i]) {
+                TB_Node* end = nl_map_get_checked(ctx->cfg.node_to_block, bbs[i]).end;
+
+                int succ_count = 0;
+                bool all_cold = true;
+                for (User* u = end->users; u; u = u->next) {
+                    if (cfg_is_control(u->n)) {
+                        all_cold &= cold[bb_id(ctx, cfg_get_fallthru(u->n))];
+                        succ_count++;
+                    }
+                }
+
+                if (succ_count > 0 && all_cold) {
+                    cold[i] = true;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    // hot chains
+    int* order = ctx->bb_order;
+    int n = 0;
+    FOREACH_N(i, 0, count) {
+        int bb = i;
+        if (bb == stop_bb || cold[bb] || !can_place_bb(ctx, placed, bb)) {
+            continue;
+        }
+
+        do {
+            placed[bb] = true;
+            order[n++] = bb;
+
+            bb = likely_succ(ctx, freq, cold, placed, bb, stop_bb);
+        } while (bb >= 0);
+    }
+
+    // cold blocks (and anything we couldn't chain) in CFG walk order, since that's
+    // a preorder walk the dominators are always placed first.
+    FOREACH_N(i, 0, count) {
+        if (i != stop_bb && !placed[i]) {
+            placed[i] = true;
+            order[n++] = i;
+        }
+    }
+
+    // enter END block at the... end
+    if (stop_bb >= 0) {
+        order[n++] = stop_bb;
+    }
+
+    ctx->bb_count = n;
+    return cold[0];
+}
+
+////////////////////////////////
+// Critical edges
+////////////////////////////////
+// a branch edge which goes straight into a merge has nowhere to put its PHI moves,
+// the branch block has other successors and the merge has other predecessors. we
+// give each of those edges an empty region of its own which ends in a goto so the
+// PHI writeback (and the regalloc's edge moves) have a block to live in.
+static void split_critical_edges(TB_Passes* restrict p, TB_Function* f) {
+    Worklist* ws = &p->worklist;
+    assert(dyn_array_length(ws->items) == 0);
+
+    dyn_array_put(ws->items, f->start_node);
+    worklist_test_n_set(ws, f->start_node);
+
+    while (dyn_array_length(ws->items)) {
+        TB_Node* n = dyn_array_pop(ws->items);
+
+        for (User* u = n->users; u; u = u->next) {
+            TB_Node* succ = u->n;
+            if (!cfg_is_control(succ) || worklist_test_n_set(ws, succ)) {
+                continue;
+            }
+
+            dyn_array_put(ws->items, succ);
+            if (n->type != TB_BRANCH || succ->type != TB_PROJ || succ->users == NULL) {
+                continue;
+            }
+
+            // (proj (branch)) => (region (proj (branch))) when the proj goes into a merge
+            User* merge_use = succ->users;
+            TB_Node* merge = merge_use->n;
+            if (merge_use->next != NULL || merge->type != TB_REGION || merge->input_count <= 1) {
+                continue;
+            }
+
+            TB_Node* split = tb_alloc_node(f, TB_REGION, TB_TYPE_CONTROL, 1, sizeof(TB_NodeRegion));
+            set_input(p, split, succ, 0);
+            set_input(p, merge, split, merge_use->slot);
+
+            worklist_test_n_set(ws, split);
+            dyn_array_put(ws->items, split);
+        }
+    }
+
+    worklist_clear(ws);
+}
+
 // Codegen through here is done in phases
 static void compile_function(TB_Passes* restrict p, TB_FunctionOutput* restrict func_out, const TB_FeatureSet* features, uint8_t* out, size_t out_capacity, bool emit_asm) {
     verify_tmp_arena(p);
@@ -900,6 +1120,7 @@ static void compile_function(TB_Passes* restrict p, TB_FunctionOutput* restrict
         .f = f,
         .p = p,
         .target_abi = f->super.module->target_abi,
+        .features = *features,
         .emit = {
             .f = f,
             .emit_asm = emit_asm,
@@ -914,6 +1135,8 @@ static void compile_function(TB_Passes* restrict p, TB_FunctionOutput* restrict
     }
 
     worklist_clear(&p->worklist);
+    split_critical_edges(p, f);
+
     ctx.values = tb_arena_alloc(tmp_arena, f->node_count * sizeof(ValueDesc));
 
     // We need to generate a CFG
@@ -931,11 +1154,44 @@ static void compile_function(TB_Passes* restrict p, TB_FunctionOutput* restrict
 
     worklist_clear_visited(&ctx.worklist);
 
+    // instrumented builds get a counter per BB, feedback builds use the counts
+    // from last time (as long as the CFG still has the same shape)
+    TB_Module* m = f->super.module;
+    if (m->prof_dumper != NULL && m->prof_dumper != f) {
+        // direct calls get recorded with their block so the feedback build
+        // can tell how hot each call edge is
+        DynArray(TB_ProfileCallSite) calls = dyn_array_create(TB_ProfileCallSite, 16);
+        FOREACH_N(i, 0, ctx.cfg.block_count) {
+            TB_Node* bb = ctx.worklist.items[i];
+            TB_Node* n = nl_map_get_checked(ctx.cfg.node_to_block, bb).end;
+            for (;;) {
+                if ((n->type == TB_CALL || n->type == TB_TAILCALL) && n->inputs[2]->type == TB_SYMBOL) {
+                    TB_Symbol* target = TB_NODE_GET_EXTRA_T(n->inputs[2], TB_NodeSymbol)->sym;
+                    TB_ProfileCallSite site = { i, target };
+                    dyn_array_put(calls, site);
+                }
+
+                if (n == bb) break;
+                n = n->inputs[0];
+            }
+        }
+
+        ctx.prof_counters = tb__profile_counters(m, f, ctx.cfg.block_count, dyn_array_length(calls), calls, &ctx.prof_base);
+        dyn_array_destroy(calls);
+    } else {
+        size_t count;
+        const uint64_t* freq = tb_function_get_profile(f, &count);
+        if (freq != NULL && count == ctx.cfg.block_count) {
+            ctx.bb_freq = freq;
+        }
+    }
+
     // Instruction selection:
     //   we just decide which instructions to emit, which operands are
-    //   fixed and which need allocation. For now regalloc is handled
-    //   immediately but in theory it could be delayed until all selection
-    //   is done.
+    //   fixed and which need allocation. The whole function is selected
+    //   before regalloc runs so it gets to make global decisions (spill
+    //   weights by loop depth). Constants and addresses don't get a vreg
+    //   which lives across blocks, isel just makes them again at each use.
     ctx.bb_count = 0;
     int* bb_order = ctx.bb_order = tb_arena_alloc(tmp_arena, ctx.cfg.block_count * sizeof(int));
 
@@ -959,14 +1215,18 @@ static void compile_function(TB_Passes* restrict p, TB_FunctionOutput* restrict
             TB_Node* end = nl_map_get_checked(ctx.cfg.node_to_block, bb).end;
             if (end->type == TB_END) {
                 stop_bb = i;
-            } else {
-                bb_order[ctx.bb_count++] = i;
             }
         }
 
-        // enter END block at the... end
-        if (stop_bb >= 0) {
-            bb_order[ctx.bb_count++] = stop_bb;
+        bool is_cold;
+        CUIK_TIMED_BLOCK("placement") {
+            is_cold = place_blocks(&ctx, stop_bb);
+        }
+
+        if (ctx.bb_freq != NULL) {
+            func_out->heat = ctx.bb_freq[0] > 0 ? TB_HEAT_HOT : TB_HEAT_COLD;
+        } else {
+            func_out->heat = is_cold ? TB_HEAT_COLD : TB_HEAT_NORMAL;
         }
 
         TB_Node** bbs = ctx.worklist.items;
@@ -985,6 +1245,10 @@ static void compile_function(TB_Passes* restrict p, TB_FunctionOutput* restrict
                 append_inst(&ctx, label);
             }
 
+            if (ctx.prof_counters != NULL) {
+                append_inst(&ctx, inst_counter((TB_Symbol*) ctx.prof_counters, ctx.prof_base + bb_order[i]*sizeof(uint64_t)));
+            }
+
             TB_Node* end = nl_map_get_checked(ctx.cfg.node_to_block, bb).end;
             isel_region(&ctx, bb, end, i);
         }
@@ -998,9 +1262,19 @@ static void compile_function(TB_Passes* restrict p, TB_FunctionOutput* restrict
             end = liveness(&ctx, f);
         }
 
-        // we can in theory have other regalloc solutions and eventually will put
-        // graph coloring here.
-        ctx.stack_usage = linear_scan(&ctx, f, ctx.stack_usage, end);
+        // linear scan is the fast path, the greedy allocator spills less but
+        // takes longer (see tb_module_set_regalloc)
+        CUIK_TIMED_BLOCK("regalloc") {
+            if (f->super.module->regalloc == TB_REGALLOC_GREEDY) {
+                ctx.stack_usage = greedy_alloc(&ctx, f, ctx.stack_usage, end);
+            } else {
+                ctx.stack_usage = linear_scan(&ctx, f, ctx.stack_usage, end);
+            }
+        }
+
+        CUIK_TIMED_BLOCK("peephole") {
+            machine_peephole(&ctx);
+        }
 
         // Arch-specific: convert instruction buffer into actual instructions
         CUIK_TIMED_BLOCK("emit code") {
@@ -1023,6 +1297,7 @@ static void compile_function(TB_Passes* restrict p, TB_FunctionOutput* restrict
     dyn_array_destroy(ctx.jump_table_patches);
     dyn_array_destroy(ctx.intervals);
     dyn_array_destroy(ctx.phi_vals);
+    dyn_array_destroy(ctx.tail_exits);
 
     if (dyn_array_length(ctx.locations)) {
         ctx.locations[0].pos = 0; // func_out->prologue_length;
@@ -32,7 +32,7 @@ struct LiveInterval {
     int reg_class;
 
     TB_Node* n;
-    TB_X86_DataType dt;
+    CG_DataType dt;
 
     // results of regalloc
     int assigned;
@@ -68,10 +68,17 @@ typedef struct {
     int* block_pos;
 
     int endpoint;
+    DynArray(int) tail_exits;
     uint64_t callee_saved[CG_REGISTER_CLASSES];
 
     Set active_set[CG_REGISTER_CLASSES];
-    RegIndex active[CG_REGISTER_CLASSES][16];
+    RegIndex active[CG_REGISTER_CLASSES][CG_REGISTER_COUNT];
+
+    // spill weights, these come from the profile if we've got one and
+    // are guessed from loop nesting otherwise. in BB layout order.
+    int bb_count;
+    int* bb_end;
+    uint64_t* bb_freq;
 
     Inst* cache;
 } LSRA;
@@ -115,7 +122,7 @@ static void reverse_bb_walk(LSRA* restrict ra, MachineBB* bb, Inst* inst) {
     // we shouldn't force only register uses or else we'll make spilling more
     // prominent.
     RegIndex* ops = inst->operands;
-    bool dst_use_reg = inst->type == IMUL || inst->type == INST_ZERO || (inst->flags & (INST_MEM | INST_GLOBAL));
+    bool dst_use_reg = dst_needs_reg(inst);
 
     FOREACH_N(i, 0, inst->out_count) {
         assert(*ops >= 0);
@@ -159,15 +166,20 @@ static int range_intersect(LiveRange* a, LiveRange* b) {
     }
 }
 
+// earliest point where the two intervals overlap (only looking at the current & later
+// ranges), -1 if they don't.
 static int interval_intersect(LiveInterval* a, LiveInterval* b) {
+    int first = -1;
     FOREACH_N(i, 1, a->active_range+1) {
-        int t = range_intersect(&a->ranges[i], &b->ranges[b->active_range]);
-        if (t >= 0) {
-            return t;
+        FOREACH_N(j, 1, b->active_range+1) {
+            int t = range_intersect(&a->ranges[i], &b->ranges[j]);
+            if (t >= 0 && (first < 0 || t < first)) {
+                first = t;
+            }
         }
     }
 
-    return -1;
+    return first;
 }
 
 #define FOREACH_SET(it, set) \
@@ -190,6 +202,25 @@ static int next_use(LSRA* restrict ra, LiveInterval* interval, int time) {
     }
 }
 
+// how many times did the BB containing t run
+static uint64_t freq_at(LSRA* restrict ra, int t) {
+    if (t == INT_MAX) {
+        return 0;
+    }
+
+    int lo = 0, hi = ra->bb_count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ra->bb_end[mid] < t) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return ra->bb_freq[lo];
+}
+
 static LiveInterval* get_active(LSRA* restrict ra, int rc, int reg) {
     if (!set_get(&ra->active_set[rc], reg)) {
         return NULL;
@@ -198,45 +229,64 @@ static LiveInterval* get_active(LSRA* restrict ra, int rc, int reg) {
     return &ra->intervals[ra->active[rc][reg]];
 }
 
-static void insert_split_move(LSRA* restrict ra, int t, int old_reg, int new_reg) {
-    Inst *prev, *inst;
-    TB_X86_DataType dt = ra->intervals[old_reg].dt;
+static int interval_start(LiveInterval* interval) { return interval->ranges[dyn_array_length(interval->ranges) - 1].start; }
+static int interval_end(LiveInterval* interval)   { return interval->ranges[1].end; }
+
+// new instructions at time t go after whatever this returns, if before_moves
+// is set it'll go before the other moves placed at time t.
+static Inst* insert_point(LSRA* restrict ra, int t, bool before_moves) {
+    Inst *prev, *inst, *real;
 
     // invalidate
     if (ra->cache->time >= t) {
         ra->cache = ra->first;
     }
 
-    prev = ra->cache, inst = prev->next;
+    // the cache only ever points at real instructions
+    prev = real = ra->cache, inst = prev->next;
     CUIK_TIMED_BLOCK("walk") {
         while (inst != NULL) {
             if (inst->time > t) {
-                ra->cache = prev;
                 break;
             }
 
             prev = inst, inst = inst->next;
+            if ((prev->flags & INST_SPILL) == 0) real = prev;
         }
     }
 
+    ra->cache = real;
+    return before_moves ? real : prev;
+}
+
+static Inst* insert_inst_after(Inst* prev, int t, int type, CG_DataType dt, int dst, int src) {
+    Inst* new_inst = tb_arena_alloc(tmp_arena, sizeof(Inst) + (2 * sizeof(RegIndex)));
+    *new_inst = (Inst){ .type = type, .flags = INST_SPILL, .dt = dt, .out_count = 1, 1 };
+    new_inst->operands[0] = dst;
+    new_inst->operands[1] = src;
+    new_inst->time = t;
+    new_inst->next = prev->next;
+    prev->next = new_inst;
+    return new_inst;
+}
+
+static void insert_split_move(LSRA* restrict ra, int t, int old_reg, int new_reg) {
+    // stores go before any other moves placed at this point, those might be
+    // reloads into the register we're evicting (unless it's the one being
+    // reloaded here).
+    bool is_store = ra->intervals[new_reg].spill > 0 && interval_start(&ra->intervals[old_reg]) < t;
+    Inst* prev = insert_point(ra, t, is_store);
+    Inst* inst = prev->next;
+
     // folded spill
     if (inst && inst->type == MOV && inst->flags == 0 && inst->operands[0] == old_reg) {
         inst->operands[0] = new_reg;
         return;
     }
 
-    Inst* new_inst = tb_arena_alloc(tmp_arena, sizeof(Inst) + (2 * sizeof(RegIndex)));
-    *new_inst = (Inst){ .type = MOV, .flags = INST_SPILL, .dt = dt, .out_count = 1, 1 };
-    new_inst->operands[0] = new_reg;
-    new_inst->operands[1] = old_reg;
-    new_inst->time = prev->time + 1;
-    new_inst->next = prev->next;
-    prev->next = new_inst;
+    insert_inst_after(prev, prev->time + 1, MOV, ra->intervals[old_reg].dt, new_reg, old_reg);
 }
 
-static int interval_start(LiveInterval* interval) { return interval->ranges[dyn_array_length(interval->ranges) - 1].start; }
-static int interval_end(LiveInterval* interval)   { return interval->ranges[1].end; }
-
 static LiveInterval* split_interval_at(LSRA* restrict ra, LiveInterval* interval, int pos) {
     // skip past previous intervals
     while (interval->split_kid >= 0 && pos > interval_end(interval)) {
@@ -366,6 +416,39 @@ static int split_intersecting(LSRA* restrict ra, int current_time, int pos, Live
     return new_reg;
 }
 
+// first use of a callee saved register means we save it in the prologue and
+// restore it at every exit, this adds an interval so pointers into it are stale.
+static void spill_callee_saved(LSRA* restrict ra, int rc, int reg) {
+    ra->callee_saved[rc] &= ~(1ull << reg);
+
+    REG_ALLOC_LOG printf("  #   spill callee saved register %s\n", reg_name(rc, reg));
+
+    int size = rc ? 16 : 8;
+    int vreg = rc*CG_REGISTER_COUNT + reg;
+    ra->stack_usage = align_up(ra->stack_usage + size, size);
+
+    LiveInterval it = {
+        .spill = ra->stack_usage,
+        .dt = ra->intervals[vreg].dt,
+        .assigned = -1,
+        .reg = -1,
+        .split_kid = -1,
+    };
+
+    int spill_slot = dyn_array_length(ra->intervals);
+    dyn_array_put(ra->intervals, it);
+
+    // insert spill and reload
+    insert_split_move(ra, 0, vreg, spill_slot);
+    if (ra->endpoint >= 0) {
+        insert_split_move(ra, ra->endpoint, spill_slot, vreg);
+    }
+
+    dyn_array_for(i, ra->tail_exits) {
+        insert_split_move(ra, ra->tail_exits[i], spill_slot, vreg);
+    }
+}
+
 // returns -1 if no registers are available
 static ptrdiff_t allocate_free_reg(LSRA* restrict ra, LiveInterval* interval) {
     int rc = interval->reg_class;
@@ -373,7 +456,7 @@ static ptrdiff_t allocate_free_reg(LSRA* restrict ra, LiveInterval* interval) {
     // callee saved will be biased to have nearer free positions to avoid incurring
     // a spill on them early.
     int half_free = 1 << 16;
-    FOREACH_N(i, 0, 16) {
+    FOREACH_N(i, 0, CG_REGISTER_COUNT) {
         ra->free_pos[i] = (ra->callee_saved[rc] & (1ull << i)) ? half_free : INT_MAX;
         // ra->free_pos[i] = INT_MAX;
     }
@@ -395,10 +478,9 @@ static ptrdiff_t allocate_free_reg(LSRA* restrict ra, LiveInterval* interval) {
         }
     }
 
-    if (rc == REG_CLASS_GPR) {
-        // reserved regs
-        ra->free_pos[RBP] = 0;
-        ra->free_pos[RSP] = 0;
+    // reserved regs
+    FOREACH_N(i, 0, CG_REGISTER_COUNT) if (reserved_regs[rc] & (1ull << i)) {
+        ra->free_pos[i] = 0;
     }
 
     // try hint
@@ -418,7 +500,7 @@ static ptrdiff_t allocate_free_reg(LSRA* restrict ra, LiveInterval* interval) {
     // pick highest free pos
     if (highest < 0) {
         highest = 0;
-        FOREACH_N(i, 1, 16) if (ra->free_pos[i] > ra->free_pos[highest]) {
+        FOREACH_N(i, 1, CG_REGISTER_COUNT) if (ra->free_pos[i] > ra->free_pos[highest]) {
             highest = i;
         }
     }
@@ -429,31 +511,8 @@ static ptrdiff_t allocate_free_reg(LSRA* restrict ra, LiveInterval* interval) {
         return -1;
     } else {
         if (UNLIKELY(ra->callee_saved[rc] & (1ull << highest))) {
-            ra->callee_saved[rc] &= ~(1ull << highest);
-
-            REG_ALLOC_LOG printf("  #   spill callee saved register %s\n", reg_name(rc, highest));
-
-            int size = rc ? 16 : 8;
-            int vreg = (rc ? FIRST_XMM : FIRST_GPR) + highest;
-            ra->stack_usage = align_up(ra->stack_usage + size, size);
-
-            LiveInterval it = {
-                .spill = ra->stack_usage,
-                .dt = ra->intervals[vreg].dt,
-                .assigned = -1,
-                .reg = -1,
-                .split_kid = -1,
-            };
-
             int old_reg = interval - ra->intervals;
-            int spill_slot = dyn_array_length(ra->intervals);
-            dyn_array_put(ra->intervals, it);
-
-            // insert spill and reload
-            insert_split_move(ra, 0, vreg, spill_slot);
-            if (ra->endpoint) {
-                insert_split_move(ra, ra->endpoint, spill_slot, vreg);
-            }
+            spill_callee_saved(ra, rc, highest);
 
             // adding to intervals might resized this
             interval = &ra->intervals[old_reg];
@@ -486,8 +545,8 @@ static ptrdiff_t allocate_blocked_reg(LSRA* restrict ra, LiveInterval* interval)
     int rc = interval->reg_class;
     int* use_pos = ra->free_pos;
 
-    FOREACH_N(i, 0, 16) ra->block_pos[i] = INT_MAX;
-    FOREACH_N(i, 0, 16) use_pos[i] = INT_MAX;
+    FOREACH_N(i, 0, CG_REGISTER_COUNT) ra->block_pos[i] = INT_MAX;
+    FOREACH_N(i, 0, CG_REGISTER_COUNT) use_pos[i] = INT_MAX;
 
     // mark non-fixed intervals
     int start = interval_start(interval);
@@ -501,7 +560,10 @@ static ptrdiff_t allocate_blocked_reg(LSRA* restrict ra, LiveInterval* interval)
     dyn_array_for(i, ra->inactive) {
         LiveInterval* it = &ra->intervals[ra->inactive[i]];
         if (it->reg_class == rc && it->reg < 0) {
-            use_pos[i] = next_use(ra, it, start);
+            int p = next_use(ra, it, start);
+            if (p < use_pos[it->assigned]) {
+                use_pos[it->assigned] = p;
+            }
         }
     }
 
@@ -527,24 +589,36 @@ static ptrdiff_t allocate_blocked_reg(LSRA* restrict ra, LiveInterval* interval)
         }
     }
 
-    if (rc == REG_CLASS_GPR) {
-        // reserved regs
-        use_pos[RBP] = 0;
-        use_pos[RSP] = 0;
+    // reserved regs
+    FOREACH_N(i, 0, CG_REGISTER_COUNT) if (reserved_regs[rc] & (1ull << i)) {
+        use_pos[i] = 0;
     }
 
     // pick highest use pos
     int highest = 0;
-    FOREACH_N(i, 1, 16) if (use_pos[i] > use_pos[highest]) {
+    FOREACH_N(i, 1, CG_REGISTER_COUNT) if (use_pos[i] > use_pos[highest]) {
         highest = i;
     }
 
-    int pos = use_pos[highest];
     int first_use = INT_MAX;
     if (dyn_array_length(interval->uses)) {
         first_use = interval->uses[dyn_array_length(interval->uses) - 1].pos;
     }
 
+    // any register which isn't needed until after our first use is fair game,
+    // we'd rather evict the one that's next used in the coldest BB.
+    if (use_pos[highest] > first_use) {
+        uint64_t best = freq_at(ra, use_pos[highest]);
+        FOREACH_N(i, 0, CG_REGISTER_COUNT) if (use_pos[i] > first_use) {
+            uint64_t freq = freq_at(ra, use_pos[i]);
+            if (freq < best || (freq == best && use_pos[i] > use_pos[highest])) {
+                best = freq, highest = i;
+            }
+        }
+    }
+
+    int pos = use_pos[highest];
+
     bool spilled = false;
     if (first_use > pos) {
         int size = 8;
@@ -577,14 +651,14 @@ static ptrdiff_t allocate_blocked_reg(LSRA* restrict ra, LiveInterval* interval)
             LiveInterval* it = &ra->intervals[ra->inactive[i]];
             LiveRange* r = &it->ranges[it->active_range];
 
-            if (it->reg_class == rc && it->assigned == highest && r->start <= pos+1 && pos <= r->end) {
+            if (it->reg_class == rc && it->reg < 0 && it->assigned == highest && r->start <= pos+1 && pos <= r->end) {
                 split_intersecting(ra, start, split_pos, it, true);
             }
         }
     }
 
     // split active reg if it intersects with fixed interval
-    LiveInterval* fix_interval = &ra->intervals[(rc ? FIRST_XMM : FIRST_GPR) + highest];
+    LiveInterval* fix_interval = &ra->intervals[rc*CG_REGISTER_COUNT + highest];
     if (dyn_array_length(fix_interval->ranges)) {
         int p = interval_intersect(interval, fix_interval);
         if (p >= 0) {
@@ -603,7 +677,7 @@ static void move_to_active(LSRA* restrict ra, LiveInterval* interval) {
         tb_panic("v%d: interval v%d should never be forced out, we should've accomodated them in the first place", ri, ra->active[rc][reg]);
     }
 
-    assert(reg < 16);
+    assert(reg < CG_REGISTER_COUNT);
     set_put(&ra->active_set[rc], reg);
     ra->active[rc][reg] = ri;
 }
@@ -655,18 +729,12 @@ static bool update_interval(LSRA* restrict ra, LiveInterval* restrict interval,
     return false;
 }
 
-static void cuiksort_defs(LiveInterval* intervals, ptrdiff_t lo, ptrdiff_t hi, RegIndex* arr);
-static int linear_scan(Ctx* restrict ctx, TB_Function* f, int stack_usage, int end) {
-    LSRA ra = { .abi = f->super.module->target_abi, .first = ctx->first, .cache = ctx->first, .intervals = ctx->intervals, .stack_usage = stack_usage };
-
-    FOREACH_N(i, 0, CG_REGISTER_CLASSES) {
-        ra.active_set[i] = set_create_in_arena(tmp_arena, 16);
-    }
-
+// shared by both allocators, fills in the ranges & use positions of every interval
+static void build_intervals(Ctx* restrict ctx, LSRA* restrict ra, int end) {
     // build intervals:
     //   we also track when uses happen to aid in splitting
     MachineBBs mbbs = ctx->machine_bbs;
-    size_t interval_count = dyn_array_length(ra.intervals);
+    size_t interval_count = dyn_array_length(ra->intervals);
     CUIK_TIMED_BLOCK("build intervals") {
         FOREACH_REVERSE_N(i, 0, ctx->bb_count) {
             TB_Node* bb = ctx->worklist.items[ctx->bb_order[i]];
@@ -682,37 +750,385 @@ static int linear_scan(Ctx* restrict ctx, TB_Function* f, int stack_usage, int e
                 if (bits == 0) continue;
 
                 FOREACH_N(k, 0, 64) if (bits & (1ull << k)) {
-                    add_range(&ra.intervals[j*64 + k], bb_start, bb_end);
+                    add_range(&ra->intervals[j*64 + k], bb_start, bb_end);
                 }
             }
 
             // for all instruction in BB (in reverse), add ranges
             if (mbb->first) {
-                reverse_bb_walk(&ra, mbb, mbb->first);
+                reverse_bb_walk(ra, mbb, mbb->first);
+            }
+        }
+    }
+
+    ra->endpoint = end;
+    ra->tail_exits = ctx->tail_exits;
+    mark_callee_saved_constraints(ctx, ra->callee_saved);
+
+    ra->bb_count = ctx->bb_count;
+    ra->bb_end  = TB_ARENA_ARR_ALLOC(tmp_arena, ctx->bb_count, int);
+    ra->bb_freq = TB_ARENA_ARR_ALLOC(tmp_arena, ctx->bb_count, uint64_t);
+
+    FOREACH_N(i, 0, ctx->bb_count) {
+        TB_Node* bb = ctx->worklist.items[ctx->bb_order[i]];
+        MachineBB* mbb = &nl_map_get_checked(mbbs, bb);
+
+        ra->bb_end[i] = mbb->end + 1;
+        if (ctx->bb_freq != NULL) {
+            ra->bb_freq[i] = ctx->bb_freq[ctx->bb_order[i]];
+        } else {
+            // no profile, every loop level is assumed to run 8 times
+            int depth = nl_map_get_checked(ctx->cfg.node_to_block, bb).loop_depth;
+            ra->bb_freq[i] = 1ull << (3 * TB_MIN(depth, 16));
+        }
+    }
+}
+
+static void free_intervals(Ctx* restrict ctx, LSRA* restrict ra) {
+    CUIK_TIMED_BLOCK("free intervals") {
+        dyn_array_for(i, ra->intervals) {
+            dyn_array_destroy(ra->intervals[i].ranges);
+            dyn_array_destroy(ra->intervals[i].uses);
+        }
+    }
+
+    ctx->intervals = ra->intervals;
+}
+
+////////////////////////////////
+// Copy coalescing
+////////////////////////////////
+// copies between virtual registers (mostly the PHI moves) which don't interfere can
+// share an interval, it means they get the same register and the move disappears.
+// this happens before either allocator looks at the intervals.
+static RegIndex coalesce_find(RegIndex* leader, RegIndex i) {
+    while (leader[i] != i) {
+        leader[i] = leader[leader[i]];
+        i = leader[i];
+    }
+
+    return i;
+}
+
+static bool intervals_overlap(LiveInterval* a, LiveInterval* b);
+
+// ranges and uses are both sorted in reverse so we merge them that way
+static void merge_intervals(LSRA* restrict ra, RegIndex dst, RegIndex src) {
+    LiveInterval* a = &ra->intervals[dst];
+    LiveInterval* b = &ra->intervals[src];
+
+    size_t a_count = dyn_array_length(a->ranges), b_count = dyn_array_length(b->ranges);
+    DynArray(LiveRange) ranges = dyn_array_create(LiveRange, a_count + b_count);
+    dyn_array_put(ranges, (LiveRange){ INT_MAX, INT_MAX });
+    for (size_t i = 1, j = 1; i < a_count || j < b_count;) {
+        LiveRange r;
+        if (j == b_count || (i < a_count && a->ranges[i].end >= b->ranges[j].end)) {
+            r = a->ranges[i++];
+        } else {
+            r = b->ranges[j++];
+        }
+
+        // the ranges touch where the copy used to be
+        LiveRange* top = &ranges[dyn_array_length(ranges) - 1];
+        if (dyn_array_length(ranges) > 1 && r.end >= top->start) {
+            top->start = TB_MIN(top->start, r.start);
+        } else {
+            dyn_array_put(ranges, r);
+        }
+    }
+
+    size_t a_uses = dyn_array_length(a->uses), b_uses = dyn_array_length(b->uses);
+    DynArray(UsePos) uses = dyn_array_create(UsePos, a_uses + b_uses + 1);
+    for (size_t i = 0, j = 0; i < a_uses || j < b_uses;) {
+        if (j == b_uses || (i < a_uses && a->uses[i].pos >= b->uses[j].pos)) {
+            dyn_array_put(uses, a->uses[i++]);
+        } else {
+            dyn_array_put(uses, b->uses[j++]);
+        }
+    }
+
+    dyn_array_destroy(a->ranges);
+    dyn_array_destroy(a->uses);
+    a->ranges = ranges;
+    a->uses = uses;
+    if (a->hint < 0) a->hint = b->hint;
+    if (a->n != b->n) a->n = NULL;
+
+    // the other interval is dead now, the allocators skip anything without ranges
+    dyn_array_destroy(b->uses);
+    dyn_array_set_length(b->ranges, 1);
+}
+
+static void coalesce_copies(Ctx* restrict ctx, LSRA* restrict ra) {
+    size_t interval_count = dyn_array_length(ra->intervals);
+    RegIndex* leader = TB_ARENA_ARR_ALLOC(tmp_arena, interval_count, RegIndex);
+    FOREACH_N(i, 0, interval_count) {
+        leader[i] = i;
+    }
+
+    int merged = 0;
+    CUIK_TIMED_BLOCK("coalesce") {
+        for (Inst* inst = ctx->first; inst; inst = inst->next) {
+            if ((inst->type != MOV && inst->type != FP_MOV) || inst->flags != 0) continue;
+            if (inst->out_count != 1 || inst->in_count != 1 || inst->tmp_count != 0) continue;
+
+            RegIndex dst = coalesce_find(leader, inst->operands[0]);
+            RegIndex src = coalesce_find(leader, inst->operands[1]);
+            if (dst == src) continue;
+
+            LiveInterval* a = &ra->intervals[dst];
+            LiveInterval* b = &ra->intervals[src];
+            if (a->reg >= 0 || b->reg >= 0) continue;
+            if (a->reg_class != b->reg_class || a->dt != b->dt || a->dt != inst->dt) continue;
+            if (intervals_overlap(a, b)) continue;
+
+            REG_ALLOC_LOG printf("  #   coalesce v%d with v%d\n", src, dst);
+            merge_intervals(ra, dst, src);
+            leader[src] = dst;
+            merged++;
+        }
+    }
+
+    if (merged == 0) {
+        return;
+    }
+
+    // rewrite operands, the copies between the same interval are gone
+    for (Inst *prev = NULL, *inst = ctx->first; inst;) {
+        FOREACH_N(i, 0, inst->out_count + inst->in_count + inst->tmp_count) {
+            inst->operands[i] = coalesce_find(leader, inst->operands[i]);
+        }
+
+        if ((inst->type == MOV || inst->type == FP_MOV) && inst->flags == 0 &&
+            inst->out_count == 1 && inst->in_count == 1 && inst->operands[0] == inst->operands[1]) {
+            assert(prev != NULL);
+            prev->next = inst->next;
+
+            // it's not an instruction anymore so it's not a use either
+            LiveInterval* interval = &ra->intervals[inst->operands[0]];
+            size_t j = 0;
+            dyn_array_for(k, interval->uses) {
+                if (interval->uses[k].pos != inst->time) {
+                    interval->uses[j++] = interval->uses[k];
+                }
+            }
+            dyn_array_set_length(interval->uses, j);
+
+            inst = inst->next;
+            continue;
+        }
+
+        prev = inst, inst = inst->next;
+    }
+
+    FOREACH_N(i, 0, interval_count) {
+        LiveInterval* interval = &ra->intervals[i];
+        if (interval->hint >= 0) {
+            interval->hint = coalesce_find(leader, interval->hint);
+            if (interval->hint == i) interval->hint = -1;
+        }
+    }
+
+    // the move resolver walks the live-ins so those need to be updated
+    MachineBBs mbbs = ctx->machine_bbs;
+    FOREACH_N(i, 0, ctx->bb_count) {
+        TB_Node* bb = ctx->worklist.items[ctx->bb_order[i]];
+        MachineBB* mbb = &nl_map_get_checked(mbbs, bb);
+
+        FOREACH_SET(j, mbb->live_in) if (leader[j] != j) {
+            set_remove(&mbb->live_in, j);
+            set_put(&mbb->live_in, coalesce_find(leader, j));
+        }
+
+        FOREACH_SET(j, mbb->live_out) if (leader[j] != j) {
+            set_remove(&mbb->live_out, j);
+            set_put(&mbb->live_out, coalesce_find(leader, j));
+        }
+    }
+}
+
+////////////////////////////////
+// Edge moves
+////////////////////////////////
+// every move on a CFG edge happens at once (a value might be moving into the register
+// another one is leaving) so we sequence them like a parallel copy: a move can go once
+// nothing else needs to read its destination. whatever's left after that are cycles,
+// those are broken with xchg for GPRs or by stashing a value on the stack.
+typedef struct {
+    RegIndex dst, src;
+} EdgeMove;
+
+// spill slots are negative so we can compare locations
+static int interval_loc(LiveInterval* interval) {
+    return interval->spill > 0 ? -interval->spill : interval->reg_class*CG_REGISTER_COUNT + interval->assigned;
+}
+
+// a register which nothing lives in at t (and the edge doesn't touch), -1 if there's none
+static int find_scratch_reg(LSRA* restrict ra, int rc, int t, size_t count, EdgeMove* moves) {
+    // unused callee saved regs aren't saved in the prologue, we can't touch those either
+    uint64_t busy = ra->callee_saved[rc] | reserved_regs[rc];
+
+    FOREACH_N(i, 0, count) {
+        LiveInterval* d = &ra->intervals[moves[i].dst];
+        LiveInterval* s = &ra->intervals[moves[i].src];
+        if (d->reg_class == rc && d->spill <= 0) busy |= 1ull << d->assigned;
+        if (s->reg_class == rc && s->spill <= 0) busy |= 1ull << s->assigned;
+    }
+
+    dyn_array_for(i, ra->intervals) {
+        LiveInterval* it = &ra->intervals[i];
+        if (it->reg_class != rc || it->spill > 0 || it->assigned < 0) continue;
+
+        FOREACH_N(j, 1, dyn_array_length(it->ranges)) {
+            if (it->ranges[j].start <= t && t <= it->ranges[j].end) {
+                busy |= 1ull << it->assigned;
+                break;
+            }
+        }
+    }
+
+    FOREACH_N(i, 0, CG_REGISTER_COUNT) if ((busy & (1ull << i)) == 0) {
+        return rc*CG_REGISTER_COUNT + i;
+    }
+
+    return -1;
+}
+
+static Inst* insert_edge_move(LSRA* restrict ra, Inst* at, int t, RegIndex dst, RegIndex src, size_t count, EdgeMove* moves) {
+    LiveInterval* d = &ra->intervals[dst];
+    LiveInterval* s = &ra->intervals[src];
+    if (interval_loc(d) == interval_loc(s)) {
+        return at;
+    } else if (d->spill <= 0 || s->spill <= 0) {
+        return insert_inst_after(at, t, MOV, d->dt, dst, src);
+    }
+
+    // memory to memory has to go through a register, scalar floats fit in a GPR just fine
+    CG_DataType word_dt = legalize(TB_TYPE_I64);
+    bool is_vector = d->reg_class != REG_CLASS_GPR && d->dt != legalize(TB_TYPE_F32) && d->dt != legalize(TB_TYPE_F64);
+    CG_DataType dt = is_vector ? d->dt : word_dt;
+
+    int tmp = find_scratch_reg(ra, is_vector ? d->reg_class : REG_CLASS_GPR, t, count, moves);
+    if (tmp >= 0) {
+        at = insert_inst_after(at, t, MOV, dt, tmp, src);
+        return insert_inst_after(at, t, MOV, dt, dst, tmp);
+    }
+
+    // nothing's free, we borrow a register and put it back:
+    //   xchg [src], reg
+    //   mov  [dst], reg
+    //   xchg [src], reg
+    tb_assert(!is_vector, "TODO: no register to copy the spilled vector through");
+    at = insert_inst_after(at, t, XCHG, word_dt, src, FIRST_GPR + BORROW_GPR);
+    at = insert_inst_after(at, t, MOV, word_dt, dst, FIRST_GPR + BORROW_GPR);
+    return insert_inst_after(at, t, XCHG, word_dt, src, FIRST_GPR + BORROW_GPR);
+}
+
+static void resolve_edge_moves(LSRA* restrict ra, int t, size_t count, EdgeMove* moves) {
+    if (count == 0) {
+        return;
+    }
+
+    // finished moves are swapped to the end, their registers are still off limits
+    // for the scratch register.
+    size_t total = count;
+    Inst* at = insert_point(ra, t, false);
+    while (count > 0) {
+        // find a move which doesn't clobber anything we still need
+        size_t i = 0;
+        for (; i < count; i++) {
+            int dst_loc = interval_loc(&ra->intervals[moves[i].dst]);
+
+            bool blocked = false;
+            FOREACH_N(j, 0, count) if (j != i && interval_loc(&ra->intervals[moves[j].src]) == dst_loc) {
+                blocked = true;
+                break;
+            }
+
+            if (!blocked) break;
+        }
+
+        if (i < count) {
+            at = insert_edge_move(ra, at, t, moves[i].dst, moves[i].src, total, moves);
+            count -= 1;
+            SWAP(EdgeMove, moves[i], moves[count]);
+            continue;
+        }
+
+        // everything left is part of a cycle
+        RegIndex dst = moves[0].dst, src = moves[0].src;
+        LiveInterval* d = &ra->intervals[dst];
+        LiveInterval* s = &ra->intervals[src];
+        int dst_loc = interval_loc(d);
+
+        if (d->reg_class == REG_CLASS_GPR && d->spill <= 0 && s->spill <= 0) {
+            // after the swap, whatever was in dst is now where src was
+            at = insert_inst_after(at, t, XCHG, legalize(TB_TYPE_I64), dst, src);
+            count -= 1;
+            SWAP(EdgeMove, moves[0], moves[count]);
+
+            FOREACH_N(j, 0, count) if (interval_loc(&ra->intervals[moves[j].src]) == dst_loc) {
+                moves[j].src = src;
+            }
+        } else {
+            // stash dst in a stack slot and read it from there
+            int rc = d->reg_class, size = rc ? 16 : 8;
+            ra->stack_usage = align_up(ra->stack_usage + size, size);
+
+            LiveInterval it = {
+                .reg_class = rc,
+                .dt = d->dt,
+                .spill = ra->stack_usage,
+                .assigned = -1,
+                .reg = -1,
+                .hint = -1,
+                .split_kid = -1,
+            };
+
+            RegIndex stash = dyn_array_length(ra->intervals);
+            dyn_array_put(ra->intervals, it);
+
+            at = insert_edge_move(ra, at, t, stash, dst, total, moves);
+            FOREACH_N(j, 0, count) if (interval_loc(&ra->intervals[moves[j].src]) == dst_loc) {
+                moves[j].src = stash;
             }
         }
     }
+}
+
+static void cuiksort_defs(LiveInterval* intervals, ptrdiff_t lo, ptrdiff_t hi, RegIndex* arr);
+static int linear_scan(Ctx* restrict ctx, TB_Function* f, int stack_usage, int end) {
+    LSRA ra = { .abi = f->super.module->target_abi, .first = ctx->first, .cache = ctx->first, .intervals = ctx->intervals, .stack_usage = stack_usage };
+
+    FOREACH_N(i, 0, CG_REGISTER_CLASSES) {
+        ra.active_set[i] = set_create_in_arena(tmp_arena, CG_REGISTER_COUNT);
+    }
+
+    MachineBBs mbbs = ctx->machine_bbs;
+    size_t interval_count = dyn_array_length(ra.intervals);
+    build_intervals(ctx, &ra, end);
+    coalesce_copies(ctx, &ra);
 
     // we use every fixed interval at the very start to force them into
     // the inactive set.
-    FOREACH_N(i, 0, 32) {
+    FOREACH_N(i, 0, CG_REGISTER_CLASSES*CG_REGISTER_COUNT) {
         add_range(&ra.intervals[i], 0, 1);
     }
 
-    ra.endpoint = end;
-    mark_callee_saved_constraints(ctx, ra.callee_saved);
-
     // generate unhandled interval list (sorted by starting point)
     ra.unhandled = dyn_array_create(LiveInterval*, (interval_count * 4) / 3);
     FOREACH_N(i, 0, interval_count) {
+        // coalesced intervals are left empty
         ra.intervals[i].active_range = dyn_array_length(ra.intervals[i].ranges) - 1;
-        dyn_array_put(ra.unhandled, i);
+        if (ra.intervals[i].active_range > 0) {
+            dyn_array_put(ra.unhandled, i);
+        }
     }
-    cuiksort_defs(ra.intervals, 0, interval_count - 1, ra.unhandled);
+    cuiksort_defs(ra.intervals, 0, dyn_array_length(ra.unhandled) - 1, ra.unhandled);
 
     // only need enough to store for the biggest register class
-    ra.free_pos  = TB_ARENA_ARR_ALLOC(tmp_arena, 16, int);
-    ra.block_pos = TB_ARENA_ARR_ALLOC(tmp_arena, 16, int);
+    ra.free_pos  = TB_ARENA_ARR_ALLOC(tmp_arena, CG_REGISTER_COUNT, int);
+    ra.block_pos = TB_ARENA_ARR_ALLOC(tmp_arena, CG_REGISTER_COUNT, int);
 
     // linear scan main loop
     CUIK_TIMED_BLOCK("reg alloc") {
@@ -806,6 +1222,9 @@ static int linear_scan(Ctx* restrict ctx, TB_Function* f, int stack_usage, int e
 
     // move resolver
     CUIK_TIMED_BLOCK("move resolver") {
+        DynArray(EdgeMove) bottom_moves = dyn_array_create(EdgeMove, 16);
+        DynArray(EdgeMove) top_moves = dyn_array_create(EdgeMove, 16);
+
         TB_Node** bbs = ctx->worklist.items;
         int* bb_order = ctx->bb_order;
         FOREACH_N(i, 0, ctx->bb_count) {
@@ -813,11 +1232,23 @@ static int linear_scan(Ctx* restrict ctx, TB_Function* f, int stack_usage, int e
             MachineBB* mbb = &nl_map_get_checked(mbbs, bb);
             TB_Node* end_node = mbb->end_node;
 
+            int succ_count = 0;
+            for (User* u = end_node->users; u; u = u->next) {
+                if (cfg_is_control(u->n)) succ_count++;
+            }
+
             for (User* u = end_node->users; u; u = u->next) {
                 if (cfg_is_control(u->n)) {
                     TB_Node* succ = cfg_get_fallthru(u->n);
                     MachineBB* target = &nl_map_get_checked(mbbs, succ);
 
+                    // the moves go before our terminator if this is the only way out, at the top
+                    // of the successor if it's the only way in. critical edges got split before
+                    // isel so the last case is just a fallback, it picks per value.
+                    bool single_pred = succ->type != TB_REGION || succ->input_count == 1;
+                    dyn_array_clear(bottom_moves);
+                    dyn_array_clear(top_moves);
+
                     // for all live-ins, we should check if we need to insert a move
                     FOREACH_SET(k, target->live_in) {
                         LiveInterval* interval = &ra.intervals[k];
@@ -827,17 +1258,24 @@ static int linear_scan(Ctx* restrict ctx, TB_Function* f, int stack_usage, int e
                         LiveInterval* end = split_interval_at(&ra, interval, target->start);
 
                         if (start != end) {
-                            if (start->spill > 0) {
-                                assert(end->spill <= 0 && "TODO: both can't be spills yet");
-                                insert_split_move(&ra, target->start + 1, start - ra.intervals, end - ra.intervals);
+                            EdgeMove m = { end - ra.intervals, start - ra.intervals };
+                            if (succ_count > 1 && (single_pred || start->spill > 0)) {
+                                dyn_array_put(top_moves, m);
                             } else {
-                                insert_split_move(&ra, mbb->terminator - 1, start - ra.intervals, end - ra.intervals);
+                                dyn_array_put(bottom_moves, m);
                             }
                         }
                     }
+
+                    int bottom = (mbb->terminator ? mbb->terminator : mbb->end) - 1;
+                    resolve_edge_moves(&ra, bottom, dyn_array_length(bottom_moves), bottom_moves);
+                    resolve_edge_moves(&ra, target->start + 1, dyn_array_length(top_moves), top_moves);
                 }
             }
         }
+
+        dyn_array_destroy(bottom_moves);
+        dyn_array_destroy(top_moves);
     }
 
     // resolve all split interval references
@@ -854,14 +1292,399 @@ static int linear_scan(Ctx* restrict ctx, TB_Function* f, int stack_usage, int e
         }
     }
 
-    CUIK_TIMED_BLOCK("free intervals") {
-        dyn_array_for(i, ra.intervals) {
-            dyn_array_destroy(ra.intervals[i].ranges);
-            dyn_array_destroy(ra.intervals[i].uses);
+    free_intervals(ctx, &ra);
+    return ra.stack_usage;
+}
+
+////////////////////////////////
+// Greedy allocator
+////////////////////////////////
+// Used at -O2, instead of walking intervals by start time we hand out registers to
+// the most expensive intervals first (uses per length, weighed by BB frequency or
+// loop depth). An interval either finds a register nothing conflicts with,
+// evicts cheaper intervals out of one (they go back into the queue) or gets spilled.
+//
+// Spilling doesn't split the interval in pieces which need to be stitched back
+// together on edges, every instruction which touches it gets a tiny interval to
+// reload into (or store from) so there's no move resolver.
+#define GREEDY_NO_SPILL 1e30f
+
+typedef struct {
+    LSRA* ra;
+
+    // intervals currently living in each register
+    DynArray(RegIndex) assigned[CG_REGISTER_CLASSES][CG_REGISTER_COUNT];
+
+    DynArray(float) weights;
+    // binary heap sorted by weight
+    DynArray(RegIndex) queue;
+
+    // inst_at[t / 2] is the instruction at time t (before any moves were added)
+    // and prev_at is the one which came right before it.
+    Inst** inst_at;
+    Inst** prev_at;
+
+    // evictions can keep cascading in weird cases, once we run out we just
+    // spill which is guaranteed to make progress
+    int evictions_left;
+} Greedy;
+
+// ranges are half-open since an interval ending at t can hand off the register to
+// one starting at t, empty ranges (dead defs) still take up the slot they're written.
+static bool intervals_overlap(LiveInterval* a, LiveInterval* b) {
+    // ranges are stored in reverse with a sentinel at [0]
+    size_t i = dyn_array_length(a->ranges) - 1, j = dyn_array_length(b->ranges) - 1;
+    while (i > 0 && j > 0) {
+        LiveRange* x = &a->ranges[i];
+        LiveRange* y = &b->ranges[j];
+
+        int x_end = TB_MAX(x->end, x->start + 1);
+        int y_end = TB_MAX(y->end, y->start + 1);
+        if (x->start < y_end && y->start < x_end) {
+            return true;
         }
+
+        if (x_end <= y_end) i--; else j--;
+    }
+
+    return false;
+}
+
+static float spill_weight(LSRA* restrict ra, LiveInterval* interval) {
+    int length = 0;
+    FOREACH_N(i, 1, dyn_array_length(interval->ranges)) {
+        length += interval->ranges[i].end - interval->ranges[i].start;
+    }
+
+    float uses = 0.0f;
+    FOREACH_N(i, 0, dyn_array_length(interval->uses)) {
+        uses += (float) freq_at(ra, interval->uses[i].pos);
+    }
+
+    return uses / (float) (length + 2);
+}
+
+static bool greedy_cmp(Greedy* g, RegIndex a, RegIndex b) {
+    float wa = g->weights[a], wb = g->weights[b];
+    return wa != wb ? wa > wb : a < b;
+}
+
+static void greedy_push(Greedy* g, RegIndex ri) {
+    size_t i = dyn_array_length(g->queue);
+    dyn_array_put(g->queue, ri);
+
+    // sift up
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!greedy_cmp(g, g->queue[i], g->queue[parent])) break;
+
+        SWAP(RegIndex, g->queue[i], g->queue[parent]);
+        i = parent;
+    }
+}
+
+static RegIndex greedy_pop(Greedy* g) {
+    RegIndex top = g->queue[0];
+    RegIndex last = dyn_array_pop(g->queue);
+
+    size_t count = dyn_array_length(g->queue);
+    if (count > 0) {
+        g->queue[0] = last;
+
+        // sift down
+        size_t i = 0;
+        for (;;) {
+            size_t best = i, l = i*2 + 1, r = i*2 + 2;
+            if (l < count && greedy_cmp(g, g->queue[l], g->queue[best])) best = l;
+            if (r < count && greedy_cmp(g, g->queue[r], g->queue[best])) best = r;
+            if (best == i) break;
+
+            SWAP(RegIndex, g->queue[i], g->queue[best]);
+            i = best;
+        }
+    }
+
+    return top;
+}
+
+// returns true if nothing in the register gets in the way
+static bool greedy_is_free(Greedy* g, LiveInterval* interval, int rc, int reg) {
+    LSRA* ra = g->ra;
+    if (reserved_regs[rc] & (1ull << reg)) {
+        return false;
+    }
+
+    if (intervals_overlap(interval, &ra->intervals[rc*CG_REGISTER_COUNT + reg])) {
+        return false;
+    }
+
+    dyn_array_for(i, g->assigned[rc][reg]) {
+        if (intervals_overlap(interval, &ra->intervals[g->assigned[rc][reg][i]])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void greedy_assign(Greedy* g, RegIndex ri, int reg) {
+    LSRA* ra = g->ra;
+    int rc = ra->intervals[ri].reg_class;
+
+    if (UNLIKELY(ra->callee_saved[rc] & (1ull << reg))) {
+        spill_callee_saved(ra, rc, reg);
+    }
+
+    REG_ALLOC_LOG printf("  #   v%d: assign to %s\n", ri, reg_name(rc, reg));
+
+    ra->intervals[ri].assigned = reg;
+    dyn_array_put(g->assigned[rc][reg], ri);
+}
+
+static RegIndex greedy_new_interval(Greedy* g, RegIndex vi, int start, int end) {
+    LSRA* ra = g->ra;
+    LiveInterval it = {
+        .reg_class = ra->intervals[vi].reg_class,
+        .n = ra->intervals[vi].n,
+        .dt = ra->intervals[vi].dt,
+        .assigned = -1, .reg = -1, .hint = -1,
+        .spill = -1, .split_kid = -1,
+    };
+
+    it.ranges = dyn_array_create(LiveRange, 2);
+    dyn_array_put(it.ranges, (LiveRange){ INT_MAX, INT_MAX });
+    dyn_array_put(it.ranges, (LiveRange){ start, end });
+
+    RegIndex ri = dyn_array_length(ra->intervals);
+    dyn_array_put(ra->intervals, it);
+
+    // callee saved spill slots also add intervals, they just don't get weights
+    while (dyn_array_length(g->weights) < ri) {
+        dyn_array_put(g->weights, 0.0f);
+    }
+    dyn_array_put(g->weights, GREEDY_NO_SPILL);
+    greedy_push(g, ri);
+    return ri;
+}
+
+static Inst* greedy_insert_move(Inst* prev, CG_DataType dt, int t, RegIndex dst, RegIndex src) {
+    Inst* new_inst = tb_arena_alloc(tmp_arena, sizeof(Inst) + (2 * sizeof(RegIndex)));
+    *new_inst = (Inst){ .type = MOV, .flags = INST_SPILL, .dt = dt, .out_count = 1, 1 };
+    new_inst->operands[0] = dst;
+    new_inst->operands[1] = src;
+    new_inst->time = t;
+    new_inst->next = prev->next;
+    prev->next = new_inst;
+    return new_inst;
+}
+
+static void greedy_spill(Greedy* g, RegIndex vi) {
+    LSRA* ra = g->ra;
+    LiveInterval* interval = &ra->intervals[vi];
+
+    int size = interval->reg_class ? 16 : 8;
+    ra->stack_usage = align_up(ra->stack_usage + size, size);
+    interval->spill = ra->stack_usage;
+
+    REG_ALLOC_LOG printf("  \x1b[33m#   v%d: spill to [RBP - %d]\x1b[0m\n", vi, interval->spill);
+
+    CG_DataType dt = interval->dt;
+    DynArray(UsePos) uses = interval->uses;
+    FOREACH_N(i, 0, dyn_array_length(uses)) {
+        int t = uses[i].pos;
+
+        // an instruction can use the same interval multiple times, we only want to see it once
+        if (i > 0 && uses[i - 1].pos == t) continue;
+
+        Inst* inst = g->inst_at[t / 2];
+        assert(inst != NULL && inst->time == t);
+
+        RegIndex* ops = inst->operands;
+        int out_end = inst->out_count, in_end = out_end + inst->in_count;
+        int op_count = in_end + inst->tmp_count;
+
+        bool is_def = false, is_use = false;
+        FOREACH_N(j, 0, in_end) if (ops[j] == vi) {
+            if (j < out_end) is_def = true;
+            else is_use = true;
+        }
+
+        // temporaries only need a register for the one instruction
+        FOREACH_N(j, in_end, op_count) if (ops[j] == vi) {
+            ops[j] = greedy_new_interval(g, vi, t, t + 1);
+        }
+
+        if (!is_def && !is_use) continue;
+
+        // plain moves can write straight to the stack slot
+        if (!is_use && (inst->type == MOV || inst->type == FP_MOV) && (inst->flags & ~INST_IMM) == 0) {
+            continue;
+        }
+
+        // two address ops use the same interval for both sides so it has to stay that way
+        RegIndex tmp = greedy_new_interval(g, vi, is_use ? t - 1 : t, is_def ? t + 2 : t);
+        FOREACH_N(j, 0, in_end) if (ops[j] == vi) {
+            ops[j] = tmp;
+        }
+
+        if (is_use) {
+            // reloads go last so they don't get in front of the stores from the previous instruction
+            Inst* prev = g->prev_at[t / 2];
+            while (prev->next != inst) prev = prev->next;
+
+            greedy_insert_move(prev, dt, t - 1, tmp, vi);
+        }
+
+        if (is_def) {
+            greedy_insert_move(inst, dt, t + 1, vi, tmp);
+        }
+    }
+}
+
+// returns the register to steal or -1 if everything's too expensive
+static int greedy_try_evict(Greedy* g, RegIndex ri, const int* order, int order_count) {
+    LSRA* ra = g->ra;
+    LiveInterval* interval = &ra->intervals[ri];
+    int rc = interval->reg_class;
+    float weight = g->weights[ri];
+
+    int best = -1;
+    float best_cost = weight;
+    FOREACH_N(i, 0, order_count) {
+        int reg = order[i];
+        if (reserved_regs[rc] & (1ull << reg)) continue;
+        if (intervals_overlap(interval, &ra->intervals[rc*CG_REGISTER_COUNT + reg])) continue;
+
+        // we evict everything in the way, it's only worth it if they're all cheaper
+        float cost = 0.0f;
+        dyn_array_for(j, g->assigned[rc][reg]) {
+            RegIndex other = g->assigned[rc][reg][j];
+            if (intervals_overlap(interval, &ra->intervals[other])) {
+                cost = TB_MAX(cost, g->weights[other]);
+                if (cost >= best_cost) break;
+            }
+        }
+
+        if (cost < best_cost) {
+            best = reg, best_cost = cost;
+        }
+    }
+
+    return best;
+}
+
+static int greedy_alloc(Ctx* restrict ctx, TB_Function* f, int stack_usage, int end) {
+    LSRA ra = { .abi = f->super.module->target_abi, .first = ctx->first, .cache = ctx->first, .intervals = ctx->intervals, .stack_usage = stack_usage };
+    Greedy g = { .ra = &ra };
+
+    size_t interval_count = dyn_array_length(ra.intervals);
+    build_intervals(ctx, &ra, end);
+    coalesce_copies(ctx, &ra);
+
+    // map times back to instructions for the spiller
+    int max_time = 0;
+    for (Inst* inst = ctx->first; inst; inst = inst->next) {
+        max_time = TB_MAX(max_time, inst->time);
+    }
+
+    g.inst_at = TB_ARENA_ARR_ALLOC(tmp_arena, max_time/2 + 1, Inst*);
+    g.prev_at = TB_ARENA_ARR_ALLOC(tmp_arena, max_time/2 + 1, Inst*);
+    memset(g.inst_at, 0, (max_time/2 + 1) * sizeof(Inst*));
+    memset(g.prev_at, 0, (max_time/2 + 1) * sizeof(Inst*));
+    for (Inst *prev = NULL, *inst = ctx->first; inst; prev = inst, inst = inst->next) {
+        g.inst_at[inst->time / 2] = inst;
+        g.prev_at[inst->time / 2] = prev;
+    }
+
+    CUIK_TIMED_BLOCK("reg alloc") {
+        g.weights = dyn_array_create(float, interval_count * 2);
+        g.queue = dyn_array_create(RegIndex, interval_count);
+        g.evictions_left = interval_count * 4;
+
+        FOREACH_N(i, 0, interval_count) {
+            LiveInterval* interval = &ra.intervals[i];
+
+            bool is_virtual = interval->reg < 0 && dyn_array_length(interval->ranges) > 1;
+            dyn_array_put(g.weights, is_virtual ? spill_weight(&ra, interval) : 0.0f);
+            if (is_virtual) {
+                greedy_push(&g, i);
+            }
+        }
+
+        while (dyn_array_length(g.queue)) {
+            RegIndex ri = greedy_pop(&g);
+            LiveInterval* interval = &ra.intervals[ri];
+            int rc = interval->reg_class;
+
+            REG_ALLOC_LOG {
+                printf("  # v%-4d t=[%-4d - %4d) weight=%f   ", ri, interval_start(interval), interval_end(interval), g.weights[ri]);
+                if (interval->n != NULL) {
+                    print_node_sexpr(interval->n, 0);
+                }
+                printf("\n");
+            }
+
+            // preference: hinted, caller saved, callee saved we're already paying
+            // for and last we'll start using new callee saved.
+            int order[CG_REGISTER_COUNT + 1], order_count = 0;
+            if (interval->hint >= 0) {
+                LiveInterval* hint = &ra.intervals[interval->hint];
+                if (hint->reg_class == rc && hint->assigned >= 0) {
+                    order[order_count++] = hint->assigned;
+                }
+            }
+
+            uint64_t unused_callee = ra.callee_saved[rc];
+            FOREACH_N(i, 0, CG_REGISTER_COUNT) if ((unused_callee & (1ull << i)) == 0) order[order_count++] = i;
+            FOREACH_N(i, 0, CG_REGISTER_COUNT) if (unused_callee & (1ull << i)) order[order_count++] = i;
+
+            int reg = -1;
+            FOREACH_N(i, 0, order_count) {
+                if (greedy_is_free(&g, interval, rc, order[i])) {
+                    reg = order[i];
+                    break;
+                }
+            }
+
+            if (reg < 0 && (g.evictions_left > 0 || g.weights[ri] >= GREEDY_NO_SPILL)) {
+                reg = greedy_try_evict(&g, ri, order, order_count);
+                if (reg >= 0) {
+                    // kick out anything that's in the way
+                    DynArray(RegIndex) list = g.assigned[rc][reg];
+                    for (size_t i = 0; i < dyn_array_length(list);) {
+                        RegIndex other = list[i];
+                        if (intervals_overlap(interval, &ra.intervals[other])) {
+                            REG_ALLOC_LOG printf("  #   v%d: evicted from %s\n", other, reg_name(rc, reg));
+
+                            ra.intervals[other].assigned = -1;
+                            dyn_array_remove(list, i);
+                            greedy_push(&g, other);
+                            g.evictions_left -= 1;
+                            continue;
+                        }
+
+                        i++;
+                    }
+                }
+            }
+
+            if (reg >= 0) {
+                greedy_assign(&g, ri, reg);
+            } else if (g.weights[ri] >= GREEDY_NO_SPILL) {
+                tb_panic("v%d: regalloc failure, nowhere to put a reload", ri);
+            } else {
+                greedy_spill(&g, ri);
+            }
+        }
+    }
+
+    FOREACH_N(rc, 0, CG_REGISTER_CLASSES) FOREACH_N(i, 0, CG_REGISTER_COUNT) {
+        dyn_array_destroy(g.assigned[rc][i]);
     }
+    dyn_array_destroy(g.weights);
+    dyn_array_destroy(g.queue);
 
-    ctx->intervals = ra.intervals;
+    free_intervals(ctx, &ra);
     return ra.stack_usage;
 }
 
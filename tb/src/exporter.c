@@ -1,4 +1,5 @@
 #include "tb_internal.h"
+#include <futex.h>
 
 TB_ExportBuffer tb_coff_write_output(TB_Module* restrict m, const IDebugFormat* dbg);
 TB_ExportBuffer tb_macho_write_output(TB_Module* restrict m, const IDebugFormat* dbg);
@@ -21,7 +22,7 @@ TB_API TB_ExportBuffer tb_module_object_export(TB_Module* m, TB_DebugFormat debu
         [TB_SYSTEM_WINDOWS] = tb_coff_write_output,
         [TB_SYSTEM_MACOS]   = tb_macho_write_output,
         [TB_SYSTEM_LINUX]   = tb_elf64obj_write_output,
-        // [TB_SYSTEM_WEB]     = tb_wasm_write_output,
+        [TB_SYSTEM_WEB]     = tb_wasm_write_output,
     };
 
     assert(fn[m->target_system] != NULL && "TODO");
@@ -64,6 +65,48 @@ TB_API void tb_export_buffer_free(TB_ExportBuffer buffer) {
     }
 }
 
+////////////////////////////////
+// Parallel helpers
+////////////////////////////////
+typedef struct {
+    TB_ParallelFn fn;
+    void* ctx;
+    size_t start, end;
+    Futex* remaining;
+} ParallelTask;
+
+static void parallel_task(void* arg) {
+    ParallelTask t = *(ParallelTask*) arg;
+    t.fn(t.ctx, t.start, t.end);
+    futex_dec(t.remaining);
+}
+
+void tb_parallel_for(TB_Module* m, size_t count, size_t grain, void* ctx, TB_ParallelFn fn) {
+    tb_parallel_for_pool(m->thread_pool, count, grain, ctx, fn);
+}
+
+void tb_parallel_for_pool(TB_ThreadPool* tp, size_t count, size_t grain, void* ctx, TB_ParallelFn fn) {
+    if (tp == NULL || count <= grain) {
+        if (count > 0) fn(ctx, 0, count);
+        return;
+    }
+
+    // the pool's queue isn't very deep, 64 batches is plenty to balance the load
+    size_t batch = (count + 63) / 64;
+    if (batch < grain) batch = grain;
+
+    // the last batch runs on this thread instead of sitting around waiting
+    size_t last = ((count - 1) / batch) * batch;
+    Futex remaining = last / batch;
+    for (size_t i = 0; i < last; i += batch) {
+        ParallelTask t = { fn, ctx, i, i + batch, &remaining };
+        tp->submit(tp, parallel_task, sizeof(t), &t);
+    }
+
+    fn(ctx, last, count);
+    futex_wait_eq(&remaining, 0);
+}
+
 static int compare_symbols(const void* a, const void* b) {
     const TB_Symbol* sym_a = *(const TB_Symbol**) a;
     const TB_Symbol* sym_b = *(const TB_Symbol**) b;
@@ -73,6 +116,12 @@ static int compare_symbols(const void* a, const void* b) {
 static int compare_functions(const void* a, const void* b) {
     const TB_FunctionOutput* sym_a = *(const TB_FunctionOutput**) a;
     const TB_FunctionOutput* sym_b = *(const TB_FunctionOutput**) b;
+
+    // hot functions are grouped together for better i-cache & iTLB locality
+    if (sym_a->heat != sym_b->heat) {
+        return sym_a->heat - sym_b->heat;
+    }
+
     return (sym_a->ordinal > sym_b->ordinal) - (sym_a->ordinal < sym_b->ordinal);
 }
 
@@ -91,21 +140,34 @@ static void layout_section(TB_ModuleSection* restrict section) {
     }
 }
 
-ExportList tb_module_layout_sections(TB_Module* m) {
-    TB_Arena* arena = &tb_thread_info(m)->tmp_arena;
-
-    size_t external_count = 0;
-    TB_External** externals = tb_arena_alloc(arena, m->symbol_count[TB_SYMBOL_EXTERNAL] * sizeof(TB_External*));
-
-    // unpack function data into the streams we actually care for.
-    // avoids needing to walk so many sparse data structures later on.
-    TB_ThreadInfo* info = atomic_load_explicit(&m->first_info_in_module, memory_order_relaxed);
-    while (info != NULL) {
-        TB_ThreadInfo* next = info->next_in_module;
-
-        // unpack symbols
+////////////////////////////////
+// Layout
+////////////////////////////////
+// every thread info gets unpacked & sorted on its own, the sorted lists
+// are merged per section after.
+typedef struct {
+    DynArray(TB_FunctionOutput*)* funcs;
+    DynArray(TB_Global*)* globals;
+    DynArray(TB_External*) externals;
+} UnpackedSymbols;
+
+typedef struct {
+    TB_Module* m;
+    TB_ThreadInfo** infos;
+    UnpackedSymbols* out;
+} UnpackCtx;
+
+static void unpack_symbols_task(void* arg, size_t start, size_t end) {
+    UnpackCtx* ctx = arg;
+    size_t section_count = dyn_array_length(ctx->m->sections);
+
+    FOREACH_N(j, start, end) {
+        TB_ThreadInfo* info = ctx->infos[j];
+        UnpackedSymbols* out = &ctx->out[j];
+
+        // threads which never made a symbol don't have a table
         TB_Symbol** syms = (TB_Symbol**) info->symbols.data;
-        size_t cap = 1ull << info->symbols.exp;
+        size_t cap = syms ? 1ull << info->symbols.exp : 0;
         for (size_t i = 0; i < cap; i++) {
             TB_Symbol* s = syms[i];
             if (s == NULL || s == NL_HASHSET_TOMB) continue;
@@ -113,49 +175,240 @@ ExportList tb_module_layout_sections(TB_Module* m) {
             switch (atomic_load_explicit(&s->tag, memory_order_relaxed)) {
                 case TB_SYMBOL_FUNCTION: {
                     TB_Function* f = (TB_Function*) s;
-                    TB_ModuleSection* sec = &m->sections[f->section];
 
                     // we only care for compiled functions
                     TB_FunctionOutput* out_f = f->output;
                     if (out_f != NULL) {
                         out_f->ordinal = f->super.ordinal;
-                        dyn_array_put(sec->funcs, out_f);
+                        dyn_array_put(out->funcs[f->section], out_f);
                     }
                     break;
                 }
                 case TB_SYMBOL_GLOBAL: {
                     TB_Global* g = (TB_Global*) s;
-                    TB_ModuleSection* sec = &m->sections[g->parent];
-                    dyn_array_put(sec->globals, g);
+                    dyn_array_put(out->globals[g->parent], g);
                     break;
                 }
                 case TB_SYMBOL_EXTERNAL: {
-                    externals[external_count++] = (TB_External*) s;
+                    dyn_array_put(out->externals, (TB_External*) s);
                     break;
                 }
                 default: break;
             }
         }
 
-        info = next;
+        FOREACH_N(i, 0, section_count) {
+            qsort(out->funcs[i], dyn_array_length(out->funcs[i]), sizeof(TB_FunctionOutput*), compare_functions);
+            qsort(out->globals[i], dyn_array_length(out->globals[i]), sizeof(TB_Symbol*), compare_symbols);
+        }
     }
+}
 
-    dyn_array_for(i, m->sections) {
-        TB_ModuleSection* sec = &m->sections[i];
+// k-way merge of the per-thread lists, there's only ever a handful of them so
+// a linear scan for the smallest head is fine.
+static void merge_sorted(void** dst, size_t k, void*** lists, size_t* cursors, int (*cmp)(const void*, const void*)) {
+    for (;;) {
+        ptrdiff_t best = -1;
+        FOREACH_N(i, 0, k) {
+            if (cursors[i] >= dyn_array_length(lists[i])) continue;
+            if (best < 0 || cmp(&lists[i][cursors[i]], &lists[best][cursors[best]]) < 0) {
+                best = i;
+            }
+        }
+
+        if (best < 0) break;
+        *dst++ = lists[best][cursors[best]++];
+    }
+}
+
+typedef struct {
+    TB_Module* m;
+    size_t info_count;
+    UnpackedSymbols* unpacked;
+} MergeCtx;
+
+static void merge_section_task(void* arg, size_t start, size_t end) {
+    MergeCtx* ctx = arg;
+    size_t k = ctx->info_count;
+
+    void*** lists = tb_platform_heap_alloc(k * sizeof(void**));
+    size_t* cursors = tb_platform_heap_alloc(k * sizeof(size_t));
+
+    FOREACH_N(i, start, end) {
+        TB_ModuleSection* sec = &ctx->m->sections[i];
+
+        size_t func_count = 0, global_count = 0;
+        FOREACH_N(j, 0, k) {
+            func_count += dyn_array_length(ctx->unpacked[j].funcs[i]);
+            global_count += dyn_array_length(ctx->unpacked[j].globals[i]);
+        }
+
+        // sections without functions keep a NULL array (COFF checks for that), also
+        // put_uninit on a NULL array only reserves the initial capacity.
+        if (func_count > 0) {
+            if (sec->funcs == NULL) sec->funcs = dyn_array_create(TB_FunctionOutput*, func_count);
+
+            size_t base = dyn_array_length(sec->funcs);
+            dyn_array_put_uninit(sec->funcs, func_count);
+            FOREACH_N(j, 0, k) lists[j] = (void**) ctx->unpacked[j].funcs[i], cursors[j] = 0;
+            merge_sorted((void**) &sec->funcs[base], k, lists, cursors, compare_functions);
+        }
+
+        if (global_count > 0) {
+            if (sec->globals == NULL) sec->globals = dyn_array_create(TB_Global*, global_count);
+
+            size_t base = dyn_array_length(sec->globals);
+            dyn_array_put_uninit(sec->globals, global_count);
+            FOREACH_N(j, 0, k) lists[j] = (void**) ctx->unpacked[j].globals[i], cursors[j] = 0;
+            merge_sorted((void**) &sec->globals[base], k, lists, cursors, compare_symbols);
+        }
+    }
+
+    tb_platform_heap_free(cursors);
+    tb_platform_heap_free(lists);
+}
+
+// Function placement is an exclusive prefix sum over the sorted functions, we
+// split it into batches: sum each batch in parallel, scan the batch totals and
+// then hand out the offsets in parallel. The same thing lays out relocations
+// where the per-function amount is however many patches stayed external.
+#define FUNC_SCAN_BATCHES 64
+
+typedef struct {
+    TB_Module* m;
+    const ICodeGen* code_gen; // non-NULL when scanning relocations
+    TB_FunctionOutput** funcs;
+    size_t count, batch;
+    size_t sums[FUNC_SCAN_BATCHES];
+} FuncScan;
+
+static void func_scan_count_task(void* arg, size_t start, size_t end) {
+    FuncScan* s = arg;
+    FOREACH_N(b, start, end) {
+        size_t hi = (b + 1) * s->batch;
+        if (hi > s->count) hi = s->count;
+
+        size_t sum = 0;
+        FOREACH_N(i, b * s->batch, hi) {
+            TB_FunctionOutput* out_f = s->funcs[i];
+            if (s->code_gen) {
+                // patching only writes into the function's own code so this is safe
+                // to do in parallel, we stash the count until the offsets are known.
+                out_f->reloc_pos = s->code_gen->emit_call_patches(s->m, out_f);
+                sum += out_f->reloc_pos;
+            } else {
+                sum += out_f->code_size;
+            }
+        }
+        s->sums[b] = sum;
+    }
+}
 
-        CUIK_TIMED_BLOCK_ARGS("sort", sec->name) {
-            qsort(sec->funcs, dyn_array_length(sec->funcs), sizeof(TB_FunctionOutput*), compare_functions);
-            qsort(sec->globals, dyn_array_length(sec->globals), sizeof(TB_Symbol*), compare_symbols);
+static void func_scan_place_task(void* arg, size_t start, size_t end) {
+    FuncScan* s = arg;
+    FOREACH_N(b, start, end) {
+        size_t hi = (b + 1) * s->batch;
+        if (hi > s->count) hi = s->count;
+
+        size_t offset = s->sums[b];
+        FOREACH_N(i, b * s->batch, hi) {
+            TB_FunctionOutput* out_f = s->funcs[i];
+            if (s->code_gen) {
+                size_t n = out_f->reloc_pos;
+                out_f->reloc_pos = offset;
+                offset += n;
+            } else {
+                out_f->code_pos = offset;
+                offset += out_f->code_size;
+            }
+        }
+    }
+}
+
+// returns the total
+static size_t func_scan(TB_Module* m, const ICodeGen* code_gen, DynArray(TB_FunctionOutput*) funcs) {
+    FuncScan s = { .m = m, .code_gen = code_gen, .funcs = funcs, .count = dyn_array_length(funcs) };
+    if (s.count == 0) {
+        return 0;
+    }
+
+    // small sections don't get split up, the batch is at least a couple thousand functions
+    s.batch = (s.count + FUNC_SCAN_BATCHES - 1) / FUNC_SCAN_BATCHES;
+    if (s.batch < 2048) s.batch = 2048;
+    size_t batch_count = (s.count + s.batch - 1) / s.batch;
+
+    tb_parallel_for(m, batch_count, 1, &s, func_scan_count_task);
+
+    size_t total = 0;
+    FOREACH_N(b, 0, batch_count) {
+        size_t n = s.sums[b];
+        s.sums[b] = total;
+        total += n;
+    }
+
+    tb_parallel_for(m, batch_count, 1, &s, func_scan_place_task);
+    return total;
+}
+
+ExportList tb_module_layout_sections(TB_Module* m) {
+    TB_Arena* arena = &tb_thread_info(m)->tmp_arena;
+    size_t section_count = dyn_array_length(m->sections);
+
+    TB_ThreadInfo* first = atomic_load_explicit(&m->first_info_in_module, memory_order_relaxed);
+
+    size_t info_count = 0;
+    for (TB_ThreadInfo* info = first; info; info = info->next_in_module) {
+        info_count++;
+    }
+
+    TB_ThreadInfo** infos = tb_arena_alloc(arena, info_count * sizeof(TB_ThreadInfo*));
+    UnpackedSymbols* unpacked = tb_arena_alloc(arena, info_count * sizeof(UnpackedSymbols));
+
+    size_t j = 0;
+    for (TB_ThreadInfo* info = first; info; info = info->next_in_module, j++) {
+        infos[j] = info;
+        unpacked[j].funcs = tb_arena_alloc(arena, section_count * sizeof(DynArray(TB_FunctionOutput*)));
+        unpacked[j].globals = tb_arena_alloc(arena, section_count * sizeof(DynArray(TB_Global*)));
+        unpacked[j].externals = dyn_array_create(TB_External*, 16);
+        FOREACH_N(i, 0, section_count) {
+            unpacked[j].funcs[i] = dyn_array_create(TB_FunctionOutput*, 16);
+            unpacked[j].globals[i] = dyn_array_create(TB_Global*, 16);
+        }
+    }
+
+    // unpack function data into the streams we actually care for.
+    // avoids needing to walk so many sparse data structures later on.
+    CUIK_TIMED_BLOCK("unpack & sort") {
+        UnpackCtx ctx = { m, infos, unpacked };
+        tb_parallel_for(m, info_count, 1, &ctx, unpack_symbols_task);
+    }
+
+    CUIK_TIMED_BLOCK("merge") {
+        MergeCtx ctx = { m, info_count, unpacked };
+        tb_parallel_for(m, section_count, 1, &ctx, merge_section_task);
+    }
+
+    size_t external_count = 0;
+    TB_External** externals = tb_arena_alloc(arena, m->symbol_count[TB_SYMBOL_EXTERNAL] * sizeof(TB_External*));
+    FOREACH_N(j, 0, info_count) {
+        dyn_array_for(i, unpacked[j].externals) {
+            externals[external_count++] = unpacked[j].externals[i];
         }
 
+        dyn_array_destroy(unpacked[j].externals);
+        FOREACH_N(i, 0, section_count) {
+            dyn_array_destroy(unpacked[j].funcs[i]);
+            dyn_array_destroy(unpacked[j].globals[i]);
+        }
+    }
+
+    dyn_array_for(i, m->sections) {
+        TB_ModuleSection* sec = &m->sections[i];
+
         // layout
         CUIK_TIMED_BLOCK_ARGS("layout", sec->name) {
             // place functions first
-            size_t offset = 0;
-            dyn_array_for(i, sec->funcs) {
-                sec->funcs[i]->code_pos = offset;
-                offset += sec->funcs[i]->code_size;
-            }
+            size_t offset = func_scan(m, NULL, sec->funcs);
 
             // then globals
             dyn_array_for(i, sec->globals) {
@@ -173,22 +426,28 @@ ExportList tb_module_layout_sections(TB_Module* m) {
     return (ExportList){ external_count, externals };
 }
 
-size_t tb_helper_write_section(TB_Module* m, size_t write_pos, TB_ModuleSection* section, uint8_t* output, uint32_t pos) {
-    assert(write_pos == pos);
-    uint8_t* data = &output[pos];
+typedef struct {
+    TB_ModuleSection* section;
+    uint8_t* data;
+} WriteSectionCtx;
 
-    // place functions
-    dyn_array_for(i, section->funcs) {
-        TB_FunctionOutput* out_f = section->funcs[i];
+static void write_funcs_task(void* arg, size_t start, size_t end) {
+    WriteSectionCtx* ctx = arg;
+    FOREACH_N(i, start, end) {
+        TB_FunctionOutput* out_f = ctx->section->funcs[i];
 
         if (out_f != NULL) {
-            memcpy(data + out_f->code_pos, out_f->code, out_f->code_size);
+            memcpy(ctx->data + out_f->code_pos, out_f->code, out_f->code_size);
         }
     }
+}
 
-    // place globals
-    dyn_array_for(i, section->globals) {
-        TB_Global* restrict g = section->globals[i];
+static void write_globals_task(void* arg, size_t start, size_t end) {
+    WriteSectionCtx* ctx = arg;
+    uint8_t* data = ctx->data;
+
+    FOREACH_N(i, start, end) {
+        TB_Global* restrict g = ctx->section->globals[i];
 
         memset(&data[g->pos], 0, g->size);
         FOREACH_N(k, 0, g->obj_count) {
@@ -198,6 +457,17 @@ size_t tb_helper_write_section(TB_Module* m, size_t write_pos, TB_ModuleSection*
             }
         }
     }
+}
+
+size_t tb_helper_write_section(TB_Module* m, size_t write_pos, TB_ModuleSection* section, uint8_t* output, uint32_t pos) {
+    assert(write_pos == pos);
+    WriteSectionCtx ctx = { section, &output[pos] };
+
+    // place functions
+    tb_parallel_for(m, dyn_array_length(section->funcs), 512, &ctx, write_funcs_task);
+
+    // place globals
+    tb_parallel_for(m, dyn_array_length(section->globals), 512, &ctx, write_globals_task);
 
     return write_pos + section->total_size;
 }
@@ -206,11 +476,10 @@ size_t tb__layout_relocations(TB_Module* m, DynArray(TB_ModuleSection) sections,
     // calculate relocation layout
     dyn_array_for(i, sections) {
         TB_ModuleSection* sec = &sections[i];
-        size_t reloc_count = 0;
 
-        dyn_array_for(i, sec->funcs) {
-            reloc_count += code_gen->emit_call_patches(m, sec->funcs[i]);
-        }
+        // resolves the internal calls and places each function's external relocations
+        size_t reloc_count = func_scan(m, code_gen, sec->funcs);
+        sec->func_reloc_count = reloc_count;
 
         dyn_array_for(j, sec->globals) {
             TB_Global* restrict g = sec->globals[j];
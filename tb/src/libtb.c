@@ -7,6 +7,7 @@
 #include "ir_printer.c"
 #include "exporter.c"
 #include "symbols.c"
+#include "profile.c"
 
 // JIT
 #include "jit.c"
@@ -26,6 +27,7 @@
 #include "objects/coff.c"
 #include "objects/elf64.c"
 #include "objects/macho.c"
+#include "objects/wasm_obj.c"
 
 // Linker
 #include "linker/linker.c"
@@ -2,27 +2,334 @@
 #include "linker.h"
 #include <tb_elf.h>
 
-static void elf_append_object(TB_Linker* l, TB_Slice obj_name, TB_Slice content) {
-    // implement this
+// we only make non-PIE static executables so everything has a fixed address,
+// this is the same base GNU ld uses.
+#define ELF_IMAGE_BASE 0x400000
+#define ELF_PAGE_SIZE  4096
+
+#define CSTRING(str) { sizeof(str)-1, (const uint8_t*) str }
+
+// undefined weak references fall back to this (see elf_init)
+static TB_Slice elf_weak_zero = CSTRING("__AbsoluteZero");
+
+// input sections get folded into these, kinda like the default
+// linker script in GNU ld. order matters (.data.rel.ro before .data).
+static const char* elf_output_sections[] = {
+    ".text", ".rodata", ".data.rel.ro", ".data", ".bss",
+    ".init_array", ".fini_array", ".preinit_array", ".gcc_except_table",
+};
+
+static TB_Slice elf_output_section_name(TB_Slice name) {
+    FOREACH_N(i, 0, COUNTOF(elf_output_sections)) {
+        size_t len = strlen(elf_output_sections[i]);
+        if (name.length >= len && memcmp(name.data, elf_output_sections[i], len) == 0 &&
+            (name.length == len || name.data[len] == '.')) {
+            return (TB_Slice){ len, (const uint8_t*) elf_output_sections[i] };
+        }
+    }
+
+    return name;
+}
+
+static TB_Slice elf_cstr(const TB_Slice file, size_t offset) {
+    if (offset >= file.length) {
+        return (TB_Slice){ 0 };
+    }
+
+    const char* str = (const char*) &file.data[offset];
+    return (TB_Slice){ strnlen(str, file.length - offset), (const uint8_t*) str };
+}
+
+static void elf_append_object(TB_Linker* l, TB_LinkerInputHandle obj_file, TB_Slice obj_name, TB_Slice content) {
+    const TB_Elf64_Ehdr* ehdr = (const TB_Elf64_Ehdr*) content.data;
+    if (content.length < sizeof(TB_Elf64_Ehdr) || memcmp(ehdr->ident, "\x7F" "ELF", 4) != 0) {
+        fprintf(stderr, "tblink: %.*s: not an ELF file\n", (int) obj_name.length, obj_name.data);
+        return;
+    }
+
+    if (ehdr->ident[TB_EI_CLASS] != 2 || ehdr->type != TB_ET_REL || ehdr->machine != TB_EM_X86_64) {
+        fprintf(stderr, "tblink: %.*s: expected an x86-64 ELF64 object file\n", (int) obj_name.length, obj_name.data);
+        return;
+    }
+
+    TB_LinkerThreadInfo* info = tb__get_thread_info(l);
+
+    const TB_Elf64_Shdr* shdrs = (const TB_Elf64_Shdr*) &content.data[ehdr->shoff];
+    size_t shnum = ehdr->shnum;
+    size_t shstrtab = shdrs[ehdr->shstrndx].offset;
+
+    const TB_Elf64_Sym* syms = NULL;
+    size_t sym_count = 0, strtab = 0;
+    FOREACH_N(i, 1, shnum) {
+        if (shdrs[i].type == TB_SHT_SYMTAB) {
+            syms = (const TB_Elf64_Sym*) &content.data[shdrs[i].offset];
+            sym_count = shdrs[i].size / sizeof(TB_Elf64_Sym);
+            strtab = shdrs[shdrs[i].link].offset;
+            break;
+        }
+    }
+
+    // COMDAT groups: only the earliest input to define a group gets to keep it,
+    // everyone else drops the member sections. objects get parsed in parallel so
+    // an earlier input might show up after we've already claimed the group, in
+    // that case it'll kill off our copy.
+    bool* dropped = tb_platform_heap_alloc(shnum * sizeof(bool));
+    memset(dropped, 0, shnum * sizeof(bool));
+    TB_LinkerComdatGroup** groups = tb_platform_heap_alloc(shnum * sizeof(TB_LinkerComdatGroup*));
+    memset(groups, 0, shnum * sizeof(TB_LinkerComdatGroup*));
+    FOREACH_N(i, 1, shnum) {
+        const TB_Elf64_Shdr* sh = &shdrs[i];
+        if (sh->type != TB_SHT_GROUP || syms == NULL || sh->info >= sym_count) continue;
+
+        const uint32_t* group = (const uint32_t*) &content.data[sh->offset];
+        size_t count = sh->size / sizeof(uint32_t);
+        if (count == 0 || (group[0] & TB_GRP_COMDAT) == 0) continue;
+
+        TB_Slice signature = elf_cstr(content, strtab + syms[sh->info].name);
+        NL_Slice key = { signature.length, signature.data };
+
+        mtx_lock(&l->lock);
+        TB_LinkerComdatGroup* g;
+        ptrdiff_t search = nl_map_get(l->comdat_groups, key);
+        if (search < 0) {
+            g = tb_platform_heap_alloc(sizeof(TB_LinkerComdatGroup));
+            *g = (TB_LinkerComdatGroup){ .owner = obj_file };
+            nl_map_put(l->comdat_groups, key, g);
+        } else {
+            g = l->comdat_groups[search].v;
+            if (g->owner > obj_file) {
+                // we're earlier, steal it
+                dyn_array_for(j, g->pieces) {
+                    g->pieces[j]->size = 0;
+                }
+                dyn_array_clear(g->pieces);
+                g->owner = obj_file;
+            } else {
+                g = NULL;
+            }
+        }
+        mtx_unlock(&l->lock);
+
+        FOREACH_N(j, 1, count) {
+            if (group[j] >= shnum) continue;
+
+            if (g != NULL) groups[group[j]] = g;
+            else dropped[group[j]] = true;
+        }
+    }
+
+    // every allocated section becomes a piece
+    TB_LinkerSectionPiece** pieces = tb_platform_heap_alloc(shnum * sizeof(TB_LinkerSectionPiece*));
+    memset(pieces, 0, shnum * sizeof(TB_LinkerSectionPiece*));
+    FOREACH_N(i, 1, shnum) {
+        const TB_Elf64_Shdr* sh = &shdrs[i];
+        if ((sh->flags & TB_SHF_ALLOC) == 0 || dropped[i]) continue;
+
+        switch (sh->type) {
+            case TB_SHT_PROGBITS: case TB_SHT_NOBITS:
+            case TB_SHT_INIT_ARRAY: case TB_SHT_FINI_ARRAY: case TB_SHT_PREINIT_ARRAY:
+            break;
+
+            // notes and such aren't part of the image
+            default: continue;
+        }
+
+        TB_Slice name = elf_cstr(content, shstrtab + sh->name);
+        if (sh->flags & TB_SHF_TLS) {
+            fprintf(stderr, "tblink: %.*s: thread local storage isn't supported yet (%.*s)\n", (int) obj_name.length, obj_name.data, (int) name.length, name.data);
+            continue;
+        }
+
+        uint32_t flags = TB_PF_R;
+        if (sh->flags & TB_SHF_WRITE)     flags |= TB_PF_W;
+        if (sh->flags & TB_SHF_EXECINSTR) flags |= TB_PF_X;
+
+        TB_Slice out_name = elf_output_section_name(name);
+        TB_LinkerSection* ls = tb__find_or_create_section2(l, out_name.length, out_name.data, flags);
+        if (flags & TB_PF_X) {
+            ls->generic_flags |= TB_LINKER_SECTION_CODE;
+        }
+
+        const void* raw_data = sh->type != TB_SHT_NOBITS ? &content.data[sh->offset] : NULL;
+        TB_LinkerSectionPiece* p = tb__append_piece(ls, PIECE_NORMAL, sh->size, raw_data, obj_file);
+
+        // keep the input order when the sections get sorted
+        p->order = (obj_file << 16u) | i;
+        p->align = sh->addralign;
+        pieces[i] = p;
+    }
+
+    // hand our group members over, unless someone earlier took the group
+    // while we were busy.
+    FOREACH_N(i, 1, shnum) {
+        TB_LinkerComdatGroup* g = groups[i];
+        if (g == NULL || pieces[i] == NULL) continue;
+
+        mtx_lock(&l->lock);
+        if (g->owner == obj_file) {
+            dyn_array_put(g->pieces, pieces[i]);
+        } else {
+            pieces[i]->size = 0;
+        }
+        mtx_unlock(&l->lock);
+    }
+
+    // Append all symbols
+    TB_LinkerSymbol** sym_map = tb_platform_heap_alloc(sym_count * sizeof(TB_LinkerSymbol*));
+    memset(sym_map, 0, sym_count * sizeof(TB_LinkerSymbol*));
+    CUIK_TIMED_BLOCK("apply symbols") FOREACH_N(i, 1, sym_count) {
+        const TB_Elf64_Sym* sym = &syms[i];
+        int bind = TB_ELF64_ST_BIND(sym->info);
+        int type = TB_ELF64_ST_TYPE(sym->info);
+        if (sym->shndx == TB_SHN_UNDEF || type == TB_ELF64_STT_FILE) {
+            continue;
+        }
+
+        TB_Slice name = elf_cstr(content, strtab + sym->name);
+        if (type == TB_ELF64_STT_SECTION && sym->shndx < shnum) {
+            name = elf_cstr(content, shstrtab + shdrs[sym->shndx].name);
+        } else if (type == TB_ELF64_STT_GNU_IFUNC) {
+            fprintf(stderr, "tblink: %.*s: IFUNC symbols aren't supported (%.*s)\n", (int) obj_name.length, obj_name.data, (int) name.length, name.data);
+            continue;
+        }
+
+        TB_LinkerSymbol s = {
+            .name = name,
+            .tag = TB_LINKER_SYMBOL_NORMAL,
+            .flags = bind == TB_ELF64_STB_WEAK ? TB_LINKER_SYMBOL_WEAK : 0,
+            .object_name = obj_name,
+        };
+
+        TB_LinkerSectionPiece* p = NULL;
+        if (sym->shndx == TB_SHN_ABS) {
+            s.tag = TB_LINKER_SYMBOL_ABSOLUTE;
+            s.absolute = sym->value;
+        } else if (sym->shndx == TB_SHN_COMMON) {
+            // tentative definition, every copy gets a piece but only the winner
+            // is reachable so the GC throws out the rest.
+            s.flags |= TB_LINKER_SYMBOL_TENTATIVE;
+
+            TB_LinkerSection* bss = tb__find_or_create_section(l, ".bss", TB_PF_R | TB_PF_W);
+            p = tb__append_piece(bss, PIECE_NORMAL, sym->size, NULL, obj_file);
+            p->order = (obj_file << 16u) | 0xFFFF;
+            p->align = sym->value;
+            s.normal.piece = p;
+        } else if (sym->shndx < shnum && pieces[sym->shndx] != NULL) {
+            p = pieces[sym->shndx];
+            s.normal.piece = p;
+            s.normal.secrel = sym->value;
+        } else {
+            // lives in a section we've dropped
+            continue;
+        }
+
+        TB_LinkerSymbol* lnk_s = NULL;
+        if (bind == TB_ELF64_STB_LOCAL) {
+            lnk_s = tb_platform_heap_alloc(sizeof(TB_LinkerSymbol));
+            *lnk_s = s;
+        } else {
+            bool inserted;
+            lnk_s = tb__define_symbol(l, &s, obj_file, &inserted);
+            if (!inserted) {
+                sym_map[i] = lnk_s;
+                continue;
+            }
+        }
+
+        // add to the section piece's symbol list
+        if (p != NULL) {
+            lnk_s->next = p->first_sym;
+            p->first_sym = lnk_s;
+        }
+        sym_map[i] = lnk_s;
+    }
+
+    CUIK_TIMED_BLOCK("parse relocations") FOREACH_N(i, 1, shnum) {
+        const TB_Elf64_Shdr* sh = &shdrs[i];
+        if (sh->type != TB_SHT_RELA && sh->type != TB_SHT_REL) continue;
+        if (sh->info >= shnum || pieces[sh->info] == NULL) continue;
+
+        if (sh->type == TB_SHT_REL) {
+            fprintf(stderr, "tblink: %.*s: REL relocations aren't supported on x86-64\n", (int) obj_name.length, obj_name.data);
+            continue;
+        }
+
+        TB_LinkerSectionPiece* restrict p = pieces[sh->info];
+        const TB_Elf64_Rela* relocs = (const TB_Elf64_Rela*) &content.data[sh->offset];
+        size_t reloc_count = sh->size / sizeof(TB_Elf64_Rela);
+
+        FOREACH_N(j, 0, reloc_count) {
+            uint32_t sym_i = TB_ELF64_R_SYM(relocs[j].info);
+            uint32_t type  = TB_ELF64_R_TYPE(relocs[j].info);
+            if (type == TB_ELF_X86_64_NONE) continue;
+
+            TB_LinkerRelocRel r = {
+                .src_piece = p,
+                .src_offset = relocs[j].offset,
+                .input = obj_file,
+                .addend = relocs[j].addend,
+                .type = type
+            };
+
+            if (sym_i == 0 || sym_i >= sym_count) {
+                r.name = elf_weak_zero;
+            } else {
+                const TB_Elf64_Sym* sym = &syms[sym_i];
+                r.target = sym_map[sym_i];
+                r.name = elf_cstr(content, strtab + sym->name);
+
+                // undefined weak references are allowed to stay undefined
+                if (sym->shndx == TB_SHN_UNDEF && TB_ELF64_ST_BIND(sym->info) == TB_ELF64_STB_WEAK) {
+                    r.alt = &elf_weak_zero;
+                }
+            }
+
+            dyn_array_put(info->relatives, r);
+            dyn_array_put(p->rel_refs, (TB_LinkerRelocRef){
+                    info, dyn_array_length(info->relatives) - 1
+                });
+        }
+    }
+
+    tb_platform_heap_free(sym_map);
+    tb_platform_heap_free(pieces);
+    tb_platform_heap_free(groups);
+    tb_platform_heap_free(dropped);
 }
 
 static void elf_append_library(TB_Linker* l, TB_Slice ar_name, TB_Slice ar_file) {
-    // implement this
+    tb__append_archive(l, ar_name, ar_file);
 }
 
 static void elf_append_module(TB_Linker* l, TB_Module* m) {
+    ExportList exports;
     CUIK_TIMED_BLOCK("layout section") {
-        tb_module_layout_sections(m);
+        exports = tb_module_layout_sections(m);
     }
+    tb__set_module_exports(m, exports);
 
     TB_LinkerInputHandle mod_index = tb__track_module(l, 0, m);
 
     DynArray(TB_ModuleSection) sections = m->sections;
     dyn_array_for(i, sections) {
+        if ((sections[i].flags & TB_MODULE_SECTION_TLS) && sections[i].total_size > 0) {
+            fprintf(stderr, "tblink: thread local storage isn't supported yet\n");
+            continue;
+        }
+
         uint32_t flags = TB_PF_R;
         if (sections[i].flags & TB_MODULE_SECTION_WRITE) flags |= TB_PF_W;
         if (sections[i].flags & TB_MODULE_SECTION_EXEC)  flags |= TB_PF_X;
         tb__append_module_section(l, mod_index, &sections[i], sections[i].name, flags);
+
+        if (sections[i].piece) {
+            // globals are aligned relative to the start of the module section
+            uint32_t align = 16;
+            dyn_array_for(j, sections[i].globals) {
+                if (sections[i].globals[j]->align > align) align = sections[i].globals[j]->align;
+            }
+            sections[i].piece->align = align;
+        }
     }
 
     tb__append_module_symbols(l, m);
@@ -50,78 +357,429 @@ static TB_LinkerSymbol* elf_resolve_sym(TB_Linker* l, TB_LinkerSymbol* sym, TB_S
 static void elf_init(TB_Linker* l) {
     l->entrypoint = "_start";
     l->resolve_sym = elf_resolve_sym;
+
+    tb__append_symbol(&l->symtab, &(TB_LinkerSymbol){ .name = elf_weak_zero, .tag = TB_LINKER_SYMBOL_ABSOLUTE });
+}
+
+// symbols the linker defines (unless someone else already did), their values
+// are filled in once the layout is done.
+typedef enum {
+    ELF_SYM_SECTION_START,
+    ELF_SYM_SECTION_END,
+    ELF_SYM_DATA_END,
+    ELF_SYM_IMAGE_END,
+    ELF_SYM_GOT,
+} ElfSyntheticKind;
+
+static const struct {
+    const char* name;
+    ElfSyntheticKind kind;
+    const char* section;
+} elf_synthetic_syms[] = {
+    { "__preinit_array_start", ELF_SYM_SECTION_START, ".preinit_array" },
+    { "__preinit_array_end",   ELF_SYM_SECTION_END,   ".preinit_array" },
+    { "__init_array_start",    ELF_SYM_SECTION_START, ".init_array"    },
+    { "__init_array_end",      ELF_SYM_SECTION_END,   ".init_array"    },
+    { "__fini_array_start",    ELF_SYM_SECTION_START, ".fini_array"    },
+    { "__fini_array_end",      ELF_SYM_SECTION_END,   ".fini_array"    },
+    { "etext",                 ELF_SYM_SECTION_END,   ".text"          },
+    { "_etext",                ELF_SYM_SECTION_END,   ".text"          },
+    { "__etext",               ELF_SYM_SECTION_END,   ".text"          },
+    { "__bss_start",           ELF_SYM_DATA_END                        },
+    { "edata",                 ELF_SYM_DATA_END                        },
+    { "_edata",                ELF_SYM_DATA_END                        },
+    { "end",                   ELF_SYM_IMAGE_END                       },
+    { "_end",                  ELF_SYM_IMAGE_END                       },
+    { "_GLOBAL_OFFSET_TABLE_", ELF_SYM_GOT                             },
+};
+
+static bool elf_is_got_reloc(uint32_t type) {
+    switch (type) {
+        case TB_ELF_X86_64_GOT32:
+        case TB_ELF_X86_64_GOTPCREL:
+        case TB_ELF_X86_64_GOTPCRELX:
+        case TB_ELF_X86_64_REX_GOTPCRELX:
+        return true;
+
+        default:
+        return false;
+    }
+}
+
+static uint64_t elf_symbol_address(TB_Linker* l, TB_LinkerSymbol* sym) {
+    // section addresses already include the image base
+    return sym->tag == TB_LINKER_SYMBOL_ABSOLUTE ? sym->absolute : tb__get_symbol_rva(l, sym);
+}
+
+static uint64_t elf_module_symbol_address(TB_Linker* l, TB_Module* m, const TB_Symbol* s) {
+    if (s->tag == TB_SYMBOL_EXTERNAL) {
+        uintptr_t addr = (uintptr_t) s->address;
+        assert(addr & 1);
+        return elf_symbol_address(l, (TB_LinkerSymbol*) (addr & ~1));
+    }
+
+    return tb__compute_rva(l, m, s);
+}
+
+// bss-like sections don't take up any file space
+static bool elf_is_nobits(TB_LinkerSection* s) {
+    for (TB_LinkerSectionPiece* p = s->first; p != NULL; p = p->next) {
+        if (p->kind != PIECE_NORMAL || p->data != NULL) return false;
+    }
+    return true;
+}
+
+static int elf_section_class(TB_LinkerSection* s) {
+    if (s->flags & TB_PF_X) return 0;
+    if ((s->flags & TB_PF_W) == 0) return 1;
+    return elf_is_nobits(s) ? 3 : 2;
+}
+
+static int compare_elf_sections(const void* a, const void* b) {
+    TB_LinkerSection* sec_a = *(TB_LinkerSection**) a;
+    TB_LinkerSection* sec_b = *(TB_LinkerSection**) b;
+
+    int class_a = elf_section_class(sec_a), class_b = elf_section_class(sec_b);
+    if (class_a != class_b) {
+        return class_a - class_b;
+    }
+
+    size_t len = sec_a->name.length < sec_b->name.length ? sec_a->name.length : sec_b->name.length;
+    int cmp = memcmp(sec_a->name.data, sec_b->name.data, len);
+    if (cmp != 0) return cmp;
+
+    return (sec_a->name.length > sec_b->name.length) - (sec_a->name.length < sec_b->name.length);
+}
+
+static uint32_t elf_section_type(TB_LinkerSection* s) {
+    if (elf_is_nobits(s)) return TB_SHT_NOBITS;
+
+    NL_Slice name = s->name;
+    if (name.length == 11 && memcmp(name.data, ".init_array", 11) == 0) return TB_SHT_INIT_ARRAY;
+    if (name.length == 11 && memcmp(name.data, ".fini_array", 11) == 0) return TB_SHT_FINI_ARRAY;
+    if (name.length == 14 && memcmp(name.data, ".preinit_array", 14) == 0) return TB_SHT_PREINIT_ARRAY;
+    return TB_SHT_PROGBITS;
 }
 
 #define WRITE(data, size) (memcpy(&output[write_pos], data, size), write_pos += (size))
+typedef NL_Map(TB_LinkerSymbol*, uint32_t) ElfGotMap;
+
+typedef struct {
+    uint8_t* output;
+    uint64_t got_address;
+    ElfGotMap got_slots;
+} ElfRelocTask;
+
+static void elf_apply_piece_relocs(TB_Linker* l, TB_LinkerSectionPiece* p, void* ctx) {
+    ElfRelocTask* t = ctx;
+    TB_LinkerSection* restrict s = p->parent;
+
+    dyn_array_for(i, p->rel_refs) {
+        TB_LinkerRelocRel* restrict r = &p->rel_refs[i].info->relatives[p->rel_refs[i].index];
+        if (r->target == NULL) continue;
+
+        uint8_t* dst = &t->output[s->offset + p->offset + r->src_offset];
+
+        uint64_t S = elf_symbol_address(l, r->target);
+        uint64_t P = s->address + p->offset + r->src_offset;
+        int64_t  A = r->addend;
+
+        uint64_t G = 0;
+        if (elf_is_got_reloc(r->type)) {
+            G = t->got_slots[nl_map_get(t->got_slots, r->target)].v * sizeof(uint64_t);
+        }
+
+        uint64_t v64;
+        uint32_t v32;
+        uint16_t v16;
+        switch (r->type) {
+            case TB_ELF_X86_64_64:       v64 = S + A;     memcpy(dst, &v64, 8); break;
+            case TB_ELF_X86_64_PC64:     v64 = S + A - P; memcpy(dst, &v64, 8); break;
+            case TB_ELF_X86_64_GOTOFF64: v64 = S + A - t->got_address; memcpy(dst, &v64, 8); break;
+
+            case TB_ELF_X86_64_PC32:
+            case TB_ELF_X86_64_PLT32:    v32 = S + A - P; memcpy(dst, &v32, 4); break;
+            case TB_ELF_X86_64_32:
+            case TB_ELF_X86_64_32S:      v32 = S + A;     memcpy(dst, &v32, 4); break;
+            case TB_ELF_X86_64_GOT32:    v32 = G + A;     memcpy(dst, &v32, 4); break;
+            case TB_ELF_X86_64_GOTPC32:  v32 = t->got_address + A - P; memcpy(dst, &v32, 4); break;
+
+            case TB_ELF_X86_64_GOTPCREL:
+            case TB_ELF_X86_64_GOTPCRELX:
+            case TB_ELF_X86_64_REX_GOTPCRELX:
+            v32 = t->got_address + G + A - P;
+            memcpy(dst, &v32, 4);
+            break;
+
+            case TB_ELF_X86_64_16:   v16 = S + A;     memcpy(dst, &v16, 2); break;
+            case TB_ELF_X86_64_PC16: v16 = S + A - P; memcpy(dst, &v16, 2); break;
+            case TB_ELF_X86_64_8:    *dst = S + A;     break;
+            case TB_ELF_X86_64_PC8:  *dst = S + A - P; break;
+
+            default: {
+                TB_Slice obj_name = l->inputs[r->input].name;
+                fprintf(stderr, "tblink: %.*s: unsupported relocation type %u\n", (int) obj_name.length, obj_name.data, r->type);
+                break;
+            }
+        }
+    }
+}
+
+// everything the relocations in the piece resolve to, the piece's own address can't
+// change when it's patched in place so it's left out.
+static uint64_t elf_digest_piece_relocs(TB_Linker* l, TB_LinkerSectionPiece* p, void* ctx, uint64_t h) {
+    ElfRelocTask* t = ctx;
+
+    dyn_array_for(i, p->rel_refs) {
+        TB_LinkerRelocRel* restrict r = &p->rel_refs[i].info->relatives[p->rel_refs[i].index];
+        if (r->target == NULL) continue;
+
+        uint64_t v[3] = { ((uint64_t) r->type << 32) | r->src_offset, elf_symbol_address(l, r->target) + r->addend, t->got_address };
+        if (elf_is_got_reloc(r->type)) {
+            v[2] += t->got_slots[nl_map_get(t->got_slots, r->target)].v * sizeof(uint64_t);
+        }
+        h = tb__hash_mix(h, v, sizeof(v));
+    }
+
+    return h;
+}
+
 static TB_ExportBuffer elf_export(TB_Linker* l) {
+    if (l->target_arch != TB_ARCH_X86_64) {
+        fprintf(stderr, "tblink: ELF linking is only supported for x86-64\n");
+        return (TB_ExportBuffer){ 0 };
+    }
+
+    CUIK_TIMED_BLOCK("load archive members") {
+        tb__load_archive_members(l, 0, NULL);
+    }
+
+    FOREACH_N(i, 0, COUNTOF(elf_synthetic_syms)) {
+        TB_Slice name = { strlen(elf_synthetic_syms[i].name), (const uint8_t*) elf_synthetic_syms[i].name };
+        if (tb__find_symbol(&l->symtab, name) == NULL) {
+            tb__append_symbol(&l->symtab, &(TB_LinkerSymbol){ .name = name, .tag = TB_LINKER_SYMBOL_ABSOLUTE });
+        }
+    }
+
+    // resolve the externals the TB modules are calling out to
+    dyn_array_for(i, l->inputs) {
+        if (l->inputs[i].tag != TB_LINKER_INPUT_MODULE) continue;
+
+        TB_Module* m = l->inputs[i].module;
+        FOREACH_N(j, 0, m->exports.count) {
+            TB_External* ext = m->exports.data[j];
+            TB_Slice name = { strlen(ext->super.name), (const uint8_t*) ext->super.name };
+
+            TB_LinkerSymbol* sym = tb__find_symbol(&l->symtab, name);
+            if (sym == NULL) {
+                tb__unresolved_symbol(l, name)->reloc = i;
+                continue;
+            }
+
+            ext->super.address = (void*) ((uintptr_t) sym | 1);
+        }
+    }
+
     CUIK_TIMED_BLOCK("GC sections") {
         gc_mark_root(l, l->entrypoint);
+
+        // nobody references the constructor tables directly, they're walked by the CRT
+        static const char* roots[] = { ".init_array", ".fini_array", ".preinit_array" };
+        FOREACH_N(i, 0, COUNTOF(roots)) {
+            TB_LinkerSection* s = tb__find_section(l, roots[i]);
+            if (s == NULL) continue;
+
+            s->generic_flags |= TB_LINKER_SECTION_PACKED;
+            for (TB_LinkerSectionPiece* p = s->first; p != NULL; p = p->next) {
+                gc_mark(l, p);
+            }
+        }
+
+        gc_mark_all(l);
+    }
+
+    if (l->icf) CUIK_TIMED_BLOCK("ICF") {
+        tb__icf(l);
+    }
+
+    // there's no dynamic linking so the GOT is just a table of absolute addresses
+    // which we fill in after layout. the thread infos don't come in any stable order
+    // so we only count the slots here, they're numbered once the pieces are sorted.
+    ElfGotMap got_slots = NULL;
+    DynArray(TB_LinkerSymbol*) got_syms = NULL;
+    TB_LinkerSectionPiece* got = NULL;
+    CUIK_TIMED_BLOCK("allocate GOT") {
+        bool needs_got = false;
+        size_t got_count = 0;
+        for (TB_LinkerThreadInfo* restrict info = l->first_thread_info; info; info = info->next) {
+            dyn_array_for(i, info->relatives) {
+                TB_LinkerRelocRel* restrict r = &info->relatives[i];
+                if ((r->src_piece->flags & TB_LINKER_PIECE_LIVE) == 0 || r->target == NULL) continue;
+
+                if (r->type == TB_ELF_X86_64_GOTPC32 || r->type == TB_ELF_X86_64_GOTOFF64) {
+                    needs_got = true;
+                } else if (elf_is_got_reloc(r->type)) {
+                    needs_got = true;
+
+                    TB_LinkerSymbol* sym = r->target;
+                    if (nl_map_get(got_slots, sym) < 0) {
+                        nl_map_put(got_slots, sym, UINT32_MAX);
+                        got_count++;
+                    }
+                }
+            }
+        }
+
+        if (needs_got) {
+            size_t got_size = got_count * sizeof(uint64_t);
+            if (got_size == 0) got_size = sizeof(uint64_t);
+
+            uint8_t* got_data = tb_platform_heap_alloc(got_size);
+            memset(got_data, 0, got_size);
+
+            TB_LinkerSection* got_section = tb__find_or_create_section(l, ".got", TB_PF_R | TB_PF_W);
+            got = tb__append_piece(got_section, PIECE_NORMAL, got_size, got_data, 0);
+            got->align = 8;
+            got->flags |= TB_LINKER_PIECE_LIVE;
+        }
     }
 
     if (!tb__finalize_sections(l)) {
         return (TB_ExportBuffer){ 0 };
     }
 
-    TB_Emitter strtbl = { 0 };
-    tb_out_reserve(&strtbl, 1024);
-    tb_out1b(&strtbl, 0); // null string in the table
-
+    // sort the sections into segments: code, read-only, data then bss
     size_t final_section_count = 0;
+    TB_LinkerSection** final_sections = NULL;
     nl_map_for_str(i, l->sections) {
-        if (l->sections[i].v->generic_flags & TB_LINKER_SECTION_DISCARD) continue;
-
-        // reserve space for names
-        NL_Slice name = l->sections[i].v->name;
-        l->sections[i].v->name_pos = tb_outs(&strtbl, name.length + 1, name.data);
-        tb_out1b_UNSAFE(&strtbl, 0);
+        final_section_count += (l->sections[i].v->generic_flags & TB_LINKER_SECTION_DISCARD) == 0;
+    }
 
-        // we're keeping it for export
-        final_section_count += 1;
+    final_sections = tb_platform_heap_alloc(final_section_count * sizeof(TB_LinkerSection*));
+    size_t j = 0;
+    nl_map_for_str(i, l->sections) {
+        TB_LinkerSection* s = l->sections[i].v;
+        if ((s->generic_flags & TB_LINKER_SECTION_DISCARD) == 0) {
+            final_sections[j++] = s;
+        }
+    }
+    assert(j == final_section_count);
+
+    // the map order depends on which thread made the section first
+    qsort(final_sections, final_section_count, sizeof(TB_LinkerSection*), compare_elf_sections);
+
+    // number the GOT slots in layout order
+    FOREACH_N(i, 0, final_section_count) {
+        for (TB_LinkerSectionPiece* p = final_sections[i]->first; p != NULL; p = p->next) {
+            if ((p->flags & TB_LINKER_PIECE_LIVE) == 0) continue;
+
+            dyn_array_for(k, p->rel_refs) {
+                TB_LinkerRelocRel* r = &p->rel_refs[k].info->relatives[p->rel_refs[k].index];
+                if (r->target == NULL || !elf_is_got_reloc(r->type)) continue;
+
+                ptrdiff_t search = nl_map_get(got_slots, r->target);
+                if (got_slots[search].v == UINT32_MAX) {
+                    got_slots[search].v = dyn_array_length(got_syms);
+                    dyn_array_put(got_syms, r->target);
+                }
+            }
+        }
     }
 
-    TB_Elf64_Shdr strtab = {
-        .name = tb_outstr_nul_UNSAFE(&strtbl, ".strtab"),
-        .type = TB_SHT_STRTAB,
-        .flags = 0,
-        .addralign = 1,
-        .size = strtbl.count,
-    };
+    TB_Emitter strtbl = { 0 };
+    tb_out_reserve(&strtbl, 1024);
+    tb_out1b(&strtbl, 0); // null string in the table
+    uint32_t shstrtab_name = tb_outstr_nul(&strtbl, ".shstrtab");
 
-    size_t size_of_headers = sizeof(TB_Elf64_Ehdr)
-        + (final_section_count * sizeof(TB_Elf64_Phdr))
-        + ((2+final_section_count) * sizeof(TB_Elf64_Shdr));
+    FOREACH_N(i, 0, final_section_count) {
+        NL_Slice name = final_sections[i]->name;
+        final_sections[i]->name_pos = tb_outs(&strtbl, name.length, name.data);
+        tb_out1b(&strtbl, 0);
+    }
 
-    size_t section_content_size = 0;
-    uint64_t virt_addr = size_of_headers;
-    CUIK_TIMED_BLOCK("layout sections") {
-        nl_map_for_str(i, l->sections) {
-            TB_LinkerSection* s = l->sections[i].v;
-            if (s->generic_flags & TB_LINKER_SECTION_DISCARD) continue;
+    // one PT_LOAD per section (+ PT_GNU_STACK)
+    size_t phdr_count = final_section_count + 1;
+    size_t size_of_headers = sizeof(TB_Elf64_Ehdr) + (phdr_count * sizeof(TB_Elf64_Phdr));
 
-            s->offset = size_of_headers + section_content_size;
-            section_content_size += s->total_size;
+    uint64_t file_pos = align_up(size_of_headers, ELF_PAGE_SIZE);
+    uint64_t virt_end = ELF_IMAGE_BASE + file_pos;
+    uint64_t data_end = virt_end;
+    CUIK_TIMED_BLOCK("layout sections") {
+        FOREACH_N(i, 0, final_section_count) {
+            TB_LinkerSection* s = final_sections[i];
+
+            if (elf_is_nobits(s)) {
+                s->offset  = file_pos;
+                s->address = align_up(virt_end, ELF_PAGE_SIZE);
+            } else {
+                // file offsets and addresses stay congruent mod the page size
+                s->offset  = align_up(file_pos, ELF_PAGE_SIZE);
+                s->address = ELF_IMAGE_BASE + s->offset;
+
+                file_pos = s->offset + s->total_size;
+                data_end = s->address + s->total_size;
+            }
+            virt_end = s->address + s->total_size;
+        }
+    }
 
-            s->address = virt_addr;
-            virt_addr += s->total_size;
-            // virt_addr = align_up(virt_addr + s->total_size, 4096);
+    size_t shstrtab_offset = file_pos;
+    file_pos += strtbl.count;
+
+    size_t shdr_offset = align_up(file_pos, 8);
+    size_t output_size = shdr_offset + (2 + final_section_count) * sizeof(TB_Elf64_Shdr);
+
+    // fill in the linker defined symbols
+    FOREACH_N(i, 0, COUNTOF(elf_synthetic_syms)) {
+        TB_LinkerSymbol* sym = tb__find_symbol_cstr(&l->symtab, elf_synthetic_syms[i].name);
+        if (sym->tag != TB_LINKER_SYMBOL_ABSOLUTE || sym->object_name.length != 0) continue;
+
+        uint64_t addr = 0;
+        switch (elf_synthetic_syms[i].kind) {
+            case ELF_SYM_SECTION_START:
+            case ELF_SYM_SECTION_END: {
+                TB_LinkerSection* s = tb__find_section(l, elf_synthetic_syms[i].section);
+                if (s && (s->generic_flags & TB_LINKER_SECTION_DISCARD) == 0) {
+                    addr = s->address + (elf_synthetic_syms[i].kind == ELF_SYM_SECTION_END ? s->total_size : 0);
+                }
+                break;
+            }
+            case ELF_SYM_DATA_END:  addr = data_end; break;
+            case ELF_SYM_IMAGE_END: addr = virt_end; break;
+            case ELF_SYM_GOT:       addr = got ? got->parent->address + got->offset : 0; break;
         }
+        sym->absolute = addr;
     }
 
-    strtab.offset = size_of_headers + section_content_size;
-    section_content_size += strtbl.count;
+    if (got) {
+        uint64_t* got_data = (uint64_t*) got->data;
+        dyn_array_for(i, got_syms) {
+            got_data[i] = elf_symbol_address(l, got_syms[i]);
+        }
+    }
 
-    uint16_t machine = 0;
-    switch (l->target_arch) {
-        case TB_ARCH_X86_64: machine = TB_EM_X86_64; break;
-        case TB_ARCH_AARCH64: machine = TB_EM_AARCH64; break;
-        default: tb_todo();
+    // text section crap
+    TB_LinkerSymbol* sym = tb__find_symbol_cstr(&l->symtab, l->entrypoint);
+    if (sym == NULL) {
+        fprintf(stderr, "tblink: could not find entrypoint! (%s)\n", l->entrypoint);
+        return (TB_ExportBuffer){ 0 };
     }
 
-    size_t output_size = size_of_headers + section_content_size;
-    size_t write_pos = 0;
+    uint64_t got_address = got ? got->parent->address + got->offset : 0;
+    if (l->incr) CUIK_TIMED_BLOCK("incremental digests") {
+        ElfRelocTask t = { NULL, got_address, got_slots };
+        tb__incr_digest(l, &t, elf_digest_piece_relocs);
+    }
 
-    TB_ExportChunk* chunk = tb_export_make_chunk(output_size);
-    uint8_t* restrict output = chunk->data;
+    TB_ExportBuffer buffer;
+    uint8_t* restrict output = tb__map_output(l, output_size, &buffer);
+    if (output == NULL) {
+        nl_map_free(got_slots);
+        dyn_array_destroy(got_syms);
+        tb_platform_heap_free(final_sections);
+        tb_platform_heap_free(strtbl.data);
+        return buffer;
+    }
 
     TB_Elf64_Ehdr header = {
         .ident = {
@@ -135,10 +793,10 @@ static TB_ExportBuffer elf_export(TB_Linker* l) {
             [TB_EI_OSABI]      = 0,
             [TB_EI_ABIVERSION] = 0
         },
-        .type = TB_ET_DYN, // executable
+        .type = TB_ET_EXEC, // executable
         .version = 1,
-        .machine = machine,
-        .entry = 0,
+        .machine = TB_EM_X86_64,
+        .entry = elf_symbol_address(l, sym),
 
         .flags = 0,
 
@@ -146,81 +804,107 @@ static TB_ExportBuffer elf_export(TB_Linker* l) {
 
         .phentsize = sizeof(TB_Elf64_Phdr),
         .phoff     = sizeof(TB_Elf64_Ehdr),
-        .phnum     = final_section_count,
+        .phnum     = phdr_count,
 
-        .shoff = sizeof(TB_Elf64_Ehdr) + (sizeof(TB_Elf64_Phdr) * final_section_count),
+        .shoff = shdr_offset,
         .shentsize = sizeof(TB_Elf64_Shdr),
         .shnum = final_section_count + 2,
         .shstrndx  = 1,
     };
 
-    // text section crap
-    TB_LinkerSection* text = tb__find_section(l, ".text");
-    TB_LinkerSymbol* sym = tb__find_symbol_cstr(&l->symtab, l->entrypoint);
-    if (text && sym) {
-        if (sym->tag == TB_LINKER_SYMBOL_NORMAL) {
-            header.entry = text->address + sym->normal.piece->offset + sym->normal.secrel;
-        } else if (sym->tag == TB_LINKER_SYMBOL_TB) {
-            header.entry = text->address + sym->tb.piece->offset + tb__get_symbol_pos(sym->tb.sym);
-        } else {
-            tb_todo();
-        }
-    } else {
-        fprintf(stderr, "tblink: could not find entrypoint!\n");
-    }
+    size_t write_pos = 0;
     WRITE(&header, sizeof(header));
 
     // write program headers
-    nl_map_for_str(i, l->sections) {
-        TB_LinkerSection* s = l->sections[i].v;
+    FOREACH_N(i, 0, final_section_count) {
+        TB_LinkerSection* s = final_sections[i];
+        bool nobits = elf_is_nobits(s);
+
         TB_Elf64_Phdr sec = {
             .type   = TB_PT_LOAD,
             .flags  = s->flags,
-            .offset = s->offset,
+            .offset = nobits ? 0 : s->offset,
             .vaddr  = s->address,
-            .filesz = s->total_size,
+            .paddr  = s->address,
+            .filesz = nobits ? 0 : s->total_size,
             .memsz  = s->total_size,
-            .align  = 1,
+            .align  = ELF_PAGE_SIZE,
         };
         WRITE(&sec, sizeof(sec));
     }
 
+    TB_Elf64_Phdr stack = { .type = TB_PT_GNU_STACK, .flags = TB_PF_R | TB_PF_W, .align = 16 };
+    WRITE(&stack, sizeof(stack));
+
+    // write section contents
+    CUIK_TIMED_BLOCK("write sections") {
+        tb__write_pieces(l, output, 0);
+    }
+
+    memcpy(&output[shstrtab_offset], strtbl.data, strtbl.count);
+
     // write section headers
+    write_pos = shdr_offset;
     memset(&output[write_pos], 0, sizeof(TB_Elf64_Shdr)), write_pos += sizeof(TB_Elf64_Shdr);
+
+    TB_Elf64_Shdr strtab = {
+        .name = shstrtab_name,
+        .type = TB_SHT_STRTAB,
+        .flags = 0,
+        .addralign = 1,
+        .size = strtbl.count,
+        .offset = shstrtab_offset,
+    };
     WRITE(&strtab, sizeof(strtab));
-    nl_map_for_str(i, l->sections) {
-        TB_LinkerSection* s = l->sections[i].v;
+
+    FOREACH_N(i, 0, final_section_count) {
+        TB_LinkerSection* s = final_sections[i];
         TB_Elf64_Shdr sec = {
             .name = s->name_pos,
-            .type = TB_SHT_PROGBITS,
+            .type = elf_section_type(s),
             .flags = TB_SHF_ALLOC | ((s->flags & TB_PF_X) ? TB_SHF_EXECINSTR : 0) | ((s->flags & TB_PF_W) ? TB_SHF_WRITE : 0),
-            .addralign = 1,
+            .addralign = ELF_PAGE_SIZE,
             .size = s->total_size,
             .addr = s->address,
             .offset = s->offset,
         };
         WRITE(&sec, sizeof(sec));
     }
-
-    TB_LinkerSection* data  = tb__find_section(l, ".data");
-    TB_LinkerSection* rdata = tb__find_section(l, ".rdata");
-
-    // write section contents
-    write_pos = tb__apply_section_contents(l, output, write_pos, text, data, rdata, 1, 0);
-    WRITE(strtbl.data, strtbl.count);
     assert(write_pos == output_size);
 
-    // TODO(NeGate): multithread this too
     CUIK_TIMED_BLOCK("apply final relocations") {
         dyn_array_for(i, l->ir_modules) {
-            tb__apply_module_relocs(l, l->ir_modules[i], output);
+            TB_Module* m = l->ir_modules[i];
+            tb__apply_module_relocs(l, m, output);
+
+            // pointers in the module's data
+            dyn_array_for(j, m->sections) {
+                TB_LinkerSectionPiece* piece = m->sections[j].piece;
+                if (piece == NULL) continue;
+
+                size_t file_pos = piece->parent->offset + piece->offset;
+                dyn_array_for(k, m->sections[j].globals) {
+                    TB_Global* g = m->sections[j].globals[k];
+                    FOREACH_N(o, 0, g->obj_count) {
+                        if (g->objects[o].type != TB_INIT_OBJ_RELOC) continue;
+
+                        uint64_t addr = elf_module_symbol_address(l, m, g->objects[o].reloc);
+                        memcpy(&output[file_pos + g->pos + g->objects[o].offset], &addr, sizeof(uint64_t));
+                    }
+                }
+            }
         }
 
-        // tb__apply_external_relocs(l, output, opt_header.image_base);
+        ElfRelocTask t = { output, got_address, got_slots };
+        tb__for_each_reloc_piece(l, &t, elf_apply_piece_relocs);
     }
 
-    // write section contents
-    return (TB_ExportBuffer){ .total = output_size, .head = chunk, .tail = chunk };
+    nl_map_free(got_slots);
+    dyn_array_destroy(got_syms);
+    tb_platform_heap_free(final_sections);
+    tb_platform_heap_free(strtbl.data);
+
+    return buffer;
 }
 
 TB_LinkerVtbl tb__linker_elf = {
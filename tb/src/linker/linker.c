@@ -1,10 +1,12 @@
 #include "linker.h"
+#include "../objects/lib_parse.h"
 
 #if __STDC_VERSION__ < 201112L || defined(__STDC_NO_ATOMICS__)
 #error "Missing C11 support for stdatomic.h"
 #endif
 
 #include <stdatomic.h>
+#include <sys/stat.h>
 
 extern TB_LinkerVtbl tb__linker_pe, tb__linker_elf;
 
@@ -20,6 +22,7 @@ TB_API TB_Linker* tb_linker_create(TB_ExecutableType exe, TB_Arch arch) {
     TB_Linker* l = tb_platform_heap_alloc(sizeof(TB_Linker));
     memset(l, 0, sizeof(TB_Linker));
     l->target_arch = arch;
+    mtx_init(&l->lock, mtx_plain);
     l->messages = tb_platform_heap_alloc((1u << QEXP) * sizeof(TB_LinkerMsg));
 
     l->symtab.exp = 24;
@@ -98,8 +101,37 @@ TB_API void tb_linker_set_entrypoint(TB_Linker* l, const char* name) {
     l->entrypoint = name;
 }
 
+TB_API void tb_linker_set_thread_pool(TB_Linker* l, TB_ThreadPool* tp) {
+    l->thread_pool = tp;
+}
+
+TB_API void tb_linker_set_icf(TB_Linker* l, bool enabled) {
+    l->icf = enabled;
+}
+
+TB_API void tb_linker_set_print_gc_sections(TB_Linker* l, bool enabled) {
+    l->print_gc = enabled;
+}
+
+TB_API void tb_linker_set_incremental(TB_Linker* l, bool enabled) {
+    // only the ELF export knows how to patch its old output
+    l->incremental = enabled && l->vtbl.export == tb__linker_elf.export;
+}
+
+TB_API bool tb_linker_get_incremental_stats(TB_Linker* l, size_t* out_patched, size_t* out_total) {
+    TB_LinkerIncremental* incr = l->incr;
+    *out_patched = incr ? incr->patched : 0;
+    *out_total   = incr ? incr->total : 0;
+    return incr && incr->relink;
+}
+
+TB_API void tb_linker_get_icf_stats(TB_Linker* l, size_t* out_folded, size_t* out_bytes) {
+    *out_folded = l->icf_folded;
+    *out_bytes  = l->icf_bytes_saved;
+}
+
 TB_API void tb_linker_append_object(TB_Linker* l, TB_Slice obj_name, TB_Slice content) {
-    l->vtbl.append_object(l, obj_name, content);
+    tb__append_object(l, 0, obj_name, content);
 }
 
 TB_API void tb_linker_append_module(TB_Linker* l, TB_Module* m) {
@@ -111,10 +143,89 @@ TB_API void tb_linker_append_library(TB_Linker* l, TB_Slice ar_name, TB_Slice ar
 }
 
 TB_API TB_ExportBuffer tb_linker_export(TB_Linker* l) {
+    tb__wait_for_objects(l);
     return l->vtbl.export(l);
 }
 
+TB_API bool tb_linker_export_to_file(TB_Linker* l, const char* path) {
+    tb__wait_for_objects(l);
+
+    if (l->incremental) {
+        tb__incr_begin(l, path);
+    }
+
+    l->output_path = path;
+    TB_ExportBuffer buffer = l->vtbl.export(l);
+    l->output_path = NULL;
+
+    if (l->output_map.data != NULL) {
+        close_file_map(&l->output_map);
+        l->output_map = (FileMap){ 0 };
+    }
+
+    if (l->incr) {
+        tb__incr_end(l, path, buffer.total != 0);
+    }
+
+    if (buffer.total == 0) {
+        fprintf(stderr, "\x1b[31merror\x1b[0m: could not export '%s'\n", path);
+        return false;
+    }
+
+    return true;
+}
+
+uint8_t* tb__map_output(TB_Linker* l, size_t size, TB_ExportBuffer* out) {
+    if (l->output_path == NULL) {
+        TB_ExportChunk* chunk = tb_export_make_chunk(size);
+        memset(chunk->data, 0, size);
+
+        *out = (TB_ExportBuffer){ .total = size, .head = chunk, .tail = chunk };
+        return chunk->data;
+    }
+
+    // patching an incremental link, only the dirty pieces get written
+    if (l->incr && l->incr->relink) {
+        if (tb__incr_same_file_layout(l, size)) {
+            l->output_map = open_file_map_rw(l->output_path);
+            if (l->output_map.data != NULL && l->output_map.size == size) {
+                *out = (TB_ExportBuffer){ .total = size };
+                return l->output_map.data;
+            }
+
+            if (l->output_map.data != NULL) {
+                close_file_map(&l->output_map);
+            }
+            l->output_map = (FileMap){ 0 };
+        }
+
+        log_debug("incremental: can't patch %s in place, writing all of it", l->output_path);
+        l->incr->relink = false;
+    }
+
+    // the sections get copied straight into the file's pages, there's no
+    // buffer to write out afterwards.
+    l->output_map = create_file_map(l->output_path, size);
+    if (l->output_map.data == NULL) {
+        fprintf(stderr, "\x1b[31merror\x1b[0m: could not open file for writing! %s\n", l->output_path);
+        *out = (TB_ExportBuffer){ 0 };
+        return NULL;
+    }
+
+    *out = (TB_ExportBuffer){ .total = size };
+    return l->output_map.data;
+}
+
 TB_API void tb_linker_destroy(TB_Linker* l) {
+    dyn_array_for(i, l->archives) {
+        tb_archive_free(&l->archives[i].parser);
+        tb_platform_heap_free(l->archives[i].loaded);
+    }
+    dyn_array_destroy(l->archives);
+    nl_map_free(l->lazy_symbols);
+
+    nl_map_free(l->import_tables);
+    tb_arena_destroy(&l->import_names);
     tb_platform_heap_free(l);
 }
 
@@ -199,34 +310,32 @@ void tb__merge_sections(TB_Linker* linker, TB_LinkerSection* from, TB_LinkerSect
     // remove 'from' from final output
     from->generic_flags |= TB_LINKER_SECTION_DISCARD;
 
-    if (to->last) to->last->next = from->first;
-    else to->first = from->first;
-    to->last = from->last;
-
-    #if 1
-    // we don't care about fixing up the offsets because they'll be properly laid out
-    // after this is all done
-    to->total_size += from->total_size;
-    to->piece_count += from->piece_count;
-
-    for (TB_LinkerSectionPiece* p = from->first; p != NULL; p = p->next) {
-        p->parent = to;
-    }
-    #else
+    // the offsets get properly laid out after this is all done but they're
+    // also the tie-break when sorting (see compare_linker_sections) so they
+    // have to follow the new order.
     if (from->last) {
-        size_t offset = to->total_size;
+        if (to->last) to->last->next = from->first;
+        else to->first = from->first;
+        to->last = from->last;
 
+        size_t offset = to->total_size;
         for (TB_LinkerSectionPiece* p = from->first; p != NULL; p = p->next) {
             p->parent = to;
             p->offset = offset;
             offset += p->size;
         }
 
-        to->total_size += from->total_size;
+        // dropped COMDAT pieces don't count anymore
+        to->total_size = offset;
         to->piece_count += from->piece_count;
-        assert(offset == to->total_size);
     }
-    #endif
+}
+
+void tb__set_module_exports(TB_Module* m, ExportList exports) {
+    // the layout's copy lives in a temporary arena, we hold onto the externals
+    // so the archive loader and GC know what the module wants.
+    m->exports = (ExportList){ exports.count, tb_platform_heap_alloc(exports.count * sizeof(TB_External*)) };
+    memcpy(m->exports.data, exports.data, exports.count * sizeof(TB_External*));
 }
 
 void tb__append_module_section(TB_Linker* l, TB_LinkerInputHandle mod, TB_ModuleSection* section, const char* name, uint32_t flags) {
@@ -236,106 +345,157 @@ void tb__append_module_section(TB_Linker* l, TB_LinkerInputHandle mod, TB_Module
     }
 }
 
-size_t tb__apply_section_contents(TB_Linker* l, uint8_t* output, size_t write_pos, TB_LinkerSection* text, TB_LinkerSection* data, TB_LinkerSection* rdata, size_t section_alignment, size_t image_base) {
-    // write section contents
-    // TODO(NeGate): we can actually parallelize this part of linking
-    CUIK_TIMED_BLOCK("write sections") nl_map_for_str(i, l->sections) {
-        TB_LinkerSection* s = l->sections[i].v;
-        if (s->generic_flags & TB_LINKER_SECTION_DISCARD) continue;
-
-        assert(s->offset == write_pos);
-        for (TB_LinkerSectionPiece* p = s->first; p != NULL; p = p->next) {
-            uint8_t* p_out = &output[write_pos];
-            TB_LinkerInput in = l->inputs[p->input];
+static void tb__write_piece(TB_Linker* l, TB_LinkerSectionPiece* p, uint8_t* output, size_t image_base) {
+    uint8_t* p_out = &output[p->parent->offset + p->offset];
+    TB_LinkerInput in = l->inputs[p->input];
 
-            switch (p->kind) {
-                case PIECE_NORMAL: {
-                    if (p->data == NULL) goto skip;
+    switch (p->kind) {
+        case PIECE_NORMAL: {
+            if (p->data == NULL) break;
 
-                    memcpy(p_out, p->data, p->size);
-                    break;
-                }
-                case PIECE_MODULE_SECTION: {
-                    tb_helper_write_section(in.module, 0, (TB_ModuleSection*) p->data, p_out, 0);
-                    break;
-                }
-                case PIECE_PDATA: {
-                    uint32_t* p_out32 = (uint32_t*) p_out;
-                    TB_Module* m = in.module;
-
-                    uint32_t rdata_rva = m->xdata->parent->address + m->xdata->offset;
-
-                    dyn_array_for(i, m->sections) {
-                        DynArray(TB_FunctionOutput*) funcs = m->sections[i].funcs;
-                        TB_LinkerSectionPiece* piece = m->sections[i].piece;
-                        uint32_t rva = piece->parent->address + piece->offset;
-
-                        dyn_array_for(j, funcs) {
-                            TB_FunctionOutput* out_f = funcs[j];
-                            if (out_f != NULL) {
-                                // both into the text section
-                                *p_out32++ = rva + out_f->code_pos;
-                                *p_out32++ = rva + out_f->code_pos + out_f->code_size;
-
-                                // refers to rdata section
-                                *p_out32++ = rdata_rva + out_f->unwind_info;
-                            }
-                        }
+            memcpy(p_out, p->data, p->size);
+            break;
+        }
+        case PIECE_MODULE_SECTION: {
+            tb_helper_write_section(in.module, 0, (TB_ModuleSection*) p->data, p_out, 0);
+            break;
+        }
+        case PIECE_PDATA: {
+            uint32_t* p_out32 = (uint32_t*) p_out;
+            TB_Module* m = in.module;
+
+            uint32_t rdata_rva = m->xdata->parent->address + m->xdata->offset;
+
+            dyn_array_for(i, m->sections) {
+                DynArray(TB_FunctionOutput*) funcs = m->sections[i].funcs;
+                TB_LinkerSectionPiece* piece = m->sections[i].piece;
+                uint32_t rva = piece->parent->address + piece->offset;
+
+                dyn_array_for(j, funcs) {
+                    TB_FunctionOutput* out_f = funcs[j];
+                    if (out_f != NULL) {
+                        // both into the text section
+                        *p_out32++ = rva + out_f->code_pos;
+                        *p_out32++ = rva + out_f->code_pos + out_f->code_size;
+
+                        // refers to rdata section
+                        *p_out32++ = rdata_rva + out_f->unwind_info;
                     }
-                    break;
                 }
-                case PIECE_RELOC: {
-                    TB_Module* m = in.module;
-
-                    dyn_array_for(i, m->sections) {
-                        DynArray(TB_Global*) globals = m->sections[i].globals;
-                        TB_LinkerSectionPiece* piece = m->sections[i].piece;
-
-                        uint32_t data_rva = piece->parent->address + piece->offset;
-                        uint32_t data_file = piece->parent->offset + piece->offset;
-
-                        uint32_t last_page = 0xFFFFFFFF;
-                        uint32_t* last_block = NULL;
-
-                        dyn_array_for(j, globals) {
-                            TB_Global* g = globals[j];
-                            FOREACH_N(k, 0, g->obj_count) {
-                                size_t actual_pos  = g->pos + g->objects[k].offset;
-                                size_t actual_page = actual_pos & ~4095;
-                                size_t page_offset = actual_pos - actual_page;
-
-                                if (g->objects[k].type != TB_INIT_OBJ_RELOC) {
-                                    continue;
-                                }
-
-                                const TB_Symbol* s = g->objects[k].reloc;
-                                if (last_page != actual_page) {
-                                    last_page  = data_rva + actual_page;
-                                    last_block = (uint32_t*) p_out;
-
-                                    last_block[0] = data_rva + actual_page;
-                                    last_block[1] = 8; // block size field (includes RVA field and itself)
-                                    p_out += 8;
-                                }
-
-                                // compute RVA
-                                uint32_t file_pos = data_file + actual_pos;
-                                *((uint64_t*) &output[file_pos]) = tb__compute_rva(l, m, s) + image_base;
-
-                                // emit relocation
-                                uint16_t payload = (10 << 12) | page_offset; // (IMAGE_REL_BASED_DIR64 << 12) | offset
-                                *((uint16_t*) p_out) = payload, p_out += sizeof(uint16_t);
-                                last_block[1] += 2;
-                            }
+            }
+            break;
+        }
+        case PIECE_RELOC: {
+            TB_Module* m = in.module;
+
+            dyn_array_for(i, m->sections) {
+                DynArray(TB_Global*) globals = m->sections[i].globals;
+                TB_LinkerSectionPiece* piece = m->sections[i].piece;
+
+                uint32_t data_rva = piece->parent->address + piece->offset;
+                uint32_t data_file = piece->parent->offset + piece->offset;
+
+                uint32_t last_page = 0xFFFFFFFF;
+                uint32_t* last_block = NULL;
+
+                dyn_array_for(j, globals) {
+                    TB_Global* g = globals[j];
+                    FOREACH_N(k, 0, g->obj_count) {
+                        size_t actual_pos  = g->pos + g->objects[k].offset;
+                        size_t actual_page = actual_pos & ~4095;
+                        size_t page_offset = actual_pos - actual_page;
+
+                        if (g->objects[k].type != TB_INIT_OBJ_RELOC) {
+                            continue;
+                        }
+
+                        const TB_Symbol* s = g->objects[k].reloc;
+                        if (last_page != actual_page) {
+                            last_page  = data_rva + actual_page;
+                            last_block = (uint32_t*) p_out;
+
+                            last_block[0] = data_rva + actual_page;
+                            last_block[1] = 8; // block size field (includes RVA field and itself)
+                            p_out += 8;
                         }
+
+                        // compute RVA
+                        uint32_t file_pos = data_file + actual_pos;
+                        *((uint64_t*) &output[file_pos]) = tb__compute_rva(l, m, s) + image_base;
+
+                        // emit relocation
+                        uint16_t payload = (10 << 12) | page_offset; // (IMAGE_REL_BASED_DIR64 << 12) | offset
+                        *((uint16_t*) p_out) = payload, p_out += sizeof(uint16_t);
+                        last_block[1] += 2;
                     }
-                    break;
                 }
-                default: tb_todo();
             }
+            break;
+        }
+        default: tb_todo();
+    }
+}
+
+typedef struct {
+    TB_Linker* l;
+    uint8_t* output;
+    size_t image_base;
+    TB_LinkerSectionPiece** pieces;
+} WritePiecesTask;
+
+static void write_pieces_task(void* ctx, size_t start, size_t end) {
+    WritePiecesTask* t = ctx;
+    FOREACH_N(i, start, end) {
+        tb__write_piece(t->l, t->pieces[i], t->output, t->image_base);
+    }
+}
+
+void tb__write_pieces(TB_Linker* l, uint8_t* output, size_t image_base) {
+    // the .reloc pieces patch pointers in the data pieces so they
+    // have to go after those are copied.
+    DynArray(TB_LinkerSectionPiece*) pieces = NULL;
+    DynArray(TB_LinkerSectionPiece*) late = NULL;
+    nl_map_for_str(i, l->sections) {
+        TB_LinkerSection* s = l->sections[i].v;
+        if (s->generic_flags & TB_LINKER_SECTION_DISCARD) continue;
+
+        for (TB_LinkerSectionPiece* p = s->first; p != NULL; p = p->next) {
+            if (!tb__piece_needs_write(l, p)) {
+                continue;
+            } else if (p->kind == PIECE_RELOC) {
+                dyn_array_put(late, p);
+            } else if (p->kind != PIECE_NORMAL || p->data != NULL) {
+                dyn_array_put(pieces, p);
+            }
+        }
+    }
+
+    WritePiecesTask t = { l, output, image_base, pieces };
+    tb_parallel_for_pool(l->thread_pool, dyn_array_length(pieces), 16, &t, write_pieces_task);
+
+    dyn_array_for(i, late) {
+        tb__write_piece(l, late[i], output, image_base);
+    }
+
+    dyn_array_destroy(pieces);
+    dyn_array_destroy(late);
+}
+
+size_t tb__apply_section_contents(TB_Linker* l, uint8_t* output, size_t write_pos, TB_LinkerSection* text, TB_LinkerSection* data, TB_LinkerSection* rdata, size_t section_alignment, size_t image_base) {
+    CUIK_TIMED_BLOCK("write sections") {
+        tb__write_pieces(l, output, image_base);
+    }
+
+    // the file space doesn't include the uninitialized pieces
+    nl_map_for_str(i, l->sections) {
+        TB_LinkerSection* s = l->sections[i].v;
+        if (s->generic_flags & TB_LINKER_SECTION_DISCARD) continue;
 
-            write_pos += p->size;
-            skip:;
+        assert(s->offset == write_pos);
+        for (TB_LinkerSectionPiece* p = s->first; p != NULL; p = p->next) {
+            if (p->kind != PIECE_NORMAL || p->data != NULL) {
+                write_pos += p->size;
+            }
         }
 
         write_pos = tb__pad_file(output, write_pos, 0x00, section_alignment);
@@ -350,48 +510,44 @@ TB_LinkerSection* tb__find_section(TB_Linker* linker, const char* name) {
 }
 
 TB_LinkerSection* tb__find_or_create_section(TB_Linker* linker, const char* name, uint32_t flags) {
-    // allocate new section if one doesn't exist already
-    ptrdiff_t search = nl_map_get_cstr(linker->sections, name);
-    if (search >= 0) {
-        // assert(linker->sections[search]->flags == flags);
-        return linker->sections[search].v;
-    }
-
-    TB_LinkerSection* s = tb_platform_heap_alloc(sizeof(TB_LinkerSection));
-    *s = (TB_LinkerSection){ .name = { strlen(name), (const uint8_t*) name }, .flags = flags };
-    nl_map_put_cstr(linker->sections, name, s);
-    return s;
+    return tb__find_or_create_section2(linker, strlen(name), (const uint8_t*) name, flags);
 }
 
 TB_LinkerSection* tb__find_or_create_section2(TB_Linker* linker, size_t name_len, const uint8_t* name_str, uint32_t flags) {
     // allocate new section if one doesn't exist already
     NL_Slice name = { name_len, name_str };
-    ptrdiff_t search = nl_map_get(linker->sections, name);
 
+    mtx_lock(&linker->lock);
+    ptrdiff_t search = nl_map_get(linker->sections, name);
     if (search >= 0) {
         // assert(linker->sections[search]->flags == flags);
-        return linker->sections[search].v;
+        TB_LinkerSection* s = linker->sections[search].v;
+        mtx_unlock(&linker->lock);
+        return s;
     }
 
     TB_LinkerSection* s = tb_platform_heap_alloc(sizeof(TB_LinkerSection));
     *s = (TB_LinkerSection){ .name = name, .flags = flags };
+    mtx_init(&s->lock, mtx_plain);
 
     nl_map_put(linker->sections, name, s);
+    mtx_unlock(&linker->lock);
     return s;
 }
 
 TB_LinkerSectionPiece* tb__append_piece(TB_LinkerSection* section, int kind, size_t size, const void* data, TB_LinkerInputHandle input) {
-    // allocate some space for it, we might wanna make the total_size increment atomic
     TB_LinkerSectionPiece* piece = tb_platform_heap_alloc(sizeof(TB_LinkerSectionPiece));
     *piece = (TB_LinkerSectionPiece){
         .kind   = kind,
         .parent = section,
-        .offset = section->total_size,
         .size   = size,
         .vsize  = size,
         .data   = data,
         .input  = input
     };
+
+    mtx_lock(&section->lock);
+    piece->offset = section->total_size;
     section->total_size += size;
     section->piece_count += 1;
 
@@ -401,31 +557,299 @@ TB_LinkerSectionPiece* tb__append_piece(TB_LinkerSection* section, int kind, siz
         section->last->next = piece;
         section->last = piece;
     }
+    mtx_unlock(&section->lock);
     return piece;
 }
 
-TB_LinkerInputHandle tb__track_module(TB_Linker* l, TB_LinkerInputHandle parent, TB_Module* mod) {
-    log_debug("%p: track module %p", l, mod);
-    TB_LinkerInput entry = { TB_LINKER_INPUT_MODULE, parent, .module = mod };
-
+static TB_LinkerInputHandle tb__track_input(TB_Linker* l, const TB_LinkerInput* entry) {
+    mtx_lock(&l->lock);
     size_t i = dyn_array_length(l->inputs);
     assert(i < 0xFFFF);
 
-    dyn_array_put(l->inputs, entry);
+    dyn_array_put(l->inputs, *entry);
+    mtx_unlock(&l->lock);
     return i;
 }
 
+TB_LinkerInputHandle tb__track_module(TB_Linker* l, TB_LinkerInputHandle parent, TB_Module* mod) {
+    log_debug("%p: track module %p", l, mod);
+    TB_LinkerInput entry = { TB_LINKER_INPUT_MODULE, parent, .module = mod };
+
+    return tb__track_input(l, &entry);
+}
+
 TB_LinkerInputHandle tb__track_object(TB_Linker* l, TB_LinkerInputHandle parent, TB_Slice name) {
     log_debug("%p: track object %.*s", l, (int) name.length, name.data);
     TB_LinkerInput entry = { TB_LINKER_INPUT_OBJECT, parent, .name = name };
+    return tb__track_input(l, &entry);
+}
 
-    size_t i = dyn_array_length(l->inputs);
-    assert(i < 0xFFFF);
+TB_LinkerInputHandle tb__track_archive(TB_Linker* l, TB_Slice name) {
+    log_debug("%p: track archive %.*s", l, (int) name.length, name.data);
+    TB_LinkerInput entry = { TB_LINKER_INPUT_ARCHIVE, 0, .name = name };
+    return tb__track_input(l, &entry);
+}
 
-    dyn_array_put(l->inputs, entry);
-    return i;
+static _Thread_local TB_LinkerThreadInfo* tb__linker_thread_info;
+
+TB_LinkerThreadInfo* tb__get_thread_info(TB_Linker* l) {
+    // each thread keeps a chain of infos (one per linker), each linker keeps
+    // a list of all the infos it's been given.
+    TB_LinkerThreadInfo* info = tb__linker_thread_info;
+    TB_LinkerThreadInfo* last = NULL;
+    for (; info; info = info->next_in_thread) {
+        if (info->parent == l) return info;
+        last = info;
+    }
+
+    // we didn't find a match, make a new element in the chain
+    TB_LinkerThreadInfo* new_t = tb_platform_heap_alloc(sizeof(TB_LinkerThreadInfo));
+    *new_t = (TB_LinkerThreadInfo){ .parent = l };
+
+    mtx_lock(&l->lock);
+    new_t->next = l->first_thread_info;
+    l->first_thread_info = new_t;
+    mtx_unlock(&l->lock);
+
+    if (last) {
+        last->next_in_thread = new_t;
+    } else {
+        tb__linker_thread_info = new_t;
+    }
+    return new_t;
+}
+
+typedef struct {
+    TB_Linker* l;
+    TB_Slice obj_name, content;
+    TB_LinkerInputHandle obj_file;
+} ObjectJob;
+
+static void tb__object_job(void* arg) {
+    ObjectJob job = *(ObjectJob*) arg;
+    CUIK_TIMED_BLOCK("append object file") {
+        job.l->vtbl.append_object(job.l, job.obj_file, job.obj_name, job.content);
+    }
+    futex_dec(&job.l->jobs);
+}
+
+void tb__append_object(TB_Linker* l, TB_LinkerInputHandle parent, TB_Slice obj_name, TB_Slice content) {
+    // the handle is picked here and not on the worker so the input order (and
+    // everything which sorts by it) doesn't depend on the scheduling.
+    ObjectJob job = { l, obj_name, content, tb__track_object(l, parent, obj_name) };
+    if (l->thread_pool == NULL) {
+        CUIK_TIMED_BLOCK("append object file") {
+            l->vtbl.append_object(l, job.obj_file, obj_name, content);
+        }
+        return;
+    }
+
+    atomic_fetch_add(&l->jobs, 1);
+    l->thread_pool->submit(l->thread_pool, tb__object_job, sizeof(job), &job);
+}
+
+void tb__wait_for_objects(TB_Linker* l) {
+    if (l->thread_pool != NULL) {
+        futex_wait_eq(&l->jobs, 0);
+    }
+}
+
+////////////////////////////////
+// Static libraries
+////////////////////////////////
+static void tb__append_archive_member(TB_Linker* l, TB_LinkerInputHandle ar_input, TB_ArchiveEntry* e) {
+    if (e->import_name.length) {
+        if (l->vtbl.append_import) {
+            l->vtbl.append_import(l, ar_input, e);
+        }
+    } else {
+        tb__append_object(l, ar_input, e->name, e->content);
+    }
+}
+
+void tb__append_archive(TB_Linker* l, TB_Slice ar_name, TB_Slice ar_file) {
+    log_debug("linking against %.*s", (int) ar_name.length, ar_name.data);
+
+    TB_ArchiveFileParser ar_parser = { 0 };
+    if (!tb_archive_parse(ar_file, &ar_parser)) {
+        return;
+    }
+
+    TB_LinkerInputHandle ar_input = tb__track_archive(l, ar_name);
+    if (ar_parser.symbol_names.length == 0) {
+        // no symbol index, we can't be lazy about it
+        TB_ArchiveEntry* restrict entries = tb_platform_heap_alloc(ar_parser.member_count * sizeof(TB_ArchiveEntry));
+        size_t new_count;
+        CUIK_TIMED_BLOCK("parse_entries") {
+            new_count = tb_archive_parse_entries(&ar_parser, 0, ar_parser.member_count, entries);
+        }
+
+        FOREACH_N(i, 0, new_count) {
+            tb__append_archive_member(l, ar_input, &entries[i]);
+        }
+
+        tb_platform_heap_free(entries);
+        tb_archive_free(&ar_parser);
+        return;
+    }
+
+    // members only get appended once an unresolved symbol asks for them (see tb__load_lazy_symbol)
+    uint32_t ar_index = dyn_array_length(l->archives);
+    TB_LinkerArchive ar = {
+        .input = ar_input,
+        .parser = ar_parser,
+        .loaded = tb_platform_heap_alloc(((ar_parser.member_count + 63) / 64) * sizeof(uint64_t)),
+    };
+    memset(ar.loaded, 0, ((ar_parser.member_count + 63) / 64) * sizeof(uint64_t));
+    dyn_array_put(l->archives, ar);
+
+    CUIK_TIMED_BLOCK("index symbols") {
+        const uint8_t* names = ar_parser.symbol_names.data;
+        const uint8_t* names_end = names + ar_parser.symbol_names.length;
+
+        FOREACH_N(i, 0, ar_parser.symbol_count) {
+            const uint8_t* end = memchr(names, 0, names_end - names);
+            if (end == NULL) break;
+
+            uint32_t member = tb_archive_symbol_member(&ar_parser, i);
+
+            NL_Slice name = { end - names, names };
+            if (member > 0 && member <= ar_parser.member_count && nl_map_get(l->lazy_symbols, name) < 0) {
+                nl_map_put(l->lazy_symbols, name, ((TB_LinkerLazySymbol){ ar_index, member - 1 }));
+            }
+
+            names = end + 1;
+        }
+    }
+}
+
+// marks the archive member which defines the name (if there is one and it's
+// not already in) to be loaded, returns true if anything new was queued.
+static bool tb__load_lazy_symbol(TB_Linker* l, TB_Slice name, DynArray(TB_LinkerLazySymbol)* pending) {
+    NL_Slice key = { name.length, name.data };
+    ptrdiff_t search = nl_map_get(l->lazy_symbols, key);
+    if (search < 0) {
+        return false;
+    }
+
+    TB_LinkerLazySymbol lazy = l->lazy_symbols[search].v;
+    TB_LinkerArchive* ar = &l->archives[lazy.archive];
+
+    uint64_t bit = 1ull << (lazy.member % 64);
+    if (ar->loaded[lazy.member / 64] & bit) {
+        return false;
+    }
+    ar->loaded[lazy.member / 64] |= bit;
+
+    log_debug("lazy load %.*s", (int) name.length, name.data);
+    dyn_array_put(*pending, lazy);
+    return true;
+}
+
+static bool tb__load_lazy_ref(TB_Linker* l, TB_LinkerSymbol* target, TB_Slice name, TB_Slice* alt, DynArray(TB_LinkerLazySymbol)* pending) {
+    if (target != NULL || tb__find_symbol(&l->symtab, name) != NULL) {
+        return false;
+    }
+
+    if (tb__load_lazy_symbol(l, name, pending)) {
+        return true;
+    }
+
+    return alt && tb__find_symbol(&l->symtab, *alt) == NULL && tb__load_lazy_symbol(l, *alt, pending);
+}
+
+static int compare_lazy_symbols(const void* a, const void* b) {
+    const TB_LinkerLazySymbol* sym_a = a;
+    const TB_LinkerLazySymbol* sym_b = b;
+    if (sym_a->archive != sym_b->archive) {
+        return sym_a->archive < sym_b->archive ? -1 : 1;
+    }
+
+    return (sym_a->member > sym_b->member) - (sym_a->member < sym_b->member);
+}
+
+// loading a member can introduce new references (which need more members) so
+// we keep scanning until nothing new gets pulled in, anything left over is an
+// unresolved symbol which GC will report.
+//
+// each round only looks at the symbol table from before the round, the members
+// it wants get sorted and appended together (so they can be parsed in parallel
+// and still get the same input handles every time).
+void tb__load_archive_members(TB_Linker* l, size_t root_count, const char** roots) {
+    tb__wait_for_objects(l);
+    if (nl_map_get_capacity(l->lazy_symbols) == 0) {
+        return;
+    }
+
+    // nothing references the GC roots, they're wanted anyways (crt0 tends to live in an archive)
+    DynArray(TB_LinkerLazySymbol) pending = NULL;
+    if (l->entrypoint) {
+        tb__load_lazy_ref(l, NULL, (TB_Slice){ strlen(l->entrypoint), (const uint8_t*) l->entrypoint }, NULL, &pending);
+    }
+
+    FOREACH_N(i, 0, root_count) {
+        tb__load_lazy_ref(l, NULL, (TB_Slice){ strlen(roots[i]), (const uint8_t*) roots[i] }, NULL, &pending);
+    }
+
+    dyn_array_for(j, l->ir_modules) {
+        TB_Module* m = l->ir_modules[j];
+        FOREACH_N(i, 0, m->exports.count) {
+            const char* name = m->exports.data[i]->super.name;
+            tb__load_lazy_ref(l, NULL, (TB_Slice){ strlen(name), (const uint8_t*) name }, NULL, &pending);
+        }
+
+        if (m->chkstk_extern) {
+            const char* name = m->chkstk_extern->name;
+            tb__load_lazy_ref(l, NULL, (TB_Slice){ strlen(name), (const uint8_t*) name }, NULL, &pending);
+        }
+    }
+
+    for (;;) {
+        for (TB_LinkerThreadInfo* restrict info = l->first_thread_info; info; info = info->next) {
+            for (; info->lazy_rel_pos < dyn_array_length(info->relatives); info->lazy_rel_pos++) {
+                TB_LinkerRelocRel* r = &info->relatives[info->lazy_rel_pos];
+                tb__load_lazy_ref(l, r->target, r->name, r->alt, &pending);
+            }
+
+            for (; info->lazy_abs_pos < dyn_array_length(info->absolutes); info->lazy_abs_pos++) {
+                TB_LinkerRelocAbs* r = &info->absolutes[info->lazy_abs_pos];
+                tb__load_lazy_ref(l, r->target, r->name, r->alt, &pending);
+            }
+
+            // /alternatename:from=to only matters when nobody defines "from"
+            for (; info->lazy_alt_pos < dyn_array_length(info->alternates); info->lazy_alt_pos++) {
+                TB_LinkerCmd* cmd = &info->alternates[info->lazy_alt_pos];
+                if (!tb__load_lazy_ref(l, NULL, cmd->from, NULL, &pending)) {
+                    tb__load_lazy_ref(l, NULL, cmd->to, NULL, &pending);
+                }
+            }
+        }
+
+        size_t count = dyn_array_length(pending);
+        if (count == 0) {
+            break;
+        }
+
+        qsort(pending, count, sizeof(TB_LinkerLazySymbol), compare_lazy_symbols);
+        FOREACH_N(i, 0, count) {
+            TB_LinkerArchive* ar = &l->archives[pending[i].archive];
+
+            TB_ArchiveEntry e;
+            if (tb_archive_parse_entries(&ar->parser, pending[i].member, pending[i].member + 1, &e) > 0) {
+                tb__append_archive_member(l, ar->input, &e);
+            }
+        }
+
+        dyn_array_clear(pending);
+        tb__wait_for_objects(l);
+    }
+
+    dyn_array_destroy(pending);
 }
 
+////////////////////////////////
+// Symbol table
+////////////////////////////////
 // murmur3 32-bit without UB unaligned accesses
 // https://github.com/demetri/scribbles/blob/master/hashing/ub_aware_hash_functions.c
 static uint32_t murmur(const void* key, size_t len) {
@@ -459,6 +883,15 @@ static uint32_t murmur(const void* key, size_t len) {
     return (h ^ (h >> 16));
 }
 
+uint64_t tb__hash_mix(uint64_t h, const void* data, size_t len) {
+    // fnv1a
+    const uint8_t* p = data;
+    FOREACH_N(i, 0, len) {
+        h = (h ^ p[i]) * 0x100000001b3ull;
+    }
+    return h;
+}
+
 ImportThunk* tb__find_or_create_import(TB_Linker* l, TB_LinkerSymbol* restrict sym) {
     assert(sym->tag == TB_LINKER_SYMBOL_IMPORT);
     TB_Slice sym_name = { sym->name.length - (sizeof("__imp_") - 1), sym->name.data + sizeof("__imp_") - 1 };
@@ -480,6 +913,16 @@ TB_LinkerSymbol* tb__find_symbol_cstr(TB_SymbolTable* restrict symtab, const cha
     return tb__find_symbol(symtab, (TB_Slice){ strlen(name), (const uint8_t*) name });
 }
 
+// the slot's name is published last, a claimed slot without a length is still
+// being filled in by someone else.
+static size_t tb__wait_for_name(TB_LinkerSymbol* slot) {
+    size_t len;
+    while ((len = atomic_load_explicit((_Atomic(size_t)*) &slot->name.length, memory_order_acquire)) == 0) {
+        // spin, it's only a memcpy away
+    }
+    return len;
+}
+
 TB_LinkerSymbol* tb__find_symbol(TB_SymbolTable* restrict symtab, TB_Slice name) {
     uint32_t mask = (1u << symtab->exp) - 1;
     uint32_t hash = murmur(name.data, name.length);
@@ -488,16 +931,19 @@ TB_LinkerSymbol* tb__find_symbol(TB_SymbolTable* restrict symtab, TB_Slice name)
         uint32_t step = (hash >> (32 - symtab->exp)) | 1;
         i = (i + step) & mask;
 
-        if (symtab->ht[i].name.length == 0) {
+        TB_LinkerSymbol* slot = &symtab->ht[i];
+        const uint8_t* data = atomic_load_explicit((_Atomic(const uint8_t*)*) &slot->name.data, memory_order_acquire);
+        if (data == NULL) {
             return NULL;
-        } else if (name.length == symtab->ht[i].name.length && memcmp(name.data, symtab->ht[i].name.data, name.length) == 0) {
-            return &symtab->ht[i];
+        } else if (name.length == tb__wait_for_name(slot) && memcmp(name.data, data, name.length) == 0) {
+            return slot;
         }
     }
 }
 
-TB_LinkerSymbol* tb__append_symbol(TB_SymbolTable* restrict symtab, const TB_LinkerSymbol* sym) {
+static TB_LinkerSymbol* tb__insert_symbol(TB_SymbolTable* restrict symtab, const TB_LinkerSymbol* sym, bool* inserted) {
     TB_Slice name = sym->name;
+    assert(name.length > 0 && name.data != NULL);
 
     uint32_t mask = (1u << symtab->exp) - 1;
     uint32_t hash = murmur(name.data, name.length);
@@ -506,33 +952,102 @@ TB_LinkerSymbol* tb__append_symbol(TB_SymbolTable* restrict symtab, const TB_Lin
         uint32_t step = (hash >> (32 - symtab->exp)) | 1;
         i = (i + step) & mask;
 
-        if (symtab->ht[i].name.length == 0) {
-            // empty slot
-            if (symtab->len > mask) {
+        TB_LinkerSymbol* slot = &symtab->ht[i];
+        const uint8_t* data = NULL;
+        if (atomic_compare_exchange_strong((_Atomic(const uint8_t*)*) &slot->name.data, &data, name.data)) {
+            // empty slot, it's ours now
+            if (atomic_fetch_add(&symtab->len, 1) >= mask) {
                 printf("Symbol table: out of memory!\n");
                 abort();
             }
 
-            symtab->len++;
-            memcpy(&symtab->ht[i], sym, sizeof(TB_LinkerSymbol));
-            return &symtab->ht[i];
-        } else if (name.length == symtab->ht[i].name.length && memcmp(name.data, symtab->ht[i].name.data, name.length) == 0) {
-            // proper collision... this is a linker should we throw warnings?
-            // memcpy(&symtab->ht[i], sym, sizeof(TB_LinkerSymbol));
-            return &symtab->ht[i];
+            TB_LinkerSymbol tmp = *sym;
+            tmp.name = (TB_Slice){ 0, name.data };
+            memcpy(slot, &tmp, sizeof(TB_LinkerSymbol));
+            atomic_store_explicit((_Atomic(size_t)*) &slot->name.length, name.length, memory_order_release);
+
+            *inserted = true;
+            return slot;
+        } else if (name.length == tb__wait_for_name(slot) && memcmp(name.data, data, name.length) == 0) {
+            *inserted = false;
+            return slot;
         }
     }
 }
 
-TB_UnresolvedSymbol* tb__unresolved_symbol(TB_Linker* l, TB_Slice name) {
-    TB_UnresolvedSymbol* d = tb_platform_heap_alloc(sizeof(TB_UnresolvedSymbol));
-    *d = (TB_UnresolvedSymbol){ .name = name };
+TB_LinkerSymbol* tb__append_symbol(TB_SymbolTable* restrict symtab, const TB_LinkerSymbol* sym) {
+    // proper collision... this is a linker should we throw warnings?
+    bool inserted;
+    return tb__insert_symbol(symtab, sym, &inserted);
+}
 
-    // mtx_lock(&parser->diag_mutex);
-    NL_Slice name2 = { name.length, name.data };
-    ptrdiff_t search = nl_map_get(l->unresolved_symbols, name2);
-    if (search < 0) {
-        nl_map_puti(l->unresolved_symbols, name2, search);
+static int symbol_strength(const TB_LinkerSymbol* sym) {
+    if (sym->flags & TB_LINKER_SYMBOL_WEAK)      return 0;
+    if (sym->flags & TB_LINKER_SYMBOL_TENTATIVE) return 1;
+    return 2;
+}
+
+TB_LinkerSymbol* tb__define_symbol(TB_Linker* l, const TB_LinkerSymbol* sym, TB_LinkerInputHandle input, bool* inserted) {
+    // anonymous stuff (string literals and such) can't be looked up anyways
+    if (sym->name.length == 0) {
+        TB_LinkerSymbol* s = tb_platform_heap_alloc(sizeof(TB_LinkerSymbol));
+        *s = *sym;
+        *inserted = true;
+        return s;
+    }
+
+    TB_LinkerSymbol* old = tb__insert_symbol(&l->symtab, sym, inserted);
+    if (*inserted) {
+        return old;
+    }
+
+    mtx_lock(&l->lock);
+    TB_LinkerSectionPiece* old_p = tb__get_piece(l, old);
+    TB_LinkerSectionPiece* new_p = tb__get_piece(l, (TB_LinkerSymbol*) sym);
+
+    // things the linker made itself (or imports) don't have pieces, those stay put
+    bool replace = false;
+    if (old_p != NULL && new_p != NULL) {
+        int old_strength = symbol_strength(old), new_strength = symbol_strength(sym);
+        if (old_strength != new_strength) {
+            replace = new_strength > old_strength;
+        } else if ((old->flags & sym->flags & (TB_LINKER_SYMBOL_COMDAT | TB_LINKER_SYMBOL_TENTATIVE)) && old_p->size != new_p->size) {
+            // COMDAT selection: we only really see "any" and "largest", for
+            // any the copies match anyways. tentative definitions also take
+            // the largest.
+            replace = new_p->size > old_p->size;
+        } else {
+            // the earlier input wins, that's what a serial link would've done
+            replace = input < old_p->input;
+        }
+
+        if ((old->flags & TB_LINKER_SYMBOL_COMDAT) && (sym->flags & TB_LINKER_SYMBOL_COMDAT)) {
+            // drop the losing copy
+            if (replace) old_p->size = 0;
+            else new_p->size = 0;
+        }
+    }
+
+    if (replace) {
+        // keep the key (readers might be looking at it) and the old piece's symbol list intact
+        TB_LinkerSymbol tmp = *sym;
+        tmp.name = old->name;
+        tmp.next = old->next;
+        *old = tmp;
+    }
+    mtx_unlock(&l->lock);
+    return old;
+}
+
+TB_UnresolvedSymbol* tb__unresolved_symbol(TB_Linker* l, TB_Slice name) {
+    TB_UnresolvedSymbol* d = tb_platform_heap_alloc(sizeof(TB_UnresolvedSymbol));
+    *d = (TB_UnresolvedSymbol){ .name = name };
+
+    // mtx_lock(&parser->diag_mutex);
+    NL_Slice name2 = { name.length, name.data };
+    ptrdiff_t search = nl_map_get(l->unresolved_symbols, name2);
+    if (search < 0) {
+        nl_map_puti(l->unresolved_symbols, name2, search);
         l->unresolved_symbols[search].v = d;
     } else {
         TB_UnresolvedSymbol* old = l->unresolved_symbols[search].v;
@@ -551,6 +1066,7 @@ static void tb__append_module_symbols(TB_Linker* l, TB_Module* m) {
     CUIK_TIMED_BLOCK("apply symbols") {
         static const TB_SymbolTag tags[] = { TB_SYMBOL_FUNCTION, TB_SYMBOL_GLOBAL };
         TB_Slice obj_name = { sizeof("<tb module>")-1, (const uint8_t*) "<tb module>" };
+        bool inserted;
 
         dyn_array_for(i, sections) {
             DynArray(TB_FunctionOutput*) funcs = sections[i].funcs;
@@ -566,7 +1082,7 @@ static void tb__append_module_symbols(TB_Linker* l, TB_Module* m) {
                     .tb = { piece, &funcs[i]->parent->super }
                 };
 
-                tb__append_symbol(&l->symtab, &ls);
+                tb__define_symbol(l, &ls, piece->input, &inserted);
             }
 
             dyn_array_for(i, globals) {
@@ -578,7 +1094,7 @@ static void tb__append_module_symbols(TB_Linker* l, TB_Module* m) {
                     .tb = { piece, &globals[i]->super }
                 };
 
-                tb__append_symbol(&l->symtab, &ls);
+                tb__define_symbol(l, &ls, piece->input, &inserted);
             }
         }
     }
@@ -586,64 +1102,125 @@ static void tb__append_module_symbols(TB_Linker* l, TB_Module* m) {
     dyn_array_put(l->ir_modules, m);
 }
 
+typedef struct {
+    TB_Linker* l;
+    TB_Module* m;
+    uint8_t* output;
+    DynArray(TB_FunctionOutput*) funcs;
+    uint64_t trampoline_rva, text_piece_rva, text_piece_file;
+} ModuleRelocTask;
+
+static void module_relocs_task(void* ctx, size_t start, size_t end) {
+    ModuleRelocTask* t = ctx;
+    TB_Linker* l = t->l;
+    TB_Module* m = t->m;
+    uint8_t* output = t->output;
+
+    FOREACH_N(j, start, end) {
+        TB_FunctionOutput* out_f = t->funcs[j];
+        for (TB_SymbolPatch* patch = out_f->last_patch; patch; patch = patch->prev) {
+            int32_t* dst = (int32_t*) &output[t->text_piece_file + out_f->code_pos + patch->pos];
+            size_t actual_pos = t->text_piece_rva + out_f->code_pos + patch->pos + 4;
+
+            int32_t p = 0;
+            if (patch->target->tag == TB_SYMBOL_EXTERNAL) {
+                uintptr_t thunk_p = (uintptr_t) patch->target->address;
+                if (thunk_p & 1) {
+                    TB_LinkerSymbol* sym = (TB_LinkerSymbol*) (thunk_p & ~1);
+                    p = tb__get_symbol_rva(l, sym) - actual_pos;
+                } else {
+                    ImportThunk* thunk = (ImportThunk*) thunk_p;
+                    assert(thunk != NULL);
+
+                    p = (t->trampoline_rva + (thunk->thunk_id * 6)) - actual_pos;
+                }
+            } else if (patch->target->tag == TB_SYMBOL_FUNCTION) {
+                // emit_call_patches only runs when exporting objects, if it
+                // did then the displacement is already in the code.
+                if (patch->internal) continue;
+
+                TB_FunctionOutput* target = ((TB_Function*) patch->target)->output;
+                assert(target != NULL && "call to a function that never got compiled");
+
+                TB_LinkerSectionPiece* piece = m->sections[target->section].piece;
+                uint32_t piece_rva = piece->parent->address + piece->offset;
+
+                p = (piece_rva + target->code_pos) - actual_pos;
+            } else if (patch->target->tag == TB_SYMBOL_GLOBAL) {
+                TB_Global* global = (TB_Global*) patch->target;
+                assert(global->super.tag == TB_SYMBOL_GLOBAL);
+
+                uint32_t flags = m->sections[global->parent].flags;
+                TB_LinkerSectionPiece* piece = m->sections[global->parent].piece;
+                uint32_t piece_rva = piece->parent->address + piece->offset;
+
+                if (flags & TB_MODULE_SECTION_TLS) {
+                    // section relative for TLS
+                    p = piece_rva + global->pos;
+                } else {
+                    p = (piece_rva + global->pos) - actual_pos;
+                }
+            } else {
+                tb_todo();
+            }
+
+            *dst += p;
+        }
+    }
+}
+
 void tb__apply_module_relocs(TB_Linker* l, TB_Module* m, uint8_t* output) {
     TB_LinkerSection* text = tb__find_section(l, ".text");
     if (text == NULL) {
         return;
     }
 
-    uint64_t trampoline_rva = text->address + l->trampoline_pos;
-
     dyn_array_for(i, m->sections) {
-        DynArray(TB_FunctionOutput*) funcs = m->sections[i].funcs;
         TB_LinkerSectionPiece* piece = m->sections[i].piece;
+        if (piece == NULL) continue;
+
+        // functions don't share patch sites so they can go in parallel
+        ModuleRelocTask t = {
+            .l = l, .m = m, .output = output,
+            .funcs = m->sections[i].funcs,
+            .trampoline_rva = text->address + l->trampoline_pos,
+            .text_piece_rva = piece->parent->address + piece->offset,
+            .text_piece_file = piece->parent->offset + piece->offset,
+        };
+        tb_parallel_for_pool(l->thread_pool, dyn_array_length(t.funcs), 256, &t, module_relocs_task);
+    }
+}
 
-        uint64_t text_piece_rva = piece->parent->address + piece->offset;
-        uint64_t text_piece_file = piece->parent->offset + piece->offset;
-
-        dyn_array_for(j, funcs) {
-            TB_FunctionOutput* out_f = funcs[j];
-            for (TB_SymbolPatch* patch = out_f->last_patch; patch; patch = patch->prev) {
-                int32_t* dst = (int32_t*) &output[text_piece_file + out_f->code_pos + patch->pos];
-                size_t actual_pos = text_piece_rva + out_f->code_pos + patch->pos + 4;
-
-                int32_t p = 0;
-                if (patch->target->tag == TB_SYMBOL_EXTERNAL) {
-                    uintptr_t thunk_p = (uintptr_t) patch->target->address;
-                    if (thunk_p & 1) {
-                        TB_LinkerSymbol* sym = (TB_LinkerSymbol*) (thunk_p & ~1);
-                        p = tb__get_symbol_rva(l, sym);
-                    } else {
-                        ImportThunk* thunk = (ImportThunk*) thunk_p;
-                        assert(thunk != NULL);
+typedef struct {
+    TB_Linker* l;
+    void* ctx;
+    TB_LinkerPieceFn fn;
+    TB_LinkerSectionPiece** pieces;
+} PieceTask;
+
+static void piece_task(void* ctx, size_t start, size_t end) {
+    PieceTask* t = ctx;
+    FOREACH_N(i, start, end) {
+        t->fn(t->l, t->pieces[i], t->ctx);
+    }
+}
 
-                        p = (trampoline_rva + (thunk->thunk_id * 6)) - actual_pos;
-                    }
-                } else if (patch->target->tag == TB_SYMBOL_FUNCTION) {
-                    // internal patching has already handled this
-                } else if (patch->target->tag == TB_SYMBOL_GLOBAL) {
-                    TB_Global* global = (TB_Global*) patch->target;
-                    assert(global->super.tag == TB_SYMBOL_GLOBAL);
-
-                    uint32_t flags = m->sections[global->parent].flags;
-                    TB_LinkerSectionPiece* piece = m->sections[global->parent].piece;
-                    uint32_t piece_rva = piece->parent->address + piece->offset;
-
-                    int32_t* dst = (int32_t*) &output[text_piece_file + out_f->code_pos + patch->pos];
-                    if (flags & TB_MODULE_SECTION_TLS) {
-                        // section relative for TLS
-                        p = piece_rva + global->pos;
-                    } else {
-                        p = (piece_rva + global->pos) - actual_pos;
-                    }
-                } else {
-                    tb_todo();
-                }
+void tb__for_each_reloc_piece(TB_Linker* l, void* ctx, TB_LinkerPieceFn fn) {
+    DynArray(TB_LinkerSectionPiece*) pieces = NULL;
+    nl_map_for_str(i, l->sections) {
+        TB_LinkerSection* s = l->sections[i].v;
+        if (s->generic_flags & TB_LINKER_SECTION_DISCARD) continue;
 
-                *dst += p;
+        for (TB_LinkerSectionPiece* p = s->first; p != NULL; p = p->next) {
+            if ((p->flags & TB_LINKER_PIECE_LIVE) && tb__piece_needs_write(l, p) && (dyn_array_length(p->rel_refs) || dyn_array_length(p->abs_refs))) {
+                dyn_array_put(pieces, p);
             }
         }
     }
+
+    PieceTask t = { l, ctx, fn, pieces };
+    tb_parallel_for_pool(l->thread_pool, dyn_array_length(pieces), 64, &t, piece_task);
+    dyn_array_destroy(pieces);
 }
 
 static TB_Slice as_filename(TB_Slice s) {
@@ -657,11 +1234,38 @@ static TB_Slice as_filename(TB_Slice s) {
     return (TB_Slice){ s.length - last, s.data + last };
 }
 
+static int compare_pieces_by_input(const void* a, const void* b) {
+    const TB_LinkerSectionPiece* p_a = *(const TB_LinkerSectionPiece**) a;
+    const TB_LinkerSectionPiece* p_b = *(const TB_LinkerSectionPiece**) b;
+
+    if (p_a->input != p_b->input) return p_a->input < p_b->input ? -1 : 1;
+    if (p_a->order != p_b->order) return p_a->order < p_b->order ? -1 : 1;
+    if (p_a->parent != p_b->parent) {
+        size_t len = p_a->parent->name.length < p_b->parent->name.length ? p_a->parent->name.length : p_b->parent->name.length;
+        int cmp = memcmp(p_a->parent->name.data, p_b->parent->name.data, len);
+        if (cmp != 0) return cmp;
+        return p_a->parent->name.length < p_b->parent->name.length ? -1 : 1;
+    }
+
+    // within one input the offsets grow in the order things were appended
+    return (p_a->offset > p_b->offset) - (p_a->offset < p_b->offset);
+}
+
 static int compare_linker_sections(const void* a, const void* b) {
     const TB_LinkerSectionPiece* sec_a = *(const TB_LinkerSectionPiece**) a;
     const TB_LinkerSectionPiece* sec_b = *(const TB_LinkerSectionPiece**) b;
 
-    return sec_a->order - sec_b->order;
+    if (sec_a->order != sec_b->order) {
+        return sec_a->order < sec_b->order ? -1 : 1;
+    }
+
+    // pieces get appended from several threads so the list order isn't stable,
+    // within one input the offsets still grow in the order they were appended.
+    if (sec_a->input != sec_b->input) {
+        return sec_a->input < sec_b->input ? -1 : 1;
+    }
+
+    return (sec_a->offset > sec_b->offset) - (sec_a->offset < sec_b->offset);
 }
 
 bool tb__finalize_sections(TB_Linker* l) {
@@ -731,6 +1335,21 @@ bool tb__finalize_sections(TB_Linker* l) {
                 assert(s->piece_count != 0);
                 array_form = tb_platform_heap_realloc(array_form, piece_count * sizeof(TB_LinkerSectionPiece*));
 
+                // incremental linking finds the pieces again by their position within the
+                // input, dead ones count too so they don't shift the others around.
+                if (l->incr) {
+                    for (TB_LinkerSectionPiece* p = s->first; p != NULL; p = p->next) {
+                        array_form[j++] = p;
+                    }
+
+                    qsort(array_form, j, sizeof(TB_LinkerSectionPiece*), compare_pieces_by_input);
+                    FOREACH_N(k, 0, j) {
+                        bool same_input = k > 0 && array_form[k-1]->input == array_form[k]->input;
+                        array_form[k]->ordinal = same_input ? array_form[k-1]->ordinal + 1 : 0;
+                    }
+                    j = 0;
+                }
+
                 for (TB_LinkerSectionPiece* p = s->first; p != NULL; p = p->next) {
                     if (p->size != 0 && (p->flags & TB_LINKER_PIECE_LIVE)) {
                         array_form[j++] = p;
@@ -753,16 +1372,24 @@ bool tb__finalize_sections(TB_Linker* l) {
 
             // convert back into linked list
             CUIK_TIMED_BLOCK("convert into list") {
-                array_form[0]->offset = 0;
+                // incremental links leave room after every piece (and at the end of
+                // the section) so the next link can patch things in place.
+                bool slack = l->incr && (s->generic_flags & TB_LINKER_SECTION_PACKED) == 0;
+
+                size_t offset = 0;
+                for (j = 0; j < piece_count; j++) {
+                    TB_LinkerSectionPiece* p = array_form[j];
+                    if (j > 0 && p->align > 1) {
+                        offset = align_up(offset, p->align);
+                    }
 
-                size_t offset = array_form[0]->size;
-                for (j = 1; j < piece_count; j++) {
-                    array_form[j]->offset = offset;
-                    offset += array_form[j]->size;
+                    p->offset = offset;
+                    p->capacity = slack ? p->size + p->size/4 + 16 : p->size;
+                    offset += p->capacity;
 
-                    array_form[j-1]->next = array_form[j];
+                    if (j > 0) array_form[j-1]->next = p;
                 }
-                s->total_size = offset;
+                s->total_size = slack ? offset + offset/8 + 1024 : offset;
 
                 s->first = array_form[0];
                 s->last = array_form[piece_count - 1];
@@ -776,53 +1403,1035 @@ bool tb__finalize_sections(TB_Linker* l) {
         tb_platform_heap_free(array_form);
     }
 
+    if (l->incr) CUIK_TIMED_BLOCK("incremental layout") {
+        tb__incr_layout(l);
+    }
+
     return true;
 }
 
-static void gc_mark(TB_Linker* l, TB_LinkerSectionPiece* p) {
-    if (p == NULL || p->size == 0 || (p->flags & TB_LINKER_PIECE_LIVE) || (p->parent->generic_flags & TB_LINKER_SECTION_DISCARD)) {
-        return;
+////////////////////////////////
+// Section GC
+////////////////////////////////
+// roots get pushed by the backend (gc_mark_root, gc_mark) and then gc_mark_all floods
+// out from them one level at a time. each level is split across the thread pool and
+// a piece belongs to whoever sets its live bit first, so the deep reference chains
+// that used to recurse are just more levels now.
+//
+// marking only looks symbols up, the resolver (which reports unresolved symbols and
+// makes import thunks) runs afterwards over the live pieces in input order so the
+// results don't depend on which thread got where first.
+static bool gc_claim(TB_LinkerSectionPiece* p) {
+    if (p == NULL || p->size == 0 || (p->parent->generic_flags & TB_LINKER_SECTION_DISCARD)) {
+        return false;
+    }
+
+    uint32_t old = atomic_fetch_or((_Atomic(uint32_t)*) &p->flags, TB_LINKER_PIECE_LIVE);
+    return (old & TB_LINKER_PIECE_LIVE) == 0;
+}
+
+static void gc_push(DynArray(TB_LinkerSectionPiece*)* ws, TB_LinkerSectionPiece* p, TB_LinkerSectionPiece* from) {
+    if (gc_claim(p)) {
+        p->live_from = from;
+        dyn_array_put(*ws, p);
     }
+}
 
-    p->flags |= TB_LINKER_PIECE_LIVE;
+static TB_LinkerSymbol* gc_lookup(TB_Linker* l, TB_LinkerSymbol* sym, TB_Slice name, TB_Slice* alt) {
+    if (sym == NULL) {
+        sym = tb__find_symbol(&l->symtab, name);
+        if (sym == NULL && alt) {
+            sym = tb__find_symbol(&l->symtab, *alt);
+        }
+    }
+    return sym;
+}
 
+static void gc_visit(TB_Linker* l, TB_LinkerSectionPiece* p, DynArray(TB_LinkerSectionPiece*)* ws) {
     // mark module content
     if (l->inputs[p->input].tag == TB_LINKER_INPUT_MODULE) {
         TB_Module* m = l->inputs[p->input].module;
 
         dyn_array_for(i, m->sections) {
-            gc_mark(l, m->sections[i].piece);
+            gc_push(ws, m->sections[i].piece, p);
+        }
+
+        // and whatever it calls out to
+        FOREACH_N(i, 0, m->exports.count) {
+            const char* name = m->exports.data[i]->super.name;
+            gc_push(ws, tb__get_piece(l, tb__find_symbol(&l->symtab, (TB_Slice){ strlen(name), (const uint8_t*) name })), p);
         }
     }
 
     // mark any kid symbols
     for (TB_LinkerSymbol* sym = p->first_sym; sym != NULL; sym = sym->next) {
-        gc_mark(l, tb__get_piece(l, sym));
+        gc_push(ws, tb__get_piece(l, sym), p);
     }
 
-    // mark any relocations
+    // mark any relocations, we're the only ones touching this piece's relocations
     dyn_array_for(i, p->abs_refs) {
         TB_LinkerRelocAbs* r = &p->abs_refs[i].info->absolutes[p->abs_refs[i].index];
-
-        // resolve symbol
-        r->target = l->resolve_sym(l, r->target, r->name, r->alt, r->input);
-        gc_mark(l, tb__get_piece(l, r->target));
+        r->target = gc_lookup(l, r->target, r->name, r->alt);
+        gc_push(ws, tb__get_piece(l, r->target), p);
     }
 
     dyn_array_for(i, p->rel_refs) {
         TB_LinkerRelocRel* r = &p->rel_refs[i].info->relatives[p->rel_refs[i].index];
+        r->target = gc_lookup(l, r->target, r->name, r->alt);
+        gc_push(ws, tb__get_piece(l, r->target), p);
+    }
+
+    gc_push(ws, p->associate, p);
+}
 
-        // resolve symbol
-        r->target = l->resolve_sym(l, r->target, r->name, r->alt, r->input);
-        gc_mark(l, tb__get_piece(l, r->target));
+static void gc_mark(TB_Linker* l, TB_LinkerSectionPiece* p) {
+    gc_push(&l->gc_worklist, p, NULL);
+}
+
+static void gc_mark_root(TB_Linker* l, const char* name) {
+    gc_mark(l, tb__get_piece(l, tb__find_symbol_cstr(&l->symtab, name)));
+}
+
+typedef struct {
+    TB_Linker* l;
+    TB_LinkerSectionPiece** level;
+    DynArray(TB_LinkerSectionPiece*) next;
+    mtx_t lock;
+} GCTask;
+
+static void gc_task(void* ctx, size_t start, size_t end) {
+    GCTask* t = ctx;
+
+    DynArray(TB_LinkerSectionPiece*) found = NULL;
+    FOREACH_N(i, start, end) {
+        gc_visit(t->l, t->level[i], &found);
     }
 
-    if (p->associate) {
-        gc_mark(l, p->associate);
+    if (found != NULL) {
+        mtx_lock(&t->lock);
+        dyn_array_for(i, found) {
+            dyn_array_put(t->next, found[i]);
+        }
+        mtx_unlock(&t->lock);
+        dyn_array_destroy(found);
     }
 }
 
-static void gc_mark_root(TB_Linker* l, const char* name) {
-    TB_LinkerSectionPiece* p = tb__get_piece(l, tb__find_symbol_cstr(&l->symtab, name));
-    gc_mark(l, p);
+static void gc_print_piece(TB_Linker* l, TB_LinkerSectionPiece* p) {
+    TB_LinkerInput* in = &l->inputs[p->input];
+    if (in->tag == TB_LINKER_INPUT_MODULE) {
+        fprintf(stderr, "%.*s in <tb module>", (int) p->parent->name.length, p->parent->name.data);
+        return;
+    }
+
+    TB_Slice obj_name = as_filename(in->name);
+    fprintf(stderr, "%.*s in %.*s", (int) p->parent->name.length, p->parent->name.data, (int) obj_name.length, obj_name.data);
+    if (p->first_sym != NULL && p->first_sym->name.length > 0) {
+        fprintf(stderr, " (%.*s)", (int) p->first_sym->name.length, p->first_sym->name.data);
+    }
+}
+
+static void gc_print_sections(TB_Linker* l) {
+    DynArray(TB_LinkerSectionPiece*) pieces = NULL;
+    nl_map_for_str(i, l->sections) {
+        TB_LinkerSection* s = l->sections[i].v;
+        if (s->generic_flags & TB_LINKER_SECTION_DISCARD) continue;
+
+        for (TB_LinkerSectionPiece* p = s->first; p != NULL; p = p->next) {
+            if (p->size > 0) dyn_array_put(pieces, p);
+        }
+    }
+
+    // a NULL base is UB for qsort even with no elements
+    if (dyn_array_length(pieces) > 1) {
+        qsort(pieces, dyn_array_length(pieces), sizeof(TB_LinkerSectionPiece*), compare_pieces_by_input);
+    }
+    dyn_array_for(i, pieces) {
+        TB_LinkerSectionPiece* p = pieces[i];
+        if (p->flags & TB_LINKER_PIECE_LIVE) {
+            fprintf(stderr, "tblink: kept ");
+            gc_print_piece(l, p);
+            if (p->live_from) {
+                fprintf(stderr, ", referenced by ");
+                gc_print_piece(l, p->live_from);
+            } else {
+                fprintf(stderr, ", root");
+            }
+        } else {
+            fprintf(stderr, "tblink: removed ");
+            gc_print_piece(l, p);
+        }
+        fprintf(stderr, "\n");
+    }
+    dyn_array_destroy(pieces);
+}
+
+static void gc_mark_all(TB_Linker* l) {
+    GCTask t = { l };
+    mtx_init(&t.lock, mtx_plain);
+
+    DynArray(TB_LinkerSectionPiece*) level = l->gc_worklist;
+    l->gc_worklist = NULL;
+
+    while (dyn_array_length(level) > 0) {
+        t.level = level;
+        t.next = NULL;
+        tb_parallel_for_pool(l->thread_pool, dyn_array_length(level), 64, &t, gc_task);
+
+        dyn_array_destroy(level);
+        level = t.next;
+    }
+    dyn_array_destroy(level);
+    mtx_destroy(&t.lock);
+
+    // run the resolver on every live relocation, in a stable order
+    DynArray(TB_LinkerSectionPiece*) live = NULL;
+    nl_map_for_str(i, l->sections) {
+        TB_LinkerSection* s = l->sections[i].v;
+        for (TB_LinkerSectionPiece* p = s->first; p != NULL; p = p->next) {
+            if ((p->flags & TB_LINKER_PIECE_LIVE) && (dyn_array_length(p->rel_refs) || dyn_array_length(p->abs_refs))) {
+                dyn_array_put(live, p);
+            }
+        }
+    }
+
+    // empty when no live piece has relocations (a lone TB module) and then
+    // live is still NULL, which qsort isn't allowed to see.
+    if (dyn_array_length(live) > 1) {
+        qsort(live, dyn_array_length(live), sizeof(TB_LinkerSectionPiece*), compare_pieces_by_input);
+    }
+    dyn_array_for(i, live) {
+        TB_LinkerSectionPiece* p = live[i];
+        dyn_array_for(j, p->abs_refs) {
+            TB_LinkerRelocAbs* r = &p->abs_refs[j].info->absolutes[p->abs_refs[j].index];
+            r->target = l->resolve_sym(l, r->target, r->name, r->alt, r->input);
+        }
+
+        dyn_array_for(j, p->rel_refs) {
+            TB_LinkerRelocRel* r = &p->rel_refs[j].info->relatives[p->rel_refs[j].index];
+            r->target = l->resolve_sym(l, r->target, r->name, r->alt, r->input);
+        }
+    }
+    dyn_array_destroy(live);
+
+    if (l->print_gc) {
+        gc_print_sections(l);
+    }
+}
+
+////////////////////////////////
+// Identical code folding
+////////////////////////////////
+// code pieces start out grouped by their bytes and the shape of their relocations, then
+// the groups keep splitting until every relocation in a group agrees on where it goes.
+// pieces which refer to each other (recursion, mutual recursion) still fold since their
+// targets are compared by class, not by identity.
+typedef struct {
+    TB_Linker* l;
+    TB_LinkerSectionPiece** pieces;
+    NL_Map(TB_LinkerSectionPiece*, uint32_t) index;
+    uint32_t* cls;
+    uint64_t* hash;
+} ICF;
+
+// where a relocation ends up, in terms of the current classes
+typedef struct {
+    uint64_t a, b;
+} ICFTarget;
+
+static ICFTarget icf_target(ICF* icf, TB_LinkerSymbol* sym) {
+    if (sym == NULL) {
+        return (ICFTarget){ 0 };
+    }
+
+    if (sym->tag == TB_LINKER_SYMBOL_NORMAL) {
+        ptrdiff_t search = nl_map_get(icf->index, sym->normal.piece);
+        if (search >= 0) {
+            // top bit keeps classes apart from pointers
+            return (ICFTarget){ (1ull << 63ull) | icf->cls[icf->index[search].v], sym->normal.secrel };
+        }
+
+        return (ICFTarget){ (uintptr_t) sym->normal.piece, sym->normal.secrel };
+    } else if (sym->tag == TB_LINKER_SYMBOL_TB) {
+        return (ICFTarget){ (uintptr_t) sym->tb.sym, 1 };
+    } else {
+        return (ICFTarget){ (uintptr_t) sym, 2 };
+    }
+}
+
+#define ICF_REL(p, i) (&(p)->rel_refs[i].info->relatives[(p)->rel_refs[i].index])
+#define ICF_ABS(p, i) (&(p)->abs_refs[i].info->absolutes[(p)->abs_refs[i].index])
+
+// bytes, size and relocation shape, none of which change while refining
+static bool icf_equal_contents(TB_LinkerSectionPiece* a, TB_LinkerSectionPiece* b) {
+    if (a->parent != b->parent || a->size != b->size || a->align != b->align ||
+        dyn_array_length(a->rel_refs) != dyn_array_length(b->rel_refs) ||
+        dyn_array_length(a->abs_refs) != dyn_array_length(b->abs_refs) ||
+        memcmp(a->data, b->data, a->size) != 0) {
+        return false;
+    }
+
+    dyn_array_for(i, a->rel_refs) {
+        TB_LinkerRelocRel* ra = ICF_REL(a, i);
+        TB_LinkerRelocRel* rb = ICF_REL(b, i);
+        if (ra->src_offset != rb->src_offset || ra->type != rb->type || ra->addend != rb->addend) {
+            return false;
+        }
+    }
+
+    dyn_array_for(i, a->abs_refs) {
+        if (ICF_ABS(a, i)->src_offset != ICF_ABS(b, i)->src_offset) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool icf_equal_targets(ICF* icf, TB_LinkerSectionPiece* a, TB_LinkerSectionPiece* b) {
+    dyn_array_for(i, a->rel_refs) {
+        ICFTarget ta = icf_target(icf, ICF_REL(a, i)->target);
+        ICFTarget tb = icf_target(icf, ICF_REL(b, i)->target);
+        if (ta.a != tb.a || ta.b != tb.b) return false;
+    }
+
+    dyn_array_for(i, a->abs_refs) {
+        ICFTarget ta = icf_target(icf, ICF_ABS(a, i)->target);
+        ICFTarget tb = icf_target(icf, ICF_ABS(b, i)->target);
+        if (ta.a != tb.a || ta.b != tb.b) return false;
+    }
+
+    return true;
+}
+
+static void icf_hash_contents_task(void* ctx, size_t start, size_t end) {
+    ICF* icf = ctx;
+    FOREACH_N(i, start, end) {
+        TB_LinkerSectionPiece* p = icf->pieces[i];
+
+        uint64_t h = tb__hash_mix(TB_HASH_SEED, &p->size, sizeof(p->size));
+        h = tb__hash_mix(h, p->data, p->size);
+        dyn_array_for(j, p->rel_refs) {
+            TB_LinkerRelocRel* r = ICF_REL(p, j);
+            h = tb__hash_mix(h, &r->src_offset, sizeof(r->src_offset));
+            h = tb__hash_mix(h, &r->type, sizeof(r->type));
+        }
+        icf->hash[i] = h;
+    }
+}
+
+static void icf_hash_targets_task(void* ctx, size_t start, size_t end) {
+    ICF* icf = ctx;
+    FOREACH_N(i, start, end) {
+        TB_LinkerSectionPiece* p = icf->pieces[i];
+
+        uint64_t h = tb__hash_mix(TB_HASH_SEED, &icf->cls[i], sizeof(uint32_t));
+        dyn_array_for(j, p->rel_refs) {
+            ICFTarget t = icf_target(icf, ICF_REL(p, j)->target);
+            h = tb__hash_mix(h, &t, sizeof(t));
+        }
+        dyn_array_for(j, p->abs_refs) {
+            ICFTarget t = icf_target(icf, ICF_ABS(p, j)->target);
+            h = tb__hash_mix(h, &t, sizeof(t));
+        }
+        icf->hash[i] = h;
+    }
+}
+
+static ICF* icf_sort_ctx;
+static int compare_icf_hash(const void* a, const void* b) {
+    uint32_t i = *(const uint32_t*) a, j = *(const uint32_t*) b;
+    uint64_t ha = icf_sort_ctx->hash[i], hb = icf_sort_ctx->hash[j];
+    if (ha != hb) return ha < hb ? -1 : 1;
+    return (i > j) - (i < j);
+}
+
+// splits the pieces by hash (and equality) into new classes, a class is named
+// after its first member so it's stable across rounds. returns the class count.
+static size_t icf_partition(ICF* icf, uint32_t* order, uint32_t* new_cls, size_t count, bool contents) {
+    FOREACH_N(i, 0, count) order[i] = i;
+
+    // the comparator can't take a context in C11 qsort, ICF only runs on
+    // the thread driving the export.
+    icf_sort_ctx = icf;
+    qsort(order, count, sizeof(uint32_t), compare_icf_hash);
+    icf_sort_ctx = NULL;
+
+    FOREACH_N(i, 0, count) new_cls[i] = UINT32_MAX;
+
+    size_t classes = 0;
+    for (size_t i = 0; i < count;) {
+        size_t j = i + 1;
+        while (j < count && icf->hash[order[j]] == icf->hash[order[i]]) j++;
+
+        // a hash run is usually one class, collisions get sorted out here
+        FOREACH_N(k, i, j) {
+            uint32_t x = order[k];
+            if (new_cls[x] != UINT32_MAX) continue;
+
+            new_cls[x] = x, classes++;
+            FOREACH_N(m, k + 1, j) {
+                uint32_t y = order[m];
+                if (new_cls[y] != UINT32_MAX) continue;
+
+                bool same = contents
+                    ? icf_equal_contents(icf->pieces[x], icf->pieces[y])
+                    : icf->cls[x] == icf->cls[y] && icf_equal_targets(icf, icf->pieces[x], icf->pieces[y]);
+
+                if (same) new_cls[y] = x;
+            }
+        }
+        i = j;
+    }
+
+    return classes;
+}
+
+// the piece behind target if this reference could have its address compared (function
+// pointer tables, vtables...), code referencing code is assumed to be calls & jumps.
+static TB_LinkerSectionPiece* icf_address_taken(TB_Linker* l, TB_LinkerSectionPiece* src, TB_LinkerSymbol* target, bool absolute) {
+    TB_LinkerSectionPiece* p = tb__get_piece(l, target);
+    if (p == NULL || src == NULL || (src->flags & TB_LINKER_PIECE_LIVE) == 0) {
+        return NULL;
+    }
+
+    if (!absolute && (src->parent->generic_flags & TB_LINKER_SECTION_CODE)) {
+        return NULL;
+    }
+
+    // the function's own unwind info doesn't count
+    for (TB_LinkerSectionPiece* a = p->associate; a != NULL; a = a->associate) {
+        if (a == src) return NULL;
+    }
+
+    return p;
+}
+
+void tb__icf(TB_Linker* l) {
+    // like lld's --icf=safe, anything which might get its address compared keeps it. we can't
+    // see a lea in code without decoding so those still fold (that part is /OPT:ICF semantics).
+    NL_Map(TB_LinkerSectionPiece*, int) taken = NULL;
+    for (TB_LinkerThreadInfo* info = l->first_thread_info; info; info = info->next) {
+        dyn_array_for(i, info->absolutes) {
+            TB_LinkerSectionPiece* p = icf_address_taken(l, info->absolutes[i].src_piece, info->absolutes[i].target, true);
+            if (p) nl_map_put(taken, p, 0);
+        }
+
+        dyn_array_for(i, info->relatives) {
+            TB_LinkerSectionPiece* p = icf_address_taken(l, info->relatives[i].src_piece, info->relatives[i].target, false);
+            if (p) nl_map_put(taken, p, 0);
+        }
+    }
+
+    // TB globals pointing at object file code
+    dyn_array_for(i, l->ir_modules) {
+        TB_Module* m = l->ir_modules[i];
+        dyn_array_for(j, m->sections) {
+            DynArray(TB_Global*) globals = m->sections[j].globals;
+            dyn_array_for(k, globals) {
+                TB_Global* g = globals[k];
+                FOREACH_N(o, 0, g->obj_count) {
+                    const TB_Symbol* s = g->objects[o].reloc;
+                    if (g->objects[o].type != TB_INIT_OBJ_RELOC || s->tag != TB_SYMBOL_EXTERNAL || ((uintptr_t) s->address & 1) == 0) {
+                        continue;
+                    }
+
+                    TB_LinkerSectionPiece* p = tb__get_piece(l, (TB_LinkerSymbol*) ((uintptr_t) s->address & ~1));
+                    if (p) nl_map_put(taken, p, 0);
+                }
+            }
+        }
+    }
+
+    // only object file code is up for folding, TB modules hand us one piece per section
+    DynArray(TB_LinkerSectionPiece*) pieces = NULL;
+    nl_map_for_str(i, l->sections) {
+        TB_LinkerSection* s = l->sections[i].v;
+        if ((s->generic_flags & TB_LINKER_SECTION_CODE) == 0 || (s->generic_flags & TB_LINKER_SECTION_DISCARD)) continue;
+
+        for (TB_LinkerSectionPiece* p = s->first; p != NULL; p = p->next) {
+            if (p->kind == PIECE_NORMAL && p->data != NULL && p->size > 0 && (p->flags & TB_LINKER_PIECE_LIVE) && nl_map_get(taken, p) < 0) {
+                dyn_array_put(pieces, p);
+            }
+        }
+    }
+
+    nl_map_free(taken);
+
+    size_t count = dyn_array_length(pieces);
+    if (count < 2) {
+        dyn_array_destroy(pieces);
+        return;
+    }
+
+    // the first piece of a class is the one that stays, so the order needs to be
+    // the same regardless of how the inputs were parsed.
+    qsort(pieces, count, sizeof(TB_LinkerSectionPiece*), compare_pieces_by_input);
+
+    ICF icf = { l, pieces };
+    icf.cls  = tb_platform_heap_alloc(count * sizeof(uint32_t));
+    icf.hash = tb_platform_heap_alloc(count * sizeof(uint64_t));
+    uint32_t* order   = tb_platform_heap_alloc(count * sizeof(uint32_t));
+    uint32_t* new_cls = tb_platform_heap_alloc(count * sizeof(uint32_t));
+    FOREACH_N(i, 0, count) {
+        nl_map_put(icf.index, pieces[i], i);
+    }
+
+    size_t classes;
+    CUIK_TIMED_BLOCK("contents") {
+        tb_parallel_for_pool(l->thread_pool, count, 256, &icf, icf_hash_contents_task);
+        classes = icf_partition(&icf, order, new_cls, count, true);
+        memcpy(icf.cls, new_cls, count * sizeof(uint32_t));
+    }
+
+    // classes only ever split so once the count stops moving we're done
+    CUIK_TIMED_BLOCK("refine") for (;;) {
+        tb_parallel_for_pool(l->thread_pool, count, 256, &icf, icf_hash_targets_task);
+        size_t new_classes = icf_partition(&icf, order, new_cls, count, false);
+        memcpy(icf.cls, new_cls, count * sizeof(uint32_t));
+
+        if (new_classes == classes) break;
+        classes = new_classes;
+    }
+
+    // fold everyone into their class' leader
+    size_t folded = 0, bytes_saved = 0;
+    FOREACH_N(i, 0, count) {
+        if (icf.cls[i] == i) continue;
+
+        TB_LinkerSectionPiece* p = pieces[i];
+        for (TB_LinkerSectionPiece* a = p; a != NULL; a = a->associate) {
+            a->flags &= ~TB_LINKER_PIECE_LIVE;
+        }
+
+        folded += 1;
+        bytes_saved += p->size;
+    }
+
+    if (folded > 0) {
+        #define REDIRECT(sym) do {                                                        \
+            TB_LinkerSymbol* s_ = (sym);                                                  \
+            if (s_ && s_->tag == TB_LINKER_SYMBOL_NORMAL) {                               \
+                ptrdiff_t search = nl_map_get(icf.index, s_->normal.piece);               \
+                if (search >= 0) s_->normal.piece = pieces[icf.cls[icf.index[search].v]]; \
+            }                                                                             \
+        } while (0)
+
+        // anything that can still get an address asked for it goes to the leader
+        FOREACH_N(i, 0, 1ull << l->symtab.exp) {
+            if (l->symtab.ht[i].name.length != 0) REDIRECT(&l->symtab.ht[i]);
+        }
+
+        for (TB_LinkerThreadInfo* info = l->first_thread_info; info; info = info->next) {
+            dyn_array_for(i, info->relatives) REDIRECT(info->relatives[i].target);
+            dyn_array_for(i, info->absolutes) REDIRECT(info->absolutes[i].target);
+        }
+
+        #undef REDIRECT
+    }
+
+    l->icf_folded += folded;
+    l->icf_bytes_saved += bytes_saved;
+    log_debug("icf: folded %zu of %zu pieces (%zu bytes)", folded, count, bytes_saved);
+
+    nl_map_free(icf.index);
+    tb_platform_heap_free(new_cls);
+    tb_platform_heap_free(order);
+    tb_platform_heap_free(icf.hash);
+    tb_platform_heap_free(icf.cls);
+    dyn_array_destroy(pieces);
+}
+
+////////////////////////////////
+// Incremental linking
+////////////////////////////////
+// a full link with incremental linking on leaves slack after every piece (and at the end of
+// every section) then saves where everything went into <output>.tbilk. the next link finds
+// each live piece's old spot by (input, section, ordinal), new pieces go into the leftover
+// space at the end of their section. if everything fits, the export only rewrites the pieces
+// whose bytes or relocation targets changed, otherwise it's a fresh layout and a full write.
+//
+// the state file is just the structs below back to back:
+//   IncrHeader, section_count * (IncrSectionRecord, name), piece_count * TB_LinkerIncrPiece
+#define INCR_MAGIC "TBILK\0\0\1"
+
+typedef struct {
+    char magic[8];
+    uint64_t output_size, output_stamp;
+    uint32_t section_count, piece_count;
+} IncrHeader;
+
+typedef struct {
+    uint64_t address, offset, capacity;
+    uint32_t flags, name_length;
+} IncrSectionRecord;
+
+typedef struct {
+    TB_LinkerSectionPiece* piece;
+    uint64_t offset, capacity;
+    uint32_t record;
+} IncrPlacement;
+
+// the stamp makes sure nobody replaced the output since we wrote it
+static bool incr_stat(const char* path, uint64_t* out_size, uint64_t* out_stamp) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return false;
+    }
+
+    *out_size = st.st_size;
+    #if defined(__linux__)
+    *out_stamp = (uint64_t) st.st_mtim.tv_sec * 1000000000ull + st.st_mtim.tv_nsec;
+    #else
+    *out_stamp = st.st_mtime;
+    #endif
+    return true;
+}
+
+static void incr_drop(TB_LinkerIncremental* incr) {
+    if (incr->file.data != NULL) {
+        close_file_map(&incr->file);
+    }
+
+    incr->file = (FileMap){ 0 };
+    dyn_array_destroy(incr->sections);
+    dyn_array_destroy(incr->pieces);
+}
+
+static bool incr_parse(TB_LinkerIncremental* incr) {
+    const uint8_t* data = incr->file.data;
+    size_t size = incr->file.size;
+
+    IncrHeader h;
+    if (size < sizeof(h)) return false;
+    memcpy(&h, data, sizeof(h));
+    if (memcmp(h.magic, INCR_MAGIC, sizeof(h.magic)) != 0) return false;
+
+    incr->output_size  = h.output_size;
+    incr->output_stamp = h.output_stamp;
+
+    size_t pos = sizeof(h);
+    FOREACH_N(i, 0, h.section_count) {
+        IncrSectionRecord r;
+        if (pos + sizeof(r) > size) return false;
+        memcpy(&r, &data[pos], sizeof(r));
+        pos += sizeof(r);
+
+        if (pos + r.name_length > size) return false;
+        TB_LinkerIncrSection s = { { r.name_length, &data[pos] }, r.flags, r.address, r.offset, r.capacity };
+        dyn_array_put(incr->sections, s);
+        pos += r.name_length;
+    }
+
+    if (pos + (size_t) h.piece_count * sizeof(TB_LinkerIncrPiece) != size) return false;
+    FOREACH_N(i, 0, h.piece_count) {
+        TB_LinkerIncrPiece p;
+        memcpy(&p, &data[pos], sizeof(p));
+        pos += sizeof(p);
+
+        if (p.section >= h.section_count) return false;
+        dyn_array_put(incr->pieces, p);
+    }
+
+    return true;
+}
+
+void tb__incr_begin(TB_Linker* l, const char* path) {
+    if (l->incr == NULL) {
+        l->incr = tb_platform_heap_alloc(sizeof(TB_LinkerIncremental));
+    }
+
+    TB_LinkerIncremental* incr = l->incr;
+    *incr = (TB_LinkerIncremental){ 0 };
+
+    char state_path[FILENAME_MAX];
+    snprintf(state_path, FILENAME_MAX, "%s.tbilk", path);
+
+    // no state means this is the first link
+    incr->file = open_file_map(state_path);
+    if (incr->file.data == NULL) {
+        incr->file = (FileMap){ 0 };
+        return;
+    }
+
+    if (!incr_parse(incr)) {
+        log_debug("incremental: can't read %s, doing a full link", state_path);
+        incr_drop(incr);
+        return;
+    }
+
+    uint64_t size, stamp;
+    if (!incr_stat(path, &size, &stamp) || size != incr->output_size || stamp != incr->output_stamp) {
+        log_debug("incremental: %s changed since the last link, doing a full link", path);
+        incr_drop(incr);
+    }
+}
+
+// inputs are named by their path (and the archive they came from), modules by how
+// many came before them.
+static void incr_input_keys(TB_Linker* l, TB_LinkerIncremental* incr) {
+    uint64_t module_count = 0;
+    dyn_array_for(i, l->inputs) {
+        TB_LinkerInput* in = &l->inputs[i];
+
+        uint64_t key = i > 0 ? incr->input_keys[in->parent] : TB_HASH_SEED;
+        key = tb__hash_mix(key, &in->tag, sizeof(in->tag));
+        if (in->tag == TB_LINKER_INPUT_MODULE) {
+            key = tb__hash_mix(key, &module_count, sizeof(module_count));
+            module_count++;
+        } else if (in->tag != TB_LINKER_INPUT_NULL) {
+            key = tb__hash_mix(key, in->name.data, in->name.length);
+        }
+
+        dyn_array_put(incr->input_keys, key);
+    }
+}
+
+static uint64_t incr_piece_key(TB_LinkerIncremental* incr, TB_LinkerSectionPiece* p) {
+    uint64_t key = incr->input_keys[p->input];
+    key = tb__hash_mix(key, p->parent->name.data, p->parent->name.length);
+    return tb__hash_mix(key, &p->ordinal, sizeof(p->ordinal));
+}
+
+static ptrdiff_t incr_find_piece(TB_LinkerIncremental* incr, uint64_t key) {
+    size_t lo = 0, hi = dyn_array_length(incr->pieces);
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (incr->pieces[mid].key < key) lo = mid + 1;
+        else hi = mid;
+    }
+
+    return lo < dyn_array_length(incr->pieces) && incr->pieces[lo].key == key ? lo : -1;
+}
+
+static TB_LinkerSection* incr_get_section(TB_Linker* l, TB_LinkerIncrSection* rec) {
+    ptrdiff_t search = nl_map_get(l->sections, rec->name);
+    if (search < 0) return NULL;
+
+    TB_LinkerSection* s = l->sections[search].v;
+    return s->generic_flags & TB_LINKER_SECTION_DISCARD ? NULL : s;
+}
+
+static int compare_pieces_by_offset(const void* a, const void* b) {
+    const TB_LinkerSectionPiece* p_a = *(const TB_LinkerSectionPiece**) a;
+    const TB_LinkerSectionPiece* p_b = *(const TB_LinkerSectionPiece**) b;
+    return (p_a->offset > p_b->offset) - (p_a->offset < p_b->offset);
+}
+
+static int compare_sections_by_name(const void* a, const void* b) {
+    const TB_LinkerSection* s_a = *(const TB_LinkerSection**) a;
+    const TB_LinkerSection* s_b = *(const TB_LinkerSection**) b;
+
+    size_t len = s_a->name.length < s_b->name.length ? s_a->name.length : s_b->name.length;
+    int cmp = memcmp(s_a->name.data, s_b->name.data, len);
+    if (cmp != 0) return cmp;
+    return (s_a->name.length > s_b->name.length) - (s_a->name.length < s_b->name.length);
+}
+
+void tb__incr_layout(TB_Linker* l) {
+    TB_LinkerIncremental* incr = l->incr;
+    incr_input_keys(l, incr);
+
+    size_t section_count = dyn_array_length(incr->sections);
+    size_t record_count = dyn_array_length(incr->pieces);
+    if (section_count == 0) {
+        return;
+    }
+
+    // the old layout only works for the same set of sections
+    size_t live_sections = 0;
+    nl_map_for_str(i, l->sections) {
+        live_sections += (l->sections[i].v->generic_flags & TB_LINKER_SECTION_DISCARD) == 0;
+    }
+
+    bool ok = live_sections == section_count;
+    TB_LinkerSection** sections = tb_platform_heap_alloc(section_count * sizeof(TB_LinkerSection*));
+    FOREACH_N(i, 0, section_count) {
+        sections[i] = incr_get_section(l, &incr->sections[i]);
+        if (sections[i] == NULL || sections[i]->flags != incr->sections[i].flags) {
+            ok = false;
+        }
+    }
+
+    if (!ok) {
+        log_debug("incremental: the sections changed");
+    }
+
+    // new pieces go after every old one in the section
+    uint64_t* tails = tb_platform_heap_alloc(section_count * sizeof(uint64_t));
+    size_t* records_in = tb_platform_heap_alloc(section_count * sizeof(size_t));
+    FOREACH_N(i, 0, section_count) {
+        tails[i] = 0, records_in[i] = 0;
+    }
+
+    FOREACH_N(i, 0, record_count) {
+        TB_LinkerIncrPiece* rec = &incr->pieces[i];
+        if (tails[rec->section] < rec->offset + rec->capacity) {
+            tails[rec->section] = rec->offset + rec->capacity;
+        }
+        records_in[rec->section] += 1;
+    }
+
+    // nothing gets moved until we know everything fits
+    uint8_t* taken = tb_platform_heap_alloc(record_count + 1);
+    memset(taken, 0, record_count + 1);
+
+    DynArray(IncrPlacement) placed = NULL;
+    for (size_t i = 0; ok && i < section_count; i++) {
+        TB_LinkerSection* s = sections[i];
+        size_t matched = 0, count = 0;
+
+        for (TB_LinkerSectionPiece* p = s->first; p != NULL; p = p->next, count++) {
+            ptrdiff_t r = incr_find_piece(incr, incr_piece_key(incr, p));
+            TB_LinkerIncrPiece* rec = r >= 0 ? &incr->pieces[r] : NULL;
+
+            if (rec && !taken[r] && rec->section == i && p->size <= rec->capacity && (p->align <= 1 || rec->offset % p->align == 0)) {
+                IncrPlacement pl = { p, rec->offset, rec->capacity, r };
+                dyn_array_put(placed, pl);
+
+                taken[r] = 1;
+                matched++;
+            } else {
+                uint64_t offset = p->align > 1 ? align_up(tails[i], p->align) : tails[i];
+                tails[i] = offset + p->size;
+                if (tails[i] > incr->sections[i].capacity) {
+                    log_debug("incremental: %.*s ran out of space", (int) s->name.length, s->name.data);
+                    ok = false;
+                    break;
+                }
+
+                IncrPlacement pl = { p, offset, p->size, UINT32_MAX };
+                dyn_array_put(placed, pl);
+            }
+        }
+
+        // the CRT walks these from start to end, there can't be any holes or strays
+        if ((s->generic_flags & TB_LINKER_SECTION_PACKED) && (matched != count || matched != records_in[i])) {
+            log_debug("incremental: %.*s changed", (int) s->name.length, s->name.data);
+            ok = false;
+        }
+    }
+
+    if (ok) {
+        dyn_array_for(i, placed) {
+            TB_LinkerSectionPiece* p = placed[i].piece;
+            p->offset   = placed[i].offset;
+            p->capacity = placed[i].capacity;
+
+            // the digest is what's in the old file at that spot, new spots always get written
+            if (placed[i].record != UINT32_MAX) {
+                p->digest = incr->pieces[placed[i].record].digest;
+            } else {
+                p->flags |= TB_LINKER_PIECE_DIRTY;
+            }
+        }
+
+        // keep the lists in address order
+        TB_LinkerSectionPiece** array_form = NULL;
+        FOREACH_N(i, 0, section_count) {
+            TB_LinkerSection* s = sections[i];
+            s->total_size = incr->sections[i].capacity;
+
+            array_form = tb_platform_heap_realloc(array_form, s->piece_count * sizeof(TB_LinkerSectionPiece*));
+            size_t j = 0;
+            for (TB_LinkerSectionPiece* p = s->first; p != NULL; p = p->next) {
+                array_form[j++] = p;
+            }
+            assert(j == s->piece_count);
+
+            qsort(array_form, j, sizeof(TB_LinkerSectionPiece*), compare_pieces_by_offset);
+            FOREACH_N(k, 1, j) {
+                array_form[k-1]->next = array_form[k];
+            }
+            array_form[j-1]->next = NULL;
+            s->first = array_form[0];
+            s->last  = array_form[j-1];
+        }
+        tb_platform_heap_free(array_form);
+
+        incr->relink = true;
+    } else {
+        log_debug("incremental: the old layout doesn't fit anymore, doing a full link");
+    }
+
+    dyn_array_destroy(placed);
+    tb_platform_heap_free(taken);
+    tb_platform_heap_free(records_in);
+    tb_platform_heap_free(tails);
+    tb_platform_heap_free(sections);
+}
+
+bool tb__incr_same_file_layout(TB_Linker* l, size_t size) {
+    TB_LinkerIncremental* incr = l->incr;
+    if (size != incr->output_size) {
+        return false;
+    }
+
+    dyn_array_for(i, incr->sections) {
+        TB_LinkerIncrSection* rec = &incr->sections[i];
+        TB_LinkerSection* s = incr_get_section(l, rec);
+        if (s == NULL || s->address != rec->address || s->offset != rec->offset || s->total_size != rec->capacity) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+typedef struct {
+    TB_Linker* l;
+    void* ctx;
+    TB_LinkerDigestFn fn;
+    TB_LinkerSectionPiece** pieces;
+} DigestTask;
+
+static void incr_digest_task(void* ctx, size_t start, size_t end) {
+    DigestTask* t = ctx;
+    FOREACH_N(i, start, end) {
+        TB_LinkerSectionPiece* p = t->pieces[i];
+
+        uint64_t h = tb__hash_mix(TB_HASH_SEED, &p->size, sizeof(p->size));
+        if (p->kind == PIECE_NORMAL) {
+            if (p->data != NULL) {
+                h = tb__hash_mix(h, p->data, p->size);
+            }
+        } else {
+            // the module's code doesn't exist until it's written out, it's always redone
+            p->flags |= TB_LINKER_PIECE_DIRTY;
+        }
+
+        if (t->fn) {
+            h = t->fn(t->l, p, t->ctx, h);
+        }
+
+        if (h != p->digest) {
+            p->flags |= TB_LINKER_PIECE_DIRTY;
+        }
+        p->digest = h;
+    }
+}
+
+void tb__incr_digest(TB_Linker* l, void* ctx, TB_LinkerDigestFn fn) {
+    DynArray(TB_LinkerSectionPiece*) pieces = NULL;
+    nl_map_for_str(i, l->sections) {
+        TB_LinkerSection* s = l->sections[i].v;
+        if (s->generic_flags & TB_LINKER_SECTION_DISCARD) continue;
+
+        for (TB_LinkerSectionPiece* p = s->first; p != NULL; p = p->next) {
+            dyn_array_put(pieces, p);
+        }
+    }
+
+    DigestTask t = { l, ctx, fn, pieces };
+    tb_parallel_for_pool(l->thread_pool, dyn_array_length(pieces), 16, &t, incr_digest_task);
+
+    TB_LinkerIncremental* incr = l->incr;
+    incr->total = dyn_array_length(pieces);
+    incr->patched = 0;
+    dyn_array_for(i, pieces) {
+        incr->patched += (pieces[i]->flags & TB_LINKER_PIECE_DIRTY) != 0;
+    }
+
+    dyn_array_destroy(pieces);
+}
+
+static int compare_incr_pieces(const void* a, const void* b) {
+    const TB_LinkerIncrPiece* p_a = a;
+    const TB_LinkerIncrPiece* p_b = b;
+    return (p_a->key > p_b->key) - (p_a->key < p_b->key);
+}
+
+void tb__incr_end(TB_Linker* l, const char* path, bool success) {
+    TB_LinkerIncremental* incr = l->incr;
+    incr_drop(incr);
+
+    char state_path[FILENAME_MAX];
+    snprintf(state_path, FILENAME_MAX, "%s.tbilk", path);
+
+    uint64_t output_size, output_stamp;
+    if (!success || incr->input_keys == NULL || !incr_stat(path, &output_size, &output_stamp)) {
+        remove(state_path);
+        dyn_array_destroy(incr->input_keys);
+        return;
+    }
+
+    if (!incr->relink) {
+        incr->patched = incr->total;
+    }
+
+    // sorted by name so the file doesn't depend on the section map's order
+    DynArray(TB_LinkerSection*) sections = NULL;
+    nl_map_for_str(i, l->sections) {
+        TB_LinkerSection* s = l->sections[i].v;
+        if ((s->generic_flags & TB_LINKER_SECTION_DISCARD) == 0) {
+            dyn_array_put(sections, s);
+        }
+    }
+    if (dyn_array_length(sections) > 1) {
+        qsort(sections, dyn_array_length(sections), sizeof(TB_LinkerSection*), compare_sections_by_name);
+    }
+
+    DynArray(TB_LinkerIncrPiece) pieces = NULL;
+    dyn_array_for(i, sections) {
+        for (TB_LinkerSectionPiece* p = sections[i]->first; p != NULL; p = p->next) {
+            TB_LinkerIncrPiece rec;
+            memset(&rec, 0, sizeof(rec));
+            rec.key      = incr_piece_key(incr, p);
+            rec.section  = i;
+            rec.offset   = p->offset;
+            rec.capacity = p->capacity;
+            rec.digest   = p->digest;
+            dyn_array_put(pieces, rec);
+        }
+    }
+    dyn_array_destroy(incr->input_keys);
+
+    // two inputs with the same name can't be told apart, neither gets a record
+    size_t piece_count = dyn_array_length(pieces);
+    if (piece_count > 1) {
+        qsort(pieces, piece_count, sizeof(TB_LinkerIncrPiece), compare_incr_pieces);
+    }
+
+    size_t j = 0;
+    for (size_t i = 0; i < piece_count;) {
+        size_t k = i + 1;
+        while (k < piece_count && pieces[k].key == pieces[i].key) k++;
+        if (k == i + 1) pieces[j++] = pieces[i];
+        i = k;
+    }
+    piece_count = j;
+
+    FILE* f = fopen(state_path, "wb");
+    if (f == NULL) {
+        log_debug("incremental: could not write %s", state_path);
+    } else {
+        IncrHeader h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, INCR_MAGIC, sizeof(h.magic));
+        h.output_size   = output_size;
+        h.output_stamp  = output_stamp;
+        h.section_count = dyn_array_length(sections);
+        h.piece_count   = piece_count;
+        fwrite(&h, sizeof(h), 1, f);
+
+        dyn_array_for(i, sections) {
+            TB_LinkerSection* s = sections[i];
+
+            IncrSectionRecord r;
+            memset(&r, 0, sizeof(r));
+            r.address     = s->address;
+            r.offset      = s->offset;
+            r.capacity    = s->total_size;
+            r.flags       = s->flags;
+            r.name_length = s->name.length;
+            fwrite(&r, sizeof(r), 1, f);
+            fwrite(s->name.data, s->name.length, 1, f);
+        }
+
+        fwrite(pieces, sizeof(TB_LinkerIncrPiece), piece_count, f);
+        fclose(f);
+    }
+
+    dyn_array_destroy(pieces);
+    dyn_array_destroy(sections);
 }
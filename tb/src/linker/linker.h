@@ -1,5 +1,7 @@
 #pragma once
 #include "../tb_internal.h"
+#include <futex.h>
+#include <file_map.h>
 
 typedef struct TB_LinkerSymbol TB_LinkerSymbol;
 typedef struct TB_LinkerThreadInfo TB_LinkerThreadInfo;
@@ -32,8 +34,12 @@ typedef enum {
     TB_LINKER_PIECE_IMMUTABLE = 1,
 
     // by the time GC is done, this is resolved and we can
-    // assume any pieces without this set are dead.
+    // assume any pieces without this set are dead. it's set
+    // atomically since marking runs across threads.
     TB_LINKER_PIECE_LIVE      = 2,
+
+    // when patching an incremental link, only these get written and relocated
+    TB_LINKER_PIECE_DIRTY     = 4,
 } TB_LinkerPieceFlags;
 
 typedef struct {
@@ -68,10 +74,23 @@ struct TB_LinkerSectionPiece {
     //   for a COFF .text section, this is the .pdata
     TB_LinkerSectionPiece* associate;
 
+    // whichever piece got this one marked by the GC (NULL for roots),
+    // only used for -print-gc-sections.
+    TB_LinkerSectionPiece* live_from;
+
     // vsize is the virtual size
     size_t offset, vsize, size;
+    // how much of the section the piece gets, this is more than the size
+    // when there's slack left for incremental linking.
+    size_t capacity;
+    // incremental linking: which of the input's pieces (for this section) we are
+    // and a hash of the final bytes, see tb__incr_digest.
+    uint32_t ordinal;
+    uint64_t digest;
     // this is for COFF $ management
     uint32_t order;
+    // 0 means no alignment constraints
+    uint32_t align;
     TB_LinkerPieceFlags flags;
     const uint8_t* data;
 };
@@ -79,6 +98,11 @@ struct TB_LinkerSectionPiece {
 typedef enum {
     TB_LINKER_SECTION_DISCARD = 1,
     TB_LINKER_SECTION_COMDAT  = 2,
+    // executable, the only pieces ICF looks at
+    TB_LINKER_SECTION_CODE    = 4,
+    // tables which get walked from start to end (.init_array), incremental
+    // linking can't leave any slack in these.
+    TB_LINKER_SECTION_PACKED  = 8,
 } TB_LinkerSectionFlags;
 
 struct TB_LinkerSection {
@@ -96,6 +120,9 @@ struct TB_LinkerSection {
     size_t piece_count;
     size_t total_size;
     TB_LinkerSectionPiece *first, *last;
+
+    // object files get parsed in parallel so appending pieces is locked
+    mtx_t lock;
 };
 
 typedef enum TB_LinkerSymbolTag {
@@ -129,6 +156,8 @@ typedef struct {
 typedef enum TB_LinkerSymbolFlags {
     TB_LINKER_SYMBOL_WEAK   = 1,
     TB_LINKER_SYMBOL_COMDAT = 2,
+    // ELF common symbols, any real definition beats them
+    TB_LINKER_SYMBOL_TENTATIVE = 4,
 } TB_LinkerSymbolFlags;
 
 // all symbols appended to the linker are converted into
@@ -173,8 +202,12 @@ struct TB_LinkerSymbol {
 };
 
 // MSI hash table
+// open addressing table which can be inserted into from several threads, a slot
+// is claimed by CASing the name's data pointer and becomes visible to lookups once
+// the name's length is stored (so readers can spin on claimed but unfinished slots).
 typedef struct TB_SymbolTable {
-    size_t exp, len;
+    size_t exp;
+    _Atomic size_t len;
     TB_LinkerSymbol* ht; // [1 << exp]
 } TB_SymbolTable;
 
@@ -200,8 +233,9 @@ struct TB_LinkerRelocRel {
 
     TB_LinkerInputHandle input;
 
-    uint16_t addend;
-    uint16_t type;
+    // ELF relocations carry full addends
+    int64_t addend;
+    uint32_t type;
 };
 
 typedef struct TB_LinkerRelocAbs TB_LinkerRelocAbs;
@@ -243,13 +277,71 @@ struct TB_LinkerThreadInfo {
     //   to simplify.
     DynArray(TB_LinkerRelocRel) relatives;
     DynArray(TB_LinkerRelocAbs) absolutes;
+
+    // how far the archive loader has gotten through the arrays above
+    size_t lazy_rel_pos, lazy_abs_pos, lazy_alt_pos;
 };
 
+// static libraries aren't appended wholesale, we only index the symbols from
+// their linker member and pull members in once someone references them.
+typedef struct {
+    TB_LinkerInputHandle input;
+    TB_ArchiveFileParser parser;
+
+    // one bit per member, set once it's been appended
+    uint64_t* loaded;
+} TB_LinkerArchive;
+
+typedef struct {
+    uint32_t archive, member;
+} TB_LinkerLazySymbol;
+
+// ELF COMDAT group, the copy from the earliest input wins
+typedef struct {
+    TB_LinkerInputHandle owner;
+    DynArray(TB_LinkerSectionPiece*) pieces;
+} TB_LinkerComdatGroup;
+
+// what the last incremental link left next to the output (<output>.tbilk)
+typedef struct {
+    NL_Slice name;
+    uint32_t flags;
+    uint64_t address, offset, capacity;
+} TB_LinkerIncrSection;
+
+typedef struct {
+    // (input, section, ordinal) hashed, the records are sorted by it
+    uint64_t key;
+    uint32_t section;
+    uint64_t offset, capacity, digest;
+} TB_LinkerIncrPiece;
+
+typedef struct {
+    FileMap file;
+
+    // the output has to be exactly what we left behind
+    uint64_t output_size, output_stamp;
+    DynArray(TB_LinkerIncrSection) sections;
+    DynArray(TB_LinkerIncrPiece) pieces;
+
+    // part of every piece key, see incr_input_keys
+    DynArray(uint64_t) input_keys;
+
+    // every live piece found a place in the old layout, the export only writes
+    // the dirty pieces into the existing file.
+    bool relink;
+    size_t patched, total;
+} TB_LinkerIncremental;
+
 // Format-specific vtable:
 typedef struct TB_LinkerVtbl {
     void (*init)(TB_Linker* l);
-    void (*append_object)(TB_Linker* l, TB_Slice obj_name, TB_Slice content);
+    // obj_file is already tracked, this might run on any thread (see tb__append_object)
+    void (*append_object)(TB_Linker* l, TB_LinkerInputHandle obj_file, TB_Slice obj_name, TB_Slice content);
     void (*append_library)(TB_Linker* l, TB_Slice ar_name, TB_Slice ar_file);
+    // archive members which aren't object files (COFF short imports), NULL if
+    // the format has no such thing. always called on the thread driving the linker.
+    void (*append_import)(TB_Linker* l, TB_LinkerInputHandle parent, TB_ArchiveEntry* e);
     void (*append_module)(TB_Linker* l, TB_Module* m);
     TB_ExportBuffer (*export)(TB_Linker* l);
 } TB_LinkerVtbl;
@@ -292,6 +384,38 @@ typedef struct TB_Linker {
 
     NL_Strmap(TB_UnresolvedSymbol*) unresolved_symbols;
 
+    // symbols which some archive member can define, first archive wins
+    DynArray(TB_LinkerArchive) archives;
+    NL_Strmap(TB_LinkerLazySymbol) lazy_symbols;
+
+    // ELF COMDAT group signatures we've already taken
+    NL_Strmap(TB_LinkerComdatGroup*) comdat_groups;
+
+    // optional, see tb_linker_set_thread_pool. object files are parsed on it
+    // and relocations are applied across it.
+    TB_ThreadPool* thread_pool;
+    // number of object files still being parsed
+    Futex jobs;
+    // guards the section map, the input list, the thread infos and symbol conflicts
+    mtx_t lock;
+
+    // set by tb_linker_export_to_file, the image gets written straight into
+    // a mapping of the output (see tb__map_output).
+    const char* output_path;
+    FileMap output_map;
+
+    // see tb_linker_set_incremental, incr is only around during tb_linker_export_to_file
+    bool incremental;
+    TB_LinkerIncremental* incr;
+
+    // identical code folding, see tb_linker_set_icf
+    bool icf;
+    // see tb_linker_set_print_gc_sections
+    bool print_gc;
+    // GC roots waiting for gc_mark_all
+    DynArray(TB_LinkerSectionPiece*) gc_worklist;
+    size_t icf_folded, icf_bytes_saved;
+
     // Message pump:
     //   this is how the user and linker communicate
     //
@@ -310,6 +434,10 @@ typedef struct TB_Linker {
     TB_LinkerSectionPiece* main_reloc;
     uint32_t iat_pos;
     DynArray(ImportTable) imports;
+    // DLL name -> index into imports, only valid until gen_imports culls them
+    NL_Strmap(uint32_t) import_tables;
+    // the __imp_ names we make up for every DLL import live here
+    TB_Arena import_names;
 
     TB_LinkerVtbl vtbl;
 } TB_Linker;
@@ -323,6 +451,7 @@ TB_LinkerSectionPiece* tb__get_piece(TB_Linker* l, TB_LinkerSymbol* restrict sym
 
 // TB helpers
 size_t tb__get_symbol_pos(TB_Symbol* s);
+void tb__set_module_exports(TB_Module* m, ExportList exports);
 void tb__append_module_section(TB_Linker* l, TB_LinkerInputHandle mod, TB_ModuleSection* section, const char* name, uint32_t flags);
 
 ImportThunk* tb__find_or_create_import(TB_Linker* l, TB_LinkerSymbol* restrict sym);
@@ -330,11 +459,32 @@ ImportThunk* tb__find_or_create_import(TB_Linker* l, TB_LinkerSymbol* restrict s
 // Inputs
 TB_LinkerInputHandle tb__track_module(TB_Linker* l, TB_LinkerInputHandle parent, TB_Module* mod);
 TB_LinkerInputHandle tb__track_object(TB_Linker* l, TB_LinkerInputHandle parent, TB_Slice name);
+TB_LinkerInputHandle tb__track_archive(TB_Linker* l, TB_Slice name);
+TB_LinkerThreadInfo* tb__get_thread_info(TB_Linker* l);
+
+// tracks the object and parses it, on the thread pool if there is one
+void tb__append_object(TB_Linker* l, TB_LinkerInputHandle parent, TB_Slice obj_name, TB_Slice content);
+// waits for every queued object file to finish parsing
+void tb__wait_for_objects(TB_Linker* l);
+
+// Static libraries
+void tb__append_archive(TB_Linker* l, TB_Slice ar_name, TB_Slice ar_file);
+// pulls in every archive member needed by the currently unresolved symbols, the
+// entrypoint and the extra GC roots count as references too.
+void tb__load_archive_members(TB_Linker* l, size_t root_count, const char** roots);
 
 // Symbol table
+// 64-bit fnv1a, start from TB_HASH_SEED
+#define TB_HASH_SEED 0xcbf29ce484222325ull
+uint64_t tb__hash_mix(uint64_t h, const void* data, size_t len);
+
 TB_LinkerSymbol* tb__find_symbol_cstr(TB_SymbolTable* restrict symtab, const char* name);
 TB_LinkerSymbol* tb__find_symbol(TB_SymbolTable* restrict symtab, TB_Slice name);
 TB_LinkerSymbol* tb__append_symbol(TB_SymbolTable* restrict symtab, const TB_LinkerSymbol* sym);
+// like tb__append_symbol but on a collision the stronger definition wins (then the earlier
+// input) regardless of which thread got there first. *inserted is set if the slot is new,
+// only then should the caller add it to the piece's symbol list.
+TB_LinkerSymbol* tb__define_symbol(TB_Linker* l, const TB_LinkerSymbol* sym, TB_LinkerInputHandle input, bool* inserted);
 uint64_t tb__compute_rva(TB_Linker* l, TB_Module* m, const TB_Symbol* s);
 uint64_t tb__get_symbol_rva(TB_Linker* l, TB_LinkerSymbol* sym);
 
@@ -347,7 +497,43 @@ TB_LinkerSection* tb__find_or_create_section2(TB_Linker* linker, size_t name_len
 TB_LinkerSectionPiece* tb__append_piece(TB_LinkerSection* section, int kind, size_t size, const void* data, TB_LinkerInputHandle input);
 
 size_t tb__pad_file(uint8_t* output, size_t write_pos, char pad, size_t align);
+
+// called by the backends once the final size is known, the image starts zeroed. it's
+// either a heap chunk or the mapped output file, *out is what the export returns.
+uint8_t* tb__map_output(TB_Linker* l, size_t size, TB_ExportBuffer* out);
+// copies the section pieces into the output across the thread pool
+void tb__write_pieces(TB_Linker* l, uint8_t* output, size_t image_base);
 void tb__apply_module_relocs(TB_Linker* l, TB_Module* m, uint8_t* output);
+
+// identical code folding (runs after GC when l->icf is set), the folded pieces stop
+// being live and every symbol pointing into them is moved to the kept copy. pieces
+// whose address is stored in data never fold.
+void tb__icf(TB_Linker* l);
+
+// Incremental linking
+//   tb_linker_export_to_file loads the old layout before the export and saves
+//   the new one after it, tb__finalize_sections places the pieces.
+void tb__incr_begin(TB_Linker* l, const char* path);
+void tb__incr_end(TB_Linker* l, const char* path, bool success);
+void tb__incr_layout(TB_Linker* l);
+// false if we'd be writing a different file than the one we left (tb__map_output checks)
+bool tb__incr_same_file_layout(TB_Linker* l, size_t size);
+
+// only the dirty pieces get written when patching an incremental link
+static bool tb__piece_needs_write(TB_Linker* l, TB_LinkerSectionPiece* p) {
+    return l->incr == NULL || !l->incr->relink || (p->flags & TB_LINKER_PIECE_DIRTY);
+}
+
+// called by the backend once the layout is final (but before anything gets written),
+// hashes every live piece's contents along with whatever fn mixes in about its relocations
+// and marks the ones which don't match the old output as dirty.
+typedef uint64_t (*TB_LinkerDigestFn)(TB_Linker* l, TB_LinkerSectionPiece* p, void* ctx, uint64_t h);
+void tb__incr_digest(TB_Linker* l, void* ctx, TB_LinkerDigestFn fn);
+
+// runs fn on every live piece which has relocations, across the thread pool if there is
+// one. pieces don't overlap so each call can patch its own piece without locking.
+typedef void (*TB_LinkerPieceFn)(TB_Linker* l, TB_LinkerSectionPiece* p, void* ctx);
+void tb__for_each_reloc_piece(TB_Linker* l, void* ctx, TB_LinkerPieceFn fn);
 size_t tb__apply_section_contents(TB_Linker* l, uint8_t* output, size_t write_pos, TB_LinkerSection* text, TB_LinkerSection* data, TB_LinkerSection* rdata, size_t section_alignment, size_t image_base);
 
 // do layouting (requires GC step to complete)
@@ -1,7 +1,6 @@
 #define NL_STRING_MAP_IMPL
 #include "linker.h"
 #include "../objects/coff.h"
-#include "../objects/lib_parse.h"
 
 #include <ctype.h>
 
@@ -11,7 +10,6 @@ typedef struct {
     uint16_t payload[];
 } BaseRelocSegment;
 
-static _Thread_local TB_LinkerThreadInfo* tb__linker_thread_info;
 
 const static uint8_t dos_stub[] = {
     // header
@@ -34,15 +32,6 @@ static int symbol_cmp(const void* a, const void* b) {
     return sym_a->ordinal - sym_b->ordinal;
 }
 
-// true if we replace the old one
-static bool process_comdat(int select, TB_LinkerSectionPiece* old_p, TB_LinkerSectionPiece* new_p) {
-    switch (select) {
-        case 2: return false;                     // any
-        case 6: return new_p->size > old_p->size; // largest
-        default: tb_todo();
-    }
-}
-
 // Musl's impl for this
 static int string_case_cmp(const char *_l, const char *_r, size_t n) {
     const unsigned char *l=(void *)_l, *r=(void *)_r;
@@ -60,54 +49,11 @@ static bool strprefix(const char* str, const char* pre, size_t len) {
     return string_case_cmp(pre, str, len < prelen ? len : prelen) == 0;
 }
 
-static TB_LinkerThreadInfo* get_thread_info(TB_Linker* l) {
-    if (tb__linker_thread_info == NULL) {
-        TB_LinkerThreadInfo* new_t = tb_platform_heap_alloc(sizeof(TB_LinkerThreadInfo));
-        *new_t = (TB_LinkerThreadInfo){ .parent = l };
-
-        if (l->first_thread_info == NULL) {
-            l->first_thread_info = new_t;
-        } else {
-            l->first_thread_info->next = new_t;
-            l->first_thread_info = new_t;
-        }
-
-        return (tb__linker_thread_info = new_t);
-    }
-
-    TB_LinkerThreadInfo* info = tb__linker_thread_info;
-    for (;;) {
-        // we hit our match
-        if (info->parent == l) return info;
-
-        // we didn't find a match, make a new element in the chain
-        if (info->next_in_thread == NULL) {
-            TB_LinkerThreadInfo* new_t = tb_platform_heap_alloc(sizeof(TB_LinkerThreadInfo));
-            *new_t = (TB_LinkerThreadInfo){ .parent = l };
-
-            if (l->first_thread_info == NULL) {
-                l->first_thread_info = new_t;
-            } else {
-                l->first_thread_info->next = new_t;
-                l->first_thread_info = new_t;
-            }
-
-            tb__linker_thread_info->next = new_t;
-            tb__linker_thread_info = new_t;
-            return new_t;
-        }
-        info = info->next_in_thread;
-    }
-}
-
-void pe_append_object(TB_Linker* l, TB_Slice obj_name, TB_Slice content) {
+static void pe_append_object(TB_Linker* l, TB_LinkerInputHandle obj_file, TB_Slice obj_name, TB_Slice content) {
     TB_COFF_Parser parser = { obj_name, content };
     tb_coff_parse_init(&parser);
 
-    TB_LinkerThreadInfo* info = get_thread_info(l);
-
-    // insert into object files (TODO: mark archive as parent)
-    TB_LinkerInputHandle obj_file = tb__track_object(l, 0, obj_name);
+    TB_LinkerThreadInfo* info = tb__get_thread_info(l);
 
     // Apply all sections (generate lookup for sections based on ordinals)
     TB_LinkerSectionPiece *text_piece = NULL, *pdata_piece = NULL;
@@ -201,6 +147,10 @@ void pe_append_object(TB_Linker* l, TB_Slice obj_name, TB_Slice content) {
             ls->generic_flags |= TB_LINKER_SECTION_COMDAT;
         }
 
+        if (s->flags & IMAGE_SCN_CNT_CODE) {
+            ls->generic_flags |= TB_LINKER_SECTION_CODE;
+        }
+
         const void* raw_data = s->raw_data.data;
         if (s->flags & IMAGE_SCN_CNT_UNINITIALIZED_DATA) {
             raw_data = NULL;
@@ -268,6 +218,7 @@ void pe_append_object(TB_Linker* l, TB_Slice obj_name, TB_Slice content) {
             };
 
             TB_LinkerSymbol* lnk_s = NULL;
+            bool inserted = true;
             if (sym->type == TB_OBJECT_SYMBOL_STATIC) {
                 lnk_s = tb_platform_heap_alloc(sizeof(TB_LinkerSymbol));
                 *lnk_s = s;
@@ -277,37 +228,27 @@ void pe_append_object(TB_Linker* l, TB_Slice obj_name, TB_Slice content) {
                     comdat_aux = NULL;
                 }
 
-                fprintf(stderr, "%.*s\n", (int) sym->name.length, sym->name.data);
-                lnk_s = tb__append_symbol(&l->symtab, &s);
+                s.flags |= TB_LINKER_SYMBOL_WEAK;
+                lnk_s = tb__define_symbol(l, &s, obj_file, &inserted);
             } else if (sym->type == TB_OBJECT_SYMBOL_EXTERN) {
                 if (comdat_aux) {
+                    // duplicate COMDATs get resolved in there (the losing piece is emptied),
+                    // we only see "any" and "largest" selections in practice.
+                    assert(comdat_aux->selection == 2 || comdat_aux->selection == 6);
                     s.flags |= TB_LINKER_SYMBOL_COMDAT;
-
-                    // check if it already exists as a COMDAT
-                    TB_LinkerSymbol* old = tb__find_symbol(&l->symtab, sym->name);
-                    if (old && (old->flags & TB_LINKER_SYMBOL_COMDAT)) {
-                        assert(old->tag == TB_LINKER_SYMBOL_NORMAL);
-
-                        bool replace = process_comdat(comdat_aux->selection, old->normal.piece, p);
-                        if (replace) {
-                            old->normal.piece->size = 0;
-                        } else {
-                            p->size = 0;
-                        }
-                    } else {
-                        lnk_s = tb__append_symbol(&l->symtab, &s);
-                    }
-
                     comdat_aux = NULL;
-                } else {
-                    lnk_s = tb__append_symbol(&l->symtab, &s);
                 }
+
+                lnk_s = tb__define_symbol(l, &s, obj_file, &inserted);
             }
 
-            // add to the section piece's symbol list
+            // add to the section piece's symbol list, duplicates stay on the first
+            // definition's list.
             if (lnk_s) {
-                lnk_s->next = p->first_sym;
-                p->first_sym = lnk_s;
+                if (inserted) {
+                    lnk_s->next = p->first_sym;
+                    p->first_sym = lnk_s;
+                }
 
                 sym->user_data = lnk_s;
             }
@@ -380,76 +321,52 @@ void pe_append_object(TB_Linker* l, TB_Slice obj_name, TB_Slice content) {
     tb_platform_heap_free(syms);
 }
 
-static void pe_append_library(TB_Linker* l, TB_Slice ar_name, TB_Slice ar_file) {
-    log_debug("linking against %.*s", (int) ar_name.length, ar_name.data);
-
-    TB_ArchiveFileParser ar_parser = { 0 };
-    if (!tb_archive_parse(ar_file, &ar_parser)) {
-        return;
-    }
+static void pe_append_import(TB_Linker* l, TB_LinkerInputHandle ar_input, TB_ArchiveEntry* restrict e) {
+    // import from DLL
+    TB_Slice libname = e->name;
+    NL_Slice key = { libname.length, libname.data };
+
+    // import libraries have an entry per function, so this runs thousands
+    // of times for something like kernel32.lib
+    uint32_t import_index;
+    ptrdiff_t search = nl_map_get(l->import_tables, key);
+    if (search >= 0) {
+        import_index = l->import_tables[search].v;
+    } else {
+        // we haven't used this DLL yet, make an import table for it
+        import_index = dyn_array_length(l->imports);
 
-    TB_ArchiveEntry* restrict entries = tb_platform_heap_alloc(ar_parser.member_count * sizeof(TB_ArchiveEntry));
-    size_t new_count;
-    CUIK_TIMED_BLOCK("parse_entries") {
-        new_count = tb_archive_parse_entries(&ar_parser, 0, ar_parser.member_count, entries);
+        ImportTable t = {
+            .libpath = libname,
+            .thunks = dyn_array_create(ImportThunk, 64)
+        };
+        dyn_array_put(l->imports, t);
+        nl_map_put(l->import_tables, key, import_index);
     }
 
-    FOREACH_N(i, 0, new_count) {
-        TB_ArchiveEntry* restrict e = &entries[i];
-
-        if (e->import_name.length) {
-            // import from DLL
-            TB_Slice libname = e->name;
-            ptrdiff_t import_index = -1;
-            dyn_array_for(j, l->imports) {
-                ImportTable* table = &l->imports[j];
-
-                if (table->libpath.length == libname.length &&
-                    memcmp(table->libpath.data, libname.data, libname.length) == 0) {
-                    import_index = j;
-                    break;
-                }
-            }
-
-            if (import_index < 0) {
-                // we haven't used this DLL yet, make an import table for it
-                import_index = dyn_array_length(l->imports);
-
-                ImportTable t = {
-                    .libpath = libname,
-                    .thunks = dyn_array_create(ImportThunk, 4096)
-                };
-                dyn_array_put(l->imports, t);
-            }
-
-            // make __imp_ form which refers to raw address
-            size_t newlen = e->import_name.length + sizeof("__imp_") - 1;
-            uint8_t* newstr = tb_platform_heap_alloc(newlen);
-            memcpy(newstr, "__imp_", sizeof("__imp_"));
-            memcpy(newstr + sizeof("__imp_") - 1, e->import_name.data, e->import_name.length);
-
-            TB_LinkerSymbol sym = {
-                .name = { newlen, newstr },
-                .tag = TB_LINKER_SYMBOL_IMPORT,
-                // .object_name = obj_name,
-                .import = { import_index, e->ordinal }
-            };
-            TB_LinkerSymbol* import_sym = tb__append_symbol(&l->symtab, &sym);
+    // make __imp_ form which refers to raw address
+    size_t newlen = e->import_name.length + sizeof("__imp_") - 1;
+    uint8_t* newstr = tb_arena_unaligned_alloc(&l->import_names, newlen);
+    memcpy(newstr, "__imp_", sizeof("__imp_") - 1);
+    memcpy(newstr + sizeof("__imp_") - 1, e->import_name.data, e->import_name.length);
+
+    TB_LinkerSymbol sym = {
+        .name = { newlen, newstr },
+        .tag = TB_LINKER_SYMBOL_IMPORT,
+        // .object_name = obj_name,
+        .import = { import_index, e->ordinal }
+    };
+    TB_LinkerSymbol* import_sym = tb__append_symbol(&l->symtab, &sym);
 
-            // make the thunk-like symbol
-            sym.name = e->import_name;
-            sym.tag = TB_LINKER_SYMBOL_THUNK;
-            sym.thunk.import_sym = import_sym;
-            tb__append_symbol(&l->symtab, &sym);
-        } else {
-            // fprintf(stderr, "%.*s\n", (int) e->name.length, e->name.data);
-            CUIK_TIMED_BLOCK("append object file") {
-                pe_append_object(l, e->name, e->content);
-            }
-        }
-    }
+    // make the thunk-like symbol
+    sym.name = e->import_name;
+    sym.tag = TB_LINKER_SYMBOL_THUNK;
+    sym.thunk.import_sym = import_sym;
+    tb__append_symbol(&l->symtab, &sym);
+}
 
-    tb_platform_heap_free(entries);
+static void pe_append_library(TB_Linker* l, TB_Slice ar_name, TB_Slice ar_file) {
+    tb__append_archive(l, ar_name, ar_file);
 }
 
 static void pe_append_module(TB_Linker* l, TB_Module* m) {
@@ -458,6 +375,7 @@ static void pe_append_module(TB_Linker* l, TB_Module* m) {
     CUIK_TIMED_BLOCK("layout section") {
         exports = tb_module_layout_sections(m);
     }
+    tb__set_module_exports(m, exports);
 
     TB_LinkerInputHandle mod_index = tb__track_module(l, 0, m);
 
@@ -534,56 +452,63 @@ static void pe_append_module(TB_Linker* l, TB_Module* m) {
     tb__append_module_symbols(l, m);
 }
 
+typedef struct {
+    uint8_t* output;
+    uint32_t trampoline_rva, iat_pos;
+} PERelocTask;
+
+static void apply_piece_relocs(TB_Linker* l, TB_LinkerSectionPiece* p, void* ctx) {
+    PERelocTask* t = ctx;
+    TB_LinkerSection* restrict s = p->parent;
+
+    // relative relocations
+    dyn_array_for(i, p->rel_refs) {
+        TB_LinkerRelocRel* restrict rel = &p->rel_refs[i].info->relatives[p->rel_refs[i].index];
+
+        // resolve source location
+        uint32_t target_rva = 0;
+        TB_LinkerSymbol* sym = rel->target;
+        if (sym == NULL) continue;
+
+        if (sym->tag == TB_LINKER_SYMBOL_IMPORT) {
+            target_rva = t->iat_pos + (sym->import.thunk->thunk_id * 8);
+        } else if (sym->tag == TB_LINKER_SYMBOL_THUNK) {
+            TB_LinkerSymbol* import_sym = sym->thunk.import_sym;
+            target_rva = t->trampoline_rva + (import_sym->import.thunk->thunk_id * 6);
+        } else {
+            target_rva = tb__get_symbol_rva(l, sym);
+        }
+
+        // find patch position
+        _Atomic(int32_t)* dst = (_Atomic(int32_t)*) &t->output[s->offset + p->offset + rel->src_offset];
+
+        // patch (atomically in case any relocations overlap)
+        uint32_t patch_amt = target_rva;
+        if (rel->type == TB_OBJECT_RELOC_ADDR32NB) {
+            // patch_amt -= 0;
+        } else if (rel->type == TB_OBJECT_RELOC_SECTION) {
+            patch_amt = sym->normal.piece->parent->number;
+        } else if (rel->type == TB_OBJECT_RELOC_SECREL) {
+            patch_amt -= sym->normal.piece->parent->address;
+        } else if (rel->type == TB_OBJECT_RELOC_REL32) {
+            uint32_t actual_pos = s->address + p->offset + rel->src_offset;
+            patch_amt -= actual_pos + rel->addend;
+        } else {
+            tb_todo();
+        }
+
+        atomic_fetch_add(dst, patch_amt);
+    }
+}
+
 static void apply_external_relocs(TB_Linker* l, uint8_t* output, uint64_t image_base) {
     TB_LinkerSection* text  = tb__find_section(l, ".text");
     uint32_t trampoline_rva = text->address + l->trampoline_pos;
     uint32_t iat_pos = l->iat_pos;
 
-    // TODO(NeGate): we can multithread this code with a job stealing queue
-    for (TB_LinkerThreadInfo* restrict info = l->first_thread_info; info; info = info->next) {
-        // relative relocations
-        dyn_array_for(i, info->relatives) {
-            TB_LinkerRelocRel* restrict rel = &info->relatives[i];
-            if ((rel->src_piece->flags & TB_LINKER_PIECE_LIVE) == 0) continue;
-
-            // resolve source location
-            uint32_t target_rva = 0;
-            TB_LinkerSymbol* sym = rel->target;
-            if (sym == NULL) continue;
-
-            if (sym->tag == TB_LINKER_SYMBOL_IMPORT) {
-                target_rva = iat_pos + (sym->import.thunk->thunk_id * 8);
-            } else if (sym->tag == TB_LINKER_SYMBOL_THUNK) {
-                TB_LinkerSymbol* import_sym = sym->thunk.import_sym;
-                target_rva = trampoline_rva + (import_sym->import.thunk->thunk_id * 6);
-            } else {
-                target_rva = tb__get_symbol_rva(l, sym);
-            }
-
-            // find patch position
-            TB_LinkerSectionPiece* restrict p = rel->src_piece;
-            TB_LinkerSection* restrict s = p->parent;
-
-            _Atomic(int32_t)* dst = (_Atomic(int32_t)*) &output[s->offset + p->offset + rel->src_offset];
-
-            // patch (we do it atomically in case any relocations overlap when we do multithreading)
-            uint32_t patch_amt = target_rva;
-            if (rel->type == TB_OBJECT_RELOC_ADDR32NB) {
-                // patch_amt -= 0;
-            } else if (rel->type == TB_OBJECT_RELOC_SECTION) {
-                patch_amt = sym->normal.piece->parent->number;
-            } else if (rel->type == TB_OBJECT_RELOC_SECREL) {
-                patch_amt -= sym->normal.piece->parent->address;
-            } else if (rel->type == TB_OBJECT_RELOC_REL32) {
-                uint32_t actual_pos = s->address + p->offset + rel->src_offset;
-                patch_amt -= actual_pos + rel->addend;
-            } else {
-                tb_todo();
-            }
-
-            atomic_fetch_add(dst, patch_amt);
-        }
-    }
+    // every piece patches its own bytes so they can go in parallel
+    PERelocTask t = { output, trampoline_rva, iat_pos };
+    tb__for_each_reloc_piece(l, &t, apply_piece_relocs);
 
     // this part will probably stay single threaded for simplicity
     if (l->main_reloc) {
@@ -739,6 +664,9 @@ static COFF_ImportDirectory* gen_imports(TB_Linker* l, PE_ImageDataDirectory* im
         dyn_array_set_length(l->imports, j); // trimmed
     }
 
+    // the indices moved around, nothing gets appended past this point anyways
+    nl_map_free(l->import_tables);
+
     if (import_entry_count == 0) {
         *imp_dir = (PE_ImageDataDirectory){ 0 };
         *iat_dir = (PE_ImageDataDirectory){ 0 };
@@ -890,6 +818,7 @@ static void pe_init(TB_Linker* l) {
     l->entrypoint = "mainCRTStartup";
     l->subsystem = TB_WIN_SUBSYSTEM_CONSOLE;
     l->resolve_sym = pe_resolve_sym;
+    tb_arena_create(&l->import_names, TB_ARENA_MEDIUM_CHUNK_SIZE);
 
     tb__append_symbol(&l->symtab, &(TB_LinkerSymbol){
             .name = CSTRING("__ImageBase"),
@@ -921,6 +850,11 @@ static TB_ExportBuffer pe_export(TB_Linker* l) {
     PE_ImageDataDirectory imp_dir, iat_dir;
     COFF_ImportDirectory* import_dirs;
 
+    CUIK_TIMED_BLOCK("load archive members") {
+        static const char* roots[] = { "_tls_used", "_load_config_used" };
+        tb__load_archive_members(l, COUNTOF(roots), roots);
+    }
+
     for (TB_LinkerThreadInfo* restrict info = l->first_thread_info; info; info = info->next) {
         dyn_array_for(i, info->alternates) {
             TB_LinkerSymbol* old = tb__find_symbol(&l->symtab, info->alternates[i].to);
@@ -956,6 +890,11 @@ static TB_ExportBuffer pe_export(TB_Linker* l) {
         gc_mark_root(l, l->entrypoint);
         gc_mark_root(l, "_tls_used");
         gc_mark_root(l, "_load_config_used");
+        gc_mark_all(l);
+    }
+
+    if (l->icf) CUIK_TIMED_BLOCK("ICF") {
+        tb__icf(l);
     }
 
     if (!tb__finalize_sections(l)) {
@@ -1137,9 +1076,13 @@ static TB_ExportBuffer pe_export(TB_Linker* l) {
         }
     }
 
+    TB_ExportBuffer buffer;
+    uint8_t* restrict output = tb__map_output(l, output_size, &buffer);
+    if (output == NULL) {
+        return buffer;
+    }
+
     size_t write_pos = 0;
-    TB_ExportChunk* chunk = tb_export_make_chunk(output_size);
-    uint8_t* restrict output = chunk->data;
 
     uint32_t pe_magic = 0x00004550;
     WRITE(dos_stub,    sizeof(dos_stub));
@@ -1169,7 +1112,6 @@ static TB_ExportBuffer pe_export(TB_Linker* l) {
 
     tb__apply_section_contents(l, output, write_pos, text, data, rdata, 512, opt_header.image_base);
 
-    // TODO(NeGate): multithread this too
     CUIK_TIMED_BLOCK("apply final relocations") {
         dyn_array_for(i, l->ir_modules) {
             tb__apply_module_relocs(l, l->ir_modules[i], output);
@@ -1178,13 +1120,14 @@ static TB_ExportBuffer pe_export(TB_Linker* l) {
         apply_external_relocs(l, output, opt_header.image_base);
     }
 
-    return (TB_ExportBuffer){ .total = output_size, .head = chunk, .tail = chunk };
+    return buffer;
 }
 
 TB_LinkerVtbl tb__linker_pe = {
     .init           = pe_init,
     .append_object  = pe_append_object,
     .append_library = pe_append_library,
+    .append_import  = pe_append_import,
     .append_module  = pe_append_module,
     .export         = pe_export
 };
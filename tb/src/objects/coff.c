@@ -14,6 +14,50 @@ static int compare_pdata(const void* a, const void* b) {
     return (sym_a[0] > sym_b[0]) - (sym_a[0] < sym_b[0]);
 }
 
+typedef struct {
+    DynArray(TB_ModuleSection) sections;
+    DynArray(TB_FunctionOutput*) funcs;
+    COFF_ImageReloc* relocs;
+} CoffRelocWriter;
+
+// each function knows where its relocations go (see tb__layout_relocations)
+// so these can be written in any order.
+static void coff_write_relocs_task(void* arg, size_t start, size_t end) {
+    CoffRelocWriter* ctx = arg;
+
+    FOREACH_N(j, start, end) {
+        TB_FunctionOutput* func_out = ctx->funcs[j];
+        COFF_ImageReloc* relocs = &ctx->relocs[func_out->reloc_pos];
+        size_t source_offset = func_out->code_pos;
+
+        for (TB_SymbolPatch* p = func_out->last_patch; p; p = p->prev) {
+            if (p->internal) continue;
+
+            size_t actual_pos = source_offset + p->pos;
+            size_t symbol_id = p->target->symbol_id;
+            assert(symbol_id != 0);
+
+            if (p->target->tag == TB_SYMBOL_FUNCTION || p->target->tag == TB_SYMBOL_EXTERNAL) {
+                *relocs++ = (COFF_ImageReloc){
+                    .Type = IMAGE_REL_AMD64_REL32,
+                    .SymbolTableIndex = symbol_id,
+                    .VirtualAddress = actual_pos
+                };
+            } else if (p->target->tag == TB_SYMBOL_GLOBAL) {
+                TB_Global* target_global = (TB_Global*) p->target;
+                bool is_tls = ctx->sections[target_global->parent].flags & TB_MODULE_SECTION_TLS;
+                *relocs++ = (COFF_ImageReloc){
+                    .Type = is_tls ? IMAGE_REL_AMD64_SECREL : IMAGE_REL_AMD64_REL32,
+                    .SymbolTableIndex = symbol_id,
+                    .VirtualAddress = actual_pos
+                };
+            } else {
+                tb_todo();
+            }
+        }
+    }
+}
+
 static COFF_Symbol section_sym(const char* name, int num, int sc) {
     COFF_Symbol s = { .section_number = num, .storage_class = sc, .aux_symbols_count = 1 };
     strncpy((char*) s.short_name, name, 8);
@@ -384,36 +428,9 @@ TB_ExportBuffer tb_coff_write_output(TB_Module* m, const IDebugFormat* dbg) {
             TB_ExportChunk* relocations = tb_export_make_chunk(reloc_count * sizeof(COFF_ImageReloc));
             COFF_ImageReloc* relocs = (COFF_ImageReloc*) relocations->data;
 
-            dyn_array_for(j, funcs) {
-                TB_FunctionOutput* func_out = funcs[j];
-                size_t source_offset = func_out->code_pos;
-
-                for (TB_SymbolPatch* p = func_out->last_patch; p; p = p->prev) {
-                    if (p->internal) continue;
-
-                    size_t actual_pos = source_offset + p->pos;
-                    size_t symbol_id = p->target->symbol_id;
-                    assert(symbol_id != 0);
-
-                    if (p->target->tag == TB_SYMBOL_FUNCTION || p->target->tag == TB_SYMBOL_EXTERNAL) {
-                        *relocs++ = (COFF_ImageReloc){
-                            .Type = IMAGE_REL_AMD64_REL32,
-                            .SymbolTableIndex = symbol_id,
-                            .VirtualAddress = actual_pos
-                        };
-                    } else if (p->target->tag == TB_SYMBOL_GLOBAL) {
-                        TB_Global* target_global = (TB_Global*) p->target;
-                        bool is_tls = sections[target_global->parent].flags & TB_MODULE_SECTION_TLS;
-                        *relocs++ = (COFF_ImageReloc){
-                            .Type = is_tls ? IMAGE_REL_AMD64_SECREL : IMAGE_REL_AMD64_REL32,
-                            .SymbolTableIndex = symbol_id,
-                            .VirtualAddress = actual_pos
-                        };
-                    } else {
-                        tb_todo();
-                    }
-                }
-            }
+            CoffRelocWriter ctx = { sections, funcs, relocs };
+            tb_parallel_for(m, dyn_array_length(funcs), 512, &ctx, coff_write_relocs_task);
+            relocs += sections[i].func_reloc_count;
 
             dyn_array_for(j, globals) {
                 TB_Global* g = globals[j];
@@ -25,6 +25,76 @@ static int put_symbol(TB_Emitter* stab, uint32_t name, uint8_t sym_info, uint16_
     return (stab->count / sizeof(TB_Elf64_Sym)) - 1;
 }
 
+typedef struct {
+    TB_Module* m;
+    DynArray(TB_FunctionOutput*) funcs;
+    TB_Elf64_Rela* rels;
+    size_t local_sym_count;
+} ElfRelocWriter;
+
+// each function knows where its relocations go (see tb__layout_relocations)
+// so these can be written in any order.
+static void elf_write_relocs_task(void* arg, size_t start, size_t end) {
+    ElfRelocWriter* ctx = arg;
+    TB_Module* m = ctx->m;
+
+    FOREACH_N(j, start, end) {
+        TB_FunctionOutput* func_out = ctx->funcs[j];
+        TB_Elf64_Rela* rels = &ctx->rels[func_out->reloc_pos];
+
+        size_t source_offset = func_out->code_pos;
+        for (TB_SymbolPatch* p = func_out->last_patch; p; p = p->prev) {
+            if (p->internal) continue;
+
+            size_t actual_pos = source_offset + p->pos;
+            size_t symbol_id = p->target->symbol_id;
+            if (is_nonlocal(p->target)) {
+                symbol_id += ctx->local_sym_count;
+            }
+            assert(symbol_id != 0);
+
+            if (m->target_arch == TB_ARCH_AARCH64) {
+                // the patch doesn't say which kind of reference it is, the
+                // instruction at that spot does.
+                uint32_t w;
+                memcpy(&w, &func_out->code[p->pos], sizeof(uint32_t));
+
+                TB_ELF_RelocType type;
+                if ((w & 0x9F000000) == 0x90000000) {
+                    type = TB_ELF_AARCH64_ADR_PREL_PG_HI21;
+                } else if ((w & 0xFC000000) == 0x94000000) {
+                    type = TB_ELF_AARCH64_CALL26;
+                } else if ((w & 0xFC000000) == 0x14000000) {
+                    type = TB_ELF_AARCH64_JUMP26;
+                } else {
+                    type = TB_ELF_AARCH64_ADD_ABS_LO12_NC;
+                }
+
+                *rels++ = (TB_Elf64_Rela){
+                    .offset = actual_pos,
+                    .info   = TB_ELF64_R_INFO(symbol_id, type),
+                    .addend = 0
+                };
+                continue;
+            }
+
+            // whatever the emitter left in the field is the addend (the linker &
+            // COFF just add to it), things like [sym + disp] counters or an
+            // immediate after the rel32 put something there.
+            int32_t disp;
+            memcpy(&disp, &func_out->code[p->pos], sizeof(int32_t));
+
+            TB_ELF_RelocType type = p->target->tag == TB_SYMBOL_GLOBAL ? TB_ELF_X86_64_PC32 : TB_ELF_X86_64_PLT32;
+            *rels++ = (TB_Elf64_Rela){
+                .offset = actual_pos,
+                // check when we should prefer R_X86_64_GOTPCREL
+                .info   = TB_ELF64_R_INFO(symbol_id, type),
+                .addend = disp - 4
+            };
+        }
+    }
+}
+
 static void put_section_symbols(DynArray(TB_ModuleSection) sections, TB_Emitter* strtbl, TB_Emitter* stab, int t) {
     dyn_array_for(i, sections) {
         int sec_num = sections[i].section_num;
@@ -35,7 +105,7 @@ static void put_section_symbols(DynArray(TB_ModuleSection) sections, TB_Emitter*
             TB_FunctionOutput* out_f = funcs[i];
             const char* name_str = out_f->parent->super.name;
 
-            uint32_t name = name_str ? tb_outstr_nul_UNSAFE(strtbl, name_str) : 0;
+            uint32_t name = name_str ? tb_outstr_nul(strtbl, name_str) : 0;
             out_f->parent->super.symbol_id = put_symbol(stab, name, TB_ELF64_ST_INFO(t, TB_ELF64_STT_FUNC), sec_num, out_f->code_pos, out_f->code_size);
         }
 
@@ -48,11 +118,11 @@ static void put_section_symbols(DynArray(TB_ModuleSection) sections, TB_Emitter*
 
             uint32_t name = 0;
             if (g->super.name) {
-                name = tb_outstr_nul_UNSAFE(strtbl, g->super.name);
+                name = tb_outstr_nul(strtbl, g->super.name);
             } else {
                 char buf[8];
                 snprintf(buf, 8, "$%d_%td", sec_num, i);
-                name = tb_outstr_nul_UNSAFE(strtbl, buf);
+                name = tb_outstr_nul(strtbl, buf);
             }
 
             g->super.symbol_id = put_symbol(stab, name, TB_ELF64_ST_INFO(t, TB_ELF64_STT_OBJECT), sec_num, g->pos, 0);
@@ -130,7 +200,7 @@ TB_ExportBuffer tb_elf64obj_write_output(TB_Module* m, const IDebugFormat* dbg)
             tb_outs(&strtbl, 5, ".rela");
         }
 
-        sections[i].name_pos = tb_outstr_nul_UNSAFE(&strtbl, sections[i].name);
+        sections[i].name_pos = tb_outstr_nul(&strtbl, sections[i].name);
     }
 
     // calculate symbol IDs
@@ -152,15 +222,15 @@ TB_ExportBuffer tb_elf64obj_write_output(TB_Module* m, const IDebugFormat* dbg)
 
     FOREACH_N(i, 0, exports.count) {
         TB_External* ext = exports.data[i];
-        uint32_t name = tb_outstr_nul_UNSAFE(&strtbl, ext->super.name);
+        uint32_t name = tb_outstr_nul(&strtbl, ext->super.name);
         ext->super.symbol_id = global_symtab.count / sizeof(TB_Elf64_Sym);
 
         put_symbol(&global_symtab, name, TB_ELF64_ST_INFO(TB_ELF64_STB_GLOBAL, 0), 0, 0, 0);
     }
 
-    uint32_t symtab_name = tb_outstr_nul_UNSAFE(&strtbl, ".symtab");
+    uint32_t symtab_name = tb_outstr_nul(&strtbl, ".symtab");
     TB_Elf64_Shdr strtab = {
-        .name = tb_outstr_nul_UNSAFE(&strtbl, ".strtab"),
+        .name = tb_outstr_nul(&strtbl, ".strtab"),
         .type = TB_SHT_STRTAB,
         .flags = 0,
         .addralign = 1,
@@ -204,33 +274,13 @@ TB_ExportBuffer tb_elf64obj_write_output(TB_Module* m, const IDebugFormat* dbg)
     size_t local_sym_count = local_symtab.count / sizeof(TB_Elf64_Sym);
     dyn_array_for(i, sections) if (sections[i].reloc_count > 0) {
         assert(sections[i].reloc_pos == write_pos);
-        TB_Elf64_Rela* rels = (TB_Elf64_Rela*) &output[write_pos];
-        DynArray(TB_FunctionOutput*) funcs = sections[i].funcs;
-        DynArray(TB_Global*) globals = sections[i].globals;
-
-        dyn_array_for(j, funcs) {
-            TB_FunctionOutput* func_out = funcs[j];
-
-            size_t source_offset = func_out->code_pos;
-            for (TB_SymbolPatch* p = func_out->last_patch; p; p = p->prev) {
-                if (p->internal) continue;
-
-                size_t actual_pos = source_offset + p->pos;
-                size_t symbol_id = p->target->symbol_id;
-                if (is_nonlocal(p->target)) {
-                    symbol_id += local_sym_count;
-                }
-                assert(symbol_id != 0);
-
-                TB_ELF_RelocType type = p->target->tag == TB_SYMBOL_GLOBAL ? TB_ELF_X86_64_PC32 : TB_ELF_X86_64_PLT32;
-                *rels++ = (TB_Elf64_Rela){
-                    .offset = actual_pos,
-                    // check when we should prefer R_X86_64_GOTPCREL
-                    .info   = TB_ELF64_R_INFO(symbol_id, type),
-                    .addend = -4
-                };
-            }
-        }
+        ElfRelocWriter ctx = {
+            .m = m,
+            .funcs = sections[i].funcs,
+            .rels = (TB_Elf64_Rela*) &output[write_pos],
+            .local_sym_count = local_sym_count,
+        };
+        tb_parallel_for(m, dyn_array_length(ctx.funcs), 512, &ctx, elf_write_relocs_task);
 
         write_pos += sections[i].reloc_count * sizeof(TB_Elf64_Rela);
     }
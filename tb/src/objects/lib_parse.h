@@ -54,29 +54,70 @@ bool tb_archive_parse(TB_Slice file, TB_ArchiveFileParser* restrict out_parser)
 
     // Process second member
     COFF_ArchiveMemberHeader* second = (COFF_ArchiveMemberHeader*) &file.data[file_offset];
-    if (memcmp(second->name, (char[16]) { "/               " }, 16) != 0) {
-        fprintf(stderr, "TB archive parser: second archive member name is invalid\n");
-        return false;
-    }
-    size_t second_content_length = tb__parse_decimal_int(sizeof(second->size), second->size);
+    if (memcmp(second->name, (char[16]) { "/               " }, 16) == 0) {
+        size_t second_content_length = tb__parse_decimal_int(sizeof(second->size), second->size);
 
-    // Extract number of symbols
-    if (second_content_length >= 8) {
-        memcpy(&out_parser->member_count, &second->contents[0], sizeof(uint32_t));
-        out_parser->members = (uint32_t*) &second->contents[4];
+        // Extract number of symbols
+        if (second_content_length >= 8) {
+            memcpy(&out_parser->member_count, &second->contents[0], sizeof(uint32_t));
+            out_parser->members = (uint32_t*) &second->contents[4];
 
-        memcpy(&out_parser->symbol_count, &second->contents[4 + out_parser->member_count*sizeof(uint32_t)], sizeof(uint32_t));
-        out_parser->symbols = (uint16_t*) &second->contents[8 + out_parser->member_count*sizeof(uint32_t)];
-    }
+            memcpy(&out_parser->symbol_count, &second->contents[4 + out_parser->member_count*sizeof(uint32_t)], sizeof(uint32_t));
+            out_parser->symbols = &second->contents[8 + out_parser->member_count*sizeof(uint32_t)];
 
-    // Advance
-    file_offset += sizeof(COFF_ArchiveMemberHeader) + second_content_length;
-    file_offset = (file_offset + 1u) & ~1u;
+            // the names are packed NUL terminated strings right after the indices, same order
+            size_t names_pos = 8 + out_parser->member_count*sizeof(uint32_t) + out_parser->symbol_count*sizeof(uint16_t);
+            if (names_pos <= second_content_length) {
+                out_parser->symbol_names = (TB_Slice){ second_content_length - names_pos, &second->contents[names_pos] };
+            }
+        }
+
+        // Advance
+        file_offset += sizeof(COFF_ArchiveMemberHeader) + second_content_length;
+        file_offset = (file_offset + 1u) & ~1u;
+    } else if (first_content_length >= 4) {
+        // GNU style archives only have the first member: a big endian symbol count,
+        // then one member offset per symbol followed by the names. we convert it
+        // into the second member's layout (unique member offsets + 1-based indices).
+        size_t symbol_count = read32be(&first->contents[0]);
+        if (4 + symbol_count*sizeof(uint32_t) > first_content_length) {
+            fprintf(stderr, "TB archive parser: first archive member is too small\n");
+            return false;
+        }
+
+        uint32_t* members = tb_platform_heap_alloc(symbol_count * sizeof(uint32_t));
+        uint32_t* symbols = tb_platform_heap_alloc(symbol_count * sizeof(uint32_t));
+
+        // a member's symbols aren't always next to each other so we dedup by offset
+        NL_Map(uint32_t, uint32_t) member_map = NULL;
+        size_t member_count = 0;
+        FOREACH_N(i, 0, symbol_count) {
+            uint32_t offset = read32be(&first->contents[4 + i*sizeof(uint32_t)]);
+
+            ptrdiff_t search = nl_map_get(member_map, offset);
+            if (search >= 0) {
+                symbols[i] = member_map[search].v;
+            } else {
+                members[member_count++] = offset;
+                nl_map_put(member_map, offset, member_count);
+                symbols[i] = member_count;
+            }
+        }
+        nl_map_free(member_map);
+
+        size_t names_pos = 4 + symbol_count*sizeof(uint32_t);
+        out_parser->member_count = member_count;
+        out_parser->members = members;
+        out_parser->symbol_count = symbol_count;
+        out_parser->symbols = symbols;
+        out_parser->wide_symbols = true;
+        out_parser->symbol_names = (TB_Slice){ first_content_length - names_pos, &first->contents[names_pos] };
+    }
 
     // Process long name member
     COFF_ArchiveMemberHeader* longnames = (COFF_ArchiveMemberHeader*) &file.data[file_offset];
     if (memcmp(longnames->name, (char[16]) { "//              " }, 16) == 0) {
-        size_t longname_content_length = tb__parse_decimal_int(sizeof(second->size), second->size);
+        size_t longname_content_length = tb__parse_decimal_int(sizeof(longnames->size), longnames->size);
         out_parser->strtbl = (TB_Slice){ longname_content_length, longnames->contents };
 
         // Advance
@@ -88,6 +129,28 @@ bool tb_archive_parse(TB_Slice file, TB_ArchiveFileParser* restrict out_parser)
     return true;
 }
 
+uint32_t tb_archive_symbol_member(TB_ArchiveFileParser* restrict parser, size_t i) {
+    if (parser->wide_symbols) {
+        return ((uint32_t*) parser->symbols)[i];
+    }
+
+    // the second member's indices aren't aligned
+    uint16_t member;
+    memcpy(&member, (uint8_t*) parser->symbols + i*sizeof(uint16_t), sizeof(uint16_t));
+    return member;
+}
+
+void tb_archive_free(TB_ArchiveFileParser* restrict parser) {
+    // only the GNU tables got allocated, COFF ones point into the file
+    if (parser->wide_symbols) {
+        tb_platform_heap_free(parser->members);
+        tb_platform_heap_free(parser->symbols);
+    }
+
+    parser->members = NULL;
+    parser->symbols = NULL;
+}
+
 size_t tb_archive_parse_entries(TB_ArchiveFileParser* restrict parser, size_t start, size_t count, TB_ArchiveEntry* out_entry) {
     TB_Slice file = parser->file;
     TB_Slice strtbl = parser->strtbl;
@@ -99,9 +162,13 @@ size_t tb_archive_parse_entries(TB_ArchiveFileParser* restrict parser, size_t st
 
         TB_Slice sym_name = { strchr(sym->name, ' ') - sym->name, (uint8_t*) sym->name };
         if (sym_name.data[0] == '/') {
-            // name is actually just an index into the long names table
+            // name is actually just an index into the long names table (GNU terminates with "/\n")
             size_t num = tb__parse_decimal_int(sym_name.length - 1, (char*)sym_name.data + 1);
-            sym_name = (TB_Slice){ strlen((const char*) &strtbl.data[num]), &strtbl.data[num] };
+            sym_name = (TB_Slice){ strcspn((const char*) &strtbl.data[num], "\n"), &strtbl.data[num] };
+        }
+
+        if (sym_name.length > 0 && sym_name.data[sym_name.length - 1] == '/') {
+            sym_name.length -= 1;
         }
 
         uint32_t short_form_header = *(uint32_t*)sym->contents;
@@ -1,26 +1,399 @@
-#include "coff.h"
-#include "../codegen/emitter.h"
+// WebAssembly module writer, there's no wasm linker so unlike the other object
+// formats this is the final output: every function gets its index, every global
+// gets its address and the code's padded LEBs get patched in place.
+//
+// Memory layout:
+//   [0, WASM_STACK_SIZE)    shadow stack (global 0 starts at the top)
+//   [WASM_STACK_SIZE, ...)  globals
+//   __heap_base             first free address (exported)
+#include "../wasm/wasm.h"
 
-typedef struct TB_ModuleExporter {
-    const ICodeGen* code_gen;
-    size_t write_pos;
-} TB_ModuleExporter;
+static void out_uleb(TB_Emitter* e, uint64_t x) {
+    do {
+        uint8_t b = x & 0x7F;
+        x >>= 7;
+        tb_out1b(e, b | (x ? 0x80 : 0));
+    } while (x);
+}
+
+static void out_sleb(TB_Emitter* e, int64_t x) {
+    for (;;) {
+        uint8_t b = x & 0x7F;
+        x >>= 7;
+
+        bool done = (x == 0 && (b & 0x40) == 0) || (x == -1 && (b & 0x40) != 0);
+        tb_out1b(e, b | (done ? 0 : 0x80));
+        if (done) break;
+    }
+}
+
+static void out_name(TB_Emitter* e, const char* str) {
+    size_t len = strlen(str);
+    out_uleb(e, len);
+    tb_outs(e, len, str);
+}
+
+// i32.const x; end
+static void out_i32_init(TB_Emitter* e, int32_t x) {
+    tb_out1b(e, WASM_I32_CONST);
+    out_sleb(e, x);
+    tb_out1b(e, WASM_END);
+}
+
+// sections are prefixed by their size so they're built separately
+static void out_section(TB_Emitter* e, int id, TB_Emitter* sec) {
+    tb_out1b(e, id);
+    out_uleb(e, sec->count);
+    tb_outs(e, sec->count, sec->data);
+    sec->count = 0;
+}
+
+static bool wasm_same_signature(TB_FunctionPrototype* a, TB_FunctionPrototype* b) {
+    if (a->param_count != b->param_count || a->return_count != b->return_count) {
+        return false;
+    }
+
+    // params are directly followed by returns
+    FOREACH_N(i, 0, a->param_count + a->return_count) {
+        if (wasm_valtype(a->params[i].dt) != wasm_valtype(b->params[i].dt)) {
+            return false;
+        }
+    }
+
+    return true;
+}
 
-#define WRITE(data, length_) write_data(e, output, length_, data)
-static void write_data(TB_ModuleExporter* e, uint8_t* output, size_t length, const void* data) {
-    memcpy(output + e->write_pos, data, length);
-    e->write_pos += length;
+static uint32_t wasm_intern_type(DynArray(TB_FunctionPrototype*)* types, TB_FunctionPrototype* proto) {
+    dyn_array_for(i, *types) {
+        if (wasm_same_signature((*types)[i], proto)) return i;
+    }
+
+    dyn_array_put(*types, proto);
+    return dyn_array_length(*types) - 1;
 }
 
-TB_API TB_Exports tb_wasm_write_output(TB_Module* m, const IDebugFormat* dbg) {
-    TB_ModuleExporter* e = tb_platform_heap_alloc(sizeof(TB_ModuleExporter));
-    memset(e, 0, sizeof(TB_ModuleExporter));
+// calls want the function index, everything else wants an address (function
+// pointers are table slots, slot 0 is left empty as the null pointer)
+static uint32_t wasm_symbol_value(const TB_Symbol* s, bool is_call) {
+    switch (s->tag) {
+        case TB_SYMBOL_FUNCTION: {
+            if (((TB_Function*) s)->output == NULL) {
+                tb_panic("wasm: %s was referenced but never compiled\n", s->name);
+            }
+            return is_call ? s->symbol_id : s->symbol_id + 1;
+        }
+
+        case TB_SYMBOL_EXTERNAL: {
+            if (s->symbol_id == SIZE_MAX) {
+                tb_panic("wasm: %s can't be imported\n", s->name);
+            }
+            return is_call ? s->symbol_id : s->symbol_id + 1;
+        }
+
+        case TB_SYMBOL_GLOBAL: {
+            if (is_call) tb_panic("wasm: can't call global %s\n", s->name);
+            return ((TB_Global*) s)->pos;
+        }
+
+        default:
+        tb_todo();
+        return 0;
+    }
+}
+
+TB_ExportBuffer tb_wasm_write_output(TB_Module* restrict m, const IDebugFormat* dbg) {
+    ExportList exports = tb_module_layout_sections(m);
+    TB_Arena* arena = &tb_thread_info(m)->tmp_arena;
+    TB_ArenaSavepoint sp = tb_arena_save(arena);
+
+    DynArray(TB_FunctionOutput*) funcs = NULL;
+    dyn_array_for(i, m->sections) {
+        dyn_array_for(j, m->sections[i].funcs) {
+            dyn_array_put(funcs, m->sections[i].funcs[j]);
+        }
+    }
+
+    ////////////////////////////////
+    // figure out imports
+    ////////////////////////////////
+    // externals only show up as imports if they're used, their type comes from
+    // the call sites (there's no prototype on the external itself).
+    TB_FunctionPrototype** import_protos = tb_arena_alloc(arena, (exports.count ? exports.count : 1) * sizeof(TB_FunctionPrototype*));
+    bool* import_used = tb_arena_alloc(arena, (exports.count ? exports.count : 1) * sizeof(bool));
+    FOREACH_N(i, 0, exports.count) {
+        exports.data[i]->super.symbol_id = i;
+        import_protos[i] = NULL;
+        import_used[i] = false;
+    }
+
+    dyn_array_for(i, funcs) {
+        TB_FunctionOutput* out_f = funcs[i];
+        for (TB_SymbolPatch* p = out_f->last_patch; p; p = p->prev) {
+            if (p->target->tag == TB_SYMBOL_EXTERNAL) import_used[p->target->symbol_id] = true;
+        }
+
+        dyn_array_for(j, out_f->proto_patches) {
+            const TB_Symbol* target = out_f->proto_patches[j].target;
+            if (target && target->tag == TB_SYMBOL_EXTERNAL) {
+                import_protos[target->symbol_id] = out_f->proto_patches[j].proto;
+            }
+        }
+    }
+
+    dyn_array_for(i, m->sections) {
+        dyn_array_for(j, m->sections[i].globals) {
+            TB_Global* g = m->sections[i].globals[j];
+            FOREACH_N(k, 0, g->obj_count) {
+                if (g->objects[k].type == TB_INIT_OBJ_RELOC && g->objects[k].reloc->tag == TB_SYMBOL_EXTERNAL) {
+                    import_used[g->objects[k].reloc->symbol_id] = true;
+                }
+            }
+        }
+    }
+
+    DynArray(TB_FunctionPrototype*) types = NULL;
+    DynArray(TB_External*) imports = NULL;
+    FOREACH_N(i, 0, exports.count) {
+        TB_External* e = exports.data[i];
+        if (!import_used[i]) {
+            e->super.symbol_id = SIZE_MAX;
+            continue;
+        }
+
+        if (import_protos[i] == NULL) {
+            tb_panic("wasm: %s isn't called directly anywhere, we don't know its type to import it\n", e->super.name);
+        }
+
+        e->super.symbol_id = dyn_array_length(imports);
+        wasm_intern_type(&types, import_protos[i]);
+        dyn_array_put(imports, e);
+    }
+
+    size_t import_count = dyn_array_length(imports);
+    size_t func_count = import_count + dyn_array_length(funcs);
+    dyn_array_for(i, funcs) {
+        funcs[i]->parent->super.symbol_id = import_count + i;
+        wasm_intern_type(&types, funcs[i]->parent->prototype);
+    }
+
+    ////////////////////////////////
+    // memory layout
+    ////////////////////////////////
+    uint64_t data_end = WASM_STACK_SIZE;
+    dyn_array_for(i, m->sections) {
+        dyn_array_for(j, m->sections[i].globals) {
+            TB_Global* g = m->sections[i].globals[j];
+
+            data_end = align_up(data_end, g->align ? g->align : 1);
+            g->pos = data_end;
+            data_end += g->size;
+        }
+    }
+
+    uint64_t heap_base = align_up(data_end, 16);
+    uint64_t page_count = (heap_base + WASM_PAGE_SIZE - 1) / WASM_PAGE_SIZE;
+    if (heap_base > UINT32_MAX) {
+        tb_panic("wasm: data doesn't fit into a 32bit address space\n");
+    }
+
+    ////////////////////////////////
+    // resolve patches
+    ////////////////////////////////
+    dyn_array_for(i, funcs) {
+        TB_FunctionOutput* out_f = funcs[i];
+        for (TB_SymbolPatch* p = out_f->last_patch; p; p = p->prev) {
+            // the opcode tells us what kind of index goes there
+            uint8_t op = out_f->code[p->pos - 1];
+            assert(op == WASM_CALL || op == WASM_I32_CONST);
+
+            uint32_t x = wasm_symbol_value(p->target, op == WASM_CALL);
+            wasm_put_padded_leb(&out_f->code[p->pos], x, op == WASM_I32_CONST);
+        }
+
+        dyn_array_for(j, out_f->proto_patches) {
+            TB_ProtoPatch* p = &out_f->proto_patches[j];
+            if (p->target == NULL) {
+                uint32_t type = wasm_intern_type(&types, p->proto);
+                wasm_put_padded_leb(&out_f->code[p->pos], type, false);
+            }
+        }
+    }
+
+    ////////////////////////////////
+    // sections
+    ////////////////////////////////
+    TB_Emitter e = { 0 };
+    TB_Emitter sec = { 0 };
+
+    tb_out4b(&e, 0x6D736100); // magic   \0asm
+    tb_out4b(&e, 1);          // version
+
+    // types
+    out_uleb(&sec, dyn_array_length(types));
+    dyn_array_for(i, types) {
+        TB_FunctionPrototype* proto = types[i];
+
+        tb_out1b(&sec, WASM_FUNC);
+        out_uleb(&sec, proto->param_count);
+        FOREACH_N(j, 0, proto->param_count) {
+            tb_out1b(&sec, wasm_valtype(proto->params[j].dt));
+        }
+
+        TB_PrototypeParam* rets = TB_PROTOTYPE_RETURNS(proto);
+        out_uleb(&sec, proto->return_count);
+        FOREACH_N(j, 0, proto->return_count) {
+            tb_out1b(&sec, wasm_valtype(rets[j].dt));
+        }
+    }
+    out_section(&e, WASM_SEC_TYPE, &sec);
+
+    // imports
+    if (import_count) {
+        out_uleb(&sec, import_count);
+        dyn_array_for(i, imports) {
+            TB_External* ext = imports[i];
+            out_name(&sec, "env");
+            out_name(&sec, ext->super.name);
+            tb_out1b(&sec, WASM_EXTERN_FUNC);
+            out_uleb(&sec, wasm_intern_type(&types, import_protos[i]));
+        }
+        out_section(&e, WASM_SEC_IMPORT, &sec);
+    }
+
+    // function signatures
+    out_uleb(&sec, dyn_array_length(funcs));
+    dyn_array_for(i, funcs) {
+        out_uleb(&sec, wasm_intern_type(&types, funcs[i]->parent->prototype));
+    }
+    out_section(&e, WASM_SEC_FUNCTION, &sec);
+
+    // function pointer table
+    out_uleb(&sec, 1);
+    tb_out1b(&sec, WASM_FUNCREF);
+    tb_out1b(&sec, 0x01); // min & max
+    out_uleb(&sec, func_count + 1);
+    out_uleb(&sec, func_count + 1);
+    out_section(&e, WASM_SEC_TABLE, &sec);
+
+    // memory
+    out_uleb(&sec, 1);
+    tb_out1b(&sec, 0x00); // just min
+    out_uleb(&sec, page_count);
+    out_section(&e, WASM_SEC_MEMORY, &sec);
+
+    // globals
+    out_uleb(&sec, 2);
+    tb_out1b(&sec, WASM_I32), tb_out1b(&sec, 1); // __stack_pointer (mutable)
+    out_i32_init(&sec, WASM_STACK_SIZE);
+    tb_out1b(&sec, WASM_I32), tb_out1b(&sec, 0); // __heap_base
+    out_i32_init(&sec, heap_base);
+    out_section(&e, WASM_SEC_GLOBAL, &sec);
+
+    // exports
+    size_t export_count = 3;
+    dyn_array_for(i, funcs) {
+        export_count += funcs[i]->linkage == TB_LINKAGE_PUBLIC;
+    }
+
+    out_uleb(&sec, export_count);
+    out_name(&sec, "memory");
+    tb_out1b(&sec, WASM_EXTERN_MEMORY), out_uleb(&sec, 0);
+    out_name(&sec, "__indirect_function_table");
+    tb_out1b(&sec, WASM_EXTERN_TABLE), out_uleb(&sec, 0);
+    out_name(&sec, "__heap_base");
+    tb_out1b(&sec, WASM_EXTERN_GLOBAL), out_uleb(&sec, 1);
+    dyn_array_for(i, funcs) {
+        if (funcs[i]->linkage == TB_LINKAGE_PUBLIC) {
+            out_name(&sec, funcs[i]->parent->super.name);
+            tb_out1b(&sec, WASM_EXTERN_FUNC);
+            out_uleb(&sec, funcs[i]->parent->super.symbol_id);
+        }
+    }
+    out_section(&e, WASM_SEC_EXPORT, &sec);
+
+    // every function goes into the table (starting at slot 1)
+    out_uleb(&sec, 1);
+    tb_out1b(&sec, 0x00);
+    out_i32_init(&sec, 1);
+    out_uleb(&sec, func_count);
+    FOREACH_N(i, 0, func_count) {
+        out_uleb(&sec, i);
+    }
+    out_section(&e, WASM_SEC_ELEM, &sec);
+
+    // code
+    out_uleb(&sec, dyn_array_length(funcs));
+    dyn_array_for(i, funcs) {
+        out_uleb(&sec, funcs[i]->code_size);
+        tb_outs(&sec, funcs[i]->code_size, funcs[i]->code);
+    }
+    out_section(&e, WASM_SEC_CODE, &sec);
+
+    // data, one active segment per initialized global
+    size_t segment_count = 0;
+    dyn_array_for(i, m->sections) {
+        dyn_array_for(j, m->sections[i].globals) {
+            segment_count += m->sections[i].globals[j]->obj_count > 0;
+        }
+    }
+
+    if (segment_count) {
+        out_uleb(&sec, segment_count);
+        dyn_array_for(i, m->sections) {
+            dyn_array_for(j, m->sections[i].globals) {
+                TB_Global* g = m->sections[i].globals[j];
+                if (g->obj_count == 0) continue;
+
+                tb_out1b(&sec, 0x00);
+                out_i32_init(&sec, g->pos);
+                out_uleb(&sec, g->size);
+
+                uint8_t* data = tb_out_reserve(&sec, g->size);
+                memset(data, 0, g->size);
+                FOREACH_N(k, 0, g->obj_count) {
+                    TB_InitObj* obj = &g->objects[k];
+                    if (obj->type == TB_INIT_OBJ_REGION) {
+                        assert(obj->offset + obj->region.size <= g->size);
+                        memcpy(&data[obj->offset], obj->region.ptr, obj->region.size);
+                    } else {
+                        uint32_t x = wasm_symbol_value(obj->reloc, false);
+                        memcpy(&data[obj->offset], &x, sizeof(x));
+                    }
+                }
+                tb_out_commit(&sec, g->size);
+            }
+        }
+        out_section(&e, WASM_SEC_DATA, &sec);
+    }
+
+    // function names for debuggers and disassemblers
+    out_name(&sec, "name");
+    {
+        TB_Emitter names = { 0 };
+        out_uleb(&names, func_count);
+        dyn_array_for(i, imports) {
+            out_uleb(&names, i);
+            out_name(&names, imports[i]->super.name);
+        }
+        dyn_array_for(i, funcs) {
+            out_uleb(&names, import_count + i);
+            out_name(&names, funcs[i]->parent->super.name);
+        }
+
+        out_section(&sec, 1, &names);
+        tb_platform_heap_free(names.data);
+    }
+    out_section(&e, WASM_SEC_CUSTOM, &sec);
+
+    TB_ExportChunk* chunk = tb_export_make_chunk(e.count);
+    memcpy(chunk->data, e.data, e.count);
 
-    // Module header
-    TB_Emitter emit = { 0 };
-    tb_out4b(&emit, 0x6D736100); // MAGIC   \0asm
-    tb_out4b(&emit, 0x1);        // VERSION 1
+    tb_platform_heap_free(e.data);
+    tb_platform_heap_free(sec.data);
+    dyn_array_destroy(types);
+    dyn_array_destroy(imports);
+    dyn_array_destroy(funcs);
+    tb_arena_restore(arena, sp);
 
-    tb_platform_heap_free(e);
-    return (TB_Exports){ .count = 1, .files = { { emit.count, emit.data } } };
+    return (TB_ExportBuffer){ .total = chunk->size, .head = chunk, .tail = chunk };
 }
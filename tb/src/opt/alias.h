@@ -0,0 +1,186 @@
+// Alias analysis: answers whether two memory operations might touch the
+// same bytes, we know about:
+//
+//   provenance: distinct LOCALs and globals never overlap, and LOCALs and
+//     restrict params which don't escape can't be reached by any other pointer.
+//
+//   offsets: constant MEMBER_ACCESS chains off the same base.
+//
+//   types: frontends can tag loads and stores with alias classes (C's strict
+//     aliasing), different non-zero classes never overlap.
+typedef struct {
+    TB_Node* base;
+    int64_t offset;
+    bool known_offset;
+} AliasAddr;
+
+static AliasAddr alias_addr(TB_Node* n) {
+    AliasAddr a = { n, 0, true };
+    for (;;) {
+        if (a.base->type == TB_MEMBER_ACCESS) {
+            a.offset += TB_NODE_GET_EXTRA_T(a.base, TB_NodeMember)->offset;
+        } else if (a.base->type == TB_ARRAY_ACCESS) {
+            a.known_offset = false;
+        } else {
+            return a;
+        }
+
+        a.base = a.base->inputs[1];
+    }
+}
+
+static bool is_noalias_param(TB_Function* f, TB_Node* n) {
+    if (n->type != TB_PROJ || n->inputs[0] != f->start_node) {
+        return false;
+    }
+
+    int i = TB_NODE_GET_EXTRA_T(n, TB_NodeProj)->index - 3;
+    return i >= 0 && i < 64 && (f->noalias_params >> i) & 1;
+}
+
+// objects which are known to be distinct from any other identified object
+static bool is_identified_object(TB_Function* f, TB_Node* n) {
+    return n->type == TB_LOCAL || n->type == TB_SYMBOL || is_noalias_param(f, n);
+}
+
+static bool is_same_base(TB_Node* a, TB_Node* b) {
+    if (a->type == TB_SYMBOL && b->type == TB_SYMBOL) {
+        return TB_NODE_GET_EXTRA_T(a, TB_NodeSymbol)->sym == TB_NODE_GET_EXTRA_T(b, TB_NodeSymbol)->sym;
+    }
+
+    return a == b;
+}
+
+// a pointer escapes once it's used as anything but an address, from there
+// any unknown pointer might be pointing at it.
+static bool pointer_escapes(TB_Passes* restrict p, TB_Node* n) {
+    for (User* u = find_users(p, n); u; u = u->next) {
+        TB_Node* use = u->n;
+        switch (use->type) {
+            case TB_MEMBER_ACCESS:
+            case TB_ARRAY_ACCESS:
+            if (u->slot != 1 || pointer_escapes(p, use)) return true;
+            break;
+
+            case TB_LOAD:
+            case TB_READ:
+            case TB_STORE:
+            case TB_WRITE:
+            case TB_MEMSET:
+            if (u->slot != 2) return true;
+            break;
+
+            case TB_MEMCPY:
+            if (u->slot != 2 && u->slot != 3) return true;
+            break;
+
+            default:
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static int alias_class(TB_Node* n) {
+    return n->type == TB_LOAD || n->type == TB_STORE ? TB_NODE_GET_EXTRA_T(n, TB_NodeMemAccess)->alias_class : 0;
+}
+
+// returns the number of addresses the memory op touches (MEMCPY has two),
+// sizes are in bytes and -1 if unknown.
+static int mem_op_addrs(TB_Passes* restrict p, TB_Node* n, TB_Node* addrs[2], int64_t sizes[2]) {
+    ICodeGen* cg = tb__find_code_generator(p->f->super.module);
+
+    switch (n->type) {
+        case TB_LOAD:
+        case TB_STORE: {
+            TB_DataType dt = n->type == TB_LOAD ? n->dt : n->inputs[3]->dt;
+            int bits = bits_in_data_type(cg->pointer_size, dt);
+
+            addrs[0] = n->inputs[2];
+            sizes[0] = bits ? (bits + 7) / 8 : -1;
+            return 1;
+        }
+
+        case TB_MEMSET:
+        case TB_MEMCPY: {
+            TB_Node* size = n->inputs[4];
+            int64_t known_size = size->type == TB_INTEGER_CONST ? TB_NODE_GET_EXTRA_T(size, TB_NodeInt)->value : -1;
+
+            addrs[0] = n->inputs[2], sizes[0] = known_size;
+            addrs[1] = n->inputs[3], sizes[1] = known_size;
+            return n->type == TB_MEMCPY ? 2 : 1;
+        }
+
+        default:
+        return 0;
+    }
+}
+
+static TB_AliasResult alias_addrs(TB_Passes* restrict p, TB_Node* a, int64_t a_size, TB_Node* b, int64_t b_size, bool distinct_classes) {
+    // the exact same address node, it doesn't matter if we can't
+    // figure out the offset.
+    if (a == b && a_size >= 0 && a_size == b_size) {
+        return TB_MUST_ALIAS;
+    }
+
+    AliasAddr x = alias_addr(a), y = alias_addr(b);
+
+    // same base, we just compare the ranges (this ignores the alias
+    // classes on purpose, it's how unions get punned).
+    if (is_same_base(x.base, y.base)) {
+        if (!x.known_offset || !y.known_offset || a_size < 0 || b_size < 0) {
+            return TB_MAY_ALIAS;
+        } else if (x.offset == y.offset && a_size == b_size) {
+            return TB_MUST_ALIAS;
+        } else if (x.offset + a_size <= y.offset || y.offset + b_size <= x.offset) {
+            return TB_NO_ALIAS;
+        } else {
+            return TB_MAY_ALIAS;
+        }
+    }
+
+    TB_Function* f = p->f;
+    bool x_ident = is_identified_object(f, x.base);
+    bool y_ident = is_identified_object(f, y.base);
+
+    // two different objects don't overlap and if one of them never leaks
+    // its address, the other pointer can't be pointing into it.
+    if (x_ident && y_ident) {
+        return TB_NO_ALIAS;
+    } else if ((x_ident && x.base->type != TB_SYMBOL && !pointer_escapes(p, x.base)) ||
+               (y_ident && y.base->type != TB_SYMBOL && !pointer_escapes(p, y.base))) {
+        return TB_NO_ALIAS;
+    }
+
+    return distinct_classes ? TB_NO_ALIAS : TB_MAY_ALIAS;
+}
+
+TB_AliasResult tb_pass_alias(TB_Passes* p, TB_Node* a, TB_Node* b) {
+    TB_Node* a_addrs[2];
+    TB_Node* b_addrs[2];
+    int64_t a_sizes[2], b_sizes[2];
+
+    int a_count = mem_op_addrs(p, a, a_addrs, a_sizes);
+    int b_count = mem_op_addrs(p, b, b_addrs, b_sizes);
+    if (a_count == 0 || b_count == 0) {
+        return TB_MAY_ALIAS;
+    }
+
+    int ac = alias_class(a), bc = alias_class(b);
+    bool distinct_classes = ac != 0 && bc != 0 && ac != bc;
+
+    TB_AliasResult result = TB_NO_ALIAS;
+    FOREACH_N(i, 0, a_count) FOREACH_N(j, 0, b_count) {
+        TB_AliasResult r = alias_addrs(p, a_addrs[i], a_sizes[i], b_addrs[j], b_sizes[j], distinct_classes);
+        if (r == TB_MAY_ALIAS) {
+            return TB_MAY_ALIAS;
+        } else if (r == TB_MUST_ALIAS) {
+            // memcpy touches more than just the one overlap
+            if (a_count > 1 || b_count > 1) return TB_MAY_ALIAS;
+            result = TB_MUST_ALIAS;
+        }
+    }
+
+    return result;
+}
@@ -143,9 +143,10 @@ static Lattice* dataflow_arith(TB_Passes* restrict opt, LatticeUniverse* uni, TB
         max = wrapped_int_add(a->_int.max, b->_int.max);
         break;
 
+        // the smallest difference comes from the biggest subtrahend
         case TB_SUB:
-        min = wrapped_int_sub(a->_int.min, b->_int.min);
-        max = wrapped_int_sub(a->_int.max, b->_int.max);
+        min = wrapped_int_sub(a->_int.min, b->_int.max);
+        max = wrapped_int_sub(a->_int.max, b->_int.min);
         break;
 
         case TB_MUL:
@@ -161,8 +162,9 @@ static Lattice* dataflow_arith(TB_Passes* restrict opt, LatticeUniverse* uni, TB
         // if we overflow, default to the full range
         if (n->type == TB_SUB) {
             // subtraction does overflow check different from add or mul
-            if (sub_overflow(a->_int.min, b->_int.min, min, n->dt.data) ||
-                sub_overflow(a->_int.max, b->_int.max, max, n->dt.data)
+            if (sub_overflow(a->_int.min, b->_int.max, min, n->dt.data) ||
+                sub_overflow(a->_int.max, b->_int.min, max, n->dt.data) ||
+                wrapped_int_lt(max, min, n->dt.data)
             ) {
                 min = lattice_int_min(n->dt.data);
                 max = lattice_int_max(n->dt.data);
@@ -3,6 +3,76 @@
 static uint32_t node_hash(void* a) { return ((TB_Node*) a)->gvn; }
 static bool node_compare(void* a, void* b) { return a == b; }
 
+////////////////////////////////
+// Loop nesting
+////////////////////////////////
+// any edge into a block which dominates the source is a backedge, every
+// block which reaches that backedge without passing through the header is
+// in the loop.
+static void compute_loop_depth(TB_Passes* p, TB_CFG* cfg) {
+    TB_Node** blocks = p->worklist.items;
+
+    TB_ArenaSavepoint sp = tb_arena_save(tmp_arena);
+    TB_Node** stack = tb_arena_alloc(tmp_arena, cfg->block_count * sizeof(TB_Node*));
+    int* claimed = tb_arena_alloc(tmp_arena, cfg->block_count * sizeof(int));
+    FOREACH_N(i, 0, cfg->block_count) {
+        claimed[i] = -1;
+    }
+
+    FOREACH_N(i, 1, cfg->block_count) {
+        TB_Node* header = blocks[i];
+        if (header->type != TB_REGION) {
+            continue;
+        }
+
+        FOREACH_N(j, 0, header->input_count) {
+            TB_Node* latch = get_pred(header, j);
+            ptrdiff_t search = nl_map_get(cfg->node_to_block, latch);
+            if (search < 0 || !tb_is_dominated_by(*cfg, header, latch)) {
+                continue;
+            }
+
+            if (claimed[i] != i) {
+                claimed[i] = i;
+                nl_map_get_checked(cfg->node_to_block, header).loop_depth += 1;
+            }
+
+            // walk backwards from the latch until we hit the header (it's
+            // already claimed so we'll stop there)
+            TB_BasicBlock* latch_bb = &cfg->node_to_block[search].v;
+            if (claimed[latch_bb->id] == i) {
+                continue;
+            }
+
+            size_t top = 0;
+            claimed[latch_bb->id] = i;
+            stack[top++] = latch;
+            while (top > 0) {
+                TB_Node* bb_node = stack[--top];
+                TB_BasicBlock* bb = &nl_map_get_checked(cfg->node_to_block, bb_node);
+                bb->loop_depth += 1;
+
+                size_t pred_count = bb_node->type == TB_REGION ? bb_node->input_count : 1;
+                FOREACH_N(k, 0, pred_count) {
+                    TB_Node* pred = get_pred(bb_node, k);
+                    ptrdiff_t pred_search = nl_map_get(cfg->node_to_block, pred);
+                    if (pred_search < 0) {
+                        continue;
+                    }
+
+                    int pred_id = cfg->node_to_block[pred_search].v.id;
+                    if (pred_id != 0 && claimed[pred_id] != i) {
+                        claimed[pred_id] = i;
+                        stack[top++] = pred;
+                    }
+                }
+            }
+        }
+    }
+
+    tb_arena_restore(tmp_arena, sp);
+}
+
 ////////////////////////////////
 // Early scheduling
 ////////////////////////////////
@@ -45,6 +115,18 @@ static void schedule_early(TB_Passes* p, TB_Node* n) {
 
         nl_hashset_put2(&best->items, n, node_hash, node_compare);
         nl_map_put(p->scheduled, n, best);
+    } else if (n->type == TB_PROJ && n->inputs[0]->type != TB_START && nl_map_get(p->scheduled, n) < 0) {
+        // projections of floating tuples (atomics) weren't pinned by the control
+        // walk, they just go wherever their tuple went. START's projections are
+        // left alone, isel rematerializes those.
+        ptrdiff_t search = nl_map_get(p->scheduled, n->inputs[0]);
+        if (search >= 0) {
+            TB_BasicBlock* bb = p->scheduled[search].v;
+            DO_IF(TB_OPTDEBUG_GCM)(printf("%s: proj v%u into .bb%d\n", p->f->super.name, n->gvn, bb->id));
+
+            nl_hashset_put2(&bb->items, n, node_hash, node_compare);
+            nl_map_put(p->scheduled, n, bb);
+        }
     }
 }
 
@@ -68,6 +150,24 @@ static TB_BasicBlock* find_lca(TB_Passes* p, TB_BasicBlock* a, TB_BasicBlock* b)
     return a;
 }
 
+// loop invariant code motion is only fine if we're not introducing
+// new traps, loads which still have a control dependency can't even
+// get here (their control input makes for the early block).
+static bool can_speculate(TB_Node* n) {
+    switch (n->type) {
+        case TB_SDIV:
+        case TB_UDIV:
+        case TB_SMOD:
+        case TB_UMOD: {
+            TB_Node* b = n->inputs[2];
+            return b->type == TB_INTEGER_CONST && TB_NODE_GET_EXTRA_T(b, TB_NodeInt)->value != 0;
+        }
+
+        default:
+        return true;
+    }
+}
+
 static void schedule_late(TB_Passes* p, TB_Node* n) {
     // pinned nodes can't be rescheduled
     if (!is_pinned(n)) {
@@ -105,6 +205,27 @@ static void schedule_late(TB_Passes* p, TB_Node* n) {
             lca = find_lca(p, lca, use_block);
         }
 
+        // the LCA is the latest we can go but anything on the dom tree between
+        // that and the early block is valid, Click picks the shallowest loop nest
+        // there (latest on ties to keep the live ranges short).
+        ptrdiff_t early_search = nl_map_get(p->scheduled, n);
+        if (lca != NULL && early_search >= 0 && can_speculate(n)) {
+            TB_BasicBlock* early = p->scheduled[early_search].v;
+            TB_BasicBlock* best = lca;
+
+            for (TB_BasicBlock* bb = lca; bb != early && bb->dom_depth > early->dom_depth;) {
+                bb = idom_bb(p, bb);
+                if (bb == NULL) break;
+
+                if (bb->loop_depth < best->loop_depth) {
+                    best = bb;
+                }
+            }
+
+            DO_IF(TB_OPTDEBUG_GCM)(if (best != lca) printf("  HOIST v%u out of .bb%d\n", n->gvn, lca->id));
+            lca = best;
+        }
+
         // tb_assert(lca, "missing least common ancestor");
         if (lca != NULL) {
             TB_OPTDEBUG(GCM)(
@@ -140,6 +261,7 @@ void tb_pass_schedule(TB_Passes* p, TB_CFG cfg) {
         CUIK_TIMED_BLOCK("dominators") {
             // jarvis pull up the dommies
             tb_compute_dominators(p->f, p, cfg);
+            compute_loop_depth(p, &cfg);
 
             worklist_clear_visited(ws);
             FOREACH_N(i, 0, cfg.block_count) {
@@ -82,6 +82,7 @@ static size_t extra_bytes(TB_Node* n) {
 
         case TB_CALL:
         case TB_SYSCALL:
+        case TB_TAILCALL:
         return sizeof(TB_NodeCall);
 
         case TB_LOAD:
@@ -181,7 +182,7 @@ bool gvn_compare(void* a, void* b) {
         case TB_LOAD: {
             TB_NodeMemAccess* am = TB_NODE_GET_EXTRA(x);
             TB_NodeMemAccess* bm = TB_NODE_GET_EXTRA(y);
-            return am->align == bm->align;
+            return am->align == bm->align && am->alias_class == bm->alias_class;
         }
 
         case TB_MEMBER_ACCESS: {
@@ -0,0 +1,656 @@
+// Whole-program passes (tb_module_ipo), these run over every function in the
+// module before any of them get compiled so they can see every call site and
+// every use of a symbol:
+//
+//   inline: small callees are copied into their callers, we walk the call graph
+//     bottom-up so by the time a function is copied it's already had its own
+//     callees inlined. START's projections become the call's inputs and the
+//     call's projections become whatever fed the callee's END. With a profile
+//     loaded the hot call sites get a bigger size budget.
+//
+//   dead symbols: anything the public symbols (and the few things codegen can
+//     reference on it's own) can't reach gets tombstoned, this is what cleans up
+//     the static functions which got inlined everywhere.
+//
+//   read-only globals: private globals which only ever get loaded from are
+//     marked so the load peepholes can fold them into constants.
+enum {
+    // callees with more nodes than this aren't copied
+    IPO_INLINE_LIMIT = 128,
+    // ... unless the call site is hot, that is it ran at least 1/IPO_HOT_FRACTION
+    // as often as the hottest call edge in the profile.
+    IPO_HOT_INLINE_LIMIT = 512,
+    IPO_HOT_FRACTION = 16,
+    // we stop inlining into a function once it's this many nodes
+    IPO_GROWTH_LIMIT = 4096,
+};
+
+typedef struct {
+    TB_Function* f;
+
+    // reachable nodes, these are only filled once the function
+    // is done (all it's own inlining is complete)
+    DynArray(TB_Node*) nodes;
+
+    // 0 = unvisited, 1 = on the stack, 2 = done
+    uint8_t state;
+    bool can_inline;
+} IPOFunc;
+
+typedef struct {
+    TB_Module* m;
+    Worklist ws;
+
+    DynArray(IPOFunc) funcs;
+    NL_Map(TB_Symbol*, size_t) func_index;
+
+    size_t inlined, killed, constants;
+} IPOCtx;
+
+static size_t ipo_clone_size(TB_Node* n) {
+    switch (n->type) {
+        case TB_INTEGER_CONST: return sizeof(TB_NodeInt);
+        case TB_FLOAT32_CONST: return sizeof(TB_NodeFloat32);
+        case TB_FLOAT64_CONST: return sizeof(TB_NodeFloat64);
+        case TB_SYMBOL:        return sizeof(TB_NodeSymbol);
+        case TB_LOCAL:         return sizeof(TB_NodeLocal);
+        case TB_PROJ:          return sizeof(TB_NodeProj);
+        case TB_REGION:        return sizeof(TB_NodeRegion);
+        case TB_MEMBER_ACCESS: return sizeof(TB_NodeMember);
+        case TB_ARRAY_ACCESS:  return sizeof(TB_NodeArray);
+
+        case TB_BRANCH: {
+            TB_NodeBranch* br = TB_NODE_GET_EXTRA(n);
+            return sizeof(TB_NodeBranch) + ((br->succ_count - 1) * sizeof(int64_t));
+        }
+
+        case TB_CALL:
+        case TB_SYSCALL: {
+            // we only need to know how many projections it's got
+            TB_NodeCall* c = TB_NODE_GET_EXTRA(n);
+            size_t proj_count = c->proto ? 2 + (c->proto->return_count > 1 ? c->proto->return_count : 1) : 3;
+            return sizeof(TB_NodeCall) + (proj_count * sizeof(TB_Node*));
+        }
+
+        case TB_AND:
+        case TB_OR:
+        case TB_XOR:
+        case TB_ADD:
+        case TB_SUB:
+        case TB_MUL:
+        case TB_SHL:
+        case TB_SHR:
+        case TB_SAR:
+        case TB_ROL:
+        case TB_ROR:
+        case TB_UDIV:
+        case TB_SDIV:
+        case TB_UMOD:
+        case TB_SMOD:
+        return sizeof(TB_NodeBinopInt);
+
+        case TB_LOAD:
+        case TB_STORE:
+        case TB_MEMCPY:
+        case TB_MEMSET:
+        case TB_READ:
+        case TB_WRITE:
+        return sizeof(TB_NodeMemAccess);
+
+        case TB_ATOMIC_LOAD:
+        case TB_ATOMIC_XCHG:
+        case TB_ATOMIC_ADD:
+        case TB_ATOMIC_SUB:
+        case TB_ATOMIC_AND:
+        case TB_ATOMIC_XOR:
+        case TB_ATOMIC_OR:
+        case TB_ATOMIC_CAS:
+        return sizeof(TB_NodeAtomic);
+
+        case TB_CMP_EQ:
+        case TB_CMP_NE:
+        case TB_CMP_ULT:
+        case TB_CMP_ULE:
+        case TB_CMP_SLT:
+        case TB_CMP_SLE:
+        case TB_CMP_FLT:
+        case TB_CMP_FLE:
+        return sizeof(TB_NodeCompare);
+
+        case TB_POISON:
+        case TB_PHI:
+        case TB_MERGEMEM:
+        case TB_DEBUGBREAK:
+        case TB_TRAP:
+        case TB_UNREACHABLE:
+        case TB_CYCLE_COUNTER:
+        case TB_INT2PTR:
+        case TB_PTR2INT:
+        case TB_TRUNCATE:
+        case TB_FLOAT_EXT:
+        case TB_SIGN_EXT:
+        case TB_ZERO_EXT:
+        case TB_UINT2FLOAT:
+        case TB_FLOAT2UINT:
+        case TB_INT2FLOAT:
+        case TB_FLOAT2INT:
+        case TB_BITCAST:
+        case TB_SELECT:
+        case TB_BSWAP:
+        case TB_CLZ:
+        case TB_CTZ:
+        case TB_POPCNT:
+        case TB_NOT:
+        case TB_NEG:
+        case TB_FADD:
+        case TB_FSUB:
+        case TB_FMUL:
+        case TB_FDIV:
+        case TB_FMAX:
+        case TB_FMIN:
+        case TB_X86INTRIN_LDMXCSR:
+        case TB_X86INTRIN_STMXCSR:
+        case TB_X86INTRIN_SQRT:
+        case TB_X86INTRIN_RSQRT:
+        return 0;
+
+        // START & END are handled by the inliner, the rest either depend on
+        // being in their own frame (VA_START, TAILCALL) or we just don't
+        // know how to copy them.
+        default: return SIZE_MAX;
+    }
+}
+
+// fills ws->items with every node reachable from the terminators, the projections
+// which are only referenced by a tuple's extra data are included too.
+static void ipo_collect(Worklist* ws, TB_Function* f) {
+    worklist_clear(ws);
+
+    DynArray(TB_Node*) stack = dyn_array_create(TB_Node*, 64);
+    dyn_array_for(i, f->terminators) {
+        dyn_array_put(stack, f->terminators[i]);
+    }
+
+    while (dyn_array_length(stack)) {
+        TB_Node* n = dyn_array_pop(stack);
+        if (worklist_test_n_set(ws, n)) {
+            continue;
+        }
+
+        dyn_array_put(ws->items, n);
+        FOREACH_N(i, 0, n->input_count) {
+            if (n->inputs[i]) dyn_array_put(stack, n->inputs[i]);
+        }
+
+        if (n->type == TB_CALL || n->type == TB_SYSCALL) {
+            TB_NodeCall* c = TB_NODE_GET_EXTRA(n);
+            size_t proj_count = (ipo_clone_size(n) - sizeof(TB_NodeCall)) / sizeof(TB_Node*);
+            FOREACH_N(i, 0, proj_count) {
+                if (c->projs[i]) dyn_array_put(stack, c->projs[i]);
+            }
+        } else if (n->type >= TB_ATOMIC_LOAD && n->type <= TB_ATOMIC_CAS) {
+            TB_NodeAtomic* a = TB_NODE_GET_EXTRA(n);
+            if (a->proj0) dyn_array_put(stack, a->proj0);
+            if (a->proj1) dyn_array_put(stack, a->proj1);
+        }
+    }
+
+    dyn_array_destroy(stack);
+}
+
+static TB_Function* ipo_call_target(TB_Node* n) {
+    if (n->type != TB_CALL || n->inputs[2]->type != TB_SYMBOL) {
+        return NULL;
+    }
+
+    TB_Symbol* sym = TB_NODE_GET_EXTRA_T(n->inputs[2], TB_NodeSymbol)->sym;
+    return sym->tag == TB_SYMBOL_FUNCTION ? (TB_Function*) sym : NULL;
+}
+
+// the size limit is checked per call site, see ipo_inline_limit
+static bool ipo_can_inline(TB_Function* f, DynArray(TB_Node*) nodes) {
+    if (f->stop_node == NULL || f->prototype->has_varargs || dyn_array_length(nodes) > IPO_HOT_INLINE_LIMIT) {
+        return false;
+    }
+
+    // the return address is only meaningful to the callee's own END
+    TB_Node* rpc = f->params[2];
+    dyn_array_for(i, nodes) {
+        TB_Node* n = nodes[i];
+        if (n == f->stop_node || n == f->start_node || (n->type == TB_PROJ && n->inputs[0] == f->start_node)) {
+            continue;
+        }
+
+        if (ipo_clone_size(n) == SIZE_MAX) {
+            return false;
+        }
+
+        FOREACH_N(j, 0, n->input_count) {
+            if (n->inputs[j] == rpc) return false;
+        }
+    }
+
+    return true;
+}
+
+// the call has to line up with what the callee's body actually expects
+static bool ipo_call_matches(TB_Node* call, TB_Function* callee) {
+    TB_NodeCall* c = TB_NODE_GET_EXTRA(call);
+    TB_Node* end = callee->stop_node;
+
+    if (call->input_count != 3 + callee->param_count || c->proto->return_count != end->input_count - 3) {
+        return false;
+    }
+
+    FOREACH_N(i, 0, callee->param_count) {
+        if (call->inputs[3 + i]->dt.raw != callee->params[3 + i]->dt.raw) return false;
+    }
+
+    FOREACH_N(i, 0, c->proto->return_count) {
+        TB_Node* proj = c->projs[2 + i];
+        if (proj && proj->dt.raw != end->inputs[3 + i]->dt.raw) return false;
+    }
+
+    return true;
+}
+
+// the profile only knows how often the caller->callee edge ran in total so we
+// split it evenly across the call sites.
+static size_t ipo_inline_limit(IPOCtx* restrict ctx, TB_Function* f, TB_Symbol* target, size_t sites) {
+    TB_Module* m = ctx->m;
+    if (m->prof_max_call == 0) {
+        return IPO_INLINE_LIMIT;
+    }
+
+    uint64_t count = tb__profile_call_count(m, f, target) / (sites ? sites : 1);
+    if (count > 0 && count >= m->prof_max_call / IPO_HOT_FRACTION) {
+        return IPO_HOT_INLINE_LIMIT;
+    }
+
+    return IPO_INLINE_LIMIT;
+}
+
+// copies the callee's body into f, the projections of the call are recorded
+// in subst (by GVN) so the caller can be rewired once all the call sites are done.
+static void ipo_inline_call(IPOCtx* restrict ctx, TB_Function* f, TB_Node* call, IPOFunc* callee, TB_Node** subst, DynArray(TB_Node*)* all) {
+    TB_Function* g = callee->f;
+    TB_Node* end = g->stop_node;
+
+    TB_Node** map = tb_platform_heap_alloc(g->node_count * sizeof(TB_Node*));
+    memset(map, 0, g->node_count * sizeof(TB_Node*));
+
+    // START maps onto the caller's (LOCALs are pinned there) and it's projections
+    // are whatever got passed to the call.
+    map[g->start_node->gvn] = f->start_node;
+    map[g->params[0]->gvn] = call->inputs[0];
+    map[g->params[1]->gvn] = call->inputs[1];
+    FOREACH_N(i, 0, g->param_count) {
+        map[g->params[3 + i]->gvn] = call->inputs[3 + i];
+    }
+
+    // allocate all the copies first, then we can wire them up
+    dyn_array_for(i, callee->nodes) {
+        TB_Node* n = callee->nodes[i];
+        if (n == end || n == g->start_node || (n->type == TB_PROJ && n->inputs[0] == g->start_node)) {
+            continue;
+        }
+
+        size_t extra = ipo_clone_size(n);
+        TB_Node* k = tb_alloc_node(f, n->type, n->dt, n->input_count, extra);
+        memcpy(k->extra, n->extra, extra);
+
+        map[n->gvn] = k;
+        dyn_array_put(*all, k);
+    }
+
+    dyn_array_for(i, callee->nodes) {
+        TB_Node* n = callee->nodes[i];
+        if (n == end || n == g->start_node || (n->type == TB_PROJ && n->inputs[0] == g->start_node)) {
+            continue;
+        }
+
+        TB_Node* k = map[n->gvn];
+        FOREACH_N(j, 0, n->input_count) {
+            TB_Node* in = n->inputs[j];
+            k->inputs[j] = in ? map[in->gvn] : NULL;
+            assert(in == NULL || k->inputs[j] != NULL);
+        }
+
+        if (n->type == TB_CALL || n->type == TB_SYSCALL) {
+            TB_NodeCall* c = TB_NODE_GET_EXTRA(k);
+            size_t proj_count = (ipo_clone_size(n) - sizeof(TB_NodeCall)) / sizeof(TB_Node*);
+            FOREACH_N(j, 0, proj_count) {
+                if (c->projs[j]) c->projs[j] = map[c->projs[j]->gvn];
+            }
+        } else if (n->type >= TB_ATOMIC_LOAD && n->type <= TB_ATOMIC_CAS) {
+            TB_NodeAtomic* a = TB_NODE_GET_EXTRA(k);
+            if (a->proj0) a->proj0 = map[a->proj0->gvn];
+            if (a->proj1) a->proj1 = map[a->proj1->gvn];
+        } else if (n->type == TB_REGION) {
+            // these are stale after IR building anyways
+            TB_NodeRegion* r = TB_NODE_GET_EXTRA(k);
+            r->mem_in = r->mem_out = NULL;
+        }
+    }
+
+    // the callee's exits (besides the return) are exits in the caller now
+    dyn_array_for(i, g->terminators) {
+        TB_Node* t = g->terminators[i];
+        if (t != end) {
+            dyn_array_put(f->terminators, map[t->gvn]);
+        }
+    }
+
+    // the call's results come from the callee's return
+    TB_NodeCall* c = TB_NODE_GET_EXTRA(call);
+    subst[c->projs[0]->gvn] = map[end->inputs[0]->gvn];
+    subst[c->projs[1]->gvn] = map[end->inputs[1]->gvn];
+    FOREACH_N(i, 0, c->proto->return_count) {
+        if (c->projs[2 + i]) {
+            subst[c->projs[2 + i]->gvn] = map[end->inputs[3 + i]->gvn];
+        }
+    }
+
+    tb_platform_heap_free(map);
+    ctx->inlined += 1;
+}
+
+static TB_Node* ipo_subst(TB_Node** subst, size_t count, TB_Node* n) {
+    while (n->gvn < count && subst[n->gvn] != NULL) {
+        n = subst[n->gvn];
+    }
+    return n;
+}
+
+static void ipo_visit(IPOCtx* restrict ctx, size_t index) {
+    TB_Function* f = ctx->funcs[index].f;
+    ctx->funcs[index].state = 1;
+
+    // make sure we don't stick the frontend's last location onto the copies
+    f->line_attrib.loc.file = NULL;
+
+    ipo_collect(&ctx->ws, f);
+    DynArray(TB_Node*) all = dyn_array_create(TB_Node*, dyn_array_length(ctx->ws.items) + 16);
+    dyn_array_for(i, ctx->ws.items) {
+        dyn_array_put(all, ctx->ws.items[i]);
+    }
+
+    // callees go first (bottom-up), anything on the stack is a cycle. we also
+    // count the call sites per callee for ipo_inline_limit.
+    NL_Map(TB_Symbol*, size_t) sites = NULL;
+    size_t original_count = dyn_array_length(all);
+    FOREACH_N(i, 0, original_count) {
+        TB_Symbol* target = (TB_Symbol*) ipo_call_target(all[i]);
+        if (target == NULL) continue;
+
+        if (ctx->m->prof_max_call > 0) {
+            ptrdiff_t site = nl_map_get(sites, target);
+            if (site < 0) {
+                nl_map_put(sites, target, 1);
+            } else {
+                sites[site].v += 1;
+            }
+        }
+
+        ptrdiff_t search = nl_map_get(ctx->func_index, target);
+        if (search >= 0 && ctx->funcs[ctx->func_index[search].v].state == 0) {
+            ipo_visit(ctx, ctx->func_index[search].v);
+        }
+    }
+
+    size_t gvn_count = f->node_count;
+    TB_Node** subst = NULL;
+    FOREACH_N(i, 0, original_count) {
+        TB_Node* call = all[i];
+        TB_Symbol* target = (TB_Symbol*) ipo_call_target(call);
+        if (target == NULL || target == &f->super) continue;
+
+        ptrdiff_t search = nl_map_get(ctx->func_index, target);
+        if (search < 0) continue;
+
+        IPOFunc* callee = &ctx->funcs[ctx->func_index[search].v];
+        if (callee->state != 2 || !callee->can_inline || !ipo_call_matches(call, callee->f)) {
+            continue;
+        }
+
+        ptrdiff_t site = nl_map_get(sites, target);
+        size_t limit = ipo_inline_limit(ctx, f, target, site >= 0 ? sites[site].v : 1);
+        if (dyn_array_length(callee->nodes) > limit) {
+            continue;
+        }
+
+        if (dyn_array_length(all) + dyn_array_length(callee->nodes) > IPO_GROWTH_LIMIT) {
+            break;
+        }
+
+        if (subst == NULL) {
+            subst = tb_platform_heap_alloc(gvn_count * sizeof(TB_Node*));
+            memset(subst, 0, gvn_count * sizeof(TB_Node*));
+        }
+
+        ipo_inline_call(ctx, f, call, callee, subst, &all);
+    }
+
+    nl_map_free(sites);
+
+    // rewire everyone who used the calls we replaced
+    if (subst != NULL) {
+        dyn_array_for(i, all) {
+            TB_Node* n = all[i];
+            FOREACH_N(j, 0, n->input_count) {
+                if (n->inputs[j]) n->inputs[j] = ipo_subst(subst, gvn_count, n->inputs[j]);
+            }
+        }
+
+        dyn_array_for(i, f->terminators) {
+            f->terminators[i] = ipo_subst(subst, gvn_count, f->terminators[i]);
+        }
+
+        tb_platform_heap_free(subst);
+
+        // we need the real set of nodes now, the calls are dead
+        ipo_collect(&ctx->ws, f);
+        dyn_array_clear(all);
+        dyn_array_for(i, ctx->ws.items) {
+            dyn_array_put(all, ctx->ws.items[i]);
+        }
+    }
+
+    ctx->funcs[index].nodes = all;
+    ctx->funcs[index].can_inline = ipo_can_inline(f, all);
+    ctx->funcs[index].state = 2;
+}
+
+static bool ipo_is_default_section(TB_Module* m, TB_ModuleSectionHandle sec) {
+    return sec == tb_module_get_text(m) || sec == tb_module_get_data(m) || sec == tb_module_get_rdata(m) || sec == tb_module_get_tls(m);
+}
+
+static bool ipo_set_has(NL_HashSet* hs, void* ptr) {
+    size_t i = nl_hashset_lookup(hs, ptr);
+    return i != SIZE_MAX && (i & NL_HASHSET_HIGH_BIT);
+}
+
+static void ipo_mark(NL_HashSet* live, DynArray(TB_Symbol*)* stack, const TB_Symbol* s) {
+    if (s != NULL && nl_hashset_put(live, (void*) s)) {
+        dyn_array_put(*stack, (TB_Symbol*) s);
+    }
+}
+
+// strips MEMBER_ACCESS & ARRAY_ACCESS to find which global (if any) the pointer is into
+static TB_Global* ipo_global_base(TB_Node* n) {
+    while (n->type == TB_MEMBER_ACCESS || n->type == TB_ARRAY_ACCESS) {
+        n = n->inputs[1];
+    }
+
+    if (n->type != TB_SYMBOL) {
+        return NULL;
+    }
+
+    TB_Symbol* sym = TB_NODE_GET_EXTRA_T(n, TB_NodeSymbol)->sym;
+    return sym->tag == TB_SYMBOL_GLOBAL ? (TB_Global*) sym : NULL;
+}
+
+static void ipo_dead_symbols(IPOCtx* restrict ctx) {
+    TB_Module* m = ctx->m;
+
+    NL_HashSet live = nl_hashset_alloc(256);
+    DynArray(TB_Symbol*) stack = dyn_array_create(TB_Symbol*, 256);
+
+    // roots: anything other modules can see, custom sections (the CRT's initializer
+    // tables, profile records) and the symbols codegen references by itself.
+    TB_SymbolIter it = tb_symbol_iter(m);
+    TB_Symbol* sym;
+    while (sym = tb_symbol_iter_next(&it), sym) {
+        if (sym->tag == TB_SYMBOL_FUNCTION) {
+            TB_Function* f = (TB_Function*) sym;
+            if (f->linkage == TB_LINKAGE_PUBLIC || !ipo_is_default_section(m, f->section)) {
+                ipo_mark(&live, &stack, sym);
+            }
+        } else if (sym->tag == TB_SYMBOL_GLOBAL) {
+            TB_Global* g = (TB_Global*) sym;
+            if (g->linkage == TB_LINKAGE_PUBLIC || !ipo_is_default_section(m, g->parent)) {
+                ipo_mark(&live, &stack, sym);
+            }
+        }
+    }
+    ipo_mark(&live, &stack, m->chkstk_extern);
+    ipo_mark(&live, &stack, m->tls_index_extern);
+
+    while (dyn_array_length(stack)) {
+        TB_Symbol* s = dyn_array_pop(stack);
+
+        if (s->tag == TB_SYMBOL_FUNCTION) {
+            ptrdiff_t search = nl_map_get(ctx->func_index, s);
+            if (search < 0) continue;
+
+            DynArray(TB_Node*) nodes = ctx->funcs[ctx->func_index[search].v].nodes;
+            dyn_array_for(i, nodes) {
+                if (nodes[i]->type == TB_SYMBOL) {
+                    ipo_mark(&live, &stack, TB_NODE_GET_EXTRA_T(nodes[i], TB_NodeSymbol)->sym);
+                }
+            }
+        } else if (s->tag == TB_SYMBOL_GLOBAL) {
+            TB_Global* g = (TB_Global*) s;
+            FOREACH_N(i, 0, g->obj_count) {
+                if (g->objects[i].type == TB_INIT_OBJ_RELOC) {
+                    ipo_mark(&live, &stack, g->objects[i].reloc);
+                }
+            }
+        }
+    }
+
+    it = tb_symbol_iter(m);
+    while (sym = tb_symbol_iter_next(&it), sym) {
+        TB_SymbolTag tag = sym->tag;
+        if ((tag == TB_SYMBOL_FUNCTION || tag == TB_SYMBOL_GLOBAL || tag == TB_SYMBOL_EXTERNAL) && !ipo_set_has(&live, sym)) {
+            tb_module_kill_symbol(m, sym);
+            ctx->killed += 1;
+        }
+    }
+
+    nl_hashset_free(live);
+    dyn_array_destroy(stack);
+}
+
+static void ipo_readonly_globals(IPOCtx* restrict ctx) {
+    TB_Module* m = ctx->m;
+    NL_HashSet written = nl_hashset_alloc(64);
+
+    // any use besides being the address of a LOAD (or some offset of it) might write
+    dyn_array_for(i, ctx->funcs) {
+        if (ctx->funcs[i].f->super.tag != TB_SYMBOL_FUNCTION) continue;
+
+        DynArray(TB_Node*) nodes = ctx->funcs[i].nodes;
+        dyn_array_for(j, nodes) {
+            TB_Node* n = nodes[j];
+            FOREACH_N(k, 0, n->input_count) {
+                TB_Global* g = n->inputs[k] ? ipo_global_base(n->inputs[k]) : NULL;
+                if (g == NULL) continue;
+
+                bool is_read = (n->type == TB_LOAD && k == 2) ||
+                    ((n->type == TB_MEMBER_ACCESS || n->type == TB_ARRAY_ACCESS) && k == 1);
+                if (!is_read) {
+                    nl_hashset_put(&written, g);
+                }
+            }
+        }
+    }
+
+    TB_SymbolIter it = tb_symbol_iter(m);
+    TB_Symbol* sym;
+    while (sym = tb_symbol_iter_next(&it), sym) if (sym->tag == TB_SYMBOL_GLOBAL) {
+        // storing the address in memory means we can't see who writes through it
+        TB_Global* g = (TB_Global*) sym;
+        FOREACH_N(i, 0, g->obj_count) {
+            if (g->objects[i].type == TB_INIT_OBJ_RELOC && g->objects[i].reloc->tag == TB_SYMBOL_GLOBAL) {
+                nl_hashset_put(&written, (void*) g->objects[i].reloc);
+            }
+        }
+    }
+
+    it = tb_symbol_iter(m);
+    while (sym = tb_symbol_iter_next(&it), sym) if (sym->tag == TB_SYMBOL_GLOBAL) {
+        TB_Global* g = (TB_Global*) sym;
+        if (g->linkage == TB_LINKAGE_PRIVATE && g->parent != tb_module_get_tls(m) && !ipo_set_has(&written, g)) {
+            g->readonly = true;
+            ctx->constants += 1;
+        }
+    }
+
+    nl_hashset_free(written);
+}
+
+void tb_module_ipo(TB_Module* m) {
+    IPOCtx ctx = { .m = m };
+    ctx.funcs = dyn_array_create(IPOFunc, 64);
+
+    TB_SymbolIter it = tb_symbol_iter(m);
+    TB_Symbol* sym;
+    while (sym = tb_symbol_iter_next(&it), sym) if (sym->tag == TB_SYMBOL_FUNCTION) {
+        TB_Function* f = (TB_Function*) sym;
+
+        // we can't see what a compiled function references, just don't bother
+        if (f->output != NULL) {
+            log_warn("%s: already compiled, skipping whole program passes", f->super.name);
+            dyn_array_destroy(ctx.funcs);
+            return;
+        }
+
+        if (f->start_node != NULL) {
+            nl_map_put(ctx.func_index, sym, dyn_array_length(ctx.funcs));
+            dyn_array_put(ctx.funcs, (IPOFunc){ .f = f });
+        }
+    }
+
+    CUIK_TIMED_BLOCK("inline") {
+        worklist_alloc(&ctx.ws, 256);
+        dyn_array_for(i, ctx.funcs) {
+            if (ctx.funcs[i].state == 0) ipo_visit(&ctx, i);
+        }
+        worklist_free(&ctx.ws);
+    }
+
+    CUIK_TIMED_BLOCK("dead symbols") {
+        ipo_dead_symbols(&ctx);
+    }
+
+    CUIK_TIMED_BLOCK("read-only globals") {
+        ipo_readonly_globals(&ctx);
+    }
+
+    dyn_array_for(i, ctx.funcs) {
+        dyn_array_destroy(ctx.funcs[i].nodes);
+    }
+    dyn_array_destroy(ctx.funcs);
+    nl_map_free(ctx.func_index);
+
+    m->ipo_inlined += ctx.inlined;
+    m->ipo_killed += ctx.killed;
+    m->ipo_constants += ctx.constants;
+}
+
+void tb_module_get_ipo_stats(TB_Module* m, size_t* out_inlined, size_t* out_killed, size_t* out_constants) {
+    *out_inlined = m->ipo_inlined;
+    *out_killed = m->ipo_killed;
+    *out_constants = m->ipo_constants;
+}
@@ -102,7 +102,8 @@ static void write_variable(Mem2Reg_Ctx* c, int var, TB_Node* block, TB_Node* val
     nl_map_put(c->defs[var], block, value);
 }
 
-static void ssa_replace_phi_arg(Mem2Reg_Ctx* c, TB_Function* f, TB_Node* bb, TB_Node* dst, DynArray(TB_Node*)* stack) {
+// edge is the control node in bb which feeds dst
+static void ssa_replace_phi_arg(Mem2Reg_Ctx* c, TB_Function* f, TB_Node* bb, TB_Node* edge, TB_Node* dst, DynArray(TB_Node*)* stack) {
     FOREACH_N(var, 0, c->to_promote_count) {
         ptrdiff_t search = nl_map_get(c->defs[var], dst);
         if (search < 0) continue;
@@ -121,7 +122,7 @@ static void ssa_replace_phi_arg(Mem2Reg_Ctx* c, TB_Function* f, TB_Node* bb, TB_
 
         bool found = false;
         FOREACH_N(j, 0, dst->input_count) {
-            if (dst->inputs[j] == bb) {
+            if (dst->inputs[j] == edge || dst->inputs[j] == bb) {
                 // try to replace
                 set_input(c->p, phi_reg, top, j + 1);
                 found = true;
@@ -244,8 +245,15 @@ static void ssa_rename(Mem2Reg_Ctx* c, TB_Function* f, TB_Node* bb, DynArray(TB_
         // fill successors
         for (User* u = end->users; u; u = u->next) {
             if (cfg_is_control(u->n)) {
+                // branch projections which only go into a region are part of that
+                // region's block, it doesn't matter how many preds it has.
+                TB_Node* edge = u->n->type == TB_REGION ? end : u->n;
                 TB_Node* succ = cfg_next_region_control(u->n);
-                ssa_replace_phi_arg(c, f, bb, succ, stack);
+                if (succ->type == TB_PROJ && succ->users != NULL && succ->users->next == NULL && succ->users->n->type == TB_REGION) {
+                    succ = succ->users->n;
+                }
+
+                ssa_replace_phi_arg(c, f, bb, edge, succ, stack);
             }
         }
     }
@@ -319,6 +327,11 @@ bool tb_pass_mem2reg(TB_Passes* p) {
                 DO_IF(TB_OPTDEBUG_MEM2REG)(log_debug("%s: v%u promoting to IR register", f->super.name, n->gvn));
                 break;
             }
+            case COHERENCY_DEAD: {
+                // SROA leaves the original slot behind with no users once it's split up
+                DO_IF(TB_OPTDEBUG_MEM2REG)(log_debug("%s: v%u could not mem2reg (dead)", f->super.name, n->gvn));
+                break;
+            }
             case COHERENCY_UNINITIALIZED: {
                 DO_IF(TB_OPTDEBUG_MEM2REG)(log_debug("%s: v%u could not mem2reg (uninitialized)", f->super.name, n->gvn));
                 break;
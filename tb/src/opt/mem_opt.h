@@ -8,9 +8,8 @@ typedef struct {
 
 static bool is_local_ptr(TB_Node* n) {
     // skip past ptr arith
-    retry: {
-        if (n->type == TB_MEMBER_ACCESS) goto retry;
-        if (n->type == TB_ARRAY_ACCESS) goto retry;
+    while (n->type == TB_MEMBER_ACCESS || n->type == TB_ARRAY_ACCESS) {
+        n = n->inputs[1];
     }
 
     return n->type == TB_LOCAL;
@@ -77,9 +76,128 @@ static TB_Node* data_phi_from_memory_phi(TB_Passes* restrict p, TB_Function* f,
     return phi;
 }
 
+// nobody writes to the global (tb_module_ipo figured that out) so we just read
+// the bytes out of it's initializer, relocations aren't known until link time.
+static TB_Node* fold_readonly_load(TB_Passes* restrict p, TB_Function* f, TB_Node* n, TB_Global* g, int64_t offset) {
+    size_t size;
+    if (n->dt.type == TB_INT && n->dt.data <= 64) {
+        size = (n->dt.data + 7) / 8;
+    } else if (n->dt.type == TB_FLOAT) {
+        size = n->dt.data == TB_FLT_64 ? 8 : 4;
+    } else {
+        return NULL;
+    }
+
+    if (offset < 0 || offset + size > g->size) {
+        return NULL;
+    }
+
+    int pointer_size = tb__find_code_generator(f->super.module)->pointer_size;
+    uint8_t bytes[8] = { 0 };
+    FOREACH_N(i, 0, g->obj_count) {
+        TB_InitObj* obj = &g->objects[i];
+        if (obj->type == TB_INIT_OBJ_RELOC) {
+            if (obj->offset < offset + size && offset < obj->offset + pointer_size) {
+                return NULL;
+            }
+        } else if (obj->offset < offset + size && offset < obj->offset + obj->region.size) {
+            // copy the overlapping bytes
+            int64_t lo = offset > obj->offset ? offset : obj->offset;
+            int64_t hi = offset + size < obj->offset + obj->region.size ? offset + size : obj->offset + obj->region.size;
+            memcpy(&bytes[lo - offset], (const uint8_t*) obj->region.ptr + (lo - obj->offset), hi - lo);
+        }
+    }
+
+    if (n->dt.type == TB_INT) {
+        uint64_t x = 0;
+        memcpy(&x, bytes, size);
+        return make_int_node(f, p, n->dt, x);
+    } else if (size == 4) {
+        TB_Node* k = tb_alloc_node(f, TB_FLOAT32_CONST, n->dt, 1, sizeof(TB_NodeFloat32));
+        memcpy(&TB_NODE_GET_EXTRA_T(k, TB_NodeFloat32)->value, bytes, 4);
+        return gvn(p, k, sizeof(TB_NodeFloat32));
+    } else {
+        TB_Node* k = tb_alloc_node(f, TB_FLOAT64_CONST, n->dt, 1, sizeof(TB_NodeFloat64));
+        memcpy(&TB_NODE_GET_EXTRA_T(k, TB_NodeFloat64)->value, bytes, 8);
+        return gvn(p, k, sizeof(TB_NodeFloat64));
+    }
+}
+
+// partial redundancy elimination for loads: the load sits right at a merge point
+// (so it runs on every path into it) and all but one of the incoming paths already
+// loaded the same bytes from the same memory. we do the load on the missing edge
+// instead and PHI them together, the fully redundant cases come out the same way
+// just without the new load. pure math doesn't need any of this, GVN + GCM already
+// put it at the LCA of its uses.
+static TB_Node* pre_load(TB_Passes* restrict p, TB_Function* f, TB_Node* n) {
+    TB_Node* region = n->inputs[0];
+    TB_Node* mem = n->inputs[1];
+    TB_Node* addr = n->inputs[2];
+
+    TB_Node* avail[8];
+    size_t path_count = region->input_count;
+    if (path_count < 2 || path_count > COUNTOF(avail)) {
+        return NULL;
+    }
+
+    int missing = -1;
+    FOREACH_N(i, 0, path_count) {
+        TB_Node* pred = get_pred(region, i);
+
+        avail[i] = NULL;
+        for (User* u = addr->users; u; u = u->next) {
+            TB_Node* use = u->n;
+            if (use != n && use->type == TB_LOAD && u->slot == 2 && use->inputs[0] != NULL &&
+                use->inputs[1] == mem && use->dt.raw == n->dt.raw &&
+                lattice_dommy(&p->universe, get_block_begin(use->inputs[0]), pred)) {
+                avail[i] = use;
+                break;
+            }
+        }
+
+        // we're only willing to add one load
+        if (avail[i] == NULL) {
+            if (missing >= 0) return NULL;
+            missing = i;
+        }
+    }
+
+    if (missing >= 0) {
+        TB_Node* k = tb_alloc_node(f, TB_LOAD, n->dt, 3, sizeof(TB_NodeMemAccess));
+        set_input(p, k, region->inputs[missing], 0);
+        set_input(p, k, mem, 1);
+        set_input(p, k, addr, 2);
+        TB_NODE_SET_EXTRA(k, TB_NodeMemAccess, .align = TB_NODE_GET_EXTRA_T(n, TB_NodeMemAccess)->align);
+        tb_pass_mark(p, k);
+
+        avail[missing] = k;
+    }
+
+    TB_Node* phi = tb_alloc_node(f, TB_PHI, n->dt, 1 + path_count, 0);
+    set_input(p, phi, region, 0);
+    FOREACH_N(i, 0, path_count) {
+        set_input(p, phi, avail[i], 1 + i);
+    }
+
+    DO_IF(TB_OPTDEBUG_PEEP)(printf(" => \x1b[32mPRE (%s)\x1b[0m", missing >= 0 ? "partial" : "full"));
+    return phi;
+}
+
 static TB_Node* ideal_load(TB_Passes* restrict p, TB_Function* f, TB_Node* n) {
     TB_Node* mem = n->inputs[1];
     TB_Node* addr = n->inputs[2];
+
+    KnownPointer ptr = known_pointer(addr);
+    if (ptr.base->type == TB_SYMBOL) {
+        TB_Symbol* sym = TB_NODE_GET_EXTRA_T(ptr.base, TB_NodeSymbol)->sym;
+        if (sym->tag == TB_SYMBOL_GLOBAL && ((TB_Global*) sym)->readonly) {
+            TB_Node* k = fold_readonly_load(p, f, n, (TB_Global*) sym, ptr.offset);
+            if (k != NULL) {
+                return k;
+            }
+        }
+    }
+
     if (n->inputs[0] != NULL) {
         // we've dependent on code which must always be run (START.mem)
         if (n->inputs[0]->type == TB_PROJ && n->inputs[0]->inputs[0]->type == TB_START) {
@@ -107,16 +225,21 @@ static TB_Node* ideal_load(TB_Passes* restrict p, TB_Function* f, TB_Node* n) {
             if (use != n && use->type == TB_LOAD && u->slot == 2) {
                 // if the other load has no control deps we don't need any
                 // either... if they're the same type (really it just needs
-                // to read the same bytes or less)
-                if (use->dt.raw == n->dt.raw) {
-                    set_input(p, n, NULL, 0);
-                    return n;
+                // to read the same bytes or less). a load that's still guarded
+                // doesn't prove anything, GCM would happily hoist us above the
+                // guard (zero trip loops on a NULL pointer).
+                if (use->inputs[0] == NULL) {
+                    if (use->dt.raw == n->dt.raw) {
+                        set_input(p, n, NULL, 0);
+                        return n;
+                    }
+                    continue;
                 }
 
                 // if we're dominated by some previous load then we can inherit
                 // it's control dep.
                 TB_Node* bb = get_block_begin(use->inputs[0]);
-                if (lattice_dommy(&p->universe, bb, parent_bb)) {
+                if (use->inputs[0] != n->inputs[0] && lattice_dommy(&p->universe, bb, parent_bb)) {
                     set_input(p, n, use->inputs[0], 0);
                     return n;
                 }
@@ -124,15 +247,26 @@ static TB_Node* ideal_load(TB_Passes* restrict p, TB_Function* f, TB_Node* n) {
         }
     }
 
+    // stores which can't touch us aren't a real dependency, skipping them
+    // lets us forward from (or GVN with) whatever came before.
+    if (mem->type == TB_STORE && tb_pass_alias(p, n, mem) == TB_NO_ALIAS) {
+        set_input(p, n, mem->inputs[1], 1);
+        return n;
+    }
+
+    if (n->inputs[0] != NULL && n->inputs[0]->type == TB_REGION) {
+        return pre_load(p, f, n);
+    }
+
     return NULL;
 }
 
 static TB_Node* identity_load(TB_Passes* restrict p, TB_Function* f, TB_Node* n) {
     // god i need a pattern matcher
     //   (load (store X A Y) A) => Y
-    TB_Node *mem = n->inputs[1], *addr = n->inputs[2];
-    if (mem->type == TB_STORE && mem->inputs[2] == addr &&
-        n->dt.raw == mem->inputs[3]->dt.raw && is_same_align(n, mem)) {
+    TB_Node *mem = n->inputs[1];
+    if (mem->type == TB_STORE && n->dt.raw == mem->inputs[3]->dt.raw &&
+        is_same_align(n, mem) && tb_pass_alias(p, n, mem) == TB_MUST_ALIAS) {
         return mem->inputs[3];
     }
 
@@ -143,6 +277,14 @@ static TB_Node* ideal_store(TB_Passes* restrict p, TB_Function* f, TB_Node* n) {
     TB_Node *mem = n->inputs[1], *addr = n->inputs[2], *val = n->inputs[3];
     TB_DataType dt = val->dt;
 
+    // we overwrite the same bytes as the store before us and nobody got to
+    // see them in between, it's dead.
+    if (mem->type == TB_STORE && mem->inputs[0] == n->inputs[0] && single_use(p, mem) &&
+        tb_pass_alias(p, n, mem) == TB_MUST_ALIAS) {
+        set_input(p, n, mem->inputs[1], 1);
+        return n;
+    }
+
     // if a store has only one user in this chain it means it's only job was
     // to facilitate the creation of that user store... if we can detect that
     // user store is itself dead, everything in the middle is too.
@@ -26,6 +26,7 @@ static void remove_input(TB_Passes* restrict p, TB_Function* f, TB_Node* n, size
 TB_Node* tb_transmute_to_int(TB_Function* f, TB_Passes* restrict p, TB_DataType dt, int num_words);
 
 static void subsume_node(TB_Passes* restrict p, TB_Function* f, TB_Node* n, TB_Node* new_n);
+static TB_Node* gvn(TB_Passes* restrict p, TB_Node* n, size_t extra);
 
 // *new_node is set to true if we make a new node, it won't set it false for you
 static TB_Node* clone_node(TB_Passes* restrict p, TB_Function* f, TB_Node* region, TB_Node* n, bool* new_node);
@@ -236,6 +237,7 @@ static bool is_if_branch(TB_Node* n, uint64_t* falsey) {
 #include "gvn.h"
 #include "dce.h"
 #include "fold.h"
+#include "alias.h"
 #include "mem_opt.h"
 #include "sroa.h"
 #include "loop.h"
@@ -245,6 +247,7 @@ static bool is_if_branch(TB_Node* n, uint64_t* falsey) {
 #include "gcm.h"
 #include "libcalls.h"
 #include "scheduler.h"
+#include "ipo.h"
 
 static bool lattice_dommy(LatticeUniverse* uni, TB_Node* expected_dom, TB_Node* bb) {
     while (bb != NULL && expected_dom != bb) {
@@ -745,7 +748,7 @@ static TB_Node* try_as_const(TB_Passes* restrict p, TB_Node* n, Lattice* l) {
 }
 
 static bool is_terminator(TB_Node* n) {
-    return n->type == TB_BRANCH || n->type == TB_END || n->type == TB_TRAP || n->type == TB_UNREACHABLE;
+    return n->type == TB_BRANCH || n->type == TB_END || n->type == TB_TRAP || n->type == TB_UNREACHABLE || n->type == TB_TAILCALL;
 }
 
 static TB_Node* unsafe_get_region(TB_Node* n) {
@@ -798,7 +801,7 @@ static bool peephole(TB_Passes* restrict p, TB_Function* f, TB_Node* n, TB_Peeph
 
     // must've dead sometime between getting scheduled and getting
     // here.
-    if (n->type != TB_END && n->type != TB_UNREACHABLE && n->users == NULL) {
+    if (n->type != TB_END && n->type != TB_UNREACHABLE && n->type != TB_TAILCALL && n->users == NULL) {
         DO_IF(TB_OPTDEBUG_PEEP)(printf(" => \x1b[196mKILL\x1b[0m"));
         tb_pass_kill_node(p, n);
         return false;
@@ -915,7 +918,7 @@ static void generate_use_lists(TB_Passes* restrict p, TB_Function* f) {
 }
 
 TB_Passes* tb_pass_enter(TB_Function* f, TB_Arena* arena) {
-    assert(f->stop_node && "missing return");
+    assert((f->stop_node || dyn_array_length(f->terminators)) && "missing return");
     TB_Passes* p = tb_platform_heap_alloc(sizeof(TB_Passes));
     *p = (TB_Passes){ .f = f };
 
@@ -423,6 +423,7 @@ static void print_bb(PrinterCtx* ctx, TB_Node* bb_start) {
                     case TB_MEMCPY: {
                         TB_NodeMemAccess* mem = TB_NODE_GET_EXTRA(n);
                         printf(" !align(%d)", mem->align);
+                        if (mem->alias_class) printf(" !alias(%d)", mem->alias_class);
                         break;
                     }
 
@@ -484,6 +485,7 @@ static void print_bb(PrinterCtx* ctx, TB_Node* bb_start) {
     dyn_array_set_length(ws->items, ctx->cfg.block_count);
 
     if (bb->end->type != TB_END &&
+        bb->end->type != TB_TAILCALL &&
         bb->end->type != TB_TRAP &&
         bb->end->type != TB_BRANCH &&
         bb->end->type != TB_UNREACHABLE) {
@@ -94,3 +94,320 @@ void sched_walk(TB_Passes* passes, Worklist* ws, DynArray(PhiVal)* phi_vals, TB_
         }
     }
 }
+
+////////////////////////////////
+// List scheduler
+////////////////////////////////
+// sched_walk only cares about dependencies so a load usually ends up right before
+// its user and the divide right before the thing waiting on it. This reorders the
+// walk using the target's latencies: every cycle we pick the ready node on the
+// longest path to the end of the block, if nothing's ready we pick whatever stalls
+// the least. Once too many values are live we prefer nodes which kill values over
+// ones which start new ones.
+//
+// some nodes have to stay glued together:
+// * projections right after their tuple.
+// * single use loads right before their user, isel folds those into the user's
+//   memory operand so they'd be reading memory from the user's position. if the
+//   walk placed a memory effect between them already we leave them be.
+typedef struct {
+    int from, to;
+} SchedEdge;
+
+// not worth it on giant blocks, picking from the ready list is quadratic
+#define SCHED_LIST_MAX 4096
+
+static bool sched_is_value(TB_Node* n) {
+    return n->dt.type != TB_TUPLE && n->dt.type != TB_CONTROL && n->dt.type != TB_MEMORY;
+}
+
+void sched_list(TB_Passes* passes, Worklist* ws, size_t start, TB_Node* end, const SchedModel* model) {
+    size_t count = dyn_array_length(ws->items) - start;
+    if (count <= 2 || count > SCHED_LIST_MAX) {
+        return;
+    }
+
+    TB_Node** nodes = &ws->items[start];
+    TB_ArenaSavepoint sp = tb_arena_save(tmp_arena);
+
+    NL_Map(TB_Node*, int) index = NULL;
+    nl_map_create(index, count);
+    FOREACH_N(i, 0, count) {
+        nl_map_put(index, nodes[i], i);
+    }
+
+    // effects before each position, used to check if a load can be glued
+    int* effects = tb_arena_alloc(tmp_arena, (count + 1) * sizeof(int));
+    effects[0] = 0;
+    FOREACH_N(i, 0, count) {
+        effects[i + 1] = effects[i] + (is_mem_out_op(nodes[i]) ? 1 : 0);
+    }
+
+    // units are named after their leader's index
+    int* leader = tb_arena_alloc(tmp_arena, count * sizeof(int));
+    FOREACH_N(i, 0, count) {
+        TB_Node* n = nodes[i];
+        leader[i] = i;
+
+        if (n == end) {
+            // the end stays in a unit of its own, even if it's a projection
+        } else if (n->type == TB_PROJ) {
+            ptrdiff_t search = nl_map_get(index, n->inputs[0]);
+            if (search >= 0) leader[i] = index[search].v;
+        } else if (n->type == TB_LOAD && n->users != NULL && n->users->next == NULL) {
+            TB_Node* u = n->users->n;
+            ptrdiff_t search = nl_map_get(index, u);
+            if (search >= 0 && sched_is_value(u) && u->type != TB_LOAD && u->type != TB_PROJ) {
+                int j = index[search].v;
+                if (j > i && effects[j] == effects[i + 1]) {
+                    leader[i] = j;
+                }
+            }
+        }
+    }
+
+    // members of each unit in walk order
+    int* first = tb_arena_alloc(tmp_arena, count * sizeof(int));
+    int* last  = tb_arena_alloc(tmp_arena, count * sizeof(int));
+    int* next  = tb_arena_alloc(tmp_arena, count * sizeof(int));
+    FOREACH_N(i, 0, count) {
+        first[i] = last[i] = next[i] = -1;
+    }
+
+    FOREACH_N(i, 0, count) {
+        int a = leader[i];
+        if (last[a] < 0) first[a] = i;
+        else next[last[a]] = i;
+        last[a] = i;
+    }
+
+    // unit costs & pressure info
+    int* latency = tb_arena_alloc(tmp_arena, count * sizeof(int));
+    int* rthru = tb_arena_alloc(tmp_arena, count * sizeof(int));
+    int* defines = tb_arena_alloc(tmp_arena, count * sizeof(int));
+    int* remaining = tb_arena_alloc(tmp_arena, count * sizeof(int));
+    bool* killable = tb_arena_alloc(tmp_arena, count * sizeof(bool));
+    FOREACH_N(i, 0, count) {
+        latency[i] = rthru[i] = defines[i] = remaining[i] = 0;
+        killable[i] = false;
+    }
+
+    FOREACH_N(i, 0, count) {
+        TB_Node* n = nodes[i];
+        SchedCost c = model->cost(model->ctx, n);
+
+        int a = leader[i];
+        latency[a] += c.latency;
+        if (rthru[a] < c.rthru) rthru[a] = c.rthru;
+
+        // things which get rematerialized or folded don't hold a register,
+        // neither do the params since they're live on entry anyways.
+        bool holds_reg = sched_is_value(n) && n->users != NULL;
+        if (n->type == TB_PROJ) {
+            holds_reg &= n->inputs[0]->type != TB_START;
+        } else {
+            holds_reg &= leader[i] == i && c.latency > 0;
+        }
+
+        if (holds_reg) {
+            defines[a] += 1;
+            killable[i] = true;
+            for (User* u = n->users; u; u = u->next) {
+                if (nl_map_get(index, u->n) < 0) {
+                    // used by a later block (or a PHI), it's live out anyways
+                    killable[i] = false;
+                }
+            }
+        }
+    }
+
+    DynArray(SchedEdge) edges = dyn_array_create(SchedEdge, count * 2);
+    FOREACH_N(i, 0, count) {
+        TB_Node* n = nodes[i];
+        FOREACH_N(k, 0, n->input_count) if (n->inputs[k]) {
+            ptrdiff_t search = nl_map_get(index, n->inputs[k]);
+            if (search < 0) continue;
+
+            int j = index[search].v;
+            if (leader[j] != leader[i]) {
+                dyn_array_put(edges, (SchedEdge){ leader[j], leader[i] });
+                remaining[j] += 1;
+            }
+        }
+
+        // same anti-dependencies as sched_walk, loads from the old memory
+        // go before the effect which replaces it
+        if (is_mem_out_op(n) && n->type != TB_PHI && n->type != TB_PROJ && n->input_count > 1 && n->inputs[1]) {
+            for (User* use = find_users(passes, n->inputs[1]); use; use = use->next) {
+                ptrdiff_t search = use->slot == 1 && use->n != n ? nl_map_get(index, use->n) : -1;
+                if (search < 0) continue;
+
+                int j = index[search].v;
+                if (leader[j] != leader[i]) {
+                    dyn_array_put(edges, (SchedEdge){ leader[j], leader[i] });
+                }
+            }
+        }
+    }
+
+    // CSR for the successors
+    size_t edge_count = dyn_array_length(edges);
+    int* succ_start = tb_arena_alloc(tmp_arena, (count + 1) * sizeof(int));
+    int* succs = tb_arena_alloc(tmp_arena, (edge_count + 1) * sizeof(int));
+    int* preds = tb_arena_alloc(tmp_arena, count * sizeof(int));
+    FOREACH_N(i, 0, count + 1) succ_start[i] = 0;
+    FOREACH_N(i, 0, count) preds[i] = 0;
+
+    FOREACH_N(e, 0, edge_count) {
+        succ_start[edges[e].from + 1] += 1;
+        preds[edges[e].to] += 1;
+    }
+    FOREACH_N(i, 0, count) succ_start[i + 1] += succ_start[i];
+    {
+        int* fill = tb_arena_alloc(tmp_arena, count * sizeof(int));
+        FOREACH_N(i, 0, count) fill[i] = succ_start[i];
+        FOREACH_N(e, 0, edge_count) {
+            succs[fill[edges[e].from]++] = edges[e].to;
+        }
+    }
+    dyn_array_destroy(edges);
+
+    // topological order (Kahn) so we can compute the critical paths, if the
+    // gluing made a cycle we just keep the walk's order.
+    size_t unit_count = 0;
+    int* topo = tb_arena_alloc(tmp_arena, count * sizeof(int));
+    int* indeg = tb_arena_alloc(tmp_arena, count * sizeof(int));
+    size_t topo_len = 0;
+    FOREACH_N(i, 0, count) if (leader[i] == i) {
+        unit_count += 1;
+        indeg[i] = preds[i];
+        if (indeg[i] == 0) topo[topo_len++] = i;
+    }
+
+    for (size_t t = 0; t < topo_len; t++) {
+        int a = topo[t];
+        FOREACH_N(e, succ_start[a], succ_start[a + 1]) {
+            if (--indeg[succs[e]] == 0) topo[topo_len++] = succs[e];
+        }
+    }
+
+    if (topo_len != unit_count) {
+        goto done;
+    }
+
+    int* height = tb_arena_alloc(tmp_arena, count * sizeof(int));
+    FOREACH_REVERSE_N(t, 0, topo_len) {
+        int a = topo[t], h = 0;
+        FOREACH_N(e, succ_start[a], succ_start[a + 1]) {
+            if (h < height[succs[e]]) h = height[succs[e]];
+        }
+        height[a] = latency[a] + h;
+    }
+
+    ptrdiff_t end_search = nl_map_get(index, end);
+    int end_unit = end_search >= 0 ? leader[index[end_search].v] : -1;
+
+    // cycle driven list scheduling, one instruction per cycle
+    int* ready = tb_arena_alloc(tmp_arena, count * sizeof(int));
+    int* earliest = tb_arena_alloc(tmp_arena, count * sizeof(int));
+    int* order = topo; // reused, the topo order isn't needed anymore
+    size_t ready_count = 0, order_len = 0;
+    FOREACH_N(i, 0, count) if (leader[i] == i) {
+        earliest[i] = 0;
+        if (preds[i] == 0) ready[ready_count++] = i;
+    }
+
+    int cycle = 0, busy = 0, live = 0;
+    while (order_len < unit_count) {
+        bool high_pressure = live >= model->max_pressure;
+
+        ptrdiff_t best = -1;
+        int best_stall = 0, best_delta = 0;
+        FOREACH_N(r, 0, ready_count) {
+            int a = ready[r];
+            // the terminator waits for everything else, unless it's a projection
+            // which the rest of the block hangs off of.
+            if (a == end_unit && ready_count > 1) {
+                continue;
+            }
+
+            int avail = earliest[a];
+            if (rthru[a] > 1 && avail < busy) avail = busy;
+            int stall = avail > cycle ? avail - cycle : 0;
+
+            int delta = defines[a];
+            for (int m = first[a]; m >= 0; m = next[m]) {
+                TB_Node* n = nodes[m];
+                FOREACH_N(k, 0, n->input_count) if (n->inputs[k]) {
+                    ptrdiff_t search = nl_map_get(index, n->inputs[k]);
+                    if (search < 0) continue;
+
+                    int j = index[search].v;
+                    if (leader[j] != a && killable[j] && remaining[j] == 1) delta -= 1;
+                }
+            }
+
+            if (best >= 0) {
+                int b = ready[best];
+                bool better;
+                if (high_pressure && delta != best_delta) {
+                    better = delta < best_delta;
+                } else if (stall != best_stall) {
+                    better = stall < best_stall;
+                } else if (height[a] != height[b]) {
+                    better = height[a] > height[b];
+                } else {
+                    better = a < b;
+                }
+
+                if (!better) continue;
+            }
+
+            best = r, best_stall = stall, best_delta = delta;
+        }
+
+        assert(best >= 0);
+        int a = ready[best];
+        ready[best] = ready[--ready_count];
+        order[order_len++] = a;
+
+        int issue = cycle + best_stall;
+        int finish = issue + latency[a];
+        if (rthru[a] > 1) busy = issue + rthru[a];
+        cycle = latency[a] > 0 ? issue + 1 : issue;
+
+        FOREACH_N(e, succ_start[a], succ_start[a + 1]) {
+            int s = succs[e];
+            if (earliest[s] < finish) earliest[s] = finish;
+            if (--preds[s] == 0) ready[ready_count++] = s;
+        }
+
+        // update register pressure
+        live += defines[a];
+        for (int m = first[a]; m >= 0; m = next[m]) {
+            TB_Node* n = nodes[m];
+            FOREACH_N(k, 0, n->input_count) if (n->inputs[k]) {
+                ptrdiff_t search = nl_map_get(index, n->inputs[k]);
+                if (search < 0) continue;
+
+                int j = index[search].v;
+                if (leader[j] != a && --remaining[j] == 0 && killable[j]) live -= 1;
+            }
+        }
+    }
+
+    // write back the new order
+    TB_Node** new_nodes = tb_arena_alloc(tmp_arena, count * sizeof(TB_Node*));
+    size_t k = 0;
+    FOREACH_N(t, 0, order_len) {
+        for (int m = first[order[t]]; m >= 0; m = next[m]) {
+            new_nodes[k++] = nodes[m];
+        }
+    }
+    assert(k == count);
+    memcpy(nodes, new_nodes, count * sizeof(TB_Node*));
+
+    done:
+    nl_map_free(index);
+    tb_arena_restore(tmp_arena, sp);
+}
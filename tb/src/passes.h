@@ -106,11 +106,32 @@ typedef struct {
     int dst, src;
 } PhiVal;
 
+// Machine model for the list scheduler, the target fills these in
+typedef struct {
+    // cycles until the result can be used, 0 if the node doesn't become an
+    // instruction of its own (constants, things that fold into their users)
+    uint8_t latency;
+    // cycles until the unit can take the next one, anything above 1 isn't
+    // pipelined (dividers)
+    uint8_t rthru;
+} SchedCost;
+
+typedef struct {
+    void* ctx;
+    SchedCost (*cost)(void* ctx, TB_Node* n);
+    // once this many values are live we'd rather finish them off than
+    // start new ones
+    int max_pressure;
+} SchedModel;
+
 typedef struct TB_BasicBlock {
     TB_Node* dom;
     TB_Node* end;
     int id, dom_depth;
 
+    // number of natural loops this block is in, filled by the scheduler
+    int loop_depth;
+
     TB_Node* mem_in;
     NL_HashSet items;
 } TB_BasicBlock;
@@ -173,7 +194,7 @@ struct TB_Passes {
 };
 
 static bool cfg_is_terminator(TB_Node* n) {
-    return n->type == TB_BRANCH || n->type == TB_UNREACHABLE || n->type == TB_TRAP || n->type == TB_END;
+    return n->type == TB_BRANCH || n->type == TB_UNREACHABLE || n->type == TB_TRAP || n->type == TB_END || n->type == TB_TAILCALL;
 }
 
 static bool ctrl_out_as_cproj_but_not_branch(TB_Node* n) {
@@ -370,6 +391,8 @@ TB_Node* worklist_pop(Worklist* ws);
 
 // Local scheduler
 void sched_walk(TB_Passes* passes, Worklist* ws, DynArray(PhiVal)* phi_vals, TB_BasicBlock* bb, TB_Node* n, bool is_end);
+//   reorders the walk's output (ws->items[start...]) according to the machine model
+void sched_list(TB_Passes* passes, Worklist* ws, size_t start, TB_Node* end, const SchedModel* model);
 
 static void push_all_nodes(TB_Passes* restrict passes, Worklist* restrict ws, TB_Function* f);
 
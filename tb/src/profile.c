@@ -0,0 +1,301 @@
+// Profile guided optimization
+//
+// Instrumented builds place a counter at the top of every basic block (the
+// entry, branch successors and merges), each function gets a record in the
+// .tbprof section which the dumper appends to the profile when the program
+// exits. Feedback builds load those records back and codegen uses them for
+// block placement and spill weights. The records also list the direct calls in
+// each block so the loader can weigh the call graph, the IPO inliner uses that
+// to spend more of it's budget on hot call sites.
+#include "tb_internal.h"
+
+void tb_module_enable_instrumentation(TB_Module* m) {
+    if (m->prof_dumper != NULL) {
+        return;
+    }
+
+    assert(!m->is_jit && "can't instrument JIT modules");
+    m->prof_section = tb_module_create_section(m, -1, ".tbprof", TB_MODULE_SECTION_WRITE, TB_COMDAT_NONE);
+    m->prof_counters = dyn_array_create(TB_Global*, 64);
+
+    // the body is only filled in once we know all the counters
+    m->prof_dumper = tb_function_create(m, -1, "__tb_prof_dump", TB_LINKAGE_PRIVATE);
+}
+
+TB_Function* tb_module_get_profile_dumper(TB_Module* m) {
+    return m->prof_dumper;
+}
+
+// statics from different TUs can share a name so those get the TU's ordinal
+// (upper half of the symbol ordinal) tacked on, "foo@3".
+static size_t profile_key(TB_Symbol* s, char* buf, size_t cap) {
+    const char* name = s->name ? s->name : "";
+    if (s->tag == TB_SYMBOL_FUNCTION && ((TB_Function*) s)->linkage == TB_LINKAGE_PRIVATE) {
+        int len = snprintf(buf, cap, "%s@%u", name, (uint32_t) (s->ordinal >> 32ull));
+        return (size_t) len < cap ? len : cap - 1;
+    } else {
+        size_t len = strlen(name);
+        if (len >= cap) len = cap - 1;
+
+        memcpy(buf, name, len);
+        buf[len] = 0;
+        return len;
+    }
+}
+
+static bool profile_key_eq(NL_Slice a, NL_Slice b) {
+    return a.length == b.length && memcmp(a.data, b.data, a.length) == 0;
+}
+
+TB_Global* tb__profile_counters(TB_Module* m, TB_Function* f, size_t count, size_t call_count, const TB_ProfileCallSite* calls, int32_t* out_base) {
+    char name[1024];
+    size_t name_len = profile_key(&f->super, name, sizeof(name));
+    size_t base = sizeof(TB_ProfileHeader) + align_up(name_len, 8);
+
+    // the call table goes after the counters
+    char callee[1024];
+    size_t call_size = 0;
+    FOREACH_N(i, 0, call_count) {
+        call_size += sizeof(TB_ProfileCallHeader) + align_up(profile_key(calls[i].target, callee, sizeof(callee)), 8);
+    }
+
+    size_t call_base = base + count*sizeof(uint64_t);
+    TB_Global* g = tb_global_create(m, 0, NULL, NULL, TB_LINKAGE_PRIVATE);
+    g->super.ordinal = f->super.ordinal;
+    tb_global_set_storage(m, m->prof_section, g, call_base + call_size, 8, call_count ? 2 : 1);
+
+    char* header = tb_global_add_region(m, g, 0, base);
+    memset(header, 0, base);
+    *((TB_ProfileHeader*) header) = (TB_ProfileHeader){ name_len, count, call_count, call_size };
+    memcpy(header + sizeof(TB_ProfileHeader), name, name_len);
+
+    if (call_count) {
+        char* table = tb_global_add_region(m, g, call_base, call_size);
+        memset(table, 0, call_size);
+
+        FOREACH_N(i, 0, call_count) {
+            size_t len = profile_key(calls[i].target, callee, sizeof(callee));
+            *((TB_ProfileCallHeader*) table) = (TB_ProfileCallHeader){ calls[i].block, len };
+            memcpy(table + sizeof(TB_ProfileCallHeader), callee, len);
+            table += sizeof(TB_ProfileCallHeader) + align_up(len, 8);
+        }
+    }
+
+    mtx_lock(&m->lock);
+    dyn_array_put(m->prof_counters, g);
+    mtx_unlock(&m->lock);
+
+    *out_base = base;
+    return g;
+}
+
+TB_Function* tb_module_finish_instrumentation(TB_Module* m, const char* path) {
+    TB_Function* f = m->prof_dumper;
+    if (f == NULL) {
+        return NULL;
+    }
+
+    TB_PrototypeParam ptr = { TB_TYPE_PTR };
+    TB_PrototypeParam word = { TB_TYPE_I64 };
+
+    // FILE* fopen(const char*, const char*)
+    TB_PrototypeParam fopen_params[] = { ptr, ptr };
+    TB_FunctionPrototype* fopen_proto = tb_prototype_create(m, TB_CDECL, 2, fopen_params, 1, &ptr, false);
+    // size_t fwrite(const void*, size_t, size_t, FILE*)
+    TB_PrototypeParam fwrite_params[] = { ptr, word, word, ptr };
+    TB_FunctionPrototype* fwrite_proto = tb_prototype_create(m, TB_CDECL, 4, fwrite_params, 1, &word, false);
+    // int fclose(FILE*)
+    TB_PrototypeParam fclose_ret = { TB_TYPE_I32 };
+    TB_FunctionPrototype* fclose_proto = tb_prototype_create(m, TB_CDECL, 1, &ptr, 1, &fclose_ret, false);
+
+    TB_External* fopen_sym  = tb_extern_create(m, -1, "fopen",  TB_EXTERNAL_SO_LOCAL);
+    TB_External* fwrite_sym = tb_extern_create(m, -1, "fwrite", TB_EXTERNAL_SO_LOCAL);
+    TB_External* fclose_sym = tb_extern_create(m, -1, "fclose", TB_EXTERNAL_SO_LOCAL);
+
+    TB_FunctionPrototype* proto = tb_prototype_create(m, TB_CDECL, 0, NULL, 0, NULL, false);
+    tb_function_set_prototype(f, tb_module_get_text(m), proto, NULL);
+
+    // fp = fopen(path, "ab")
+    TB_Node* fopen_args[] = { tb_inst_cstring(f, path), tb_inst_cstring(f, "ab") };
+    TB_Node* fp = tb_inst_call(f, fopen_proto, tb_inst_get_symbol_address(f, (TB_Symbol*) fopen_sym), 2, fopen_args).single;
+
+    TB_Node* write_bb = tb_inst_region(f);
+    TB_Node* exit_bb = tb_inst_region(f);
+    tb_inst_if(f, tb_inst_cmp_eq(f, fp, tb_inst_uint(f, TB_TYPE_PTR, 0)), exit_bb, write_bb);
+
+    // fwrite(record, size, 1, fp) for each function
+    tb_inst_set_control(f, write_bb);
+    mtx_lock(&m->lock);
+    dyn_array_for(i, m->prof_counters) {
+        TB_Global* g = m->prof_counters[i];
+
+        TB_Node* args[] = {
+            tb_inst_get_symbol_address(f, (TB_Symbol*) g),
+            tb_inst_uint(f, TB_TYPE_I64, g->size),
+            tb_inst_uint(f, TB_TYPE_I64, 1),
+            fp,
+        };
+        tb_inst_call(f, fwrite_proto, tb_inst_get_symbol_address(f, (TB_Symbol*) fwrite_sym), 4, args);
+    }
+    mtx_unlock(&m->lock);
+
+    tb_inst_call(f, fclose_proto, tb_inst_get_symbol_address(f, (TB_Symbol*) fclose_sym), 1, &fp);
+    tb_inst_goto(f, exit_bb);
+
+    tb_inst_set_control(f, exit_bb);
+    tb_inst_ret(f, 0, NULL);
+    return f;
+}
+
+bool tb_module_load_profile(TB_Module* m, const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return false;
+    }
+
+    fseek(file, 0, SEEK_END);
+    size_t length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    uint8_t* data = tb_platform_heap_alloc(length);
+    size_t read = fread(data, 1, length, file);
+    fclose(file);
+
+    if (read != length) {
+        tb_platform_heap_free(data);
+        return false;
+    }
+
+    TB_Arena* arena = get_permanent_arena(m);
+    bool valid = true;
+
+    size_t i = 0;
+    while (i + sizeof(TB_ProfileHeader) <= length) {
+        TB_ProfileHeader header;
+        memcpy(&header, &data[i], sizeof(TB_ProfileHeader));
+
+        size_t base = sizeof(TB_ProfileHeader) + align_up(header.name_len, 8);
+        size_t call_base = base + header.count*sizeof(uint64_t);
+        size_t size = call_base + header.call_size;
+        if (i + size > length) {
+            // truncated record, probably a run which crashed mid-dump
+            valid = false;
+            break;
+        }
+
+        const char* name = (const char*) &data[i + sizeof(TB_ProfileHeader)];
+        const uint8_t* counters = &data[i + base];
+
+        NL_Slice key = { header.name_len, (const uint8_t*) name };
+        ptrdiff_t search = nl_map_get(m->profiles, key);
+
+        TB_Profile* prof;
+        if (search >= 0) {
+            prof = m->profiles[search].v;
+            if (prof->count != header.count) {
+                // the function changed between runs? it's not trustworthy anymore
+                prof->count = 0;
+            }
+        } else {
+            prof = tb_arena_alloc(arena, sizeof(TB_Profile) + header.count*sizeof(uint64_t));
+            prof->calls = NULL;
+            prof->count = header.count;
+            memset(prof->counters, 0, header.count*sizeof(uint64_t));
+
+            key.data = (const uint8_t*) tb__arena_strdup(m, header.name_len, name);
+            nl_map_put(m->profiles, key, prof);
+        }
+
+        // multiple runs are summed
+        FOREACH_N(j, 0, prof->count) {
+            uint64_t c;
+            memcpy(&c, &counters[j * sizeof(uint64_t)], sizeof(uint64_t));
+            prof->counters[j] += c;
+        }
+
+        // call edges are weighed with this run's own counters, they don't
+        // care if the block layout changed between runs.
+        size_t j = call_base, end = size;
+        FOREACH_N(k, 0, header.call_count) {
+            TB_ProfileCallHeader site;
+            if (j + sizeof(TB_ProfileCallHeader) > end) {
+                valid = false;
+                break;
+            }
+
+            memcpy(&site, &data[i + j], sizeof(TB_ProfileCallHeader));
+            NL_Slice callee = { site.name_len, &data[i + j + sizeof(TB_ProfileCallHeader)] };
+            j += sizeof(TB_ProfileCallHeader) + align_up(site.name_len, 8);
+            if (j > end || site.block >= header.count) {
+                valid = false;
+                break;
+            }
+
+            uint64_t c;
+            memcpy(&c, &counters[site.block * sizeof(uint64_t)], sizeof(uint64_t));
+
+            TB_ProfileCall* edge = prof->calls;
+            while (edge != NULL && !profile_key_eq(edge->callee, callee)) {
+                edge = edge->next;
+            }
+
+            if (edge == NULL) {
+                edge = tb_arena_alloc(arena, sizeof(TB_ProfileCall));
+                edge->next = prof->calls;
+                edge->callee = (NL_Slice){ callee.length, (const uint8_t*) tb__arena_strdup(m, callee.length, (const char*) callee.data) };
+                edge->count = 0;
+                prof->calls = edge;
+            }
+
+            edge->count += c;
+            if (m->prof_max_call < edge->count) {
+                m->prof_max_call = edge->count;
+            }
+        }
+
+        i += size;
+    }
+
+    tb_platform_heap_free(data);
+    return valid;
+}
+
+const uint64_t* tb_function_get_profile(TB_Function* f, size_t* out_count) {
+    TB_Module* m = f->super.module;
+    if (m->profiles == NULL || f->super.name == NULL) {
+        return NULL;
+    }
+
+    char name[1024];
+    NL_Slice key = { profile_key(&f->super, name, sizeof(name)), (const uint8_t*) name };
+    ptrdiff_t search = nl_map_get(m->profiles, key);
+    if (search < 0 || m->profiles[search].v->count == 0) {
+        return NULL;
+    }
+
+    TB_Profile* prof = m->profiles[search].v;
+    *out_count = prof->count;
+    return prof->counters;
+}
+
+uint64_t tb__profile_call_count(TB_Module* m, TB_Function* caller, TB_Symbol* callee) {
+    if (m->profiles == NULL || caller->super.name == NULL || callee->name == NULL) {
+        return 0;
+    }
+
+    char name[1024];
+    NL_Slice key = { profile_key(&caller->super, name, sizeof(name)), (const uint8_t*) name };
+    ptrdiff_t search = nl_map_get(m->profiles, key);
+    if (search < 0) {
+        return 0;
+    }
+
+    key.length = profile_key(callee, name, sizeof(name));
+    for (TB_ProfileCall* edge = m->profiles[search].v->calls; edge; edge = edge->next) {
+        if (profile_key_eq(edge->callee, key)) {
+            return edge->count;
+        }
+    }
+
+    return 0;
+}
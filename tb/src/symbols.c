@@ -7,7 +7,8 @@ TB_SymbolIter tb_symbol_iter(TB_Module* mod) {
 
 TB_Symbol* tb_symbol_iter_next(TB_SymbolIter* iter) {
     for (TB_ThreadInfo* info = iter->info; info != NULL; info = info->next_in_module) {
-        size_t cap = 1ull << info->symbols.exp;
+        // threads which never made a symbol don't have a table
+        size_t cap = info->symbols.data ? 1ull << info->symbols.exp : 0;
         for (size_t i = iter->i; i < cap; i++) {
             void* ptr = info->symbols.data[i];
             if (ptr == NULL) continue;
@@ -17,13 +18,21 @@ TB_Symbol* tb_symbol_iter_next(TB_SymbolIter* iter) {
             iter->info = info;
             return (TB_Symbol*) ptr;
         }
+
+        // the next table starts from the top
+        iter->i = 0;
     }
 
+    iter->info = NULL;
     return NULL;
 }
 
 void tb_module_kill_symbol(TB_Module* m, TB_Symbol* sym) {
-    sym->tag = TB_SYMBOL_TOMBSTONE;
+    // the exporters size their tables off of the counts
+    TB_SymbolTag old = atomic_exchange(&sym->tag, TB_SYMBOL_TOMBSTONE);
+    if (old != TB_SYMBOL_TOMBSTONE) {
+        atomic_fetch_sub(&m->symbol_count[old], 1);
+    }
 }
 
 void tb_symbol_append(TB_Module* m, TB_Symbol* s) {
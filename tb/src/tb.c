@@ -2,6 +2,14 @@
 #include "host.h"
 #include "passes.h"
 
+#if defined(TB_HOST_X86_64)
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
 TB_ThreadInfo* tb_thread_info(TB_Module* m) {
     static thread_local TB_ThreadInfo* chain;
     static thread_local mtx_t lock;
@@ -59,8 +67,8 @@ static thread_local uint8_t* tb_thread_storage;
 ICodeGen* tb__find_code_generator(TB_Module* m) {
     switch (m->target_arch) {
         case TB_ARCH_X86_64: return &tb__x64_codegen;
-        // case TB_ARCH_AARCH64: return &tb__aarch64_codegen;
-        // case TB_ARCH_WASM32: return &tb__wasm32_codegen;
+        case TB_ARCH_AARCH64: return &tb__aarch64_codegen;
+        case TB_ARCH_WASM32: return &tb__wasm32_codegen;
         default: return NULL;
     }
 }
@@ -106,6 +114,107 @@ TB_Module* tb_module_create_for_host(const TB_FeatureSet* features, bool is_jit)
     return tb_module_create(arch, sys, features, is_jit);
 }
 
+#if defined(TB_HOST_X86_64)
+static void host_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4]) {
+    #if defined(_MSC_VER) && !defined(__clang__)
+    __cpuidex((int*) regs, leaf, subleaf);
+    #else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+    #endif
+}
+
+static uint64_t host_xgetbv(void) {
+    #if defined(_MSC_VER) && !defined(__clang__)
+    return _xgetbv(0);
+    #else
+    uint32_t lo, hi;
+    __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return ((uint64_t) hi << 32ull) | lo;
+    #endif
+}
+#endif
+
+void tb_get_host_features(TB_FeatureSet* out) {
+    *out = (TB_FeatureSet){ 0 };
+
+    #if defined(TB_HOST_X86_64)
+    uint32_t regs[4];
+    host_cpuid(0, 0, regs);
+    uint32_t max_leaf = regs[0];
+
+    TB_FeatureSet_X64 f = 0;
+    host_cpuid(1, 0, regs);
+    uint32_t ecx1 = regs[2];
+    if (ecx1 & (1u << 0))  f |= TB_FEATURE_X64_SSE3;
+    if (ecx1 & (1u << 1))  f |= TB_FEATURE_X64_CLMUL;
+    if (ecx1 & (1u << 19)) f |= TB_FEATURE_X64_SSE41;
+    if (ecx1 & (1u << 20)) f |= TB_FEATURE_X64_SSE42;
+    if (ecx1 & (1u << 23)) f |= TB_FEATURE_X64_POPCNT;
+
+    // AVX needs the OS to save the YMM state too (OSXSAVE + XCR0 bits 1 & 2)
+    bool ymm_state = (ecx1 & (1u << 27)) && (host_xgetbv() & 6) == 6;
+    if (ymm_state && (ecx1 & (1u << 28))) f |= TB_FEATURE_X64_AVX;
+    if (ymm_state && (ecx1 & (1u << 29))) f |= TB_FEATURE_X64_F16C;
+
+    if (max_leaf >= 7) {
+        host_cpuid(7, 0, regs);
+        uint32_t ebx7 = regs[1];
+        if (ebx7 & (1u << 3)) f |= TB_FEATURE_X64_BMI1;
+        if (ebx7 & (1u << 8)) f |= TB_FEATURE_X64_BMI2;
+        if ((f & TB_FEATURE_X64_AVX) && (ebx7 & (1u << 5))) f |= TB_FEATURE_X64_AVX2;
+    }
+
+    host_cpuid(0x80000000, 0, regs);
+    if (regs[0] >= 0x80000001) {
+        // ABM is what AMD calls LZCNT
+        host_cpuid(0x80000001, 0, regs);
+        if (regs[2] & (1u << 5)) f |= TB_FEATURE_X64_LZCNT;
+    }
+
+    out->x64 = f;
+    #endif
+}
+
+bool tb_get_named_features(TB_Arch arch, const char* name, TB_FeatureSet* out) {
+    if (strcmp(name, "native") == 0) {
+        #if defined(TB_HOST_X86_64)
+        if (arch == TB_ARCH_X86_64) {
+            tb_get_host_features(out);
+            return true;
+        }
+        #endif
+
+        return false;
+    }
+
+    if (arch == TB_ARCH_X86_64) {
+        // the psABI microarchitecture levels (AVX-512 is ignored since we don't use it)
+        enum {
+            V2 = TB_FEATURE_X64_SSE3 | TB_FEATURE_X64_SSE41 | TB_FEATURE_X64_SSE42 | TB_FEATURE_X64_POPCNT,
+            V3 = V2 | TB_FEATURE_X64_AVX | TB_FEATURE_X64_AVX2 | TB_FEATURE_X64_BMI1 | TB_FEATURE_X64_BMI2 | TB_FEATURE_X64_F16C | TB_FEATURE_X64_LZCNT,
+        };
+
+        static const struct {
+            const char* name;
+            TB_FeatureSet_X64 features;
+        } levels[] = {
+            { "x86-64",    0  },
+            { "x86-64-v2", V2 },
+            { "x86-64-v3", V3 },
+            { "x86-64-v4", V3 },
+        };
+
+        FOREACH_N(i, 0, COUNTOF(levels)) {
+            if (strcmp(name, levels[i].name) == 0) {
+                *out = (TB_FeatureSet){ .x64 = levels[i].features };
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
 TB_ModuleSectionHandle tb_module_create_section(TB_Module* m, ptrdiff_t len, const char* name, TB_ModuleSectionFlags flags, TB_ComdatType comdat) {
     size_t i = dyn_array_length(m->sections);
     dyn_array_put_uninit(m->sections, 1);
@@ -129,7 +238,13 @@ TB_Module* tb_module_create(TB_Arch arch, TB_System sys, const TB_FeatureSet* fe
 
     m->is_jit = is_jit;
 
-    m->target_abi = (sys == TB_SYSTEM_WINDOWS) ? TB_ABI_WIN64 : TB_ABI_SYSTEMV;
+    if (arch == TB_ARCH_AARCH64) {
+        m->target_abi = TB_ABI_AAPCS64;
+    } else if (arch == TB_ARCH_WASM32) {
+        m->target_abi = TB_ABI_WASM32;
+    } else {
+        m->target_abi = (sys == TB_SYSTEM_WINDOWS) ? TB_ABI_WIN64 : TB_ABI_SYSTEMV;
+    }
     m->target_arch = arch;
     m->target_system = sys;
     if (features == NULL) {
@@ -271,6 +386,8 @@ void tb_module_destroy(TB_Module* m) {
         info = next;
     }
 
+    dyn_array_destroy(m->prof_counters);
+    nl_map_free(m->profiles);
     dyn_array_destroy(m->files);
     tb_platform_heap_free(m);
 }
@@ -309,6 +426,7 @@ TB_FunctionPrototype* tb_prototype_create(TB_Module* m, TB_CallingConv cc, size_
     p->return_count = return_count;
     p->param_count = param_count;
     p->has_varargs = has_varargs;
+    p->has_indirect_return = false;
     if (param_count > 0) {
         memcpy(p->params, params, param_count * sizeof(TB_PrototypeParam));
     }
@@ -481,6 +599,23 @@ void tb_module_set_tls_index(TB_Module* m, ptrdiff_t len, const char* name) {
     }
 }
 
+void tb_module_set_regalloc(TB_Module* m, TB_RegAlloc ra) {
+    m->regalloc = ra;
+}
+
+void tb_module_set_scheduler(TB_Module* m, TB_Scheduler sched) {
+    m->scheduler = sched;
+}
+
+void tb_module_get_peephole_stats(TB_Module* m, size_t* out_hits, size_t* out_bytes) {
+    *out_hits = m->peephole_hits;
+    *out_bytes = m->peephole_bytes;
+}
+
+void tb_module_set_thread_pool(TB_Module* m, TB_ThreadPool* tp) {
+    m->thread_pool = tp;
+}
+
 void tb_symbol_bind_ptr(TB_Symbol* s, void* ptr) {
     s->address = ptr;
 }
@@ -736,6 +871,7 @@ size_t tb_outstr_nul(TB_Emitter* o, const char* str) {
     tb_out_reserve(o, len);
 
     memcpy(&o->data[o->count], str, len);
+    o->count += len;
     return start;
 }
 
@@ -207,6 +207,13 @@ TB_Node* tb_inst_param(TB_Function* f, int param_id) {
     return f->params[3 + param_id];
 }
 
+void tb_function_set_noalias(TB_Function* f, int param_id) {
+    assert(param_id < f->param_count);
+    if (param_id < 64) {
+        f->noalias_params |= 1ull << param_id;
+    }
+}
+
 void tb_get_data_type_size(TB_Module* mod, TB_DataType dt, size_t* size, size_t* align) {
     const ICodeGen* restrict code_gen = tb__find_code_generator(mod);
     code_gen->get_data_type_size(dt, size, align);
@@ -280,7 +287,7 @@ TB_Node* tb_inst_load(TB_Function* f, TB_DataType dt, TB_Node* addr, TB_CharUnit
     }
 }
 
-void tb_inst_store(TB_Function* f, TB_DataType dt, TB_Node* addr, TB_Node* val, uint32_t alignment, bool is_volatile) {
+TB_Node* tb_inst_store(TB_Function* f, TB_DataType dt, TB_Node* addr, TB_Node* val, uint32_t alignment, bool is_volatile) {
     assert(TB_DATA_TYPE_EQUALS(dt, val->dt));
 
     TB_Node* n = tb_alloc_node(f, is_volatile ? TB_WRITE : TB_STORE, TB_TYPE_MEMORY, 4, sizeof(TB_NodeMemAccess));
@@ -289,6 +296,13 @@ void tb_inst_store(TB_Function* f, TB_DataType dt, TB_Node* addr, TB_Node* val,
     n->inputs[2] = addr;
     n->inputs[3] = val;
     TB_NODE_SET_EXTRA(n, TB_NodeMemAccess, .align = alignment);
+    return n;
+}
+
+void tb_inst_set_alias_class(TB_Function* f, TB_Node* mem_op, int alias_class) {
+    if (mem_op->type == TB_LOAD || mem_op->type == TB_STORE) {
+        TB_NODE_GET_EXTRA_T(mem_op, TB_NodeMemAccess)->alias_class = alias_class;
+    }
 }
 
 void tb_inst_memset(TB_Function* f, TB_Node* dst, TB_Node* val, TB_Node* size, TB_CharUnits align) {
@@ -467,12 +481,15 @@ TB_MultiOutput tb_inst_call(TB_Function* f, TB_FunctionPrototype* proto, TB_Node
 }
 
 void tb_inst_tailcall(TB_Function* f, TB_FunctionPrototype* proto, TB_Node* target, size_t param_count, TB_Node** params) {
-    size_t proj_count = 2 + (proto->return_count > 1 ? proto->return_count : 1);
+    TB_Node* mem_state = peek_mem(f, f->active_control_node);
 
-    TB_Node* n = tb_alloc_node(f, TB_CALL, TB_TYPE_TUPLE, 3 + param_count, sizeof(TB_NodeCall) + (sizeof(TB_Node*)*proj_count));
+    // the callee returns straight to our caller so there's no projections
+    TB_Node* n = tb_alloc_node(f, TB_TAILCALL, TB_TYPE_CONTROL, 4 + param_count, sizeof(TB_NodeCall));
     n->inputs[0] = f->active_control_node;
-    n->inputs[2] = target;
-    memcpy(n->inputs + 3, params, param_count * sizeof(TB_Node*));
+    n->inputs[1] = mem_state;
+    n->inputs[2] = f->params[2];
+    n->inputs[3] = target;
+    memcpy(n->inputs + 4, params, param_count * sizeof(TB_Node*));
 
     TB_NodeCall* c = TB_NODE_GET_EXTRA(n);
     c->proto = proto;
@@ -96,6 +96,14 @@ struct TB_SymbolPatch {
     const TB_Symbol* target;
 };
 
+// wasm needs the callee's signature where x64 just needs an address, call_indirect
+// encodes a type index (target is NULL) and imports need their types declared.
+typedef struct {
+    uint32_t pos;
+    const TB_Symbol* target;
+    TB_FunctionPrototype* proto;
+} TB_ProtoPatch;
+
 struct TB_External {
     TB_Symbol super;
     TB_ExternalType type;
@@ -135,6 +143,10 @@ struct TB_Global {
     // contents
     uint32_t obj_count, obj_capacity;
     TB_InitObj* objects;
+
+    // set by tb_module_ipo when nothing can write to it, loads
+    // from it just read the initializer.
+    bool readonly;
 };
 
 struct TB_DebugType {
@@ -241,11 +253,19 @@ struct TB_CodeRegion {
 
 typedef struct COFF_UnwindInfo COFF_UnwindInfo;
 
+// functions are grouped by how hot they are in the final layout
+typedef enum {
+    TB_HEAT_HOT,    // ran during profiling
+    TB_HEAT_NORMAL, // no clue
+    TB_HEAT_COLD,   // never ran during profiling or can't return (it always traps)
+} TB_CodeHeat;
+
 typedef struct TB_FunctionOutput {
     TB_Function* parent;
     TB_ModuleSectionHandle section;
 
     TB_Linkage linkage;
+    TB_CodeHeat heat;
 
     uint64_t ordinal;
     uint8_t prologue_length;
@@ -263,6 +283,10 @@ typedef struct TB_FunctionOutput {
     uint32_t unwind_info;
     uint32_t unwind_size;
 
+    // where this function's relocations start within the section's
+    // relocation array, filled by tb__layout_relocations.
+    uint32_t reloc_pos;
+
     DynArray(TB_StackSlot) stack_slots;
 
     // Part of the debug info
@@ -272,6 +296,8 @@ typedef struct TB_FunctionOutput {
     uint32_t patch_pos;
     uint32_t patch_count;
     TB_SymbolPatch* last_patch;
+
+    DynArray(TB_ProtoPatch) proto_patches;
 } TB_FunctionOutput;
 
 struct TB_Function {
@@ -286,6 +312,9 @@ struct TB_Function {
     size_t param_count;
     TB_Node** params;
 
+    // restrict params (bit per param)
+    uint64_t noalias_params;
+
     TB_Node* start_node;
     TB_Node* stop_node;
 
@@ -334,6 +363,8 @@ struct TB_ModuleSection {
     uint32_t total_size;
     uint32_t reloc_count;
     uint32_t reloc_pos;
+    // function relocations come first, the globals' start after these
+    uint32_t func_reloc_count;
 
     DynArray(TB_Global*) globals;
     DynArray(TB_FunctionOutput*) funcs;
@@ -379,6 +410,52 @@ typedef struct {
     TB_External** data;
 } ExportList;
 
+// .tbprof records are laid out as:
+//
+//   uint32_t name_len, count;
+//   uint32_t call_count, call_size;
+//   char     name[name_len];     (padded to 8 bytes)
+//   uint64_t counters[count];
+//   calls[call_count]            (call_size bytes in total)
+//
+// each call site is:
+//
+//   uint32_t block, name_len;
+//   char     name[name_len];     (padded to 8 bytes)
+//
+// it's the block the call lives in along with the callee's key, the loader uses
+// those to figure out how often each caller->callee edge ran.
+typedef struct {
+    uint32_t name_len, count;
+    uint32_t call_count, call_size;
+} TB_ProfileHeader;
+
+typedef struct {
+    uint32_t block, name_len;
+} TB_ProfileCallHeader;
+
+// what codegen hands the instrumentation, one per direct call
+typedef struct {
+    uint32_t block;
+    TB_Symbol* target;
+} TB_ProfileCallSite;
+
+typedef struct TB_ProfileCall TB_ProfileCall;
+struct TB_ProfileCall {
+    TB_ProfileCall* next;
+    NL_Slice callee;
+    uint64_t count;
+};
+
+// loaded counters (summed across runs)
+typedef struct {
+    // call edges out of this function
+    TB_ProfileCall* calls;
+
+    size_t count;
+    uint64_t counters[];
+} TB_Profile;
+
 struct TB_Module {
     bool is_jit;
 
@@ -399,14 +476,24 @@ struct TB_Module {
     TB_Arch target_arch;
     TB_System target_system;
     TB_FeatureSet features;
+    TB_RegAlloc regalloc;
+    TB_Scheduler scheduler;
     ExportList exports;
 
+    // optional, see tb_module_set_thread_pool
+    TB_ThreadPool* thread_pool;
+
     // This is a hack for windows since they've got this idea
     // of a _tls_index
     TB_Symbol* tls_index_extern;
     TB_Symbol* chkstk_extern;
 
     _Atomic uint32_t compiled_function_count;
+
+    // machine peephole stats (see tb_module_get_peephole_stats)
+    _Atomic uint64_t peephole_hits, peephole_bytes;
+    // whole program stats (see tb_module_get_ipo_stats)
+    size_t ipo_inlined, ipo_killed, ipo_constants;
     _Atomic uint32_t symbol_count[TB_SYMBOL_MAX];
 
     // needs to be locked with 'TB_Module.lock'
@@ -415,6 +502,16 @@ struct TB_Module {
     // unused by the JIT
     DynArray(TB_ModuleSection) sections;
 
+    // profile guided optimization (see profile.c), prof_dumper
+    // is NULL if we're not instrumenting.
+    TB_Function* prof_dumper;
+    TB_ModuleSectionHandle prof_section;
+    // needs to be locked with 'TB_Module.lock'
+    DynArray(TB_Global*) prof_counters;
+    // filled by tb_module_load_profile
+    NL_Strmap(TB_Profile*) profiles;
+    uint64_t prof_max_call;
+
     // windows specific lol
     TB_LinkerSectionPiece* xdata;
 };
@@ -579,6 +676,13 @@ TB_Node* tb__make_proj(TB_Function* f, TB_DataType dt, TB_Node* src, int index);
 
 ExportList tb_module_layout_sections(TB_Module* m);
 
+// splits [0, count) into batches of at least grain items and spreads them
+// across the module's thread pool, without one it's just a loop.
+typedef void (*TB_ParallelFn)(void* ctx, size_t start, size_t end);
+void tb_parallel_for(TB_Module* m, size_t count, size_t grain, void* ctx, TB_ParallelFn fn);
+// same thing without a module (the linker has its own pool), tp can be NULL
+void tb_parallel_for_pool(TB_ThreadPool* tp, size_t count, size_t grain, void* ctx, TB_ParallelFn fn);
+
 ////////////////////////////////
 // EXPORTER HELPER
 ////////////////////////////////
@@ -595,10 +699,18 @@ void print_node_sexpr(TB_Node* n, int depth);
 
 TB_Symbol* tb_symbol_alloc(TB_Module* m, TB_SymbolTag tag, ptrdiff_t len, const char* name, size_t size);
 void tb_symbol_append(TB_Module* m, TB_Symbol* s);
+void tb_module_kill_symbol(TB_Module* m, TB_Symbol* sym);
 
 void tb_emit_symbol_patch(TB_FunctionOutput* func_out, const TB_Symbol* target, size_t pos);
 TB_Global* tb__small_data_intern(TB_Module* m, size_t len, const void* data);
 
+// allocates the function's .tbprof record, out_base is the offset of the first counter
+TB_Global* tb__profile_counters(TB_Module* m, TB_Function* f, size_t count, size_t call_count, const TB_ProfileCallSite* calls, int32_t* out_base);
+
+// how many times the caller->callee edge ran in the loaded profile (summed over
+// all the call sites), 0 if we don't know.
+uint64_t tb__profile_call_count(TB_Module* m, TB_Function* caller, TB_Symbol* callee);
+
 // out_bytes needs at least 16 bytes
 void tb__md5sum(uint8_t* out_bytes, uint8_t* initial_msg, size_t initial_len);
 
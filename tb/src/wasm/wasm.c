@@ -1,138 +1,1712 @@
-#if 0
-#include "../codegen/emitter.h"
+// WebAssembly backend, there's no register allocation here since wasm is a stack
+// machine with infinite locals, the interesting parts are deciding which values
+// can be left on the operand stack and rebuilding structured control flow.
+//
+// Control flow follows "Beyond Relooper" (Norman Ramsey, 2022), for reducible CFGs
+// the dominator tree tells us where every block and loop goes:
+//   * loop headers get wrapped in a 'loop' (backedges are 'br's to it)
+//   * merge nodes (blocks with 2+ forward preds) get placed after their idom
+//     inside a 'block' (forward edges are 'br's out of it)
+//   * everything else is inlined at its only predecessor.
 #include "../tb_internal.h"
+#include "../passes.h"
+#include "../codegen/emitter.h"
+#include "wasm.h"
+
+static const char* op_names[256] = {
+    #define X(name, op, str) [op] = str,
+    WASM_OPS(X)
+    #undef X
+};
+
+typedef struct {
+    TB_Node* ctrl; // branch projection or the end of a fallthrough block
+    int succ;      // -1 if the edge was killed
+} Edge;
+
+typedef struct {
+    TB_Node* n;
+    TB_Node* end;
+
+    int idom, rpo;
+    int first_child, next_sibling;
+
+    // forward edges into this block, 2+ makes it a merge node
+    int fwd_preds;
+    bool is_loop;
 
-// used to add patches since there's separate arrays per thread
-static thread_local size_t s_local_thread_id;
+    int edge_count;
+    Edge* edges;
+
+    int item_start, item_count;
+} Block;
+
+enum {
+    VAL_NONE,   // dead
+    VAL_STMT,   // doesn't produce a value (or it's a tuple), gets emitted at its position
+    VAL_REMAT,  // constants, addresses and params are just rebuilt at each use
+    VAL_INLINE, // single use which the operand stack can carry there
+    VAL_LOCAL,  // everything else is stored into a wasm local
+};
+
+typedef struct {
+    uint8_t kind;
+    int block, pos;
+
+    // inline values are evaluated wherever their user is
+    int root;
+
+    // wasm local index (or frame offset for TB_LOCAL)
+    int local;
+} Val;
+
+enum {
+    FRAME_IF,
+    FRAME_LOOP,  // target is the loop header
+    FRAME_BLOCK, // target is the merge node placed after it
+    FRAME_ARM,   // switch arm
+};
 
-typedef struct WasmVal {
-    int users_left;  // each time we use it, we decrement. it starts with all the direct users
-    int local_slot;  // -1 when invalid
-} WasmVal;
+typedef struct {
+    int kind, target;
+} Frame;
 
-typedef struct WasmCtx {
+typedef struct {
     TB_CGEmitter emit;
 
+    TB_Passes* p;
     TB_Function* f;
-    WasmVal* vals;
-} WasmCtx;
+    TB_CFG cfg;
 
-static size_t wasm_emit_call_patches(TB_Module* restrict m) {
-    return 0;
+    size_t block_count;
+    Block* blocks;
+    TB_Node** items;
+    Val* vals;
+
+    DynArray(Frame) frames;
+    int depth;
+
+    // shadow stack frame
+    int fp;
+    uint32_t frame_size;
+} Ctx;
+
+////////////////////////////////
+// Encoding
+////////////////////////////////
+static void emit_uleb(Ctx* ctx, uint64_t x) {
+    do {
+        uint8_t b = x & 0x7F;
+        x >>= 7;
+        EMIT1(&ctx->emit, b | (x ? 0x80 : 0));
+    } while (x);
 }
 
-static void wasm_get_data_type_size(TB_DataType dt, TB_CharUnits* out_size, TB_CharUnits* out_align) {
-    switch (dt.type) {
-        case TB_INT: {
-            // round up bits to a byte
-            bool is_big_int = dt.data > 64;
-            int bits = is_big_int ? ((dt.data + 7) / 8) : tb_next_pow2(dt.data);
+static void emit_sleb(Ctx* ctx, int64_t x) {
+    for (;;) {
+        uint8_t b = x & 0x7F;
+        x >>= 7;
+
+        bool done = (x == 0 && (b & 0x40) == 0) || (x == -1 && (b & 0x40) != 0);
+        EMIT1(&ctx->emit, b | (done ? 0 : 0x80));
+        if (done) break;
+    }
+}
+
+static void emit_padded(Ctx* ctx, uint32_t x, bool is_signed) {
+    wasm_put_padded_leb(tb_cgemit_reserve(&ctx->emit, WASM_PADDED_LEB), x, is_signed);
+    ctx->emit.count += WASM_PADDED_LEB;
+}
+
+static void asm_op(Ctx* ctx, WasmOp op) {
+    EMITA(&ctx->emit, "  %*s%s", ctx->depth * 2, "", op_names[op]);
+}
+
+static void op0(Ctx* ctx, WasmOp op) {
+    if (op == WASM_END || op == WASM_ELSE) ctx->depth--;
+
+    EMIT1(&ctx->emit, op);
+    asm_op(ctx, op);
+    EMITA(&ctx->emit, "\n");
+
+    if (op == WASM_ELSE) ctx->depth++;
+}
+
+// block, loop, if (always void since we only communicate through locals)
+static void op_block(Ctx* ctx, WasmOp op) {
+    EMIT1(&ctx->emit, op);
+    EMIT1(&ctx->emit, WASM_VOID);
+    asm_op(ctx, op);
+    EMITA(&ctx->emit, "\n");
+    ctx->depth++;
+}
+
+static void op_idx(Ctx* ctx, WasmOp op, uint32_t x) {
+    EMIT1(&ctx->emit, op);
+    emit_uleb(ctx, x);
+    asm_op(ctx, op);
+    EMITA(&ctx->emit, " %u\n", x);
+}
+
+static void op_mem(Ctx* ctx, WasmOp op, int align, uint32_t offset) {
+    EMIT1(&ctx->emit, op);
+    emit_uleb(ctx, align);
+    emit_uleb(ctx, offset);
+    asm_op(ctx, op);
+    if (offset) EMITA(&ctx->emit, " offset=%u", offset);
+    EMITA(&ctx->emit, " align=%d\n", 1 << align);
+}
+
+static void op_i32(Ctx* ctx, int32_t x) {
+    EMIT1(&ctx->emit, WASM_I32_CONST);
+    emit_sleb(ctx, x);
+    asm_op(ctx, WASM_I32_CONST);
+    EMITA(&ctx->emit, " %d\n", x);
+}
+
+static void op_i64(Ctx* ctx, int64_t x) {
+    EMIT1(&ctx->emit, WASM_I64_CONST);
+    emit_sleb(ctx, x);
+    asm_op(ctx, WASM_I64_CONST);
+    EMITA(&ctx->emit, " %"PRId64"\n", x);
+}
+
+static void op_f32(Ctx* ctx, float x) {
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+
+    EMIT1(&ctx->emit, WASM_F32_CONST);
+    EMIT4(&ctx->emit, bits);
+    asm_op(ctx, WASM_F32_CONST);
+    EMITA(&ctx->emit, " %f\n", x);
+}
+
+static void op_f64(Ctx* ctx, double x) {
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+
+    EMIT1(&ctx->emit, WASM_F64_CONST);
+    EMIT8(&ctx->emit, bits);
+    asm_op(ctx, WASM_F64_CONST);
+    EMITA(&ctx->emit, " %f\n", x);
+}
+
+static void op_fc(Ctx* ctx, int sub) {
+    static const char* names[] = {
+        "i32.trunc_sat_f32_s", "i32.trunc_sat_f32_u", "i32.trunc_sat_f64_s", "i32.trunc_sat_f64_u",
+        "i64.trunc_sat_f32_s", "i64.trunc_sat_f32_u", "i64.trunc_sat_f64_s", "i64.trunc_sat_f64_u",
+        NULL, NULL, "memory.copy", "memory.fill",
+    };
+
+    EMIT1(&ctx->emit, WASM_PREFIX_FC);
+    emit_uleb(ctx, sub);
+    EMITA(&ctx->emit, "  %*s%s\n", ctx->depth * 2, "", names[sub]);
+
+    // memory indices
+    if (sub == WASM_FC_MEMORY_COPY) {
+        EMIT1(&ctx->emit, 0), EMIT1(&ctx->emit, 0);
+    } else if (sub == WASM_FC_MEMORY_FILL) {
+        EMIT1(&ctx->emit, 0);
+    }
+}
+
+// the writer fills these in once every function and global has an index
+static void op_symbol(Ctx* ctx, WasmOp op, const TB_Symbol* sym) {
+    EMIT1(&ctx->emit, op);
+    tb_emit_symbol_patch(ctx->emit.output, sym, GET_CODE_POS(&ctx->emit));
+    emit_padded(ctx, 0, op == WASM_I32_CONST);
+    asm_op(ctx, op);
+    EMITA(&ctx->emit, " %s\n", sym->name);
+}
+
+static void op_local_get(Ctx* ctx, int x) { op_idx(ctx, WASM_LOCAL_GET, x); }
+static void op_local_set(Ctx* ctx, int x) { op_idx(ctx, WASM_LOCAL_SET, x); }
+
+// i32 -> i64 variant of the same integer op
+static WasmOp int_op(WasmOp op, bool is64) {
+    if (!is64) return op;
+    if (op >= WASM_I32_EQZ && op <= WASM_I32_GE_U) return op + (WASM_I64_EQZ - WASM_I32_EQZ);
+    if (op >= WASM_I32_CLZ && op <= WASM_I32_ROTR) return op + (WASM_I64_CLZ - WASM_I32_CLZ);
+    tb_unreachable();
+    return op;
+}
+
+// f32 -> f64 variant of the same float op
+static WasmOp float_op(WasmOp op, bool is64) {
+    if (!is64) return op;
+    if (op >= WASM_F32_EQ && op <= WASM_F32_GE) return op + (WASM_F64_EQ - WASM_F32_EQ);
+    if (op >= WASM_F32_ABS && op <= WASM_F32_MAX) return op + (WASM_F64_ABS - WASM_F32_ABS);
+    tb_unreachable();
+    return op;
+}
+
+static bool is_i64(TB_DataType dt) { return wasm_valtype(dt) == WASM_I64; }
+static bool is_f64(TB_DataType dt) { return wasm_valtype(dt) == WASM_F64; }
+
+////////////////////////////////
+// Values
+////////////////////////////////
+static TB_Node* find_proj(TB_Node* n, int index) {
+    for (User* u = n->users; u; u = u->next) {
+        if (u->n->type == TB_PROJ && TB_NODE_GET_EXTRA_T(u->n, TB_NodeProj)->index == index) {
+            return u->n;
+        }
+    }
+    return NULL;
+}
+
+static bool is_value(TB_Node* n) {
+    return n->dt.type == TB_INT || n->dt.type == TB_PTR || n->dt.type == TB_FLOAT;
+}
+
+static bool is_remat(TB_Node* n) {
+    switch (n->type) {
+        case TB_INTEGER_CONST:
+        case TB_FLOAT32_CONST:
+        case TB_FLOAT64_CONST:
+        case TB_POISON:
+        case TB_SYMBOL:
+        case TB_LOCAL:
+        return true;
+
+        case TB_PROJ:
+        return n->inputs[0]->type == TB_START && TB_NODE_GET_EXTRA_T(n, TB_NodeProj)->index >= 3;
+
+        default:
+        return false;
+    }
+}
+
+// loads can't be moved across these
+static bool has_effects(TB_Node* n) {
+    return (n->type >= TB_STORE && n->type <= TB_ATOMIC_CAS) || (n->type >= TB_CALL && n->type <= TB_SAFEPOINT_POLL) || n->type == TB_MACHINE_OP;
+}
+
+// users which read the operand more than once need it in a local
+static bool wants_local_operand(TB_Node* n, int slot) {
+    switch (n->type) {
+        case TB_BSWAP:  return slot == 1;
+        case TB_BRANCH: return slot == 1 && TB_NODE_GET_EXTRA_T(n, TB_NodeBranch)->succ_count > 2;
+        default:        return slot == 2 && n->type >= TB_ATOMIC_LOAD && n->type <= TB_ATOMIC_CAS;
+    }
+}
+
+static int find_block(Ctx* ctx, TB_Node* n) {
+    ptrdiff_t search = nl_map_get(ctx->cfg.node_to_block, n);
+    if (search < 0 && n->type == TB_PROJ && n->users) {
+        // branch projections are skipped when they enter a region
+        search = nl_map_get(ctx->cfg.node_to_block, n->users->n);
+    }
+    return search >= 0 ? ctx->cfg.node_to_block[search].v.id : -1;
+}
+
+static int sched_block(Ctx* ctx, TB_Node* n) {
+    ptrdiff_t search = nl_map_get(ctx->p->scheduled, n);
+    return search >= 0 ? ctx->p->scheduled[search].v->id : -1;
+}
+
+static Val* get_val(Ctx* ctx, TB_Node* n) {
+    return &ctx->vals[n->gvn];
+}
+
+static int classify(Ctx* ctx, TB_Node* n, int b, int i, int* effects) {
+    if (!is_value(n)) return VAL_STMT;
+    if (is_remat(n)) return VAL_REMAT;
+
+    // phis were decided up front, tuple projections live in locals
+    if (n->type == TB_PHI) return get_val(ctx, n)->kind;
+    if (n->type == TB_PROJ) return n->users ? VAL_LOCAL : VAL_NONE;
+
+    int uses = 0, root = -1;
+    for (User* u = n->users; u; u = u->next) {
+        TB_Node* use = u->n;
+        Val* uv = get_val(ctx, use);
+
+        // dead users (we only know about the ones we've decided on so far)
+        if (uv->block < 0) continue;
+        if ((uv->block == b || use->type == TB_PHI) && uv->kind == VAL_NONE) continue;
+
+        uses += 1;
+        if (use->type == TB_PHI) {
+            // the move happens at the end of the predecessor
+            TB_Node* pred = use->inputs[0]->inputs[u->slot - 1];
+            root = sched_block(ctx, pred) == b ? ctx->blocks[b].item_count : -1;
+        } else if (uv->block == b && !wants_local_operand(use, u->slot)) {
+            root = uv->kind == VAL_INLINE ? uv->root : uv->pos;
+        } else {
+            root = -1;
+        }
+    }
+
+    if (uses == 0) return VAL_NONE;
+    if (uses > 1 || root < 0) return VAL_LOCAL;
+
+    // if any stores or calls happen between where the load was scheduled and
+    // where it'd be evaluated we can't move it.
+    if (n->type == TB_LOAD && effects[root] != effects[i + 1]) {
+        return VAL_LOCAL;
+    }
+
+    get_val(ctx, n)->root = root;
+    return VAL_INLINE;
+}
+
+static void classify_values(Ctx* ctx) {
+    TB_ArenaSavepoint sp = tb_arena_save(tmp_arena);
+
+    // params don't always make it into the schedule, they're just local.gets
+    // anyways so it doesn't matter.
+    for (User* u = ctx->f->start_node->users; u; u = u->next) {
+        if (is_remat(u->n)) get_val(ctx, u->n)->kind = VAL_REMAT;
+    }
+
+    // phis first since they're read across blocks
+    FOREACH_N(b, 0, ctx->block_count) {
+        TB_Node** items = &ctx->items[ctx->blocks[b].item_start];
+        FOREACH_N(i, 0, ctx->blocks[b].item_count) {
+            TB_Node* n = items[i];
+            if (n->type == TB_PHI && is_value(n)) {
+                int kind = VAL_NONE;
+                for (User* u = n->users; u; u = u->next) {
+                    if (get_val(ctx, u->n)->block >= 0) kind = VAL_LOCAL;
+                }
+                get_val(ctx, n)->kind = kind;
+            }
+        }
+    }
+
+    FOREACH_N(b, 0, ctx->block_count) {
+        Block* bb = &ctx->blocks[b];
+        TB_Node** items = &ctx->items[bb->item_start];
+
+        // prefix count of side effects
+        int* effects = tb_arena_alloc(tmp_arena, (bb->item_count + 1) * sizeof(int));
+        effects[0] = 0;
+        FOREACH_N(i, 0, bb->item_count) {
+            effects[i + 1] = effects[i] + has_effects(items[i]);
+        }
+
+        // users come after their operands so walking backwards means we've
+        // already decided on them.
+        FOREACH_REVERSE_N(i, 0, bb->item_count) {
+            TB_Node* n = items[i];
+            get_val(ctx, n)->kind = classify(ctx, n, b, i, effects);
+        }
+    }
+
+    tb_arena_restore(tmp_arena, sp);
+}
+
+static void emit_expr(Ctx* ctx, TB_Node* n);
+
+static void emit_value(Ctx* ctx, TB_Node* n) {
+    Val* v = get_val(ctx, n);
+    switch (v->kind) {
+        case VAL_LOCAL:
+        op_local_get(ctx, v->local);
+        break;
+
+        case VAL_REMAT:
+        case VAL_INLINE:
+        emit_expr(ctx, n);
+        break;
+
+        default:
+        tb_panic("wasm: v%u doesn't have a value\n", n->gvn);
+    }
+}
+
+// anything that isn't a load, compare or constant may have garbage in the bits
+// above its width, these clean them up for the ops which care.
+static bool is_clean(TB_Node* n) {
+    return n->type == TB_LOAD || n->type == TB_INTEGER_CONST || n->type == TB_ZERO_EXT || (n->type >= TB_CMP_EQ && n->type <= TB_CMP_FLE);
+}
+
+static void normalize(Ctx* ctx, TB_DataType dt, bool is_signed, bool clean) {
+    if (dt.type != TB_INT || dt.data == 32 || dt.data == 64) return;
+
+    bool is64 = dt.data > 32;
+    if (is_signed) {
+        if (!is64 && dt.data == 8) {
+            op0(ctx, WASM_I32_EXTEND8_S);
+        } else if (!is64 && dt.data == 16) {
+            op0(ctx, WASM_I32_EXTEND16_S);
+        } else {
+            int shift = (is64 ? 64 : 32) - dt.data;
+            if (is64) op_i64(ctx, shift); else op_i32(ctx, shift);
+            op0(ctx, int_op(WASM_I32_SHL, is64));
+            if (is64) op_i64(ctx, shift); else op_i32(ctx, shift);
+            op0(ctx, int_op(WASM_I32_SHR_S, is64));
+        }
+    } else if (!clean) {
+        uint64_t mask = UINT64_MAX >> (64 - dt.data);
+        if (is64) op_i64(ctx, mask); else op_i32(ctx, mask);
+        op0(ctx, int_op(WASM_I32_AND, is64));
+    }
+}
+
+static void emit_normalized(Ctx* ctx, TB_Node* n, bool is_signed) {
+    emit_value(ctx, n);
+    normalize(ctx, n->dt, is_signed, is_clean(n));
+}
+
+// i32 non-zero if n is
+static void emit_cond(Ctx* ctx, TB_Node* n) {
+    emit_normalized(ctx, n, false);
+    if (is_i64(n->dt)) {
+        op_i64(ctx, 0);
+        op0(ctx, WASM_I64_NE);
+    }
+}
+
+// shift amounts and sizes don't always match the other operand's width
+static void emit_int_as(Ctx* ctx, TB_Node* n, bool want64) {
+    emit_value(ctx, n);
+    if (is_i64(n->dt) && !want64) {
+        op0(ctx, WASM_I32_WRAP_I64);
+    } else if (!is_i64(n->dt) && want64) {
+        normalize(ctx, n->dt, false, is_clean(n));
+        op0(ctx, WASM_I64_EXTEND_I32_U);
+    }
+}
+
+// pushes the base address and returns what's left for the memarg offset
+static uint32_t emit_address(Ctx* ctx, TB_Node* addr) {
+    int64_t disp = 0;
+    while (addr->type == TB_MEMBER_ACCESS && get_val(ctx, addr)->kind == VAL_INLINE) {
+        int64_t offset = TB_NODE_GET_EXTRA_T(addr, TB_NodeMember)->offset;
+        if (offset < 0 || disp + offset > INT32_MAX) break;
+
+        disp += offset;
+        addr = addr->inputs[1];
+    }
+
+    if (addr->type == TB_LOCAL && disp + get_val(ctx, addr)->local <= INT32_MAX) {
+        op_local_get(ctx, ctx->fp);
+        return disp + get_val(ctx, addr)->local;
+    }
+
+    emit_value(ctx, addr);
+    return disp;
+}
+
+// memarg alignment is log2 and only a hint, atomics (n = NULL) just say natural
+static int mem_align(TB_Node* n, int size) {
+    int align = n ? TB_NODE_GET_EXTRA_T(n, TB_NodeMemAccess)->align : 0;
+    if (align <= 0 || align > size) align = size;
+    return tb_ffs(align) - 1;
+}
+
+static void emit_load(Ctx* ctx, TB_Node* n, TB_Node* addr, TB_DataType dt) {
+    uint32_t offset = emit_address(ctx, addr);
+
+    WasmOp op;
+    int size;
+    if (dt.type == TB_FLOAT) {
+        bool f64 = dt.data == TB_FLT_64;
+        op = f64 ? WASM_F64_LOAD : WASM_F32_LOAD, size = f64 ? 8 : 4;
+    } else {
+        int bits = dt.type == TB_PTR ? 32 : dt.data;
+        bool is64 = bits > 32;
+        if (bits <= 8)       op = is64 ? WASM_I64_LOAD8_U  : WASM_I32_LOAD8_U,  size = 1;
+        else if (bits <= 16) op = is64 ? WASM_I64_LOAD16_U : WASM_I32_LOAD16_U, size = 2;
+        else if (bits <= 32) op = WASM_I32_LOAD, size = 4;
+        else                 op = WASM_I64_LOAD, size = 8;
+    }
+
+    op_mem(ctx, op, mem_align(n, size), offset);
+}
+
+static void emit_store(Ctx* ctx, TB_Node* n, TB_Node* addr, TB_Node* val) {
+    uint32_t offset = emit_address(ctx, addr);
+    emit_value(ctx, val);
+
+    TB_DataType dt = val->dt;
+    WasmOp op;
+    int size;
+    if (dt.type == TB_FLOAT) {
+        bool f64 = dt.data == TB_FLT_64;
+        op = f64 ? WASM_F64_STORE : WASM_F32_STORE, size = f64 ? 8 : 4;
+    } else {
+        int bits = dt.type == TB_PTR ? 32 : dt.data;
+        bool is64 = bits > 32;
+        if (bits <= 8)       op = is64 ? WASM_I64_STORE8  : WASM_I32_STORE8,  size = 1;
+        else if (bits <= 16) op = is64 ? WASM_I64_STORE16 : WASM_I32_STORE16, size = 2;
+        else if (bits <= 32) op = is64 ? WASM_I64_STORE32 : WASM_I32_STORE,   size = 4;
+        else                 op = WASM_I64_STORE, size = 8;
+    }
+
+    op_mem(ctx, op, mem_align(n, size), offset);
+}
+
+static void emit_zero(Ctx* ctx, TB_DataType dt) {
+    switch (wasm_valtype(dt)) {
+        case WASM_I32: op_i32(ctx, 0); break;
+        case WASM_I64: op_i64(ctx, 0); break;
+        case WASM_F32: op_f32(ctx, 0.0f); break;
+        case WASM_F64: op_f64(ctx, 0.0); break;
+    }
+}
 
-            *out_size  = ((bits+7) / 8) << dt.width;
-            *out_align = is_big_int ? 8 : bits/8;
+static void emit_expr(Ctx* ctx, TB_Node* n) {
+    TB_DataType dt = n->dt;
+    switch (n->type) {
+        case TB_INTEGER_CONST: {
+            uint64_t x = TB_NODE_GET_EXTRA_T(n, TB_NodeInt)->value;
+            if (dt.type == TB_INT && dt.data < 64) {
+                x &= UINT64_MAX >> (64 - dt.data);
+            }
+
+            if (is_i64(dt)) op_i64(ctx, x);
+            else op_i32(ctx, (int32_t) x);
             break;
         }
-        case TB_FLOAT: {
-            int s = 0;
-            if (dt.data == TB_FLT_32) s = 4;
-            else if (dt.data == TB_FLT_64) s = 8;
-            else tb_unreachable();
+        case TB_FLOAT32_CONST: op_f32(ctx, TB_NODE_GET_EXTRA_T(n, TB_NodeFloat32)->value); break;
+        case TB_FLOAT64_CONST: op_f64(ctx, TB_NODE_GET_EXTRA_T(n, TB_NodeFloat64)->value); break;
+        case TB_POISON: emit_zero(ctx, dt); break;
 
-            *out_size = s << dt.width;
-            *out_align = s;
+        case TB_SYMBOL: {
+            op_symbol(ctx, WASM_I32_CONST, TB_NODE_GET_EXTRA_T(n, TB_NodeSymbol)->sym);
             break;
         }
-        case TB_PTR: {
-            *out_size = 8;
-            *out_align = 8;
+
+        case TB_LOCAL: {
+            op_local_get(ctx, ctx->fp);
+            if (get_val(ctx, n)->local) {
+                op_i32(ctx, get_val(ctx, n)->local);
+                op0(ctx, WASM_I32_ADD);
+            }
             break;
         }
-        default: tb_unreachable();
+
+        case TB_PROJ: {
+            // only START's params get here, everything else is in a local
+            assert(n->inputs[0]->type == TB_START);
+            op_local_get(ctx, TB_NODE_GET_EXTRA_T(n, TB_NodeProj)->index - 3);
+            break;
+        }
+
+        case TB_LOAD: {
+            emit_load(ctx, n, n->inputs[2], dt);
+            break;
+        }
+
+        case TB_MEMBER_ACCESS: {
+            emit_value(ctx, n->inputs[1]);
+            op_i32(ctx, TB_NODE_GET_EXTRA_T(n, TB_NodeMember)->offset);
+            op0(ctx, WASM_I32_ADD);
+            break;
+        }
+
+        case TB_ARRAY_ACCESS: {
+            int64_t stride = TB_NODE_GET_EXTRA_T(n, TB_NodeArray)->stride;
+            emit_value(ctx, n->inputs[1]);
+            emit_int_as(ctx, n->inputs[2], false);
+            if (stride != 1) {
+                if ((stride & (stride - 1)) == 0 && stride > 0) {
+                    op_i32(ctx, tb_ffs64(stride) - 1);
+                    op0(ctx, WASM_I32_SHL);
+                } else {
+                    op_i32(ctx, stride);
+                    op0(ctx, WASM_I32_MUL);
+                }
+            }
+            op0(ctx, WASM_I32_ADD);
+            break;
+        }
+
+        case TB_INT2PTR: {
+            TB_Node* src = n->inputs[1];
+            emit_normalized(ctx, src, false);
+            if (is_i64(src->dt)) op0(ctx, WASM_I32_WRAP_I64);
+            break;
+        }
+
+        case TB_PTR2INT: {
+            emit_value(ctx, n->inputs[1]);
+            if (is_i64(dt)) op0(ctx, WASM_I64_EXTEND_I32_U);
+            break;
+        }
+
+        case TB_TRUNCATE: {
+            TB_Node* src = n->inputs[1];
+            emit_value(ctx, src);
+            if (dt.type == TB_FLOAT) {
+                op0(ctx, WASM_F32_DEMOTE_F64);
+            } else if (is_i64(src->dt) && !is_i64(dt)) {
+                op0(ctx, WASM_I32_WRAP_I64);
+            }
+            break;
+        }
+
+        case TB_FLOAT_EXT: {
+            emit_value(ctx, n->inputs[1]);
+            op0(ctx, WASM_F64_PROMOTE_F32);
+            break;
+        }
+
+        case TB_SIGN_EXT:
+        case TB_ZERO_EXT: {
+            bool is_signed = n->type == TB_SIGN_EXT;
+            TB_Node* src = n->inputs[1];
+            emit_normalized(ctx, src, is_signed);
+            if (!is_i64(src->dt) && is_i64(dt)) {
+                op0(ctx, is_signed ? WASM_I64_EXTEND_I32_S : WASM_I64_EXTEND_I32_U);
+            }
+            break;
+        }
+
+        case TB_INT2FLOAT:
+        case TB_UINT2FLOAT: {
+            bool is_signed = n->type == TB_INT2FLOAT;
+            TB_Node* src = n->inputs[1];
+            emit_normalized(ctx, src, is_signed);
+
+            static const WasmOp ops[2][2][2] = {
+                // [f64][i64][signed]
+                { { WASM_F32_CONVERT_I32_U, WASM_F32_CONVERT_I32_S }, { WASM_F32_CONVERT_I64_U, WASM_F32_CONVERT_I64_S } },
+                { { WASM_F64_CONVERT_I32_U, WASM_F64_CONVERT_I32_S }, { WASM_F64_CONVERT_I64_U, WASM_F64_CONVERT_I64_S } },
+            };
+            op0(ctx, ops[is_f64(dt)][is_i64(src->dt)][is_signed]);
+            break;
+        }
+
+        case TB_FLOAT2INT:
+        case TB_FLOAT2UINT: {
+            // the saturating forms don't trap on out of range values (which
+            // are UB in C anyways)
+            TB_Node* src = n->inputs[1];
+            emit_value(ctx, src);
+
+            int sub = (is_i64(dt) ? 4 : 0) + (is_f64(src->dt) ? 2 : 0) + (n->type == TB_FLOAT2UINT);
+            op_fc(ctx, sub);
+            break;
+        }
+
+        case TB_BITCAST: {
+            TB_Node* src = n->inputs[1];
+            emit_value(ctx, src);
+
+            uint8_t from = wasm_valtype(src->dt), to = wasm_valtype(dt);
+            if (from == to) break;
+
+            if (from == WASM_F32 && to == WASM_I32)      op0(ctx, WASM_I32_REINTERPRET_F32);
+            else if (from == WASM_F64 && to == WASM_I64) op0(ctx, WASM_I64_REINTERPRET_F64);
+            else if (from == WASM_I32 && to == WASM_F32) op0(ctx, WASM_F32_REINTERPRET_I32);
+            else if (from == WASM_I64 && to == WASM_F64) op0(ctx, WASM_F64_REINTERPRET_I64);
+            else tb_todo();
+            break;
+        }
+
+        case TB_SELECT: {
+            emit_value(ctx, n->inputs[2]);
+            emit_value(ctx, n->inputs[3]);
+            emit_cond(ctx, n->inputs[1]);
+            op0(ctx, WASM_SELECT);
+            break;
+        }
+
+        case TB_NOT: {
+            emit_value(ctx, n->inputs[1]);
+            if (is_i64(dt)) op_i64(ctx, -1); else op_i32(ctx, -1);
+            op0(ctx, int_op(WASM_I32_XOR, is_i64(dt)));
+            break;
+        }
+
+        case TB_NEG: {
+            if (dt.type == TB_FLOAT) {
+                emit_value(ctx, n->inputs[1]);
+                op0(ctx, float_op(WASM_F32_NEG, is_f64(dt)));
+            } else {
+                emit_zero(ctx, dt);
+                emit_value(ctx, n->inputs[1]);
+                op0(ctx, int_op(WASM_I32_SUB, is_i64(dt)));
+            }
+            break;
+        }
+
+        case TB_CLZ:
+        case TB_CTZ:
+        case TB_POPCNT: {
+            TB_Node* src = n->inputs[1];
+            bool is64 = is_i64(src->dt);
+            int bits = src->dt.type == TB_PTR ? 32 : src->dt.data;
+            int width = is64 ? 64 : 32;
+
+            emit_value(ctx, src);
+            if (n->type == TB_CTZ) {
+                // a sentinel bit right above the width stops it from counting garbage
+                if (bits != width) {
+                    if (is64) op_i64(ctx, 1ull << bits); else op_i32(ctx, 1u << bits);
+                    op0(ctx, int_op(WASM_I32_OR, is64));
+                }
+                op0(ctx, int_op(WASM_I32_CTZ, is64));
+            } else {
+                normalize(ctx, src->dt, false, is_clean(src));
+                op0(ctx, int_op(n->type == TB_CLZ ? WASM_I32_CLZ : WASM_I32_POPCNT, is64));
+                if (n->type == TB_CLZ && bits != width) {
+                    if (is64) op_i64(ctx, width - bits); else op_i32(ctx, width - bits);
+                    op0(ctx, int_op(WASM_I32_SUB, is64));
+                }
+            }
+
+            if (is64 && !is_i64(dt)) {
+                op0(ctx, WASM_I32_WRAP_I64);
+            } else if (!is64 && is_i64(dt)) {
+                op0(ctx, WASM_I64_EXTEND_I32_U);
+            }
+            break;
+        }
+
+        case TB_BSWAP: {
+            // no byteswap op, we stitch it back together one byte at a time
+            TB_Node* src = n->inputs[1];
+            bool is64 = is_i64(dt);
+            int bytes = dt.data / 8;
+            FOREACH_N(i, 0, bytes) {
+                int shr = i * 8, shl = (bytes - 1 - i) * 8;
+                emit_value(ctx, src);
+                if (shr) {
+                    if (is64) op_i64(ctx, shr); else op_i32(ctx, shr);
+                    op0(ctx, int_op(WASM_I32_SHR_U, is64));
+                }
+                if (i != 0) {
+                    if (is64) op_i64(ctx, 0xFF); else op_i32(ctx, 0xFF);
+                    op0(ctx, int_op(WASM_I32_AND, is64));
+                }
+                if (shl) {
+                    if (is64) op_i64(ctx, shl); else op_i32(ctx, shl);
+                    op0(ctx, int_op(WASM_I32_SHL, is64));
+                }
+                if (i != 0) {
+                    op0(ctx, int_op(WASM_I32_OR, is64));
+                }
+            }
+            break;
+        }
+
+        case TB_AND:
+        case TB_OR:
+        case TB_XOR:
+        case TB_ADD:
+        case TB_SUB:
+        case TB_MUL: {
+            static const WasmOp ops[] = { WASM_I32_AND, WASM_I32_OR, WASM_I32_XOR, WASM_I32_ADD, WASM_I32_SUB, WASM_I32_MUL };
+
+            emit_value(ctx, n->inputs[1]);
+            emit_value(ctx, n->inputs[2]);
+            op0(ctx, int_op(ops[n->type - TB_AND], is_i64(dt)));
+            break;
+        }
+
+        case TB_SHL:
+        case TB_SHR:
+        case TB_SAR:
+        case TB_ROL:
+        case TB_ROR: {
+            static const WasmOp ops[] = { WASM_I32_SHL, WASM_I32_SHR_U, WASM_I32_SHR_S, WASM_I32_ROTL, WASM_I32_ROTR };
+
+            bool is64 = is_i64(dt);
+            if ((n->type == TB_ROL || n->type == TB_ROR) && dt.data != 32 && dt.data != 64) {
+                tb_todo();
+            }
+
+            // left shifts don't care about the garbage, it's shifted further up
+            if (n->type == TB_SHL) {
+                emit_value(ctx, n->inputs[1]);
+            } else {
+                emit_normalized(ctx, n->inputs[1], n->type == TB_SAR);
+            }
+            emit_int_as(ctx, n->inputs[2], is64);
+            op0(ctx, int_op(ops[n->type - TB_SHL], is64));
+            break;
+        }
+
+        case TB_UDIV:
+        case TB_SDIV:
+        case TB_UMOD:
+        case TB_SMOD: {
+            static const WasmOp ops[] = { WASM_I32_DIV_U, WASM_I32_DIV_S, WASM_I32_REM_U, WASM_I32_REM_S };
+
+            bool is_signed = n->type == TB_SDIV || n->type == TB_SMOD;
+            emit_normalized(ctx, n->inputs[1], is_signed);
+            emit_normalized(ctx, n->inputs[2], is_signed);
+            op0(ctx, int_op(ops[n->type - TB_UDIV], is_i64(dt)));
+            break;
+        }
+
+        case TB_FADD:
+        case TB_FSUB:
+        case TB_FMUL:
+        case TB_FDIV:
+        case TB_FMAX:
+        case TB_FMIN: {
+            static const WasmOp ops[] = { WASM_F32_ADD, WASM_F32_SUB, WASM_F32_MUL, WASM_F32_DIV, WASM_F32_MAX, WASM_F32_MIN };
+
+            emit_value(ctx, n->inputs[1]);
+            emit_value(ctx, n->inputs[2]);
+            op0(ctx, float_op(ops[n->type - TB_FADD], is_f64(dt)));
+            break;
+        }
+
+        case TB_CMP_EQ:
+        case TB_CMP_NE:
+        case TB_CMP_ULT:
+        case TB_CMP_ULE:
+        case TB_CMP_SLT:
+        case TB_CMP_SLE:
+        case TB_CMP_FLT:
+        case TB_CMP_FLE: {
+            TB_DataType cmp_dt = TB_NODE_GET_EXTRA_T(n, TB_NodeCompare)->cmp_dt;
+            if (cmp_dt.type == TB_FLOAT) {
+                static const WasmOp ops[] = { WASM_F32_EQ, WASM_F32_NE, 0, 0, 0, 0, WASM_F32_LT, WASM_F32_LE };
+
+                emit_value(ctx, n->inputs[1]);
+                emit_value(ctx, n->inputs[2]);
+                op0(ctx, float_op(ops[n->type - TB_CMP_EQ], is_f64(cmp_dt)));
+            } else {
+                static const WasmOp ops[] = { WASM_I32_EQ, WASM_I32_NE, WASM_I32_LT_U, WASM_I32_LE_U, WASM_I32_LT_S, WASM_I32_LE_S };
+
+                bool is_signed = n->type == TB_CMP_SLT || n->type == TB_CMP_SLE;
+                emit_normalized(ctx, n->inputs[1], is_signed);
+                emit_normalized(ctx, n->inputs[2], is_signed);
+                op0(ctx, int_op(ops[n->type - TB_CMP_EQ], is_i64(cmp_dt)));
+            }
+            break;
+        }
+
+        case TB_X86INTRIN_SQRT: {
+            emit_value(ctx, n->inputs[1]);
+            op0(ctx, float_op(WASM_F32_SQRT, is_f64(dt)));
+            break;
+        }
+
+        case TB_X86INTRIN_RSQRT: {
+            if (is_f64(dt)) op_f64(ctx, 1.0); else op_f32(ctx, 1.0f);
+            emit_value(ctx, n->inputs[1]);
+            op0(ctx, float_op(WASM_F32_SQRT, is_f64(dt)));
+            op0(ctx, float_op(WASM_F32_DIV, is_f64(dt)));
+            break;
+        }
+
+        default:
+        tb_todo();
+    }
+}
+
+////////////////////////////////
+// Effects
+////////////////////////////////
+static void emit_epilogue(Ctx* ctx) {
+    if (ctx->frame_size) {
+        op_local_get(ctx, ctx->fp);
+        op_i32(ctx, ctx->frame_size);
+        op0(ctx, WASM_I32_ADD);
+        op_idx(ctx, WASM_GLOBAL_SET, 0);
+    }
+}
+
+// stores the result into the projection's local (if anyone wants it)
+static void set_proj(Ctx* ctx, TB_Node* n, int index) {
+    TB_Node* proj = find_proj(n, index);
+    if (proj && get_val(ctx, proj)->kind == VAL_LOCAL) {
+        op_local_set(ctx, get_val(ctx, proj)->local);
+    } else {
+        op0(ctx, WASM_DROP);
+    }
+}
+
+static void emit_call(Ctx* ctx, TB_Node* n) {
+    TB_NodeCall* c = TB_NODE_GET_EXTRA(n);
+    TB_FunctionPrototype* proto = c->proto;
+
+    int first_arg = n->type == TB_TAILCALL ? 4 : 3;
+    if (n->input_count - first_arg != proto->param_count) {
+        // varargs go through memory, we don't do that yet
+        tb_todo();
+    }
+
+    FOREACH_N(i, first_arg, n->input_count) {
+        emit_value(ctx, n->inputs[i]);
+    }
+
+    TB_Node* target = n->inputs[first_arg - 1];
+    if (target->type == TB_SYMBOL) {
+        TB_Symbol* sym = TB_NODE_GET_EXTRA_T(target, TB_NodeSymbol)->sym;
+        if (sym->tag == TB_SYMBOL_EXTERNAL) {
+            // imports need a type, we only know it from the call sites
+            TB_ProtoPatch patch = { .pos = GET_CODE_POS(&ctx->emit), .target = sym, .proto = proto };
+            dyn_array_put(ctx->emit.output->proto_patches, patch);
+        }
+
+        op_symbol(ctx, WASM_CALL, sym);
+    } else {
+        // function pointers are table slots
+        emit_value(ctx, target);
+
+        EMIT1(&ctx->emit, WASM_CALL_INDIRECT);
+        TB_ProtoPatch patch = { .pos = GET_CODE_POS(&ctx->emit), .proto = proto };
+        dyn_array_put(ctx->emit.output->proto_patches, patch);
+        emit_padded(ctx, 0, false);
+        EMIT1(&ctx->emit, 0);
+
+        asm_op(ctx, WASM_CALL_INDIRECT);
+        EMITA(&ctx->emit, "\n");
+    }
+}
+
+static void emit_stmt(Ctx* ctx, TB_Node* n) {
+    switch (n->type) {
+        // nothing to do
+        case TB_START:
+        case TB_REGION:
+        case TB_PHI:
+        case TB_PROJ:
+        case TB_MERGEMEM:
+        case TB_DEBUGBREAK:
+        case TB_SAFEPOINT_POLL:
+        case TB_DEAD:
+        break;
+
+        case TB_STORE:
+        case TB_WRITE: {
+            emit_store(ctx, n, n->inputs[2], n->inputs[3]);
+            break;
+        }
+
+        case TB_MEMCPY:
+        case TB_MEMSET: {
+            emit_value(ctx, n->inputs[2]);
+            emit_int_as(ctx, n->inputs[3], false);
+            emit_int_as(ctx, n->inputs[4], false);
+            op_fc(ctx, n->type == TB_MEMCPY ? WASM_FC_MEMORY_COPY : WASM_FC_MEMORY_FILL);
+            break;
+        }
+
+        // wasm without the threads proposal is single threaded so the atomics
+        // are just plain memory ops.
+        case TB_READ:
+        case TB_ATOMIC_LOAD: {
+            TB_DataType dt = find_proj(n, 1) ? find_proj(n, 1)->dt : TB_TYPE_I32;
+            emit_load(ctx, n->type == TB_READ ? n : NULL, n->inputs[2], dt);
+            set_proj(ctx, n, 1);
+            break;
+        }
+
+        case TB_ATOMIC_XCHG: {
+            TB_Node* addr = n->inputs[2];
+            TB_Node* src = n->inputs[3];
+            if (find_proj(n, 1)) {
+                emit_load(ctx, NULL, addr, src->dt);
+                set_proj(ctx, n, 1);
+            }
+
+            emit_store(ctx, NULL, addr, src);
+            break;
+        }
+
+        case TB_ATOMIC_ADD:
+        case TB_ATOMIC_SUB:
+        case TB_ATOMIC_AND:
+        case TB_ATOMIC_XOR:
+        case TB_ATOMIC_OR: {
+            static const WasmOp ops[] = { WASM_I32_ADD, WASM_I32_SUB, WASM_I32_AND, WASM_I32_XOR, WASM_I32_OR };
+
+            TB_Node* addr = n->inputs[2];
+            TB_Node* src = n->inputs[3];
+            TB_Node* proj = find_proj(n, 1);
+            bool is64 = is_i64(src->dt);
+
+            // addr; addr; load; (tee old); src; op; store
+            emit_value(ctx, addr);
+            emit_load(ctx, NULL, addr, src->dt);
+            if (proj && get_val(ctx, proj)->kind == VAL_LOCAL) {
+                op_idx(ctx, WASM_LOCAL_TEE, get_val(ctx, proj)->local);
+            }
+            emit_value(ctx, src);
+            op0(ctx, int_op(ops[n->type - TB_ATOMIC_ADD], is64));
+
+            int bits = src->dt.type == TB_PTR ? 32 : src->dt.data;
+            WasmOp op;
+            if (bits <= 8)       op = is64 ? WASM_I64_STORE8  : WASM_I32_STORE8;
+            else if (bits <= 16) op = is64 ? WASM_I64_STORE16 : WASM_I32_STORE16;
+            else if (bits <= 32) op = is64 ? WASM_I64_STORE32 : WASM_I32_STORE;
+            else                 op = WASM_I64_STORE;
+            op_mem(ctx, op, 0, 0);
+            break;
+        }
+
+        case TB_ATOMIC_CAS: {
+            TB_Node* addr = n->inputs[2];
+            TB_Node* expected = n->inputs[3];
+            TB_Node* desired = n->inputs[4];
+            TB_Node* proj = find_proj(n, 1);
+
+            // if (*addr == expected) *addr = desired
+            emit_load(ctx, NULL, addr, expected->dt);
+            if (proj && get_val(ctx, proj)->kind == VAL_LOCAL) {
+                op_idx(ctx, WASM_LOCAL_TEE, get_val(ctx, proj)->local);
+            }
+            emit_normalized(ctx, expected, false);
+            op0(ctx, int_op(WASM_I32_EQ, is_i64(expected->dt)));
+            op_block(ctx, WASM_IF);
+            emit_store(ctx, NULL, addr, desired);
+            op0(ctx, WASM_END);
+            break;
+        }
+
+        case TB_CALL: {
+            emit_call(ctx, n);
+
+            TB_FunctionPrototype* proto = TB_NODE_GET_EXTRA_T(n, TB_NodeCall)->proto;
+            FOREACH_REVERSE_N(i, 0, proto->return_count) {
+                set_proj(ctx, n, 2 + i);
+            }
+            break;
+        }
+
+        default:
+        tb_todo();
     }
 }
 
-size_t wasm_emit_epilogue(uint8_t* out, uint64_t saved, uint64_t stack_usage) {
+////////////////////////////////
+// Structured control flow
+////////////////////////////////
+static void do_tree(Ctx* ctx, int x);
+
+static int br_depth(Ctx* ctx, int kind, int target) {
+    size_t count = dyn_array_length(ctx->frames);
+    FOREACH_REVERSE_N(i, 0, count) {
+        if (ctx->frames[i].kind == kind && ctx->frames[i].target == target) {
+            return count - 1 - i;
+        }
+    }
+
+    tb_panic("wasm: no label for .bb%d\n", target);
     return 0;
 }
 
-size_t wasm_emit_prologue(uint8_t* out, uint64_t saved, uint64_t stack_usage) {
+static void push_frame(Ctx* ctx, int kind, int target) {
+    dyn_array_put(ctx->frames, (Frame){ kind, target });
+}
+
+static void pop_frame(Ctx* ctx) {
+    (void) dyn_array_pop(ctx->frames);
+}
+
+static int phi_edge_index(Ctx* ctx, TB_Node* region, Edge* e, int x) {
+    FOREACH_N(j, 0, region->input_count) {
+        if (region->inputs[j] == e->ctrl) return j;
+    }
+
+    FOREACH_N(j, 0, region->input_count) {
+        if (sched_block(ctx, region->inputs[j]) == x) return j;
+    }
+
+    tb_panic("wasm: .bb%d isn't a predecessor of v%u\n", x, region->gvn);
     return 0;
 }
 
-// We do a little stackify system, every time we use a value that
-// has multiple users we allocate a local slot for it and use that.
-void push_val(WasmCtx* restrict ctx, TB_Reg r) {
+// phis are a parallel copy, all the reads go first
+static void emit_phi_moves(Ctx* ctx, int x, Edge* e) {
+    TB_Node* dst = ctx->blocks[e->succ].n;
+    if (dst->type != TB_REGION) return;
+
+    int j = phi_edge_index(ctx, dst, e, x);
+
+    size_t count = 0;
+    for (User* u = dst->users; u; u = u->next) count++;
+
+    TB_ArenaSavepoint sp = tb_arena_save(tmp_arena);
+    TB_Node** phis = tb_arena_alloc(tmp_arena, count * sizeof(TB_Node*));
+
+    size_t phi_count = 0;
+    for (User* u = dst->users; u; u = u->next) {
+        TB_Node* phi = u->n;
+        if (phi->type == TB_PHI && get_val(ctx, phi)->kind == VAL_LOCAL && phi->inputs[1 + j] != phi) {
+            emit_value(ctx, phi->inputs[1 + j]);
+            phis[phi_count++] = phi;
+        }
+    }
+
+    FOREACH_REVERSE_N(i, 0, phi_count) {
+        op_local_set(ctx, get_val(ctx, phis[i])->local);
+    }
+    tb_arena_restore(tmp_arena, sp);
+}
+
+static void do_branch(Ctx* ctx, int x, int y) {
+    if (y < 0) {
+        op0(ctx, WASM_UNREACHABLE);
+    } else if (ctx->blocks[y].rpo <= ctx->blocks[x].rpo) {
+        op_idx(ctx, WASM_BR, br_depth(ctx, FRAME_LOOP, y));
+    } else if (ctx->blocks[y].fwd_preds >= 2) {
+        op_idx(ctx, WASM_BR, br_depth(ctx, FRAME_BLOCK, y));
+    } else {
+        do_tree(ctx, y);
+    }
+}
+
+static void do_edge(Ctx* ctx, int x, Edge* e) {
+    if (e->succ >= 0) {
+        emit_phi_moves(ctx, x, e);
+    }
+    do_branch(ctx, x, e->succ);
+}
+
+static void emit_return(Ctx* ctx, TB_Node* end) {
+    FOREACH_N(i, 3, end->input_count) {
+        emit_value(ctx, end->inputs[i]);
+    }
+    emit_epilogue(ctx);
+    op0(ctx, WASM_RETURN);
+}
+
+static void emit_switch(Ctx* ctx, int x, TB_Node* end) {
+    Block* b = &ctx->blocks[x];
+    TB_NodeBranch* br = TB_NODE_GET_EXTRA(end);
+    TB_Node* key = end->inputs[1];
+    size_t arms = br->succ_count;
 
+    // arm i is the block at depth i from the dispatch (arm 0 is the default)
+    FOREACH_REVERSE_N(i, 0, arms) {
+        op_block(ctx, WASM_BLOCK);
+        push_frame(ctx, FRAME_ARM, i);
+    }
+
+    uint64_t mask = key->dt.type == TB_INT && key->dt.data < 64 ? UINT64_MAX >> (64 - key->dt.data) : UINT64_MAX;
+    uint64_t min = UINT64_MAX, max = 0;
+    FOREACH_N(i, 1, arms) {
+        uint64_t k = br->keys[i - 1] & mask;
+        if (k < min) min = k;
+        if (k > max) max = k;
+    }
+
+    if (!is_i64(key->dt) && max - min < 2*arms + 16) {
+        // dense enough for a jump table
+        emit_normalized(ctx, key, false);
+        if (min) {
+            op_i32(ctx, min);
+            op0(ctx, WASM_I32_SUB);
+        }
+
+        size_t range = max - min + 1;
+        EMIT1(&ctx->emit, WASM_BR_TABLE);
+        emit_uleb(ctx, range);
+        asm_op(ctx, WASM_BR_TABLE);
+        FOREACH_N(k, 0, range) {
+            int target = 0;
+            FOREACH_N(i, 1, arms) {
+                if ((br->keys[i - 1] & mask) == min + k) { target = i; break; }
+            }
+            emit_uleb(ctx, target);
+            EMITA(&ctx->emit, " %d", target);
+        }
+        emit_uleb(ctx, 0);
+        EMITA(&ctx->emit, " 0\n");
+    } else {
+        FOREACH_N(i, 1, arms) {
+            emit_normalized(ctx, key, false);
+            if (is_i64(key->dt)) {
+                op_i64(ctx, br->keys[i - 1] & mask);
+            } else {
+                op_i32(ctx, br->keys[i - 1] & mask);
+            }
+            op0(ctx, int_op(WASM_I32_EQ, is_i64(key->dt)));
+            op_idx(ctx, WASM_BR_IF, i);
+        }
+        op_idx(ctx, WASM_BR, 0);
+    }
+
+    FOREACH_N(i, 0, arms) {
+        pop_frame(ctx);
+        op0(ctx, WASM_END);
+        do_edge(ctx, x, &b->edges[i]);
+    }
 }
 
-TB_FunctionOutput wasm_fast_compile_function(TB_Function* restrict f, const TB_FeatureSet* features, uint8_t* out, size_t out_capacity, size_t local_thread_id) {
-    s_local_thread_id = local_thread_id;
-    WasmCtx ctx = { .vals = (WasmVal*) use_count };
+static void emit_block(Ctx* ctx, int x) {
+    Block* b = &ctx->blocks[x];
+    TB_Node* end = b->end;
+
+    EMITA(&ctx->emit, "  %*s;; .bb%d\n", ctx->depth * 2, "", x);
+    FOREACH_N(i, 0, b->item_count) {
+        TB_Node* n = ctx->items[b->item_start + i];
+        if (n == end && cfg_is_terminator(n)) break;
+
+        Val* v = get_val(ctx, n);
+        if (v->kind == VAL_STMT) {
+            emit_stmt(ctx, n);
+        } else if (v->kind == VAL_LOCAL && n->type != TB_PHI && n->type != TB_PROJ) {
+            emit_expr(ctx, n);
+            op_local_set(ctx, v->local);
+        }
+    }
+
+    switch (end->type) {
+        case TB_END: {
+            emit_return(ctx, end);
+            break;
+        }
 
-    // Evaluate basic blocks
-    TB_FOR_BASIC_BLOCK(bb, f) {
-        EMIT1(&ctx.emit, 0x02);
+        case TB_TRAP:
+        case TB_UNREACHABLE: {
+            op0(ctx, WASM_UNREACHABLE);
+            break;
+        }
 
-        TB_Reg terminator = f->bbs[bb].end;
-        TB_FOR_NODE(r, f, bb) {
-            if (r == terminator) break;
+        case TB_TAILCALL: {
+            // no tail calls without the proposal, the callee's results become ours
+            emit_call(ctx, end);
+            emit_epilogue(ctx);
+            op0(ctx, WASM_RETURN);
+            break;
+        }
 
-            TB_Node* restrict n = &f->nodes[r];
-            TB_NodeTypeEnum reg_type = n->type;
-            // TB_DataType dt = n->dt;
+        case TB_BRANCH: {
+            if (b->edge_count == 1) {
+                do_edge(ctx, x, &b->edges[0]);
+            } else if (b->edge_count == 2) {
+                // key != keys[0] takes the first successor
+                TB_Node* key = end->inputs[1];
+                uint64_t k = TB_NODE_GET_EXTRA_T(end, TB_NodeBranch)->keys[0];
+                if (k == 0) {
+                    emit_cond(ctx, key);
+                } else {
+                    emit_normalized(ctx, key, false);
+                    if (is_i64(key->dt)) op_i64(ctx, k); else op_i32(ctx, k);
+                    op0(ctx, int_op(WASM_I32_NE, is_i64(key->dt)));
+                }
 
-            switch (reg_type) {
-                default: tb_todo();
+                op_block(ctx, WASM_IF);
+                push_frame(ctx, FRAME_IF, -1);
+                do_edge(ctx, x, &b->edges[0]);
+                op0(ctx, WASM_ELSE);
+                do_edge(ctx, x, &b->edges[1]);
+                pop_frame(ctx);
+                op0(ctx, WASM_END);
+            } else {
+                emit_switch(ctx, x, end);
             }
+            break;
         }
 
-        // Evaluate terminator
-        TB_Reg bb_end = f->bbs[bb].end;
-        TB_Node* end = &f->nodes[bb_end];
-        if (end->type == TB_TRAP) {
-            EMIT1(&ctx.emit, 0x00);
-        } else if (end->type == TB_NULL) {
-            // empty basic block
-        } else if (end->type == TB_UNREACHABLE) {
-            /* lmao you thought we'd help you */
-        } else if (end->type == TB_RET) {
-            // Evaluate return value
-            if (end->ret.value) {
-                push_val(&ctx, end->ret.value);
+        default: {
+            if (b->edge_count) {
+                do_edge(ctx, x, &b->edges[0]);
+            } else {
+                op0(ctx, WASM_UNREACHABLE);
             }
+            break;
+        }
+    }
+}
+
+// merge children are placed after x, each one in a block which x's code can
+// break out of. ys is sorted with the highest RPO first (so it's the outermost).
+static void node_within(Ctx* ctx, int x, int* ys, int count) {
+    if (count == 0) {
+        emit_block(ctx, x);
+        return;
+    }
+
+    op_block(ctx, WASM_BLOCK);
+    push_frame(ctx, FRAME_BLOCK, ys[0]);
+    node_within(ctx, x, ys + 1, count - 1);
+    pop_frame(ctx);
+    op0(ctx, WASM_END);
 
-            EMIT1(&ctx.emit, 0x0F); // return
+    do_tree(ctx, ys[0]);
+}
+
+static void do_tree(Ctx* ctx, int x) {
+    Block* b = &ctx->blocks[x];
+
+    int count = 0;
+    for (int c = b->first_child; c >= 0; c = ctx->blocks[c].next_sibling) {
+        count += ctx->blocks[c].fwd_preds >= 2;
+    }
+
+    int* ys = tb_arena_alloc(tmp_arena, (count ? count : 1) * sizeof(int));
+    count = 0;
+    for (int c = b->first_child; c >= 0; c = ctx->blocks[c].next_sibling) {
+        if (ctx->blocks[c].fwd_preds >= 2) ys[count++] = c;
+    }
+
+    if (b->is_loop) {
+        op_block(ctx, WASM_LOOP);
+        push_frame(ctx, FRAME_LOOP, x);
+        node_within(ctx, x, ys, count);
+        pop_frame(ctx);
+        op0(ctx, WASM_END);
+    } else {
+        node_within(ctx, x, ys, count);
+    }
+}
+
+static bool dominates(Ctx* ctx, int a, int b) {
+    while (b >= 0 && b != a) {
+        b = b == 0 ? -1 : ctx->blocks[b].idom;
+    }
+    return b == a;
+}
+
+static void build_structure(Ctx* ctx) {
+    size_t block_count = ctx->block_count;
+    TB_ArenaSavepoint sp = tb_arena_save(tmp_arena);
+
+    // our own RPO, the edges are the ground truth for the structuring
+    int* stack = tb_arena_alloc(tmp_arena, block_count * sizeof(int));
+    int* next = tb_arena_alloc(tmp_arena, block_count * sizeof(int));
+    int* order = tb_arena_alloc(tmp_arena, block_count * sizeof(int));
+    FOREACH_N(i, 0, block_count) {
+        next[i] = 0;
+        ctx->blocks[i].rpo = -1;
+    }
+
+    int top = 0, post = 0;
+    stack[top++] = 0, ctx->blocks[0].rpo = 0;
+    while (top > 0) {
+        int x = stack[top - 1];
+        Block* b = &ctx->blocks[x];
+        if (next[x] < b->edge_count) {
+            int y = b->edges[next[x]++].succ;
+            if (y >= 0 && ctx->blocks[y].rpo < 0) {
+                ctx->blocks[y].rpo = 0;
+                stack[top++] = y;
+            }
         } else {
-            tb_todo();
+            order[post++] = x;
+            top -= 1;
+        }
+    }
+
+    FOREACH_N(i, 0, post) {
+        ctx->blocks[order[i]].rpo = post - 1 - i;
+    }
+
+    // dominators over the same edges we're structuring with, Cooper, Harvey
+    // & Kennedy's "A Simple, Fast Dominance Algorithm".
+    int* pred_start = tb_arena_alloc(tmp_arena, (block_count + 1) * sizeof(int));
+    FOREACH_N(i, 0, block_count + 1) {
+        pred_start[i] = 0;
+    }
+
+    FOREACH_N(x, 0, block_count) if (ctx->blocks[x].rpo >= 0) {
+        FOREACH_N(i, 0, ctx->blocks[x].edge_count) {
+            int y = ctx->blocks[x].edges[i].succ;
+            if (y >= 0) pred_start[y + 1] += 1;
+        }
+    }
+
+    FOREACH_N(i, 0, block_count) {
+        pred_start[i + 1] += pred_start[i];
+    }
+
+    int* preds = tb_arena_alloc(tmp_arena, (pred_start[block_count] + 1) * sizeof(int));
+    FOREACH_N(i, 0, block_count) {
+        next[i] = 0;
+    }
+
+    FOREACH_N(x, 0, block_count) if (ctx->blocks[x].rpo >= 0) {
+        FOREACH_N(i, 0, ctx->blocks[x].edge_count) {
+            int y = ctx->blocks[x].edges[i].succ;
+            if (y >= 0) preds[pred_start[y] + next[y]++] = x;
+        }
+    }
+
+    FOREACH_N(i, 0, block_count) {
+        ctx->blocks[i].idom = -1;
+    }
+    ctx->blocks[0].idom = 0;
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        FOREACH_N(r, 1, post) {
+            int x = order[post - 1 - r];
+            int new_idom = -1;
+            FOREACH_N(j, pred_start[x], pred_start[x + 1]) {
+                int a = preds[j];
+                if (ctx->blocks[a].idom < 0) continue;
+                if (new_idom < 0) { new_idom = a; continue; }
+
+                int b = new_idom;
+                while (a != b) {
+                    while (ctx->blocks[a].rpo > ctx->blocks[b].rpo) a = ctx->blocks[a].idom;
+                    while (ctx->blocks[b].rpo > ctx->blocks[a].rpo) b = ctx->blocks[b].idom;
+                }
+                new_idom = a;
+            }
+
+            if (ctx->blocks[x].idom != new_idom) {
+                ctx->blocks[x].idom = new_idom;
+                changed = true;
+            }
+        }
+    }
+
+    // classify edges
+    FOREACH_N(x, 0, block_count) {
+        Block* b = &ctx->blocks[x];
+        if (b->rpo < 0) continue;
+
+        FOREACH_N(i, 0, b->edge_count) {
+            int y = b->edges[i].succ;
+            if (y < 0) continue;
+
+            if (ctx->blocks[y].rpo > b->rpo) {
+                ctx->blocks[y].fwd_preds += 1;
+            } else if (dominates(ctx, y, x)) {
+                ctx->blocks[y].is_loop = true;
+            } else {
+                tb_panic("wasm: %s has irreducible control flow (.bb%d -> .bb%d)\n", ctx->f->super.name, (int) x, y);
+            }
+        }
+    }
+
+    // dominator tree, children get pushed in RPO order so the lists end up
+    // with the highest RPO first.
+    FOREACH_N(i, 0, post) {
+        int x = order[post - 1 - i];
+        Block* b = &ctx->blocks[x];
+        if (x != 0 && b->idom >= 0) {
+            b->next_sibling = ctx->blocks[b->idom].first_child;
+            ctx->blocks[b->idom].first_child = x;
+        }
+    }
+
+    tb_arena_restore(tmp_arena, sp);
+}
+
+static void collect_edges(Ctx* ctx, Block* b) {
+    TB_Node* end = b->end;
+    if (end->type == TB_BRANCH) {
+        size_t succ_count = TB_NODE_GET_EXTRA_T(end, TB_NodeBranch)->succ_count;
+
+        b->edge_count = succ_count;
+        b->edges = tb_arena_alloc(tmp_arena, succ_count * sizeof(Edge));
+        FOREACH_N(i, 0, succ_count) {
+            b->edges[i] = (Edge){ NULL, -1 };
         }
 
-        EMIT1(&ctx.emit, 0x0B);
+        for (User* u = end->users; u; u = u->next) {
+            if (u->n->type == TB_PROJ && u->n->dt.type == TB_CONTROL) {
+                int index = TB_NODE_GET_EXTRA_T(u->n, TB_NodeProj)->index;
+                b->edges[index] = (Edge){ u->n, find_block(ctx, cfg_get_fallthru(u->n)) };
+            }
+        }
+    } else if (!cfg_is_terminator(end)) {
+        TB_Node* next = cfg_next_control(end);
+        if (next != NULL) {
+            b->edge_count = 1;
+            b->edges = tb_arena_alloc(tmp_arena, sizeof(Edge));
+            b->edges[0] = (Edge){ end, find_block(ctx, next) };
+        }
     }
+}
+
+////////////////////////////////
+// Function
+////////////////////////////////
+static void compile_function(TB_Passes* restrict p, TB_FunctionOutput* restrict func_out, const TB_FeatureSet* features, uint8_t* out, size_t out_capacity, bool emit_asm) {
+    verify_tmp_arena(p);
 
-    TB_FunctionOutput func_out = {
-        .linkage = f->linkage,
-        .code = ctx.emit.data,
-        .code_size = ctx.emit.count,
+    TB_Function* restrict f = p->f;
+    TB_FunctionPrototype* proto = f->prototype;
+    Ctx ctx = {
+        .p = p,
+        .f = f,
+        .fp = -1,
+        .emit = {
+            .f = f,
+            .emit_asm = emit_asm,
+            .output = func_out,
+            .data = out,
+            .capacity = out_capacity,
+        }
     };
-    return func_out;
+
+    worklist_clear(&p->worklist);
+    ctx.cfg = tb_compute_rpo(f, p);
+    tb_pass_schedule(p, ctx.cfg);
+
+    Worklist* ws = &p->worklist;
+    size_t block_count = ctx.block_count = ctx.cfg.block_count;
+    ctx.blocks = tb_arena_alloc(tmp_arena, block_count * sizeof(Block));
+    ctx.items = tb_arena_alloc(tmp_arena, f->node_count * sizeof(TB_Node*));
+    ctx.vals = tb_arena_alloc(tmp_arena, f->node_count * sizeof(Val));
+    FOREACH_N(i, 0, f->node_count) {
+        ctx.vals[i] = (Val){ .block = -1, .local = -1 };
+    }
+
+    // local schedules
+    size_t item_count = 0;
+    worklist_clear_visited(ws);
+    FOREACH_N(i, 0, block_count) {
+        TB_Node* bb_node = ws->items[i];
+        TB_BasicBlock* bb = &nl_map_get_checked(ctx.cfg.node_to_block, bb_node);
+
+        Block* b = &ctx.blocks[i];
+        *b = (Block){ .n = bb_node, .end = bb->end, .first_child = -1, .next_sibling = -1 };
+
+        // phis are defined on entry, if the walk reached them through a user it'd
+        // follow the backedge values in and schedule those before their operands.
+        if (bb_node->type == TB_REGION) {
+            for (User* u = bb_node->users; u; u = u->next) {
+                if (u->n->type == TB_PHI && !worklist_test_n_set(ws, u->n)) {
+                    dyn_array_put(ws->items, u->n);
+                }
+            }
+        }
+
+        sched_walk(p, ws, NULL, bb, bb->end, true);
+
+        b->item_start = item_count;
+        b->item_count = dyn_array_length(ws->items) - block_count;
+        FOREACH_N(j, 0, b->item_count) {
+            TB_Node* n = ws->items[block_count + j];
+            ctx.items[item_count + j] = n;
+            ctx.vals[n->gvn].block = i;
+            ctx.vals[n->gvn].pos = j;
+        }
+        item_count += b->item_count;
+        dyn_array_set_length(ws->items, block_count);
+    }
+
+    FOREACH_N(i, 0, block_count) {
+        collect_edges(&ctx, &ctx.blocks[i]);
+    }
+
+    classify_values(&ctx);
+
+    // stack slots
+    uint32_t frame_size = 0;
+    for (User* u = f->start_node->users; u; u = u->next) {
+        TB_Node* n = u->n;
+        if (n->type == TB_LOCAL && get_val(&ctx, n)->block >= 0) {
+            TB_NodeLocal* l = TB_NODE_GET_EXTRA(n);
+            assert(l->align <= 16 && "the shadow stack is only 16 byte aligned");
+
+            frame_size = align_up(frame_size, l->align ? l->align : 1);
+            get_val(&ctx, n)->local = frame_size;
+            frame_size += l->size;
+        }
+    }
+    ctx.frame_size = align_up(frame_size, 16);
+
+    // locals are grouped by type, params come first
+    static const uint8_t types[4] = { WASM_I32, WASM_I64, WASM_F32, WASM_F64 };
+    static const char* type_names[4] = { "i32", "i64", "f32", "f64" };
+    int type_count[4] = { ctx.frame_size ? 1 : 0 };
+    FOREACH_N(i, 0, item_count) {
+        TB_Node* n = ctx.items[i];
+        if (get_val(&ctx, n)->kind == VAL_LOCAL) {
+            int t = WASM_I32 - wasm_valtype(n->dt);
+            type_count[t] += 1;
+        }
+    }
+
+    int next_local[4];
+    next_local[0] = proto->param_count;
+    FOREACH_N(t, 1, 4) {
+        next_local[t] = next_local[t - 1] + type_count[t - 1];
+    }
+
+    if (ctx.frame_size) {
+        ctx.fp = next_local[0]++;
+    }
+
+    FOREACH_N(i, 0, item_count) {
+        TB_Node* n = ctx.items[i];
+        if (get_val(&ctx, n)->kind == VAL_LOCAL) {
+            int t = WASM_I32 - wasm_valtype(n->dt);
+            get_val(&ctx, n)->local = next_local[t]++;
+        }
+    }
+
+    EMITA(&ctx.emit, "%s:\n", f->super.name);
+
+    int run_count = 0;
+    FOREACH_N(t, 0, 4) run_count += type_count[t] != 0;
+
+    emit_uleb(&ctx, run_count);
+    FOREACH_N(t, 0, 4) if (type_count[t]) {
+        emit_uleb(&ctx, type_count[t]);
+        EMIT1(&ctx.emit, types[t]);
+        EMITA(&ctx.emit, "  (local %s x %d)\n", type_names[t], type_count[t]);
+    }
+
+    // prologue
+    if (ctx.frame_size) {
+        op_idx(&ctx, WASM_GLOBAL_GET, 0);
+        op_i32(&ctx, ctx.frame_size);
+        op0(&ctx, WASM_I32_SUB);
+        op_idx(&ctx, WASM_LOCAL_TEE, ctx.fp);
+        op_idx(&ctx, WASM_GLOBAL_SET, 0);
+    }
+
+    build_structure(&ctx);
+    do_tree(&ctx, 0);
+
+    // every path ends in a br or return, the validator doesn't know that
+    if (proto->return_count) {
+        op0(&ctx, WASM_UNREACHABLE);
+    }
+    EMIT1(&ctx.emit, WASM_END);
+
+    dyn_array_destroy(ctx.frames);
+    tb_free_cfg(&ctx.cfg);
+
+    func_out->asm_out = ctx.emit.head_asm;
+    func_out->code = ctx.emit.data;
+    func_out->code_size = ctx.emit.count;
+    func_out->stack_usage = ctx.frame_size;
+}
+
+static void get_data_type_size(TB_DataType dt, size_t* out_size, size_t* out_align) {
+    switch (dt.type) {
+        case TB_INT: {
+            // above 64bits we really dont care that much about natural alignment
+            bool is_big_int = dt.data > 64;
+
+            // round up bits to a byte
+            int bits = is_big_int ? ((dt.data + 7) / 8) : tb_next_pow2(dt.data - 1);
+
+            *out_size  = ((bits+7) / 8);
+            *out_align = is_big_int ? 8 : ((dt.data + 7) / 8);
+            break;
+        }
+        case TB_FLOAT: {
+            int s = 0;
+            if (dt.data == TB_FLT_32) s = 4;
+            else if (dt.data == TB_FLT_64) s = 8;
+            else tb_unreachable();
+
+            *out_size = s;
+            *out_align = s;
+            break;
+        }
+        case TB_PTR: {
+            *out_size = 4;
+            *out_align = 4;
+            break;
+        }
+        default: tb_unreachable();
+    }
+}
+
+// nothing can be resolved until the module writer has given everything an index
+static size_t emit_call_patches(TB_Module* restrict m, TB_FunctionOutput* out_f) {
+    return out_f->patch_count;
 }
 
-#if _MSC_VER
-_Pragma("warning (push)") _Pragma("warning (disable: 4028)")
-#endif
 ICodeGen tb__wasm32_codegen = {
     .minimum_addressable_size = 8,
     .pointer_size = 32,
 
-    .get_data_type_size  = wasm_get_data_type_size,
-    .emit_call_patches   = wasm_emit_call_patches,
-    .emit_prologue       = wasm_emit_prologue,
-    .emit_epilogue       = wasm_emit_epilogue,
-
-    .fast_path = wasm_fast_compile_function,
-    //.complex_path = x64_complex_compile_function
+    .emit_call_patches  = emit_call_patches,
+    .get_data_type_size = get_data_type_size,
+    .compile_function   = compile_function,
 };
-#if _MSC_VER
-_Pragma("warning (pop)")
-#endif
-#endif
@@ -0,0 +1,258 @@
+// WebAssembly binary encoding bits, shared between the codegen and the module writer.
+// [https://webassembly.github.io/spec/core/binary/index.html]
+#pragma once
+
+// value types
+enum {
+    WASM_I32     = 0x7F,
+    WASM_I64     = 0x7E,
+    WASM_F32     = 0x7D,
+    WASM_F64     = 0x7C,
+    WASM_FUNCREF = 0x70,
+    WASM_FUNC    = 0x60,
+    WASM_VOID    = 0x40, // empty blocktype
+};
+
+// section ids
+enum {
+    WASM_SEC_CUSTOM,
+    WASM_SEC_TYPE,
+    WASM_SEC_IMPORT,
+    WASM_SEC_FUNCTION,
+    WASM_SEC_TABLE,
+    WASM_SEC_MEMORY,
+    WASM_SEC_GLOBAL,
+    WASM_SEC_EXPORT,
+    WASM_SEC_START,
+    WASM_SEC_ELEM,
+    WASM_SEC_CODE,
+    WASM_SEC_DATA,
+};
+
+// import/export kinds
+enum {
+    WASM_EXTERN_FUNC,
+    WASM_EXTERN_TABLE,
+    WASM_EXTERN_MEMORY,
+    WASM_EXTERN_GLOBAL,
+};
+
+// global 0 is the shadow stack pointer (it grows down from the top of the
+// stack region), memory below it is the stack and the data goes after.
+#define WASM_STACK_SIZE   (64 * 1024)
+#define WASM_PAGE_SIZE    (64 * 1024)
+
+// calls and addresses are emitted as 5 byte LEBs so the writer can patch
+// them in place once everything has an index.
+#define WASM_PADDED_LEB   5
+
+//   opcode      byte   mnemonic
+#define WASM_OPS(X) \
+    X(UNREACHABLE,  0x00, "unreachable")         \
+    X(NOP,          0x01, "nop")                 \
+    X(BLOCK,        0x02, "block")               \
+    X(LOOP,         0x03, "loop")                \
+    X(IF,           0x04, "if")                  \
+    X(ELSE,         0x05, "else")                \
+    X(END,          0x0B, "end")                 \
+    X(BR,           0x0C, "br")                  \
+    X(BR_IF,        0x0D, "br_if")               \
+    X(BR_TABLE,     0x0E, "br_table")            \
+    X(RETURN,       0x0F, "return")              \
+    X(CALL,         0x10, "call")                \
+    X(CALL_INDIRECT,0x11, "call_indirect")       \
+    X(DROP,         0x1A, "drop")                \
+    X(SELECT,       0x1B, "select")              \
+    X(LOCAL_GET,    0x20, "local.get")           \
+    X(LOCAL_SET,    0x21, "local.set")           \
+    X(LOCAL_TEE,    0x22, "local.tee")           \
+    X(GLOBAL_GET,   0x23, "global.get")          \
+    X(GLOBAL_SET,   0x24, "global.set")          \
+    X(I32_LOAD,     0x28, "i32.load")            \
+    X(I64_LOAD,     0x29, "i64.load")            \
+    X(F32_LOAD,     0x2A, "f32.load")            \
+    X(F64_LOAD,     0x2B, "f64.load")            \
+    X(I32_LOAD8_S,  0x2C, "i32.load8_s")         \
+    X(I32_LOAD8_U,  0x2D, "i32.load8_u")         \
+    X(I32_LOAD16_S, 0x2E, "i32.load16_s")        \
+    X(I32_LOAD16_U, 0x2F, "i32.load16_u")        \
+    X(I64_LOAD8_S,  0x30, "i64.load8_s")         \
+    X(I64_LOAD8_U,  0x31, "i64.load8_u")         \
+    X(I64_LOAD16_S, 0x32, "i64.load16_s")        \
+    X(I64_LOAD16_U, 0x33, "i64.load16_u")        \
+    X(I64_LOAD32_S, 0x34, "i64.load32_s")        \
+    X(I64_LOAD32_U, 0x35, "i64.load32_u")        \
+    X(I32_STORE,    0x36, "i32.store")           \
+    X(I64_STORE,    0x37, "i64.store")           \
+    X(F32_STORE,    0x38, "f32.store")           \
+    X(F64_STORE,    0x39, "f64.store")           \
+    X(I32_STORE8,   0x3A, "i32.store8")          \
+    X(I32_STORE16,  0x3B, "i32.store16")         \
+    X(I64_STORE8,   0x3C, "i64.store8")          \
+    X(I64_STORE16,  0x3D, "i64.store16")         \
+    X(I64_STORE32,  0x3E, "i64.store32")         \
+    X(MEMORY_SIZE,  0x3F, "memory.size")         \
+    X(MEMORY_GROW,  0x40, "memory.grow")         \
+    X(I32_CONST,    0x41, "i32.const")           \
+    X(I64_CONST,    0x42, "i64.const")           \
+    X(F32_CONST,    0x43, "f32.const")           \
+    X(F64_CONST,    0x44, "f64.const")           \
+    X(I32_EQZ,      0x45, "i32.eqz")             \
+    X(I32_EQ,       0x46, "i32.eq")              \
+    X(I32_NE,       0x47, "i32.ne")              \
+    X(I32_LT_S,     0x48, "i32.lt_s")            \
+    X(I32_LT_U,     0x49, "i32.lt_u")            \
+    X(I32_GT_S,     0x4A, "i32.gt_s")            \
+    X(I32_GT_U,     0x4B, "i32.gt_u")            \
+    X(I32_LE_S,     0x4C, "i32.le_s")            \
+    X(I32_LE_U,     0x4D, "i32.le_u")            \
+    X(I32_GE_S,     0x4E, "i32.ge_s")            \
+    X(I32_GE_U,     0x4F, "i32.ge_u")            \
+    X(I64_EQZ,      0x50, "i64.eqz")             \
+    X(I64_EQ,       0x51, "i64.eq")              \
+    X(I64_NE,       0x52, "i64.ne")              \
+    X(I64_LT_S,     0x53, "i64.lt_s")            \
+    X(I64_LT_U,     0x54, "i64.lt_u")            \
+    X(I64_GT_S,     0x55, "i64.gt_s")            \
+    X(I64_GT_U,     0x56, "i64.gt_u")            \
+    X(I64_LE_S,     0x57, "i64.le_s")            \
+    X(I64_LE_U,     0x58, "i64.le_u")            \
+    X(I64_GE_S,     0x59, "i64.ge_s")            \
+    X(I64_GE_U,     0x5A, "i64.ge_u")            \
+    X(F32_EQ,       0x5B, "f32.eq")              \
+    X(F32_NE,       0x5C, "f32.ne")              \
+    X(F32_LT,       0x5D, "f32.lt")              \
+    X(F32_GT,       0x5E, "f32.gt")              \
+    X(F32_LE,       0x5F, "f32.le")              \
+    X(F32_GE,       0x60, "f32.ge")              \
+    X(F64_EQ,       0x61, "f64.eq")              \
+    X(F64_NE,       0x62, "f64.ne")              \
+    X(F64_LT,       0x63, "f64.lt")              \
+    X(F64_GT,       0x64, "f64.gt")              \
+    X(F64_LE,       0x65, "f64.le")              \
+    X(F64_GE,       0x66, "f64.ge")              \
+    X(I32_CLZ,      0x67, "i32.clz")             \
+    X(I32_CTZ,      0x68, "i32.ctz")             \
+    X(I32_POPCNT,   0x69, "i32.popcnt")          \
+    X(I32_ADD,      0x6A, "i32.add")             \
+    X(I32_SUB,      0x6B, "i32.sub")             \
+    X(I32_MUL,      0x6C, "i32.mul")             \
+    X(I32_DIV_S,    0x6D, "i32.div_s")           \
+    X(I32_DIV_U,    0x6E, "i32.div_u")           \
+    X(I32_REM_S,    0x6F, "i32.rem_s")           \
+    X(I32_REM_U,    0x70, "i32.rem_u")           \
+    X(I32_AND,      0x71, "i32.and")             \
+    X(I32_OR,       0x72, "i32.or")              \
+    X(I32_XOR,      0x73, "i32.xor")             \
+    X(I32_SHL,      0x74, "i32.shl")             \
+    X(I32_SHR_S,    0x75, "i32.shr_s")           \
+    X(I32_SHR_U,    0x76, "i32.shr_u")           \
+    X(I32_ROTL,     0x77, "i32.rotl")            \
+    X(I32_ROTR,     0x78, "i32.rotr")            \
+    X(I64_CLZ,      0x79, "i64.clz")             \
+    X(I64_CTZ,      0x7A, "i64.ctz")             \
+    X(I64_POPCNT,   0x7B, "i64.popcnt")          \
+    X(I64_ADD,      0x7C, "i64.add")             \
+    X(I64_SUB,      0x7D, "i64.sub")             \
+    X(I64_MUL,      0x7E, "i64.mul")             \
+    X(I64_DIV_S,    0x7F, "i64.div_s")           \
+    X(I64_DIV_U,    0x80, "i64.div_u")           \
+    X(I64_REM_S,    0x81, "i64.rem_s")           \
+    X(I64_REM_U,    0x82, "i64.rem_u")           \
+    X(I64_AND,      0x83, "i64.and")             \
+    X(I64_OR,       0x84, "i64.or")              \
+    X(I64_XOR,      0x85, "i64.xor")             \
+    X(I64_SHL,      0x86, "i64.shl")             \
+    X(I64_SHR_S,    0x87, "i64.shr_s")           \
+    X(I64_SHR_U,    0x88, "i64.shr_u")           \
+    X(I64_ROTL,     0x89, "i64.rotl")            \
+    X(I64_ROTR,     0x8A, "i64.rotr")            \
+    X(F32_ABS,      0x8B, "f32.abs")             \
+    X(F32_NEG,      0x8C, "f32.neg")             \
+    X(F32_SQRT,     0x91, "f32.sqrt")            \
+    X(F32_ADD,      0x92, "f32.add")             \
+    X(F32_SUB,      0x93, "f32.sub")             \
+    X(F32_MUL,      0x94, "f32.mul")             \
+    X(F32_DIV,      0x95, "f32.div")             \
+    X(F32_MIN,      0x96, "f32.min")             \
+    X(F32_MAX,      0x97, "f32.max")             \
+    X(F64_ABS,      0x99, "f64.abs")             \
+    X(F64_NEG,      0x9A, "f64.neg")             \
+    X(F64_SQRT,     0x9F, "f64.sqrt")            \
+    X(F64_ADD,      0xA0, "f64.add")             \
+    X(F64_SUB,      0xA1, "f64.sub")             \
+    X(F64_MUL,      0xA2, "f64.mul")             \
+    X(F64_DIV,      0xA3, "f64.div")             \
+    X(F64_MIN,      0xA4, "f64.min")             \
+    X(F64_MAX,      0xA5, "f64.max")             \
+    X(I32_WRAP_I64,       0xA7, "i32.wrap_i64")        \
+    X(I32_TRUNC_F32_S,    0xA8, "i32.trunc_f32_s")     \
+    X(I32_TRUNC_F32_U,    0xA9, "i32.trunc_f32_u")     \
+    X(I32_TRUNC_F64_S,    0xAA, "i32.trunc_f64_s")     \
+    X(I32_TRUNC_F64_U,    0xAB, "i32.trunc_f64_u")     \
+    X(I64_EXTEND_I32_S,   0xAC, "i64.extend_i32_s")    \
+    X(I64_EXTEND_I32_U,   0xAD, "i64.extend_i32_u")    \
+    X(I64_TRUNC_F32_S,    0xAE, "i64.trunc_f32_s")     \
+    X(I64_TRUNC_F32_U,    0xAF, "i64.trunc_f32_u")     \
+    X(I64_TRUNC_F64_S,    0xB0, "i64.trunc_f64_s")     \
+    X(I64_TRUNC_F64_U,    0xB1, "i64.trunc_f64_u")     \
+    X(F32_CONVERT_I32_S,  0xB2, "f32.convert_i32_s")   \
+    X(F32_CONVERT_I32_U,  0xB3, "f32.convert_i32_u")   \
+    X(F32_CONVERT_I64_S,  0xB4, "f32.convert_i64_s")   \
+    X(F32_CONVERT_I64_U,  0xB5, "f32.convert_i64_u")   \
+    X(F32_DEMOTE_F64,     0xB6, "f32.demote_f64")      \
+    X(F64_CONVERT_I32_S,  0xB7, "f64.convert_i32_s")   \
+    X(F64_CONVERT_I32_U,  0xB8, "f64.convert_i32_u")   \
+    X(F64_CONVERT_I64_S,  0xB9, "f64.convert_i64_s")   \
+    X(F64_CONVERT_I64_U,  0xBA, "f64.convert_i64_u")   \
+    X(F64_PROMOTE_F32,    0xBB, "f64.promote_f32")     \
+    X(I32_REINTERPRET_F32,0xBC, "i32.reinterpret_f32") \
+    X(I64_REINTERPRET_F64,0xBD, "i64.reinterpret_f64") \
+    X(F32_REINTERPRET_I32,0xBE, "f32.reinterpret_i32") \
+    X(F64_REINTERPRET_I64,0xBF, "f64.reinterpret_i64") \
+    X(I32_EXTEND8_S,      0xC0, "i32.extend8_s")       \
+    X(I32_EXTEND16_S,     0xC1, "i32.extend16_s")      \
+    X(I64_EXTEND8_S,      0xC2, "i64.extend8_s")       \
+    X(I64_EXTEND16_S,     0xC3, "i64.extend16_s")      \
+    X(I64_EXTEND32_S,     0xC4, "i64.extend32_s")      \
+    X(PREFIX_FC,          0xFC, "<0xFC>")
+
+typedef enum {
+    #define X(name, op, str) WASM_ ## name = op,
+    WASM_OPS(X)
+    #undef X
+} WasmOp;
+
+// 0xFC prefixed ops (saturating truncation and bulk memory)
+enum {
+    WASM_FC_I32_TRUNC_SAT_F32_S = 0,
+    WASM_FC_I32_TRUNC_SAT_F32_U = 1,
+    WASM_FC_I32_TRUNC_SAT_F64_S = 2,
+    WASM_FC_I32_TRUNC_SAT_F64_U = 3,
+    WASM_FC_I64_TRUNC_SAT_F32_S = 4,
+    WASM_FC_I64_TRUNC_SAT_F32_U = 5,
+    WASM_FC_I64_TRUNC_SAT_F64_S = 6,
+    WASM_FC_I64_TRUNC_SAT_F64_U = 7,
+    WASM_FC_MEMORY_COPY         = 10,
+    WASM_FC_MEMORY_FILL         = 11,
+};
+
+// narrow ints live in the next size up, pointers are 32bit
+static uint8_t wasm_valtype(TB_DataType dt) {
+    switch (dt.type) {
+        case TB_INT: {
+            if (dt.data > 64) tb_todo();
+            return dt.data <= 32 ? WASM_I32 : WASM_I64;
+        }
+        case TB_PTR:   return WASM_I32;
+        case TB_FLOAT: return dt.data == TB_FLT_64 ? WASM_F64 : WASM_F32;
+        default:       tb_unreachable(); return 0;
+    }
+}
+
+static void wasm_put_padded_leb(uint8_t* dst, uint32_t x, bool is_signed) {
+    FOREACH_N(i, 0, 4) {
+        dst[i] = 0x80 | ((x >> (i * 7)) & 0x7F);
+    }
+    dst[4] = (is_signed ? ((int32_t) x >> 28) : (x >> 28)) & 0x7F;
+}
@@ -5,7 +5,8 @@
 #include "x64_disasm.c"
 
 enum {
-    CG_REGISTER_CLASSES = 2
+    CG_REGISTER_CLASSES = 2,
+    CG_REGISTER_COUNT = 16,
 };
 
 enum {
@@ -14,8 +15,18 @@ enum {
 
     FIRST_GPR = 0,
     FIRST_XMM = 16, // we're getting more GPRs in intel APX so this might change :)
+
+    // RIP-relative operands still have an input, it doesn't mean anything
+    GLOBAL_BASE = RSP,
+    // edge moves can borrow this one (xchg'ing it out and back) when nothing's free
+    BORROW_GPR = RAX,
 };
 
+typedef TB_X86_DataType CG_DataType;
+
+// never handed out by the allocator
+static const uint64_t reserved_regs[CG_REGISTER_CLASSES] = { (1u << RBP) | (1u << RSP), 0 };
+
 typedef struct {
     TB_DataType dt;
 
@@ -43,16 +54,17 @@ static const struct ParamDescriptor {
 
 static size_t emit_prologue(Ctx* restrict ctx);
 static size_t emit_epilogue(Ctx* restrict ctx, TB_Node* stop);
+static void emit_frame_teardown(Ctx* restrict ctx);
 
 // initialize register allocator state
 static void init_regalloc(Ctx* restrict ctx) {
     // Generate intervals for physical registers
-    FOREACH_N(i, 0, 32) {
+    FOREACH_N(i, 0, CG_REGISTER_CLASSES*CG_REGISTER_COUNT) {
         DynArray(LiveRange) ranges = dyn_array_create(LiveRange, 8);
         dyn_array_put(ranges, (LiveRange){ INT_MAX, INT_MAX });
 
-        bool is_gpr = i < 16;
-        int reg = i % 16;
+        bool is_gpr = i < CG_REGISTER_COUNT;
+        int reg = i % CG_REGISTER_COUNT;
 
         dyn_array_put(ctx->intervals, (LiveInterval){
                 .reg_class = is_gpr ? REG_CLASS_GPR : REG_CLASS_XMM,
@@ -131,6 +143,20 @@ static bool is_terminator(int t) {
     return t == INST_TERMINATOR || t == INT3 || t == UD2;
 }
 
+static const char* reg_name(int rg, int num) {
+    return (rg == REG_CLASS_XMM ? XMM_NAMES : GPR_NAMES)[num];
+}
+
+// most things can write straight into a spill slot, cmov, the bit counting ops and
+// the BMI2 shifts can only write to registers.
+static bool dst_needs_reg(Inst* inst) {
+    if (inst->type == IMUL || inst->type == INST_ZERO || (inst->flags & (INST_MEM | INST_GLOBAL))) {
+        return true;
+    }
+
+    return inst->type >= CMOVO && inst->type <= SHRX;
+}
+
 static bool try_for_imm32(Ctx* restrict ctx, TB_Node* n, int32_t* out_x) {
     if (n->type == TB_INTEGER_CONST) {
         TB_NodeInt* i = TB_NODE_GET_EXTRA(n);
@@ -179,6 +205,24 @@ static Inst* inst_jcc(TB_Node* target, Cond cc) {
     return i;
 }
 
+// lock add qword [sym + disp], 1
+//
+// locked so threads running the same block don't drop counts
+static Inst* inst_counter(TB_Symbol* sym, int32_t disp) {
+    Inst* i = alloc_inst(ADD, TB_TYPE_I64, 0, 1, 0);
+    i->flags = INST_GLOBAL | INST_IMM | INST_LOCK;
+    i->mem_slot = 0;
+    i->operands[0] = RSP;
+    i->s = sym;
+    i->disp = disp;
+    i->imm = 1;
+    return i;
+}
+
+static bool is_counter(Inst* inst) {
+    return inst->type == ADD && inst->flags == (INST_GLOBAL | INST_IMM | INST_LOCK);
+}
+
 // store(binop(load(a), b))
 static int can_folded_store(Ctx* restrict ctx, TB_Node* mem, TB_Node* addr, TB_Node* src) {
     switch (src->type) {
@@ -436,6 +480,193 @@ static bool should_rematerialize(TB_Node* n) {
         n->type == TB_LOCAL || n->type == TB_SYMBOL;
 }
 
+////////////////////////////////
+// Scheduling model
+////////////////////////////////
+// latencies are rough numbers for the 64bit forms, the first row is the baseline
+// x86-64 (Sandy Bridge-ish) and the second is x86-64-v3 (Skylake/Zen2-ish), we
+// pick by whether AVX2 is around since that's what separates those levels.
+typedef enum {
+    SCHED_NONE, SCHED_ALU, SCHED_IMUL, SCHED_DIV, SCHED_LOAD, SCHED_STORE,
+    SCHED_FADD, SCHED_FMUL, SCHED_FDIV, SCHED_CVT, SCHED_CALL,
+    SCHED_CLASS_COUNT
+} SchedClass;
+
+static const SchedCost x64_sched_costs[2][SCHED_CLASS_COUNT] = {
+    // x86-64
+    {
+        [SCHED_NONE]  = { 0,  1 }, [SCHED_ALU]   = { 1,  1 },
+        [SCHED_IMUL]  = { 3,  1 }, [SCHED_DIV]   = { 40, 25 },
+        [SCHED_LOAD]  = { 5,  1 }, [SCHED_STORE] = { 1,  1 },
+        [SCHED_FADD]  = { 3,  1 }, [SCHED_FMUL]  = { 5,  1 },
+        [SCHED_FDIV]  = { 14, 14 }, [SCHED_CVT]  = { 4,  1 },
+        [SCHED_CALL]  = { 1,  1 },
+    },
+    // x86-64-v3
+    {
+        [SCHED_NONE]  = { 0,  1 }, [SCHED_ALU]   = { 1,  1 },
+        [SCHED_IMUL]  = { 3,  1 }, [SCHED_DIV]   = { 36, 21 },
+        [SCHED_LOAD]  = { 5,  1 }, [SCHED_STORE] = { 1,  1 },
+        [SCHED_FADD]  = { 4,  1 }, [SCHED_FMUL]  = { 4,  1 },
+        [SCHED_FDIV]  = { 11, 4 },  [SCHED_CVT]  = { 5,  1 },
+        [SCHED_CALL]  = { 1,  1 },
+    },
+};
+
+static SchedClass node_sched_class(TB_Node* n) {
+    if (should_rematerialize(n)) {
+        return SCHED_NONE;
+    }
+
+    switch (n->type) {
+        case TB_START: case TB_REGION: case TB_PHI: case TB_PROJ:
+        case TB_MERGEMEM: case TB_BITCAST:
+        return SCHED_NONE;
+
+        case TB_LOAD: case TB_READ: case TB_ATOMIC_LOAD:
+        return SCHED_LOAD;
+
+        case TB_STORE: case TB_WRITE:
+        return SCHED_STORE;
+
+        case TB_MUL: case TB_MULPAIR:
+        return SCHED_IMUL;
+
+        case TB_UDIV: case TB_SDIV: case TB_UMOD: case TB_SMOD:
+        return SCHED_DIV;
+
+        case TB_FADD: case TB_FSUB: case TB_FMAX: case TB_FMIN:
+        return SCHED_FADD;
+
+        case TB_FMUL:
+        return SCHED_FMUL;
+
+        case TB_FDIV:
+        return SCHED_FDIV;
+
+        case TB_INT2FLOAT: case TB_UINT2FLOAT: case TB_FLOAT2INT:
+        case TB_FLOAT2UINT: case TB_FLOAT_EXT:
+        return SCHED_CVT;
+
+        case TB_CALL: case TB_SYSCALL:
+        return SCHED_CALL;
+
+        default:
+        return SCHED_ALU;
+    }
+}
+
+static SchedCost node_sched_cost(void* user, TB_Node* n) {
+    Ctx* restrict ctx = user;
+    bool v3 = ctx->features.x64 & TB_FEATURE_X64_AVX2;
+    return x64_sched_costs[v3][node_sched_class(n)];
+}
+
+static SchedModel sched_model(Ctx* restrict ctx) {
+    // 16 GPRs minus RSP, RBP and a couple for isel's temporaries
+    return (SchedModel){ ctx, node_sched_cost, 12 };
+}
+
+// we don't reuse our incoming argument space for the callee's so tail
+// calls need all their arguments in registers.
+static bool tail_args_fit(const struct ParamDescriptor* restrict desc, bool is_sysv, TB_Node* n, size_t first_arg) {
+    size_t xmms_used = 0, gprs_used = 0;
+    FOREACH_N(i, first_arg, n->input_count) {
+        bool use_xmm = TB_IS_FLOAT_TYPE(n->inputs[i]->dt);
+        if ((use_xmm ? xmms_used : gprs_used) >= desc->gpr_count) {
+            return false;
+        }
+
+        // win64 will always expend a register
+        if (!is_sysv || use_xmm)  xmms_used++;
+        if (!is_sysv || !use_xmm) gprs_used++;
+    }
+
+    return true;
+}
+
+// calls which flow directly into the END can recycle our frame, as long
+// as nothing on it might still be referenced by the callee.
+static bool is_tail_call(Ctx* restrict ctx, TB_Node* n) {
+    TB_Node* end = ctx->f->stop_node;
+    if (n->type != TB_CALL || end == NULL) {
+        return false;
+    }
+
+    TB_NodeCall* c = TB_NODE_GET_EXTRA(n);
+    if (c->proto == NULL || end->inputs[0] != c->projs[0] || end->inputs[1] != c->projs[1]) {
+        return false;
+    }
+
+    // return values are forwarded untouched
+    if (end->input_count - 3 > c->proto->return_count) {
+        return false;
+    }
+
+    FOREACH_N(i, 3, end->input_count) {
+        if (end->inputs[i] != c->projs[i - 1]) {
+            return false;
+        }
+    }
+
+    // stack slots might've escaped into the callee
+    for (User* u = ctx->f->start_node->users; u; u = u->next) {
+        if (u->n->type == TB_LOCAL) {
+            return false;
+        }
+    }
+
+    bool is_sysv = (ctx->target_abi == TB_ABI_SYSTEMV);
+    return tail_args_fit(&param_descs[is_sysv ? 1 : 0], is_sysv, n, 3);
+}
+
+// dst &= mask, the 64bit masks don't fit into an imm32
+static void isel_and_mask(Ctx* restrict ctx, TB_Node* n, TB_DataType dt, int dst, uint64_t mask) {
+    if (dt.data <= 32) {
+        SUBMIT(inst_op_rri(AND, dt, dst, dst, mask));
+    } else {
+        int tmp = DEF(n, dt);
+        SUBMIT(inst_op_abs(MOVABS, dt, tmp, mask));
+        SUBMIT(inst_op_rrr(AND, dt, dst, dst, tmp));
+    }
+}
+
+// popcnt without the popcnt instruction, it's the usual SWAR trick:
+//   x = x - ((x >> 1) & 0x55..)
+//   x = (x & 0x33..) + ((x >> 2) & 0x33..)
+//   x = (x + (x >> 4)) & 0x0F..
+//   x = (x * 0x01..) >> (bits - 8)
+static void isel_popcnt_fallback(Ctx* restrict ctx, TB_Node* n, TB_DataType dt, int dst, int src) {
+    int tmp = DEF(n, dt);
+    SUBMIT(inst_move(dt, tmp, src));
+    SUBMIT(inst_op_rri(SHR, dt, tmp, tmp, 1));
+    isel_and_mask(ctx, n, dt, tmp, 0x5555555555555555ull);
+    SUBMIT(inst_move(dt, dst, src));
+    SUBMIT(inst_op_rrr(SUB, dt, dst, dst, tmp));
+
+    tmp = DEF(n, dt);
+    SUBMIT(inst_move(dt, tmp, dst));
+    SUBMIT(inst_op_rri(SHR, dt, tmp, tmp, 2));
+    isel_and_mask(ctx, n, dt, tmp, 0x3333333333333333ull);
+    isel_and_mask(ctx, n, dt, dst, 0x3333333333333333ull);
+    SUBMIT(inst_op_rrr(ADD, dt, dst, dst, tmp));
+
+    tmp = DEF(n, dt);
+    SUBMIT(inst_move(dt, tmp, dst));
+    SUBMIT(inst_op_rri(SHR, dt, tmp, tmp, 4));
+    SUBMIT(inst_op_rrr(ADD, dt, dst, dst, tmp));
+    isel_and_mask(ctx, n, dt, dst, 0x0F0F0F0F0F0F0F0Full);
+
+    if (dt.data <= 32) {
+        SUBMIT(inst_op_rri(IMUL, dt, dst, dst, 0x01010101));
+    } else {
+        tmp = DEF(n, dt);
+        SUBMIT(inst_op_abs(MOVABS, dt, tmp, 0x0101010101010101ull));
+        SUBMIT(inst_op_rrr(IMUL, dt, dst, dst, tmp));
+    }
+    SUBMIT(inst_op_rri(SHR, dt, dst, dst, dt.data - 8));
+}
+
 static void isel(Ctx* restrict ctx, TB_Node* n, const int dst) {
     TB_NodeTypeEnum type = n->type;
     switch (type) {
@@ -689,33 +920,45 @@ static void isel(Ctx* restrict ctx, TB_Node* n, const int dst) {
 
         // bit magic
         case TB_CTZ:
-        case TB_CLZ: {
-            int op = type == TB_CLZ ? BSR : BSF;
+        case TB_CLZ:
+        case TB_POPCNT: {
             int lhs = input_reg(ctx, n->inputs[1]);
             hint_reg(ctx, dst, lhs);
 
             // we only wanna deal with 32 or 64 ops for
             // this (16 is annoying and 8 is unavailable)
             TB_DataType dt = n->dt;
-            if (dt.data < 64) {
-                // make sure the bits are zero'd above
-                if (dt.data < 32) {
-                    assert(type == TB_CLZ && "clz is different, and im stupid");
-                    SUBMIT(inst_op_zero(TB_TYPE_I32, dst));
-                }
-
+            int bits = dt.data;
+            if (bits < 32) {
                 dt.data = 32;
-            }
 
-            Inst* inst = inst_op_rr(op, dt, dst, lhs);
-            if (type == TB_CLZ) {
-                // the difference between bsf and tzcnt
-                inst->flags |= INST_REP;
+                // the bits above need to be zero'd for clz and popcnt, ctz
+                // doesn't care (beyond the zero case)
+                if (type != TB_CTZ) {
+                    SUBMIT(inst_op_rr(bits <= 8 ? MOVZXB : MOVZXW, dt, dst, lhs));
+                    lhs = dst;
+                }
             }
-            SUBMIT(inst);
 
-            // flip bits to make CLZ instead of bitscanreverse
-            SUBMIT(inst_op_rri(XOR, dt, dst, dst, 63));
+            TB_FeatureSet_X64 features = ctx->features.x64;
+            if (type == TB_POPCNT) {
+                if (features & TB_FEATURE_X64_POPCNT) {
+                    SUBMIT(inst_op_rr(POPCNT, dt, dst, lhs));
+                } else {
+                    isel_popcnt_fallback(ctx, n, dt, dst, lhs);
+                }
+            } else if (type == TB_CTZ) {
+                SUBMIT(inst_op_rr(features & TB_FEATURE_X64_BMI1 ? TZCNT : BSF, dt, dst, lhs));
+            } else if (features & TB_FEATURE_X64_LZCNT) {
+                SUBMIT(inst_op_rr(LZCNT, dt, dst, lhs));
+                if (bits < 32) {
+                    SUBMIT(inst_op_rri(SUB, dt, dst, dst, 32 - bits));
+                }
+            } else {
+                // flip bits to make CLZ instead of bitscanreverse
+                SUBMIT(inst_op_rr(BSR, dt, dst, lhs));
+                SUBMIT(inst_op_rri(XOR, dt, dst, dst, bits < 32 ? bits - 1 : dt.data - 1));
+            }
             break;
         }
 
@@ -739,9 +982,18 @@ static void isel(Ctx* restrict ctx, TB_Node* n, const int dst) {
                 break;
             }
 
-            // the shift operations need their right hand side in CL (RCX's low 8bit)
             int rhs = input_reg(ctx, n->inputs[2]);
 
+            // BMI2 shifts can take the amount from any register and don't
+            // destroy the source, they're only 32 or 64bit tho.
+            bool bmi2 = ctx->features.x64 & TB_FEATURE_X64_BMI2;
+            if (bmi2 && type <= TB_SAR && n->dt.type == TB_INT && (n->dt.data == 32 || n->dt.data == 64)) {
+                const static InstType bmi2_ops[] = { SHLX, SHRX, SARX };
+                SUBMIT(inst_op_rrr(bmi2_ops[type - TB_SHL], n->dt, dst, lhs, rhs));
+                break;
+            }
+
+            // the shift operations need their right hand side in CL (RCX's low 8bit)
             SUBMIT(inst_move(n->dt, dst, lhs));
             SUBMIT(inst_move(n->dt, RCX, rhs));
             SUBMIT(inst_op_rrr_tmp(op, n->dt, dst, dst, RCX, RCX));
@@ -1009,7 +1261,15 @@ static void isel(Ctx* restrict ctx, TB_Node* n, const int dst) {
                 desc = &param_descs[2];
             }
 
-            TB_Node* ret_node = TB_NODE_GET_EXTRA_T(n, TB_NodeCall)->projs[2];
+            // tail calls have the RPC before the target
+            size_t first_arg = type == TB_TAILCALL ? 4 : 3;
+            bool is_tail = type == TB_TAILCALL || is_tail_call(ctx, n);
+            if (is_tail && !tail_args_fit(desc, is_sysv, n, first_arg)) {
+                tb_panic("tail call needs stack arguments, those aren't supported yet\n");
+            }
+
+            // the callee returns straight to our caller on tail calls
+            TB_Node* ret_node = is_tail ? NULL : TB_NODE_GET_EXTRA_T(n, TB_NodeCall)->projs[2];
             if (!has_users(ctx, ret_node)) {
                 ret_node = NULL;
             }
@@ -1023,8 +1283,8 @@ static void isel(Ctx* restrict ctx, TB_Node* n, const int dst) {
 
             // system calls don't count, we track this for ABI
             // and stack allocation purposes.
-            if (ctx->caller_usage < n->input_count - 3) {
-                ctx->caller_usage = n->input_count - 3;
+            if (!is_tail && ctx->caller_usage < n->input_count - first_arg) {
+                ctx->caller_usage = n->input_count - first_arg;
             }
 
             uint32_t caller_saved_gprs = desc->caller_saved_gprs;
@@ -1036,10 +1296,10 @@ static void isel(Ctx* restrict ctx, TB_Node* n, const int dst) {
             RegIndex param_srcs[64];
 
             TB_FunctionPrototype* proto = TB_NODE_GET_EXTRA_T(n, TB_NodeCall)->proto;
-            int vararg_cutoff = proto && proto->has_varargs ? proto->param_count : n->input_count-2;
+            int vararg_cutoff = proto && proto->has_varargs ? proto->param_count : n->input_count-first_arg+1;
 
             size_t xmms_used = 0, gprs_used = 0;
-            FOREACH_N(i, 3, n->input_count) {
+            FOREACH_N(i, first_arg, n->input_count) {
                 TB_Node* param = n->inputs[i];
                 TB_DataType param_dt = param->dt;
 
@@ -1050,7 +1310,6 @@ static void isel(Ctx* restrict ctx, TB_Node* n, const int dst) {
                         xmms_used++;
                     } else {
                         gprs_used++;
-                        caller_saved_gprs &= ~(1u << gprs_used);
                     }
                 } else {
                     // win64 will always expend a register
@@ -1083,7 +1342,7 @@ static void isel(Ctx* restrict ctx, TB_Node* n, const int dst) {
 
             // perform last minute copies (this avoids keeping parameter registers alive for too long)
             FOREACH_N(i, 0, in_count) {
-                TB_DataType dt = n->inputs[3 + i]->dt;
+                TB_DataType dt = n->inputs[first_arg + i]->dt;
 
                 bool use_xmm = TB_IS_FLOAT_TYPE(dt);
                 SUBMIT(inst_move(dt, ins[i], param_srcs[i]));
@@ -1099,12 +1358,20 @@ static void isel(Ctx* restrict ctx, TB_Node* n, const int dst) {
 
             // compute the target (unless it's a symbol) before the
             // registers all need to be forcibly shuffled
-            TB_Node* target = n->inputs[2];
+            TB_Node* target = n->inputs[first_arg - 1];
             bool static_call = n->type != TB_SYSCALL && target->type == TB_SYMBOL;
 
             int target_val = RSP; // placeholder really
             if (!static_call) {
                 target_val = input_reg(ctx, target);
+
+                // callee saved registers are reloaded right before the jump so
+                // the target can't stay in one of those, R11 isn't a param.
+                if (is_tail) {
+                    hint_reg(ctx, target_val, FIRST_GPR + R11);
+                    SUBMIT(inst_move(TB_TYPE_PTR, FIRST_GPR + R11, target_val));
+                    target_val = FIRST_GPR + R11;
+                }
             }
 
             if (type == TB_SYSCALL) {
@@ -1133,27 +1400,30 @@ static void isel(Ctx* restrict ctx, TB_Node* n, const int dst) {
             // the function call boundary... you might see why inlining could be nice to implement
             size_t clobber_count = tb_popcount(caller_saved_gprs) + tb_popcount(caller_saved_xmms);
 
-            int op = SYSCALL;
-            if (n->type == TB_CALL) op = CALL;
-            if (n->type == TB_TAILCALL) op = JMP;
+            Inst* call_inst;
+            if (is_tail) {
+                // we never come back so there's nothing to clobber or return
+                call_inst = alloc_inst(JMP, TB_TYPE_VOID, 0, 1 + in_count, 0);
+                call_inst->flags |= INST_TAIL;
+            } else {
+                call_inst = alloc_inst(n->type == TB_CALL ? CALL : SYSCALL, ret_dt, 1, 1 + in_count, clobber_count);
 
-            Inst* call_inst = alloc_inst(op, ret_dt, 1, 1 + in_count, clobber_count);
+                // mark clobber list
+                {
+                    RegIndex* clobbers = &call_inst->operands[call_inst->out_count + call_inst->in_count];
+                    FOREACH_N(i, 0, 16) if (caller_saved_gprs & (1u << i)) {
+                        *clobbers++ = FIRST_GPR + i;
+                    }
 
-            // mark clobber list
-            {
-                RegIndex* clobbers = &call_inst->operands[call_inst->out_count + call_inst->in_count];
-                FOREACH_N(i, 0, 16) if (caller_saved_gprs & (1u << i)) {
-                    *clobbers++ = FIRST_GPR + i;
+                    FOREACH_N(i, 0, 16) if (caller_saved_xmms & (1u << i)) {
+                        *clobbers++ = FIRST_XMM + i;
+                    }
                 }
 
-                FOREACH_N(i, 0, 16) if (caller_saved_xmms & (1u << i)) {
-                    *clobbers++ = FIRST_XMM + i;
-                }
+                // return value (either XMM0 or RAX)
+                call_inst->operands[0] = (use_xmm_ret ? FIRST_XMM : 0) + RAX;
             }
 
-            // return value (either XMM0 or RAX)
-            call_inst->operands[0] = (use_xmm_ret ? FIRST_XMM : 0) + RAX;
-
             // write inputs
             RegIndex* dst_ins = &call_inst->operands[call_inst->out_count];
             if (static_call) {
@@ -1474,6 +1744,11 @@ static void isel(Ctx* restrict ctx, TB_Node* n, const int dst) {
         }
 
         case TB_END: {
+            // the call before us already jumped away
+            if (n->inputs[0]->type == TB_PROJ && is_tail_call(ctx, n->inputs[0]->inputs[0])) {
+                break;
+            }
+
             if (n->input_count > 3) {
                 assert(n->input_count <= 4 && "We don't support multiple returns here");
 
@@ -1523,7 +1798,7 @@ static void isel(Ctx* restrict ctx, TB_Node* n, const int dst) {
 
             TB_NodeAtomic* a = TB_NODE_GET_EXTRA(n);
             TB_DataType dt = a->proj1->dt;
-            bool dst_users = !has_users(ctx, a->proj1);
+            bool dst_users = has_users(ctx, a->proj1);
 
             int op = (dst_users ? fetch_tbl : tbl)[type - TB_ATOMIC_XCHG];
             if (op == 0) {
@@ -1678,6 +1953,24 @@ static void inst2_print(TB_CGEmitter* restrict e, InstType type, Val* dst, Val*
     }
 }
 
+// direct calls (and tail jumps) print the symbol rather than a memory operand
+static void print_call_target(TB_CGEmitter* restrict e, const char* mnemonic, Val* target) {
+    if (e->emit_asm) {
+        EMITA(e, "  %s ", mnemonic);
+
+        if (*target->symbol->name == 0) {
+            EMITA(e, "sym%p", target->symbol);
+        } else {
+            EMITA(e, "%s", target->symbol->name);
+        }
+
+        if (target->imm != 0) {
+            EMITA(e, " + %d", target->imm);
+        }
+        EMITA(e, "\n");
+    }
+}
+
 static void inst1_print(TB_CGEmitter* restrict e, int type, Val* src, TB_X86_DataType dt) {
     if (e->emit_asm) {
         EMITA(e, "  %s ", inst_table[type].mnemonic);
@@ -1712,6 +2005,10 @@ static int resolve_interval(Ctx* restrict ctx, Inst* inst, int i, Val* val) {
             }
         } else {
             *val = val_global(inst->s);
+            if (is_counter(inst)) {
+                // counters are the only [sym + disp] operand
+                val->imm = inst->disp;
+            }
             return 1;
         }
     }
@@ -1733,6 +2030,495 @@ static int resolve_interval(Ctx* restrict ctx, Inst* inst, int i, Val* val) {
     return 1;
 }
 
+////////////////////////////////
+// Machine peepholes
+////////////////////////////////
+// runs over the final instruction list (after regalloc, before encoding) so
+// the rules get to see the real locations. Each rule is handed an instruction
+// (and the one before it in the list so it can unlink it), it returns how many
+// bytes it saved or -1 if it didn't apply.
+typedef int (*PeepRule)(Ctx* restrict ctx, Inst* prev, Inst* inst);
+
+// these don't emit anything
+static bool peep_is_marker(Inst* inst) {
+    return inst->type == INST_LINE || inst->type == INST_TERMINATOR;
+}
+
+static Inst* peep_next(Inst* inst, Inst** out_prev) {
+    Inst* prev = inst;
+    inst = inst->next;
+    while (inst != NULL && peep_is_marker(inst)) {
+        prev = inst, inst = inst->next;
+    }
+
+    if (out_prev) *out_prev = prev;
+    return inst;
+}
+
+static bool peep_reads_flags(Inst* inst) {
+    return (inst->type >= JO && inst->type <= JG) || (inst->type >= SETO && inst->type <= SETG) || (inst->type >= CMOVO && inst->type <= CMOVG);
+}
+
+// plain `mov dst, src` between registers and memory, returns the operand
+// index of src or -1 if it's anything fancier.
+static int peep_mov_operands(Ctx* restrict ctx, Inst* inst, Val* dst, Val* src) {
+    if ((inst->type != MOV && inst->type != FP_MOV) || inst->tmp_count != 0 || (inst->flags & ~(INST_MEM | INST_INDEXED | INST_SPILL))) {
+        return -1;
+    }
+
+    int i = 0;
+    if (inst->out_count == 1) {
+        i += resolve_interval(ctx, inst, 0, dst);
+    } else if (inst->out_count == 0 && (inst->flags & INST_MEM) && inst->mem_slot == 0) {
+        i += resolve_interval(ctx, inst, 0, dst);
+    } else {
+        return -1;
+    }
+
+    if (i >= inst->out_count + inst->in_count) {
+        return -1;
+    }
+
+    int src_slot = i;
+    i += resolve_interval(ctx, inst, i, src);
+    return i == inst->out_count + inst->in_count ? src_slot : -1;
+}
+
+static int peep_encoded_size(int type, Val* dst, Val* src, TB_X86_DataType dt) {
+    uint8_t buffer[32];
+    TB_CGEmitter e = { .data = buffer, .capacity = sizeof(buffer) };
+
+    if (type == MOV && dt >= TB_X86_TYPE_PBYTE && dt <= TB_X86_TYPE_XMMWORD) {
+        type = FP_MOV;
+    }
+
+    inst2_print(&e, type, dst, src, dt);
+    return e.count;
+}
+
+static bool peep_is_reg(Val* v) {
+    return v->type == VAL_GPR || v->type == VAL_XMM;
+}
+
+// mov a, a
+static int peep_self_move(Ctx* restrict ctx, Inst* prev, Inst* inst) {
+    Val dst, src;
+    if (peep_mov_operands(ctx, inst, &dst, &src) < 0 || !is_value_match(&dst, &src)) {
+        return -1;
+    }
+
+    // the encoder already skips these, nothing saved but it keeps the
+    // rest of the rules from having to look past them
+    prev->next = inst->next;
+    return 0;
+}
+
+// jmp .next
+// .next:
+static int peep_jmp_next(Ctx* restrict ctx, Inst* prev, Inst* inst) {
+    if (inst->type != JMP || inst->flags != INST_NODE) {
+        return -1;
+    }
+
+    Inst* next = peep_next(inst, NULL);
+    if (next == NULL || next->type != INST_LABEL || next->n != inst->n) {
+        return -1;
+    }
+
+    // jmp rel32, it might've been relaxed to 2 bytes but we don't know yet
+    prev->next = inst->next;
+    return 5;
+}
+
+// jcc .a        j!cc .b
+// jmp .b   =>
+// .a:           .a:
+static int peep_jcc_over_jmp(Ctx* restrict ctx, Inst* prev, Inst* inst) {
+    if (inst->type < JO || inst->type > JG || inst->flags != INST_NODE) {
+        return -1;
+    }
+
+    Inst* jmp_prev;
+    Inst* jmp = peep_next(inst, &jmp_prev);
+    if (jmp == NULL || jmp->type != JMP || jmp->flags != INST_NODE) {
+        return -1;
+    }
+
+    Inst* next = peep_next(jmp, NULL);
+    if (next == NULL || next->type != INST_LABEL || next->n != inst->n) {
+        return -1;
+    }
+
+    inst->type = JO + ((inst->type - JO) ^ 1);
+    inst->n = jmp->n;
+    jmp_prev->next = jmp->next;
+    return 5;
+}
+
+// add a, b      add a, b
+// test a, a  => je ...
+// je ...
+static int peep_redundant_test(Ctx* restrict ctx, Inst* prev, Inst* inst) {
+    if (inst->type != ADD && inst->type != SUB && inst->type != AND && inst->type != OR && inst->type != XOR) {
+        return -1;
+    }
+
+    if (inst->out_count != 1 || (inst->flags & (INST_LOCK | INST_REP))) {
+        return -1;
+    }
+
+    Inst* test_prev;
+    Inst* test = peep_next(inst, &test_prev);
+    if (test == NULL || test->dt != inst->dt || test->out_count != 0 || test->tmp_count != 0) {
+        return -1;
+    }
+
+    // test a, a or cmp a, 0
+    Val out, lhs, rhs;
+    resolve_interval(ctx, inst, 0, &out);
+    if (test->type == TEST && test->flags == 0 && test->in_count == 2) {
+        resolve_interval(ctx, test, 0, &lhs);
+        resolve_interval(ctx, test, 1, &rhs);
+        if (!is_value_match(&lhs, &rhs)) {
+            return -1;
+        }
+    } else if (test->type == CMP && test->flags == INST_IMM && test->in_count == 1 && test->imm == 0) {
+        resolve_interval(ctx, test, 0, &lhs);
+        rhs = val_imm(0);
+    } else {
+        return -1;
+    }
+
+    if (out.type != VAL_GPR || !is_value_match(&out, &lhs)) {
+        return -1;
+    }
+
+    // the arithmetic only agrees with the test on ZF (and SF but we'd need to
+    // also know which flags the users look at, not worth it)
+    Inst* jcc = peep_next(test, NULL);
+    if (jcc == NULL || (jcc->type != JE && jcc->type != JNE)) {
+        return -1;
+    }
+
+    Inst* after = peep_next(jcc, NULL);
+    if (after != NULL && peep_reads_flags(after)) {
+        return -1;
+    }
+
+    test_prev->next = test->next;
+    return peep_encoded_size(test->type, &lhs, &rhs, test->dt);
+}
+
+// mov [m], a      mov [m], a
+// mov b, [m]  =>  mov b, a
+static int peep_store_load(Ctx* restrict ctx, Inst* prev, Inst* inst) {
+    Val store_dst, store_src;
+    int store_slot = peep_mov_operands(ctx, inst, &store_dst, &store_src);
+    if (store_slot < 0 || store_dst.type != VAL_MEM || !peep_is_reg(&store_src)) {
+        return -1;
+    }
+
+    // packed ints don't have a plain move form
+    if (inst->dt == TB_X86_TYPE_NONE || (inst->dt >= TB_X86_TYPE_PBYTE && inst->dt <= TB_X86_TYPE_PQWORD)) {
+        return -1;
+    }
+
+    Inst* load_prev;
+    Inst* load = peep_next(inst, &load_prev);
+    if (load == NULL || load->dt != inst->dt) {
+        return -1;
+    }
+
+    Val load_dst, load_src;
+    int load_slot = peep_mov_operands(ctx, load, &load_dst, &load_src);
+    if (load_slot < 0 || !peep_is_reg(&load_dst) || !is_value_match(&load_src, &store_dst)) {
+        return -1;
+    }
+
+    int old_size = peep_encoded_size(MOV, &load_dst, &load_src, load->dt);
+    if (is_value_match(&load_dst, &store_src)) {
+        load_prev->next = load->next;
+        return old_size;
+    }
+
+    // only the register form is left
+    if (load->flags & INST_MEM) {
+        return -1;
+    }
+
+    load->operands[load_slot] = inst->operands[store_slot];
+    return old_size - peep_encoded_size(MOV, &load_dst, &store_src, load->dt);
+}
+
+static const struct {
+    const char* name;
+    PeepRule func;
+} peep_rules[] = {
+    { "self move",     peep_self_move      },
+    { "jmp next",      peep_jmp_next       },
+    { "jcc over jmp",  peep_jcc_over_jmp   },
+    { "redundant test", peep_redundant_test },
+    { "store load",    peep_store_load     },
+};
+
+static bool peep_is_branch(Inst* inst) {
+    return (inst->type == JMP || (inst->type >= JO && inst->type <= JG)) && inst->flags == INST_NODE;
+}
+
+// jumps into a block which is nothing but `jmp .b` can go straight to .b, these
+// are mostly the landing pads from splitting critical edges. once nothing jumps
+// to a pad it's only reachable by falling into it:
+//
+// jcc .a            j!cc .b
+// .pad:         =>  .a:
+// jmp .b
+// .a:
+static int peep_thread_jumps(Ctx* restrict ctx, size_t* hits) {
+    NL_Map(TB_Node*, TB_Node*) forward = NULL;
+    for (Inst* inst = ctx->first; inst; inst = inst->next) {
+        Inst* jmp = inst->type == INST_LABEL ? peep_next(inst, NULL) : NULL;
+        if (jmp != NULL && jmp->type == JMP && jmp->flags == INST_NODE && jmp->n != inst->n) {
+            nl_map_put(forward, inst->n, jmp->n);
+        }
+    }
+
+    if (forward == NULL) {
+        return 0;
+    }
+
+    // pads can chain, a few hops is plenty (and infinite loops can make cycles)
+    NL_Map(TB_Node*, int) refs = NULL;
+    for (Inst* inst = ctx->first; inst; inst = inst->next) {
+        if (peep_is_branch(inst)) {
+            ptrdiff_t i;
+            for (int hops = 0; hops < 4 && (i = nl_map_get(forward, inst->n)) >= 0; hops++) {
+                inst->n = forward[i].v;
+            }
+        }
+
+        if (inst->type != INST_LABEL && (inst->flags & INST_NODE)) {
+            nl_map_put(refs, inst->n, 0);
+        }
+    }
+
+    dyn_array_for(i, ctx->jump_table_patches) {
+        nl_map_put(refs, ctx->jump_table_patches[i].target, 0);
+    }
+
+    int saved = 0;
+    Inst* prev = ctx->first;
+    Inst* last = ctx->first; // last instruction which isn't a marker
+    for (Inst* inst = prev->next; inst; inst = prev->next) {
+        if (inst->type == INST_LABEL && nl_map_get(forward, inst->n) >= 0 && nl_map_get(refs, inst->n) < 0) {
+            Inst* jmp = peep_next(inst, NULL);
+            Inst* next = peep_next(jmp, NULL);
+
+            bool dead = last->type == JMP;
+            if (!dead && last->type >= JO && last->type <= JG && last->flags == INST_NODE && next != NULL && next->type == INST_LABEL && next->n == last->n) {
+                last->type = JO + ((last->type - JO) ^ 1);
+                last->n = jmp->n;
+                dead = true;
+            }
+
+            if (dead) {
+                // it's never placed so it can't keep a label either
+                nl_map_remove(ctx->emit.labels, inst->n);
+
+                *hits += 1, saved += 5;
+                prev->next = jmp->next;
+                continue;
+            }
+        }
+
+        if (!peep_is_marker(inst)) {
+            last = inst;
+        }
+        prev = inst;
+    }
+
+    nl_map_free(forward);
+    nl_map_free(refs);
+    return saved;
+}
+
+static void machine_peephole(Ctx* restrict ctx) {
+    size_t hits = 0, bytes = 0;
+    bytes += peep_thread_jumps(ctx, &hits);
+
+    Inst* prev = ctx->first;
+    Inst* inst = prev->next;
+    while (inst != NULL) {
+        bool progress = false;
+        FOREACH_N(i, 0, COUNTOF(peep_rules)) {
+            int saved = peep_rules[i].func(ctx, prev, inst);
+            if (saved >= 0) {
+                TB_OPTDEBUG(CODEGEN)(printf("  PEEP %s: saved %d bytes\n", peep_rules[i].name, saved));
+
+                hits += 1, bytes += saved;
+                progress = true;
+                break;
+            }
+        }
+
+        // the rule might've removed the instruction so we start over from the last
+        // one we know is still there.
+        if (progress) {
+            inst = prev->next;
+        } else {
+            prev = inst, inst = inst->next;
+        }
+    }
+
+    if (hits > 0) {
+        TB_Module* m = ctx->module;
+        atomic_fetch_add(&m->peephole_hits, hits);
+        atomic_fetch_add(&m->peephole_bytes, bytes);
+    }
+}
+
+////////////////////////////////
+// Branch relaxation
+////////////////////////////////
+// branches to labels are emitted as rel32 first, once every label is placed we
+// pick the ones which fit in rel8. Shrinking a branch only ever brings others
+// closer to their targets so we keep marking until nothing changes and then
+// compact the code in one go.
+typedef struct {
+    uint32_t start;
+    TB_Node* target;
+
+    // filled in by relax_branches
+    uint32_t target_pos;
+    bool is_jcc, is_short;
+} BranchSite;
+
+static int branch_long_size(BranchSite* b) { return b->is_jcc ? 6 : 5; }
+
+// how many bytes did the short branches before pos save, removed[i] is the
+// sum over the first i branches.
+static uint32_t relax_removed_before(size_t count, BranchSite* branches, uint32_t* removed, uint32_t pos) {
+    size_t lo = 0, hi = count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (branches[mid].start < pos) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return removed[lo];
+}
+
+static void relax_branches(Ctx* restrict ctx, TB_FunctionOutput* restrict func_out, DynArray(BranchSite) branches) {
+    TB_CGEmitter* e = &ctx->emit;
+    size_t count = dyn_array_length(branches);
+    if (count == 0) {
+        return;
+    }
+
+    dyn_array_for(i, branches) {
+        uint32_t pos = nl_map_get_checked(e->labels, branches[i].target);
+        assert((pos & 0x80000000) && "target label wasn't resolved... what?");
+        branches[i].target_pos = pos & ~0x80000000;
+    }
+
+    TB_ArenaSavepoint sp = tb_arena_save(tmp_arena);
+    uint32_t* removed = tb_arena_alloc(tmp_arena, (count + 1) * sizeof(uint32_t));
+
+    bool progress;
+    do {
+        progress = false;
+
+        removed[0] = 0;
+        FOREACH_N(i, 0, count) {
+            removed[i + 1] = removed[i] + (branches[i].is_short ? branch_long_size(&branches[i]) - 2 : 0);
+        }
+
+        // the prefix sums might be stale as we go but that just means we're
+        // being conservative, it'll get picked up next round.
+        FOREACH_N(i, 0, count) {
+            BranchSite* b = &branches[i];
+            if (b->is_short) {
+                continue;
+            }
+
+            int saved = branch_long_size(b) - 2;
+            int64_t end = (int64_t) b->start - removed[i] + 2;
+            int64_t target = (int64_t) b->target_pos - relax_removed_before(count, branches, removed, b->target_pos);
+            if (b->start < b->target_pos) {
+                target -= saved;
+            }
+
+            int64_t disp = target - end;
+            if (disp >= INT8_MIN && disp <= INT8_MAX) {
+                b->is_short = true;
+                progress = true;
+            }
+        }
+    } while (progress);
+
+    removed[0] = 0;
+    FOREACH_N(i, 0, count) {
+        removed[i + 1] = removed[i] + (branches[i].is_short ? branch_long_size(&branches[i]) - 2 : 0);
+    }
+
+    if (removed[count] > 0) {
+        #define RELAX_MAP(pos) ((pos) - relax_removed_before(count, branches, removed, pos))
+
+        // compact, we're only ever moving code backwards so it's fine to do in place
+        uint8_t* data = e->data;
+        uint32_t read = 0, write = 0;
+        FOREACH_N(i, 0, count) {
+            BranchSite* b = &branches[i];
+            int len = branch_long_size(b);
+
+            memmove(&data[write], &data[read], b->start - read);
+            write += b->start - read;
+            read = b->start;
+
+            int64_t target = RELAX_MAP(b->target_pos);
+            if (b->is_short) {
+                int64_t disp = target - (write + 2);
+                assert(disp >= INT8_MIN && disp <= INT8_MAX);
+
+                // jcc rel32 is 0F 8x, the rel8 version is 7x
+                data[write + 0] = b->is_jcc ? 0x70 | (data[read + 1] & 0x0F) : 0xEB;
+                data[write + 1] = (uint8_t) (int8_t) disp;
+                write += 2;
+            } else {
+                int32_t disp = target - (write + len);
+                memmove(&data[write], &data[read], len - 4);
+                memcpy(&data[write + len - 4], &disp, 4);
+                write += len;
+            }
+            read += len;
+        }
+
+        memmove(&data[write], &data[read], e->count - read);
+        e->count = write + (e->count - read);
+
+        // everything which remembers a code position needs to move too
+        nl_map_for(i, e->labels) {
+            uint32_t pos = e->labels[i].v;
+            assert(pos & 0x80000000);
+            e->labels[i].v = 0x80000000 | RELAX_MAP(pos & ~0x80000000);
+        }
+
+        for (TB_SymbolPatch* p = func_out->last_patch; p != NULL; p = p->prev) {
+            p->pos = RELAX_MAP(p->pos);
+        }
+
+        dyn_array_for(i, ctx->locations) {
+            ctx->locations[i].pos = RELAX_MAP(ctx->locations[i].pos);
+        }
+
+        #undef RELAX_MAP
+    }
+
+    tb_arena_restore(tmp_arena, sp);
+}
+
 static void emit_code(Ctx* restrict ctx, TB_FunctionOutput* restrict func_out, int end) {
     TB_CGEmitter* e = &ctx->emit;
 
@@ -1752,6 +2538,7 @@ static void emit_code(Ctx* restrict ctx, TB_FunctionOutput* restrict func_out, i
     // emit prologue
     func_out->prologue_length = emit_prologue(ctx);
 
+    DynArray(BranchSite) branches = dyn_array_create(BranchSite, 64);
     Inst* prev_line = NULL;
     for (Inst* restrict inst = ctx->first; inst; inst = inst->next) {
         size_t in_base = inst->out_count;
@@ -1830,27 +2617,37 @@ static void emit_code(Ctx* restrict ctx, TB_FunctionOutput* restrict func_out, i
             } else if (inst->flags & INST_GLOBAL) {
                 target = val_global(inst->s);
             } else {
-                assert(inst->in_count == 1);
                 resolve_interval(ctx, inst, in_base, &target);
             }
 
-            inst1_print(e, inst->type, &target, inst->dt);
+            if (inst->flags & INST_TAIL) {
+                emit_frame_teardown(ctx);
+            }
+
+            uint32_t start = GET_CODE_POS(e);
+            if (inst->flags & INST_TAIL) {
+                // tail calls print like the call they replaced
+                if (target.type == VAL_GLOBAL) {
+                    print_call_target(e, "jmp", &target);
+                } else if (e->emit_asm) {
+                    EMITA(e, "  jmp ");
+                    print_operand(e, &target, TB_X86_TYPE_QWORD);
+                    EMITA(e, "\n");
+                }
+                inst1(e, JMP, &target, inst->dt);
+            } else {
+                inst1_print(e, inst->type, &target, inst->dt);
+            }
+
+            if (target.type == VAL_LABEL) {
+                BranchSite b = { .start = start, .target = inst->n, .is_jcc = inst->type != JMP };
+                dyn_array_put(branches, b);
+            }
         } else if (inst->type == CALL) {
             Val target;
             size_t i = resolve_interval(ctx, inst, in_base, &target);
             if (target.type == VAL_GLOBAL) {
-                EMITA(e, "  call ");
-
-                if (*target.symbol->name == 0) {
-                    EMITA(e, "sym%p", target.symbol);
-                } else {
-                    EMITA(e, "%s", target.symbol->name);
-                }
-
-                if (target.imm != 0) {
-                    EMITA(e, " + %d", target.imm);
-                }
-                EMITA(e, "\n");
+                print_call_target(e, "call", &target);
                 inst1(e, CALL, &target, TB_X86_TYPE_QWORD);
             } else {
                 inst1_print(e, CALL, &target, TB_X86_TYPE_QWORD);
@@ -1905,6 +2702,24 @@ static void emit_code(Ctx* restrict ctx, TB_FunctionOutput* restrict func_out, i
                     continue;
                 }
 
+                if (inst_table[inst->type].cat == INST_VEX) {
+                    // non-destructive three operand form, no need for the mov
+                    Val rhs;
+                    resolve_interval(ctx, inst, i, &rhs);
+                    if (e->emit_asm) {
+                        EMITA(e, "  %s ", inst_table[inst->type].mnemonic);
+                        print_operand(e, &out, inst->dt);
+                        EMITA(e, ", ");
+                        print_operand(e, &lhs, inst->dt);
+                        EMITA(e, ", ");
+                        print_operand(e, &rhs, inst->dt);
+                        EMITA(e, "\n");
+                    }
+
+                    inst3_vex(e, inst->type, &out, &lhs, &rhs, inst->dt);
+                    continue;
+                }
+
                 if (inst->out_count == 0) {
                     out = lhs;
                 } else if (inst->type == IDIV || inst->type == DIV) {
@@ -1948,6 +2763,11 @@ static void emit_code(Ctx* restrict ctx, TB_FunctionOutput* restrict func_out, i
         emit_epilogue(ctx, ctx->f->stop_node);
     }
 
+    CUIK_TIMED_BLOCK("relax branches") {
+        relax_branches(ctx, func_out, branches);
+    }
+    dyn_array_destroy(branches);
+
     // pad to 16bytes
     static const uint8_t nops[8][8] = {
         { 0x90 },
@@ -2056,18 +2876,15 @@ static size_t emit_prologue(Ctx* restrict ctx) {
     return e->count;
 }
 
-static size_t emit_epilogue(Ctx* restrict ctx, TB_Node* stop) {
-    uint64_t saved = ctx->regs_to_save, stack_usage = ctx->stack_usage;
+// shared between the epilogue and tail calls
+static void emit_frame_teardown(Ctx* restrict ctx) {
+    uint64_t stack_usage = ctx->stack_usage;
     TB_CGEmitter* e = &ctx->emit;
 
     if (stack_usage <= 16) {
-        EMITA(e, "  ret\n");
-        EMIT1(e, 0xC3);
-        return 1;
+        return;
     }
 
-    size_t start = e->count;
-
     // add rsp, N
     if (stack_usage > 0) {
         EMITA(e, "  add RSP, %d\n", stack_usage);
@@ -2089,6 +2906,20 @@ static size_t emit_epilogue(Ctx* restrict ctx, TB_Node* stop) {
         EMITA(e, "  pop RBP\n");
         EMIT1(&ctx->emit, 0x58 + RBP);
     }
+}
+
+static size_t emit_epilogue(Ctx* restrict ctx, TB_Node* stop) {
+    uint64_t stack_usage = ctx->stack_usage;
+    TB_CGEmitter* e = &ctx->emit;
+
+    if (stack_usage <= 16) {
+        EMITA(e, "  ret\n");
+        EMIT1(e, 0xC3);
+        return 1;
+    }
+
+    size_t start = e->count;
+    emit_frame_teardown(ctx);
 
     // ret
     TB_Node* rpc = stop->inputs[2];
@@ -100,6 +100,9 @@ typedef enum {
 
     // SSE
     INST_BINOP_SSE,
+
+    // VEX encoded, three operands (dst, src, vvvv)
+    INST_VEX,
 } InstCategory;
 
 typedef struct InstDesc {
@@ -197,7 +200,7 @@ inline static bool is_value_match(const Val* a, const Val* b) {
     if (a->type != b->type) return false;
 
     if (a->type == VAL_MEM) {
-        return a->reg == b->reg && a->index == b->index && a->scale == b->scale && a->index == b->index;
+        return a->reg == b->reg && a->index == b->index && a->scale == b->scale && a->imm == b->imm;
     }
 
     return (a->type == VAL_GPR || a->type == VAL_XMM) ? a->reg == b->reg : false;
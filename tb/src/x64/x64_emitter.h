@@ -29,7 +29,7 @@ static void emit_memory_operand(TB_CGEmitter* restrict e, uint8_t rx, const Val*
 
         EMIT1(e, mod_rx_rm(mod, rx, needs_index ? RSP : base));
         if (needs_index) {
-            EMIT1(e, mod_rx_rm(scale, (base & 7) == RSP ? RSP : index, base));
+            EMIT1(e, mod_rx_rm(scale, index != GPR_NONE ? index : RSP, base));
         }
 
         if (mod == MOD_INDIRECT_DISP8) {
@@ -146,7 +146,7 @@ static void inst2(TB_CGEmitter* restrict e, InstType type, const Val* a, const V
     }
 
     bool dir = b->type == VAL_MEM || b->type == VAL_GLOBAL;
-    if (dir || inst->op == 0x63 || inst->op == 0x69 || inst->op == 0x6E || (type >= CMOVO && type <= CMOVG) || inst->op == 0xAF || inst->cat == INST_BINOP_EXT2) {
+    if (dir || inst->op == 0x63 || inst->op == 0x69 || inst->op == 0x6E || (type >= CMOVO && type <= TZCNT) || inst->op == 0xAF || inst->cat == INST_BINOP_EXT2) {
         SWAP(const Val*, a, b);
     }
 
@@ -161,6 +161,12 @@ static void inst2(TB_CGEmitter* restrict e, InstType type, const Val* a, const V
     bool is_gpr_only_dst = (inst->op & 1);
     bool dir_flag = (dir != is_gpr_only_dst) && inst->op != 0x69;
 
+    // the 0F ops don't follow the size & direction bit patterns (cmovne
+    // isn't some flipped cmove)
+    if (inst->cat == INST_BINOP_EXT || inst->cat == INST_BINOP_EXT2) {
+        dir_flag = false;
+    }
+
     if (inst->cat != INST_BINOP_EXT3) {
         // Address size prefix
         if (dt == TB_X86_TYPE_WORD && inst->cat != INST_BINOP_EXT2) {
@@ -172,6 +178,10 @@ static void inst2(TB_CGEmitter* restrict e, InstType type, const Val* a, const V
         EMIT1(e, 0x66);
     }
 
+    if (type >= POPCNT && type <= TZCNT) {
+        EMIT1(e, 0xF3);
+    }
+
     // REX PREFIX
     //  0 1 0 0 W R X B
     //          ^ ^ ^ ^
@@ -259,6 +269,32 @@ static void inst2(TB_CGEmitter* restrict e, InstType type, const Val* a, const V
     }
 }
 
+// dst <- op(src, src2) where src2 goes into VEX.vvvv, only the BMI2 shifts use this
+static void inst3_vex(TB_CGEmitter* restrict e, InstType type, const Val* dst, const Val* src, const Val* src2, TB_X86_DataType dt) {
+    assert(type < COUNTOF(inst_table));
+    const InstDesc* restrict inst = &inst_table[type];
+    assert(dst->type == VAL_GPR && src2->type == VAL_GPR);
+
+    uint8_t base = 0, index = 0;
+    if (src->type == VAL_GPR || src->type == VAL_MEM) {
+        base = src->reg;
+    }
+
+    if (src->type == VAL_MEM && src->index != GPR_NONE) {
+        index = src->index;
+    }
+
+    // 3 byte VEX
+    //   C4 [R X B m-mmmm] [W vvvv L pp]
+    //
+    // R, X, B and vvvv are stored inverted, the 0F38 map is m-mmmm=2
+    EMIT1(e, 0xC4);
+    EMIT1(e, ((~dst->reg >> 3) & 1) << 7 | ((~index >> 3) & 1) << 6 | ((~base >> 3) & 1) << 5 | 0x02);
+    EMIT1(e, (dt == TB_X86_TYPE_QWORD ? 0x80 : 0) | ((~src2->reg & 15) << 3) | inst->rx_i);
+    EMIT1(e, inst->op);
+    emit_memory_operand(e, dst->reg, src);
+}
+
 static void inst2sse(TB_CGEmitter* restrict e, InstType type, const Val* a, const Val* b, TB_X86_DataType dt) {
     assert(type < COUNTOF(inst_table));
     const InstDesc* restrict inst = &inst_table[type];
@@ -1,6 +1,8 @@
 #include "tb_test_regressions.inc"
 #include "tb_test_exit_status.inc"
 #include "tb_test_int_arith.inc"
+#include "tb_test_wasm.inc"
+#include "tb_test_aarch64.inc"
 
 #define TEST(proc_)                                        \
 do {                                                       \
@@ -26,11 +28,20 @@ int main(int argc, char **argv) {
 
     TEST(regression_module_arena);
     TEST(regression_link_global);
+    TEST(regression_link_call);
+    TEST(regression_zero_trip_load);
     TEST(exit_status);
 
     // TEST(regression_module_arena);
     // TEST(regression_link_global);
     TEST(exit_status);
+    TEST(wasm_module);
+    TEST(wasm_exec_max);
+    TEST(wasm_exec_loop);
+    TEST(wasm_exec_global);
+    TEST(wasm_exec_call);
+    TEST(wasm_exec_switch);
+    TEST(aarch64_encodings);
 
     /*TEST(i8_add);
     TEST(i8_sub);